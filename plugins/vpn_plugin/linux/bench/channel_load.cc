@@ -0,0 +1,226 @@
+#include <flutter_linux/flutter_linux.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "include/vpn_plugin/vpn_plugin.h"
+#include "test/fake_binary_messenger.h"
+
+// Headless load generator for the plugin's platform channels. Registers the
+// plugin against the fake messenger from the tests, keeps a number of method
+// calls in flight across ivpn_manager, storage_manager, servers_manager and
+// routing_profiles_manager, subscribes to and cancels the state event stream
+// in between, and reports throughput and latency percentiles per method.
+// Needs neither a Flutter engine nor a display.
+//
+//   vpn_plugin_channel_load [--seconds=N] [--inflight=N] [--servers=N]
+//
+// --servers adds that many servers before the run, for storage at scale.
+
+namespace {
+
+struct Options {
+  double seconds = 5;
+  int inflight = 64;
+  int servers = 1000;
+};
+
+struct Method {
+  const char* channel;
+  const char* name;
+  int weight;
+  GBytes* message;
+  std::vector<int64_t> latencies_ns;
+  uint64_t errors;
+};
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--seconds=", 10) == 0) {
+      options->seconds = atof(arg + 10);
+    } else if (strncmp(arg, "--inflight=", 11) == 0) {
+      options->inflight = atoi(arg + 11);
+    } else if (strncmp(arg, "--servers=", 10) == 0) {
+      options->servers = atoi(arg + 10);
+    } else {
+      fprintf(stderr, "usage: %s [--seconds=N] [--inflight=N] [--servers=N]\n", argv[0]);
+      return false;
+    }
+  }
+  return options->seconds > 0 && options->inflight > 0 && options->servers >= 0;
+}
+
+FlValue* ServerArgs(int64_t id, const std::string& ip) {
+  FlValue* args = fl_value_new_map();
+  if (id) fl_value_set_string_take(args, "id", fl_value_new_int(id));
+  fl_value_set_string_take(args, "ipAddress", fl_value_new_string(ip.c_str()));
+  fl_value_set_string_take(args, "domain", fl_value_new_string("vpn.example.com"));
+  fl_value_set_string_take(args, "username", fl_value_new_string("user"));
+  fl_value_set_string_take(args, "password", fl_value_new_string("secret"));
+  fl_value_set_string_take(args, "routingProfileId", fl_value_new_int(1));
+  fl_value_set_string_take(args, "protocol", fl_value_new_int(1));
+  fl_value_set_string_take(args, "dnsServers", fl_value_new_string("8.8.8.8, 8.8.4.4"));
+  return args;
+}
+
+FlValue* IdArgs(int64_t id) {
+  FlValue* args = fl_value_new_map();
+  fl_value_set_string_take(args, "id", fl_value_new_int(id));
+  return args;
+}
+
+std::string Ip(int64_t i) {
+  return "10." + std::to_string(i >> 16 & 255) + "." + std::to_string(i >> 8 & 255) + "." +
+         std::to_string(i & 255);
+}
+
+GBytes* Encode(FlMethodCodec* codec, const char* name, FlValue* args) {
+  g_autoptr(GError) error = NULL;
+  GBytes* message = fl_method_codec_encode_method_call(codec, name, args, &error);
+  if (!message) {
+    fprintf(stderr, "cannot encode %s: %s\n", name, error->message);
+    exit(1);
+  }
+  if (args) fl_value_unref(args);
+  return message;
+}
+
+int64_t Percentile(const std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) return 2;
+
+  FakeBinaryMessenger* messenger = fake_binary_messenger_new();
+  uint64_t events = 0;
+  fake_binary_messenger_set_outgoing(messenger, [&events](const gchar* channel, GBytes*) {
+    if (g_strcmp0(channel, "vpn_plugin_event_channel") == 0) events++;
+  });
+  FakePluginRegistrar* registrar = fake_plugin_registrar_new(messenger);
+  vpn_plugin_register_with_registrar(FL_PLUGIN_REGISTRAR(registrar));
+
+  g_autoptr(FlStandardMethodCodec) standard = fl_standard_method_codec_new();
+  FlMethodCodec* codec = FL_METHOD_CODEC(standard);
+
+  std::string rules;
+  for (int i = 0; i < 100; i++) rules += "host" + std::to_string(i) + ".example.com\n";
+  FlValue* rules_args = IdArgs(2);
+  fl_value_set_string_take(rules_args, "mode", fl_value_new_int(0));
+  fl_value_set_string_take(rules_args, "rules", fl_value_new_string(rules.c_str()));
+  FlValue* name_args = IdArgs(2);
+  fl_value_set_string_take(name_args, "name", fl_value_new_string("Work Profile"));
+  FlValue* mode_args = IdArgs(2);
+  fl_value_set_string_take(mode_args, "mode", fl_value_new_int(1));
+  FlValue* routes_args = fl_value_new_map();
+  fl_value_set_string_take(routes_args, "routes",
+                           fl_value_new_string("192.168.0.0/16,10.0.0.0/8"));
+
+  // Writes leave the storage the size it started at.
+  std::vector<Method> methods = {
+      {"ivpn_manager", "getCurrentState", 4, Encode(codec, "getCurrentState", NULL), {}, 0},
+      {"ivpn_manager", "start", 1, Encode(codec, "start", NULL), {}, 0},
+      {"ivpn_manager", "stop", 1, Encode(codec, "stop", NULL), {}, 0},
+      {"storage_manager", "getAllServers", 2, Encode(codec, "getAllServers", NULL), {}, 0},
+      {"storage_manager", "getAllServersPacked", 2, Encode(codec, "getAllServersPacked", NULL), {}, 0},
+      {"storage_manager", "getRoutingProfiles", 2, Encode(codec, "getRoutingProfiles", NULL), {}, 0},
+      {"storage_manager", "getSelectedServerId", 3, Encode(codec, "getSelectedServerId", NULL), {}, 0},
+      {"storage_manager", "setSelectedServerId", 1, Encode(codec, "setSelectedServerId", IdArgs(1)), {}, 0},
+      {"storage_manager", "getExcludedRoutes", 2, Encode(codec, "getExcludedRoutes", NULL), {}, 0},
+      {"storage_manager", "setExcludedRoutes", 1, Encode(codec, "setExcludedRoutes", routes_args), {}, 0},
+      {"servers_manager", "addNewServer", 1, Encode(codec, "addNewServer", ServerArgs(0, "10.0.0")), {}, 0},
+      {"servers_manager", "setNewServer", 1, Encode(codec, "setNewServer", ServerArgs(1, "192.168.1.100")), {}, 0},
+      {"servers_manager", "removeServer", 1, Encode(codec, "removeServer", IdArgs(-1)), {}, 0},
+      {"routing_profiles_manager", "getAllProfiles", 2, Encode(codec, "getAllProfiles", NULL), {}, 0},
+      {"routing_profiles_manager", "setRules", 1, Encode(codec, "setRules", rules_args), {}, 0},
+      {"routing_profiles_manager", "setProfileName", 1, Encode(codec, "setProfileName", name_args), {}, 0},
+      {"routing_profiles_manager", "setDefaultRoutingMode", 1, Encode(codec, "setDefaultRoutingMode", mode_args), {}, 0},
+      {"vpn_plugin_event_channel", "listen", 1, Encode(codec, "listen", NULL), {}, 0},
+      {"vpn_plugin_event_channel", "cancel", 1, Encode(codec, "cancel", NULL), {}, 0},
+  };
+  std::vector<size_t> schedule;
+  for (size_t i = 0; i < methods.size(); i++) {
+    for (int w = 0; w < methods[i].weight; w++) schedule.push_back(i);
+  }
+
+  // Storage at scale first, outside the measurement.
+  int outstanding = 0;
+  for (int i = 0; i < options.servers; i++) {
+    g_autoptr(GBytes) message = Encode(codec, "addNewServer", ServerArgs(0, Ip(i)));
+    outstanding++;
+    fake_binary_messenger_send(messenger, "servers_manager", message,
+                               [&outstanding](GBytes*) { outstanding--; });
+    while (outstanding > options.inflight) g_main_context_iteration(NULL, TRUE);
+  }
+  while (outstanding > 0) g_main_context_iteration(NULL, TRUE);
+
+  size_t next = 0;
+  uint64_t sent = 0;
+  int64_t start = NowNs();
+  int64_t end = start + static_cast<int64_t>(options.seconds * 1e9);
+  while (NowNs() < end) {
+    while (outstanding < options.inflight) {
+      Method* method = &methods[schedule[next++ % schedule.size()]];
+      int64_t sent_at = NowNs();
+      outstanding++;
+      sent++;
+      fake_binary_messenger_send(
+          messenger, method->channel, method->message,
+          [method, sent_at, codec, &outstanding](GBytes* response) {
+            method->latencies_ns.push_back(NowNs() - sent_at);
+            g_autoptr(GError) error = NULL;
+            g_autoptr(FlMethodResponse) decoded =
+                fl_method_codec_decode_response(codec, response, &error);
+            if (!decoded || !FL_IS_METHOD_SUCCESS_RESPONSE(decoded)) method->errors++;
+            outstanding--;
+          });
+    }
+    g_main_context_iteration(NULL, TRUE);
+  }
+  while (outstanding > 0) g_main_context_iteration(NULL, TRUE);
+  double elapsed = static_cast<double>(NowNs() - start) / 1e9;
+
+  printf("%-26s %-24s %9s %9s %9s %9s %9s %9s %6s\n", "channel", "method", "calls", "calls/s",
+         "p50_us", "p90_us", "p99_us", "max_us", "errors");
+  std::vector<int64_t> all;
+  for (Method& method : methods) {
+    std::vector<int64_t>& l = method.latencies_ns;
+    std::sort(l.begin(), l.end());
+    all.insert(all.end(), l.begin(), l.end());
+    printf("%-26s %-24s %9zu %9.0f %9.1f %9.1f %9.1f %9.1f %6llu\n", method.channel, method.name,
+           l.size(), static_cast<double>(l.size()) / elapsed, Percentile(l, 0.5) / 1e3,
+           Percentile(l, 0.9) / 1e3, Percentile(l, 0.99) / 1e3, l.empty() ? 0 : l.back() / 1e3,
+           static_cast<unsigned long long>(method.errors));
+    g_bytes_unref(method.message);
+  }
+  std::sort(all.begin(), all.end());
+  printf("%-51s %9zu %9.0f %9.1f %9.1f %9.1f %9.1f\n", "all", all.size(),
+         static_cast<double>(all.size()) / elapsed, Percentile(all, 0.5) / 1e3,
+         Percentile(all, 0.9) / 1e3, Percentile(all, 0.99) / 1e3,
+         all.empty() ? 0 : all.back() / 1e3);
+  printf("%llu calls in %.2f s with %d in flight, %llu state events, %d servers stored\n",
+         static_cast<unsigned long long>(sent), elapsed, options.inflight,
+         static_cast<unsigned long long>(events), options.servers + 2);
+
+  g_object_unref(registrar);
+  g_object_unref(messenger);
+  return 0;
+}
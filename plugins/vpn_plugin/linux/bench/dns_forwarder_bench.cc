@@ -0,0 +1,174 @@
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dns_forwarder.h"
+#include "dns_message.h"
+#include "event_loop.h"
+#include "test/dns_test_server.h"
+
+// Benchmarks for the caching DNS forwarder. The in-process case measures the
+// cache path alone; the listener cases send queries over loopback UDP and
+// report per-query latency percentiles for cache hits and for misses that go
+// to a local upstream.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+DnsQuestion Question(const std::string& name) {
+  DnsQuestion question;
+  question.name = name;
+  question.type = kDnsTypeA;
+  question.klass = kDnsClassIn;
+  return question;
+}
+
+double MicrosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+double Percentile(std::vector<double>* samples, double percentile) {
+  if (samples->empty()) return 0;
+  size_t index = std::min(samples->size() - 1,
+                          static_cast<size_t>(percentile / 100 * samples->size()));
+  std::nth_element(samples->begin(), samples->begin() + index, samples->end());
+  return (*samples)[index];
+}
+
+struct ListenerFixture {
+  ListenerFixture() {
+    DnsForwarderOptions options;
+    options.upstreams.push_back(upstream.address());
+    options.cache.capacity = 1 << 20;
+    forwarder = std::make_unique<DnsForwarder>(thread.loop(), options);
+    SocketAddress listen;
+    IpAddress::Parse("127.0.0.1", &listen.ip);
+    ok = forwarder->Start() && forwarder->Listen(listen);
+    thread.Start();
+
+    client = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval tv = {2, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    sockaddr_storage ss;
+    socklen_t len = forwarder->local_address().ToSockaddr(&ss);
+    ok = ok && connect(client, reinterpret_cast<sockaddr*>(&ss), len) == 0;
+  }
+  ~ListenerFixture() {
+    close(client);
+    thread.RunSync([this]() { forwarder.reset(); });
+    thread.Stop();
+  }
+
+  // Sends one query and waits for its answer.
+  bool Exchange(const std::string& query) {
+    if (send(client, query.data(), query.size(), 0) != static_cast<ssize_t>(query.size())) {
+      return false;
+    }
+    char buffer[1500];
+    return recv(client, buffer, sizeof(buffer), 0) > 0;
+  }
+
+  test::DnsTestServer upstream;
+  LoopThread thread;
+  std::unique_ptr<DnsForwarder> forwarder;
+  int client = -1;
+  bool ok = false;
+};
+
+void ReportLatency(benchmark::State& state, std::vector<double>* samples) {
+  state.counters["qps"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+  state.counters["p50_us"] = Percentile(samples, 50);
+  state.counters["p99_us"] = Percentile(samples, 99);
+}
+
+}  // namespace
+
+// Resolve() on a warm cache, without sockets: parse, lookup, TTL rewrite.
+static void BM_DnsCacheHit(benchmark::State& state) {
+  EventLoop loop;
+  DnsForwarderOptions options;
+  SocketAddress unused;
+  IpAddress::Parse("127.0.0.1", &unused.ip);
+  unused.port = 9;
+  options.upstreams.push_back(unused);
+  DnsForwarder forwarder(&loop, options);
+  std::string query = BuildDnsQuery(1, Question("bench.example.com"));
+  std::string response = query;
+  response[2] = static_cast<char>(0x81);
+  response[3] = static_cast<char>(0x80);
+  response[7] = 1;
+  response += std::string("\xc0\x0c\x00\x01\x00\x01\x00\x00\x0e\x10\x00\x04\x0a\x00\x00\x01", 16);
+  DnsMessage message;
+  DnsMessage::Parse(reinterpret_cast<const uint8_t*>(response.data()), response.size(), &message);
+  forwarder.cache().Insert(DnsCache::Key(message.questions[0]), response, message,
+                           EventLoop::NowMs());
+
+  size_t answered = 0;
+  for (auto _ : state) {
+    forwarder.Resolve(reinterpret_cast<const uint8_t*>(query.data()), query.size(),
+                      [&answered](const std::string& answer) { answered += answer.size(); });
+  }
+  benchmark::DoNotOptimize(answered);
+  state.counters["qps"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_DnsCacheHit);
+
+// One name queried over and over through the UDP listener.
+static void BM_DnsListenerCached(benchmark::State& state) {
+  ListenerFixture f;
+  std::string query = BuildDnsQuery(7, Question("cached.example.com"));
+  if (!f.ok || !f.Exchange(query)) {
+    state.SkipWithError("forwarder setup failed");
+    return;
+  }
+  std::vector<double> samples;
+  for (auto _ : state) {
+    auto start = std::chrono::steady_clock::now();
+    if (!f.Exchange(query)) {
+      state.SkipWithError("query timed out");
+      break;
+    }
+    samples.push_back(MicrosSince(start));
+  }
+  ReportLatency(state, &samples);
+}
+BENCHMARK(BM_DnsListenerCached)->UseRealTime();
+
+// A fresh name every query, so each one goes to the upstream.
+static void BM_DnsListenerMiss(benchmark::State& state) {
+  ListenerFixture f;
+  if (!f.ok) {
+    state.SkipWithError("forwarder setup failed");
+    return;
+  }
+  std::vector<double> samples;
+  uint64_t serial = 0;
+  for (auto _ : state) {
+    std::string query =
+        BuildDnsQuery(7, Question("n" + std::to_string(serial++) + ".example.com"));
+    auto start = std::chrono::steady_clock::now();
+    if (!f.Exchange(query)) {
+      state.SkipWithError("query timed out");
+      break;
+    }
+    samples.push_back(MicrosSince(start));
+  }
+  ReportLatency(state, &samples);
+}
+BENCHMARK(BM_DnsListenerMiss)->UseRealTime();
+
+}  // namespace bench
+}  // namespace vpn_plugin
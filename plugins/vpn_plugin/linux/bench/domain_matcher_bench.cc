@@ -0,0 +1,144 @@
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "domain_matcher.h"
+
+// Matching hostnames against a profile of 100k domain rules, the size of
+// a large blocklist, with and without keyword rules. The hash-set matcher
+// is how RuleSet matched before the automaton: one lookup per dot. The
+// trace is hostnames as a browser resolves them: a few sites take most
+// lookups, names carry service prefixes, and about one in ten is under a
+// rule.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+constexpr int kRules = 100000;
+constexpr int kTrace = 1 << 16;
+
+const char* const kTlds[] = {"com", "net", "org", "io", "de", "ru", "co.uk", "app"};
+const char* const kPrefixes[] = {"", "www.", "api.", "cdn.", "static.", "img.", "m.", "edge-7."};
+
+std::string Site(uint32_t i) {
+  return "site" + std::to_string(i * 2654435761u % 1000003) + "." + kTlds[i % 8];
+}
+
+// Rules for sites 0..kRules: mostly subdomain rules, some exact names,
+// and with |keywords| one in fifty a keyword.
+std::vector<std::string> Rules(bool keywords) {
+  std::vector<std::string> rules;
+  for (uint32_t i = 0; i < kRules; i++) {
+    if (keywords && i % 50 == 0) {
+      rules.push_back("*track" + std::to_string(i) + "*");
+    } else if (i % 4 == 0) {
+      rules.push_back(Site(i));
+    } else {
+      rules.push_back("*." + Site(i));
+    }
+  }
+  return rules;
+}
+
+// Site popularity follows a Zipf law over ten times as many sites as
+// there are rules; the first tenth of them have rules.
+std::vector<std::string> Trace() {
+  std::mt19937 rng(11);
+  std::vector<double> weights;
+  for (int i = 1; i <= 10 * kRules; i++) weights.push_back(1.0 / std::pow(i, 0.9));
+  std::discrete_distribution<uint32_t> site(weights.begin(), weights.end());
+  std::uniform_int_distribution<int> prefix(0, 7);
+  // Ranks are shuffled over sites, so rules are not simply the popular ones.
+  std::vector<std::string> trace;
+  for (int i = 0; i < kTrace; i++) {
+    uint32_t rank = site(rng);
+    trace.push_back(kPrefixes[prefix(rng)] + Site(rank * 7919u % (10 * kRules)));
+  }
+  return trace;
+}
+
+class HashSetMatcher {
+ public:
+  explicit HashSetMatcher(const std::vector<std::string>& rules) {
+    for (const auto& raw : rules) {
+      std::string rule = NormalizeDomain(raw);
+      if (rule.compare(0, 2, "*.") == 0) {
+        suffixes_.insert(rule.substr(2));
+      } else {
+        exact_.insert(rule.compare(0, 4, "www.") == 0 ? rule.substr(4) : rule);
+      }
+    }
+  }
+
+  bool Matches(const std::string& raw) const {
+    std::string domain = NormalizeDomain(raw);
+    if (exact_.count(domain)) return true;
+    if (domain.compare(0, 4, "www.") == 0 && exact_.count(domain.substr(4))) return true;
+    for (size_t dot = domain.find('.'); dot != std::string::npos; dot = domain.find('.', dot + 1)) {
+      if (suffixes_.count(domain.substr(dot + 1))) return true;
+    }
+    return false;
+  }
+
+ private:
+  std::unordered_set<std::string> exact_;
+  std::unordered_set<std::string> suffixes_;
+};
+
+template <typename Matcher>
+void RunTrace(benchmark::State& state, const Matcher& matcher) {
+  static const std::vector<std::string> trace = Trace();
+  size_t i = 0;
+  uint64_t matched = 0;
+  for (auto _ : state) {
+    matched += matcher.Matches(trace[i]);
+    i = (i + 1) & (kTrace - 1);
+  }
+  state.counters["matched"] =
+      benchmark::Counter(static_cast<double>(matched) / static_cast<double>(state.iterations()));
+}
+
+}  // namespace
+
+static void BM_HashSetMatch(benchmark::State& state) {
+  static const HashSetMatcher matcher(Rules(false));
+  RunTrace(state, matcher);
+}
+BENCHMARK(BM_HashSetMatch);
+
+static void BM_AutomatonMatch(benchmark::State& state) {
+  static const DomainMatcher matcher(Rules(false));
+  RunTrace(state, matcher);
+}
+BENCHMARK(BM_AutomatonMatch);
+
+static void BM_AutomatonMatchWithKeywords(benchmark::State& state) {
+  static const DomainMatcher matcher(Rules(true));
+  RunTrace(state, matcher);
+}
+BENCHMARK(BM_AutomatonMatchWithKeywords);
+
+// Building happens off the connect path, in the policy store's thread.
+static void BM_AutomatonBuild(benchmark::State& state) {
+  std::vector<std::string> rules = Rules(state.range(0) != 0);
+  size_t states = 0;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    DomainMatcher matcher(rules);
+    states = matcher.states();
+    bytes = matcher.memory_usage().bytes;
+  }
+  state.counters["states"] = static_cast<double>(states);
+  state.counters["bytes"] = static_cast<double>(bytes);
+}
+BENCHMARK(BM_AutomatonBuild)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+}  // namespace bench
+}  // namespace vpn_plugin
@@ -0,0 +1,75 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "domain_table.h"
+
+// Lookup cost of the address-to-domain table at the sizes a long session
+// with many CDN-backed sites reaches. Addresses share a few thousand names,
+// as they do in practice.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+constexpr int64_t kNow = 1000 * 1000;
+
+IpAddress AddressFor(uint32_t i) {
+  uint8_t bytes[4] = {static_cast<uint8_t>(i >> 24 | 1), static_cast<uint8_t>(i >> 16),
+                      static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+  return IpAddress::FromV4(bytes);
+}
+
+std::unique_ptr<DomainTable> Filled(size_t entries) {
+  DomainTableOptions options;
+  // Headroom so the buckets rarely overflow.
+  options.capacity = entries * 5 / 4;
+  auto table = std::make_unique<DomainTable>(options);
+  for (uint32_t i = 0; i < entries; i++) {
+    table->Insert(AddressFor(i), "site" + std::to_string(i % 4096) + ".example.com", 3600, kNow);
+  }
+  return table;
+}
+
+}  // namespace
+
+static void BM_DomainTableLookup(benchmark::State& state) {
+  size_t entries = static_cast<size_t>(state.range(0));
+  std::unique_ptr<DomainTable> table = Filled(entries);
+  std::string domain;
+  uint32_t i = 0;
+  uint64_t found = 0;
+  for (auto _ : state) {
+    // Stride through the keys so lookups miss the CPU caches like real ones.
+    i = static_cast<uint32_t>((i + 7919) % entries);
+    found += table->Find(AddressFor(i), kNow, &domain);
+  }
+  state.counters["lookups"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+  state.counters["found_pct"] = 100.0 * found / std::max<int64_t>(1, state.iterations());
+  state.counters["entries"] = static_cast<double>(table->size());
+  state.counters["slot_bytes_per_entry"] =
+      24.0 * table->capacity() / std::max<size_t>(1, table->size());
+}
+BENCHMARK(BM_DomainTableLookup)->Arg(1 << 20)->Arg(4 << 20);
+
+static void BM_DomainTableInsert(benchmark::State& state) {
+  DomainTableOptions options;
+  options.capacity = 1 << 20;
+  DomainTable table(options);
+  uint32_t i = 0;
+  for (auto _ : state) {
+    table.Insert(AddressFor(i), "site" + std::to_string(i % 4096) + ".example.com", 3600, kNow);
+    i++;
+  }
+  state.counters["inserts"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_DomainTableInsert);
+
+}  // namespace bench
+}  // namespace vpn_plugin
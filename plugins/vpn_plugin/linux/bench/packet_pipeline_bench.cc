@@ -0,0 +1,111 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packet_pipeline.h"
+#include "pcap_file.h"
+#include "routing_policy.h"
+#include "test/packet_builder.h"
+
+// Replays a capture through the packet pipeline, one pipeline per benchmark
+// thread, and reports packets/sec per core. Set VPN_PLUGIN_PCAP to a pcap
+// file (raw IP, Ethernet, Linux cooked or loopback) to replay real traffic;
+// otherwise a synthetic mix of TCP and UDP flows is used.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+PcapCapture SyntheticCapture() {
+  PcapCapture capture;
+  test::PacketSpec spec;
+  for (int i = 0; i < 16384; i++) {
+    int flow = i % 4096;
+    spec.dst = std::to_string(20 + flow % 200) + "." + std::to_string(flow / 200) + ".0." +
+               std::to_string(1 + flow % 250);
+    spec.src_port = static_cast<uint16_t>(30000 + flow);
+    spec.protocol = flow % 4 == 0 ? kIpProtoUdp : kIpProtoTcp;
+    spec.dst_port = spec.protocol == kIpProtoUdp ? 443 : 80;
+    spec.payload = (i % 3 == 0) ? 1200 : 64;
+    auto packet = test::BuildPacket(spec);
+    capture.Add(packet.data(), packet.size());
+  }
+  return capture;
+}
+
+const PcapCapture& Capture() {
+  static PcapCapture* capture = []() {
+    auto* out = new PcapCapture();
+    const char* path = getenv("VPN_PLUGIN_PCAP");
+    std::string error;
+    if (path && !PcapCapture::Load(path, out, &error)) {
+      fprintf(stderr, "%s; using synthetic traffic\n", error.c_str());
+      *out = SyntheticCapture();
+    } else if (!path) {
+      *out = SyntheticCapture();
+    }
+    return out;
+  }();
+  return *capture;
+}
+
+PacketPipelineOptions BenchOptions() {
+  PacketPipelineOptions options;
+  // Mirrors the seeded "Work" profile plus the default excluded routes.
+  options.policy = std::make_shared<RoutingPolicy>(
+      RoutingMode::kBypass, std::vector<std::string>{"company.com", "*.internal"},
+      std::vector<std::string>{"social.com", "*.entertainment", "20.0.0.0/8", "100.0.0.0/8"},
+      std::vector<std::string>{"192.168.0.0/16", "10.0.0.0/8"});
+  options.included_routes.resize(2);
+  IpNetwork::Parse("0.0.0.0/0", &options.included_routes[0]);
+  IpNetwork::Parse("2000::/3", &options.included_routes[1]);
+  options.mtu = 1500;
+  return options;
+}
+
+}  // namespace
+
+static void BM_PacketPipelineReplay(benchmark::State& state) {
+  const PcapCapture& capture = Capture();
+  if (capture.empty()) {
+    state.SkipWithError("capture has no IP packets");
+    return;
+  }
+  std::vector<iovec> packets = capture.packets();
+  size_t batch = static_cast<size_t>(state.range(0));
+  std::vector<PacketVerdict> verdicts(batch);
+  PacketPipeline pipeline(BenchOptions());
+  size_t next = 0;
+  int64_t processed = 0;
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    size_t n = std::min(batch, packets.size() - next);
+    pipeline.Process(&packets[next], n, verdicts.data());
+    benchmark::DoNotOptimize(verdicts.data());
+    for (size_t i = 0; i < n; i++) bytes += packets[next + i].iov_len;
+    processed += n;
+    next += n;
+    if (next == packets.size()) next = 0;
+  }
+  state.SetItemsProcessed(processed);
+  state.SetBytesProcessed(bytes);
+  state.counters["packets_per_core"] = benchmark::Counter(
+      static_cast<double>(processed), benchmark::Counter::kIsRate | benchmark::Counter::kAvgThreads);
+  state.counters["flows"] = static_cast<double>(pipeline.flow_count());
+}
+BENCHMARK(BM_PacketPipelineReplay)
+    ->Arg(1)
+    ->Arg(32)
+    ->Arg(64)
+    ->ThreadRange(1, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())))
+    ->UseRealTime();
+
+}  // namespace bench
+}  // namespace vpn_plugin
@@ -0,0 +1,66 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "policy_store.h"
+
+// What switching servers costs the connect path: building the policy from
+// a profile's rules, against taking the one the store has built already.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+// A profile with |rules| rules, a mix of domains, wildcards and networks.
+PolicyInputs Profile(int64_t rules) {
+  PolicyInputs inputs;
+  inputs.default_mode = RoutingMode::kVpn;
+  for (int64_t i = 0; i < rules; i++) {
+    switch (i % 4) {
+      case 0: inputs.bypass_rules.push_back("site" + std::to_string(i) + ".example.com"); break;
+      case 1: inputs.bypass_rules.push_back("*.cdn" + std::to_string(i) + ".example.net"); break;
+      case 2:
+        inputs.bypass_rules.push_back("10." + std::to_string(i / 256 % 256) + "." +
+                                      std::to_string(i % 256) + ".0/24");
+        break;
+      default: inputs.bypass_rules.push_back("company" + std::to_string(i) + ".com"); break;
+    }
+  }
+  inputs.excluded_routes = {"192.168.0.0/16", "10.0.0.0/8"};
+  return inputs;
+}
+
+}  // namespace
+
+static void BM_BuildPolicy(benchmark::State& state) {
+  PolicyInputs inputs = Profile(state.range(0));
+  for (auto _ : state) {
+    RoutingPolicy policy(inputs.default_mode, inputs.bypass_rules, inputs.vpn_rules,
+                         inputs.excluded_routes);
+    benchmark::DoNotOptimize(&policy);
+  }
+}
+BENCHMARK(BM_BuildPolicy)->Arg(10)->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// Alternates between two servers, as setSelectedServerId does.
+static void BM_SwitchServer(benchmark::State& state) {
+  PolicyStore store;
+  store.Set(1, Profile(state.range(0)));
+  store.Set(2, Profile(state.range(0) / 2));
+  store.Flush();
+  int64_t server = 1;
+  for (auto _ : state) {
+    std::shared_ptr<const RoutingPolicy> policy = store.Get(server);
+    benchmark::DoNotOptimize(policy.get());
+    server = 3 - server;
+  }
+  state.counters["inline_builds"] = static_cast<double>(store.inline_builds());
+}
+BENCHMARK(BM_SwitchServer)->Arg(10)->Arg(1000)->Arg(100000);
+
+}  // namespace bench
+}  // namespace vpn_plugin
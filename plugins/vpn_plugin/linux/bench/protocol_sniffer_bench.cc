@@ -0,0 +1,63 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <string>
+
+#include "protocol_sniffer.h"
+#include "test/client_hello_builder.h"
+
+// Cost of reading the domain out of the first bytes of a flow, which every
+// sniffed connection pays before its route is chosen.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+void RunSniffer(benchmark::State& state,
+                SniffResult (*sniffer)(const uint8_t*, size_t, std::string*),
+                const std::string& data) {
+  const auto* bytes = reinterpret_cast<const uint8_t*>(data.data());
+  std::string name;
+  for (auto _ : state) {
+    SniffResult result = sniffer(bytes, data.size(), &name);
+    benchmark::DoNotOptimize(result);
+    if (result != SniffResult::kFound) state.SkipWithError("name not found");
+  }
+  state.counters["hellos"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+  state.counters["bytes"] = static_cast<double>(data.size());
+}
+
+}  // namespace
+
+static void BM_SniffTlsClientHello(benchmark::State& state) {
+  RunSniffer(state, SniffTlsServerName, test::BuildTlsClientHello("www.example.com"));
+}
+BENCHMARK(BM_SniffTlsClientHello);
+
+// The same hello cut into many small records, the worst case for the
+// record walk.
+static void BM_SniffTlsClientHelloSplit(benchmark::State& state) {
+  RunSniffer(state, SniffTlsServerName,
+             test::SplitTlsRecords(test::BuildTlsClientHello("www.example.com"), 16));
+}
+BENCHMARK(BM_SniffTlsClientHelloSplit);
+
+static void BM_SniffHttpHost(benchmark::State& state) {
+  RunSniffer(state, SniffHttpHost,
+             "GET /assets/app.js HTTP/1.1\r\nUser-Agent: Mozilla/5.0\r\nAccept: */*\r\n"
+             "Accept-Encoding: gzip\r\nHost: www.example.com\r\n\r\n");
+}
+BENCHMARK(BM_SniffHttpHost);
+
+// Includes key derivation and the AEAD open of a full-size Initial.
+static void BM_SniffQuicInitial(benchmark::State& state) {
+  test::QuicInitialSpec spec;
+  spec.crypto.emplace_back(0, test::BuildTlsClientHello("www.example.com").substr(5));
+  RunSniffer(state, SniffQuicServerName, test::BuildQuicInitial(spec));
+}
+BENCHMARK(BM_SniffQuicInitial);
+
+}  // namespace bench
+}  // namespace vpn_plugin
@@ -0,0 +1,277 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "record_codec.h"
+
+// Encode plus decode cost and message size of the server list reply, as
+// one map per server with string keys (what getAllServers sends through
+// the standard method codec) against the packed positional encoding of
+// getAllServersPacked. The map path is modelled without Flutter: a value
+// tree is built like the FlValue one and serialized with the standard
+// codec's wire format, and decoding rebuilds the tree like the Dart side.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+struct Server {
+  int64_t id;
+  std::string ip_address;
+  std::string domain;
+  std::string login;
+  std::string password;
+  std::vector<std::string> dns_servers;
+  int64_t vpn_protocol;
+  int64_t routing_profile_id;
+};
+
+std::vector<Server> Servers(size_t count) {
+  std::vector<Server> servers(count);
+  for (size_t i = 0; i < count; i++) {
+    Server& s = servers[i];
+    s.id = static_cast<int64_t>(i + 1);
+    s.ip_address = "10." + std::to_string(i >> 16 & 255) + "." + std::to_string(i >> 8 & 255) +
+                   "." + std::to_string(i & 255);
+    s.domain = "vpn" + std::to_string(i) + ".example.com";
+    s.login = "user" + std::to_string(i % 50);
+    s.password = "password" + std::to_string(i);
+    s.dns_servers = {"8.8.8.8", "8.8.4.4"};
+    s.vpn_protocol = static_cast<int64_t>(i & 1);
+    s.routing_profile_id = static_cast<int64_t>(i % 4 + 1);
+  }
+  return servers;
+}
+
+// Minimal model of an FlValue tree.
+struct Value {
+  enum Type { kInt, kString, kList, kMap } type;
+  int64_t number = 0;
+  std::string text;
+  std::vector<std::unique_ptr<Value>> items;
+  std::vector<std::pair<std::unique_ptr<Value>, std::unique_ptr<Value>>> entries;
+
+  static std::unique_ptr<Value> Int(int64_t v) {
+    auto value = std::make_unique<Value>(Value{kInt});
+    value->number = v;
+    return value;
+  }
+  static std::unique_ptr<Value> String(std::string_view v) {
+    auto value = std::make_unique<Value>(Value{kString});
+    value->text.assign(v.data(), v.size());
+    return value;
+  }
+  void Set(const char* key, std::unique_ptr<Value> value) {
+    entries.emplace_back(String(key), std::move(value));
+  }
+};
+
+// The standard message codec's wire format.
+void WriteSize(std::string* out, size_t size) {
+  if (size < 254) {
+    out->push_back(static_cast<char>(size));
+  } else if (size <= 0xffff) {
+    out->push_back(static_cast<char>(254));
+    uint16_t v = static_cast<uint16_t>(size);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+  } else {
+    out->push_back(static_cast<char>(255));
+    uint32_t v = static_cast<uint32_t>(size);
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+}
+
+void Write(std::string* out, const Value& value) {
+  switch (value.type) {
+    case Value::kInt:
+      if (value.number >= INT32_MIN && value.number <= INT32_MAX) {
+        out->push_back(3);
+        int32_t v = static_cast<int32_t>(value.number);
+        out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+      } else {
+        out->push_back(4);
+        out->append(reinterpret_cast<const char*>(&value.number), sizeof(value.number));
+      }
+      break;
+    case Value::kString:
+      out->push_back(7);
+      WriteSize(out, value.text.size());
+      out->append(value.text);
+      break;
+    case Value::kList:
+      out->push_back(12);
+      WriteSize(out, value.items.size());
+      for (const auto& item : value.items) Write(out, *item);
+      break;
+    case Value::kMap:
+      out->push_back(13);
+      WriteSize(out, value.entries.size());
+      for (const auto& entry : value.entries) {
+        Write(out, *entry.first);
+        Write(out, *entry.second);
+      }
+      break;
+  }
+}
+
+size_t ReadSize(const std::string& in, size_t* offset) {
+  uint8_t first = static_cast<uint8_t>(in[(*offset)++]);
+  if (first < 254) return first;
+  if (first == 254) {
+    uint16_t v;
+    memcpy(&v, in.data() + *offset, sizeof(v));
+    *offset += sizeof(v);
+    return v;
+  }
+  uint32_t v;
+  memcpy(&v, in.data() + *offset, sizeof(v));
+  *offset += sizeof(v);
+  return v;
+}
+
+std::unique_ptr<Value> Read(const std::string& in, size_t* offset) {
+  uint8_t type = static_cast<uint8_t>(in[(*offset)++]);
+  switch (type) {
+    case 3: {
+      int32_t v;
+      memcpy(&v, in.data() + *offset, sizeof(v));
+      *offset += sizeof(v);
+      return Value::Int(v);
+    }
+    case 4: {
+      int64_t v;
+      memcpy(&v, in.data() + *offset, sizeof(v));
+      *offset += sizeof(v);
+      return Value::Int(v);
+    }
+    case 7: {
+      size_t size = ReadSize(in, offset);
+      auto value = Value::String(std::string_view(in.data() + *offset, size));
+      *offset += size;
+      return value;
+    }
+    case 12: {
+      auto value = std::make_unique<Value>(Value{Value::kList});
+      size_t size = ReadSize(in, offset);
+      for (size_t i = 0; i < size; i++) value->items.push_back(Read(in, offset));
+      return value;
+    }
+    default: {
+      auto value = std::make_unique<Value>(Value{Value::kMap});
+      size_t size = ReadSize(in, offset);
+      for (size_t i = 0; i < size; i++) {
+        auto key = Read(in, offset);
+        value->entries.emplace_back(std::move(key), Read(in, offset));
+      }
+      return value;
+    }
+  }
+}
+
+void EncodeMaps(const std::vector<Server>& servers, std::string* out) {
+  Value list{Value::kList};
+  for (const auto& s : servers) {
+    auto m = std::make_unique<Value>(Value{Value::kMap});
+    m->Set("id", Value::Int(s.id));
+    m->Set("ipAddress", Value::String(s.ip_address));
+    m->Set("domain", Value::String(s.domain));
+    m->Set("login", Value::String(s.login));
+    m->Set("password", Value::String(s.password));
+    auto dns = std::make_unique<Value>(Value{Value::kList});
+    for (const auto& d : s.dns_servers) dns->items.push_back(Value::String(d));
+    m->Set("dnsServers", std::move(dns));
+    m->Set("vpnProtocol", Value::Int(s.vpn_protocol));
+    m->Set("routingProfileId", Value::Int(s.routing_profile_id));
+    list.items.push_back(std::move(m));
+  }
+  out->clear();
+  Write(out, list);
+}
+
+void EncodePacked(const std::vector<Server>& servers, RecordWriter* writer) {
+  std::vector<const char*> dns;
+  writer->Reset(8);
+  for (const auto& s : servers) {
+    writer->AddInt(s.id);
+    writer->AddString(s.ip_address);
+    writer->AddString(s.domain);
+    writer->AddString(s.login);
+    writer->AddString(s.password);
+    dns.clear();
+    for (const auto& d : s.dns_servers) dns.push_back(d.c_str());
+    writer->AddStringList(dns.data(), dns.size());
+    writer->AddInt(s.vpn_protocol);
+    writer->AddInt(s.routing_profile_id);
+    writer->EndRecord();
+  }
+}
+
+// Decodes into Server records, copying every string as the Dart side
+// would create its own.
+bool DecodePacked(const std::string& message, std::vector<Server>* out) {
+  RecordReader reader;
+  if (!reader.Open(reinterpret_cast<const uint8_t*>(message.data()), message.size())) {
+    return false;
+  }
+  out->resize(reader.record_count());
+  std::string_view text;
+  std::vector<std::string_view> list;
+  for (Server& s : *out) {
+    bool ok = reader.ReadInt(&s.id) && reader.ReadString(&text);
+    s.ip_address.assign(text.data(), text.size());
+    ok = ok && reader.ReadString(&text);
+    s.domain.assign(text.data(), text.size());
+    ok = ok && reader.ReadString(&text);
+    s.login.assign(text.data(), text.size());
+    ok = ok && reader.ReadString(&text);
+    s.password.assign(text.data(), text.size());
+    ok = ok && reader.ReadStringList(&list);
+    s.dns_servers.assign(list.begin(), list.end());
+    ok = ok && reader.ReadInt(&s.vpn_protocol) && reader.ReadInt(&s.routing_profile_id);
+    if (!ok) return false;
+  }
+  return reader.done();
+}
+
+}  // namespace
+
+static void BM_ServerListMaps(benchmark::State& state) {
+  std::vector<Server> servers = Servers(static_cast<size_t>(state.range(0)));
+  std::string message;
+  for (auto _ : state) {
+    EncodeMaps(servers, &message);
+    size_t offset = 0;
+    std::unique_ptr<Value> decoded = Read(message, &offset);
+    benchmark::DoNotOptimize(decoded.get());
+  }
+  state.counters["bytes"] = static_cast<double>(message.size());
+}
+BENCHMARK(BM_ServerListMaps)->Arg(100)->Arg(5000);
+
+static void BM_ServerListPacked(benchmark::State& state) {
+  std::vector<Server> servers = Servers(static_cast<size_t>(state.range(0)));
+  RecordWriter writer;
+  std::vector<Server> decoded;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    EncodePacked(servers, &writer);
+    const std::string& message = writer.Finish();
+    bytes = message.size();
+    if (!DecodePacked(message, &decoded)) {
+      state.SkipWithError("decode failed");
+      break;
+    }
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+}
+BENCHMARK(BM_ServerListPacked)->Arg(100)->Arg(5000);
+
+}  // namespace bench
+}  // namespace vpn_plugin
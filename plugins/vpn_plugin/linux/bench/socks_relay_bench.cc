@@ -0,0 +1,234 @@
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "socks_server.h"
+
+// Loopback benchmarks for the SOCKS5 listener. A sink server discards
+// everything it receives; the client tunnels through the listener with a
+// bypass decision so the relay path is exercised end to end. Each runs on
+// the epoll loop with the splice() relay (arg 0) and on the io_uring loop
+// with UringRelay (arg 1).
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+class LoopbackSink {
+ public:
+  LoopbackSink() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, SOMAXCONN);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    port_ = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() {
+      while (true) {
+        int c = accept(fd_, nullptr, nullptr);
+        if (c < 0) return;
+        std::thread([c]() {
+          std::string buf(1 << 20, '\0');
+          while (recv(c, &buf[0], buf.size(), 0) > 0) {
+          }
+          close(c);
+        }).detach();
+      }
+    });
+  }
+  ~LoopbackSink() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+  }
+  uint16_t port() const { return port_; }
+
+ private:
+  int fd_;
+  uint16_t port_;
+  std::thread thread_;
+};
+
+struct Fixture {
+  explicit Fixture(EventLoopBackend backend) : thread(backend) {
+    SocksServerOptions options;
+    IpAddress::Parse("127.0.0.1", &options.listen_address.ip);
+    server = std::make_unique<SocksServer>(thread.loop(), options);
+    server->Listen();
+    thread.Start();
+  }
+  ~Fixture() {
+    thread.RunSync([this]() { server.reset(); });
+    thread.Stop();
+  }
+
+  // System calls the listener thread made, as far as it counts them.
+  uint64_t syscalls() const {
+    return thread.loop()->syscalls() + server->stats().relay_syscalls.load();
+  }
+
+  mutable LoopThread thread;
+  std::unique_ptr<SocksServer> server;
+  LoopbackSink sink;
+};
+
+Fixture& SharedFixture(int64_t backend) {
+  static Fixture* fixtures[2] = {};
+  Fixture*& fixture = fixtures[backend ? 1 : 0];
+  if (!fixture) {
+    fixture = new Fixture(backend ? EventLoopBackend::kIoUring : EventLoopBackend::kEpoll);
+  }
+  return *fixture;
+}
+
+bool UsesBackend(benchmark::State& state, Fixture& f) {
+  bool uring = f.thread.loop()->backend() == EventLoopBackend::kIoUring;
+  if (uring != (state.range(0) != 0)) {
+    state.SkipWithError("io_uring unavailable");
+    return false;
+  }
+  return true;
+}
+
+// Connects through the listener to the sink. Returns -1 on failure.
+int OpenTunnel(Fixture& f) {
+  sockaddr_storage ss;
+  socklen_t len = f.server->local_address().ToSockaddr(&ss);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+    close(fd);
+    return -1;
+  }
+  uint16_t port = f.sink.port();
+  const char request[] = {5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1,
+                          static_cast<char>(port >> 8), static_cast<char>(port & 0xff)};
+  send(fd, request, sizeof(request), MSG_NOSIGNAL);
+  char reply[12];
+  size_t got = 0;
+  while (got < sizeof(reply)) {
+    ssize_t n = recv(fd, reply + got, sizeof(reply) - got, 0);
+    if (n <= 0) break;
+    got += n;
+  }
+  if (got != sizeof(reply) || reply[3] != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace
+
+static void BM_SocksRelayThroughput(benchmark::State& state) {
+  Fixture& f = SharedFixture(state.range(0));
+  if (!UsesBackend(state, f)) return;
+  int fd = OpenTunnel(f);
+  if (fd < 0) {
+    state.SkipWithError("tunnel setup failed");
+    return;
+  }
+  std::string chunk(static_cast<size_t>(state.range(1)), 'x');
+  int64_t bytes = 0;
+  uint64_t syscalls = f.syscalls();
+  for (auto _ : state) {
+    ssize_t n = send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL);
+    if (n <= 0) {
+      state.SkipWithError("send failed");
+      break;
+    }
+    bytes += n;
+  }
+  // Lets the relay catch up so its calls are counted against these bytes.
+  shutdown(fd, SHUT_WR);
+  char byte;
+  recv(fd, &byte, 1, 0);
+  syscalls = f.syscalls() - syscalls;
+  close(fd);
+  state.SetBytesProcessed(bytes);
+  state.counters["Gbit"] =
+      benchmark::Counter(static_cast<double>(bytes) * 8 / 1e9, benchmark::Counter::kIsRate);
+  state.counters["syscalls"] =
+      benchmark::Counter(static_cast<double>(syscalls), benchmark::Counter::kIsRate);
+  state.counters["KiB_per_syscall"] = static_cast<double>(bytes) / 1024 / std::max<uint64_t>(1, syscalls);
+}
+BENCHMARK(BM_SocksRelayThroughput)
+    ->ArgNames({"uring", "chunk"})
+    ->ArgsProduct({{0, 1}, {16 << 10, 256 << 10}})
+    ->UseRealTime();
+
+// Many flows with small writes, where the loop's per-event cost rather than
+// copying dominates.
+static void BM_SocksRelayManyFlows(benchmark::State& state) {
+  Fixture& f = SharedFixture(state.range(0));
+  if (!UsesBackend(state, f)) return;
+  std::vector<int> fds;
+  for (int i = 0; i < state.range(1); i++) {
+    int fd = OpenTunnel(f);
+    if (fd < 0) break;
+    fds.push_back(fd);
+  }
+  if (fds.size() != static_cast<size_t>(state.range(1))) {
+    for (int fd : fds) close(fd);
+    state.SkipWithError("tunnel setup failed");
+    return;
+  }
+  std::string message(1024, 'm');
+  int64_t messages = 0;
+  uint64_t syscalls = f.syscalls();
+  for (auto _ : state) {
+    for (int fd : fds) {
+      if (send(fd, message.data(), message.size(), MSG_NOSIGNAL) > 0) messages++;
+    }
+  }
+  for (int fd : fds) shutdown(fd, SHUT_WR);
+  for (int fd : fds) {
+    char byte;
+    recv(fd, &byte, 1, 0);
+    close(fd);
+  }
+  syscalls = f.syscalls() - syscalls;
+  state.SetBytesProcessed(messages * static_cast<int64_t>(message.size()));
+  state.counters["messages"] =
+      benchmark::Counter(static_cast<double>(messages), benchmark::Counter::kIsRate);
+  state.counters["syscalls_per_message"] =
+      static_cast<double>(syscalls) / std::max<int64_t>(1, messages);
+}
+BENCHMARK(BM_SocksRelayManyFlows)
+    ->ArgNames({"uring", "flows"})
+    ->ArgsProduct({{0, 1}, {64}})
+    ->UseRealTime();
+
+static void BM_SocksConnectRate(benchmark::State& state) {
+  Fixture& f = SharedFixture(state.range(0));
+  if (!UsesBackend(state, f)) return;
+  for (auto _ : state) {
+    int fd = OpenTunnel(f);
+    if (fd < 0) {
+      state.SkipWithError("tunnel setup failed");
+      break;
+    }
+    close(fd);
+  }
+  state.counters["connections"] =
+      benchmark::Counter(static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_SocksConnectRate)->ArgName("uring")->Arg(0)->Arg(1)->UseRealTime();
+
+}  // namespace bench
+}  // namespace vpn_plugin
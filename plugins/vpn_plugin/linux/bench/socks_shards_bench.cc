@@ -0,0 +1,153 @@
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "socks_shards.h"
+
+// Scaling of the sharded SOCKS listener on loopback: a fixed set of client
+// connections streams data through the listener to a sink while the number
+// of shards, one pinned per CPU, grows from 1 to the CPUs available. The
+// clients and the sink run on the same machine, so the curve flattens
+// before the shards run out of work.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+constexpr int kConnections = 16;
+constexpr size_t kChunk = 64 * 1024;
+
+class LoopbackSink {
+ public:
+  LoopbackSink() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, SOMAXCONN);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    port_ = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() {
+      while (true) {
+        int c = accept(fd_, nullptr, nullptr);
+        if (c < 0) return;
+        std::thread([c]() {
+          std::string buf(1 << 20, '\0');
+          while (recv(c, &buf[0], buf.size(), 0) > 0) {
+          }
+          close(c);
+        }).detach();
+      }
+    });
+  }
+  ~LoopbackSink() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+  }
+  uint16_t port() const { return port_; }
+
+ private:
+  int fd_;
+  uint16_t port_;
+  std::thread thread_;
+};
+
+int OpenTunnel(const SocketAddress& proxy, uint16_t port) {
+  sockaddr_storage ss;
+  socklen_t len = proxy.ToSockaddr(&ss);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+    close(fd);
+    return -1;
+  }
+  const char request[] = {5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1, static_cast<char>(port >> 8),
+                          static_cast<char>(port & 0xff)};
+  send(fd, request, sizeof(request), MSG_NOSIGNAL);
+  char reply[12];
+  size_t got = 0;
+  while (got < sizeof(reply)) {
+    ssize_t n = recv(fd, reply + got, sizeof(reply) - got, 0);
+    if (n <= 0) break;
+    got += n;
+  }
+  if (got != sizeof(reply) || reply[3] != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void ShardCounts(benchmark::internal::Benchmark* b) {
+  size_t cpus = AllowedCpus().size();
+  for (size_t shards = 1; shards <= cpus; shards *= 2) b->Arg(static_cast<int64_t>(shards));
+  if ((cpus & (cpus - 1)) != 0) b->Arg(static_cast<int64_t>(cpus));
+}
+
+}  // namespace
+
+static void BM_SocksShardsThroughput(benchmark::State& state) {
+  LoopbackSink sink;
+  SocksShardOptions options;
+  options.shards = static_cast<size_t>(state.range(0));
+  SocksServerOptions server_options;
+  IpAddress::Parse("127.0.0.1", &server_options.listen_address.ip);
+  SocksShardGroup group(options, server_options);
+  if (!group.Start()) {
+    state.SkipWithError("listen failed");
+    return;
+  }
+  std::vector<int> fds;
+  for (int i = 0; i < kConnections; i++) {
+    int fd = OpenTunnel(group.local_address(), sink.port());
+    if (fd < 0) break;
+    fds.push_back(fd);
+  }
+  if (fds.size() != kConnections) {
+    for (int fd : fds) close(fd);
+    state.SkipWithError("tunnel setup failed");
+    return;
+  }
+
+  // Each iteration moves 1 MiB on every connection, from one thread each.
+  std::atomic<int64_t> bytes{0};
+  for (auto _ : state) {
+    std::vector<std::thread> clients;
+    for (int fd : fds) {
+      clients.emplace_back([fd, &bytes]() {
+        std::string chunk(kChunk, 'x');
+        int64_t sent = 0;
+        while (sent < (1 << 20)) {
+          ssize_t n = send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL);
+          if (n <= 0) return;
+          sent += n;
+        }
+        bytes += sent;
+      });
+    }
+    for (auto& client : clients) client.join();
+  }
+  for (int fd : fds) close(fd);
+
+  std::vector<uint64_t> accepted = group.accepted();
+  state.SetBytesProcessed(bytes.load());
+  state.counters["Gbit"] = benchmark::Counter(static_cast<double>(bytes.load()) * 8 / 1e9,
+                                              benchmark::Counter::kIsRate);
+  state.counters["busiest_shard_pct"] =
+      100.0 * *std::max_element(accepted.begin(), accepted.end()) / kConnections;
+}
+BENCHMARK(BM_SocksShardsThroughput)->ArgName("shards")->Apply(ShardCounts)->UseRealTime();
+
+}  // namespace bench
+}  // namespace vpn_plugin
@@ -0,0 +1,73 @@
+#!/bin/bash
+# Startup time of the Linux app on a headless X server. Each run starts the
+# bundle under xvfb-run and reads the milestones the plugin logs with
+# G_MESSAGES_DEBUG set, in milliseconds from process start:
+#   plugin registered  registration returned, storage still loading
+#   first frame        Flutter drew its first frame into the view
+#   plugin ready       storage loaded, queued method calls start to run
+# Then it prints the median, minimum and maximum of each.
+#
+# usage: startup.sh [binary] [runs]
+#   binary  defaults to build/linux/x64/release/bundle/vpn
+#   runs    defaults to 10
+# With DROP_CACHES=1 the page cache is dropped before every run (needs
+# sudo), so that runs are cold starts rather than warm ones.
+
+set -eu
+
+binary="${1:-build/linux/x64/release/bundle/vpn}"
+runs="${2:-10}"
+timeout_s=30
+
+if [[ ! -x "$binary" ]]; then
+  echo "No executable at $binary; build with: flutter build linux --release" >&2
+  exit 1
+fi
+if ! command -v xvfb-run >/dev/null; then
+  echo "xvfb-run not found (package xvfb)" >&2
+  exit 1
+fi
+
+results=$(mktemp)
+log=$(mktemp)
+trap 'rm -f "$results" "$log"' EXIT
+
+for ((run = 1; run <= runs; run++)); do
+  if [[ "${DROP_CACHES:-0}" == 1 ]]; then
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+  fi
+  : >"$log"
+  # A session of its own, so that the app, Xvfb and xvfb-run go together.
+  G_MESSAGES_DEBUG=all setsid xvfb-run -a "$binary" >"$log" 2>&1 &
+  pid=$!
+  for ((tick = 0; tick < timeout_s * 10; tick++)); do
+    if grep -q "startup: first frame" "$log" && grep -q "startup: plugin ready" "$log"; then
+      break
+    fi
+    sleep 0.1
+  done
+  kill -TERM -- "-$pid" 2>/dev/null || true
+  wait "$pid" 2>/dev/null || true
+  if ! grep -q "startup: plugin ready" "$log"; then
+    echo "run $run: no startup milestones within ${timeout_s}s; last output:" >&2
+    tail -n 20 "$log" >&2
+    exit 1
+  fi
+  sed -n 's/.*vpn_plugin: startup: \([a-z ]*\) \([0-9]*\) ms.*/\1\t\2/p' "$log" >>"$results"
+  echo "run $run: $(sed -n 's/.*vpn_plugin: startup: \([a-z ]*\) \([0-9]*\) ms.*/\1 \2/p' "$log" |
+    paste -sd, - | sed 's/,/, /g') ms"
+done
+
+echo
+printf '%-20s %8s %8s %8s %5s\n' stage median min max runs
+for stage in "plugin registered" "first frame" "plugin ready"; do
+  awk -F'\t' -v stage="$stage" '$1 == stage { print $2 }' "$results" | sort -n |
+    awk -v stage="$stage" '
+      { v[NR] = $1 }
+      END {
+        if (NR == 0) { printf "%-20s %8s\n", stage, "-"; exit }
+        median = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+        printf "%-20s %8d %8d %8d %5d\n", stage, median, v[1], v[NR], NR
+      }'
+done
@@ -0,0 +1,65 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "trace.h"
+
+// Cost of a span on the recording thread with tracing off and on, and of
+// dumping full buffers in either format.
+
+namespace vpn_plugin {
+namespace bench {
+
+static void BM_SpanDisabled(benchmark::State& state) {
+  Tracer::Disable();
+  for (auto _ : state) {
+    TraceSpan span("bench.span");
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_SpanDisabled);
+
+static void BM_SpanEnabled(benchmark::State& state) {
+  Tracer::Enable();
+  for (auto _ : state) {
+    TraceSpan span("bench.span");
+    benchmark::ClobberMemory();
+  }
+  Tracer::Disable();
+  Tracer::Clear();
+}
+BENCHMARK(BM_SpanEnabled);
+
+static void BM_Instant(benchmark::State& state) {
+  Tracer::Enable();
+  int64_t i = 0;
+  for (auto _ : state) Tracer::Instant("bench.instant", i++);
+  Tracer::Disable();
+  Tracer::Clear();
+}
+BENCHMARK(BM_Instant);
+
+// Dumps one thread's full buffer of nested spans.
+static void BM_Dump(benchmark::State& state) {
+  Tracer::Enable();
+  Tracer::Clear();
+  for (size_t i = 0; i < Tracer::kDefaultEventsPerThread / 2; i++) {
+    TraceSpan outer("bench.outer");
+    TraceSpan inner("bench.inner");
+  }
+  Tracer::Disable();
+  TraceFormat format = state.range(0) ? TraceFormat::kPerfetto : TraceFormat::kChromeJson;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    std::string trace = Tracer::Dump(format);
+    bytes = trace.size();
+    benchmark::DoNotOptimize(trace.data());
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+  state.SetItemsProcessed(state.iterations() * Tracer::kDefaultEventsPerThread);
+  Tracer::Clear();
+}
+BENCHMARK(BM_Dump)->ArgName("perfetto")->Arg(0)->Arg(1);
+
+}  // namespace bench
+}  // namespace vpn_plugin
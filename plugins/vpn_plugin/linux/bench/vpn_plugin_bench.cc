@@ -0,0 +1,132 @@
+#include <benchmark/benchmark.h>
+#include <flutter_linux/flutter_linux.h>
+
+#include <string>
+#include <vector>
+
+#include "include/vpn_plugin/vpn_plugin.h"
+#include "vpn_plugin_private.h"
+
+// The plugin's own method handlers, called directly on the benchmark
+// thread: address validation and list splitting on their own, server
+// add/replace/remove and rule replacement with growing storage, and
+// building the list replies as FlValue trees (and packed, to compare).
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+FlValue* ServerArgs(int64_t id, const std::string& ip) {
+  FlValue* args = fl_value_new_map();
+  if (id) fl_value_set_string_take(args, "id", fl_value_new_int(id));
+  fl_value_set_string_take(args, "ipAddress", fl_value_new_string(ip.c_str()));
+  fl_value_set_string_take(args, "domain", fl_value_new_string("vpn.example.com"));
+  fl_value_set_string_take(args, "username", fl_value_new_string("user"));
+  fl_value_set_string_take(args, "password", fl_value_new_string("secret"));
+  fl_value_set_string_take(args, "routingProfileId", fl_value_new_int(1));
+  fl_value_set_string_take(args, "protocol", fl_value_new_int(1));
+  fl_value_set_string_take(args, "dnsServers", fl_value_new_string("8.8.8.8, 8.8.4.4"));
+  return args;
+}
+
+std::string Ip(int64_t i) {
+  return "10." + std::to_string(i >> 16 & 255) + "." + std::to_string(i >> 8 & 255) + "." +
+         std::to_string(i & 255);
+}
+
+void Call(VpnPlugin* plugin, const gchar* channel, const gchar* method, FlValue* args) {
+  FlMethodResponse* response = vpn_plugin_handle_method_call(plugin, channel, method, args);
+  benchmark::DoNotOptimize(response);
+  g_object_unref(response);
+}
+
+// Fills the storage up to |count| servers.
+void AddServers(VpnPlugin* plugin, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    FlValue* args = ServerArgs(0, Ip(i));
+    Call(plugin, "servers_manager", "addNewServer", args);
+    fl_value_unref(args);
+  }
+}
+
+}  // namespace
+
+static void BM_IsValidIpv4(benchmark::State& state) {
+  const char* inputs[] = {"192.168.1.100", "10.0.0.1", "256.0.0.1", "1.2.3", "vpn.example.com"};
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(is_valid_ipv4(inputs[i++ % G_N_ELEMENTS(inputs)]));
+  }
+}
+BENCHMARK(BM_IsValidIpv4);
+
+static void BM_SplitCsv(benchmark::State& state) {
+  std::string csv;
+  for (int64_t i = 0; i < state.range(0); i++) csv += " " + Ip(i) + " ,";
+  for (auto _ : state) {
+    GPtrArray* parts = string_split_csv(csv.c_str(), ",");
+    benchmark::DoNotOptimize(parts->len);
+    string_array_free(parts);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SplitCsv)->Arg(2)->Arg(1000);
+
+// One add, replace and remove of a server while |range| others are stored.
+static void BM_ServerAddSetRemove(benchmark::State& state) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  AddServers(plugin, state.range(0));
+  // Ids are one past the highest, and the two mock servers come first.
+  int64_t id = state.range(0) + 3;
+  FlValue* add = ServerArgs(0, "10.255.0.1");
+  FlValue* set = ServerArgs(id, "10.255.0.2");
+  FlValue* remove = fl_value_new_map();
+  fl_value_set_string_take(remove, "id", fl_value_new_int(id));
+  for (auto _ : state) {
+    Call(plugin, "servers_manager", "addNewServer", add);
+    Call(plugin, "servers_manager", "setNewServer", set);
+    Call(plugin, "servers_manager", "removeServer", remove);
+  }
+  fl_value_unref(remove);
+  fl_value_unref(set);
+  fl_value_unref(add);
+  g_object_unref(plugin);
+}
+BENCHMARK(BM_ServerAddSetRemove)->Arg(10)->Arg(1000);
+
+// Replaces a profile's rules with a list of |range| lines.
+static void BM_SetRules(benchmark::State& state) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  std::string rules;
+  for (int64_t i = 0; i < state.range(0); i++) rules += "host" + std::to_string(i) + ".example.com\n";
+  FlValue* args = fl_value_new_map();
+  fl_value_set_string_take(args, "id", fl_value_new_int(1));
+  fl_value_set_string_take(args, "mode", fl_value_new_int(1));
+  fl_value_set_string_take(args, "rules", fl_value_new_string(rules.c_str()));
+  for (auto _ : state) Call(plugin, "routing_profiles_manager", "setRules", args);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  fl_value_unref(args);
+  g_object_unref(plugin);
+}
+BENCHMARK(BM_SetRules)->Arg(10)->Arg(10000);
+
+// Builds the server list reply with |range| servers stored.
+static void BM_ServerListReply(benchmark::State& state) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  AddServers(plugin, state.range(0));
+  for (auto _ : state) Call(plugin, "storage_manager", "getAllServers", NULL);
+  g_object_unref(plugin);
+}
+BENCHMARK(BM_ServerListReply)->Arg(100)->Arg(5000);
+
+static void BM_ServerListReplyPacked(benchmark::State& state) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  AddServers(plugin, state.range(0));
+  for (auto _ : state) Call(plugin, "storage_manager", "getAllServersPacked", NULL);
+  g_object_unref(plugin);
+}
+BENCHMARK(BM_ServerListReplyPacked)->Arg(100)->Arg(5000);
+
+}  // namespace bench
+}  // namespace vpn_plugin
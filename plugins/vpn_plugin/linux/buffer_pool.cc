@@ -0,0 +1,286 @@
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+namespace vpn_plugin {
+
+namespace {
+
+// Room for an IP/UDP or HTTP/2 frame header in front of a packet.
+constexpr size_t kPacketHeadroom = 128;
+constexpr size_t kAlignment = 64;
+
+size_t RoundUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+std::mutex g_options_mutex;
+BufferPoolOptions g_options;
+// Slabs of every pool, for ProcessMemoryUsage().
+std::atomic<uint64_t> g_slab_count{0};
+std::atomic<uint64_t> g_slab_bytes{0};
+
+}  // namespace
+
+struct BufferPool::SlabHeader {
+  BufferPool* pool;
+  uint32_t size_class;
+};
+
+// Hands the thread's pool over to the remote frees still to come when the
+// thread exits.
+struct ThreadPoolHolder {
+  ~ThreadPoolHolder() {
+    if (pool) pool->Orphan();
+  }
+  BufferPool* pool = nullptr;
+};
+
+namespace {
+thread_local ThreadPoolHolder t_pool;
+}  // namespace
+
+BufferPoolOptions BufferPoolOptions::FromConfig(const ConfigDocument& config) {
+  BufferPoolOptions options;
+  int64_t mtu = config.GetInt("listener.tun", "mtu_size", 1500);
+  if (mtu >= 576 && mtu <= 65535) {
+    options.packet_size = RoundUp(static_cast<size_t>(mtu) + kPacketHeadroom, kAlignment);
+  }
+  return options;
+}
+
+BufferPool::BufferPool(BufferPoolOptions options) : options_(options) {
+  options_.packet_size =
+      std::min(kChunkSize, RoundUp(std::max(options_.packet_size, kAlignment), kAlignment));
+  classes_[0].block_size = options_.packet_size;
+  classes_[1].block_size = kChunkSize;
+}
+
+BufferPool::~BufferPool() {
+  for (const auto& slab : slabs_) munmap(slab.first, slab.second);
+  g_slab_count.fetch_sub(slabs_.size(), std::memory_order_relaxed);
+  g_slab_bytes.fetch_sub(mapped_bytes_, std::memory_order_relaxed);
+}
+
+BufferPool* BufferPool::ForThread() {
+  if (!t_pool.pool) {
+    std::lock_guard<std::mutex> lock(g_options_mutex);
+    t_pool.pool = new BufferPool(g_options);
+  }
+  return t_pool.pool;
+}
+
+void BufferPool::Configure(const BufferPoolOptions& options) {
+  std::lock_guard<std::mutex> lock(g_options_mutex);
+  g_options = options;
+}
+
+BufferPoolStats BufferPool::stats() const {
+  BufferPoolStats stats;
+  stats.allocations = allocations_.load(std::memory_order_relaxed);
+  stats.failures = failures_.load(std::memory_order_relaxed);
+  stats.remote_frees = remote_frees_.load(std::memory_order_relaxed);
+  uint64_t freed = frees_.load(std::memory_order_relaxed) + stats.remote_frees;
+  stats.in_use = stats.allocations > freed ? stats.allocations - freed : 0;
+  stats.peak_in_use = peak_in_use_.load(std::memory_order_relaxed);
+  stats.slabs = slab_count_.load(std::memory_order_relaxed);
+  stats.huge_slabs = huge_slabs_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+MemoryUsage BufferPool::ProcessMemoryUsage() {
+  MemoryUsage usage;
+  usage.bytes = static_cast<size_t>(g_slab_bytes.load(std::memory_order_relaxed));
+  usage.objects = static_cast<size_t>(g_slab_count.load(std::memory_order_relaxed));
+  return usage;
+}
+
+bool BufferPool::IsOwnerThread() const {
+  return !orphaned_.load(std::memory_order_acquire) &&
+         owner_.load(std::memory_order_relaxed) == static_cast<unsigned long>(pthread_self());
+}
+
+void* BufferPool::Allocate(size_t size) {
+  if (owner_.load(std::memory_order_relaxed) == 0) {
+    owner_.store(static_cast<unsigned long>(pthread_self()), std::memory_order_relaxed);
+  }
+  SizeClass* size_class;
+  if (size <= classes_[0].block_size) {
+    size_class = &classes_[0];
+  } else if (size <= kChunkSize) {
+    size_class = &classes_[1];
+  } else {
+    return nullptr;
+  }
+  void* block;
+  if (size_class->free) {
+    block = size_class->free;
+    size_class->free = size_class->free->next;
+  } else {
+    block = Refill(size_class);
+    if (!block) {
+      Bump(&failures_);
+      return nullptr;
+    }
+  }
+  Bump(&allocations_);
+  uint64_t in_use = allocations_.load(std::memory_order_relaxed) -
+                    frees_.load(std::memory_order_relaxed) -
+                    remote_frees_.load(std::memory_order_relaxed);
+  if (in_use > peak_in_use_.load(std::memory_order_relaxed)) {
+    peak_in_use_.store(in_use, std::memory_order_relaxed);
+  }
+  return block;
+}
+
+void* BufferPool::Refill(SizeClass* size_class) {
+  // Blocks other threads returned come first, then the current slab.
+  FreeBlock* remote = size_class->remote.exchange(nullptr, std::memory_order_acquire);
+  if (remote) {
+    size_class->free = remote->next;
+    return remote;
+  }
+  if (size_class->carve == size_class->carve_end && !MapSlab(size_class)) return nullptr;
+  void* block = size_class->carve;
+  size_class->carve += size_class->block_size;
+  return block;
+}
+
+bool BufferPool::MapSlab(SizeClass* size_class) {
+  if (options_.max_bytes && mapped_bytes_ + kSlabSize > options_.max_bytes) return false;
+  char* slab = nullptr;
+  bool huge = false;
+  if (options_.hugepages) {
+    // Huge pages come aligned to their size.
+    void* memory = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (memory != MAP_FAILED) {
+      slab = static_cast<char*>(memory);
+      huge = true;
+    }
+  }
+  if (!slab) {
+    // Map twice the size and trim to an aligned slab.
+    void* memory =
+        mmap(nullptr, 2 * kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+    uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+    uintptr_t aligned = RoundUp(start, kSlabSize);
+    if (aligned > start) munmap(memory, aligned - start);
+    uintptr_t end = start + 2 * kSlabSize;
+    if (end > aligned + kSlabSize) {
+      munmap(reinterpret_cast<void*>(aligned + kSlabSize), end - aligned - kSlabSize);
+    }
+    slab = reinterpret_cast<char*>(aligned);
+    if (options_.hugepages) madvise(slab, kSlabSize, MADV_HUGEPAGE);
+  }
+  slabs_.emplace_back(slab, kSlabSize);
+  mapped_bytes_ += kSlabSize;
+  g_slab_count.fetch_add(1, std::memory_order_relaxed);
+  g_slab_bytes.fetch_add(kSlabSize, std::memory_order_relaxed);
+  Bump(&slab_count_);
+  if (huge) Bump(&huge_slabs_);
+
+  auto* header = reinterpret_cast<SlabHeader*>(slab);
+  header->pool = this;
+  header->size_class = static_cast<uint32_t>(size_class - classes_);
+  size_class->carve = slab + RoundUp(sizeof(SlabHeader), kAlignment);
+  size_t blocks = (kSlabSize - (size_class->carve - slab)) / size_class->block_size;
+  size_class->carve_end = size_class->carve + blocks * size_class->block_size;
+  return true;
+}
+
+void BufferPool::Free(void* block) {
+  auto* header =
+      reinterpret_cast<SlabHeader*>(reinterpret_cast<uintptr_t>(block) & ~(kSlabSize - 1));
+  BufferPool* pool = header->pool;
+  SizeClass* size_class = &pool->classes_[header->size_class];
+  auto* free_block = static_cast<FreeBlock*>(block);
+  if (pool->IsOwnerThread()) {
+    free_block->next = size_class->free;
+    size_class->free = free_block;
+    Bump(&pool->frees_);
+    return;
+  }
+  pool->FreeRemote(size_class, free_block);
+}
+
+void BufferPool::FreeRemote(SizeClass* size_class, FreeBlock* block) {
+  FreeBlock* head = size_class->remote.load(std::memory_order_relaxed);
+  do {
+    block->next = head;
+  } while (!size_class->remote.compare_exchange_weak(head, block, std::memory_order_release,
+                                                     std::memory_order_relaxed));
+  remote_frees_.fetch_add(1, std::memory_order_relaxed);
+  // Stays negative while the owner lives, so only a free after Orphan()
+  // can bring it to zero.
+  if (orphan_balance_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+}
+
+void BufferPool::Orphan() {
+  orphaned_.store(true, std::memory_order_release);
+  int64_t outstanding = static_cast<int64_t>(allocations_.load(std::memory_order_relaxed) -
+                                             frees_.load(std::memory_order_relaxed));
+  if (orphan_balance_.fetch_add(outstanding, std::memory_order_acq_rel) + outstanding == 0) {
+    delete this;
+  }
+}
+
+size_t BufferPool::BlockSize(const void* block) {
+  auto* header =
+      reinterpret_cast<const SlabHeader*>(reinterpret_cast<uintptr_t>(block) & ~(kSlabSize - 1));
+  return header->pool->classes_[header->size_class].block_size;
+}
+
+bool ChunkQueue::Append(const char* data, size_t size) {
+  size_t room = chunks_.empty() ? 0 : BufferPool::kChunkSize - chunks_.back().end;
+  size_t first = chunks_.size();
+  for (size_t needed = size > room ? size - room : 0; needed > 0;) {
+    Chunk chunk;
+    chunk.buffer = PooledBuffer(pool_, BufferPool::kChunkSize);
+    if (!chunk.buffer) {
+      chunks_.resize(first);
+      return false;
+    }
+    chunks_.push_back(std::move(chunk));
+    needed -= std::min(needed, BufferPool::kChunkSize);
+  }
+  size_t index = first > 0 && room > 0 ? first - 1 : first;
+  size_ += size;
+  while (size > 0) {
+    Chunk& chunk = chunks_[index++];
+    size_t n = std::min(size, BufferPool::kChunkSize - chunk.end);
+    memcpy(chunk.buffer.data() + chunk.end, data, n);
+    chunk.end += n;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void ChunkQueue::Consume(size_t size) {
+  size_ -= size;
+  while (size > 0) {
+    Chunk& chunk = chunks_.front();
+    size_t n = std::min(size, chunk.end - chunk.begin);
+    chunk.begin += n;
+    size -= n;
+    if (chunk.begin == chunk.end) chunks_.erase(chunks_.begin());
+  }
+}
+
+void ChunkQueue::Clear() {
+  chunks_.clear();
+  size_ = 0;
+}
+
+}  // namespace vpn_plugin
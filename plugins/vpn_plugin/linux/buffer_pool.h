@@ -0,0 +1,190 @@
+#ifndef FLUTTER_PLUGIN_BUFFER_POOL_H_
+#define FLUTTER_PLUGIN_BUFFER_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "config_document.h"
+#include "memory_usage.h"
+
+namespace vpn_plugin {
+
+struct BufferPoolOptions {
+  // Size of the packet class: one packet of the TUN MTU plus headroom for
+  // the headers added when it is encapsulated.
+  size_t packet_size = 2048;
+  // Mapped slabs stop growing past this many bytes; 0 means no limit.
+  size_t max_bytes = 0;
+  // Backs slabs with 2 MiB huge pages: explicit ones when the system has
+  // some reserved, transparent ones otherwise.
+  bool hugepages = false;
+
+  // Sizes the packet class from `mtu_size` in [listener.tun].
+  static BufferPoolOptions FromConfig(const ConfigDocument& config);
+};
+
+struct BufferPoolStats {
+  uint64_t allocations = 0;
+  // Allocations refused because the pool was at max_bytes.
+  uint64_t failures = 0;
+  // Blocks freed by threads other than the owner.
+  uint64_t remote_frees = 0;
+  uint64_t in_use = 0;
+  uint64_t peak_in_use = 0;
+  uint64_t slabs = 0;
+  uint64_t huge_slabs = 0;
+};
+
+// Slab allocator for packet and relay buffers, owned by one thread. Blocks
+// come in two size classes, MTU-sized packets and 64 KiB relay chunks, and
+// are carved from 2 MiB slabs aligned to their size, whose header names the
+// pool and class; Free() finds both from the pointer alone.
+//
+// Allocate() must be called on the owning thread, which takes and returns
+// blocks through a plain free list. Free() may be called on any thread:
+// other threads push blocks onto a lock-free list that the owner takes over
+// in one exchange when its own list runs dry. Slabs are kept until the pool
+// is destroyed.
+class BufferPool {
+ public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  static constexpr size_t kSlabSize = 2 * 1024 * 1024;
+
+  explicit BufferPool(BufferPoolOptions options = BufferPoolOptions());
+  // Every block must have been freed.
+  ~BufferPool();
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // The calling thread's pool, created with the options last passed to
+  // Configure(). It outlives the thread until its last block is freed.
+  static BufferPool* ForThread();
+  // Options for pools ForThread() creates from now on.
+  static void Configure(const BufferPoolOptions& options);
+
+  const BufferPoolOptions& options() const { return options_; }
+  BufferPoolStats stats() const;
+  // Slabs mapped by every pool of the process, and their bytes.
+  static MemoryUsage ProcessMemoryUsage();
+
+  // Returns a block of at least |size| bytes, aligned to 64, or nullptr if
+  // |size| exceeds kChunkSize or the pool is at max_bytes.
+  void* Allocate(size_t size);
+  static void Free(void* block);
+  // Usable size of a block from Allocate().
+  static size_t BlockSize(const void* block);
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+  struct SizeClass {
+    size_t block_size = 0;
+    FreeBlock* free = nullptr;
+    // Unused tail of the newest slab of this class.
+    char* carve = nullptr;
+    char* carve_end = nullptr;
+    std::atomic<FreeBlock*> remote{nullptr};
+  };
+  struct SlabHeader;
+
+  bool IsOwnerThread() const;
+  void* Refill(SizeClass* size_class);
+  bool MapSlab(SizeClass* size_class);
+  void FreeRemote(SizeClass* size_class, FreeBlock* block);
+  void Orphan();
+
+  static void Bump(std::atomic<uint64_t>* counter, uint64_t delta = 1) {
+    counter->store(counter->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  BufferPoolOptions options_;
+  SizeClass classes_[2];
+  std::vector<std::pair<void*, size_t>> slabs_;
+  size_t mapped_bytes_ = 0;
+  // pthread_t of the owner, set by the first Allocate().
+  std::atomic<unsigned long> owner_{0};
+  // Outstanding blocks of a pool whose thread has exited, less remote
+  // frees; the free that brings it to zero deletes the pool.
+  std::atomic<int64_t> orphan_balance_{0};
+  std::atomic<bool> orphaned_{false};
+
+  // Written by the owner only, readable anywhere.
+  std::atomic<uint64_t> allocations_{0};
+  std::atomic<uint64_t> frees_{0};
+  std::atomic<uint64_t> failures_{0};
+  std::atomic<uint64_t> remote_frees_{0};
+  std::atomic<uint64_t> peak_in_use_{0};
+  std::atomic<uint64_t> slab_count_{0};
+  std::atomic<uint64_t> huge_slabs_{0};
+
+  friend struct ThreadPoolHolder;
+};
+
+// Owning handle to a pool block, freed on destruction.
+class PooledBuffer {
+ public:
+  PooledBuffer() = default;
+  // Takes a block of at least |size| bytes from |pool|; check the result.
+  PooledBuffer(BufferPool* pool, size_t size) : data_(static_cast<char*>(pool->Allocate(size))) {}
+  ~PooledBuffer() { reset(); }
+
+  PooledBuffer(PooledBuffer&& other) noexcept : data_(std::exchange(other.data_, nullptr)) {}
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+      reset();
+      data_ = std::exchange(other.data_, nullptr);
+    }
+    return *this;
+  }
+
+  explicit operator bool() const { return data_ != nullptr; }
+  char* data() const { return data_; }
+  size_t capacity() const { return data_ ? BufferPool::BlockSize(data_) : 0; }
+  void reset() {
+    if (data_) BufferPool::Free(std::exchange(data_, nullptr));
+  }
+
+ private:
+  char* data_ = nullptr;
+};
+
+// Byte queue over 64 KiB pool chunks, for data a relay has read but not
+// yet written. Chunks go back to the pool as soon as they are drained, so
+// an idle relay holds no buffers.
+class ChunkQueue {
+ public:
+  explicit ChunkQueue(BufferPool* pool) : pool_(pool) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Copies |size| bytes to the back. Returns false, queueing nothing, if
+  // the pool is out of chunks.
+  bool Append(const char* data, size_t size);
+  // Contiguous bytes at the front; the queue must not be empty.
+  const char* front() const { return chunks_.front().buffer.data() + chunks_.front().begin; }
+  size_t front_size() const { return chunks_.front().end - chunks_.front().begin; }
+  // Drops |size| bytes from the front.
+  void Consume(size_t size);
+  void Clear();
+
+ private:
+  struct Chunk {
+    PooledBuffer buffer;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  BufferPool* pool_;
+  std::vector<Chunk> chunks_;
+  size_t size_ = 0;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_BUFFER_POOL_H_
@@ -0,0 +1,217 @@
+#include "config_document.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "trace.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+class Cursor {
+ public:
+  explicit Cursor(const std::string& text) : text_(text) {}
+
+  bool AtEnd() const { return pos_ >= text_.size(); }
+  char Peek() const { return AtEnd() ? '\0' : text_[pos_]; }
+  bool StartsWith(const char* s) const { return text_.compare(pos_, strlen(s), s) == 0; }
+  void Advance(size_t n = 1) { pos_ += n; }
+  int line() const {
+    int l = 1;
+    for (size_t i = 0; i < pos_ && i < text_.size(); i++) l += text_[i] == '\n';
+    return l;
+  }
+
+  // Skips blanks, and when |newlines| is set also line breaks and comments.
+  void SkipSpace(bool newlines) {
+    while (!AtEnd()) {
+      char c = Peek();
+      if (c == ' ' || c == '\t' || c == '\r') {
+        Advance();
+      } else if (newlines && c == '\n') {
+        Advance();
+      } else if (c == '#') {
+        while (!AtEnd() && Peek() != '\n') Advance();
+      } else {
+        break;
+      }
+    }
+  }
+
+  bool ReadBareWord(std::string* out) {
+    size_t start = pos_;
+    while (!AtEnd()) {
+      char c = Peek();
+      if (isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.') {
+        Advance();
+      } else {
+        break;
+      }
+    }
+    *out = text_.substr(start, pos_ - start);
+    return !out->empty();
+  }
+
+  bool ReadString(std::string* out) {
+    if (StartsWith("\"\"\"")) {
+      Advance(3);
+      // A newline immediately following the opening delimiter is trimmed.
+      if (Peek() == '\n') Advance();
+      size_t end = text_.find("\"\"\"", pos_);
+      if (end == std::string::npos) return false;
+      *out = text_.substr(pos_, end - pos_);
+      if (!out->empty() && out->back() == '\n') out->pop_back();
+      pos_ = end + 3;
+      return true;
+    }
+    if (Peek() != '"') return false;
+    Advance();
+    out->clear();
+    while (!AtEnd() && Peek() != '"') {
+      char c = Peek();
+      if (c == '\n') return false;
+      if (c == '\\') {
+        Advance();
+        switch (Peek()) {
+          case 'n': out->push_back('\n'); break;
+          case 't': out->push_back('\t'); break;
+          case '"': out->push_back('"'); break;
+          case '\\': out->push_back('\\'); break;
+          default: return false;
+        }
+      } else {
+        out->push_back(c);
+      }
+      Advance();
+    }
+    if (AtEnd()) return false;
+    Advance();
+    return true;
+  }
+
+ private:
+  const std::string& text_;
+  size_t pos_ = 0;
+};
+
+bool ParseValue(Cursor* cur, ConfigDocument::Value* out) {
+  using Type = ConfigDocument::Value::Type;
+  char c = cur->Peek();
+  if (c == '"') {
+    out->type = Type::kString;
+    return cur->ReadString(&out->string_value);
+  }
+  if (c == '[') {
+    cur->Advance();
+    out->type = Type::kList;
+    cur->SkipSpace(true);
+    while (cur->Peek() != ']') {
+      std::string item;
+      if (!cur->ReadString(&item)) return false;
+      out->list_value.push_back(item);
+      cur->SkipSpace(true);
+      if (cur->Peek() == ',') {
+        cur->Advance();
+        cur->SkipSpace(true);
+      } else if (cur->Peek() != ']') {
+        return false;
+      }
+    }
+    cur->Advance();
+    return true;
+  }
+  std::string word;
+  if (!cur->ReadBareWord(&word)) return false;
+  if (word == "true" || word == "false") {
+    out->type = Type::kBool;
+    out->bool_value = word == "true";
+    return true;
+  }
+  char* end = nullptr;
+  long long v = strtoll(word.c_str(), &end, 10);
+  if (*end != '\0') return false;
+  out->type = Type::kInt;
+  out->int_value = v;
+  return true;
+}
+
+}  // namespace
+
+bool ConfigDocument::Parse(const std::string& text, ConfigDocument* out, std::string* error) {
+  TraceSpan span("config.parse", static_cast<int64_t>(text.size()));
+  ConfigDocument doc;
+  std::string section;
+  doc.sections_[section];
+  Cursor cur(text);
+
+  auto fail = [&](const char* what) {
+    if (error) *error = std::string(what) + " at line " + std::to_string(cur.line());
+    return false;
+  };
+
+  while (true) {
+    cur.SkipSpace(true);
+    if (cur.AtEnd()) break;
+    if (cur.Peek() == '[') {
+      cur.Advance();
+      if (!cur.ReadBareWord(&section) || cur.Peek() != ']') return fail("bad section header");
+      cur.Advance();
+      doc.sections_[section];
+    } else {
+      std::string key;
+      if (!cur.ReadBareWord(&key)) return fail("expected key");
+      cur.SkipSpace(false);
+      if (cur.Peek() != '=') return fail("expected '='");
+      cur.Advance();
+      cur.SkipSpace(false);
+      Value value;
+      if (!ParseValue(&cur, &value)) return fail("bad value");
+      doc.sections_[section][key] = std::move(value);
+    }
+    cur.SkipSpace(false);
+    if (!cur.AtEnd() && cur.Peek() != '\n') return fail("trailing characters");
+  }
+
+  *out = std::move(doc);
+  return true;
+}
+
+bool ConfigDocument::HasSection(const std::string& section) const {
+  return sections_.count(section) != 0;
+}
+
+const ConfigDocument::Value* ConfigDocument::Find(const std::string& section,
+                                                  const std::string& key) const {
+  auto s = sections_.find(section);
+  if (s == sections_.end()) return nullptr;
+  auto v = s->second.find(key);
+  return v == s->second.end() ? nullptr : &v->second;
+}
+
+std::string ConfigDocument::GetString(const std::string& section, const std::string& key,
+                                      const std::string& fallback) const {
+  const Value* v = Find(section, key);
+  return v && v->type == Value::Type::kString ? v->string_value : fallback;
+}
+
+bool ConfigDocument::GetBool(const std::string& section, const std::string& key,
+                             bool fallback) const {
+  const Value* v = Find(section, key);
+  return v && v->type == Value::Type::kBool ? v->bool_value : fallback;
+}
+
+int64_t ConfigDocument::GetInt(const std::string& section, const std::string& key,
+                               int64_t fallback) const {
+  const Value* v = Find(section, key);
+  return v && v->type == Value::Type::kInt ? v->int_value : fallback;
+}
+
+std::vector<std::string> ConfigDocument::GetStringList(const std::string& section,
+                                                       const std::string& key) const {
+  const Value* v = Find(section, key);
+  return v && v->type == Value::Type::kList ? v->list_value : std::vector<std::string>();
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,44 @@
+#ifndef FLUTTER_PLUGIN_CONFIG_DOCUMENT_H_
+#define FLUTTER_PLUGIN_CONFIG_DOCUMENT_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace vpn_plugin {
+
+// Reader for the backend configuration document produced by the Dart
+// ConfigurationEncoder. Only the TOML subset the encoder emits is supported:
+// [section] headers, quoted and triple-quoted strings, booleans, integers and
+// flat arrays of strings.
+class ConfigDocument {
+ public:
+  struct Value {
+    enum class Type { kString, kBool, kInt, kList };
+    Type type = Type::kString;
+    std::string string_value;
+    bool bool_value = false;
+    int64_t int_value = 0;
+    std::vector<std::string> list_value;
+  };
+
+  // Top-level keys live in the section named "".
+  static bool Parse(const std::string& text, ConfigDocument* out, std::string* error);
+
+  bool HasSection(const std::string& section) const;
+  const Value* Find(const std::string& section, const std::string& key) const;
+
+  std::string GetString(const std::string& section, const std::string& key,
+                        const std::string& fallback = std::string()) const;
+  bool GetBool(const std::string& section, const std::string& key, bool fallback = false) const;
+  int64_t GetInt(const std::string& section, const std::string& key, int64_t fallback = 0) const;
+  std::vector<std::string> GetStringList(const std::string& section, const std::string& key) const;
+
+ private:
+  std::map<std::string, std::map<std::string, Value>> sections_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_CONFIG_DOCUMENT_H_
@@ -0,0 +1,161 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace vpn_plugin {
+
+namespace {
+
+void PutU32(std::string* out, size_t offset, uint32_t value) {
+  (*out)[offset] = static_cast<char>(value >> 24);
+  (*out)[offset + 1] = static_cast<char>(value >> 16);
+  (*out)[offset + 2] = static_cast<char>(value >> 8);
+  (*out)[offset + 3] = static_cast<char>(value);
+}
+
+void CollectTtls(const std::vector<DnsRecord>& records,
+                 std::vector<std::pair<uint32_t, uint32_t>>* out) {
+  for (const auto& record : records) {
+    // The OPT pseudo-record uses its TTL field for extended flags.
+    if (record.type == kDnsTypeOpt) continue;
+    out->emplace_back(static_cast<uint32_t>(record.ttl_offset), record.ttl);
+  }
+}
+
+}  // namespace
+
+DnsCache::DnsCache(DnsCacheOptions options)
+    : options_(options),
+      shard_capacity_(std::max<size_t>(1, options.capacity / std::max<size_t>(1, options.shards))),
+      shards_(new Shard[std::max<size_t>(1, options.shards)]) {
+  options_.shards = std::max<size_t>(1, options_.shards);
+}
+
+std::string DnsCache::Key(const DnsQuestion& question) {
+  std::string key;
+  key.reserve(question.name.size() + 4);
+  key.push_back(static_cast<char>(question.type >> 8));
+  key.push_back(static_cast<char>(question.type));
+  key.push_back(static_cast<char>(question.klass >> 8));
+  key.push_back(static_cast<char>(question.klass));
+  key += question.name;
+  return key;
+}
+
+DnsCache::Shard& DnsCache::ShardFor(const std::string& key) {
+  return shards_[std::hash<std::string>()(key) % options_.shards];
+}
+
+DnsCache::Result DnsCache::Find(const std::string& key, uint16_t id, int64_t now_ms,
+                                std::string* response, bool* refresh) {
+  *refresh = false;
+  Shard& shard = ShardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) return Result::kMiss;
+  Entry& entry = *it->second;
+  bool stale = now_ms >= entry.expires_ms;
+  if (stale && now_ms - entry.expires_ms >= static_cast<int64_t>(options_.max_stale) * 1000) {
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+    return Result::kMiss;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  entry.hits++;
+
+  int64_t age_s = (now_ms - entry.stored_ms) / 1000;
+  *response = entry.response;
+  for (const auto& ttl : entry.ttls) {
+    uint32_t value = stale ? options_.stale_answer_ttl
+                           : static_cast<uint32_t>(std::max<int64_t>(0, ttl.second - age_s));
+    PutU32(response, ttl.first, value);
+  }
+  SetDnsId(response, id);
+
+  if (!entry.refreshing) {
+    int64_t lifetime = entry.expires_ms - entry.stored_ms;
+    bool due = stale || (entry.hits >= options_.prefetch_hits &&
+                         (entry.expires_ms - now_ms) * 100 <=
+                             lifetime * static_cast<int64_t>(options_.prefetch_percent));
+    if (due) {
+      entry.refreshing = true;
+      *refresh = true;
+    }
+  }
+  return stale ? Result::kStale : Result::kFresh;
+}
+
+bool DnsCache::Insert(const std::string& key, const std::string& response,
+                      const DnsMessage& message, int64_t now_ms) {
+  uint32_t ttl = 0;
+  bool negative = false;
+  if (!DnsCacheLifetime(reinterpret_cast<const uint8_t*>(response.data()), message, &ttl,
+                        &negative)) {
+    return false;
+  }
+  ttl = negative ? std::min(ttl, options_.max_negative_ttl)
+                 : std::min(std::max(ttl, options_.min_ttl), options_.max_ttl);
+  if (ttl == 0) return false;
+
+  Entry entry;
+  entry.key = key;
+  entry.response = response;
+  CollectTtls(message.answers, &entry.ttls);
+  CollectTtls(message.authority, &entry.ttls);
+  CollectTtls(message.additional, &entry.ttls);
+  // Served TTLs never outlive the entry, even when records disagree.
+  for (auto& record_ttl : entry.ttls) record_ttl.second = std::min(record_ttl.second, ttl);
+  entry.stored_ms = now_ms;
+  entry.expires_ms = now_ms + static_cast<int64_t>(ttl) * 1000;
+
+  Shard& shard = ShardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    entry.hits = it->second->hits;
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+  }
+  shard.lru.push_front(std::move(entry));
+  shard.index[key] = shard.lru.begin();
+  while (shard.lru.size() > shard_capacity_) {
+    shard.index.erase(shard.lru.back().key);
+    shard.lru.pop_back();
+  }
+  return true;
+}
+
+void DnsCache::ClearRefresh(const std::string& key) {
+  Shard& shard = ShardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) it->second->refreshing = false;
+}
+
+size_t DnsCache::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < options_.shards; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    total += shards_[i].lru.size();
+  }
+  return total;
+}
+
+MemoryUsage DnsCache::memory_usage() const {
+  MemoryUsage usage;
+  usage.bytes = options_.shards * sizeof(Shard);
+  for (size_t i = 0; i < options_.shards; i++) {
+    const Shard& shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    usage.bytes += HeapBytes(shard.lru) + HeapBytes(shard.index);
+    for (const Entry& entry : shard.lru) {
+      // The index holds a second copy of the key.
+      usage.bytes += 2 * HeapBytes(entry.key) + HeapBytes(entry.response) + HeapBytes(entry.ttls);
+    }
+    usage.objects += shard.lru.size();
+  }
+  return usage;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,99 @@
+#ifndef FLUTTER_PLUGIN_DNS_CACHE_H_
+#define FLUTTER_PLUGIN_DNS_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dns_message.h"
+#include "memory_usage.h"
+
+namespace vpn_plugin {
+
+struct DnsCacheOptions {
+  // Total entries across all shards.
+  size_t capacity = 8192;
+  size_t shards = 16;
+  // Positive TTLs are clamped into [min_ttl, max_ttl]; negative answers are
+  // kept for at most max_negative_ttl (RFC 2308 section 5).
+  uint32_t min_ttl = 0;
+  uint32_t max_ttl = 24 * 3600;
+  uint32_t max_negative_ttl = 300;
+  // Expired answers may still be served for this long while a refresh is
+  // under way, with stale_answer_ttl as their TTL (RFC 8767).
+  uint32_t max_stale = 24 * 3600;
+  uint32_t stale_answer_ttl = 30;
+  // An entry is refreshed ahead of expiry once it has been hit this many
+  // times and less than prefetch_percent of its lifetime remains.
+  uint32_t prefetch_hits = 3;
+  uint32_t prefetch_percent = 10;
+};
+
+// Response cache keyed by question. Entries keep the response bytes and
+// the offsets of their TTL fields so hits are served by patching a copy:
+// the remaining lifetime goes into every TTL and the id is replaced. Keys
+// are spread over independently locked shards, each with its own LRU list,
+// so the cache can be shared between threads.
+class DnsCache {
+ public:
+  enum class Result { kMiss, kFresh, kStale };
+
+  explicit DnsCache(DnsCacheOptions options = DnsCacheOptions());
+
+  DnsCache(const DnsCache&) = delete;
+  DnsCache& operator=(const DnsCache&) = delete;
+
+  static std::string Key(const DnsQuestion& question);
+
+  // On a hit, writes the response for query |id| to |response|. |refresh|
+  // is set when the caller should query upstream to renew the entry; it is
+  // only handed out once per entry.
+  Result Find(const std::string& key, uint16_t id, int64_t now_ms, std::string* response,
+              bool* refresh);
+  // Stores |response| if it is cacheable. |message| is its parsed form.
+  // Returns false if it was not stored.
+  bool Insert(const std::string& key, const std::string& response, const DnsMessage& message,
+              int64_t now_ms);
+  // Allows a refresh to be handed out again, e.g. after it failed.
+  void ClearRefresh(const std::string& key);
+
+  size_t size() const;
+  // Entries, and the bytes they and the shards hold.
+  MemoryUsage memory_usage() const;
+  const DnsCacheOptions& options() const { return options_; }
+
+ private:
+  struct Entry {
+    std::string key;
+    std::string response;
+    // Offset and original value of every TTL field, excluding OPT.
+    std::vector<std::pair<uint32_t, uint32_t>> ttls;
+    int64_t stored_ms;
+    int64_t expires_ms;
+    uint32_t hits = 0;
+    bool refreshing = false;
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    // Most recently used first.
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  };
+
+  Shard& ShardFor(const std::string& key);
+
+  DnsCacheOptions options_;
+  size_t shard_capacity_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_DNS_CACHE_H_
@@ -0,0 +1,345 @@
+#include "dns_forwarder.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <utility>
+
+#include "buffer_pool.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr size_t kMaxDatagram = 65536;
+constexpr uint8_t kDnsRcodeNotImp = 4;
+// EDNS(0) payload size for upstream queries; the DNS flag day 2020 value
+// avoids IP fragmentation while keeping most answers out of TCP.
+constexpr uint16_t kEdnsPayloadSize = 1232;
+
+// Upstream answers that say nothing about the name itself.
+bool IsUpstreamFailure(const DnsMessage& response) {
+  uint8_t rcode = response.rcode();
+  return response.truncated() || rcode == kDnsRcodeServFail || rcode == kDnsRcodeRefused ||
+         rcode == kDnsRcodeNotImp || rcode == kDnsRcodeFormErr;
+}
+
+DnsMessage QueryFor(const DnsQuestion& question) {
+  DnsMessage query;
+  query.flags = 0x0100;
+  query.questions.push_back(question);
+  return query;
+}
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Wire length of the single question that follows the header.
+size_t QuestionLength(const DnsQuestion& question) {
+  return (question.name.empty() ? 1 : question.name.size() + 2) + 4;
+}
+
+}  // namespace
+
+bool DnsForwarderOptions::FromConfig(const ConfigDocument& config, DnsForwarderOptions* out,
+                                     std::string* error) {
+  DnsForwarderOptions options = *out;
+  options.upstreams.clear();
+  for (std::string text : config.GetStringList("", "dns_upstreams")) {
+    if (text.compare(0, 6, "udp://") == 0) text = text.substr(6);
+    if (text.find("://") != std::string::npos) continue;
+    SocketAddress address;
+    if (SocketAddress::Parse(text, 53, &address)) options.upstreams.push_back(address);
+  }
+  if (options.upstreams.empty()) {
+    if (error) *error = "no plain DNS upstream configured";
+    return false;
+  }
+  *out = std::move(options);
+  return true;
+}
+
+DnsForwarder::DnsForwarder(EventLoop* loop, DnsForwarderOptions options)
+    : loop_(loop),
+      options_(std::move(options)),
+      cache_(options_.cache),
+      random_(std::random_device()()),
+      alive_(std::make_shared<bool>(true)) {}
+
+DnsForwarder::~DnsForwarder() {
+  *alive_ = false;
+  for (auto& entry : pending_) {
+    if (entry.second.timer) loop_->CancelTimer(entry.second.timer);
+  }
+  for (int fd : upstream_fds_) {
+    if (fd < 0) continue;
+    loop_->Remove(fd);
+    close(fd);
+  }
+  if (listen_fd_ >= 0) {
+    loop_->Remove(listen_fd_);
+    close(listen_fd_);
+  }
+}
+
+bool DnsForwarder::Start() {
+  for (size_t i = 0; i < options_.upstreams.size(); i++) {
+    sockaddr_storage ss;
+    socklen_t len = options_.upstreams[i].ToSockaddr(&ss);
+    int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // Connecting filters out datagrams from anyone but the upstream.
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0 &&
+        !loop_->Add(fd, EventLoop::kReadable, [this, i](uint32_t) { OnUpstreamReadable(i); })) {
+      close(fd);
+      fd = -1;
+    }
+    upstream_fds_.push_back(fd);
+  }
+  for (int fd : upstream_fds_) {
+    if (fd >= 0) return true;
+  }
+  return false;
+}
+
+bool DnsForwarder::Listen(const SocketAddress& address) {
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  if (bind(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0 ||
+      !loop_->Add(fd, EventLoop::kReadable, [this](uint32_t) { OnListenerReadable(); })) {
+    close(fd);
+    return false;
+  }
+  len = sizeof(ss);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len);
+  SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &local_address_);
+  listen_fd_ = fd;
+  return true;
+}
+
+void DnsForwarder::Resolve(const uint8_t* query, size_t size, Callback callback) {
+  stats_.queries++;
+  DnsMessage message;
+  if (!DnsMessage::Parse(query, size, &message) || message.is_response()) {
+    callback(std::string());
+    return;
+  }
+  if (message.questions.size() != 1 || (message.flags & 0x7800) != 0) {
+    stats_.failures++;
+    callback(BuildDnsError(message, message.questions.size() != 1 ? kDnsRcodeFormErr
+                                                                  : kDnsRcodeNotImp));
+    return;
+  }
+  const DnsQuestion& question = message.questions[0];
+  Waiter waiter{message.id, std::string(), std::move(callback)};
+  size_t question_end = kDnsHeaderSize;
+  std::string name;
+  // Only an uncompressed question can be copied over the cached one.
+  if (ReadDnsName(query, size, &question_end, &name) &&
+      question_end + 4 - kDnsHeaderSize == QuestionLength(question)) {
+    waiter.question.assign(reinterpret_cast<const char*>(query) + kDnsHeaderSize,
+                           QuestionLength(question));
+  }
+  std::string key = DnsCache::Key(question);
+  std::string response;
+  bool refresh = false;
+  switch (cache_.Find(key, message.id, EventLoop::NowMs(), &response, &refresh)) {
+    case DnsCache::Result::kMiss:
+      stats_.misses++;
+      StartQuery(key, question, std::move(waiter));
+      return;
+    case DnsCache::Result::kFresh:
+      stats_.cache_hits++;
+      break;
+    case DnsCache::Result::kStale:
+      stats_.stale_hits++;
+      break;
+  }
+  if (options_.domains) {
+    // Refreshes the mapping for clients that reconnect from their own cache.
+    DnsMessage answer;
+    const auto* data = reinterpret_cast<const uint8_t*>(response.data());
+    if (DnsMessage::Parse(data, response.size(), &answer)) {
+      options_.domains->Learn(data, response.size(), answer, EventLoop::NowMs());
+    }
+  }
+  if (refresh) {
+    stats_.prefetches++;
+    StartQuery(key, question, Waiter{0, std::string(), nullptr});
+  }
+  Answer(waiter, std::move(response));
+}
+
+void DnsForwarder::Answer(const Waiter& waiter, std::string response) {
+  SetDnsId(&response, waiter.id);
+  // Echo the question as asked, keeping any case randomisation intact. Both
+  // hold the same name, so the lengths only differ for malformed input.
+  if (response.size() >= kDnsHeaderSize + waiter.question.size()) {
+    memcpy(&response[kDnsHeaderSize], waiter.question.data(), waiter.question.size());
+  }
+  waiter.callback(response);
+}
+
+void DnsForwarder::StartQuery(const std::string& key, const DnsQuestion& question,
+                              Waiter waiter) {
+  auto existing = pending_.find(key);
+  if (existing != pending_.end()) {
+    if (waiter.callback) {
+      stats_.coalesced++;
+      existing->second.waiters.push_back(std::move(waiter));
+    }
+    return;
+  }
+  Pending& pending = pending_[key];
+  pending.question = question;
+  if (waiter.callback) pending.waiters.push_back(std::move(waiter));
+  pending.txids.assign(upstream_fds_.size(), 0);
+  pending.sent_us = NowUs();
+  size_t sent = 0;
+  for (size_t i = 0; i < upstream_fds_.size(); i++) {
+    if (upstream_fds_[i] < 0) continue;
+    uint16_t txid = NextTxid(i);
+    std::string query = BuildDnsQuery(txid, question, kEdnsPayloadSize);
+    if (send(upstream_fds_[i], query.data(), query.size(), 0) < 0) continue;
+    pending.txids[i] = txid;
+    inflight_[static_cast<uint32_t>(i) << 16 | txid] = key;
+    stats_.upstream_queries++;
+    sent++;
+  }
+  pending.failed = upstream_fds_.size() - sent;
+  if (sent == 0) {
+    Fail(key, std::string());
+    return;
+  }
+  std::weak_ptr<bool> alive = alive_;
+  pending.timer = loop_->AddTimer(options_.timeout_ms, [this, alive, key]() {
+    if (alive.expired() || !*alive.lock()) return;
+    auto it = pending_.find(key);
+    if (it == pending_.end()) return;
+    it->second.timer = 0;
+    stats_.upstream_timeouts++;
+    Fail(key, it->second.last_failure);
+  });
+}
+
+void DnsForwarder::OnUpstreamReadable(size_t upstream) {
+  // With the pool exhausted, the next datagram to arrive retries.
+  PooledBuffer buffer(BufferPool::ForThread(), kMaxDatagram);
+  if (!buffer) return;
+  while (upstream < upstream_fds_.size() && upstream_fds_[upstream] >= 0) {
+    ssize_t n = recv(upstream_fds_[upstream], buffer.data(), kMaxDatagram, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      // EAGAIN, or an ICMP error surfaced on the connected socket.
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      continue;
+    }
+    if (n < static_cast<ssize_t>(kDnsHeaderSize)) continue;
+    OnUpstreamResponse(upstream, std::string(buffer.data(), static_cast<size_t>(n)));
+  }
+}
+
+void DnsForwarder::OnUpstreamResponse(size_t upstream, const std::string& response) {
+  const auto* data = reinterpret_cast<const uint8_t*>(response.data());
+  uint16_t txid = static_cast<uint16_t>(data[0] << 8 | data[1]);
+  auto inflight = inflight_.find(static_cast<uint32_t>(upstream) << 16 | txid);
+  if (inflight == inflight_.end()) return;
+  std::string key = inflight->second;
+  Pending& pending = pending_[key];
+  DnsMessage message;
+  // A mismatched question is a spoofing attempt or a confused upstream;
+  // keep waiting for the real answer.
+  if (!DnsMessage::Parse(data, response.size(), &message) || !message.is_response() ||
+      message.questions.size() != 1 || !(message.questions[0] == pending.question)) {
+    return;
+  }
+  inflight_.erase(inflight);
+  pending.txids[upstream] = 0;
+  if (IsUpstreamFailure(message)) {
+    pending.last_failure = response;
+    if (++pending.failed == pending.txids.size()) Fail(key, response);
+    return;
+  }
+  if (options_.upstream_latency_us) {
+    options_.upstream_latency_us->Record(NowUs() - pending.sent_us);
+  }
+  int64_t now_ms = EventLoop::NowMs();
+  cache_.Insert(key, response, message, now_ms);
+  if (options_.domains) options_.domains->Learn(data, response.size(), message, now_ms);
+  Finish(key, response);
+}
+
+void DnsForwarder::Fail(const std::string& key, std::string response) {
+  auto it = pending_.find(key);
+  if (it == pending_.end()) return;
+  // Serve stale once the upstreams have given up (RFC 8767).
+  std::string cached;
+  bool refresh = false;
+  if (cache_.Find(key, 0, EventLoop::NowMs(), &cached, &refresh) != DnsCache::Result::kMiss) {
+    response = cached;
+  } else {
+    stats_.failures++;
+    if (response.empty()) response = BuildDnsError(QueryFor(it->second.question),
+                                                   kDnsRcodeServFail);
+  }
+  cache_.ClearRefresh(key);
+  Finish(key, response);
+}
+
+void DnsForwarder::Finish(const std::string& key, const std::string& response) {
+  auto it = pending_.find(key);
+  if (it == pending_.end()) return;
+  Pending pending = std::move(it->second);
+  pending_.erase(it);
+  if (pending.timer) loop_->CancelTimer(pending.timer);
+  for (size_t i = 0; i < pending.txids.size(); i++) {
+    if (pending.txids[i]) inflight_.erase(static_cast<uint32_t>(i) << 16 | pending.txids[i]);
+  }
+  std::weak_ptr<bool> alive = alive_;
+  for (const auto& waiter : pending.waiters) {
+    Answer(waiter, response);
+    if (alive.expired() || !*alive.lock()) return;
+  }
+}
+
+void DnsForwarder::OnListenerReadable() {
+  PooledBuffer buffer(BufferPool::ForThread(), kMaxDatagram);
+  if (!buffer) return;
+  while (true) {
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    ssize_t n = recvfrom(listen_fd_, buffer.data(), kMaxDatagram, 0,
+                         reinterpret_cast<sockaddr*>(&ss), &len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    std::weak_ptr<bool> alive = alive_;
+    Resolve(reinterpret_cast<const uint8_t*>(buffer.data()), static_cast<size_t>(n),
+            [this, alive, ss, len](const std::string& response) {
+              if (alive.expired() || !*alive.lock() || response.empty()) return;
+              sendto(listen_fd_, response.data(), response.size(), 0,
+                     reinterpret_cast<const sockaddr*>(&ss), len);
+            });
+  }
+}
+
+uint16_t DnsForwarder::NextTxid(size_t upstream) {
+  while (true) {
+    uint16_t txid = static_cast<uint16_t>(random_());
+    if (txid && !inflight_.count(static_cast<uint32_t>(upstream) << 16 | txid)) return txid;
+  }
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,132 @@
+#ifndef FLUTTER_PLUGIN_DNS_FORWARDER_H_
+#define FLUTTER_PLUGIN_DNS_FORWARDER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config_document.h"
+#include "dns_cache.h"
+#include "dns_message.h"
+#include "domain_table.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "net_address.h"
+
+namespace vpn_plugin {
+
+struct DnsForwarderOptions {
+  // Plain DNS-over-UDP resolvers, all queried in parallel on a miss.
+  std::vector<SocketAddress> upstreams;
+  DnsCacheOptions cache;
+  // Give up on the upstreams after this long.
+  int timeout_ms = 2000;
+  // Learns address-to-domain mappings from every answer handed out.
+  DomainTable* domains = nullptr;
+  // Time from sending a miss upstream to the answer that wins, in
+  // microseconds. May be shared between forwarders.
+  Histogram* upstream_latency_us = nullptr;
+
+  // Reads the top-level dns_upstreams list. Only plain "ip[:port]" entries
+  // are used; encrypted transports are skipped. Returns false if none is
+  // left.
+  static bool FromConfig(const ConfigDocument& config, DnsForwarderOptions* out,
+                         std::string* error);
+};
+
+struct DnsForwarderStats {
+  std::atomic<uint64_t> queries{0};
+  std::atomic<uint64_t> cache_hits{0};
+  std::atomic<uint64_t> stale_hits{0};
+  std::atomic<uint64_t> misses{0};
+  // Misses that joined a query already in flight for the same question.
+  std::atomic<uint64_t> coalesced{0};
+  std::atomic<uint64_t> prefetches{0};
+  std::atomic<uint64_t> upstream_queries{0};
+  std::atomic<uint64_t> upstream_timeouts{0};
+  std::atomic<uint64_t> failures{0};
+};
+
+// Caching DNS forwarder. Queries are answered from the cache when possible,
+// including expired entries within the serve-stale window, which are then
+// refreshed in the background. A miss is sent to every upstream at once and
+// the first usable response wins; SERVFAIL and REFUSED only count once every
+// upstream has returned one. Concurrent misses for one question share a
+// single upstream exchange. Must be used on the loop thread.
+class DnsForwarder {
+ public:
+  // Receives the wire response. Empty when the query was not understood
+  // well enough to answer.
+  using Callback = std::function<void(const std::string& response)>;
+
+  DnsForwarder(EventLoop* loop, DnsForwarderOptions options);
+  ~DnsForwarder();
+
+  DnsForwarder(const DnsForwarder&) = delete;
+  DnsForwarder& operator=(const DnsForwarder&) = delete;
+
+  // Opens the upstream sockets.
+  bool Start();
+  // Also serves queries arriving on a UDP socket bound to |address|.
+  bool Listen(const SocketAddress& address);
+  SocketAddress local_address() const { return local_address_; }
+
+  // Answers |query|. The callback may run before this returns.
+  void Resolve(const uint8_t* query, size_t size, Callback callback);
+
+  const DnsForwarderStats& stats() const { return stats_; }
+  DnsCache& cache() { return cache_; }
+
+ private:
+  struct Waiter {
+    uint16_t id;
+    // The question section exactly as the client sent it.
+    std::string question;
+    Callback callback;
+  };
+  struct Pending {
+    DnsQuestion question;
+    std::vector<Waiter> waiters;
+    // Transaction id used towards each upstream, 0 once it has answered.
+    std::vector<uint16_t> txids;
+    size_t failed = 0;
+    std::string last_failure;
+    EventLoop::TimerId timer = 0;
+    int64_t sent_us = 0;
+  };
+
+  static void Answer(const Waiter& waiter, std::string response);
+  void StartQuery(const std::string& key, const DnsQuestion& question, Waiter waiter);
+  void OnUpstreamReadable(size_t upstream);
+  void OnUpstreamResponse(size_t upstream, const std::string& response);
+  // Answers with a stale entry if there is one, otherwise with |response|
+  // or SERVFAIL.
+  void Fail(const std::string& key, std::string response);
+  // Answers every waiter and forgets the query.
+  void Finish(const std::string& key, const std::string& response);
+  void OnListenerReadable();
+  uint16_t NextTxid(size_t upstream);
+
+  EventLoop* loop_;
+  DnsForwarderOptions options_;
+  DnsCache cache_;
+  std::vector<int> upstream_fds_;
+  int listen_fd_ = -1;
+  SocketAddress local_address_;
+  std::unordered_map<std::string, Pending> pending_;
+  // (upstream << 16 | txid) -> key of the pending query.
+  std::unordered_map<uint32_t, std::string> inflight_;
+  std::mt19937 random_;
+  std::shared_ptr<bool> alive_;
+  DnsForwarderStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_DNS_FORWARDER_H_
@@ -0,0 +1,195 @@
+#include "dns_message.h"
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+namespace {
+
+// Bounds pointer chains so a looping name cannot stall the parser.
+constexpr int kMaxCompressionPointers = 32;
+constexpr size_t kMaxNameLength = 255;
+
+uint16_t ReadU16(const uint8_t* p) { return static_cast<uint16_t>(p[0] << 8 | p[1]); }
+
+uint32_t ReadU32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+void PutU16(std::string* out, uint16_t value) {
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value & 0xff));
+}
+
+bool ReadRecords(const uint8_t* data, size_t size, size_t* offset, uint16_t count,
+                 std::vector<DnsRecord>* out) {
+  out->reserve(count);
+  for (uint16_t i = 0; i < count; i++) {
+    DnsRecord record;
+    if (!ReadDnsName(data, size, offset, &record.name)) return false;
+    if (size - *offset < 10) return false;
+    const uint8_t* p = data + *offset;
+    record.type = ReadU16(p);
+    record.klass = ReadU16(p + 2);
+    record.ttl_offset = *offset + 4;
+    record.ttl = ReadU32(p + 4);
+    record.rdata_length = ReadU16(p + 8);
+    record.rdata_offset = *offset + 10;
+    if (size - record.rdata_offset < record.rdata_length) return false;
+    *offset = record.rdata_offset + record.rdata_length;
+    out->push_back(std::move(record));
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ReadDnsName(const uint8_t* data, size_t size, size_t* offset, std::string* out) {
+  out->clear();
+  size_t pos = *offset;
+  size_t end = 0;
+  int pointers = 0;
+  while (true) {
+    if (pos >= size) return false;
+    uint8_t length = data[pos];
+    if ((length & 0xc0) == 0xc0) {
+      if (pos + 1 >= size || ++pointers > kMaxCompressionPointers) return false;
+      if (!end) end = pos + 2;
+      pos = static_cast<size_t>(length & 0x3f) << 8 | data[pos + 1];
+      continue;
+    }
+    if (length & 0xc0) return false;  // Reserved label types.
+    pos++;
+    if (length == 0) break;
+    if (size - pos < length) return false;
+    if (!out->empty()) out->push_back('.');
+    for (size_t i = 0; i < length; i++) {
+      char c = static_cast<char>(data[pos + i]);
+      out->push_back(c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c);
+    }
+    if (out->size() > kMaxNameLength) return false;
+    pos += length;
+  }
+  *offset = end ? end : pos;
+  return true;
+}
+
+bool DnsMessage::Parse(const uint8_t* data, size_t size, DnsMessage* out) {
+  if (size < kDnsHeaderSize) return false;
+  out->id = ReadU16(data);
+  out->flags = ReadU16(data + 2);
+  uint16_t qdcount = ReadU16(data + 4);
+  uint16_t ancount = ReadU16(data + 6);
+  uint16_t nscount = ReadU16(data + 8);
+  uint16_t arcount = ReadU16(data + 10);
+  size_t offset = kDnsHeaderSize;
+  out->questions.clear();
+  out->questions.reserve(qdcount);
+  for (uint16_t i = 0; i < qdcount; i++) {
+    DnsQuestion question;
+    if (!ReadDnsName(data, size, &offset, &question.name)) return false;
+    if (size - offset < 4) return false;
+    question.type = ReadU16(data + offset);
+    question.klass = ReadU16(data + offset + 2);
+    offset += 4;
+    out->questions.push_back(std::move(question));
+  }
+  out->answers.clear();
+  out->authority.clear();
+  out->additional.clear();
+  return ReadRecords(data, size, &offset, ancount, &out->answers) &&
+         ReadRecords(data, size, &offset, nscount, &out->authority) &&
+         ReadRecords(data, size, &offset, arcount, &out->additional);
+}
+
+bool DnsCacheLifetime(const uint8_t* data, const DnsMessage& response, uint32_t* ttl,
+                      bool* negative) {
+  if (!response.is_response() || response.truncated() || response.questions.size() != 1) {
+    return false;
+  }
+  uint8_t rcode = response.rcode();
+  if (rcode != kDnsRcodeNoError && rcode != kDnsRcodeNxDomain) return false;
+  const DnsQuestion& question = response.questions[0];
+  bool answered = false;
+  uint32_t lifetime = UINT32_MAX;
+  for (const auto& record : response.answers) {
+    lifetime = std::min(lifetime, record.ttl);
+    if (record.type == question.type) answered = true;
+  }
+  if (rcode == kDnsRcodeNoError && answered) {
+    *negative = false;
+    *ttl = lifetime;
+    return true;
+  }
+  // NXDOMAIN, or NODATA (possibly after a CNAME chain).
+  for (const auto& record : response.authority) {
+    if (record.type != kDnsTypeSoa || record.rdata_length < 22) continue;
+    // MINIMUM is the last field of the SOA data.
+    uint32_t minimum = ReadU32(data + record.rdata_offset + record.rdata_length - 4);
+    *negative = true;
+    *ttl = std::min({lifetime, record.ttl, minimum});
+    return true;
+  }
+  return false;
+}
+
+void SetDnsId(std::string* message, uint16_t id) {
+  if (message->size() < 2) return;
+  (*message)[0] = static_cast<char>(id >> 8);
+  (*message)[1] = static_cast<char>(id & 0xff);
+}
+
+void AppendDnsName(std::string* out, const std::string& name) {
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t dot = name.find('.', start);
+    if (dot == std::string::npos) dot = name.size();
+    size_t length = std::min<size_t>(dot - start, 63);
+    out->push_back(static_cast<char>(length));
+    out->append(name, start, length);
+    start = dot + 1;
+  }
+  out->push_back('\0');
+}
+
+std::string BuildDnsError(const DnsMessage& query, uint8_t rcode) {
+  std::string out;
+  PutU16(&out, query.id);
+  // QR, the query's opcode and RD, RA, and the new rcode.
+  PutU16(&out, static_cast<uint16_t>(0x8000 | (query.flags & 0x7900) | 0x0080 | (rcode & 0x0f)));
+  PutU16(&out, query.questions.empty() ? 0 : 1);
+  PutU16(&out, 0);
+  PutU16(&out, 0);
+  PutU16(&out, 0);
+  if (!query.questions.empty()) {
+    AppendDnsName(&out, query.questions[0].name);
+    PutU16(&out, query.questions[0].type);
+    PutU16(&out, query.questions[0].klass);
+  }
+  return out;
+}
+
+std::string BuildDnsQuery(uint16_t id, const DnsQuestion& question,
+                          uint16_t udp_payload_size) {
+  std::string out;
+  PutU16(&out, id);
+  PutU16(&out, 0x0100);  // RD
+  PutU16(&out, 1);
+  PutU16(&out, 0);
+  PutU16(&out, 0);
+  PutU16(&out, udp_payload_size ? 1 : 0);
+  AppendDnsName(&out, question.name);
+  PutU16(&out, question.type);
+  PutU16(&out, question.klass);
+  if (udp_payload_size) {
+    // Root name, OPT, payload size as class, zero TTL and no options.
+    out.push_back('\0');
+    PutU16(&out, kDnsTypeOpt);
+    PutU16(&out, udp_payload_size);
+    out.append(6, '\0');
+  }
+  return out;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,93 @@
+#ifndef FLUTTER_PLUGIN_DNS_MESSAGE_H_
+#define FLUTTER_PLUGIN_DNS_MESSAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vpn_plugin {
+
+constexpr uint16_t kDnsTypeA = 1;
+constexpr uint16_t kDnsTypeCname = 5;
+constexpr uint16_t kDnsTypeSoa = 6;
+constexpr uint16_t kDnsTypeAaaa = 28;
+constexpr uint16_t kDnsTypeOpt = 41;
+constexpr uint16_t kDnsClassIn = 1;
+
+constexpr uint8_t kDnsRcodeNoError = 0;
+constexpr uint8_t kDnsRcodeFormErr = 1;
+constexpr uint8_t kDnsRcodeServFail = 2;
+constexpr uint8_t kDnsRcodeNxDomain = 3;
+constexpr uint8_t kDnsRcodeRefused = 5;
+
+constexpr size_t kDnsHeaderSize = 12;
+
+struct DnsQuestion {
+  // Lowercase, without the trailing dot; empty for the root.
+  std::string name;
+  uint16_t type = 0;
+  uint16_t klass = 0;
+
+  bool operator==(const DnsQuestion& other) const {
+    return type == other.type && klass == other.klass && name == other.name;
+  }
+};
+
+// A resource record. Offsets point into the message it was parsed from so
+// the TTL can be rewritten and the data decoded in place.
+struct DnsRecord {
+  std::string name;
+  uint16_t type = 0;
+  uint16_t klass = 0;
+  uint32_t ttl = 0;
+  size_t ttl_offset = 0;
+  size_t rdata_offset = 0;
+  uint16_t rdata_length = 0;
+};
+
+// Parsed view of a DNS message (RFC 1035 section 4).
+struct DnsMessage {
+  uint16_t id = 0;
+  uint16_t flags = 0;
+  std::vector<DnsQuestion> questions;
+  std::vector<DnsRecord> answers;
+  std::vector<DnsRecord> authority;
+  std::vector<DnsRecord> additional;
+
+  bool is_response() const { return (flags & 0x8000) != 0; }
+  bool truncated() const { return (flags & 0x0200) != 0; }
+  uint8_t rcode() const { return flags & 0x000f; }
+
+  // Returns false if the message is truncated or malformed.
+  static bool Parse(const uint8_t* data, size_t size, DnsMessage* out);
+};
+
+// Reads a possibly compressed name at |*offset| and advances it past the
+// name as it appears in place. The result is lowercase without the
+// trailing dot.
+bool ReadDnsName(const uint8_t* data, size_t size, size_t* offset, std::string* out);
+
+// How long a response may be cached: the smallest answer TTL, or for
+// NXDOMAIN and NODATA the SOA TTL capped by its minimum field (RFC 2308).
+// Returns false for responses that must not be cached. |data| is the
+// message |response| was parsed from.
+bool DnsCacheLifetime(const uint8_t* data, const DnsMessage& response, uint32_t* ttl,
+                      bool* negative);
+
+void SetDnsId(std::string* message, uint16_t id);
+
+// Builds a header-and-question response to |query| with |rcode|.
+std::string BuildDnsError(const DnsMessage& query, uint8_t rcode);
+
+// Builds a recursive query for |question| with the given id. A non-zero
+// |udp_payload_size| adds an EDNS(0) OPT record advertising it.
+std::string BuildDnsQuery(uint16_t id, const DnsQuestion& question,
+                          uint16_t udp_payload_size = 0);
+
+// Appends |name| in uncompressed wire format.
+void AppendDnsName(std::string* out, const std::string& name);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_DNS_MESSAGE_H_
@@ -0,0 +1,192 @@
+#include "domain_matcher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr size_t kMaxDomain = 253;
+// Edge lists longer than this are searched by bisection.
+constexpr uint16_t kScanEdges = 16;
+
+inline uint8_t Lower(char c) {
+  uint8_t byte = static_cast<uint8_t>(c);
+  return byte >= 'A' && byte <= 'Z' ? static_cast<uint8_t>(byte + ('a' - 'A')) : byte;
+}
+
+}  // namespace
+
+std::string NormalizeDomain(const std::string& domain) {
+  std::string out;
+  out.reserve(domain.size());
+  for (char c : domain) out.push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+  if (!out.empty() && out.back() == '.') out.pop_back();
+  return out;
+}
+
+DomainMatcher::DomainMatcher() : states_(1) { std::fill(std::begin(root_), std::end(root_), 0); }
+
+DomainMatcher::DomainMatcher(const std::vector<std::string>& patterns) : DomainMatcher() {
+  // The trie is built with a child list per state, then flattened.
+  std::vector<std::vector<std::pair<uint8_t, uint32_t>>> children(1);
+  for (const auto& raw : patterns) {
+    std::string pattern = NormalizeDomain(raw);
+    Kind kind;
+    std::string body;
+    if (pattern.size() > 2 && pattern.front() == '*' && pattern.back() == '*') {
+      kind = kKeyword;
+      body = pattern.substr(1, pattern.size() - 2);
+    } else if (pattern.compare(0, 2, "*.") == 0) {
+      // The dot stays, so the name itself does not match.
+      kind = kSuffix;
+      body = pattern.substr(1);
+    } else {
+      kind = kExact;
+      body = pattern.compare(0, 4, "www.") == 0 ? pattern.substr(4) : pattern;
+    }
+    if (body.empty() || body.size() > kMaxDomain) continue;
+
+    uint32_t state = 0;
+    for (auto it = body.rbegin(); it != body.rend(); ++it) {
+      uint8_t byte = static_cast<uint8_t>(*it);
+      auto& list = children[state];
+      auto edge = std::find_if(list.begin(), list.end(),
+                               [byte](const std::pair<uint8_t, uint32_t>& e) {
+                                 return e.first == byte;
+                               });
+      if (edge != list.end()) {
+        state = edge->second;
+        continue;
+      }
+      uint32_t next = static_cast<uint32_t>(states_.size());
+      list.emplace_back(byte, next);
+      states_.emplace_back();
+      states_[next].depth = static_cast<uint8_t>(states_[state].depth + 1);
+      children.emplace_back();
+      state = next;
+    }
+    states_[state].kinds |= kind;
+    has_keywords_ = has_keywords_ || kind == kKeyword;
+    patterns_++;
+  }
+
+  // Renumbered breadth first, so that the shallow states every lookup
+  // passes through share cache lines.
+  std::vector<uint32_t> order;
+  std::vector<uint32_t> renumbered(states_.size());
+  order.reserve(states_.size());
+  order.push_back(0);
+  for (size_t head = 0; head < order.size(); head++) {
+    auto& list = children[order[head]];
+    std::sort(list.begin(), list.end());
+    for (const auto& edge : list) {
+      renumbered[edge.second] = static_cast<uint32_t>(order.size());
+      order.push_back(edge.second);
+    }
+  }
+  std::vector<State> built(states_.size());
+  labels_.reserve(states_.size() - 1);
+  targets_.reserve(states_.size() - 1);
+  for (size_t i = 0; i < order.size(); i++) {
+    auto& list = children[order[i]];
+    built[i] = states_[order[i]];
+    built[i].first_edge = static_cast<uint32_t>(labels_.size());
+    built[i].edges = static_cast<uint16_t>(list.size());
+    for (const auto& edge : list) {
+      labels_.push_back(edge.first);
+      targets_.push_back(renumbered[edge.second]);
+    }
+    std::vector<std::pair<uint8_t, uint32_t>>().swap(list);
+  }
+  states_.swap(built);
+  for (uint16_t e = 0; e < states_[0].edges; e++) root_[labels_[e]] = targets_[e];
+  if (!has_keywords_) return;
+
+  // Failure links, breadth first so that every state's link is set before
+  // its children's.
+  std::vector<uint32_t> queue;
+  queue.reserve(states_.size());
+  for (uint16_t e = 0; e < states_[0].edges; e++) queue.push_back(targets_[e]);
+  for (size_t head = 0; head < queue.size(); head++) {
+    const State& parent = states_[queue[head]];
+    for (uint16_t e = 0; e < parent.edges; e++) {
+      uint8_t byte = labels_[parent.first_edge + e];
+      uint32_t child = targets_[parent.first_edge + e];
+      uint32_t fail = Step(parent.fail, byte);
+      states_[child].fail = fail;
+      states_[child].output = states_[fail].kinds ? fail : states_[fail].output;
+      queue.push_back(child);
+    }
+  }
+}
+
+uint32_t DomainMatcher::Child(uint32_t state, uint8_t byte) const {
+  if (state == 0) return root_[byte];
+  const State& s = states_[state];
+  const uint8_t* labels = labels_.data() + s.first_edge;
+  if (s.edges > kScanEdges) {
+    const uint8_t* it = std::lower_bound(labels, labels + s.edges, byte);
+    return it != labels + s.edges && *it == byte ? targets_[s.first_edge + (it - labels)] : 0;
+  }
+  for (uint16_t e = 0; e < s.edges; e++) {
+    if (labels[e] == byte) return targets_[s.first_edge + e];
+    if (labels[e] > byte) break;
+  }
+  return 0;
+}
+
+uint32_t DomainMatcher::Step(uint32_t state, uint8_t byte) const {
+  while (true) {
+    uint32_t next = Child(state, byte);
+    if (next || state == 0) return next;
+    state = states_[state].fail;
+  }
+}
+
+bool DomainMatcher::Accepts(uint8_t kinds, size_t depth, size_t read, const char* domain,
+                            size_t size) {
+  if (kinds & kKeyword) return true;
+  // The other kinds are anchored at the end of the domain.
+  if (depth != read) return false;
+  if (kinds & kSuffix) return true;
+  return read == size || (read + 4 == size && Lower(domain[0]) == 'w' &&
+                          Lower(domain[1]) == 'w' && Lower(domain[2]) == 'w' && domain[3] == '.');
+}
+
+bool DomainMatcher::Matches(const std::string& domain) const {
+  if (patterns_ == 0) return false;
+  const char* data = domain.data();
+  size_t size = domain.size();
+  if (size > 0 && data[size - 1] == '.') size--;
+
+  uint32_t state = 0;
+  if (!has_keywords_) {
+    for (size_t read = 1; read <= size; read++) {
+      state = Child(state, Lower(data[size - read]));
+      if (state == 0) return false;
+      uint8_t kinds = states_[state].kinds;
+      if (kinds && Accepts(kinds, read, read, data, size)) return true;
+    }
+    return false;
+  }
+  for (size_t read = 1; read <= size; read++) {
+    state = Step(state, Lower(data[size - read]));
+    for (uint32_t out = states_[state].kinds ? state : states_[state].output; out;
+         out = states_[out].output) {
+      if (Accepts(states_[out].kinds, states_[out].depth, read, data, size)) return true;
+    }
+  }
+  return false;
+}
+
+MemoryUsage DomainMatcher::memory_usage() const {
+  MemoryUsage usage;
+  usage.bytes = HeapBytes(states_) + HeapBytes(labels_) + HeapBytes(targets_);
+  usage.objects = patterns_;
+  return usage;
+}
+
+}  // namespace vpn_plugin
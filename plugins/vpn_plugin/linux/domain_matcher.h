@@ -0,0 +1,80 @@
+#ifndef FLUTTER_PLUGIN_DOMAIN_MATCHER_H_
+#define FLUTTER_PLUGIN_DOMAIN_MATCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memory_usage.h"
+
+namespace vpn_plugin {
+
+// Matches a domain against every domain rule of a rule set in one pass
+// over its bytes. Patterns are
+//   "example.com"    example.com and www.example.com
+//   "*.example.com"  names under example.com, but not example.com itself
+//   "*word*"         names with "word" anywhere in them
+// and compare without regard to case or a trailing dot.
+//
+// The patterns are reversed into one Aho-Corasick automaton and the domain
+// is read last byte first, so the first two kinds are prefixes of what is
+// read and only count when they start at its first byte; keywords count
+// anywhere. Without keywords no match can start later, so the scan is a
+// plain trie walk that stops at the first byte without an edge.
+//
+// States are 16 bytes, with their edges in two arrays, labels and targets,
+// sorted by label, so that finding an edge scans a few bytes. The root's
+// edges are a table of 256, as it is where most mismatches land.
+class DomainMatcher {
+ public:
+  DomainMatcher();
+  explicit DomainMatcher(const std::vector<std::string>& patterns);
+
+  bool Matches(const std::string& domain) const;
+
+  bool empty() const { return patterns_ == 0; }
+  size_t patterns() const { return patterns_; }
+  size_t states() const { return states_.size(); }
+  bool has_keywords() const { return has_keywords_; }
+  MemoryUsage memory_usage() const;
+
+ private:
+  enum Kind : uint8_t { kExact = 1, kSuffix = 2, kKeyword = 4 };
+
+  struct State {
+    uint32_t first_edge = 0;
+    // Longest proper suffix of this state's string that is also a state,
+    // and the nearest state along those links that ends a pattern. Only
+    // set when there are keywords.
+    uint32_t fail = 0;
+    uint32_t output = 0;
+    uint16_t edges = 0;
+    // Bytes from the root; no domain is longer than 253.
+    uint8_t depth = 0;
+    uint8_t kinds = 0;
+  };
+
+  // Child of |state| by |byte|, or 0 for none.
+  uint32_t Child(uint32_t state, uint8_t byte) const;
+  // Child by |byte|, following failure links when there is none.
+  uint32_t Step(uint32_t state, uint8_t byte) const;
+  // Whether a pattern of |kinds| ending after |read| of the |size| bytes
+  // of |domain|, |depth| long, matches the domain.
+  static bool Accepts(uint8_t kinds, size_t depth, size_t read, const char* domain,
+                      size_t size);
+
+  std::vector<State> states_;
+  std::vector<uint8_t> labels_;
+  std::vector<uint32_t> targets_;
+  uint32_t root_[256];
+  size_t patterns_ = 0;
+  bool has_keywords_ = false;
+};
+
+// Lowercases and strips a trailing dot so rule and flow domains compare equal.
+std::string NormalizeDomain(const std::string& domain);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_DOMAIN_MATCHER_H_
@@ -0,0 +1,246 @@
+#include "domain_table.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vpn_plugin {
+
+namespace {
+
+// CNAME chains longer than this are not followed.
+constexpr int kMaxChain = 8;
+
+}  // namespace
+
+DomainTable::DomainTable(DomainTableOptions options)
+    : options_(options),
+      buckets_per_shard_(std::max<size_t>(
+          1, options.capacity / std::max<size_t>(1, options.shards) / kBucketSize)),
+      shards_(new Shard[std::max<size_t>(1, options.shards)]) {
+  options_.shards = std::max<size_t>(1, options_.shards);
+  for (size_t i = 0; i < options_.shards; i++) {
+    shards_[i].slots.assign(buckets_per_shard_ * kBucketSize, Slot());
+  }
+}
+
+void DomainTable::MapAddress(const IpAddress& ip, uint8_t* out) {
+  if (ip.is_v4()) {
+    memset(out, 0, 10);
+    out[10] = 0xff;
+    out[11] = 0xff;
+    memcpy(out + 12, ip.bytes, 4);
+  } else {
+    memcpy(out, ip.bytes, 16);
+  }
+}
+
+uint64_t DomainTable::Hash(const uint8_t* address) {
+  uint64_t high;
+  uint64_t low;
+  memcpy(&high, address, 8);
+  memcpy(&low, address + 8, 8);
+  // Multiply-xorshift mix of both halves (as in splitmix64).
+  uint64_t hash = (low ^ (high * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 31;
+  hash *= 0x94d049bb133111ebull;
+  return hash ^ (hash >> 29);
+}
+
+DomainTable::Slot* DomainTable::Probe(const Shard& shard, const uint8_t* address,
+                                      uint64_t hash, Slot** victim) const {
+  // Two candidate buckets per address; the entry may be in either.
+  size_t buckets[2] = {static_cast<size_t>(hash >> 8) % buckets_per_shard_,
+                       static_cast<size_t>(hash >> 36) % buckets_per_shard_};
+  Slot* slots = const_cast<Slot*>(shard.slots.data());
+  Slot* oldest = nullptr;
+  Slot* free_slot = nullptr;
+  size_t most_free = 0;
+  for (size_t bucket : buckets) {
+    Slot* begin = slots + bucket * kBucketSize;
+    Slot* first_free = nullptr;
+    size_t free_count = 0;
+    for (Slot* slot = begin; slot != begin + kBucketSize; slot++) {
+      if (!slot->name) {
+        if (!first_free) first_free = slot;
+        free_count++;
+      } else if (memcmp(slot->address, address, 16) == 0) {
+        return slot;
+      } else if (!oldest || slot->expires_s < oldest->expires_s) {
+        oldest = slot;
+      }
+    }
+    // New entries go to the emptier bucket, which keeps both from
+    // overflowing until the table is nearly full.
+    if (free_count > most_free) {
+      most_free = free_count;
+      free_slot = first_free;
+    }
+  }
+  if (victim) *victim = free_slot ? free_slot : oldest;
+  return nullptr;
+}
+
+uint32_t DomainTable::AcquireName(Shard& shard, const std::string& domain) {
+  auto it = shard.name_index.find(domain);
+  uint32_t index;
+  if (it != shard.name_index.end()) {
+    index = it->second;
+  } else {
+    if (!shard.free_names.empty()) {
+      index = shard.free_names.back();
+      shard.free_names.pop_back();
+    } else {
+      index = static_cast<uint32_t>(shard.names.size());
+      shard.names.emplace_back();
+    }
+    it = shard.name_index.emplace(domain, index).first;
+    // Keys of a node-based map stay put, so the name can point at them.
+    shard.names[index].text = &it->first;
+  }
+  shard.names[index].refs++;
+  return index + 1;
+}
+
+void DomainTable::ReleaseName(Shard& shard, uint32_t name) {
+  Name& entry = shard.names[name - 1];
+  if (--entry.refs > 0) return;
+  shard.name_index.erase(*entry.text);
+  entry.text = nullptr;
+  shard.free_names.push_back(name - 1);
+}
+
+void DomainTable::Insert(const IpAddress& ip, const std::string& domain, uint32_t ttl,
+                         int64_t now_ms) {
+  if (!ip.is_valid() || domain.empty()) return;
+  uint8_t address[16];
+  MapAddress(ip, address);
+  uint64_t hash = Hash(address);
+  ttl = std::min(std::max(ttl, options_.min_ttl), options_.max_ttl);
+  uint32_t now_s = static_cast<uint32_t>(now_ms / 1000);
+  uint32_t expires_s = now_s + ttl;
+
+  Shard& shard = shards_[hash % options_.shards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  stats_.learned++;
+  Slot* victim = nullptr;
+  Slot* existing = Probe(shard, address, hash, &victim);
+  if (existing) {
+    if (*shard.names[existing->name - 1].text != domain) {
+      uint32_t name = AcquireName(shard, domain);
+      ReleaseName(shard, existing->name);
+      existing->name = name;
+    }
+    existing->expires_s = std::max(existing->expires_s, expires_s);
+    return;
+  }
+  if (victim->name) {
+    if (victim->expires_s > now_s) stats_.evicted++;
+    ReleaseName(shard, victim->name);
+  } else {
+    shard.used++;
+  }
+  memcpy(victim->address, address, 16);
+  victim->name = AcquireName(shard, domain);
+  victim->expires_s = expires_s;
+}
+
+size_t DomainTable::Learn(const uint8_t* response, size_t size, const DnsMessage& message,
+                          int64_t now_ms) {
+  if (!message.is_response() || message.rcode() != kDnsRcodeNoError ||
+      message.questions.size() != 1 || message.answers.empty()) {
+    return 0;
+  }
+  const std::string& domain = message.questions[0].name;
+  // Owner names that lead back to the question, with the smallest TTL seen
+  // on the way there.
+  std::vector<std::pair<std::string, uint32_t>> owners = {{domain, UINT32_MAX}};
+  for (int round = 0; round < kMaxChain; round++) {
+    bool grew = false;
+    for (const auto& record : message.answers) {
+      if (record.type != kDnsTypeCname) continue;
+      auto owner = std::find_if(owners.begin(), owners.end(),
+                                [&](const std::pair<std::string, uint32_t>& known) {
+                                  return known.first == record.name;
+                                });
+      if (owner == owners.end()) continue;
+      size_t offset = record.rdata_offset;
+      std::string target;
+      if (!ReadDnsName(response, size, &offset, &target)) continue;
+      bool known = std::any_of(owners.begin(), owners.end(),
+                               [&](const std::pair<std::string, uint32_t>& entry) {
+                                 return entry.first == target;
+                               });
+      if (known) continue;
+      owners.emplace_back(target, std::min(owner->second, record.ttl));
+      grew = true;
+    }
+    if (!grew) break;
+  }
+
+  size_t learned = 0;
+  for (const auto& record : message.answers) {
+    IpAddress ip;
+    if (record.type == kDnsTypeA && record.rdata_length == 4) {
+      ip = IpAddress::FromV4(response + record.rdata_offset);
+    } else if (record.type == kDnsTypeAaaa && record.rdata_length == 16) {
+      ip = IpAddress::FromV6(response + record.rdata_offset);
+    } else {
+      continue;
+    }
+    for (const auto& owner : owners) {
+      if (owner.first != record.name) continue;
+      Insert(ip, domain, std::min(owner.second, record.ttl), now_ms);
+      learned++;
+      break;
+    }
+  }
+  return learned;
+}
+
+bool DomainTable::Find(const IpAddress& ip, int64_t now_ms, std::string* domain) const {
+  if (!ip.is_valid()) return false;
+  uint8_t address[16];
+  MapAddress(ip, address);
+  uint64_t hash = Hash(address);
+  uint32_t now_s = static_cast<uint32_t>(now_ms / 1000);
+  const Shard& shard = shards_[hash % options_.shards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const Slot* slot = Probe(shard, address, hash, nullptr);
+  if (!slot || slot->expires_s <= now_s) {
+    stats_.misses++;
+    return false;
+  }
+  *domain = *shard.names[slot->name - 1].text;
+  stats_.hits++;
+  return true;
+}
+
+bool DomainTable::Attribute(FlowTarget* target, int64_t now_ms) const {
+  if (!target->domain.empty() || !target->ip.is_valid()) return false;
+  return Find(target->ip, now_ms, &target->domain);
+}
+
+size_t DomainTable::size() const {
+  size_t total = 0;
+  for (size_t i = 0; i < options_.shards; i++) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    total += shards_[i].used;
+  }
+  return total;
+}
+
+MemoryUsage DomainTable::memory_usage() const {
+  MemoryUsage usage;
+  usage.bytes = options_.shards * sizeof(Shard);
+  for (size_t i = 0; i < options_.shards; i++) {
+    const Shard& shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    usage.bytes += HeapBytes(shard.slots) + HeapBytes(shard.names) +
+                   HeapBytes(shard.free_names) + HeapBytes(shard.name_index);
+    for (const auto& name : shard.name_index) usage.bytes += HeapBytes(name.first);
+    usage.objects += shard.used;
+  }
+  return usage;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,114 @@
+#ifndef FLUTTER_PLUGIN_DOMAIN_TABLE_H_
+#define FLUTTER_PLUGIN_DOMAIN_TABLE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "dns_message.h"
+#include "memory_usage.h"
+#include "net_address.h"
+#include "routing_policy.h"
+
+namespace vpn_plugin {
+
+struct DomainTableOptions {
+  // Total addresses remembered across all shards.
+  size_t capacity = 256 * 1024;
+  size_t shards = 16;
+  // Record TTLs are clamped into [min_ttl, max_ttl]. The floor covers
+  // clients that keep using an address after its TTL ran out.
+  uint32_t min_ttl = 300;
+  uint32_t max_ttl = 24 * 3600;
+};
+
+struct DomainTableStats {
+  std::atomic<uint64_t> learned{0};
+  std::atomic<uint64_t> evicted{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+};
+
+// Maps destination addresses back to the domain they were resolved from,
+// learned from the DNS answers the client received. Used at flow setup so
+// domain rules also apply to connections that only carry an address.
+//
+// Slots are 24 bytes: the address (IPv4 stored v4-mapped), an index into a
+// per-shard table of interned domain names, and an expiry in seconds. They
+// are grouped into small buckets that are searched linearly, and every
+// address may live in either of two buckets. When both are full the entry
+// closest to expiry is replaced, so the table never grows past its
+// capacity. Each shard has its own lock.
+class DomainTable {
+ public:
+  explicit DomainTable(DomainTableOptions options = DomainTableOptions());
+
+  DomainTable(const DomainTable&) = delete;
+  DomainTable& operator=(const DomainTable&) = delete;
+
+  // Remembers that |ip| belongs to |domain|, which must already be
+  // normalised, for |ttl| seconds.
+  void Insert(const IpAddress& ip, const std::string& domain, uint32_t ttl, int64_t now_ms);
+  // Records every A and AAAA record of a successful response under the
+  // question name, following CNAME chains. |message| is the parsed form of
+  // the |size| bytes at |response|. Returns the number of addresses
+  // recorded.
+  size_t Learn(const uint8_t* response, size_t size, const DnsMessage& message,
+               int64_t now_ms);
+  // Returns false if |ip| is unknown or its entry has expired.
+  bool Find(const IpAddress& ip, int64_t now_ms, std::string* domain) const;
+  // Fills in the domain of an address-only |target|. Returns true if it
+  // was found.
+  bool Attribute(FlowTarget* target, int64_t now_ms) const;
+
+  size_t size() const;
+  // Remembered addresses, and the bytes of the slots and interned names.
+  MemoryUsage memory_usage() const;
+  size_t capacity() const { return buckets_per_shard_ * kBucketSize * options_.shards; }
+  const DomainTableStats& stats() const { return stats_; }
+
+ private:
+  static constexpr size_t kBucketSize = 8;
+
+  struct Slot {
+    uint8_t address[16];
+    // 1 + index into Shard::names; 0 marks a free slot.
+    uint32_t name;
+    uint32_t expires_s;
+  };
+  static_assert(sizeof(Slot) == 24, "slots should stay compact");
+  struct Name {
+    const std::string* text = nullptr;
+    uint32_t refs = 0;
+  };
+  struct Shard {
+    mutable std::mutex mutex;
+    std::vector<Slot> slots;
+    std::vector<Name> names;
+    std::vector<uint32_t> free_names;
+    std::unordered_map<std::string, uint32_t> name_index;
+    size_t used = 0;
+  };
+
+  static void MapAddress(const IpAddress& ip, uint8_t* out);
+  static uint64_t Hash(const uint8_t* address);
+  // Returns the slot holding |address|, or null. When |victim| is given it
+  // receives the slot a new entry should take.
+  Slot* Probe(const Shard& shard, const uint8_t* address, uint64_t hash, Slot** victim) const;
+  uint32_t AcquireName(Shard& shard, const std::string& domain);
+  void ReleaseName(Shard& shard, uint32_t name);
+
+  DomainTableOptions options_;
+  size_t buckets_per_shard_;
+  std::unique_ptr<Shard[]> shards_;
+  mutable DomainTableStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_DOMAIN_TABLE_H_
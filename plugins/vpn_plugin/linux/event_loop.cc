@@ -0,0 +1,341 @@
+#include "event_loop.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+
+#include "io_uring.h"
+
+namespace vpn_plugin {
+
+namespace {
+constexpr int kMaxEvents = 256;
+constexpr unsigned kUringEntries = 1024;
+// user_data of submissions whose completions nobody waits for, and of the
+// wake fd's poll.
+constexpr uint64_t kIgnoredToken = 0;
+constexpr uint64_t kWakeToken = 1;
+
+// splice() into a socket whose peer has gone raises SIGPIPE, and unlike
+// send() it has no MSG_NOSIGNAL. The signal goes to the thread that made
+// the call, so threads that run loops block it once, and the rest of the
+// process keeps its own disposition.
+void BlockSigpipe() {
+  thread_local bool blocked = false;
+  if (blocked) return;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+  blocked = true;
+}
+}  // namespace
+
+EventLoop::EventLoop(EventLoopBackend backend) {
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (backend == EventLoopBackend::kIoUring && wake_fd_ >= 0) {
+    auto uring = std::make_unique<IoUring>();
+    if (uring->Init(kUringEntries) && uring->SupportsOp(IORING_OP_POLL_ADD) &&
+        uring->SupportsOp(IORING_OP_POLL_REMOVE)) {
+      uring_ = std::move(uring);
+      ArmWakePoll();
+      return;
+    }
+  }
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ >= 0 && wake_fd_ >= 0) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+  }
+}
+
+EventLoop::~EventLoop() {
+  // Closing the ring cancels whatever is still queued on it before the
+  // callbacks, and the buffers they keep alive, are destroyed.
+  uring_.reset();
+  completions_.clear();
+  if (wake_fd_ >= 0) close(wake_fd_);
+  if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+int64_t EventLoop::NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t EventLoop::syscalls() const {
+  return syscalls_.load(std::memory_order_relaxed) + (uring_ ? uring_->syscalls() : 0);
+}
+
+bool EventLoop::Add(int fd, uint32_t events, IoCallback callback) {
+  auto watch = std::make_unique<Watch>(Watch{fd, std::move(callback), true, events, 0});
+  if (uring_) {
+    if (watches_.count(fd) || !ArmPoll(watch.get())) return false;
+    watches_[fd] = std::move(watch);
+    return true;
+  }
+  syscalls_.fetch_add(1, std::memory_order_relaxed);
+  epoll_event ev = {};
+  ev.events = events | EPOLLET;
+  ev.data.ptr = watch.get();
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) return false;
+  watches_[fd] = std::move(watch);
+  return true;
+}
+
+bool EventLoop::Modify(int fd, uint32_t events) {
+  auto it = watches_.find(fd);
+  if (it == watches_.end()) return false;
+  if (uring_) {
+    CancelPoll(it->second->token);
+    it->second->events = events;
+    return ArmPoll(it->second.get());
+  }
+  syscalls_.fetch_add(1, std::memory_order_relaxed);
+  epoll_event ev = {};
+  ev.events = events | EPOLLET;
+  ev.data.ptr = it->second.get();
+  return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::Remove(int fd) {
+  auto it = watches_.find(fd);
+  if (it == watches_.end()) return;
+  if (uring_) {
+    CancelPoll(it->second->token);
+  } else {
+    syscalls_.fetch_add(1, std::memory_order_relaxed);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+  // Events for this fd may still be pending in the current batch, so the
+  // watch is kept alive (and inert) until the batch is dispatched.
+  it->second->active = false;
+  removed_.push_back(std::move(it->second));
+  watches_.erase(it);
+}
+
+void EventLoop::ArmWakePoll() {
+  if (io_uring_sqe* sqe = uring_->GetSqe()) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd_;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = EPOLLIN;
+    sqe->user_data = kWakeToken;
+  }
+}
+
+bool EventLoop::ArmPoll(Watch* watch) {
+  io_uring_sqe* sqe = uring_->GetSqe();
+  if (!sqe) return false;
+  // Multishot polls are edge-triggered unless asked otherwise, like the
+  // epoll backend.
+  watch->token = next_token_++;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = watch->fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = watch->events;
+  sqe->user_data = watch->token;
+  polls_[watch->token] = watch;
+  return true;
+}
+
+void EventLoop::CancelPoll(uint64_t token) {
+  polls_.erase(token);
+  if (io_uring_sqe* sqe = uring_->GetSqe()) {
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = token;
+    sqe->user_data = kIgnoredToken;
+  }
+}
+
+uint64_t EventLoop::AddCompletion(CompletionCallback callback) {
+  uint64_t token = next_token_++;
+  completions_[token] = std::move(callback);
+  return token;
+}
+
+EventLoop::TimerId EventLoop::AddTimer(int64_t delay_ms, Task task) {
+  TimerId id = next_timer_id_++;
+  auto it = timers_.emplace(NowMs() + delay_ms, Timer{id, std::move(task)});
+  timer_index_[id] = it;
+  return id;
+}
+
+void EventLoop::CancelTimer(TimerId id) {
+  auto it = timer_index_.find(id);
+  if (it == timer_index_.end()) return;
+  timers_.erase(it->second);
+  timer_index_.erase(it);
+}
+
+void EventLoop::Post(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  uint64_t one = 1;
+  ssize_t ignored = write(wake_fd_, &one, sizeof(one));
+  (void)ignored;
+}
+
+void EventLoop::Stop() {
+  stopped_ = true;
+  uint64_t one = 1;
+  ssize_t ignored = write(wake_fd_, &one, sizeof(one));
+  (void)ignored;
+}
+
+void EventLoop::Run() {
+  loop_thread_ = std::this_thread::get_id();
+  while (!stopped_) RunOnce(-1);
+  stopped_ = false;
+}
+
+int EventLoop::NextTimeoutMs(int requested) const {
+  if (timers_.empty()) return requested;
+  int64_t until = timers_.begin()->first - NowMs();
+  if (until < 0) until = 0;
+  if (requested >= 0 && requested < until) return requested;
+  return static_cast<int>(until);
+}
+
+void EventLoop::RunOnce(int timeout_ms) {
+  loop_thread_ = std::this_thread::get_id();
+  BlockSigpipe();
+  if (uring_) {
+    RunOnceUring(timeout_ms);
+    return;
+  }
+  syscalls_.fetch_add(1, std::memory_order_relaxed);
+  epoll_event events[kMaxEvents];
+  int n = epoll_wait(epoll_fd_, events, kMaxEvents, NextTimeoutMs(timeout_ms));
+  for (int i = 0; i < n; i++) {
+    auto* watch = static_cast<Watch*>(events[i].data.ptr);
+    if (!watch) {
+      uint64_t count;
+      while (read(wake_fd_, &count, sizeof(count)) > 0) {
+      }
+      continue;
+    }
+    if (watch->active) watch->callback(events[i].events);
+  }
+  removed_.clear();
+  RunExpiredTimers();
+  RunPostedTasks();
+}
+
+void EventLoop::RunOnceUring(int timeout_ms) {
+  uring_->SubmitAndWait(1, NextTimeoutMs(timeout_ms));
+  uring_->DrainCompletions([this](const io_uring_cqe& cqe) {
+    DispatchCompletion(cqe.user_data, cqe.res, cqe.flags);
+  });
+  removed_.clear();
+  RunExpiredTimers();
+  RunPostedTasks();
+  // Whatever the callbacks queued is submitted by the next wait, in the
+  // same system call.
+}
+
+void EventLoop::DispatchCompletion(uint64_t token, int32_t result, uint32_t flags) {
+  bool more = flags & IORING_CQE_F_MORE;
+  if (token == kIgnoredToken) return;
+  if (token == kWakeToken) {
+    uint64_t count;
+    while (read(wake_fd_, &count, sizeof(count)) > 0) {
+    }
+    if (!more) ArmWakePoll();
+    return;
+  }
+  auto poll = polls_.find(token);
+  if (poll != polls_.end()) {
+    Watch* watch = poll->second;
+    if (!more) {
+      // The kernel ended the multishot poll (e.g. on completion queue
+      // overflow); arm a new one, which reports the fd if it is ready.
+      polls_.erase(poll);
+      ArmPoll(watch);
+    }
+    if (result > 0 && watch->active) watch->callback(static_cast<uint32_t>(result));
+    return;
+  }
+  auto completion = completions_.find(token);
+  if (completion == completions_.end()) return;
+  if (more) {
+    completion->second(result, flags);
+    return;
+  }
+  CompletionCallback callback = std::move(completion->second);
+  completions_.erase(completion);
+  callback(result, flags);
+}
+
+void EventLoop::RunExpiredTimers() {
+  int64_t now = NowMs();
+  while (!timers_.empty() && timers_.begin()->first <= now) {
+    auto it = timers_.begin();
+    Task task = std::move(it->second.task);
+    timer_index_.erase(it->second.id);
+    timers_.erase(it);
+    task();
+  }
+}
+
+void EventLoop::RunPostedTasks() {
+  std::vector<Task> tasks;
+  {
+    std::lock_guard<std::mutex> lock(tasks_mutex_);
+    tasks.swap(tasks_);
+  }
+  for (auto& task : tasks) task();
+  removed_.clear();
+}
+
+void LoopThread::Start(int cpu) {
+  if (thread_.joinable()) return;
+  thread_ = std::thread([this, cpu]() {
+    if (cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      // Best effort: outside the process's allowed CPUs the thread stays
+      // unpinned.
+      sched_setaffinity(0, sizeof(set), &set);
+    }
+    loop_.Run();
+  });
+}
+
+void LoopThread::Stop() {
+  if (!thread_.joinable()) return;
+  loop_.Stop();
+  thread_.join();
+}
+
+void LoopThread::RunSync(EventLoop::Task task) {
+  if (!thread_.joinable() || loop_.IsLoopThread()) {
+    task();
+    return;
+  }
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+  loop_.Post([&]() {
+    task();
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    cv.notify_one();
+  });
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return done; });
+}
+
+}  // namespace vpn_plugin
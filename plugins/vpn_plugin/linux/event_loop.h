@@ -0,0 +1,157 @@
+#ifndef FLUTTER_PLUGIN_EVENT_LOOP_H_
+#define FLUTTER_PLUGIN_EVENT_LOOP_H_
+
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace vpn_plugin {
+
+class IoUring;
+
+enum class EventLoopBackend {
+  kEpoll,
+  // Waits on an io_uring instead, with fd readiness delivered by multishot
+  // polls, and lets callers queue their own operations on the ring. Falls
+  // back to epoll on kernels that lack what it needs.
+  kIoUring,
+};
+
+// Single-threaded edge-triggered readiness loop over epoll or io_uring. All
+// methods except Post() and Stop() must be called on the thread running
+// Run().
+class EventLoop {
+ public:
+  using IoCallback = std::function<void(uint32_t events)>;
+  using CompletionCallback = std::function<void(int32_t result, uint32_t flags)>;
+  using Task = std::function<void()>;
+  using TimerId = uint64_t;
+
+  static constexpr uint32_t kReadable = EPOLLIN;
+  static constexpr uint32_t kWritable = EPOLLOUT;
+  static constexpr uint32_t kHangup = EPOLLRDHUP | EPOLLHUP;
+  static constexpr uint32_t kError = EPOLLERR;
+
+  explicit EventLoop(EventLoopBackend backend = EventLoopBackend::kEpoll);
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  bool ok() const { return (epoll_fd_ >= 0 || uring_) && wake_fd_ >= 0; }
+  EventLoopBackend backend() const {
+    return uring_ ? EventLoopBackend::kIoUring : EventLoopBackend::kEpoll;
+  }
+
+  // Registers |fd| in edge-triggered mode. The callback must drain the fd
+  // until EAGAIN, or it will not be notified again.
+  bool Add(int fd, uint32_t events, IoCallback callback);
+  bool Modify(int fd, uint32_t events);
+  // Unregisters |fd|. Safe to call from inside any callback, including the
+  // fd's own. Does not close the fd.
+  void Remove(int fd);
+
+  // io_uring backend only (nullptr otherwise): the ring, for callers that
+  // queue their own operations.
+  IoUring* uring() { return uring_.get(); }
+  // Returns the user_data to put in a submission whose completions go to
+  // |callback|. The callback is dropped after a completion without
+  // IORING_CQE_F_MORE, so it must not be used for more than one request.
+  uint64_t AddCompletion(CompletionCallback callback);
+
+  TimerId AddTimer(int64_t delay_ms, Task task);
+  void CancelTimer(TimerId id);
+
+  // Queues |task| to run on the loop thread. Thread-safe.
+  void Post(Task task);
+
+  void Run();
+  // Makes Run() return after the current iteration. Thread-safe.
+  void Stop();
+  // Waits up to |timeout_ms| (-1 for no limit) and dispatches one batch.
+  void RunOnce(int timeout_ms);
+
+  bool IsLoopThread() const { return std::this_thread::get_id() == loop_thread_.load(); }
+  static int64_t NowMs();
+  // Waits and registration changes made by the loop so far, plus whatever
+  // the io_uring backend made for its callers.
+  uint64_t syscalls() const;
+
+ private:
+  struct Watch {
+    int fd;
+    IoCallback callback;
+    bool active;
+    uint32_t events;
+    // user_data of the watch's multishot poll (io_uring backend).
+    uint64_t token;
+  };
+  struct Timer {
+    TimerId id;
+    Task task;
+  };
+
+  void ArmWakePoll();
+  bool ArmPoll(Watch* watch);
+  void CancelPoll(uint64_t token);
+  void RunOnceUring(int timeout_ms);
+  void DispatchCompletion(uint64_t token, int32_t result, uint32_t flags);
+  int NextTimeoutMs(int requested) const;
+  void RunExpiredTimers();
+  void RunPostedTasks();
+
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::unique_ptr<IoUring> uring_;
+  // io_uring user_data -> watch or completion callback.
+  uint64_t next_token_ = 2;
+  std::unordered_map<uint64_t, Watch*> polls_;
+  std::unordered_map<uint64_t, CompletionCallback> completions_;
+  std::atomic<uint64_t> syscalls_{0};
+  std::atomic<bool> stopped_{false};
+  std::atomic<std::thread::id> loop_thread_{};
+
+  std::unordered_map<int, std::unique_ptr<Watch>> watches_;
+  std::vector<std::unique_ptr<Watch>> removed_;
+
+  TimerId next_timer_id_ = 1;
+  std::multimap<int64_t, Timer> timers_;
+  std::unordered_map<TimerId, std::multimap<int64_t, Timer>::iterator> timer_index_;
+
+  std::mutex tasks_mutex_;
+  std::vector<Task> tasks_;
+};
+
+// Owns an EventLoop running on a dedicated thread.
+class LoopThread {
+ public:
+  explicit LoopThread(EventLoopBackend backend = EventLoopBackend::kEpoll) : loop_(backend) {}
+  ~LoopThread() { Stop(); }
+
+  LoopThread(const LoopThread&) = delete;
+  LoopThread& operator=(const LoopThread&) = delete;
+
+  // Starts the loop, on |cpu| only if it is not negative.
+  void Start(int cpu = -1);
+  void Stop();
+  // Runs |task| on the loop thread and blocks until it has finished.
+  void RunSync(EventLoop::Task task);
+
+  EventLoop* loop() { return &loop_; }
+
+ private:
+  EventLoop loop_;
+  std::thread thread_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_EVENT_LOOP_H_
@@ -0,0 +1,219 @@
+#include "flow_table.h"
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr size_t kInitialSlots = 1024;
+
+// Slots for |flows| flows at a load factor of at most 3/4.
+size_t SlotsFor(size_t flows) {
+  size_t slots = 16;
+  while (slots * 3 / 4 < flows) slots *= 2;
+  return slots;
+}
+
+uint64_t Load64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t Mix(uint64_t hash, uint64_t value) {
+  hash ^= value;
+  hash *= 0x9e3779b97f4a7c15ull;
+  return hash ^ (hash >> 29);
+}
+
+}  // namespace
+
+FlowKey FlowKey::FromHeaders(const PacketHeaders& headers) {
+  FlowKey key;
+  memset(&key, 0, sizeof(key));
+  key.family = static_cast<uint8_t>(headers.dst.family);
+  key.protocol = headers.protocol;
+  key.src_port = headers.src_port;
+  key.dst_port = headers.dst_port;
+  memcpy(key.src, headers.src.bytes, headers.src.size());
+  memcpy(key.dst, headers.dst.bytes, headers.dst.size());
+  return key;
+}
+
+IpAddress FlowKey::src_ip() const {
+  return family == AF_INET6 ? IpAddress::FromV6(src) : IpAddress::FromV4(src);
+}
+
+IpAddress FlowKey::dst_ip() const {
+  return family == AF_INET6 ? IpAddress::FromV6(dst) : IpAddress::FromV4(dst);
+}
+
+FlowTable::FlowTable(FlowTableOptions options, ExpiredCallback on_expired)
+    : options_(options),
+      on_expired_(std::move(on_expired)),
+      entries_(std::min(kInitialSlots, SlotsFor(options_.capacity))),
+      mask_(entries_.size() - 1),
+      wheel_(entries_.size()) {
+  if (options_.tick_ms == 0) options_.tick_ms = 1;
+}
+
+uint32_t FlowTable::Hash(const FlowKey& key) {
+  const auto* p = reinterpret_cast<const uint8_t*>(&key);
+  uint64_t hash = 0;
+  for (size_t i = 0; i + 8 <= sizeof(key); i += 8) hash = Mix(hash, Load64(p + i));
+  uint64_t tail = 0;
+  memcpy(&tail, p + sizeof(key) / 8 * 8, sizeof(key) % 8);
+  hash = Mix(hash, tail);
+  return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+uint32_t FlowTable::ToTick(uint64_t now_ms) {
+  if (!started_) {
+    epoch_ms_ = now_ms;
+    started_ = true;
+  }
+  return now_ms <= epoch_ms_ ? 0 : static_cast<uint32_t>((now_ms - epoch_ms_) / options_.tick_ms);
+}
+
+uint32_t FlowTable::TimeoutTicks(const FlowEntry& entry) const {
+  uint32_t ms;
+  if (entry.key.protocol == kIpProtoTcp) {
+    ms = entry.state == kClosing ? options_.tcp_closing_timeout_ms : options_.tcp_timeout_ms;
+  } else if (entry.key.protocol == kIpProtoUdp) {
+    ms = options_.udp_timeout_ms;
+  } else {
+    ms = options_.other_timeout_ms;
+  }
+  return std::max<uint32_t>(1, (ms + options_.tick_ms - 1) / options_.tick_ms);
+}
+
+size_t FlowTable::Probe(const FlowKey& key, uint32_t hash) const {
+  size_t index = hash & mask_;
+  while (entries_[index].state != kEmpty &&
+         (entries_[index].hash != hash || !(entries_[index].key == key))) {
+    index = (index + 1) & mask_;
+  }
+  return index;
+}
+
+FlowEntry* FlowTable::Find(const FlowKey& key) {
+  size_t index = Probe(key, Hash(key));
+  return entries_[index].state == kEmpty ? nullptr : &entries_[index];
+}
+
+FlowEntry* FlowTable::Insert(const FlowKey& key, PacketVerdict verdict, uint64_t now_ms,
+                             bool* inserted) {
+  *inserted = false;
+  uint32_t hash = Hash(key);
+  size_t index = Probe(key, hash);
+  if (entries_[index].state != kEmpty) return &entries_[index];
+  if (count_ >= options_.capacity) return nullptr;
+  if ((count_ + 1) > entries_.size() * 3 / 4) {
+    Grow();
+    index = Probe(key, hash);
+  }
+  uint32_t tick = ToTick(now_ms);
+  FlowEntry& entry = entries_[index];
+  entry.key = key;
+  entry.state = kOpen;
+  entry.verdict = verdict;
+  entry.first_seen = tick;
+  entry.last_seen = tick;
+  entry.packets = 0;
+  entry.hash = hash;
+  entry.bytes = 0;
+  count_++;
+  wheel_.Schedule(static_cast<uint32_t>(index), uint64_t{tick} + TimeoutTicks(entry));
+  *inserted = true;
+  return &entry;
+}
+
+void FlowTable::Touch(FlowEntry* entry, size_t size, uint8_t tcp_flags, uint64_t now_ms) {
+  entry->last_seen = ToTick(now_ms);
+  entry->packets++;
+  entry->bytes += size;
+  if (entry->state == kOpen && entry->key.protocol == kIpProtoTcp &&
+      (tcp_flags & (kTcpFlagFin | kTcpFlagRst))) {
+    // The pending timer is for the longer open timeout; bring it forward.
+    entry->state = kClosing;
+    wheel_.Schedule(static_cast<uint32_t>(entry - entries_.data()),
+                    uint64_t{entry->last_seen} + TimeoutTicks(*entry));
+  }
+}
+
+bool FlowTable::Remove(const FlowKey& key) {
+  size_t index = Probe(key, Hash(key));
+  if (entries_[index].state == kEmpty) return false;
+  RemoveAt(index);
+  return true;
+}
+
+size_t FlowTable::Expire(uint64_t now_ms) {
+  size_t expired = 0;
+  wheel_.Advance(ToTick(now_ms), [this, &expired](uint32_t index) {
+    FlowEntry& entry = entries_[index];
+    // Timers are not moved on every packet; a flow that saw traffic since
+    // gets a new deadline instead.
+    uint64_t deadline = uint64_t{entry.last_seen} + TimeoutTicks(entry);
+    if (deadline > wheel_.now()) {
+      wheel_.Schedule(index, deadline);
+      return;
+    }
+    FlowRecord record;
+    record.key = entry.key;
+    record.verdict = entry.verdict;
+    record.bytes = entry.bytes;
+    record.packets = entry.packets;
+    record.first_seen_ms = epoch_ms_ + uint64_t{entry.first_seen} * options_.tick_ms;
+    record.last_seen_ms = epoch_ms_ + uint64_t{entry.last_seen} * options_.tick_ms;
+    RemoveAt(index);
+    expired++;
+    if (on_expired_) on_expired_(record);
+  });
+  return expired;
+}
+
+void FlowTable::RemoveAt(size_t index) {
+  wheel_.Cancel(static_cast<uint32_t>(index));
+  entries_[index].state = kEmpty;
+  count_--;
+  // Backward-shift deletion: pull later entries of the probe run into the
+  // hole when their home slot is not after it.
+  size_t hole = index;
+  size_t next = index;
+  while (true) {
+    next = (next + 1) & mask_;
+    FlowEntry& entry = entries_[next];
+    if (entry.state == kEmpty) return;
+    size_t home = entry.hash & mask_;
+    if (((next - home) & mask_) >= ((next - hole) & mask_)) {
+      entries_[hole] = entry;
+      wheel_.Move(static_cast<uint32_t>(next), static_cast<uint32_t>(hole));
+      entry.state = kEmpty;
+      hole = next;
+    }
+  }
+}
+
+void FlowTable::Grow() {
+  size_t slots = entries_.size() * 2;
+  if (slots > SlotsFor(options_.capacity)) return;
+  std::vector<FlowEntry> entries(slots);
+  TimerWheel wheel(slots, wheel_.now());
+  size_t mask = slots - 1;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    if (entries_[i].state == kEmpty) continue;
+    size_t index = entries_[i].hash & mask;
+    while (entries[index].state != kEmpty) index = (index + 1) & mask;
+    entries[index] = entries_[i];
+    if (wheel_.scheduled(static_cast<uint32_t>(i))) {
+      wheel.Schedule(static_cast<uint32_t>(index), wheel_.expiry(static_cast<uint32_t>(i)));
+    }
+  }
+  entries_ = std::move(entries);
+  mask_ = mask;
+  wheel_ = std::move(wheel);
+}
+
+}  // namespace vpn_plugin
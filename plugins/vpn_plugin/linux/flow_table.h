@@ -0,0 +1,130 @@
+#ifndef FLUTTER_PLUGIN_FLOW_TABLE_H_
+#define FLUTTER_PLUGIN_FLOW_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "net_address.h"
+#include "packet_headers.h"
+#include "timer_wheel.h"
+
+namespace vpn_plugin {
+
+enum class PacketVerdict : uint8_t { kTunnel = 0, kBypass = 1, kDrop = 2 };
+
+// 5-tuple of a TCP/UDP flow; other protocols leave the ports zero.
+struct FlowKey {
+  uint8_t src[16];
+  uint8_t dst[16];
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t family;
+  uint8_t protocol;
+
+  static FlowKey FromHeaders(const PacketHeaders& headers);
+  IpAddress src_ip() const;
+  IpAddress dst_ip() const;
+
+  bool operator==(const FlowKey& other) const { return memcmp(this, &other, sizeof(*this)) == 0; }
+};
+
+// One slot of the table, exactly one cache line.
+struct alignas(64) FlowEntry {
+  FlowKey key;
+  uint8_t state;
+  PacketVerdict verdict;
+  // Ticks since the table was created.
+  uint32_t first_seen;
+  uint32_t last_seen;
+  uint32_t packets;
+  uint32_t hash;
+  uint64_t bytes;
+};
+static_assert(sizeof(FlowEntry) == 64, "FlowEntry must fill one cache line");
+
+// Final accounting of a flow, reported when it expires. Times are on the
+// EventLoop::NowMs() clock.
+struct FlowRecord {
+  FlowKey key;
+  PacketVerdict verdict = PacketVerdict::kTunnel;
+  uint64_t bytes = 0;
+  uint32_t packets = 0;
+  uint64_t first_seen_ms = 0;
+  uint64_t last_seen_ms = 0;
+  // Filled in by the owner of the table, e.g. from a DomainTable.
+  std::string domain;
+};
+
+struct FlowTableOptions {
+  // Flows beyond this many are not tracked.
+  size_t capacity = 65536;
+  // Idle time after which a flow is forgotten.
+  uint32_t tcp_timeout_ms = 300000;
+  // Applies from the first FIN or RST on.
+  uint32_t tcp_closing_timeout_ms = 10000;
+  uint32_t udp_timeout_ms = 60000;
+  uint32_t other_timeout_ms = 30000;
+  // Expiry granularity.
+  uint32_t tick_ms = 250;
+};
+
+// Open-addressing hash table of flows with linear probing. Idle flows are
+// expired through a TimerWheel that shares the table's slot indices, and
+// deletions shift later entries back instead of leaving tombstones. The
+// table starts small and doubles up to the capacity.
+//
+// Entry pointers are valid until the next Insert(), Remove() or Expire().
+// Not thread-safe.
+class FlowTable {
+ public:
+  using ExpiredCallback = std::function<void(const FlowRecord& record)>;
+
+  // |on_expired| sees every flow that times out; it may be empty.
+  FlowTable(FlowTableOptions options, ExpiredCallback on_expired);
+
+  FlowTable(const FlowTable&) = delete;
+  FlowTable& operator=(const FlowTable&) = delete;
+
+  size_t size() const { return count_; }
+  size_t capacity() const { return options_.capacity; }
+
+  FlowEntry* Find(const FlowKey& key);
+  // Returns the flow for |key|, adding it with |verdict| if it is new and
+  // the table has room; nullptr otherwise. |inserted| tells which happened.
+  FlowEntry* Insert(const FlowKey& key, PacketVerdict verdict, uint64_t now_ms, bool* inserted);
+  // Accounts one packet of |size| bytes to |entry|.
+  void Touch(FlowEntry* entry, size_t size, uint8_t tcp_flags, uint64_t now_ms);
+  // Forgets a flow without reporting it.
+  bool Remove(const FlowKey& key);
+  // Expires the flows idle since before their timeout, reporting each.
+  // Returns how many expired.
+  size_t Expire(uint64_t now_ms);
+
+ private:
+  enum State : uint8_t { kEmpty = 0, kOpen = 1, kClosing = 2 };
+
+  static uint32_t Hash(const FlowKey& key);
+  uint32_t ToTick(uint64_t now_ms);
+  uint32_t TimeoutTicks(const FlowEntry& entry) const;
+  // Index of |key|, or of the empty slot where it would go.
+  size_t Probe(const FlowKey& key, uint32_t hash) const;
+  void RemoveAt(size_t index);
+  void Grow();
+
+  FlowTableOptions options_;
+  ExpiredCallback on_expired_;
+  std::vector<FlowEntry> entries_;
+  size_t mask_;
+  size_t count_ = 0;
+  TimerWheel wheel_;
+  uint64_t epoch_ms_ = 0;
+  bool started_ = false;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_FLOW_TABLE_H_
@@ -0,0 +1,22 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "protocol_sniffer.h"
+
+// libFuzzer entry point: every sniffer reads untrusted bytes straight from
+// the client, so none of them may read out of bounds or return a name that
+// fails validation.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  using vpn_plugin::SniffResult;
+  std::string name;
+  for (auto sniffer : {vpn_plugin::SniffTlsServerName, vpn_plugin::SniffHttpHost,
+                       vpn_plugin::SniffStreamDomain, vpn_plugin::SniffQuicServerName}) {
+    name.clear();
+    if (sniffer(data, size, &name) == SniffResult::kFound &&
+        !vpn_plugin::IsValidSniffedName(name)) {
+      __builtin_trap();
+    }
+  }
+  return 0;
+}
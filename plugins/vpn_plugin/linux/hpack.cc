@@ -0,0 +1,446 @@
+#include "hpack.h"
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+namespace {
+
+// RFC 7541 appendix A.
+const HpackHeader kStaticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+constexpr size_t kStaticTableSize = sizeof(kStaticTable) / sizeof(kStaticTable[0]);
+
+// Per-entry overhead counted against the table size (section 4.1).
+constexpr size_t kEntryOverhead = 32;
+
+struct HuffmanCode {
+  uint32_t code;
+  uint8_t bits;
+};
+
+// Appendix B; index 256 is EOS.
+const HuffmanCode kHuffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Binary decoding tree built from kHuffmanCodes. Leaves carry the symbol.
+class HuffmanTree {
+ public:
+  HuffmanTree() {
+    nodes_.push_back(Node());
+    for (int symbol = 0; symbol < 257; symbol++) {
+      const HuffmanCode& code = kHuffmanCodes[symbol];
+      int node = 0;
+      for (int bit = code.bits - 1; bit >= 0; bit--) {
+        int branch = (code.code >> bit) & 1;
+        if (nodes_[node].child[branch] == 0) {
+          nodes_[node].child[branch] = static_cast<int>(nodes_.size());
+          nodes_.push_back(Node());
+        }
+        node = nodes_[node].child[branch];
+      }
+      nodes_[node].symbol = symbol;
+    }
+  }
+
+  bool Decode(const uint8_t* data, size_t size, std::string* out) const {
+    int node = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < size; i++) {
+      for (int bit = 7; bit >= 0; bit--) {
+        int branch = (data[i] >> bit) & 1;
+        node = nodes_[node].child[branch];
+        if (node == 0) return false;
+        depth++;
+        all_ones = all_ones && branch == 1;
+        int symbol = nodes_[node].symbol;
+        if (symbol >= 0) {
+          // EOS inside the string is a decoding error (section 5.2).
+          if (symbol == 256) return false;
+          out->push_back(static_cast<char>(symbol));
+          node = 0;
+          depth = 0;
+          all_ones = true;
+        }
+      }
+    }
+    // Padding must be a prefix of EOS shorter than a byte.
+    return depth < 8 && all_ones;
+  }
+
+ private:
+  struct Node {
+    int child[2] = {0, 0};
+    int symbol = -1;
+  };
+  std::vector<Node> nodes_;
+};
+
+const HuffmanTree& Tree() {
+  static const HuffmanTree* tree = new HuffmanTree();
+  return *tree;
+}
+
+bool DecodeString(const uint8_t** p, const uint8_t* end, std::string* out) {
+  if (*p >= end) return false;
+  bool huffman = (**p & 0x80) != 0;
+  uint64_t length;
+  if (!HpackDecodeInteger(p, end, 7, &length)) return false;
+  if (length > static_cast<uint64_t>(end - *p)) return false;
+  out->clear();
+  if (huffman) {
+    if (!HpackHuffmanDecode(*p, static_cast<size_t>(length), out)) return false;
+  } else {
+    out->assign(reinterpret_cast<const char*>(*p), static_cast<size_t>(length));
+  }
+  *p += length;
+  return true;
+}
+
+void EncodeString(const std::string& value, std::string* out) {
+  size_t huffman_length = HpackHuffmanEncodedLength(value);
+  if (huffman_length < value.size()) {
+    HpackEncodeInteger(huffman_length, 7, 0x80, out);
+    HpackHuffmanEncode(value, out);
+  } else {
+    HpackEncodeInteger(value.size(), 7, 0x00, out);
+    out->append(value);
+  }
+}
+
+}  // namespace
+
+void HpackEncodeInteger(uint64_t value, int prefix_bits, uint8_t first_byte, std::string* out) {
+  uint64_t max_prefix = (1u << prefix_bits) - 1;
+  if (value < max_prefix) {
+    out->push_back(static_cast<char>(first_byte | value));
+    return;
+  }
+  out->push_back(static_cast<char>(first_byte | max_prefix));
+  value -= max_prefix;
+  while (value >= 128) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool HpackDecodeInteger(const uint8_t** p, const uint8_t* end, int prefix_bits, uint64_t* out) {
+  if (*p >= end) return false;
+  uint64_t max_prefix = (1u << prefix_bits) - 1;
+  uint64_t value = **p & max_prefix;
+  (*p)++;
+  if (value < max_prefix) {
+    *out = value;
+    return true;
+  }
+  // Values are capped well below 2^32; longer encodings are rejected.
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (*p >= end) return false;
+    uint8_t byte = **p;
+    (*p)++;
+    value += static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *out = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t HpackHuffmanEncodedLength(const std::string& input) {
+  uint64_t bits = 0;
+  for (unsigned char c : input) bits += kHuffmanCodes[c].bits;
+  return static_cast<size_t>((bits + 7) / 8);
+}
+
+void HpackHuffmanEncode(const std::string& input, std::string* out) {
+  uint64_t accumulator = 0;
+  int pending = 0;
+  for (unsigned char c : input) {
+    const HuffmanCode& code = kHuffmanCodes[c];
+    accumulator = accumulator << code.bits | code.code;
+    pending += code.bits;
+    while (pending >= 8) {
+      pending -= 8;
+      out->push_back(static_cast<char>(accumulator >> pending));
+    }
+  }
+  if (pending > 0) {
+    // Pad with the most significant bits of EOS (all ones).
+    out->push_back(static_cast<char>(accumulator << (8 - pending) | (0xff >> pending)));
+  }
+}
+
+bool HpackHuffmanDecode(const uint8_t* data, size_t size, std::string* out) {
+  return Tree().Decode(data, size, out);
+}
+
+void HpackDynamicTable::Insert(const std::string& name, const std::string& value) {
+  size_t entry = name.size() + value.size() + kEntryOverhead;
+  if (entry > max_size_) {
+    // An entry larger than the table empties it (section 4.4).
+    Evict(0);
+    return;
+  }
+  Evict(max_size_ - entry);
+  entries_.push_front(HpackHeader{name, value, false});
+  size_ += entry;
+}
+
+void HpackDynamicTable::SetMaxSize(size_t max_size) {
+  max_size_ = max_size;
+  Evict(max_size);
+}
+
+void HpackDynamicTable::Evict(size_t target) {
+  while (size_ > target && !entries_.empty()) {
+    const HpackHeader& last = entries_.back();
+    size_ -= last.name.size() + last.value.size() + kEntryOverhead;
+    entries_.pop_back();
+  }
+}
+
+void HpackEncoder::SetMaxTableSize(size_t size) {
+  // Never use more than the default, whatever the peer allows.
+  size = std::min<size_t>(size, 4096);
+  if (size == table_.max_size() && !pending_size_update_) return;
+  min_size_since_update_ = std::min(min_size_since_update_, size);
+  table_.SetMaxSize(size);
+  pending_size_update_ = true;
+}
+
+size_t HpackEncoder::Find(const std::string& name, const std::string& value,
+                          bool* name_only) const {
+  size_t name_match = 0;
+  for (size_t i = 0; i < kStaticTableSize; i++) {
+    if (kStaticTable[i].name != name) continue;
+    if (kStaticTable[i].value == value) {
+      *name_only = false;
+      return i + 1;
+    }
+    if (name_match == 0) name_match = i + 1;
+  }
+  for (size_t i = 0; i < table_.count(); i++) {
+    const HpackHeader& entry = table_.at(i);
+    if (entry.name != name) continue;
+    if (entry.value == value) {
+      *name_only = false;
+      return kStaticTableSize + i + 1;
+    }
+    if (name_match == 0) name_match = kStaticTableSize + i + 1;
+  }
+  *name_only = true;
+  return name_match;
+}
+
+void HpackEncoder::Encode(const std::vector<HpackHeader>& headers, std::string* out) {
+  if (pending_size_update_) {
+    if (min_size_since_update_ < table_.max_size()) {
+      HpackEncodeInteger(min_size_since_update_, 5, 0x20, out);
+    }
+    HpackEncodeInteger(table_.max_size(), 5, 0x20, out);
+    pending_size_update_ = false;
+    min_size_since_update_ = SIZE_MAX;
+  }
+  for (const auto& header : headers) {
+    bool name_only = false;
+    size_t index = Find(header.name, header.value, &name_only);
+    if (index != 0 && !name_only) {
+      HpackEncodeInteger(index, 7, 0x80, out);
+      continue;
+    }
+    if (header.sensitive) {
+      HpackEncodeInteger(index, 4, 0x10, out);
+    } else {
+      HpackEncodeInteger(index, 6, 0x40, out);
+    }
+    if (index == 0) EncodeString(header.name, out);
+    EncodeString(header.value, out);
+    if (!header.sensitive) table_.Insert(header.name, header.value);
+  }
+}
+
+bool HpackDecoder::Lookup(size_t index, HpackHeader* out) const {
+  if (index == 0) return false;
+  if (index <= kStaticTableSize) {
+    *out = kStaticTable[index - 1];
+    return true;
+  }
+  index -= kStaticTableSize + 1;
+  if (index >= table_.count()) return false;
+  *out = table_.at(index);
+  return true;
+}
+
+bool HpackDecoder::Decode(const uint8_t* data, size_t size, std::vector<HpackHeader>* out) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + size;
+  bool headers_seen = false;
+  while (p < end) {
+    uint8_t first = *p;
+    uint64_t index;
+    HpackHeader header;
+    if (first & 0x80) {
+      // Indexed header field.
+      if (!HpackDecodeInteger(&p, end, 7, &index) || !Lookup(index, &header)) return false;
+      out->push_back(std::move(header));
+      headers_seen = true;
+      continue;
+    }
+    if ((first & 0xe0) == 0x20) {
+      // Table size updates are only allowed before the first field.
+      uint64_t new_size;
+      if (headers_seen || !HpackDecodeInteger(&p, end, 5, &new_size) || new_size > limit_) {
+        return false;
+      }
+      table_.SetMaxSize(static_cast<size_t>(new_size));
+      continue;
+    }
+    bool incremental = (first & 0xc0) == 0x40;
+    int prefix = incremental ? 6 : 4;
+    header.sensitive = (first & 0xf0) == 0x10;
+    if (!HpackDecodeInteger(&p, end, prefix, &index)) return false;
+    if (index == 0) {
+      if (!DecodeString(&p, end, &header.name)) return false;
+    } else {
+      HpackHeader named;
+      if (!Lookup(index, &named)) return false;
+      header.name = std::move(named.name);
+    }
+    if (!DecodeString(&p, end, &header.value)) return false;
+    if (incremental) table_.Insert(header.name, header.value);
+    out->push_back(std::move(header));
+    headers_seen = true;
+  }
+  return true;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,93 @@
+#ifndef FLUTTER_PLUGIN_HPACK_H_
+#define FLUTTER_PLUGIN_HPACK_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace vpn_plugin {
+
+struct HpackHeader {
+  std::string name;
+  std::string value;
+  // Emitted as "never indexed" so intermediaries do not compress it either.
+  bool sensitive = false;
+};
+
+// Dynamic table shared by the encoder and decoder implementations (RFC 7541
+// section 2.3.2). Entry 0 is the most recently inserted.
+class HpackDynamicTable {
+ public:
+  explicit HpackDynamicTable(size_t max_size) : max_size_(max_size) {}
+
+  void Insert(const std::string& name, const std::string& value);
+  void SetMaxSize(size_t max_size);
+
+  size_t max_size() const { return max_size_; }
+  size_t size() const { return size_; }
+  size_t count() const { return entries_.size(); }
+  const HpackHeader& at(size_t index) const { return entries_[index]; }
+
+ private:
+  void Evict(size_t target);
+
+  size_t max_size_;
+  size_t size_ = 0;
+  std::deque<HpackHeader> entries_;
+};
+
+// Per-connection header compressor. The dynamic table persists across header
+// blocks, so fields repeated on every stream (:authority, the proxy
+// credentials, user-agent) shrink to a single byte after the first stream.
+class HpackEncoder {
+ public:
+  HpackEncoder() : table_(4096) {}
+
+  // Applies the peer's SETTINGS_HEADER_TABLE_SIZE. A size update is emitted
+  // at the start of the next header block.
+  void SetMaxTableSize(size_t size);
+
+  void Encode(const std::vector<HpackHeader>& headers, std::string* out);
+
+  const HpackDynamicTable& table() const { return table_; }
+
+ private:
+  // Returns a 1-based HPACK index; |name_only| is set when just the name
+  // matched. Returns 0 if nothing matched.
+  size_t Find(const std::string& name, const std::string& value, bool* name_only) const;
+
+  HpackDynamicTable table_;
+  bool pending_size_update_ = false;
+  size_t min_size_since_update_ = SIZE_MAX;
+};
+
+// Per-connection header decompressor.
+class HpackDecoder {
+ public:
+  explicit HpackDecoder(size_t max_table_size = 4096) : table_(max_table_size), limit_(max_table_size) {}
+
+  // Decodes a complete header block. Returns false on a compression error,
+  // which is fatal for the connection.
+  bool Decode(const uint8_t* data, size_t size, std::vector<HpackHeader>* out);
+
+  const HpackDynamicTable& table() const { return table_; }
+
+ private:
+  bool Lookup(size_t index, HpackHeader* out) const;
+
+  HpackDynamicTable table_;
+  size_t limit_;
+};
+
+// Primitive representations (RFC 7541 sections 5.1, 5.2), exposed for tests.
+void HpackEncodeInteger(uint64_t value, int prefix_bits, uint8_t first_byte, std::string* out);
+bool HpackDecodeInteger(const uint8_t** p, const uint8_t* end, int prefix_bits, uint64_t* out);
+void HpackHuffmanEncode(const std::string& input, std::string* out);
+size_t HpackHuffmanEncodedLength(const std::string& input);
+bool HpackHuffmanDecode(const uint8_t* data, size_t size, std::string* out);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_HPACK_H_
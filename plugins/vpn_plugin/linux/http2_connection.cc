@@ -0,0 +1,565 @@
+#include "http2_connection.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr size_t kReadChunk = 64 * 1024;
+constexpr uint32_t kMaxStreamId = 0x7fffffff;
+
+uint32_t ReadU32(const std::string& data, size_t offset) {
+  const auto* p = reinterpret_cast<const uint8_t*>(data.data() + offset);
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+}  // namespace
+
+Http2Connection::Http2Connection(EventLoop* loop, std::unique_ptr<ByteStream> stream,
+                                 Http2ConnectionOptions options, Listener* listener)
+    : loop_(loop),
+      stream_(std::move(stream)),
+      options_(options),
+      listener_(listener),
+      alive_(std::make_shared<bool>(true)) {}
+
+Http2Connection::~Http2Connection() {
+  *alive_ = false;
+  if (connect_timer_) loop_->CancelTimer(connect_timer_);
+  if (registered_) loop_->Remove(stream_->fd());
+}
+
+bool Http2Connection::Start() {
+  if (!loop_->Add(stream_->fd(), EventLoop::kReadable | EventLoop::kWritable | EventLoop::kHangup,
+                  [this](uint32_t events) { OnEvent(events); })) {
+    return false;
+  }
+  registered_ = true;
+  std::weak_ptr<bool> alive = alive_;
+  connect_timer_ = loop_->AddTimer(options_.connect_timeout_ms, [this, alive]() {
+    if (alive.expired() || !*alive.lock()) return;
+    connect_timer_ = 0;
+    if (state_ != State::kReady) Fail(Http2Error::kSettingsTimeout);
+  });
+  state_ = State::kHandshaking;
+  DoHandshake();
+  return true;
+}
+
+bool Http2Connection::accepting_streams() const {
+  return state_ == State::kReady && !going_away_ && streams_.size() < peer_max_streams_ &&
+         next_stream_id_ < kMaxStreamId;
+}
+
+void Http2Connection::OnEvent(uint32_t events) {
+  (void)events;
+  if (state_ == State::kClosed) return;
+  if (state_ == State::kHandshaking) {
+    DoHandshake();
+    return;
+  }
+  if (!ReadFrames()) return;
+  Flush();
+}
+
+void Http2Connection::DoHandshake() {
+  if (!early_data_tried_) {
+    // The preface and SETTINGS have no effect beyond this connection, so a
+    // replay is harmless; requests are never sent early.
+    std::string preface = Preface();
+    switch (stream_->WriteEarlyData(preface.data(), preface.size(), &early_data_written_)) {
+      case ByteStream::Status::kOk:
+        early_data_tried_ = true;
+        break;
+      case ByteStream::Status::kWouldBlock:
+        return;
+      default:
+        Fail(Http2Error::kConnectError);
+        return;
+    }
+  }
+  switch (stream_->Handshake()) {
+    case ByteStream::Status::kOk:
+      break;
+    case ByteStream::Status::kWouldBlock:
+      return;
+    default:
+      Fail(Http2Error::kConnectError);
+      return;
+  }
+  std::string alpn = stream_->alpn();
+  if (!alpn.empty() && alpn != "h2") {
+    Fail(Http2Error::kConnectError);
+    return;
+  }
+  state_ = State::kSettings;
+  SendPreface();
+  // The server preface may already be buffered.
+  if (ReadFrames()) Flush();
+}
+
+std::string Http2Connection::Preface() const {
+  std::string preface(kHttp2ClientPreface, kHttp2ClientPrefaceSize);
+  AppendHttp2Settings(&preface, {
+                                    {Http2Setting::kEnablePush, 0},
+                                    {Http2Setting::kInitialWindowSize,
+                                     static_cast<uint32_t>(options_.stream_window)},
+                                });
+  if (options_.connection_window > kHttp2DefaultWindow) {
+    AppendHttp2WindowUpdate(&preface, 0,
+                            static_cast<uint32_t>(options_.connection_window - kHttp2DefaultWindow));
+  }
+  return preface;
+}
+
+void Http2Connection::SendPreface() {
+  // Early data the server rejected is sent again in full.
+  size_t sent = stream_->early_data_accepted() ? early_data_written_ : 0;
+  output_.append(Preface(), sent, std::string::npos);
+  recv_window_ = std::max(options_.connection_window, kHttp2DefaultWindow);
+  Flush();
+}
+
+bool Http2Connection::ReadFrames() {
+  std::weak_ptr<bool> alive = alive_;
+  char buffer[kReadChunk];
+  while (state_ != State::kClosed) {
+    size_t read = 0;
+    ByteStream::Status status = stream_->Read(buffer, sizeof(buffer), &read);
+    if (status == ByteStream::Status::kWouldBlock) return true;
+    if (status != ByteStream::Status::kOk) {
+      Close();
+      return false;
+    }
+    reader_.Append(buffer, read);
+    Http2Frame frame;
+    while (true) {
+      Http2FrameReader::Result result = reader_.Next(&frame);
+      if (result == Http2FrameReader::Result::kNeedMore) break;
+      if (result == Http2FrameReader::Result::kError) {
+        Fail(reader_.error());
+        return false;
+      }
+      if (!HandleFrame(frame)) {
+        if (!alive.expired() && state_ != State::kClosed) Fail(Http2Error::kProtocolError);
+        return false;
+      }
+      if (alive.expired() || state_ == State::kClosed) return false;
+    }
+  }
+  return false;
+}
+
+bool Http2Connection::HandleFrame(Http2Frame& frame) {
+  if (continuation_stream_ != 0 && (frame.type != Http2FrameType::kContinuation ||
+                                    frame.stream_id != continuation_stream_)) {
+    return false;
+  }
+  // The server preface must start with SETTINGS.
+  if (state_ == State::kSettings && frame.type != Http2FrameType::kSettings) return false;
+  switch (frame.type) {
+    case Http2FrameType::kData:
+      return HandleData(frame);
+    case Http2FrameType::kHeaders:
+    case Http2FrameType::kContinuation:
+      return HandleHeaders(frame);
+    case Http2FrameType::kSettings:
+      return HandleSettings(frame);
+    case Http2FrameType::kPing:
+      if (frame.stream_id != 0 || frame.payload.size() != 8) return false;
+      if (!(frame.flags & kHttp2FlagAck)) {
+        AppendHttp2Ping(&output_, reinterpret_cast<const uint8_t*>(frame.payload.data()), true);
+      }
+      return true;
+    case Http2FrameType::kGoaway:
+      return HandleGoaway(frame);
+    case Http2FrameType::kWindowUpdate:
+      return HandleWindowUpdate(frame);
+    case Http2FrameType::kRstStream:
+      return HandleRstStream(frame);
+    case Http2FrameType::kPushPromise:
+      // Push was disabled in our SETTINGS.
+      return false;
+    default:
+      // PRIORITY and unknown extension frames are ignored.
+      return true;
+  }
+}
+
+bool Http2Connection::HandleSettings(const Http2Frame& frame) {
+  if (frame.stream_id != 0) return false;
+  if (frame.flags & kHttp2FlagAck) {
+    settings_acked_ = true;
+    return frame.payload.empty();
+  }
+  if (frame.payload.size() % 6 != 0) return false;
+  bool window_grew = false;
+  uint32_t previous_max_streams = peer_max_streams_;
+  for (size_t offset = 0; offset < frame.payload.size(); offset += 6) {
+    auto id = static_cast<Http2Setting>(static_cast<uint8_t>(frame.payload[offset]) << 8 |
+                                        static_cast<uint8_t>(frame.payload[offset + 1]));
+    uint32_t value = ReadU32(frame.payload, offset + 2);
+    switch (id) {
+      case Http2Setting::kHeaderTableSize:
+        encoder_.SetMaxTableSize(value);
+        break;
+      case Http2Setting::kMaxConcurrentStreams:
+        peer_max_streams_ = value;
+        break;
+      case Http2Setting::kInitialWindowSize: {
+        if (value > static_cast<uint32_t>(kHttp2MaxWindow)) return false;
+        int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+        for (auto& entry : streams_) {
+          int64_t window = entry.second.send_window + delta;
+          if (window > kHttp2MaxWindow) return false;
+          entry.second.send_window = static_cast<int32_t>(window);
+        }
+        peer_initial_window_ = static_cast<int32_t>(value);
+        window_grew = window_grew || delta > 0;
+        break;
+      }
+      case Http2Setting::kMaxFrameSize:
+        if (value < kHttp2DefaultMaxFrameSize || value > 0xffffff) return false;
+        peer_max_frame_size_ = value;
+        break;
+      default:
+        break;
+    }
+  }
+  AppendHttp2SettingsAck(&output_);
+  std::weak_ptr<bool> alive = alive_;
+  if (state_ == State::kSettings) {
+    state_ = State::kReady;
+    established_ = true;
+    if (connect_timer_) {
+      loop_->CancelTimer(connect_timer_);
+      connect_timer_ = 0;
+    }
+    listener_->OnReady(this);
+    if (alive.expired()) return true;
+  } else if (peer_max_streams_ > previous_max_streams) {
+    listener_->OnCapacity(this);
+    if (alive.expired()) return true;
+  }
+  if (window_grew) NotifyBlockedStreams();
+  return true;
+}
+
+bool Http2Connection::HandleHeaders(Http2Frame& frame) {
+  if (frame.stream_id == 0) return false;
+  if (frame.type == Http2FrameType::kHeaders) {
+    if (frame.stream_id >= next_stream_id_ || (frame.stream_id & 1) == 0) return false;
+    continuation_end_stream_ = (frame.flags & kHttp2FlagEndStream) != 0;
+    header_block_.swap(frame.payload);
+  } else {
+    header_block_ += frame.payload;
+  }
+  if (!(frame.flags & kHttp2FlagEndHeaders)) {
+    continuation_stream_ = frame.stream_id;
+    return true;
+  }
+  continuation_stream_ = 0;
+  // Blocks for streams we already reset must still be decoded to keep the
+  // HPACK state in sync.
+  std::vector<HpackHeader> headers;
+  bool decoded = decoder_.Decode(reinterpret_cast<const uint8_t*>(header_block_.data()),
+                                 header_block_.size(), &headers);
+  header_block_.clear();
+  if (!decoded) {
+    Fail(Http2Error::kCompressionError);
+    return false;
+  }
+  auto it = streams_.find(frame.stream_id);
+  if (it == streams_.end()) return true;
+  bool end_stream = continuation_end_stream_;
+  if (end_stream) it->second.remote_closed = true;
+  std::weak_ptr<bool> alive = alive_;
+  it->second.delegate->OnHeaders(frame.stream_id, headers, end_stream);
+  if (alive.expired()) return true;
+  if (end_stream) MaybeFinish(frame.stream_id);
+  return true;
+}
+
+bool Http2Connection::HandleData(const Http2Frame& frame) {
+  if (frame.stream_id == 0) return false;
+  recv_window_ -= static_cast<int32_t>(frame.length);
+  if (recv_window_ < 0) {
+    Fail(Http2Error::kFlowControlError);
+    return false;
+  }
+  // Padding is credited back straight away.
+  size_t padding = frame.length - frame.payload.size();
+  auto it = streams_.find(frame.stream_id);
+  if (it == streams_.end()) {
+    if (frame.stream_id >= next_stream_id_) return false;
+    Consume(frame.stream_id, frame.length);
+    return true;
+  }
+  Stream& stream = it->second;
+  stream.recv_window -= static_cast<int32_t>(frame.length);
+  if (stream.recv_window < 0 || stream.remote_closed) {
+    ResetStream(frame.stream_id, Http2Error::kFlowControlError);
+    Consume(0, frame.length);
+    return true;
+  }
+  bool end_stream = (frame.flags & kHttp2FlagEndStream) != 0;
+  if (end_stream) stream.remote_closed = true;
+  stream.unconsumed += frame.payload.size();
+  if (padding > 0) {
+    stream.unconsumed += padding;
+    Consume(frame.stream_id, padding);
+  }
+  std::weak_ptr<bool> alive = alive_;
+  stream.delegate->OnData(frame.stream_id, frame.payload.data(), frame.payload.size(), end_stream);
+  if (alive.expired()) return true;
+  if (end_stream) MaybeFinish(frame.stream_id);
+  return true;
+}
+
+bool Http2Connection::HandleWindowUpdate(const Http2Frame& frame) {
+  if (frame.payload.size() != 4) return false;
+  uint32_t increment = ReadU32(frame.payload, 0) & 0x7fffffff;
+  if (frame.stream_id == 0) {
+    if (increment == 0) return false;
+    if (static_cast<int64_t>(send_window_) + increment > kHttp2MaxWindow) {
+      Fail(Http2Error::kFlowControlError);
+      return false;
+    }
+    send_window_ += static_cast<int32_t>(increment);
+    NotifyBlockedStreams();
+    return true;
+  }
+  auto it = streams_.find(frame.stream_id);
+  if (it == streams_.end()) return true;
+  if (increment == 0 ||
+      static_cast<int64_t>(it->second.send_window) + increment > kHttp2MaxWindow) {
+    ResetStream(frame.stream_id, increment == 0 ? Http2Error::kProtocolError
+                                                : Http2Error::kFlowControlError);
+    return true;
+  }
+  it->second.send_window += static_cast<int32_t>(increment);
+  if (it->second.blocked && send_window_ > 0) {
+    it->second.blocked = false;
+    it->second.delegate->OnWritable(frame.stream_id);
+  }
+  return true;
+}
+
+bool Http2Connection::HandleRstStream(const Http2Frame& frame) {
+  if (frame.stream_id == 0 || frame.payload.size() != 4) return false;
+  FinishStream(frame.stream_id, static_cast<Http2Error>(ReadU32(frame.payload, 0)), true);
+  return true;
+}
+
+bool Http2Connection::HandleGoaway(const Http2Frame& frame) {
+  if (frame.stream_id != 0 || frame.payload.size() < 8) return false;
+  uint32_t last_stream_id = ReadU32(frame.payload, 0) & 0x7fffffff;
+  going_away_ = true;
+  std::vector<uint32_t> refused;
+  for (const auto& entry : streams_) {
+    if (entry.first > last_stream_id) refused.push_back(entry.first);
+  }
+  std::weak_ptr<bool> alive = alive_;
+  for (uint32_t id : refused) {
+    FinishStream(id, Http2Error::kRefusedStream, true);
+    if (alive.expired() || state_ == State::kClosed) return true;
+  }
+  if (streams_.empty()) {
+    Close();
+    return true;
+  }
+  listener_->OnCapacity(this);
+  return true;
+}
+
+uint32_t Http2Connection::OpenStream(const std::vector<HpackHeader>& headers, bool end_stream,
+                                     Http2StreamDelegate* delegate) {
+  if (!accepting_streams()) return 0;
+  uint32_t id = next_stream_id_;
+  next_stream_id_ += 2;
+  std::string block;
+  encoder_.Encode(headers, &block);
+  AppendHttp2Headers(&output_, id, block, end_stream, peer_max_frame_size_);
+  Stream stream;
+  stream.delegate = delegate;
+  stream.send_window = peer_initial_window_;
+  stream.recv_window = options_.stream_window;
+  stream.local_closed = end_stream;
+  streams_.emplace(id, stream);
+  streams_opened_++;
+  Flush();
+  return id;
+}
+
+size_t Http2Connection::SendData(uint32_t stream_id, const char* data, size_t size,
+                                 bool end_stream) {
+  if (state_ == State::kClosed) return 0;
+  auto it = streams_.find(stream_id);
+  if (it == streams_.end() || it->second.local_closed) return 0;
+  Stream& stream = it->second;
+  size_t allowed = static_cast<size_t>(std::max<int32_t>(0, std::min(stream.send_window, send_window_)));
+  size_t accepted = std::min(size, allowed);
+  bool finish = end_stream && accepted == size;
+  size_t offset = 0;
+  do {
+    size_t chunk = std::min<size_t>(accepted - offset, peer_max_frame_size_);
+    bool last = offset + chunk == accepted;
+    if (chunk == 0 && !finish) break;
+    AppendHttp2Data(&output_, stream_id, data + offset, chunk, last && finish);
+    offset += chunk;
+  } while (offset < accepted);
+  stream.send_window -= static_cast<int32_t>(accepted);
+  send_window_ -= static_cast<int32_t>(accepted);
+  if (accepted < size) stream.blocked = true;
+  if (finish) stream.local_closed = true;
+  Flush();
+  if (finish) MaybeFinish(stream_id);
+  return accepted;
+}
+
+void Http2Connection::Consume(uint32_t stream_id, size_t bytes) {
+  if (state_ == State::kClosed || bytes == 0) return;
+  pending_connection_update_ += bytes;
+  if (pending_connection_update_ >= static_cast<size_t>(options_.connection_window / 2)) {
+    AppendHttp2WindowUpdate(&output_, 0, static_cast<uint32_t>(pending_connection_update_));
+    recv_window_ += static_cast<int32_t>(pending_connection_update_);
+    pending_connection_update_ = 0;
+  }
+  auto it = streams_.find(stream_id);
+  if (it != streams_.end()) {
+    Stream& stream = it->second;
+    size_t credited = std::min(bytes, stream.unconsumed);
+    stream.unconsumed -= credited;
+    stream.pending_update += credited;
+    if (!stream.remote_closed &&
+        stream.pending_update >= static_cast<size_t>(options_.stream_window / 2)) {
+      AppendHttp2WindowUpdate(&output_, stream_id, static_cast<uint32_t>(stream.pending_update));
+      stream.recv_window += static_cast<int32_t>(stream.pending_update);
+      stream.pending_update = 0;
+    }
+  }
+  Flush();
+}
+
+void Http2Connection::ResetStream(uint32_t stream_id, Http2Error error) {
+  if (state_ == State::kClosed || !streams_.count(stream_id)) return;
+  AppendHttp2RstStream(&output_, stream_id, error);
+  FinishStream(stream_id, error, false);
+  if (state_ != State::kClosed) Flush();
+}
+
+void Http2Connection::Shutdown() {
+  if (state_ == State::kClosed) return;
+  if (state_ != State::kReady || streams_.empty()) {
+    Close();
+    return;
+  }
+  if (!going_away_) {
+    AppendHttp2Goaway(&output_, 0, Http2Error::kNoError);
+    going_away_ = true;
+    Flush();
+  }
+}
+
+void Http2Connection::NotifyBlockedStreams() {
+  if (send_window_ <= 0) return;
+  std::vector<uint32_t> ready;
+  for (const auto& entry : streams_) {
+    if (entry.second.blocked && entry.second.send_window > 0) ready.push_back(entry.first);
+  }
+  std::weak_ptr<bool> alive = alive_;
+  for (uint32_t id : ready) {
+    auto it = streams_.find(id);
+    if (it == streams_.end() || !it->second.blocked) continue;
+    it->second.blocked = false;
+    it->second.delegate->OnWritable(id);
+    if (alive.expired() || state_ == State::kClosed || send_window_ <= 0) return;
+  }
+}
+
+void Http2Connection::MaybeFinish(uint32_t stream_id) {
+  auto it = streams_.find(stream_id);
+  if (it == streams_.end() || !it->second.local_closed || !it->second.remote_closed) return;
+  FinishStream(stream_id, Http2Error::kNoError, true);
+}
+
+void Http2Connection::FinishStream(uint32_t stream_id, Http2Error error, bool notify) {
+  auto it = streams_.find(stream_id);
+  if (it == streams_.end()) return;
+  Http2StreamDelegate* delegate = it->second.delegate;
+  // Nobody will consume what the delegate still holds.
+  size_t unconsumed = it->second.unconsumed;
+  streams_.erase(it);
+  if (unconsumed) Consume(0, unconsumed);
+  std::weak_ptr<bool> alive = alive_;
+  if (notify) {
+    delegate->OnClosed(stream_id, error);
+    if (alive.expired() || state_ == State::kClosed) return;
+  }
+  if (going_away_ && streams_.empty()) {
+    Close();
+    return;
+  }
+  listener_->OnCapacity(this);
+}
+
+void Http2Connection::Flush() {
+  while (output_offset_ < output_.size()) {
+    size_t written = 0;
+    ByteStream::Status status =
+        stream_->Write(output_.data() + output_offset_, output_.size() - output_offset_, &written);
+    if (status == ByteStream::Status::kWouldBlock) break;
+    if (status != ByteStream::Status::kOk) {
+      Close();
+      return;
+    }
+    output_offset_ += written;
+  }
+  if (output_offset_ == output_.size()) {
+    output_.clear();
+    output_offset_ = 0;
+  } else if (output_offset_ > kReadChunk) {
+    output_.erase(0, output_offset_);
+    output_offset_ = 0;
+  }
+}
+
+void Http2Connection::Fail(Http2Error error) {
+  if (state_ == State::kClosed) return;
+  if (state_ == State::kReady || state_ == State::kSettings) {
+    AppendHttp2Goaway(&output_, 0, error);
+    Flush();
+  }
+  Close();
+}
+
+void Http2Connection::Close() {
+  if (state_ == State::kClosed) return;
+  state_ = State::kClosed;
+  if (connect_timer_) {
+    loop_->CancelTimer(connect_timer_);
+    connect_timer_ = 0;
+  }
+  if (registered_) {
+    loop_->Remove(stream_->fd());
+    registered_ = false;
+  }
+  // Notify from a fresh stack: Close() can be reached from inside public
+  // calls whose callers still use the connection afterwards.
+  std::weak_ptr<bool> alive = alive_;
+  loop_->Post([this, alive]() {
+    if (alive.expired() || !*alive.lock()) return;
+    std::unordered_map<uint32_t, Stream> streams;
+    streams.swap(streams_);
+    for (auto& entry : streams) {
+      entry.second.delegate->OnClosed(entry.first, Http2Error::kConnectError);
+      if (alive.expired()) return;
+    }
+    listener_->OnClosed(this);
+  });
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,168 @@
+#ifndef FLUTTER_PLUGIN_HTTP2_CONNECTION_H_
+#define FLUTTER_PLUGIN_HTTP2_CONNECTION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.h"
+#include "hpack.h"
+#include "http2_frame.h"
+#include "tls_stream.h"
+
+namespace vpn_plugin {
+
+// Receives the events of one stream. Callbacks run on the loop thread and
+// may call back into the connection.
+class Http2StreamDelegate {
+ public:
+  virtual ~Http2StreamDelegate() = default;
+  virtual void OnHeaders(uint32_t stream_id, const std::vector<HpackHeader>& headers,
+                         bool end_stream) = 0;
+  // Received bytes count against the receive window until Consume() is
+  // called, so a slow reader throttles the peer instead of buffering.
+  virtual void OnData(uint32_t stream_id, const char* data, size_t size, bool end_stream) = 0;
+  // The send window opened after SendData() accepted less than offered.
+  virtual void OnWritable(uint32_t stream_id) = 0;
+  // The stream was reset or the connection went away. No further callbacks.
+  virtual void OnClosed(uint32_t stream_id, Http2Error error) = 0;
+};
+
+struct Http2ConnectionOptions {
+  // Receive windows advertised to the peer.
+  int32_t stream_window = 256 * 1024;
+  int32_t connection_window = 16 * 1024 * 1024;
+  // Abandon connection setup (TCP, TLS and SETTINGS) after this long.
+  int connect_timeout_ms = 10000;
+};
+
+// Client side of one HTTP/2 connection (RFC 9113) multiplexing many
+// streams. Owns the transport; must be used on the loop thread.
+class Http2Connection {
+ public:
+  class Listener {
+   public:
+    virtual ~Listener() = default;
+    virtual void OnReady(Http2Connection* connection) = 0;
+    // Streams finished or the peer raised its concurrency limit.
+    virtual void OnCapacity(Http2Connection* connection) = 0;
+    // The connection failed or was closed. It may be deleted from here.
+    virtual void OnClosed(Http2Connection* connection) = 0;
+  };
+
+  Http2Connection(EventLoop* loop, std::unique_ptr<ByteStream> stream,
+                  Http2ConnectionOptions options, Listener* listener);
+  ~Http2Connection();
+
+  Http2Connection(const Http2Connection&) = delete;
+  Http2Connection& operator=(const Http2Connection&) = delete;
+
+  bool Start();
+
+  // Returns the new stream id, or 0 if the connection cannot take another
+  // stream right now.
+  uint32_t OpenStream(const std::vector<HpackHeader>& headers, bool end_stream,
+                      Http2StreamDelegate* delegate);
+  // Queues up to |size| bytes, limited by the stream and connection send
+  // windows. Returns the number of bytes accepted; END_STREAM is only sent
+  // once everything was accepted.
+  size_t SendData(uint32_t stream_id, const char* data, size_t size, bool end_stream);
+  // Returns receive credit for bytes handed out through OnData().
+  void Consume(uint32_t stream_id, size_t bytes);
+  // Resets the stream. The delegate is not called again.
+  void ResetStream(uint32_t stream_id, Http2Error error);
+  // Sends GOAWAY and closes once active streams finish.
+  void Shutdown();
+
+  bool ready() const { return state_ == State::kReady; }
+  bool closed() const { return state_ == State::kClosed; }
+  // Whether the connection ever got ready, even if it has closed since.
+  bool established() const { return established_; }
+  bool accepting_streams() const;
+  size_t active_streams() const { return streams_.size(); }
+  uint32_t peer_max_streams() const { return peer_max_streams_; }
+  int32_t send_window() const { return send_window_; }
+  size_t streams_opened() const { return streams_opened_; }
+  const HpackEncoder& encoder() const { return encoder_; }
+  int fd() const { return stream_->fd(); }
+  // Whether TLS resumed an earlier session instead of a full handshake.
+  bool resumed() const { return stream_->resumed(); }
+
+ private:
+  enum class State { kConnecting, kHandshaking, kSettings, kReady, kClosed };
+
+  struct Stream {
+    Http2StreamDelegate* delegate;
+    int32_t send_window;
+    int32_t recv_window;
+    // Bytes delivered but not yet consumed, and consumed but not yet
+    // returned to the peer through WINDOW_UPDATE.
+    size_t unconsumed = 0;
+    size_t pending_update = 0;
+    bool local_closed = false;
+    bool remote_closed = false;
+    bool blocked = false;
+  };
+
+  void OnEvent(uint32_t events);
+  void DoHandshake();
+  std::string Preface() const;
+  void SendPreface();
+  bool ReadFrames();
+  bool HandleFrame(Http2Frame& frame);
+  bool HandleSettings(const Http2Frame& frame);
+  bool HandleHeaders(Http2Frame& frame);
+  bool HandleData(const Http2Frame& frame);
+  bool HandleWindowUpdate(const Http2Frame& frame);
+  bool HandleRstStream(const Http2Frame& frame);
+  bool HandleGoaway(const Http2Frame& frame);
+  void Flush();
+  void NotifyBlockedStreams();
+  void FinishStream(uint32_t stream_id, Http2Error error, bool notify);
+  void MaybeFinish(uint32_t stream_id);
+  void Fail(Http2Error error);
+  void Close();
+
+  EventLoop* loop_;
+  std::unique_ptr<ByteStream> stream_;
+  Http2ConnectionOptions options_;
+  Listener* listener_;
+  State state_ = State::kConnecting;
+  EventLoop::TimerId connect_timer_ = 0;
+  bool registered_ = false;
+  bool going_away_ = false;
+  bool settings_acked_ = false;
+  bool established_ = false;
+  // The preface was offered as TLS early data; this much of it was taken.
+  bool early_data_tried_ = false;
+  size_t early_data_written_ = 0;
+
+  Http2FrameReader reader_;
+  std::string output_;
+  size_t output_offset_ = 0;
+  HpackEncoder encoder_;
+  HpackDecoder decoder_;
+  // Header block being assembled from HEADERS + CONTINUATION.
+  uint32_t continuation_stream_ = 0;
+  bool continuation_end_stream_ = false;
+  std::string header_block_;
+
+  std::unordered_map<uint32_t, Stream> streams_;
+  uint32_t next_stream_id_ = 1;
+  size_t streams_opened_ = 0;
+  uint32_t peer_max_streams_ = 100;
+  int32_t peer_initial_window_ = kHttp2DefaultWindow;
+  uint32_t peer_max_frame_size_ = kHttp2DefaultMaxFrameSize;
+  int32_t send_window_ = kHttp2DefaultWindow;
+  int32_t recv_window_ = kHttp2DefaultWindow;
+  size_t pending_connection_update_ = 0;
+  // Lets callbacks detect that the connection was deleted under them.
+  std::shared_ptr<bool> alive_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_HTTP2_CONNECTION_H_
@@ -0,0 +1,146 @@
+#include "http2_frame.h"
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+const char kHttp2ClientPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace {
+
+uint32_t ReadU24(const uint8_t* p) { return static_cast<uint32_t>(p[0] << 16 | p[1] << 8 | p[2]); }
+
+uint32_t ReadU32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+void AppendU32(std::string* out, uint32_t v) {
+  out->push_back(static_cast<char>(v >> 24));
+  out->push_back(static_cast<char>(v >> 16));
+  out->push_back(static_cast<char>(v >> 8));
+  out->push_back(static_cast<char>(v));
+}
+
+}  // namespace
+
+Http2FrameReader::Result Http2FrameReader::Next(Http2Frame* frame) {
+  if (buffered() < kHttp2FrameHeaderSize) return Result::kNeedMore;
+  const auto* header = reinterpret_cast<const uint8_t*>(buffer_.data() + consumed_);
+  uint32_t length = ReadU24(header);
+  if (length > max_frame_size_) {
+    error_ = Http2Error::kFrameSizeError;
+    return Result::kError;
+  }
+  if (buffered() < kHttp2FrameHeaderSize + length) return Result::kNeedMore;
+
+  frame->type = static_cast<Http2FrameType>(header[3]);
+  frame->flags = header[4];
+  frame->length = length;
+  frame->stream_id = ReadU32(header + 5) & 0x7fffffff;
+  const char* payload = buffer_.data() + consumed_ + kHttp2FrameHeaderSize;
+  size_t begin = 0;
+  size_t end = length;
+  bool padded_type =
+      frame->type == Http2FrameType::kData || frame->type == Http2FrameType::kHeaders;
+  if (padded_type && (frame->flags & kHttp2FlagPadded)) {
+    if (length < 1 || static_cast<uint8_t>(payload[0]) >= length) {
+      error_ = Http2Error::kProtocolError;
+      return Result::kError;
+    }
+    begin = 1;
+    end = length - static_cast<uint8_t>(payload[0]);
+  }
+  if (frame->type == Http2FrameType::kHeaders && (frame->flags & kHttp2FlagPriority)) {
+    // Stream dependency and weight; priorities are not used.
+    if (end - begin < 5) {
+      error_ = Http2Error::kProtocolError;
+      return Result::kError;
+    }
+    begin += 5;
+  }
+  frame->payload.assign(payload + begin, end - begin);
+  consumed_ += kHttp2FrameHeaderSize + length;
+  // Compact once the consumed prefix dominates the buffer.
+  if (consumed_ > 65536 && consumed_ * 2 > buffer_.size()) {
+    buffer_.erase(0, consumed_);
+    consumed_ = 0;
+  } else if (consumed_ == buffer_.size()) {
+    buffer_.clear();
+    consumed_ = 0;
+  }
+  return Result::kFrame;
+}
+
+void AppendHttp2FrameHeader(std::string* out, size_t length, Http2FrameType type, uint8_t flags,
+                            uint32_t stream_id) {
+  out->push_back(static_cast<char>(length >> 16));
+  out->push_back(static_cast<char>(length >> 8));
+  out->push_back(static_cast<char>(length));
+  out->push_back(static_cast<char>(type));
+  out->push_back(static_cast<char>(flags));
+  AppendU32(out, stream_id & 0x7fffffff);
+}
+
+void AppendHttp2Settings(std::string* out,
+                         const std::vector<std::pair<Http2Setting, uint32_t>>& settings) {
+  AppendHttp2FrameHeader(out, settings.size() * 6, Http2FrameType::kSettings, 0, 0);
+  for (const auto& setting : settings) {
+    auto id = static_cast<uint16_t>(setting.first);
+    out->push_back(static_cast<char>(id >> 8));
+    out->push_back(static_cast<char>(id));
+    AppendU32(out, setting.second);
+  }
+}
+
+void AppendHttp2SettingsAck(std::string* out) {
+  AppendHttp2FrameHeader(out, 0, Http2FrameType::kSettings, kHttp2FlagAck, 0);
+}
+
+void AppendHttp2WindowUpdate(std::string* out, uint32_t stream_id, uint32_t increment) {
+  AppendHttp2FrameHeader(out, 4, Http2FrameType::kWindowUpdate, 0, stream_id);
+  AppendU32(out, increment & 0x7fffffff);
+}
+
+void AppendHttp2Data(std::string* out, uint32_t stream_id, const char* data, size_t size,
+                     bool end_stream) {
+  AppendHttp2FrameHeader(out, size, Http2FrameType::kData, end_stream ? kHttp2FlagEndStream : 0,
+                         stream_id);
+  out->append(data, size);
+}
+
+void AppendHttp2RstStream(std::string* out, uint32_t stream_id, Http2Error error) {
+  AppendHttp2FrameHeader(out, 4, Http2FrameType::kRstStream, 0, stream_id);
+  AppendU32(out, static_cast<uint32_t>(error));
+}
+
+void AppendHttp2Ping(std::string* out, const uint8_t opaque[8], bool ack) {
+  AppendHttp2FrameHeader(out, 8, Http2FrameType::kPing, ack ? kHttp2FlagAck : 0, 0);
+  out->append(reinterpret_cast<const char*>(opaque), 8);
+}
+
+void AppendHttp2Goaway(std::string* out, uint32_t last_stream_id, Http2Error error) {
+  AppendHttp2FrameHeader(out, 8, Http2FrameType::kGoaway, 0, 0);
+  AppendU32(out, last_stream_id & 0x7fffffff);
+  AppendU32(out, static_cast<uint32_t>(error));
+}
+
+void AppendHttp2Headers(std::string* out, uint32_t stream_id, const std::string& block,
+                        bool end_stream, uint32_t max_frame_size) {
+  size_t offset = 0;
+  bool first = true;
+  do {
+    size_t chunk = std::min<size_t>(block.size() - offset, max_frame_size);
+    bool last = offset + chunk == block.size();
+    uint8_t flags = last ? kHttp2FlagEndHeaders : 0;
+    if (first && end_stream) flags |= kHttp2FlagEndStream;
+    AppendHttp2FrameHeader(out, chunk,
+                           first ? Http2FrameType::kHeaders : Http2FrameType::kContinuation,
+                           flags, stream_id);
+    out->append(block, offset, chunk);
+    offset += chunk;
+    first = false;
+  } while (offset < block.size());
+}
+
+}  // namespace vpn_plugin
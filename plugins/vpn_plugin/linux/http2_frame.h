@@ -0,0 +1,114 @@
+#ifndef FLUTTER_PLUGIN_HTTP2_FRAME_H_
+#define FLUTTER_PLUGIN_HTTP2_FRAME_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vpn_plugin {
+
+enum class Http2FrameType : uint8_t {
+  kData = 0x0,
+  kHeaders = 0x1,
+  kPriority = 0x2,
+  kRstStream = 0x3,
+  kSettings = 0x4,
+  kPushPromise = 0x5,
+  kPing = 0x6,
+  kGoaway = 0x7,
+  kWindowUpdate = 0x8,
+  kContinuation = 0x9,
+};
+
+enum class Http2Error : uint32_t {
+  kNoError = 0x0,
+  kProtocolError = 0x1,
+  kInternalError = 0x2,
+  kFlowControlError = 0x3,
+  kSettingsTimeout = 0x4,
+  kStreamClosed = 0x5,
+  kFrameSizeError = 0x6,
+  kRefusedStream = 0x7,
+  kCancel = 0x8,
+  kCompressionError = 0x9,
+  kConnectError = 0xa,
+  kEnhanceYourCalm = 0xb,
+};
+
+enum class Http2Setting : uint16_t {
+  kHeaderTableSize = 0x1,
+  kEnablePush = 0x2,
+  kMaxConcurrentStreams = 0x3,
+  kInitialWindowSize = 0x4,
+  kMaxFrameSize = 0x5,
+  kMaxHeaderListSize = 0x6,
+};
+
+constexpr uint8_t kHttp2FlagEndStream = 0x1;
+constexpr uint8_t kHttp2FlagAck = 0x1;
+constexpr uint8_t kHttp2FlagEndHeaders = 0x4;
+constexpr uint8_t kHttp2FlagPadded = 0x8;
+constexpr uint8_t kHttp2FlagPriority = 0x20;
+
+constexpr size_t kHttp2FrameHeaderSize = 9;
+constexpr uint32_t kHttp2DefaultMaxFrameSize = 16384;
+constexpr int32_t kHttp2DefaultWindow = 65535;
+constexpr int32_t kHttp2MaxWindow = 0x7fffffff;
+extern const char kHttp2ClientPreface[];
+constexpr size_t kHttp2ClientPrefaceSize = 24;
+
+struct Http2Frame {
+  Http2FrameType type = Http2FrameType::kData;
+  uint8_t flags = 0;
+  uint32_t stream_id = 0;
+  // Length on the wire, including padding; counted by flow control.
+  uint32_t length = 0;
+  // Payload with padding removed for DATA and HEADERS.
+  std::string payload;
+};
+
+// Incremental frame parser. Bytes are appended as they arrive from the
+// transport and complete frames are popped one at a time.
+class Http2FrameReader {
+ public:
+  enum class Result { kFrame, kNeedMore, kError };
+
+  explicit Http2FrameReader(uint32_t max_frame_size = kHttp2DefaultMaxFrameSize)
+      : max_frame_size_(max_frame_size) {}
+
+  void Append(const char* data, size_t size) { buffer_.append(data, size); }
+  Result Next(Http2Frame* frame);
+  // Raised after SETTINGS_MAX_FRAME_SIZE has been acknowledged.
+  void set_max_frame_size(uint32_t size) { max_frame_size_ = size; }
+  Http2Error error() const { return error_; }
+  size_t buffered() const { return buffer_.size() - consumed_; }
+
+ private:
+  std::string buffer_;
+  size_t consumed_ = 0;
+  uint32_t max_frame_size_;
+  Http2Error error_ = Http2Error::kNoError;
+};
+
+// Frame writers. Each appends one complete frame to |out|.
+void AppendHttp2FrameHeader(std::string* out, size_t length, Http2FrameType type, uint8_t flags,
+                            uint32_t stream_id);
+void AppendHttp2Settings(std::string* out,
+                         const std::vector<std::pair<Http2Setting, uint32_t>>& settings);
+void AppendHttp2SettingsAck(std::string* out);
+void AppendHttp2WindowUpdate(std::string* out, uint32_t stream_id, uint32_t increment);
+void AppendHttp2Data(std::string* out, uint32_t stream_id, const char* data, size_t size,
+                     bool end_stream);
+void AppendHttp2RstStream(std::string* out, uint32_t stream_id, Http2Error error);
+void AppendHttp2Ping(std::string* out, const uint8_t opaque[8], bool ack);
+void AppendHttp2Goaway(std::string* out, uint32_t last_stream_id, Http2Error error);
+// Splits |block| into HEADERS and CONTINUATION frames of at most
+// |max_frame_size| bytes.
+void AppendHttp2Headers(std::string* out, uint32_t stream_id, const std::string& block,
+                        bool end_stream, uint32_t max_frame_size);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_HTTP2_FRAME_H_
@@ -0,0 +1,349 @@
+#include "http2_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "path_mtu.h"
+#include "trace.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+std::string Base64(const std::string& input) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((input.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    uint32_t v = static_cast<uint8_t>(input[i]) << 16 | static_cast<uint8_t>(input[i + 1]) << 8 |
+                 static_cast<uint8_t>(input[i + 2]);
+    out.push_back(kAlphabet[v >> 18]);
+    out.push_back(kAlphabet[(v >> 12) & 0x3f]);
+    out.push_back(kAlphabet[(v >> 6) & 0x3f]);
+    out.push_back(kAlphabet[v & 0x3f]);
+  }
+  if (i < input.size()) {
+    uint32_t v = static_cast<uint8_t>(input[i]) << 16;
+    if (i + 1 < input.size()) v |= static_cast<uint8_t>(input[i + 1]) << 8;
+    out.push_back(kAlphabet[v >> 18]);
+    out.push_back(kAlphabet[(v >> 12) & 0x3f]);
+    out.push_back(i + 1 < input.size() ? kAlphabet[(v >> 6) & 0x3f] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+// After every address failed, new connections are not attempted for this
+// long; streams opened meanwhile fail fast.
+constexpr int64_t kRetryDelayMs = 1000;
+
+}  // namespace
+
+std::vector<HpackHeader> Http2ConnectHeaders(const std::string& authority,
+                                             const std::string& username,
+                                             const std::string& password) {
+  std::vector<HpackHeader> headers = {
+      {":method", "CONNECT"},
+      {":authority", authority},
+  };
+  if (!username.empty()) {
+    // Constant for the lifetime of the connection, so it is worth indexing.
+    headers.push_back({"proxy-authorization", "Basic " + Base64(username + ":" + password)});
+  }
+  return headers;
+}
+
+bool Http2PoolOptions::FromConfig(const ConfigDocument& config, Http2PoolOptions* out,
+                                  std::string* error) {
+  const char* kSection = "endpoint";
+  Http2PoolOptions options = *out;
+  bool has_ipv6 = config.GetBool(kSection, "has_ipv6", true);
+  options.addresses.clear();
+  for (const auto& text : config.GetStringList(kSection, "addresses")) {
+    SocketAddress address;
+    if (!SocketAddress::Parse(text, 443, &address)) continue;
+    if (address.ip.is_v6() && !has_ipv6) continue;
+    options.addresses.push_back(address);
+  }
+  if (options.addresses.empty()) {
+    if (error) *error = "endpoint has no usable address";
+    return false;
+  }
+  options.server_name = config.GetString(kSection, "hostname");
+  TlsClientOptions tls;
+  tls.skip_verification = config.GetBool(kSection, "skip_verification");
+  tls.certificate_pem = config.GetString(kSection, "certificate");
+  tls.sessions = options.tls_sessions;
+  options.tls = TlsClientContext::Create(tls, error);
+  if (!options.tls) return false;
+  *out = std::move(options);
+  return true;
+}
+
+Http2Pool::Http2Pool(EventLoop* loop, Http2PoolOptions options)
+    : loop_(loop), options_(std::move(options)) {}
+
+Http2Pool::~Http2Pool() {
+  if (race_timer_) loop_->CancelTimer(race_timer_);
+}
+
+Http2Pool::RequestId Http2Pool::OpenStream(std::vector<HpackHeader> headers, bool end_stream,
+                                           Http2StreamDelegate* delegate, OpenCallback callback) {
+  RequestId id = next_request_id_++;
+  queue_.push_back(Request{id, std::move(headers), end_stream, delegate, std::move(callback)});
+  DrainQueue();
+  if (!queue_.empty() && queue_.back().id == id) stats_.streams_queued++;
+  return id;
+}
+
+void Http2Pool::Cancel(RequestId id) {
+  for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+    if (it->id == id) {
+      queue_.erase(it);
+      return;
+    }
+  }
+}
+
+std::vector<size_t> Http2Pool::StreamsPerConnection() const {
+  std::vector<size_t> out;
+  for (const auto& connection : connections_) {
+    if (connection->ready()) out.push_back(connection->active_streams());
+  }
+  return out;
+}
+
+Http2Connection* Http2Pool::PickConnection() const {
+  Http2Connection* best = nullptr;
+  for (const auto& connection : connections_) {
+    if (!connection->accepting_streams()) continue;
+    if (!best || connection->active_streams() < best->active_streams()) best = connection.get();
+  }
+  return best;
+}
+
+bool Http2Pool::CanGrow() const {
+  if (options_.addresses.empty()) return false;
+  if (failed_attempts_ >= options_.addresses.size() &&
+      EventLoop::NowMs() - last_failure_ms_ < kRetryDelayMs) {
+    return false;
+  }
+  size_t live = 0;
+  for (const auto& connection : connections_) {
+    if (!connection->closed()) live++;
+  }
+  return live < options_.max_connections;
+}
+
+bool Http2Pool::AnyReady() const {
+  for (const auto& connection : connections_) {
+    if (connection->ready()) return true;
+  }
+  return false;
+}
+
+bool Http2Pool::Connecting() const {
+  // A connection that failed during setup stays listed until its OnClosed()
+  // has run and been counted, so it still counts as outstanding here.
+  for (const auto& connection : connections_) {
+    if (!connection->ready() && !connection->established()) return true;
+  }
+  return false;
+}
+
+void Http2Pool::OpenConnection() {
+  if (options_.addresses.empty()) return;
+  bool cold = !AnyReady();
+  if (cold && attempts_.empty() && options_.winners) {
+    SocketAddress winner;
+    if (options_.winners->Lookup(EndpointKey(), NetworkId(), &winner)) {
+      auto it = std::find(options_.addresses.begin(), options_.addresses.end(), winner);
+      if (it != options_.addresses.end()) {
+        next_address_ = static_cast<size_t>(it - options_.addresses.begin());
+        stats_.winner_cache_hits++;
+      }
+    }
+  }
+  if (cold && cold_start_ms_ == 0) cold_start_ms_ = EventLoop::NowMs();
+  const SocketAddress address = options_.addresses[next_address_++ % options_.addresses.size()];
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    RecordFailure();
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0 && errno != EINPROGRESS) {
+    close(fd);
+    RecordFailure();
+    return;
+  }
+  std::unique_ptr<ByteStream> stream;
+  if (options_.tls) {
+    stream.reset(new TlsStream(options_.tls, fd, options_.server_name));
+  } else {
+    stream.reset(new PlainStream(fd));
+  }
+  auto* connection = new Http2Connection(loop_, std::move(stream), options_.connection, this);
+  connections_.push_back(std::unique_ptr<Http2Connection>(connection));
+  // Over loopback the handshake can finish within Start().
+  attempts_[connection] = Attempt{address, Tracer::NowNs()};
+  if (!connection->Start()) {
+    attempts_.erase(connection);
+    connections_.pop_back();
+    RecordFailure();
+    return;
+  }
+  if (cold_start_ms_ != 0) ArmRace();
+}
+
+void Http2Pool::ArmRace() {
+  if (race_timer_ || options_.race_delay_ms <= 0 || options_.addresses.size() < 2) return;
+  race_timer_ = loop_->AddTimer(options_.race_delay_ms, [this]() {
+    race_timer_ = 0;
+    OnRaceTimer();
+  });
+}
+
+void Http2Pool::OnRaceTimer() {
+  // Nothing left to race: a connection won, every address has an attempt
+  // out, or every address has failed lately.
+  if (AnyReady() || attempts_.empty() || attempts_.size() >= options_.addresses.size() ||
+      failed_attempts_ >= options_.addresses.size()) {
+    return;
+  }
+  stats_.races_started++;
+  Tracer::Instant("pool.race", static_cast<int64_t>(attempts_.size()));
+  OpenConnection();
+}
+
+std::string Http2Pool::NetworkId() const {
+  return options_.network_id ? options_.network_id() : LocalNetworkId(options_.addresses[0]);
+}
+
+std::string Http2Pool::EndpointKey() const {
+  return options_.server_name.empty() ? options_.addresses[0].ToString() : options_.server_name;
+}
+
+void Http2Pool::RecordFailure() {
+  stats_.connections_failed++;
+  failed_attempts_++;
+  last_failure_ms_ = EventLoop::NowMs();
+}
+
+void Http2Pool::DrainQueue() {
+  if (draining_) return;
+  draining_ = true;
+  while (!queue_.empty()) {
+    Http2Connection* connection = PickConnection();
+    // Past the target load, wait for a new connection while the pool can
+    // still grow; the peer's stream limit is only used once it cannot.
+    if (!connection || connection->active_streams() >= options_.target_streams_per_connection) {
+      if (!Connecting() && CanGrow()) {
+        // The new connection may already be ready, or may have failed and
+        // counted against CanGrow(); either way, pick again.
+        OpenConnection();
+        continue;
+      }
+      if (Connecting() || !connection) break;
+    }
+    Request request = std::move(queue_.front());
+    queue_.pop_front();
+    uint32_t stream_id = connection->OpenStream(request.headers, request.end_stream,
+                                                request.delegate);
+    if (stream_id == 0) {
+      stats_.streams_failed++;
+      request.callback(nullptr, 0);
+      continue;
+    }
+    stats_.streams_opened++;
+    request.callback(connection, stream_id);
+  }
+  draining_ = false;
+  if (!queue_.empty() && !PickConnection() && !Connecting()) FailQueue();
+}
+
+void Http2Pool::FailQueue() {
+  std::deque<Request> queue;
+  queue.swap(queue_);
+  for (auto& request : queue) {
+    stats_.streams_failed++;
+    request.callback(nullptr, 0);
+  }
+}
+
+void Http2Pool::OnReady(Http2Connection* connection) {
+  stats_.connections_opened++;
+  if (connection->resumed()) stats_.tls_resumed++;
+  if (int mtu = SocketPathMtu(connection->fd())) stats_.path_mtu = static_cast<uint64_t>(mtu);
+  failed_attempts_ = 0;
+  auto attempt = attempts_.find(connection);
+  if (attempt != attempts_.end()) {
+    SocketAddress address = attempt->second.address;
+    Tracer::Complete("pool.connect", attempt->second.started_ns, connection->resumed());
+    attempts_.erase(attempt);
+    if (cold_start_ms_ != 0) {
+      stats_.last_connect_ms = static_cast<uint64_t>(EventLoop::NowMs() - cold_start_ms_);
+      if (options_.connect_time_ms) {
+        options_.connect_time_ms->Record(static_cast<int64_t>(stats_.last_connect_ms));
+      }
+      Tracer::Complete("pool.cold_start", cold_start_ms_ * 1000000,
+                       static_cast<int64_t>(connections_.size()));
+      cold_start_ms_ = 0;
+      if (race_timer_) {
+        loop_->CancelTimer(race_timer_);
+        race_timer_ = 0;
+      }
+      if (options_.winners) options_.winners->Record(EndpointKey(), NetworkId(), address);
+      // Every other attempt of a cold start lost the race.
+      connections_.erase(std::remove_if(connections_.begin(), connections_.end(),
+                                        [this](const std::unique_ptr<Http2Connection>& c) {
+                                          return attempts_.count(c.get()) != 0;
+                                        }),
+                         connections_.end());
+      attempts_.clear();
+    }
+  }
+  DrainQueue();
+}
+
+void Http2Pool::OnCapacity(Http2Connection* connection) {
+  (void)connection;
+  DrainQueue();
+}
+
+void Http2Pool::OnClosed(Http2Connection* connection) {
+  if (!connection->established()) RecordFailure();
+  auto attempt = attempts_.find(connection);
+  if (attempt != attempts_.end()) {
+    Tracer::Complete("pool.connect_failed", attempt->second.started_ns);
+    SocketAddress winner;
+    if (options_.winners &&
+        options_.winners->Lookup(EndpointKey(), NetworkId(), &winner) &&
+        winner == attempt->second.address) {
+      // The cached winner no longer works on this network; race afresh.
+      options_.winners->Forget(EndpointKey(), NetworkId());
+    }
+    attempts_.erase(attempt);
+  }
+  for (auto it = connections_.begin(); it != connections_.end(); ++it) {
+    if (it->get() == connection) {
+      connections_.erase(it);
+      break;
+    }
+  }
+  DrainQueue();
+}
+
+}  // namespace vpn_plugin
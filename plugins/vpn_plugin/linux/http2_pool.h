@@ -0,0 +1,173 @@
+#ifndef FLUTTER_PLUGIN_HTTP2_POOL_H_
+#define FLUTTER_PLUGIN_HTTP2_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config_document.h"
+#include "event_loop.h"
+#include "http2_connection.h"
+#include "metrics.h"
+#include "net_address.h"
+#include "tls_stream.h"
+#include "upstream_cache.h"
+
+namespace vpn_plugin {
+
+struct Http2PoolOptions {
+  // Endpoint addresses, tried round-robin as connections are opened.
+  std::vector<SocketAddress> addresses;
+  // While no connection is ready, an attempt that has not finished its
+  // handshake after this long is raced by one to the next address (Happy
+  // Eyeballs, RFC 8305); the first to become ready wins and the others are
+  // dropped. 0 turns racing off.
+  int64_t race_delay_ms = 250;
+  // Winners of past races. A pool starting cold tries the winner for the
+  // current network first. May be shared between pools and threads.
+  std::shared_ptr<UpstreamWinnerCache> winners;
+  // Names the current network for the winner cache; defaults to the local
+  // address toward the first endpoint address.
+  std::function<std::string()> network_id;
+  // SNI and certificate name; the endpoint hostname.
+  std::string server_name;
+  // Without a TLS context connections speak cleartext HTTP/2 with prior
+  // knowledge (h2c), which is only meant for tests.
+  std::shared_ptr<TlsClientContext> tls;
+  // Session cache for the TLS context FromConfig() creates.
+  std::shared_ptr<TlsSessionCache> tls_sessions;
+  Http2ConnectionOptions connection;
+  size_t max_connections = 4;
+  // A new connection is opened once every live connection carries this many
+  // streams, even if the peer would allow more on the existing ones.
+  size_t target_streams_per_connection = 64;
+  // Time from a cold start to its first ready connection, in milliseconds.
+  // May be shared between pools.
+  Histogram* connect_time_ms = nullptr;
+
+  // Reads the [endpoint] section. Returns false if it has no usable address.
+  static bool FromConfig(const ConfigDocument& config, Http2PoolOptions* out,
+                         std::string* error);
+};
+
+struct Http2PoolStats {
+  uint64_t connections_opened = 0;
+  uint64_t connections_failed = 0;
+  uint64_t streams_opened = 0;
+  uint64_t streams_queued = 0;
+  uint64_t streams_failed = 0;
+  // Attempts started because an earlier one was slow, and cold starts that
+  // went to a cached winner first.
+  uint64_t races_started = 0;
+  uint64_t winner_cache_hits = 0;
+  // Time from the first attempt of a cold start until a connection was
+  // ready, for the last cold start.
+  uint64_t last_connect_ms = 0;
+  // Connections that resumed a TLS session instead of a full handshake.
+  uint64_t tls_resumed = 0;
+  // Path MTU toward the endpoint as the kernel last saw it when a
+  // connection became ready; 0 until one has.
+  uint64_t path_mtu = 0;
+};
+
+// Multiplexes streams over a small set of HTTP/2 connections to one
+// endpoint. New streams go to the live connection with the fewest active
+// streams. Once every connection carries the target number of streams a new
+// one is opened, up to max_connections; past that, streams are packed up to
+// the peer's concurrency limit and then queued. While no connection is
+// ready, slow attempts are raced across the endpoint addresses. Must be used
+// on the loop thread.
+class Http2Pool : public Http2Connection::Listener {
+ public:
+  using RequestId = uint64_t;
+  // Called once with the connection and stream id, or with (nullptr, 0) if
+  // the stream could not be opened.
+  using OpenCallback = std::function<void(Http2Connection* connection, uint32_t stream_id)>;
+
+  Http2Pool(EventLoop* loop, Http2PoolOptions options);
+  ~Http2Pool() override;
+
+  Http2Pool(const Http2Pool&) = delete;
+  Http2Pool& operator=(const Http2Pool&) = delete;
+
+  // Opens a stream now if a connection has room, otherwise queues the
+  // request until one does. The callback may run before this returns.
+  RequestId OpenStream(std::vector<HpackHeader> headers, bool end_stream,
+                       Http2StreamDelegate* delegate, OpenCallback callback);
+  // Drops a queued request; its callback is not run.
+  void Cancel(RequestId id);
+
+  size_t connection_count() const { return connections_.size(); }
+  size_t queued() const { return queue_.size(); }
+  const Http2PoolStats& stats() const { return stats_; }
+  // Active streams per live connection, for diagnostics and tests.
+  std::vector<size_t> StreamsPerConnection() const;
+
+  // Http2Connection::Listener:
+  void OnReady(Http2Connection* connection) override;
+  void OnCapacity(Http2Connection* connection) override;
+  void OnClosed(Http2Connection* connection) override;
+
+ private:
+  struct Request {
+    RequestId id;
+    std::vector<HpackHeader> headers;
+    bool end_stream;
+    Http2StreamDelegate* delegate;
+    OpenCallback callback;
+  };
+
+  // The live connection with the fewest active streams that can take one
+  // more, or null.
+  Http2Connection* PickConnection() const;
+  bool CanGrow() const;
+  bool Connecting() const;
+  bool AnyReady() const;
+  void OpenConnection();
+  void ArmRace();
+  void OnRaceTimer();
+  std::string NetworkId() const;
+  std::string EndpointKey() const;
+  void RecordFailure();
+  void DrainQueue();
+  void FailQueue();
+
+  EventLoop* loop_;
+  Http2PoolOptions options_;
+  std::vector<std::unique_ptr<Http2Connection>> connections_;
+  std::deque<Request> queue_;
+  RequestId next_request_id_ = 1;
+  size_t next_address_ = 0;
+  struct Attempt {
+    SocketAddress address;
+    int64_t started_ns;
+  };
+
+  // Address each connection still in its handshake was opened to.
+  std::unordered_map<Http2Connection*, Attempt> attempts_;
+  EventLoop::TimerId race_timer_ = 0;
+  // Start of the current cold start, 0 while a connection is ready.
+  int64_t cold_start_ms_ = 0;
+  bool draining_ = false;
+  // Connection attempts that failed since one last became ready; growth
+  // pauses for a while once every address has failed.
+  size_t failed_attempts_ = 0;
+  int64_t last_failure_ms_ = 0;
+  Http2PoolStats stats_;
+};
+
+// Standard headers of an HTTP/2 CONNECT request (RFC 9113 section 8.5) for
+// |authority| ("host:port"), with Basic proxy credentials when |username|
+// is set.
+std::vector<HpackHeader> Http2ConnectHeaders(const std::string& authority,
+                                             const std::string& username,
+                                             const std::string& password);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_HTTP2_POOL_H_
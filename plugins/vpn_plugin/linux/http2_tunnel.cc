@@ -0,0 +1,335 @@
+#include "http2_tunnel.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <utility>
+
+#include "buffer_pool.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+std::string Authority(const FlowTarget& target) {
+  std::string host = target.domain;
+  if (host.empty()) {
+    host = target.ip.ToString();
+    if (target.ip.is_v6()) host = "[" + host + "]";
+  }
+  return host + ":" + std::to_string(target.port);
+}
+
+}  // namespace
+
+class Http2TunnelConnector::Flow : public Http2StreamDelegate {
+ public:
+  Flow(Http2TunnelConnector* owner, uint64_t id, int fd)
+      : owner_(owner), id_(id), fd_(fd), down_(BufferPool::ForThread()) {}
+
+  ~Flow() override {
+    if (RelayBudget* budget = owner_->budget_) {
+      if (waiter_) budget->CancelWait(waiter_);
+      if (paused_) budget->OnResumed();
+      budget->Release(charged_);
+    }
+    if (connection_ && stream_id_) connection_->ResetStream(stream_id_, Http2Error::kCancel);
+    if (request_) owner_->pool_->Cancel(request_);
+    if (fd_ >= 0) {
+      owner_->loop_->Remove(fd_);
+      close(fd_);
+    }
+  }
+
+  bool Start(const std::string& authority) {
+    if (!owner_->loop_->Add(fd_,
+                            EventLoop::kReadable | EventLoop::kWritable | EventLoop::kHangup,
+                            [this](uint32_t events) { OnLocalEvent(events); })) {
+      return false;
+    }
+    Http2Pool::RequestId request = owner_->pool_->OpenStream(
+        Http2ConnectHeaders(authority, owner_->username_, owner_->password_), false, this,
+        [this](Http2Connection* connection, uint32_t stream_id) {
+          request_ = 0;
+          if (!connection) {
+            owner_->stats_.flows_refused++;
+            Finish();
+            return;
+          }
+          connection_ = connection;
+          stream_id_ = stream_id;
+        });
+    // The callback may already have run.
+    if (!connection_ && !finished_) request_ = request;
+    return true;
+  }
+
+  // Http2StreamDelegate:
+  void OnHeaders(uint32_t, const std::vector<HpackHeader>& headers, bool end_stream) override {
+    if (finished_ || established_) return;  // Trailers.
+    for (const auto& header : headers) {
+      if (header.name == ":status") established_ = header.value.size() == 3 && header.value[0] == '2';
+    }
+    if (!established_ || end_stream) {
+      owner_->stats_.flows_refused++;
+      Finish();
+      return;
+    }
+    owner_->stats_.flows_opened++;
+    PumpUp();
+  }
+
+  void OnData(uint32_t, const char* data, size_t size, bool end_stream) override {
+    if (finished_) return;
+    size_t written = 0;
+    if (down_.empty()) {
+      written = WriteLocal(data, size);
+      if (written == SIZE_MAX) return;
+    }
+    if (!down_.Append(data + written, size - written)) {
+      Finish();
+      return;
+    }
+    Credit(written);
+    remote_eof_ = remote_eof_ || end_stream;
+    MaybeShutdownLocal();
+  }
+
+  void OnWritable(uint32_t) override { PumpUp(); }
+
+  void OnClosed(uint32_t, Http2Error error) override {
+    connection_ = nullptr;
+    stream_id_ = 0;
+    // A clean close still lets buffered bytes drain to the flow.
+    if (error != Http2Error::kNoError || down_.empty()) {
+      Finish();
+      return;
+    }
+    remote_eof_ = true;
+  }
+
+ private:
+  void OnLocalEvent(uint32_t events) {
+    if (events & EventLoop::kWritable) FlushDown();
+    if (finished_) return;
+    if (events & (EventLoop::kReadable | EventLoop::kHangup)) PumpUp();
+  }
+
+  // Moves bytes from the flow into the stream while it has send window.
+  void PumpUp() {
+    if (finished_ || !connection_ || !established_) return;
+    while (true) {
+      if (up_) {
+        size_t sent = connection_->SendData(stream_id_, up_.data() + up_begin_,
+                                            up_end_ - up_begin_, local_eof_);
+        if (!connection_) return;
+        owner_->stats_.bytes_up += sent;
+        up_begin_ += sent;
+        if (up_begin_ < up_end_) {
+          Settle();
+          return;  // Resumed from OnWritable().
+        }
+        up_.reset();
+      }
+      Settle();
+      if (local_eof_) return;
+      if (Throttled()) {
+        // The local socket is not drained, so no edge will come; FlushDown()
+        // or the budget resumes reading.
+        reads_paused_ = true;
+        return;
+      }
+      up_ = PooledBuffer(BufferPool::ForThread(), BufferPool::kChunkSize);
+      if (!up_) {
+        Finish();
+        return;
+      }
+      ssize_t n = recv(fd_, up_.data(), BufferPool::kChunkSize, 0);
+      if (n > 0) {
+        up_begin_ = 0;
+        up_end_ = static_cast<size_t>(n);
+        Settle();
+        continue;
+      }
+      up_.reset();
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+      if (n < 0) {
+        Finish();
+        return;
+      }
+      local_eof_ = true;
+      connection_->SendData(stream_id_, nullptr, 0, true);
+      return;
+    }
+  }
+
+  // Returns the number of bytes written, or SIZE_MAX if the flow failed.
+  size_t WriteLocal(const char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+      ssize_t n = send(fd_, data + written, size - written, MSG_NOSIGNAL);
+      if (n > 0) {
+        written += static_cast<size_t>(n);
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+      Finish();
+      return SIZE_MAX;
+    }
+    return written;
+  }
+
+  void FlushDown() {
+    if (down_.empty()) return;
+    size_t flushed = 0;
+    while (!down_.empty()) {
+      size_t size = down_.front_size();
+      size_t written = WriteLocal(down_.front(), size);
+      if (written == SIZE_MAX) return;
+      down_.Consume(written);
+      flushed += written;
+      if (written < size) break;
+    }
+    Credit(flushed);
+    MaybeShutdownLocal();
+    if (reads_paused_ && !finished_) {
+      reads_paused_ = false;
+      PumpUp();
+    }
+  }
+
+  // Bytes the flow has accepted go back to the endpoint as stream window,
+  // unless the flow or the loop is over budget; they are then owed until
+  // it drains, which keeps the endpoint from sending more.
+  void Credit(size_t bytes) {
+    owner_->stats_.bytes_down += bytes;
+    owed_ += bytes;
+    Settle();
+  }
+
+  size_t Buffered() const { return (up_ ? up_end_ - up_begin_ : 0) + down_.size(); }
+
+  // Brings the flow's charge on the budget in line with what it holds, and
+  // hands out withheld credit once it may take in more.
+  void Settle() {
+    if (RelayBudget* budget = owner_->budget_) {
+      size_t held = Buffered();
+      if (held > charged_) {
+        budget->Charge(held - charged_);
+      } else {
+        budget->Release(charged_ - held);
+      }
+      charged_ = held;
+    }
+    if (!owed_ || !connection_ || finished_ || Throttled()) return;
+    connection_->Consume(stream_id_, owed_);
+    owed_ = 0;
+  }
+
+  // Returns true while the flow must take in nothing more. Over its own
+  // budget the flow waits for its local side to drain; over the loop's it
+  // also queues on the budget.
+  bool Throttled() {
+    RelayBudget* budget = owner_->budget_;
+    if (!budget) return false;
+    if (Buffered() < budget->per_flow_bytes() && !budget->exhausted()) {
+      if (paused_) {
+        paused_ = false;
+        budget->OnResumed();
+      }
+      return false;
+    }
+    if (!paused_) {
+      paused_ = true;
+      budget->OnPaused();
+    }
+    if (budget->exhausted() && !waiter_) {
+      waiter_ = budget->Wait([this]() {
+        waiter_ = 0;
+        Settle();
+        reads_paused_ = false;
+        PumpUp();
+      });
+    }
+    return true;
+  }
+
+  void MaybeShutdownLocal() {
+    if (!remote_eof_ || !down_.empty() || finished_) return;
+    shutdown(fd_, SHUT_WR);
+    if (!connection_ || local_eof_) Finish();
+  }
+
+  void Finish() {
+    if (finished_) return;
+    finished_ = true;
+    owner_->Remove(id_);
+  }
+
+  Http2TunnelConnector* owner_;
+  uint64_t id_;
+  int fd_;
+  Http2Pool::RequestId request_ = 0;
+  Http2Connection* connection_ = nullptr;
+  uint32_t stream_id_ = 0;
+  bool established_ = false;
+  bool local_eof_ = false;
+  bool remote_eof_ = false;
+  bool finished_ = false;
+  bool paused_ = false;
+  bool reads_paused_ = false;
+  // Bytes charged on the budget, and credit withheld from the stream.
+  size_t charged_ = 0;
+  size_t owed_ = 0;
+  RelayBudget::WaiterId waiter_ = 0;
+  // Read from the flow but not yet accepted by the stream; released once
+  // the stream takes all of it.
+  PooledBuffer up_;
+  size_t up_begin_ = 0;
+  size_t up_end_ = 0;
+  // Received from the stream but not yet accepted by the flow.
+  ChunkQueue down_;
+};
+
+Http2TunnelConnector::Http2TunnelConnector(EventLoop* loop, Http2Pool* pool,
+                                           std::string username, std::string password,
+                                           RelayBudget* budget)
+    : loop_(loop),
+      pool_(pool),
+      username_(std::move(username)),
+      password_(std::move(password)),
+      budget_(budget),
+      alive_(std::make_shared<bool>(true)) {}
+
+Http2TunnelConnector::~Http2TunnelConnector() {
+  *alive_ = false;
+  flows_.clear();
+}
+
+int Http2TunnelConnector::Open(const FlowTarget& target) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) return -1;
+  uint64_t id = next_id_++;
+  auto flow = std::unique_ptr<Flow>(new Flow(this, id, fds[1]));
+  Flow* raw = flow.get();
+  flows_[id] = std::move(flow);
+  if (!raw->Start(Authority(target))) {
+    flows_.erase(id);
+    close(fds[0]);
+    return -1;
+  }
+  return fds[0];
+}
+
+void Http2TunnelConnector::Remove(uint64_t id) {
+  // Flows finish from inside their own callbacks; delete them afterwards.
+  std::weak_ptr<bool> alive = alive_;
+  loop_->Post([this, alive, id]() {
+    if (alive.expired() || !*alive.lock()) return;
+    flows_.erase(id);
+  });
+}
+
+}  // namespace vpn_plugin
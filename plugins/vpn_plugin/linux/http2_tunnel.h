@@ -0,0 +1,65 @@
+#ifndef FLUTTER_PLUGIN_HTTP2_TUNNEL_H_
+#define FLUTTER_PLUGIN_HTTP2_TUNNEL_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "event_loop.h"
+#include "http2_pool.h"
+#include "relay_budget.h"
+#include "socks_server.h"
+
+namespace vpn_plugin {
+
+struct Http2TunnelStats {
+  uint64_t flows_opened = 0;
+  uint64_t flows_refused = 0;
+  uint64_t bytes_up = 0;
+  uint64_t bytes_down = 0;
+};
+
+// Carries listener flows as CONNECT streams over the pooled HTTP/2
+// connections to the endpoint. Each flow gets one end of a socketpair; the
+// other end is bridged to its stream on the loop thread.
+//
+// Backpressure is end to end: bytes are only read from the flow while the
+// stream has send window, and received bytes are only credited back to the
+// endpoint once the flow has accepted them. With a RelayBudget, flows also
+// stop reading and withhold those credits while they or the loop hold more
+// than the budget allows. The pool and budget must outlive the connector.
+class Http2TunnelConnector : public TunnelConnector {
+ public:
+  Http2TunnelConnector(EventLoop* loop, Http2Pool* pool, std::string username,
+                       std::string password, RelayBudget* budget = nullptr);
+  ~Http2TunnelConnector() override;
+
+  Http2TunnelConnector(const Http2TunnelConnector&) = delete;
+  Http2TunnelConnector& operator=(const Http2TunnelConnector&) = delete;
+
+  // TunnelConnector:
+  int Open(const FlowTarget& target) override;
+
+  size_t active_flows() const { return flows_.size(); }
+  const Http2TunnelStats& stats() const { return stats_; }
+
+ private:
+  class Flow;
+
+  void Remove(uint64_t id);
+
+  EventLoop* loop_;
+  Http2Pool* pool_;
+  std::string username_;
+  std::string password_;
+  RelayBudget* budget_;
+  uint64_t next_id_ = 1;
+  std::unordered_map<uint64_t, std::unique_ptr<Flow>> flows_;
+  std::shared_ptr<bool> alive_;
+  Http2TunnelStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_HTTP2_TUNNEL_H_
@@ -18,6 +18,8 @@ typedef struct {
 
 FLUTTER_PLUGIN_EXPORT GType vpn_plugin_get_type(void);
 
+#define VPN_PLUGIN(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), vpn_plugin_get_type(), VpnPlugin))
+
 FLUTTER_PLUGIN_EXPORT void vpn_plugin_register_with_registrar(FlPluginRegistrar* registrar);
 
 G_END_DECLS
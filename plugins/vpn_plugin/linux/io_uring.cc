@@ -0,0 +1,180 @@
+#include "io_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+namespace vpn_plugin {
+
+namespace {
+
+// Completions outnumber submissions with multishot requests.
+constexpr unsigned kCqEntriesPerSqEntry = 4;
+
+}  // namespace
+
+IoUring::~IoUring() {
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (ring_) munmap(ring_, ring_size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+bool IoUring::Init(unsigned entries) {
+  if (fd_ >= 0) return true;
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * kCqEntriesPerSqEntry;
+  int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (fd < 0) return false;
+  uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    close(fd);
+    return false;
+  }
+  fd_ = fd;
+
+  // Both rings share one mapping (IORING_FEAT_SINGLE_MMAP).
+  ring_size_ = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  void* ring = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) return false;
+  ring_ = ring;
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto* sq = static_cast<char*>(ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  // Submission slots map one to one onto the entry array.
+  auto* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; i++) array[i] = i;
+
+  auto* cq = static_cast<char*>(ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  std::vector<char> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+  auto* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+  if (Register(IORING_REGISTER_PROBE, probe, 256) == 0) {
+    for (unsigned i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++) {
+      if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) supported_ops_[i] = 1;
+    }
+  }
+  return true;
+}
+
+io_uring_sqe* IoUring::GetSqe() {
+  unsigned tail = *sq_tail_ + sq_pending_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+    if (SubmitAndWait(0, 0) < 0) return nullptr;
+    tail = *sq_tail_ + sq_pending_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) return nullptr;
+  }
+  io_uring_sqe* sqe = &sqes_[tail & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_pending_++;
+  return sqe;
+}
+
+int IoUring::SubmitAndWait(unsigned wait_nr, int timeout_ms) {
+  unsigned to_submit = sq_pending_;
+  if (to_submit) {
+    __atomic_store_n(sq_tail_, *sq_tail_ + to_submit, __ATOMIC_RELEASE);
+    sq_pending_ = 0;
+  }
+  if (timeout_ms == 0) wait_nr = 0;
+  if (to_submit == 0 && wait_nr == 0) return 0;
+
+  __kernel_timespec ts;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  if (wait_nr && timeout_ms > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  int n = Enter(to_submit, wait_nr, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+  // A timeout or signal only ends the wait; the entries were taken.
+  if (n < 0 && (errno == ETIME || errno == EINTR)) return 0;
+  return n;
+}
+
+bool IoUring::SupportsOp(uint8_t opcode) const {
+  return opcode < IORING_OP_LAST && supported_ops_[opcode];
+}
+
+bool IoUring::RegisterSparseFiles(unsigned count) {
+  io_uring_rsrc_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.nr = count;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  return Register(IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0;
+}
+
+bool IoUring::UpdateFile(unsigned slot, int fd) {
+  io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds = reinterpret_cast<uint64_t>(&fd);
+  return Register(IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool IoUring::RegisterBuffer(void* base, size_t size) {
+  iovec iov = {base, size};
+  return Register(IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+
+bool IoUring::UnregisterFiles() { return Register(IORING_UNREGISTER_FILES, nullptr, 0) == 0; }
+
+bool IoUring::UnregisterBuffers() {
+  return Register(IORING_UNREGISTER_BUFFERS, nullptr, 0) == 0;
+}
+
+bool IoUring::RegisterBufferRing(io_uring_buf_ring* ring, unsigned entries, uint16_t group) {
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  return Register(IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+}
+
+bool IoUring::UnregisterBufferRing(uint16_t group) {
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = group;
+  return Register(IORING_UNREGISTER_PBUF_RING, &reg, 1) == 0;
+}
+
+int IoUring::Register(unsigned opcode, const void* arg, unsigned count) {
+  syscalls_.fetch_add(1, std::memory_order_relaxed);
+  return static_cast<int>(syscall(__NR_io_uring_register, fd_, opcode, arg, count));
+}
+
+int IoUring::Enter(unsigned to_submit, unsigned wait_nr, unsigned flags, const void* arg,
+                   size_t arg_size) {
+  syscalls_.fetch_add(1, std::memory_order_relaxed);
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, flags, arg, arg_size));
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,98 @@
+#ifndef FLUTTER_PLUGIN_IO_URING_H_
+#define FLUTTER_PLUGIN_IO_URING_H_
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace vpn_plugin {
+
+// Minimal io_uring ring driven through the raw system calls, so the plugin
+// does not depend on liburing. Not thread-safe; owned by one EventLoop.
+class IoUring {
+ public:
+  IoUring() = default;
+  ~IoUring();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Sets up a ring with |entries| submission slots. Fails on kernels
+  // without the features the loop relies on (extended wait arguments,
+  // no dropped completions), so callers can fall back to epoll.
+  bool Init(unsigned entries);
+  bool ok() const { return fd_ >= 0; }
+
+  // Returns a zeroed submission entry. When the queue is full, queued
+  // entries are submitted first; nullptr if that fails.
+  io_uring_sqe* GetSqe();
+  // Submits queued entries and waits up to |timeout_ms| (-1 for no limit)
+  // for at least |wait_nr| completions.
+  int SubmitAndWait(unsigned wait_nr, int timeout_ms);
+
+  // Calls |fn| with a copy of each ready completion. Each entry is released
+  // before its callback runs, so callbacks may queue new submissions.
+  template <typename Fn>
+  unsigned DrainCompletions(Fn fn) {
+    unsigned count = 0;
+    while (true) {
+      unsigned head = *cq_head_;
+      if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return count;
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      fn(cqe);
+      count++;
+    }
+  }
+
+  // Whether the kernel knows |opcode|.
+  bool SupportsOp(uint8_t opcode) const;
+
+  // Registers an empty table of |count| fixed files, filled by UpdateFile.
+  bool RegisterSparseFiles(unsigned count);
+  // Installs |fd| (-1 to clear) in fixed file slot |slot|.
+  bool UpdateFile(unsigned slot, int fd);
+  // Pins [base, base + size) as registered buffer 0.
+  bool RegisterBuffer(void* base, size_t size);
+  bool UnregisterFiles();
+  bool UnregisterBuffers();
+  // Registers |ring| (page aligned, |entries| a power of two) as provided
+  // buffer group |group|.
+  bool RegisterBufferRing(io_uring_buf_ring* ring, unsigned entries, uint16_t group);
+  bool UnregisterBufferRing(uint16_t group);
+
+  // io_uring_enter and io_uring_register calls made so far.
+  uint64_t syscalls() const { return syscalls_.load(std::memory_order_relaxed); }
+
+ private:
+  int Register(unsigned opcode, const void* arg, unsigned count);
+  int Enter(unsigned to_submit, unsigned wait_nr, unsigned flags, const void* arg,
+            size_t arg_size);
+
+  int fd_ = -1;
+  void* ring_ = nullptr;
+  size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  // Entries filled since the last submit.
+  unsigned sq_pending_ = 0;
+
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+
+  uint8_t supported_ops_[IORING_OP_LAST] = {};
+  std::atomic<uint64_t> syscalls_{0};
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_IO_URING_H_
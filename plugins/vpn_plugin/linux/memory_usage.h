@@ -0,0 +1,54 @@
+#ifndef FLUTTER_PLUGIN_MEMORY_USAGE_H_
+#define FLUTTER_PLUGIN_MEMORY_USAGE_H_
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vpn_plugin {
+
+// Live heap bytes and objects one subsystem holds. Subsystems count their
+// containers by capacity, not size, and add a node's worth of pointers for
+// every element of a list or hash map, so the figure follows what the
+// allocator hands out rather than what is in use.
+struct MemoryUsage {
+  size_t bytes = 0;
+  size_t objects = 0;
+
+  MemoryUsage& operator+=(const MemoryUsage& other) {
+    bytes += other.bytes;
+    objects += other.objects;
+    return *this;
+  }
+};
+
+// Heap bytes behind |text|; none while it fits the small-string buffer.
+inline size_t HeapBytes(const std::string& text) {
+  return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+}
+
+template <typename T>
+size_t HeapBytes(const std::vector<T>& values) {
+  return values.capacity() * sizeof(T);
+}
+
+// Nodes only; what the elements own on top is the caller's to add.
+template <typename T>
+size_t HeapBytes(const std::list<T>& values) {
+  return values.size() * (sizeof(T) + 2 * sizeof(void*));
+}
+
+// The bucket array and nodes, each node holding a next pointer and the
+// cached hash. What keys and values own on top is the caller's to add.
+template <typename K, typename V, typename H, typename E, typename A>
+size_t HeapBytes(const std::unordered_map<K, V, H, E, A>& map) {
+  using Node = std::pair<const K, V>;
+  return map.bucket_count() * sizeof(void*) +
+         map.size() * (sizeof(Node) + sizeof(void*) + sizeof(size_t));
+}
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_MEMORY_USAGE_H_
@@ -0,0 +1,144 @@
+#include "method_dispatcher.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr uint32_t kSeedAttempts = 4096;
+// Doublings of the table past twice the name count before giving up.
+constexpr int kMaxGrowth = 4;
+
+}  // namespace
+
+MethodTable::MethodTable(std::vector<std::string> names) : names_(std::move(names)) {
+  uint32_t size = 4;
+  while (size < names_.size() * 2) size <<= 1;
+  // A table twice the size of the name list almost always has a seed
+  // without collisions within a few tries; grow it if not.
+  for (int growth = 0; growth <= kMaxGrowth; growth++, size <<= 1) {
+    for (uint32_t seed = 1; seed <= kSeedAttempts; seed++) {
+      slots_.assign(size, -1);
+      bool collided = false;
+      for (size_t i = 0; i < names_.size() && !collided; i++) {
+        size_t length;
+        uint32_t slot = Hash(names_[i].c_str(), seed, &length) & (size - 1);
+        int taken = slots_[slot];
+        // A repeated name hashes like its first copy, which keeps the slot.
+        if (taken >= 0 && names_[static_cast<size_t>(taken)] == names_[i]) continue;
+        collided = taken >= 0;
+        slots_[slot] = static_cast<int>(i);
+      }
+      if (!collided) {
+        mask_ = size - 1;
+        seed_ = seed;
+        return;
+      }
+    }
+  }
+  // No seed separates the names; Find() compares against each of them.
+  slots_.clear();
+}
+
+// FNV-1a with the seed mixed into the offset basis.
+uint32_t MethodTable::Hash(const char* name, uint32_t seed, size_t* length) {
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  const char* p = name;
+  for (; *p; p++) {
+    hash ^= static_cast<uint8_t>(*p);
+    hash *= 16777619u;
+  }
+  *length = static_cast<size_t>(p - name);
+  return hash ^ (hash >> 15);
+}
+
+int MethodTable::Find(const char* name) const {
+  if (!name) return -1;
+  if (slots_.empty()) {
+    for (size_t i = 0; i < names_.size(); i++) {
+      if (names_[i] == name) return static_cast<int>(i);
+    }
+    return -1;
+  }
+  size_t length;
+  int index = slots_[Hash(name, seed_, &length) & mask_];
+  if (index < 0) return -1;
+  const std::string& candidate = names_[static_cast<size_t>(index)];
+  if (candidate.size() != length || memcmp(candidate.data(), name, length) != 0) return -1;
+  return index;
+}
+
+MethodDispatcher::MethodDispatcher(MethodDispatcherOptions options) : options_(options) {
+  size_t workers = options_.workers ? options_.workers : 1;
+  for (size_t i = 0; i < workers; i++) workers_.emplace_back([this]() { WorkerMain(); });
+}
+
+MethodDispatcher::~MethodDispatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_.notify_all();
+  for (std::thread& worker : workers_) worker.join();
+}
+
+void MethodDispatcher::Post(uint32_t lane, Task task) {
+  stats_.calls++;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Lane& queue = lanes_[lane];
+    queue.tasks.push_back(std::move(task));
+    pending_++;
+    if (queue.scheduled) {
+      stats_.queued_behind++;
+      return;
+    }
+    queue.scheduled = true;
+    ready_.push_back(lane);
+  }
+  work_.notify_one();
+}
+
+void MethodDispatcher::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+void MethodDispatcher::WorkerMain() {
+  if (options_.nice > 0) {
+    // Per thread on Linux, where the thread id names the thread.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), options_.nice);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_.wait(lock, [this]() { return !ready_.empty() || stopping_; });
+    // Queued tasks still run when stopping; their owners wait on them.
+    if (ready_.empty()) return;
+    uint32_t id = ready_.front();
+    ready_.pop_front();
+    Lane& lane = lanes_[id];
+    Task task = std::move(lane.tasks.front());
+    lane.tasks.pop_front();
+    lock.unlock();
+    task();
+    task = nullptr;
+    lock.lock();
+    // The lane goes to the back so that a busy lane does not starve the
+    // others. Map references stay valid while other lanes are added.
+    if (lane.tasks.empty()) {
+      lane.scheduled = false;
+    } else {
+      ready_.push_back(id);
+      work_.notify_one();
+    }
+    if (--pending_ == 0) idle_.notify_all();
+  }
+}
+
+}  // namespace vpn_plugin
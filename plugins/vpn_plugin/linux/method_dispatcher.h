@@ -0,0 +1,99 @@
+#ifndef FLUTTER_PLUGIN_METHOD_DISPATCHER_H_
+#define FLUTTER_PLUGIN_METHOD_DISPATCHER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace vpn_plugin {
+
+// Method names of one channel, looked up with one hash and one compare.
+// The hash seed is searched for when the table is built so that no two
+// names share a slot. A name listed twice is found at its first index.
+class MethodTable {
+ public:
+  explicit MethodTable(std::vector<std::string> names);
+
+  // Index of |name| in the list given to the constructor, the first if it
+  // is there more than once, or -1.
+  int Find(const char* name) const;
+  size_t size() const { return names_.size(); }
+
+ private:
+  static uint32_t Hash(const char* name, uint32_t seed, size_t* length);
+
+  std::vector<std::string> names_;
+  // Index into names_ per slot, -1 for empty slots.
+  std::vector<int> slots_;
+  uint32_t mask_ = 0;
+  uint32_t seed_ = 0;
+};
+
+struct MethodDispatcherOptions {
+  size_t workers = 2;
+  // Niceness of the worker threads, so that a thread drawing frames
+  // preempts them when there are fewer CPUs than busy threads.
+  int nice = 10;
+};
+
+struct MethodDispatcherStats {
+  std::atomic<uint64_t> calls{0};
+  // Calls waiting behind an earlier call of their lane when posted.
+  std::atomic<uint64_t> queued_behind{0};
+};
+
+// Runs method calls on worker threads instead of the thread that received
+// them. Calls posted to the same lane run one at a time in the order they
+// were posted; calls of different lanes may run at the same time. Replies
+// are the caller's business: a task hands its result back to the thread
+// that owns the channel itself.
+class MethodDispatcher {
+ public:
+  using Task = std::function<void()>;
+
+  explicit MethodDispatcher(MethodDispatcherOptions options = {});
+  // Runs what is still queued, then joins the workers.
+  ~MethodDispatcher();
+
+  MethodDispatcher(const MethodDispatcher&) = delete;
+  MethodDispatcher& operator=(const MethodDispatcher&) = delete;
+
+  // Thread-safe.
+  void Post(uint32_t lane, Task task);
+  // Blocks until every task posted so far has run.
+  void Drain();
+
+  const MethodDispatcherStats& stats() const { return stats_; }
+
+ private:
+  struct Lane {
+    std::deque<Task> tasks;
+    // A worker owns the lane, or the lane is in ready_.
+    bool scheduled = false;
+  };
+
+  void WorkerMain();
+
+  MethodDispatcherOptions options_;
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable idle_;
+  std::unordered_map<uint32_t, Lane> lanes_;
+  std::deque<uint32_t> ready_;
+  size_t pending_ = 0;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+  MethodDispatcherStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_METHOD_DISPATCHER_H_
@@ -0,0 +1,315 @@
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr int64_t kMinIntervalMs = 1000;
+
+// Each thread adds to one shard, picked round-robin as threads first add.
+size_t ThreadShard() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed);
+  return shard;
+}
+
+const char* TypeName(MetricsRegistry::Type type) {
+  switch (type) {
+    case MetricsRegistry::Type::kCounter:
+      return "counter";
+    case MetricsRegistry::Type::kGauge:
+      return "gauge";
+    default:
+      return "histogram";
+  }
+}
+
+// |name|{|labels|,|extra|}, leaving out the braces when there are none.
+void AppendSeries(std::string* out, const std::string& name, const std::string& labels,
+                  const std::string& extra) {
+  out->append(name);
+  if (labels.empty() && extra.empty()) return;
+  out->push_back('{');
+  out->append(labels);
+  if (!labels.empty() && !extra.empty()) out->push_back(',');
+  out->append(extra);
+  out->push_back('}');
+}
+
+// HELP text with backslashes and line breaks escaped.
+void AppendHelp(std::string* out, const std::string& help) {
+  for (char c : help) {
+    if (c == '\\') {
+      out->append("\\\\");
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
+
+}  // namespace
+
+void Counter::Add(uint64_t n) {
+  shards_[ThreadShard() % kShards].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const Shard& shard : shards_) total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+size_t Histogram::BucketIndex(int64_t value) {
+  uint64_t v = static_cast<uint64_t>(std::min(std::max<int64_t>(value, 0), kMaxValue));
+  if (v < (uint64_t{1} << kSubBucketBits)) return static_cast<size_t>(v);
+  // With e the highest set bit, v >> (e - kSubBucketBits) keeps the top
+  // kSubBucketBits + 1 bits, which lie in [32, 64).
+  int shift = 63 - __builtin_clzll(v) - kSubBucketBits;
+  return (static_cast<size_t>(shift) << kSubBucketBits) + static_cast<size_t>(v >> shift);
+}
+
+int64_t Histogram::BucketHigh(size_t index) {
+  constexpr size_t kSubBuckets = size_t{1} << kSubBucketBits;
+  if (index < 2 * kSubBuckets) return static_cast<int64_t>(index);
+  int shift = static_cast<int>(index >> kSubBucketBits) - 1;
+  int64_t top = static_cast<int64_t>((index & (kSubBuckets - 1)) + kSubBuckets);
+  return ((top + 1) << shift) - 1;
+}
+
+void Histogram::Record(int64_t value) {
+  value = std::min(std::max<int64_t>(value, 0), kMaxValue);
+  buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.buckets_.resize(kBuckets);
+  for (size_t i = 0; i < kBuckets; i++) {
+    snapshot.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+    snapshot.count_ += snapshot.buckets_[i];
+  }
+  snapshot.sum_ = sum_.load(std::memory_order_relaxed);
+  snapshot.max_ = max_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+int64_t HistogramSnapshot::Percentile(double quantile) const {
+  if (count_ == 0) return 0;
+  quantile = std::min(std::max(quantile, 0.0), 1.0);
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * count_)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen >= rank) return std::min(Histogram::BucketHigh(i), max_);
+  }
+  return max_;
+}
+
+uint64_t HistogramSnapshot::CountAtOrBelow(int64_t bound) const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < buckets_.size() && Histogram::BucketHigh(i) <= bound; i++) {
+    count += buckets_[i];
+  }
+  return count;
+}
+
+MetricsRegistry::Family* MetricsRegistry::GetFamily(const std::string& name,
+                                                    const std::string& help, Type type) {
+  auto it = families_.find(name);
+  if (it == families_.end()) {
+    it = families_.emplace(name, Family{}).first;
+    it->second.type = type;
+    it->second.help = help;
+  }
+  // A name registered as another type is a programming error; hand out a
+  // metric that is never exported rather than mixing types in one family.
+  return it->second.type == type ? &it->second : nullptr;
+}
+
+Counter* MetricsRegistry::GetCounter(const std::string& name, const std::string& help,
+                                     const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  static Counter unexported;
+  Family* family = GetFamily(name, help, Type::kCounter);
+  if (!family) return &unexported;
+  auto& counter = family->counters[labels];
+  if (!counter) counter = std::make_unique<Counter>();
+  return counter.get();
+}
+
+Gauge* MetricsRegistry::GetGauge(const std::string& name, const std::string& help,
+                                 const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  static Gauge unexported;
+  Family* family = GetFamily(name, help, Type::kGauge);
+  if (!family) return &unexported;
+  auto& gauge = family->gauges[labels];
+  if (!gauge) gauge = std::make_unique<Gauge>();
+  return gauge.get();
+}
+
+Histogram* MetricsRegistry::GetHistogram(const std::string& name, const std::string& help,
+                                         const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  static Histogram unexported;
+  Family* family = GetFamily(name, help, Type::kHistogram);
+  if (!family) return &unexported;
+  auto& histogram = family->histograms[labels];
+  if (!histogram) histogram = std::make_unique<Histogram>();
+  return histogram.get();
+}
+
+std::vector<MetricsRegistry::Sample> MetricsRegistry::Snapshot() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Sample> samples;
+  for (const auto& family : families_) {
+    for (const auto& counter : family.second.counters) {
+      Sample sample{family.first, family.second.help, counter.first, Type::kCounter, 0, {}};
+      sample.value = static_cast<int64_t>(counter.second->value());
+      samples.push_back(std::move(sample));
+    }
+    for (const auto& gauge : family.second.gauges) {
+      Sample sample{family.first, family.second.help, gauge.first, Type::kGauge,
+                    gauge.second->value(), {}};
+      samples.push_back(std::move(sample));
+    }
+    for (const auto& histogram : family.second.histograms) {
+      Sample sample{family.first, family.second.help, histogram.first, Type::kHistogram, 0, {}};
+      sample.histogram = histogram.second->Snapshot();
+      samples.push_back(std::move(sample));
+    }
+  }
+  return samples;
+}
+
+std::string MetricsRegistry::PrometheusText() const {
+  std::vector<Sample> samples = Snapshot();
+  std::string out;
+  const std::string* family = nullptr;
+  char number[32];
+  for (const Sample& sample : samples) {
+    if (!family || *family != sample.name) {
+      family = &sample.name;
+      out.append("# HELP ").append(sample.name).push_back(' ');
+      AppendHelp(&out, sample.help);
+      out.append("\n# TYPE ").append(sample.name).push_back(' ');
+      out.append(TypeName(sample.type)).push_back('\n');
+    }
+    if (sample.type != Type::kHistogram) {
+      AppendSeries(&out, sample.name, sample.labels, std::string());
+      snprintf(number, sizeof(number), " %lld\n", static_cast<long long>(sample.value));
+      out.append(number);
+      continue;
+    }
+    // Values are integers, so "le" at 2^k - 1 counts exactly the values
+    // below 2^k. One pass over the buckets serves every bound.
+    const HistogramSnapshot& h = sample.histogram;
+    size_t index = 0;
+    uint64_t below = 0;
+    for (int64_t bound = 0;; bound = bound * 2 + 1) {
+      for (; index < h.buckets_.size() && Histogram::BucketHigh(index) <= bound; index++) {
+        below += h.buckets_[index];
+      }
+      snprintf(number, sizeof(number), "le=\"%lld\"", static_cast<long long>(bound));
+      AppendSeries(&out, sample.name + "_bucket", sample.labels, number);
+      snprintf(number, sizeof(number), " %llu\n", static_cast<unsigned long long>(below));
+      out.append(number);
+      if (bound >= h.max()) break;
+    }
+    AppendSeries(&out, sample.name + "_bucket", sample.labels, "le=\"+Inf\"");
+    snprintf(number, sizeof(number), " %llu\n", static_cast<unsigned long long>(h.count()));
+    out.append(number);
+    AppendSeries(&out, sample.name + "_sum", sample.labels, std::string());
+    snprintf(number, sizeof(number), " %lld\n", static_cast<long long>(h.sum()));
+    out.append(number);
+    AppendSeries(&out, sample.name + "_count", sample.labels, std::string());
+    snprintf(number, sizeof(number), " %llu\n", static_cast<unsigned long long>(h.count()));
+    out.append(number);
+  }
+  return out;
+}
+
+bool MetricsRegistry::WritePrometheusFile(const std::string& path, std::string* error) const {
+  std::string data = PrometheusText();
+  // The textfile collector reads every *.prom file in its directory, so the
+  // file in progress must not end in .prom.
+  std::string temp = path + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (error) *error = "cannot create " + temp;
+    return false;
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n <= 0) break;
+    written += static_cast<size_t>(n);
+  }
+  bool ok = close(fd) == 0 && written == data.size() && rename(temp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    unlink(temp.c_str());
+    if (error) *error = "cannot write " + path;
+  }
+  return ok;
+}
+
+MetricsOptions MetricsOptions::FromConfig(const ConfigDocument& config) {
+  const char* kSection = "metrics";
+  MetricsOptions options;
+  options.textfile = config.GetString(kSection, "textfile");
+  int64_t interval = config.GetInt(kSection, "interval", options.interval_ms / 1000);
+  options.interval_ms = std::max(interval * 1000, kMinIntervalMs);
+  return options;
+}
+
+MetricsFileWriter::MetricsFileWriter(const MetricsRegistry* registry, MetricsOptions options)
+    : registry_(registry), options_(std::move(options)) {
+  if (!options_.textfile.empty()) thread_ = std::thread([this]() { Run(); });
+}
+
+MetricsFileWriter::~MetricsFileWriter() {
+  if (!thread_.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+  WriteOnce();
+}
+
+void MetricsFileWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    lock.unlock();
+    WriteOnce();
+    lock.lock();
+    wake_.wait_for(lock, std::chrono::milliseconds(options_.interval_ms),
+                   [this]() { return stopping_; });
+  }
+}
+
+void MetricsFileWriter::WriteOnce() {
+  if (registry_->WritePrometheusFile(options_.textfile, nullptr)) {
+    writes_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    failures_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace vpn_plugin
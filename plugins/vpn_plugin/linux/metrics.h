@@ -0,0 +1,184 @@
+#ifndef FLUTTER_PLUGIN_METRICS_H_
+#define FLUTTER_PLUGIN_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config_document.h"
+
+namespace vpn_plugin {
+
+// Monotonic count, spread over cache lines so that threads adding at the
+// same time do not contend on one.
+class Counter {
+ public:
+  void Add(uint64_t n = 1);
+  uint64_t value() const;
+
+ private:
+  static constexpr size_t kShards = 16;
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<Shard, kShards> shards_;
+};
+
+// Value that goes up and down, such as a queue depth.
+class Gauge {
+ public:
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void Add(int64_t delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Counts of a histogram at one point in time.
+class HistogramSnapshot {
+ public:
+  uint64_t count() const { return count_; }
+  int64_t sum() const { return sum_; }
+  int64_t max() const { return max_; }
+  // Value, to the histogram's precision, that |quantile| (0..1) of the
+  // recorded values are at or below. 0 when empty.
+  int64_t Percentile(double quantile) const;
+  // Values at or below |bound|; exact when |bound| + 1 is a power of two.
+  uint64_t CountAtOrBelow(int64_t bound) const;
+
+ private:
+  friend class Histogram;
+  friend class MetricsRegistry;
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  int64_t sum_ = 0;
+  int64_t max_ = 0;
+};
+
+// Distribution of non-negative integer values, such as latencies in
+// microseconds, in log-linear buckets as HdrHistogram lays them out: exact
+// below 32, then 32 buckets per power of two, so a value is known to
+// within about 3%. Values past 2^36 count as 2^36 - 1. Recording is a
+// few relaxed atomic adds.
+class Histogram {
+ public:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr int kMaxValueBits = 36;
+  static constexpr int64_t kMaxValue = (int64_t{1} << kMaxValueBits) - 1;
+  static constexpr size_t kBuckets = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+
+  void Record(int64_t value);
+  HistogramSnapshot Snapshot() const;
+
+  static size_t BucketIndex(int64_t value);
+  // Largest value that falls into bucket |index|.
+  static int64_t BucketHigh(size_t index);
+
+ private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<int64_t> sum_{0};
+  std::atomic<int64_t> max_{0};
+};
+
+// Named metrics of the process. Getting a metric takes a lock the first
+// time its name and labels are seen; afterwards callers keep the pointer,
+// which stays valid as long as the registry, and update it without locks.
+class MetricsRegistry {
+ public:
+  enum class Type { kCounter, kGauge, kHistogram };
+
+  struct Sample {
+    std::string name;
+    std::string help;
+    // As Prometheus writes them, e.g. method="start"; may be empty.
+    std::string labels;
+    Type type;
+    // Counter or gauge value.
+    int64_t value = 0;
+    HistogramSnapshot histogram;
+  };
+
+  // Metric names follow Prometheus conventions: a unit suffix, and _total
+  // for counters.
+  Counter* GetCounter(const std::string& name, const std::string& help,
+                      const std::string& labels = std::string());
+  Gauge* GetGauge(const std::string& name, const std::string& help,
+                  const std::string& labels = std::string());
+  Histogram* GetHistogram(const std::string& name, const std::string& help,
+                          const std::string& labels = std::string());
+
+  // Every metric, ordered by name then labels.
+  std::vector<Sample> Snapshot() const;
+  // Prometheus text exposition format 0.0.4. Histograms get cumulative
+  // buckets at each power of two up to their largest value.
+  std::string PrometheusText() const;
+  // Writes PrometheusText() aside and renames it over |path|, so that a
+  // scraper never reads half a file.
+  bool WritePrometheusFile(const std::string& path, std::string* error) const;
+
+ private:
+  struct Family {
+    Type type;
+    std::string help;
+    // By labels.
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+  };
+
+  Family* GetFamily(const std::string& name, const std::string& help, Type type);
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Family> families_;
+};
+
+struct MetricsOptions {
+  // Prometheus text file rewritten every interval, for node_exporter's
+  // textfile collector; empty writes none.
+  std::string textfile;
+  int64_t interval_ms = 15000;
+
+  // Reads `textfile` and `interval` (seconds) from [metrics].
+  static MetricsOptions FromConfig(const ConfigDocument& config);
+};
+
+// Rewrites the registry's text file every interval from a thread of its
+// own, and once more when destroyed.
+class MetricsFileWriter {
+ public:
+  MetricsFileWriter(const MetricsRegistry* registry, MetricsOptions options);
+  ~MetricsFileWriter();
+
+  MetricsFileWriter(const MetricsFileWriter&) = delete;
+  MetricsFileWriter& operator=(const MetricsFileWriter&) = delete;
+
+  uint64_t writes() const { return writes_.load(std::memory_order_relaxed); }
+  uint64_t failures() const { return failures_.load(std::memory_order_relaxed); }
+
+ private:
+  void Run();
+  void WriteOnce();
+
+  const MetricsRegistry* registry_;
+  MetricsOptions options_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::atomic<uint64_t> writes_{0};
+  std::atomic<uint64_t> failures_{0};
+  std::thread thread_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_METRICS_H_
@@ -0,0 +1,154 @@
+#include "net_address.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace vpn_plugin {
+
+bool IpAddress::Parse(const std::string& text, IpAddress* out) {
+  IpAddress ip;
+  if (inet_pton(AF_INET, text.c_str(), ip.bytes) == 1) {
+    ip.family = AF_INET;
+  } else if (inet_pton(AF_INET6, text.c_str(), ip.bytes) == 1) {
+    ip.family = AF_INET6;
+  } else {
+    return false;
+  }
+  *out = ip;
+  return true;
+}
+
+IpAddress IpAddress::FromV4(const uint8_t* bytes) {
+  IpAddress ip;
+  ip.family = AF_INET;
+  memcpy(ip.bytes, bytes, 4);
+  return ip;
+}
+
+IpAddress IpAddress::FromV6(const uint8_t* bytes) {
+  IpAddress ip;
+  ip.family = AF_INET6;
+  memcpy(ip.bytes, bytes, 16);
+  return ip;
+}
+
+std::string IpAddress::ToString() const {
+  char buf[INET6_ADDRSTRLEN] = {};
+  if (!is_valid() || !inet_ntop(family, bytes, buf, sizeof(buf))) return std::string();
+  return buf;
+}
+
+static bool ParsePort(const std::string& text, uint16_t* out) {
+  if (text.empty() || text.size() > 5) return false;
+  char* end = nullptr;
+  long v = strtol(text.c_str(), &end, 10);
+  if (*end != '\0' || v < 0 || v > 65535) return false;
+  *out = static_cast<uint16_t>(v);
+  return true;
+}
+
+bool SocketAddress::Parse(const std::string& text, uint16_t default_port, SocketAddress* out) {
+  SocketAddress addr;
+  std::string host = text;
+  std::string port;
+  if (!text.empty() && text[0] == '[') {
+    size_t close = text.find(']');
+    if (close == std::string::npos) return false;
+    host = text.substr(1, close - 1);
+    if (close + 1 < text.size()) {
+      if (text[close + 1] != ':') return false;
+      port = text.substr(close + 2);
+    }
+  } else if (std::count(text.begin(), text.end(), ':') == 1) {
+    size_t colon = text.find(':');
+    host = text.substr(0, colon);
+    port = text.substr(colon + 1);
+  }
+  if (!IpAddress::Parse(host, &addr.ip)) return false;
+  if (port.empty()) {
+    if (default_port == 0) return false;
+    addr.port = default_port;
+  } else if (!ParsePort(port, &addr.port)) {
+    return false;
+  }
+  *out = addr;
+  return true;
+}
+
+bool SocketAddress::FromSockaddr(const sockaddr* sa, SocketAddress* out) {
+  if (sa->sa_family == AF_INET) {
+    auto* sin = reinterpret_cast<const sockaddr_in*>(sa);
+    out->ip = IpAddress::FromV4(reinterpret_cast<const uint8_t*>(&sin->sin_addr));
+    out->port = ntohs(sin->sin_port);
+    return true;
+  }
+  if (sa->sa_family == AF_INET6) {
+    auto* sin6 = reinterpret_cast<const sockaddr_in6*>(sa);
+    out->ip = IpAddress::FromV6(reinterpret_cast<const uint8_t*>(&sin6->sin6_addr));
+    out->port = ntohs(sin6->sin6_port);
+    return true;
+  }
+  return false;
+}
+
+socklen_t SocketAddress::ToSockaddr(sockaddr_storage* out) const {
+  memset(out, 0, sizeof(*out));
+  if (ip.is_v4()) {
+    auto* sin = reinterpret_cast<sockaddr_in*>(out);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    memcpy(&sin->sin_addr, ip.bytes, 4);
+    return sizeof(sockaddr_in);
+  }
+  if (ip.is_v6()) {
+    auto* sin6 = reinterpret_cast<sockaddr_in6*>(out);
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    memcpy(&sin6->sin6_addr, ip.bytes, 16);
+    return sizeof(sockaddr_in6);
+  }
+  return 0;
+}
+
+std::string SocketAddress::ToString() const {
+  if (ip.is_v6()) return "[" + ip.ToString() + "]:" + std::to_string(port);
+  return ip.ToString() + ":" + std::to_string(port);
+}
+
+bool IpNetwork::Parse(const std::string& text, IpNetwork* out) {
+  IpNetwork net;
+  size_t slash = text.find('/');
+  if (!IpAddress::Parse(text.substr(0, slash), &net.base)) return false;
+  int max_prefix = net.base.is_v4() ? 32 : 128;
+  if (slash == std::string::npos) {
+    net.prefix = max_prefix;
+  } else {
+    std::string bits = text.substr(slash + 1);
+    char* end = nullptr;
+    long v = strtol(bits.c_str(), &end, 10);
+    if (bits.empty() || *end != '\0' || v < 0 || v > max_prefix) return false;
+    net.prefix = static_cast<int>(v);
+  }
+  // Normalize host bits so Contains() can compare whole bytes.
+  for (int i = 0; i < static_cast<int>(net.base.size()); i++) {
+    int keep = net.prefix - i * 8;
+    if (keep >= 8) continue;
+    net.base.bytes[i] &= keep <= 0 ? 0 : static_cast<uint8_t>(0xff << (8 - keep));
+  }
+  *out = net;
+  return true;
+}
+
+bool IpNetwork::Contains(const IpAddress& ip) const {
+  if (ip.family != base.family) return false;
+  int full = prefix / 8;
+  if (memcmp(ip.bytes, base.bytes, full) != 0) return false;
+  int rest = prefix % 8;
+  if (rest == 0) return true;
+  uint8_t mask = static_cast<uint8_t>(0xff << (8 - rest));
+  return (ip.bytes[full] & mask) == base.bytes[full];
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,65 @@
+#ifndef FLUTTER_PLUGIN_NET_ADDRESS_H_
+#define FLUTTER_PLUGIN_NET_ADDRESS_H_
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace vpn_plugin {
+
+// IPv4 or IPv6 address in network byte order. IPv4 addresses only use the
+// first four bytes of |bytes|.
+struct IpAddress {
+  int family = AF_UNSPEC;
+  uint8_t bytes[16] = {};
+
+  static bool Parse(const std::string& text, IpAddress* out);
+  static IpAddress FromV4(const uint8_t* bytes);
+  static IpAddress FromV6(const uint8_t* bytes);
+
+  bool is_v4() const { return family == AF_INET; }
+  bool is_v6() const { return family == AF_INET6; }
+  bool is_valid() const { return family != AF_UNSPEC; }
+  size_t size() const { return is_v4() ? 4 : (is_v6() ? 16 : 0); }
+  std::string ToString() const;
+
+  bool operator==(const IpAddress& other) const {
+    return family == other.family && memcmp(bytes, other.bytes, size()) == 0;
+  }
+  bool operator!=(const IpAddress& other) const { return !(*this == other); }
+};
+
+// Address and port pair, convertible to and from sockaddr structures.
+struct SocketAddress {
+  IpAddress ip;
+  uint16_t port = 0;
+
+  // Accepts "1.2.3.4:80", "[::1]:80", and, when |default_port| is non-zero,
+  // bare addresses without a port.
+  static bool Parse(const std::string& text, uint16_t default_port, SocketAddress* out);
+  static bool FromSockaddr(const sockaddr* sa, SocketAddress* out);
+
+  socklen_t ToSockaddr(sockaddr_storage* out) const;
+  std::string ToString() const;
+
+  bool operator==(const SocketAddress& other) const {
+    return port == other.port && ip == other.ip;
+  }
+};
+
+// CIDR network, e.g. "10.0.0.0/8" or "2000::/3". A bare address is treated
+// as a host route.
+struct IpNetwork {
+  IpAddress base;
+  int prefix = 0;
+
+  static bool Parse(const std::string& text, IpNetwork* out);
+  bool Contains(const IpAddress& ip) const;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_NET_ADDRESS_H_
@@ -0,0 +1,237 @@
+#include "packet_headers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr uint8_t kIpv6HopByHop = 0;
+constexpr uint8_t kIpv6Routing = 43;
+constexpr uint8_t kIpv6Fragment = 44;
+constexpr uint8_t kIpv6Auth = 51;
+constexpr uint8_t kIpv6DestOptions = 60;
+// Bounds the extension header walk on hostile input.
+constexpr int kMaxExtensionHeaders = 8;
+
+constexpr uint8_t kTcpOptionEnd = 0;
+constexpr uint8_t kTcpOptionNop = 1;
+constexpr uint8_t kTcpOptionMss = 2;
+constexpr uint8_t kIcmpUnreachable = 3;
+constexpr uint8_t kIcmpFragmentationNeeded = 4;
+constexpr uint8_t kIcmpV6PacketTooBig = 2;
+// ICMP errors quote as much of the packet as fits in these (RFC 1812
+// section 4.3.2.3, RFC 4443 section 2.4).
+constexpr size_t kIcmpV4ErrorSize = 576;
+
+uint16_t ReadU16(const uint8_t* p) { return static_cast<uint16_t>(p[0] << 8 | p[1]); }
+
+void WriteU16(uint8_t* p, uint16_t value) {
+  p[0] = static_cast<uint8_t>(value >> 8);
+  p[1] = static_cast<uint8_t>(value);
+}
+
+// ICMPv4 types 3, 4, 5, 11 and 12 and ICMPv6 types below 128 are errors.
+bool IsIcmpError(const uint8_t* packet, const PacketHeaders& headers) {
+  if (headers.l4_offset >= headers.total_length) return false;
+  uint8_t type = packet[headers.l4_offset];
+  if (headers.protocol == kIpProtoIcmp) {
+    return type == 3 || type == 4 || type == 5 || type == 11 || type == 12;
+  }
+  return headers.protocol == kIpProtoIcmpV6 && type < 128;
+}
+
+// Fills ports, flags and the payload offset from the L4 header at
+// |l4_offset|. Returns false if the header is truncated.
+bool ParseTransport(const uint8_t* data, PacketHeaders* out) {
+  size_t available = out->total_length - out->l4_offset;
+  const uint8_t* l4 = data + out->l4_offset;
+  out->payload_offset = out->total_length;
+  if (out->fragment) return true;
+  switch (out->protocol) {
+    case kIpProtoTcp: {
+      if (available < 20) return false;
+      size_t header = static_cast<size_t>(l4[12] >> 4) * 4;
+      if (header < 20 || header > available) return false;
+      out->src_port = ReadU16(l4);
+      out->dst_port = ReadU16(l4 + 2);
+      out->tcp_flags = l4[13];
+      out->payload_offset = static_cast<uint16_t>(out->l4_offset + header);
+      return true;
+    }
+    case kIpProtoUdp:
+      if (available < 8) return false;
+      out->src_port = ReadU16(l4);
+      out->dst_port = ReadU16(l4 + 2);
+      out->payload_offset = static_cast<uint16_t>(out->l4_offset + 8);
+      return true;
+    default:
+      return true;
+  }
+}
+
+bool ParseIpv4(const uint8_t* data, size_t size, PacketHeaders* out) {
+  if (size < 20) return false;
+  size_t header = static_cast<size_t>(data[0] & 0x0f) * 4;
+  uint16_t total = ReadU16(data + 2);
+  if (header < 20 || total < header || total > size) return false;
+  uint16_t fragment = ReadU16(data + 6);
+  out->src = IpAddress::FromV4(data + 12);
+  out->dst = IpAddress::FromV4(data + 16);
+  out->protocol = data[9];
+  // A set MF bit or a non-zero offset; only the first fragment has ports,
+  // but the flow cannot be tracked reliably from it alone.
+  out->fragment = (fragment & 0x3fff) != 0;
+  out->total_length = total;
+  out->l4_offset = static_cast<uint16_t>(header);
+  return ParseTransport(data, out);
+}
+
+bool ParseIpv6(const uint8_t* data, size_t size, PacketHeaders* out) {
+  if (size < 40) return false;
+  size_t total = 40 + static_cast<size_t>(ReadU16(data + 4));
+  if (total > size || total > 0xffff) return false;
+  out->src = IpAddress::FromV6(data + 8);
+  out->dst = IpAddress::FromV6(data + 24);
+  out->total_length = static_cast<uint16_t>(total);
+  uint8_t next = data[6];
+  size_t offset = 40;
+  for (int i = 0; i < kMaxExtensionHeaders; i++) {
+    if (next != kIpv6HopByHop && next != kIpv6Routing && next != kIpv6Fragment &&
+        next != kIpv6Auth && next != kIpv6DestOptions) {
+      break;
+    }
+    if (offset + 8 > total) return false;
+    const uint8_t* ext = data + offset;
+    size_t length;
+    if (next == kIpv6Fragment) {
+      out->fragment = true;
+      length = 8;
+    } else if (next == kIpv6Auth) {
+      length = (static_cast<size_t>(ext[1]) + 2) * 4;
+    } else {
+      length = (static_cast<size_t>(ext[1]) + 1) * 8;
+    }
+    next = ext[0];
+    offset += length;
+  }
+  if (offset > total) return false;
+  out->protocol = next;
+  out->l4_offset = static_cast<uint16_t>(offset);
+  return ParseTransport(data, out);
+}
+
+}  // namespace
+
+bool ParsePacketHeaders(const uint8_t* data, size_t size, PacketHeaders* out) {
+  *out = PacketHeaders();
+  if (size < 1) return false;
+  switch (data[0] >> 4) {
+    case 4:
+      return ParseIpv4(data, size, out);
+    case 6:
+      return ParseIpv6(data, size, out);
+    default:
+      return false;
+  }
+}
+
+uint32_t ChecksumAdd(const uint8_t* data, size_t size, uint32_t sum) {
+  for (size_t i = 0; i + 1 < size; i += 2) sum += ReadU16(data + i);
+  if (size & 1) sum += static_cast<uint32_t>(data[size - 1]) << 8;
+  return sum;
+}
+
+uint16_t ChecksumFinish(uint32_t sum) {
+  while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+  return static_cast<uint16_t>(~sum);
+}
+
+bool ClampTcpMss(uint8_t* packet, const PacketHeaders& headers, uint16_t max_mss) {
+  if (headers.protocol != kIpProtoTcp || headers.fragment ||
+      !(headers.tcp_flags & kTcpFlagSyn)) {
+    return false;
+  }
+  uint8_t* tcp = packet + headers.l4_offset;
+  size_t end = headers.payload_offset - headers.l4_offset;
+  for (size_t i = 20; i < end;) {
+    uint8_t kind = tcp[i];
+    if (kind == kTcpOptionEnd) break;
+    if (kind == kTcpOptionNop) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= end || tcp[i + 1] < 2 || i + tcp[i + 1] > end) break;
+    if (kind == kTcpOptionMss && tcp[i + 1] == 4) {
+      uint16_t mss = ReadU16(tcp + i + 2);
+      if (mss <= max_mss) return false;
+      WriteU16(tcp + i + 2, max_mss);
+      // HC' = ~(~HC + ~m + m'), on the option's 16-bit word; the option
+      // starts at an even offset only when i is even.
+      uint32_t sum = static_cast<uint16_t>(~ReadU16(tcp + 16));
+      if (i % 2 == 0) {
+        sum += static_cast<uint16_t>(~mss) + max_mss;
+      } else {
+        // Straddles two words: fold the change of each byte pair instead.
+        uint8_t old_bytes[4] = {tcp[i + 1], static_cast<uint8_t>(mss >> 8),
+                                static_cast<uint8_t>(mss), tcp[i + 4]};
+        uint8_t* word = tcp + i + 1;
+        for (int w = 0; w < 4; w += 2) {
+          sum += static_cast<uint16_t>(~ReadU16(old_bytes + w)) + ReadU16(word + w);
+        }
+      }
+      WriteU16(tcp + 16, ChecksumFinish(sum));
+      return true;
+    }
+    i += tcp[i + 1];
+  }
+  return false;
+}
+
+size_t BuildPacketTooBig(const uint8_t* packet, const PacketHeaders& headers, uint16_t mtu,
+                         uint8_t* out) {
+  if (IsIcmpError(packet, headers)) return 0;
+  if (headers.src.is_v4()) {
+    uint16_t fragment = ReadU16(packet + 6);
+    // Only DF packets expect this error, and only for the first fragment.
+    if (!(fragment & 0x4000) || (fragment & 0x1fff)) return 0;
+    size_t quoted = std::min<size_t>(headers.total_length, kIcmpV4ErrorSize - 28);
+    size_t total = 28 + quoted;
+    memset(out, 0, 28);
+    out[0] = 0x45;
+    WriteU16(out + 2, static_cast<uint16_t>(total));
+    out[8] = 64;
+    out[9] = kIpProtoIcmp;
+    memcpy(out + 12, headers.dst.bytes, 4);
+    memcpy(out + 16, headers.src.bytes, 4);
+    WriteU16(out + 10, ChecksumFinish(ChecksumAdd(out, 20)));
+    uint8_t* icmp = out + 20;
+    icmp[0] = kIcmpUnreachable;
+    icmp[1] = kIcmpFragmentationNeeded;
+    WriteU16(icmp + 6, mtu);
+    memcpy(icmp + 8, packet, quoted);
+    WriteU16(icmp + 2, ChecksumFinish(ChecksumAdd(icmp, 8 + quoted)));
+    return total;
+  }
+  size_t quoted = std::min<size_t>(headers.total_length, kMaxTooBigSize - 48);
+  size_t payload = 8 + quoted;
+  memset(out, 0, 48);
+  out[0] = 0x60;
+  WriteU16(out + 4, static_cast<uint16_t>(payload));
+  out[6] = kIpProtoIcmpV6;
+  out[7] = 64;
+  memcpy(out + 8, headers.dst.bytes, 16);
+  memcpy(out + 24, headers.src.bytes, 16);
+  uint8_t* icmp = out + 40;
+  icmp[0] = kIcmpV6PacketTooBig;
+  WriteU16(icmp + 6, mtu);
+  memcpy(icmp + 8, packet, quoted);
+  // The pseudo-header: addresses, upper-layer length and next header.
+  uint32_t sum = ChecksumAdd(out + 8, 32);
+  sum += static_cast<uint32_t>(payload) + kIpProtoIcmpV6;
+  WriteU16(icmp + 2, ChecksumFinish(ChecksumAdd(icmp, payload, sum)));
+  return 40 + payload;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,63 @@
+#ifndef FLUTTER_PLUGIN_PACKET_HEADERS_H_
+#define FLUTTER_PLUGIN_PACKET_HEADERS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "net_address.h"
+
+namespace vpn_plugin {
+
+constexpr uint8_t kIpProtoIcmp = 1;
+constexpr uint8_t kIpProtoTcp = 6;
+constexpr uint8_t kIpProtoUdp = 17;
+constexpr uint8_t kIpProtoIcmpV6 = 58;
+
+constexpr uint8_t kTcpFlagFin = 0x01;
+constexpr uint8_t kTcpFlagSyn = 0x02;
+constexpr uint8_t kTcpFlagRst = 0x04;
+constexpr uint8_t kTcpFlagAck = 0x10;
+
+// L3/L4 summary of a raw IP packet as read from the TUN device. Offsets are
+// relative to the start of the packet.
+struct PacketHeaders {
+  IpAddress src;
+  IpAddress dst;
+  uint8_t protocol = 0;
+  // Zero for protocols without ports and for non-first fragments.
+  uint16_t src_port = 0;
+  uint16_t dst_port = 0;
+  uint8_t tcp_flags = 0;
+  bool fragment = false;
+  // Length from the IP header, which may be shorter than the buffer.
+  uint16_t total_length = 0;
+  uint16_t l4_offset = 0;
+  // Start of the TCP/UDP payload; equal to total_length when there is none.
+  uint16_t payload_offset = 0;
+};
+
+// Parses IPv4 (with options) and IPv6 (with extension headers) packets.
+// Returns false for truncated or malformed packets.
+bool ParsePacketHeaders(const uint8_t* data, size_t size, PacketHeaders* out);
+
+// One's complement sum of |data| (RFC 1071) added to |sum|; fold and
+// invert it with ChecksumFinish().
+uint32_t ChecksumAdd(const uint8_t* data, size_t size, uint32_t sum = 0);
+uint16_t ChecksumFinish(uint32_t sum);
+
+// Lowers the MSS option of a TCP SYN to |max_mss|, updating the checksum
+// incrementally (RFC 1624). Returns true if the packet was changed.
+bool ClampTcpMss(uint8_t* packet, const PacketHeaders& headers, uint16_t max_mss);
+
+// Writes to |out| the ICMP "fragmentation needed" (IPv4) or ICMPv6 "packet
+// too big" error that tells the sender of |packet| to stay within |mtu|,
+// sent from the packet's destination. Returns its size, or 0 if no error
+// may be sent: IPv4 packets that allow fragmentation or are not the first
+// fragment, and ICMP errors. |out| needs room for kMaxTooBigSize bytes.
+constexpr size_t kMaxTooBigSize = 1280;
+size_t BuildPacketTooBig(const uint8_t* packet, const PacketHeaders& headers, uint16_t mtu,
+                         uint8_t* out);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_PACKET_HEADERS_H_
@@ -0,0 +1,171 @@
+#include "packet_pipeline.h"
+
+#include <algorithm>
+
+#include "event_loop.h"
+
+namespace vpn_plugin {
+
+PacketPipelineOptions PacketPipelineOptions::FromConfig(const ConfigDocument& config) {
+  PacketPipelineOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(RoutingPolicy::FromConfig(config));
+  for (const auto& route : config.GetStringList("listener.tun", "included_routes")) {
+    IpNetwork net;
+    if (IpNetwork::Parse(route, &net)) options.included_routes.push_back(net);
+  }
+  // The MTU the TUN device was created with; SYNs are clamped to it and
+  // larger packets answered with ICMP.
+  int64_t mtu = config.GetInt("listener.tun", "mtu_size", options.mtu);
+  if (mtu >= 576 && mtu <= 65535) options.mtu = static_cast<int>(mtu);
+  return options;
+}
+
+namespace {
+
+constexpr int kMinMtu = 576;
+constexpr int kIpv6MinMtu = 1280;
+
+}  // namespace
+
+PacketPipeline::PacketPipeline(PacketPipelineOptions options)
+    : options_(std::move(options)),
+      mtu_(options_.mtu),
+      flows_(options_.flows, [this](const FlowRecord& record) { OnFlowExpired(record); }) {
+  stats_.effective_mtu = static_cast<uint64_t>(mtu_);
+}
+
+void PacketPipeline::SetPathMtu(int path_mtu) {
+  mtu_ = path_mtu > 0 ? std::max(kMinMtu, std::min(path_mtu, options_.mtu)) : options_.mtu;
+  stats_.effective_mtu = static_cast<uint64_t>(mtu_);
+}
+
+int PacketPipeline::LimitFor(const uint8_t* packet, size_t size) const {
+  // IPv6 links never go below 1280, so the sender is told no less and
+  // packets up to it are carried whatever the TUN MTU.
+  return size > 0 && (packet[0] >> 4) == 6 ? std::max(mtu_, kIpv6MinMtu) : mtu_;
+}
+
+bool PacketPipeline::ReplyTooBig(const uint8_t* packet, size_t size, int limit) {
+  PacketHeaders headers;
+  if (!options_.on_reply || !ParsePacketHeaders(packet, size, &headers)) return false;
+  uint8_t reply[kMaxTooBigSize];
+  size_t length = BuildPacketTooBig(packet, headers, static_cast<uint16_t>(limit), reply);
+  if (!length) return false;
+  stats_.too_big_replies++;
+  options_.on_reply(reply, length);
+  return true;
+}
+
+size_t PacketPipeline::Expire(uint64_t now_ms) { return flows_.Expire(now_ms); }
+
+void PacketPipeline::OnFlowExpired(const FlowRecord& record) {
+  if (!options_.on_flow_expired) return;
+  if (!options_.domains) {
+    options_.on_flow_expired(record);
+    return;
+  }
+  FlowRecord named = record;
+  FlowTarget target;
+  target.ip = record.key.dst_ip();
+  target.port = record.key.dst_port;
+  options_.domains->Attribute(&target, EventLoop::NowMs());
+  named.domain = std::move(target.domain);
+  options_.on_flow_expired(named);
+}
+
+PacketVerdict PacketPipeline::Classify(const PacketHeaders& headers) const {
+  if (!options_.included_routes.empty()) {
+    bool included = false;
+    for (const auto& net : options_.included_routes) {
+      if (net.Contains(headers.dst)) {
+        included = true;
+        break;
+      }
+    }
+    if (!included) return PacketVerdict::kDrop;
+  }
+  if (!options_.policy) return PacketVerdict::kTunnel;
+  FlowTarget target;
+  target.ip = headers.dst;
+  target.port = headers.dst_port;
+  if (options_.domains) options_.domains->Attribute(&target, EventLoop::NowMs());
+  return options_.policy->Decide(target) == RoutingMode::kVpn ? PacketVerdict::kTunnel
+                                                              : PacketVerdict::kBypass;
+}
+
+void PacketPipeline::Process(const iovec* packets, size_t count, PacketVerdict* verdicts,
+                             PacketHeaders* headers) {
+  PacketHeaders scratch[kMaxBatch];
+  flows_.Expire(EventLoop::NowMs());
+  for (size_t start = 0; start < count; start += kMaxBatch) {
+    size_t n = std::min(kMaxBatch, count - start);
+    ProcessChunk(packets + start, n, verdicts + start, headers ? headers + start : scratch);
+  }
+}
+
+void PacketPipeline::ProcessChunk(const iovec* packets, size_t count, PacketVerdict* verdicts,
+                                  PacketHeaders* headers) {
+  // Pass 1: parse headers and reject what cannot be forwarded at all.
+  bool parsed[kMaxBatch];
+  for (size_t i = 0; i < count; i++) {
+    const auto* data = static_cast<const uint8_t*>(packets[i].iov_base);
+    size_t size = packets[i].iov_len;
+    stats_.packets++;
+    stats_.bytes += size;
+    parsed[i] = false;
+    int limit = LimitFor(data, size);
+    if (size > static_cast<size_t>(limit)) {
+      stats_.dropped_oversize++;
+      verdicts[i] = PacketVerdict::kDrop;
+      if (!ReplyTooBig(data, size, limit)) stats_.dropped_oversize_unanswered++;
+    } else if (!ParsePacketHeaders(data, size, &headers[i])) {
+      stats_.dropped_malformed++;
+      verdicts[i] = PacketVerdict::kDrop;
+    } else {
+      parsed[i] = true;
+    }
+  }
+
+  // Pass 2: look up flows, classifying the ones seen for the first time.
+  uint64_t now_ms = EventLoop::NowMs();
+  for (size_t i = 0; i < count; i++) {
+    if (!parsed[i]) continue;
+    FlowKey key = FlowKey::FromHeaders(headers[i]);
+    FlowEntry* flow = flows_.Find(key);
+    PacketVerdict verdict;
+    if (flow) {
+      stats_.flow_hits++;
+      verdict = flow->verdict;
+    } else {
+      stats_.flow_misses++;
+      verdict = Classify(headers[i]);
+      bool inserted;
+      flow = flows_.Insert(key, verdict, now_ms, &inserted);
+    }
+    if (flow) flows_.Touch(flow, packets[i].iov_len, headers[i].tcp_flags, now_ms);
+    verdicts[i] = verdict;
+    if (options_.clamp_mss && (headers[i].tcp_flags & kTcpFlagSyn) &&
+        headers[i].protocol == kIpProtoTcp && verdict != PacketVerdict::kDrop) {
+      // Room for the IP and TCP headers without options, as the MSS is
+      // defined (RFC 9293 section 3.7.1).
+      int overhead = headers[i].src.is_v4() ? 40 : 60;
+      if (ClampTcpMss(static_cast<uint8_t*>(packets[i].iov_base), headers[i],
+                      static_cast<uint16_t>(mtu_ - overhead))) {
+        stats_.mss_clamped++;
+      }
+    }
+    switch (verdict) {
+      case PacketVerdict::kTunnel:
+        stats_.tunnel++;
+        break;
+      case PacketVerdict::kBypass:
+        stats_.bypass++;
+        break;
+      case PacketVerdict::kDrop:
+        stats_.dropped_unrouted++;
+        break;
+    }
+  }
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,122 @@
+#ifndef FLUTTER_PLUGIN_PACKET_PIPELINE_H_
+#define FLUTTER_PLUGIN_PACKET_PIPELINE_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "config_document.h"
+#include "domain_table.h"
+#include "flow_table.h"
+#include "net_address.h"
+#include "packet_headers.h"
+#include "routing_policy.h"
+
+namespace vpn_plugin {
+
+struct PacketPipelineOptions {
+  // Without a policy every packet is sent through the endpoint.
+  std::shared_ptr<const RoutingPolicy> policy;
+  // Supplies the domain of new flows, so domain rules match them too.
+  const DomainTable* domains = nullptr;
+  // Packets to destinations outside these routes are dropped; empty means
+  // no restriction.
+  std::vector<IpNetwork> included_routes;
+  // Packets longer than this are dropped; IPv6 ones only past 1280, the
+  // IPv6 minimum, which senders need not go below.
+  int mtu = 1500;
+  // Lowers the MSS option of TCP SYNs so that segments fit the MTU.
+  bool clamp_mss = true;
+  // Receives the ICMP errors that answer oversize packets whose senders
+  // do path MTU discovery, to be written back to the TUN device.
+  std::function<void(const uint8_t* packet, size_t size)> on_reply;
+  // Flow decisions are cached up to flows.capacity flows, each until it
+  // has been idle for its protocol's timeout.
+  FlowTableOptions flows;
+  // Sees the final byte and packet counts of every expired flow, with the
+  // domain filled in from |domains| while it is still known.
+  std::function<void(const FlowRecord& record)> on_flow_expired;
+
+  // Reads `mtu_size` and `included_routes` from [listener.tun] and the
+  // routing keys from the top level.
+  static PacketPipelineOptions FromConfig(const ConfigDocument& config);
+};
+
+struct PacketPipelineStats {
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  uint64_t tunnel = 0;
+  uint64_t bypass = 0;
+  uint64_t dropped_malformed = 0;
+  uint64_t dropped_oversize = 0;
+  // ICMP errors handed to on_reply for oversize packets.
+  uint64_t too_big_replies = 0;
+  // Oversize drops with no ICMP error, as the sender expects none: IPv4
+  // without DF, which would have to be fragmented, later fragments and
+  // ICMP errors. Included in dropped_oversize.
+  uint64_t dropped_oversize_unanswered = 0;
+  uint64_t mss_clamped = 0;
+  uint64_t dropped_unrouted = 0;
+  uint64_t flow_hits = 0;
+  uint64_t flow_misses = 0;
+  // The MTU packets are held to: the configured one, or less once the
+  // path toward the endpoint was found to carry less.
+  uint64_t effective_mtu = 0;
+};
+
+// Classifies raw IP packets read from the TUN device. Packets are handled in
+// batches, as returned by readv()/recvmmsg(): headers are parsed for the whole
+// batch first, then flows are looked up, and the routing policy only runs for
+// packets whose flow has not been seen before.
+//
+// SYN packets may be rewritten in place to clamp their MSS.
+//
+// A pipeline is owned by a single thread; run one per core.
+class PacketPipeline {
+ public:
+  static constexpr size_t kMaxBatch = 64;
+
+  explicit PacketPipeline(PacketPipelineOptions options);
+
+  // Writes one verdict per packet. |headers| may be null; otherwise it
+  // receives the parsed headers of each packet.
+  void Process(const iovec* packets, size_t count, PacketVerdict* verdicts,
+               PacketHeaders* headers = nullptr);
+
+  // Expires idle flows. Process() does this too, so a caller only needs it
+  // when no packets arrive for a while.
+  size_t Expire(uint64_t now_ms);
+
+  // Holds packets to |path_mtu| when that is below the configured MTU, as
+  // found by path MTU discovery toward the endpoint; 0 restores the
+  // configured MTU. Values are kept at or above the IPv4 minimum of 576.
+  void SetPathMtu(int path_mtu);
+  int mtu() const { return mtu_; }
+
+  size_t flow_count() const { return flows_.size(); }
+  const PacketPipelineStats& stats() const { return stats_; }
+
+ private:
+  void ProcessChunk(const iovec* packets, size_t count, PacketVerdict* verdicts,
+                    PacketHeaders* headers);
+  PacketVerdict Classify(const PacketHeaders& headers) const;
+  // Largest packet forwarded for the IP version of |packet|.
+  int LimitFor(const uint8_t* packet, size_t size) const;
+  // Answers a packet over |limit| with an ICMP error. Returns false if
+  // none could be sent.
+  bool ReplyTooBig(const uint8_t* packet, size_t size, int limit);
+  void OnFlowExpired(const FlowRecord& record);
+
+  PacketPipelineOptions options_;
+  int mtu_;
+  FlowTable flows_;
+  PacketPipelineStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_PACKET_PIPELINE_H_
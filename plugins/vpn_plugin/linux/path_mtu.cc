@@ -0,0 +1,106 @@
+#include "path_mtu.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+int SocketPathMtu(int fd) {
+  int domain = 0;
+  socklen_t len = sizeof(domain);
+  if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0) return 0;
+  int mtu = 0;
+  len = sizeof(mtu);
+  int result = domain == AF_INET6 ? getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len)
+                                  : getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len);
+  return result == 0 && mtu > 0 ? mtu : 0;
+}
+
+PmtuSearch::PmtuSearch(PmtuSearchOptions options) : options_(options) {
+  options_.max_mtu = std::max(options_.max_mtu, options_.base_mtu);
+  options_.max_probes = std::max(options_.max_probes, 1);
+  options_.resolution = std::max(options_.resolution, 1);
+  confirmed_ = options_.base_mtu;
+  too_big_ = options_.max_mtu + 1;
+  candidate_ = options_.base_mtu;
+}
+
+int PmtuSearch::NextProbe() const {
+  return state_ == PmtuState::kBase || state_ == PmtuState::kSearching ? candidate_ : 0;
+}
+
+void PmtuSearch::OnProbeAcked(int size) {
+  if (size != candidate_ || NextProbe() == 0) return;
+  probes_++;
+  losses_ = 0;
+  confirmed_ = std::max(confirmed_, size);
+  if (state_ == PmtuState::kBase) {
+    state_ = PmtuState::kSearching;
+    // Most paths carry the maximum; try it before narrowing down.
+    candidate_ = too_big_ - 1;
+    if (candidate_ <= confirmed_) state_ = PmtuState::kSearchComplete;
+    return;
+  }
+  PickCandidate();
+}
+
+void PmtuSearch::OnProbeLost(int size) {
+  if (size != candidate_ || NextProbe() == 0) return;
+  probes_++;
+  if (++losses_ < options_.max_probes) return;
+  losses_ = 0;
+  if (state_ == PmtuState::kBase) {
+    state_ = PmtuState::kError;
+    return;
+  }
+  too_big_ = size;
+  PickCandidate();
+}
+
+void PmtuSearch::OnPacketTooBig(int mtu) {
+  // Reports below the base are bogus or from an attacker (RFC 8899 section
+  // 4.6.1), and reports above the current probe say nothing new.
+  if (mtu < options_.base_mtu || mtu >= too_big_) return;
+  too_big_ = mtu + 1;
+  if (confirmed_ > mtu) {
+    confirmed_ = mtu;
+    state_ = PmtuState::kSearchComplete;
+    return;
+  }
+  if (state_ != PmtuState::kSearching) return;
+  // Probe the reported size itself; it is likely exact.
+  losses_ = 0;
+  candidate_ = mtu;
+  if (candidate_ <= confirmed_) state_ = PmtuState::kSearchComplete;
+}
+
+void PmtuSearch::OnBlackHole() {
+  confirmed_ = options_.base_mtu;
+  too_big_ = options_.max_mtu + 1;
+  candidate_ = options_.base_mtu;
+  losses_ = 0;
+  state_ = PmtuState::kBase;
+}
+
+void PmtuSearch::Restart() {
+  if (state_ == PmtuState::kError) {
+    OnBlackHole();
+    return;
+  }
+  too_big_ = options_.max_mtu + 1;
+  losses_ = 0;
+  state_ = PmtuState::kSearching;
+  PickCandidate();
+}
+
+void PmtuSearch::PickCandidate() {
+  if (too_big_ - confirmed_ <= options_.resolution) {
+    state_ = PmtuState::kSearchComplete;
+    return;
+  }
+  candidate_ = confirmed_ + (too_big_ - confirmed_) / 2;
+}
+
+}  // namespace vpn_plugin
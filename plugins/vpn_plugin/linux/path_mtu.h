@@ -0,0 +1,77 @@
+#ifndef FLUTTER_PLUGIN_PATH_MTU_H_
+#define FLUTTER_PLUGIN_PATH_MTU_H_
+
+#include <cstdint>
+
+namespace vpn_plugin {
+
+// The kernel's path MTU toward the peer of a connected socket, as lowered
+// by ICMP "fragmentation needed" and "packet too big" messages for TCP.
+// Returns 0 if unknown.
+int SocketPathMtu(int fd);
+
+struct PmtuSearchOptions {
+  // Packet sizes including all outer headers. The base is assumed to work
+  // on any path and is confirmed before the search starts.
+  int base_mtu = 1280;
+  int max_mtu = 1500;
+  // Losses of one probe size before it is taken as too big, so that random
+  // loss does not pass for a size limit.
+  int max_probes = 3;
+  // The search ends once the largest working size is known this closely.
+  int resolution = 8;
+};
+
+enum class PmtuState {
+  kBase,
+  kSearching,
+  kSearchComplete,
+  // Even the base size does not get through.
+  kError,
+};
+
+// Datagram packetization layer path MTU discovery (RFC 8899) for a
+// transport that can send padded probe packets and learn which arrived.
+// Starts with the base size, tries the maximum, then halves the interval
+// between the largest acknowledged size and the smallest lost one. Reports
+// from ICMP are used as hints and upper bounds, never trusted to raise the
+// MTU.
+class PmtuSearch {
+ public:
+  explicit PmtuSearch(PmtuSearchOptions options = PmtuSearchOptions());
+
+  // Size of the next probe to send, or 0 when the search is over. The
+  // transport reports each probe of this size as acked or lost.
+  int NextProbe() const;
+  void OnProbeAcked(int size);
+  void OnProbeLost(int size);
+  // An ICMP error reported that |mtu| is the most the path carries.
+  void OnPacketTooBig(int mtu);
+  // Full-sized packets keep being lost: falls back to the base size and
+  // searches again.
+  void OnBlackHole();
+  // Searches again upward from the current size; RFC 8899 does this on a
+  // timer, as the path may have changed.
+  void Restart();
+
+  // The largest size confirmed to get through, or the base size.
+  int mtu() const { return confirmed_; }
+  PmtuState state() const { return state_; }
+  uint64_t probes() const { return probes_; }
+
+ private:
+  void PickCandidate();
+
+  PmtuSearchOptions options_;
+  PmtuState state_ = PmtuState::kBase;
+  int confirmed_;
+  // Smallest size known not to get through; max_mtu + 1 while none is.
+  int too_big_;
+  int candidate_;
+  int losses_ = 0;
+  uint64_t probes_ = 0;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_PATH_MTU_H_
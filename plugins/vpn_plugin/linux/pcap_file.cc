@@ -0,0 +1,176 @@
+#include "pcap_file.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr uint32_t kMagicMicros = 0xa1b2c3d4;
+constexpr uint32_t kMagicNanos = 0xa1b23c4d;
+constexpr size_t kFileHeaderSize = 24;
+constexpr size_t kRecordHeaderSize = 16;
+
+constexpr uint16_t kEtherTypeIpv4 = 0x0800;
+constexpr uint16_t kEtherTypeIpv6 = 0x86dd;
+constexpr uint16_t kEtherTypeVlan = 0x8100;
+constexpr uint16_t kEtherTypeQinQ = 0x88a8;
+
+uint32_t ReadU32(const uint8_t* p, bool swap) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+uint16_t ReadBe16(const uint8_t* p) { return static_cast<uint16_t>(p[0] << 8 | p[1]); }
+
+void AppendU32(std::string* out, uint32_t v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+bool IsSupportedLinkType(uint32_t link_type) {
+  switch (link_type) {
+    case PcapCapture::kLinkTypeNull:
+    case PcapCapture::kLinkTypeEthernet:
+    case PcapCapture::kLinkTypeRaw:
+    case PcapCapture::kLinkTypeLinuxSll:
+    case PcapCapture::kLinkTypeIpv4:
+    case PcapCapture::kLinkTypeIpv6:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the offset of the IP header within a frame, or -1 if the frame
+// does not carry IP.
+long IpOffset(uint32_t link_type, const uint8_t* frame, size_t size) {
+  switch (link_type) {
+    case PcapCapture::kLinkTypeRaw:
+    case PcapCapture::kLinkTypeIpv4:
+    case PcapCapture::kLinkTypeIpv6:
+      return 0;
+    case PcapCapture::kLinkTypeNull:
+      // Host byte order address family of the capturing machine.
+      return size >= 4 ? 4 : -1;
+    case PcapCapture::kLinkTypeLinuxSll: {
+      if (size < 16) return -1;
+      uint16_t protocol = ReadBe16(frame + 14);
+      return protocol == kEtherTypeIpv4 || protocol == kEtherTypeIpv6 ? 16 : -1;
+    }
+    case PcapCapture::kLinkTypeEthernet: {
+      size_t offset = 12;
+      while (offset + 2 <= size) {
+        uint16_t type = ReadBe16(frame + offset);
+        if (type == kEtherTypeVlan || type == kEtherTypeQinQ) {
+          offset += 4;
+          continue;
+        }
+        if (type == kEtherTypeIpv4 || type == kEtherTypeIpv6) return static_cast<long>(offset + 2);
+        return -1;
+      }
+      return -1;
+    }
+    default:
+      return -1;
+  }
+}
+
+}  // namespace
+
+bool PcapCapture::Load(const std::string& path, PcapCapture* out, std::string* error) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    if (error) *error = "cannot open " + path;
+    return false;
+  }
+  std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  return Parse(reinterpret_cast<const uint8_t*>(contents.data()), contents.size(), out, error);
+}
+
+bool PcapCapture::Parse(const uint8_t* data, size_t size, PcapCapture* out, std::string* error) {
+  if (size < kFileHeaderSize) {
+    if (error) *error = "truncated pcap header";
+    return false;
+  }
+  uint32_t magic = ReadU32(data, false);
+  bool swap;
+  if (magic == kMagicMicros || magic == kMagicNanos) {
+    swap = false;
+  } else if (__builtin_bswap32(magic) == kMagicMicros || __builtin_bswap32(magic) == kMagicNanos) {
+    swap = true;
+  } else {
+    if (error) *error = "not a pcap file (pcapng is not supported)";
+    return false;
+  }
+  uint32_t link_type = ReadU32(data + 20, swap) & 0xffff;
+  if (!IsSupportedLinkType(link_type)) {
+    if (error) *error = "unsupported link type " + std::to_string(link_type);
+    return false;
+  }
+
+  PcapCapture capture;
+  size_t offset = kFileHeaderSize;
+  while (offset + kRecordHeaderSize <= size) {
+    uint32_t captured = ReadU32(data + offset + 8, swap);
+    uint32_t original = ReadU32(data + offset + 12, swap);
+    offset += kRecordHeaderSize;
+    if (captured > size - offset) {
+      if (error) *error = "truncated pcap record";
+      return false;
+    }
+    const uint8_t* frame = data + offset;
+    offset += captured;
+    long ip = IpOffset(link_type, frame, captured);
+    // Packets cut short by the snap length cannot be parsed faithfully.
+    if (ip < 0 || captured < original) {
+      capture.skipped_++;
+      continue;
+    }
+    capture.Add(frame + ip, captured - static_cast<size_t>(ip));
+  }
+  *out = std::move(capture);
+  return true;
+}
+
+void PcapCapture::Add(const uint8_t* packet, size_t size) {
+  offsets_.emplace_back(data_.size(), size);
+  data_.append(reinterpret_cast<const char*>(packet), size);
+}
+
+std::string PcapCapture::Serialize() const {
+  std::string out;
+  AppendU32(&out, kMagicMicros);
+  AppendU32(&out, 2 | 4 << 16);  // Version 2.4.
+  AppendU32(&out, 0);            // Time zone.
+  AppendU32(&out, 0);            // Timestamp accuracy.
+  AppendU32(&out, 65535);        // Snap length.
+  AppendU32(&out, kLinkTypeRaw);
+  for (const auto& entry : offsets_) {
+    AppendU32(&out, 0);
+    AppendU32(&out, 0);
+    AppendU32(&out, static_cast<uint32_t>(entry.second));
+    AppendU32(&out, static_cast<uint32_t>(entry.second));
+    out.append(data_, entry.first, entry.second);
+  }
+  return out;
+}
+
+iovec PcapCapture::packet(size_t index) const {
+  iovec iov;
+  iov.iov_base = const_cast<char*>(data_.data() + offsets_[index].first);
+  iov.iov_len = offsets_[index].second;
+  return iov;
+}
+
+std::vector<iovec> PcapCapture::packets() const {
+  std::vector<iovec> out;
+  out.reserve(offsets_.size());
+  for (size_t i = 0; i < offsets_.size(); i++) out.push_back(packet(i));
+  return out;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,51 @@
+#ifndef FLUTTER_PLUGIN_PCAP_FILE_H_
+#define FLUTTER_PLUGIN_PCAP_FILE_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vpn_plugin {
+
+// Packets of a capture in the classic libpcap format, reduced to their IP
+// layer so they look like what a TUN device returns. Used to replay traffic
+// through the packet pipeline without a TUN device.
+class PcapCapture {
+ public:
+  // Link types that are understood; other captures are rejected.
+  static constexpr uint32_t kLinkTypeNull = 0;
+  static constexpr uint32_t kLinkTypeEthernet = 1;
+  static constexpr uint32_t kLinkTypeRaw = 101;
+  static constexpr uint32_t kLinkTypeLinuxSll = 113;
+  static constexpr uint32_t kLinkTypeIpv4 = 228;
+  static constexpr uint32_t kLinkTypeIpv6 = 229;
+
+  static bool Load(const std::string& path, PcapCapture* out, std::string* error);
+  static bool Parse(const uint8_t* data, size_t size, PcapCapture* out, std::string* error);
+
+  // Appends an IP packet; used to build captures in memory.
+  void Add(const uint8_t* packet, size_t size);
+
+  // Serializes the packets as a LINKTYPE_RAW capture.
+  std::string Serialize() const;
+
+  size_t size() const { return offsets_.size(); }
+  bool empty() const { return offsets_.empty(); }
+  iovec packet(size_t index) const;
+  // iovecs for all packets; valid until the capture is modified.
+  std::vector<iovec> packets() const;
+  size_t skipped() const { return skipped_; }
+
+ private:
+  std::string data_;
+  std::vector<std::pair<size_t, size_t>> offsets_;
+  // Records that were not IP (ARP, LLDP, ...) or were truncated.
+  size_t skipped_ = 0;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_PCAP_FILE_H_
@@ -0,0 +1,122 @@
+#include "policy_store.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+
+namespace vpn_plugin {
+
+PolicyStore::PolicyStore(BuiltCallback on_built)
+    : on_built_(std::move(on_built)), thread_([this]() { Run(); }) {}
+
+PolicyStore::~PolicyStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+}
+
+std::shared_ptr<const RoutingPolicy> PolicyStore::Build(const PolicyInputs& inputs) {
+  return std::make_shared<const RoutingPolicy>(inputs.default_mode, inputs.bypass_rules,
+                                               inputs.vpn_rules, inputs.excluded_routes);
+}
+
+void PolicyStore::Set(int64_t server, PolicyInputs inputs) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(server);
+    if (it != entries_.end() && it->second.inputs == inputs) return;
+    Entry& entry = entries_[server];
+    entry.inputs = std::move(inputs);
+    entry.version = next_version_++;
+    if (std::find(queue_.begin(), queue_.end(), server) != queue_.end()) return;
+    queue_.push_back(server);
+  }
+  wake_.notify_one();
+}
+
+void PolicyStore::Retain(const std::vector<int64_t>& servers) {
+  std::unordered_set<int64_t> keep(servers.begin(), servers.end());
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    it = keep.count(it->first) ? std::next(it) : entries_.erase(it);
+  }
+}
+
+std::shared_ptr<const RoutingPolicy> PolicyStore::Get(int64_t server, uint64_t* version) {
+  PolicyInputs inputs;
+  uint64_t latest;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(server);
+    if (it == entries_.end()) return nullptr;
+    latest = it->second.version;
+    if (version) *version = latest;
+    if (it->second.built == latest) return it->second.policy;
+    inputs = it->second.inputs;
+  }
+  std::shared_ptr<const RoutingPolicy> policy = Build(inputs);
+  inline_builds_.fetch_add(1, std::memory_order_relaxed);
+  Install(server, latest, policy);
+  return policy;
+}
+
+bool PolicyStore::IsCurrent(int64_t server, uint64_t version) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(server);
+  return it != entries_.end() && it->second.built == version;
+}
+
+void PolicyStore::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this]() { return queue_.empty() && !building_; });
+}
+
+size_t PolicyStore::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+bool PolicyStore::Install(int64_t server, uint64_t version,
+                          std::shared_ptr<const RoutingPolicy> policy) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(server);
+  // Newer inputs, or a build that got there first, win.
+  if (it == entries_.end() || it->second.version != version || it->second.built == version) {
+    return false;
+  }
+  it->second.built = version;
+  it->second.policy = std::move(policy);
+  return true;
+}
+
+void PolicyStore::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    if (stopping_) break;
+    int64_t server = queue_.front();
+    queue_.pop_front();
+    auto it = entries_.find(server);
+    if (it != entries_.end() && it->second.built != it->second.version) {
+      PolicyInputs inputs = it->second.inputs;
+      uint64_t version = it->second.version;
+      building_ = true;
+      lock.unlock();
+      std::shared_ptr<const RoutingPolicy> policy = Build(inputs);
+      builds_.fetch_add(1, std::memory_order_relaxed);
+      if (Install(server, version, policy) && on_built_) {
+        on_built_(server, version, std::move(policy));
+      }
+      lock.lock();
+      building_ = false;
+    }
+    if (queue_.empty()) idle_.notify_all();
+  }
+  building_ = false;
+  idle_.notify_all();
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,106 @@
+#ifndef FLUTTER_PLUGIN_POLICY_STORE_H_
+#define FLUTTER_PLUGIN_POLICY_STORE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "routing_policy.h"
+
+namespace vpn_plugin {
+
+// What a server's effective policy is built from: the rules of its routing
+// profile and the excluded routes that apply to every server.
+struct PolicyInputs {
+  RoutingMode default_mode = RoutingMode::kVpn;
+  std::vector<std::string> bypass_rules;
+  std::vector<std::string> vpn_rules;
+  std::vector<std::string> excluded_routes;
+
+  bool operator==(const PolicyInputs& other) const {
+    return default_mode == other.default_mode && bypass_rules == other.bypass_rules &&
+           vpn_rules == other.vpn_rules && excluded_routes == other.excluded_routes;
+  }
+  bool operator!=(const PolicyInputs& other) const { return !(*this == other); }
+};
+
+// Compiled routing policies by server id. Set() queues a server's inputs
+// for a background thread that builds its RoutingPolicy, so connecting to
+// a server only looks the finished policy up. A policy never changes once
+// built; new inputs build a new one, which the listeners swap in.
+class PolicyStore {
+ public:
+  // Called on the build thread, with no lock of the store held, each time
+  // a server's policy is rebuilt in the background. By the time it runs a
+  // newer |version| may be built already; see IsCurrent().
+  using BuiltCallback = std::function<void(int64_t server, uint64_t version,
+                                           std::shared_ptr<const RoutingPolicy> policy)>;
+
+  explicit PolicyStore(BuiltCallback on_built = nullptr);
+  ~PolicyStore();
+
+  PolicyStore(const PolicyStore&) = delete;
+  PolicyStore& operator=(const PolicyStore&) = delete;
+
+  // Replaces |server|'s inputs. Inputs equal to the current ones are not
+  // built again.
+  void Set(int64_t server, PolicyInputs inputs);
+  // Drops every server not in |servers|.
+  void Retain(const std::vector<int64_t>& servers);
+  // The policy built from |server|'s latest inputs, and their version in
+  // |version| if given; null for a server the store does not know. Builds
+  // it on the calling thread when the background thread has not got to it
+  // yet.
+  std::shared_ptr<const RoutingPolicy> Get(int64_t server, uint64_t* version = nullptr);
+  // Whether the policy of |version| is the newest one built for |server|,
+  // so that handing it out cannot replace a newer one.
+  bool IsCurrent(int64_t server, uint64_t version) const;
+  // Blocks until every queued build has finished.
+  void Flush();
+
+  size_t size() const;
+  // Policies built in the background, and by Get() because the background
+  // had not finished them.
+  uint64_t builds() const { return builds_.load(std::memory_order_relaxed); }
+  uint64_t inline_builds() const { return inline_builds_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Entry {
+    PolicyInputs inputs;
+    // Bumped by every Set() that changes |inputs|; |policy| is current
+    // while |built| equals it.
+    uint64_t version = 0;
+    uint64_t built = 0;
+    std::shared_ptr<const RoutingPolicy> policy;
+  };
+
+  static std::shared_ptr<const RoutingPolicy> Build(const PolicyInputs& inputs);
+  // Installs |policy| if |server|'s inputs are still at |version|.
+  bool Install(int64_t server, uint64_t version, std::shared_ptr<const RoutingPolicy> policy);
+  void Run();
+
+  BuiltCallback on_built_;
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  std::unordered_map<int64_t, Entry> entries_;
+  std::deque<int64_t> queue_;
+  bool building_ = false;
+  bool stopping_ = false;
+  uint64_t next_version_ = 1;
+  std::atomic<uint64_t> builds_{0};
+  std::atomic<uint64_t> inline_builds_{0};
+  std::thread thread_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_POLICY_STORE_H_
@@ -0,0 +1,534 @@
+#include "protocol_sniffer.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr uint8_t kTlsHandshake = 22;
+constexpr uint8_t kHandshakeClientHello = 1;
+constexpr uint16_t kExtensionServerName = 0;
+constexpr uint8_t kServerNameHost = 0;
+constexpr size_t kTlsRecordHeader = 5;
+// Larger hellos are not something a client sends.
+constexpr size_t kMaxClientHello = 64 * 1024;
+constexpr size_t kMaxHttpHeader = 8192;
+
+constexpr uint32_t kQuicV1 = 0x00000001;
+constexpr uint32_t kQuicV2 = 0x6b3343cf;
+constexpr uint8_t kQuicV1Salt[20] = {0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+                                     0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a};
+constexpr uint8_t kQuicV2Salt[20] = {0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+                                     0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9};
+constexpr size_t kQuicMaxCid = 20;
+constexpr size_t kQuicTagSize = 16;
+constexpr size_t kQuicSampleSize = 16;
+constexpr uint64_t kQuicFramePadding = 0x00;
+constexpr uint64_t kQuicFramePing = 0x01;
+constexpr uint64_t kQuicFrameAck = 0x02;
+constexpr uint64_t kQuicFrameAckEcn = 0x03;
+constexpr uint64_t kQuicFrameCrypto = 0x06;
+
+// A byte sequence made of pieces that are not contiguous in memory: the
+// payloads of consecutive TLS records, or CRYPTO frames in offset order.
+class ByteChain {
+ public:
+  static constexpr size_t kMaxPieces = 32;
+
+  bool Append(const uint8_t* data, size_t size) {
+    if (size == 0) return true;
+    if (count_ == kMaxPieces) return false;
+    pieces_[count_++] = Piece{data, size};
+    size_ += size;
+    return true;
+  }
+  size_t size() const { return size_; }
+
+ private:
+  friend class ChainReader;
+  struct Piece {
+    const uint8_t* data;
+    size_t size;
+  };
+  Piece pieces_[kMaxPieces];
+  size_t count_ = 0;
+  size_t size_ = 0;
+};
+
+class ChainReader {
+ public:
+  explicit ChainReader(const ByteChain& chain) : chain_(chain) {}
+
+  size_t position() const { return position_; }
+  size_t remaining() const { return chain_.size() - position_; }
+
+  bool Skip(size_t n) {
+    if (n > remaining()) return false;
+    position_ += n;
+    while (n > 0) {
+      size_t step = std::min(n, chain_.pieces_[piece_].size - offset_);
+      n -= step;
+      offset_ += step;
+      if (offset_ == chain_.pieces_[piece_].size) {
+        piece_++;
+        offset_ = 0;
+      }
+    }
+    return true;
+  }
+  bool ReadInt(size_t bytes, uint32_t* out) {
+    if (bytes > remaining()) return false;
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      value = value << 8 | chain_.pieces_[piece_].data[offset_];
+      Skip(1);
+    }
+    *out = value;
+    return true;
+  }
+  bool ReadString(size_t n, std::string* out) {
+    if (n > remaining()) return false;
+    out->clear();
+    out->reserve(n);
+    while (n > 0) {
+      size_t step = std::min(n, chain_.pieces_[piece_].size - offset_);
+      out->append(reinterpret_cast<const char*>(chain_.pieces_[piece_].data + offset_), step);
+      Skip(step);
+      n -= step;
+    }
+    return true;
+  }
+
+ private:
+  const ByteChain& chain_;
+  size_t piece_ = 0;
+  size_t offset_ = 0;
+  size_t position_ = 0;
+};
+
+// Parses a handshake message from the start of |chain|. |final| says no
+// further bytes will follow, so a short hello is malformed rather than
+// incomplete.
+SniffResult ParseClientHello(const ByteChain& chain, bool final, std::string* server_name) {
+  ChainReader reader(chain);
+  uint32_t type;
+  uint32_t length;
+  if (!reader.ReadInt(1, &type)) return SniffResult::kNeedMore;
+  if (type != kHandshakeClientHello) return SniffResult::kNotFound;
+  if (!reader.ReadInt(3, &length)) return final ? SniffResult::kNotFound : SniffResult::kNeedMore;
+  if (length > kMaxClientHello) return SniffResult::kNotFound;
+  size_t end = reader.position() + length;
+  // Running out of bytes means "wait" until the whole hello is there.
+  SniffResult shortage = final || chain.size() >= end ? SniffResult::kNotFound
+                                                      : SniffResult::kNeedMore;
+  uint32_t value;
+  // legacy_version, random, legacy_session_id.
+  if (!reader.Skip(2 + 32) || !reader.ReadInt(1, &value) || !reader.Skip(value)) {
+    return shortage;
+  }
+  // cipher_suites, legacy_compression_methods.
+  if (!reader.ReadInt(2, &value) || !reader.Skip(value) || !reader.ReadInt(1, &value) ||
+      !reader.Skip(value)) {
+    return shortage;
+  }
+  if (reader.position() >= end) return SniffResult::kNotFound;
+  uint32_t extensions_length;
+  if (!reader.ReadInt(2, &extensions_length)) return shortage;
+  size_t extensions_end = reader.position() + extensions_length;
+  if (extensions_end > end) return SniffResult::kNotFound;
+  while (reader.position() + 4 <= extensions_end) {
+    uint32_t extension;
+    uint32_t extension_length;
+    if (!reader.ReadInt(2, &extension) || !reader.ReadInt(2, &extension_length)) {
+      return shortage;
+    }
+    size_t extension_end = reader.position() + extension_length;
+    if (extension_end > extensions_end) return SniffResult::kNotFound;
+    if (extension != kExtensionServerName) {
+      if (!reader.Skip(extension_length)) return shortage;
+      continue;
+    }
+    uint32_t list_length;
+    uint32_t name_type;
+    uint32_t name_length;
+    if (!reader.ReadInt(2, &list_length) || !reader.ReadInt(1, &name_type) ||
+        !reader.ReadInt(2, &name_length)) {
+      return shortage;
+    }
+    if (name_type != kServerNameHost || reader.position() + name_length > extension_end) {
+      return SniffResult::kNotFound;
+    }
+    std::string name;
+    if (!reader.ReadString(name_length, &name)) return shortage;
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (!IsValidSniffedName(name)) return SniffResult::kNotFound;
+    *server_name = std::move(name);
+    return SniffResult::kFound;
+  }
+  return SniffResult::kNotFound;
+}
+
+bool StartsWithNoCase(const uint8_t* data, size_t size, const char* prefix) {
+  size_t length = strlen(prefix);
+  if (size < length) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (std::tolower(data[i]) != prefix[i]) return false;
+  }
+  return true;
+}
+
+// QUIC variable-length integer (RFC 9000 section 16).
+bool ReadVarint(const uint8_t* data, size_t size, size_t* offset, uint64_t* out) {
+  if (*offset >= size) return false;
+  size_t length = size_t{1} << (data[*offset] >> 6);
+  if (size - *offset < length) return false;
+  uint64_t value = data[*offset] & 0x3f;
+  for (size_t i = 1; i < length; i++) value = value << 8 | data[*offset + i];
+  *offset += length;
+  *out = value;
+  return true;
+}
+
+bool HkdfExtract(const uint8_t* salt, size_t salt_size, const uint8_t* ikm, size_t ikm_size,
+                 uint8_t* prk) {
+  unsigned int length = 32;
+  return HMAC(EVP_sha256(), salt, static_cast<int>(salt_size), ikm, ikm_size, prk, &length) !=
+         nullptr;
+}
+
+// HKDF-Expand-Label with an empty context (RFC 8446 section 7.1), for
+// outputs of at most one SHA-256 block.
+bool HkdfExpandLabel(const uint8_t* secret, const char* label, uint8_t* out, size_t size) {
+  uint8_t info[80];
+  size_t label_length = strlen(label);
+  size_t n = 0;
+  info[n++] = 0;
+  info[n++] = static_cast<uint8_t>(size);
+  info[n++] = static_cast<uint8_t>(6 + label_length);
+  memcpy(info + n, "tls13 ", 6);
+  n += 6;
+  memcpy(info + n, label, label_length);
+  n += label_length;
+  info[n++] = 0;
+  info[n++] = 1;
+  uint8_t block[32];
+  unsigned int length = sizeof(block);
+  if (!HMAC(EVP_sha256(), secret, 32, info, n, block, &length)) return false;
+  memcpy(out, block, size);
+  return true;
+}
+
+struct QuicKeys {
+  uint8_t key[16];
+  uint8_t iv[12];
+  uint8_t hp[16];
+};
+
+bool DeriveClientInitialKeys(uint32_t version, const uint8_t* dcid, size_t dcid_size,
+                             QuicKeys* keys) {
+  bool v2 = version == kQuicV2;
+  uint8_t initial[32];
+  uint8_t client[32];
+  return HkdfExtract(v2 ? kQuicV2Salt : kQuicV1Salt, sizeof(kQuicV1Salt), dcid, dcid_size,
+                     initial) &&
+         HkdfExpandLabel(initial, "client in", client, sizeof(client)) &&
+         HkdfExpandLabel(client, v2 ? "quicv2 key" : "quic key", keys->key, sizeof(keys->key)) &&
+         HkdfExpandLabel(client, v2 ? "quicv2 iv" : "quic iv", keys->iv, sizeof(keys->iv)) &&
+         HkdfExpandLabel(client, v2 ? "quicv2 hp" : "quic hp", keys->hp, sizeof(keys->hp));
+}
+
+class CipherContext {
+ public:
+  CipherContext() : ctx_(EVP_CIPHER_CTX_new()) {}
+  ~CipherContext() { EVP_CIPHER_CTX_free(ctx_); }
+  CipherContext(const CipherContext&) = delete;
+  CipherContext& operator=(const CipherContext&) = delete;
+  EVP_CIPHER_CTX* get() { return ctx_; }
+
+ private:
+  EVP_CIPHER_CTX* ctx_;
+};
+
+bool HeaderProtectionMask(const uint8_t* hp, const uint8_t* sample, uint8_t* mask) {
+  CipherContext ctx;
+  int length = 0;
+  return ctx.get() && EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_ecb(), nullptr, hp, nullptr) &&
+         EVP_EncryptUpdate(ctx.get(), mask, &length, sample, kQuicSampleSize) &&
+         length == static_cast<int>(kQuicSampleSize);
+}
+
+bool DecryptPayload(const QuicKeys& keys, uint64_t packet_number, const uint8_t* header,
+                    size_t header_size, const uint8_t* ciphertext, size_t size, uint8_t* out) {
+  if (size < kQuicTagSize) return false;
+  uint8_t nonce[12];
+  memcpy(nonce, keys.iv, sizeof(nonce));
+  for (int i = 0; i < 8; i++) nonce[11 - i] ^= static_cast<uint8_t>(packet_number >> (8 * i));
+  size_t body = size - kQuicTagSize;
+  CipherContext ctx;
+  int length = 0;
+  return ctx.get() &&
+         EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, nullptr, nullptr) &&
+         EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, sizeof(nonce), nullptr) &&
+         EVP_DecryptInit_ex(ctx.get(), nullptr, nullptr, keys.key, nonce) &&
+         EVP_DecryptUpdate(ctx.get(), nullptr, &length, header, static_cast<int>(header_size)) &&
+         EVP_DecryptUpdate(ctx.get(), out, &length, ciphertext, static_cast<int>(body)) &&
+         EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, kQuicTagSize,
+                             const_cast<uint8_t*>(ciphertext + body)) &&
+         EVP_DecryptFinal_ex(ctx.get(), out + length, &length);
+}
+
+struct CryptoFragment {
+  uint64_t offset;
+  const uint8_t* data;
+  size_t size;
+};
+
+// Collects the CRYPTO frames of a decrypted Initial payload. Returns false
+// on frames an Initial packet cannot carry.
+bool CollectCryptoFrames(const uint8_t* payload, size_t size,
+                         std::vector<CryptoFragment>* fragments) {
+  size_t offset = 0;
+  while (offset < size) {
+    uint64_t type;
+    if (!ReadVarint(payload, size, &offset, &type)) return false;
+    if (type == kQuicFramePadding || type == kQuicFramePing) continue;
+    if (type == kQuicFrameCrypto) {
+      uint64_t stream_offset;
+      uint64_t length;
+      if (!ReadVarint(payload, size, &offset, &stream_offset) ||
+          !ReadVarint(payload, size, &offset, &length) || length > size - offset) {
+        return false;
+      }
+      fragments->push_back(CryptoFragment{stream_offset, payload + offset,
+                                          static_cast<size_t>(length)});
+      offset += static_cast<size_t>(length);
+      continue;
+    }
+    if (type == kQuicFrameAck || type == kQuicFrameAckEcn) {
+      uint64_t value;
+      uint64_t ranges;
+      // Largest acknowledged, delay, range count, first range.
+      if (!ReadVarint(payload, size, &offset, &value) ||
+          !ReadVarint(payload, size, &offset, &value) ||
+          !ReadVarint(payload, size, &offset, &ranges) ||
+          !ReadVarint(payload, size, &offset, &value)) {
+        return false;
+      }
+      for (uint64_t i = 0; i < ranges * 2 + (type == kQuicFrameAckEcn ? 3 : 0); i++) {
+        if (!ReadVarint(payload, size, &offset, &value)) return false;
+      }
+      continue;
+    }
+    // Anything else ends the useful part of the packet.
+    return true;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool IsValidSniffedName(const std::string& name) {
+  if (name.empty() || name.size() > 253 || name.front() == '.' || name.front() == '-') {
+    return false;
+  }
+  for (char c : name) {
+    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '-' ||
+          c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+SniffResult SniffTlsServerName(const uint8_t* data, size_t size, std::string* server_name) {
+  if (size == 0) return SniffResult::kNeedMore;
+  if (data[0] != kTlsHandshake) return SniffResult::kNotFound;
+  ByteChain chain;
+  size_t offset = 0;
+  bool final = false;
+  while (offset < size) {
+    if (size - offset < kTlsRecordHeader) break;
+    const uint8_t* header = data + offset;
+    if (header[0] != kTlsHandshake) {
+      // A different record type means the hello is over.
+      final = true;
+      break;
+    }
+    size_t length = static_cast<size_t>(header[3]) << 8 | header[4];
+    if (header[1] != 3 || length == 0 || length > 16384 + 256) return SniffResult::kNotFound;
+    size_t available = std::min(length, size - offset - kTlsRecordHeader);
+    if (!chain.Append(header + kTlsRecordHeader, available)) return SniffResult::kNotFound;
+    offset += kTlsRecordHeader + available;
+  }
+  return ParseClientHello(chain, final, server_name);
+}
+
+SniffResult SniffHttpHost(const uint8_t* data, size_t size, std::string* host) {
+  static const char* const kMethods[] = {"GET ",     "POST ",  "HEAD ",    "PUT ",  "DELETE ",
+                                         "OPTIONS ", "PATCH ", "CONNECT ", "TRACE "};
+  bool method = false;
+  for (const char* candidate : kMethods) {
+    size_t length = strlen(candidate);
+    size_t compared = std::min(size, length);
+    if (memcmp(data, candidate, compared) != 0) continue;
+    if (compared < length) return SniffResult::kNeedMore;
+    method = true;
+    break;
+  }
+  if (!method) return SniffResult::kNotFound;
+
+  size_t limit = std::min(size, kMaxHttpHeader);
+  const uint8_t* end = data + limit;
+  const uint8_t* line = static_cast<const uint8_t*>(memchr(data, '\n', limit));
+  while (line) {
+    line++;
+    const uint8_t* next = static_cast<const uint8_t*>(memchr(line, '\n', end - line));
+    if (!next) break;
+    size_t length = next - line;
+    if (length > 0 && line[length - 1] == '\r') length--;
+    // An empty line ends the headers.
+    if (length == 0) return SniffResult::kNotFound;
+    if (StartsWithNoCase(line, length, "host:")) {
+      const char* value = reinterpret_cast<const char*>(line) + 5;
+      const char* value_end = reinterpret_cast<const char*>(line) + length;
+      while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+      std::string name(value, value_end);
+      if (!name.empty() && name[0] == '[') return SniffResult::kNotFound;
+      size_t colon = name.rfind(':');
+      if (colon != std::string::npos) name.resize(colon);
+      std::transform(name.begin(), name.end(), name.begin(),
+                     [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+      if (!name.empty() && name.back() == '.') name.pop_back();
+      if (!IsValidSniffedName(name)) return SniffResult::kNotFound;
+      *host = std::move(name);
+      return SniffResult::kFound;
+    }
+    line = next;
+  }
+  return size >= kMaxHttpHeader ? SniffResult::kNotFound : SniffResult::kNeedMore;
+}
+
+SniffResult SniffStreamDomain(const uint8_t* data, size_t size, std::string* domain) {
+  if (size == 0) return SniffResult::kNeedMore;
+  if (data[0] == kTlsHandshake) return SniffTlsServerName(data, size, domain);
+  return SniffHttpHost(data, size, domain);
+}
+
+SniffResult SniffQuicServerName(const uint8_t* data, size_t size, std::string* server_name) {
+  std::vector<uint8_t> plaintext;
+  // Start and end of each decrypted payload within |plaintext|.
+  std::vector<std::pair<size_t, size_t>> payloads;
+  bool have_keys = false;
+  QuicKeys keys;
+  uint8_t dcid[kQuicMaxCid];
+  size_t dcid_size = 0;
+  size_t offset = 0;
+  // A datagram may hold several coalesced long-header packets.
+  while (offset < size && (data[offset] & 0x80)) {
+    const uint8_t* packet = data + offset;
+    size_t remaining = size - offset;
+    if (remaining < 7) break;
+    uint32_t version = static_cast<uint32_t>(packet[1]) << 24 | packet[2] << 16 |
+                       packet[3] << 8 | packet[4];
+    if (version != kQuicV1 && version != kQuicV2) break;
+    uint8_t type = (packet[0] >> 4) & 0x03;
+    bool initial = version == kQuicV2 ? type == 1 : type == 0;
+    bool retry = version == kQuicV2 ? type == 0 : type == 3;
+    if (retry) break;
+    size_t pos = 5;
+    size_t packet_dcid_size = packet[pos++];
+    if (packet_dcid_size > kQuicMaxCid || remaining - pos < packet_dcid_size + 1) break;
+    const uint8_t* packet_dcid = packet + pos;
+    pos += packet_dcid_size;
+    size_t scid_size = packet[pos++];
+    if (scid_size > kQuicMaxCid || remaining - pos < scid_size) break;
+    pos += scid_size;
+    uint64_t token_length = 0;
+    if (initial) {
+      if (!ReadVarint(packet, remaining, &pos, &token_length) ||
+          token_length > remaining - pos) {
+        break;
+      }
+      pos += static_cast<size_t>(token_length);
+    }
+    uint64_t length;
+    if (!ReadVarint(packet, remaining, &pos, &length) || length > remaining - pos) break;
+    size_t packet_size = pos + static_cast<size_t>(length);
+    offset += packet_size;
+    if (!initial) continue;
+
+    if (!have_keys) {
+      if (!DeriveClientInitialKeys(version, packet_dcid, packet_dcid_size, &keys)) break;
+      memcpy(dcid, packet_dcid, packet_dcid_size);
+      dcid_size = packet_dcid_size;
+      have_keys = true;
+    } else if (packet_dcid_size != dcid_size || memcmp(dcid, packet_dcid, dcid_size) != 0) {
+      continue;
+    }
+    // The sample starts four bytes after the packet number field begins.
+    if (length < 4 + kQuicSampleSize) break;
+    uint8_t mask[kQuicSampleSize];
+    if (!HeaderProtectionMask(keys.hp, packet + pos + 4, mask)) break;
+    uint8_t header[64 + 2 * kQuicMaxCid];
+    size_t pn_length = ((packet[0] ^ mask[0]) & 0x03) + 1;
+    size_t header_size = pos + pn_length;
+    // The token is part of the authenticated header, so long ones need
+    // a buffer of their own.
+    std::vector<uint8_t> long_header;
+    uint8_t* aad = header;
+    if (header_size > sizeof(header)) {
+      long_header.resize(header_size);
+      aad = long_header.data();
+    }
+    memcpy(aad, packet, header_size);
+    aad[0] ^= mask[0] & 0x0f;
+    uint64_t packet_number = 0;
+    for (size_t i = 0; i < pn_length; i++) {
+      aad[pos + i] ^= mask[1 + i];
+      packet_number = packet_number << 8 | aad[pos + i];
+    }
+    size_t ciphertext_size = packet_size - header_size;
+    size_t start = plaintext.size();
+    plaintext.resize(start + ciphertext_size);
+    if (!DecryptPayload(keys, packet_number, aad, header_size, packet + header_size,
+                        ciphertext_size, plaintext.data() + start)) {
+      return SniffResult::kNotFound;
+    }
+    plaintext.resize(start + ciphertext_size - kQuicTagSize);
+    payloads.emplace_back(start, plaintext.size());
+  }
+  if (!have_keys) return SniffResult::kNotFound;
+
+  // Fragments point into |plaintext|, which no longer grows.
+  std::vector<CryptoFragment> fragments;
+  for (const auto& payload : payloads) {
+    if (!CollectCryptoFrames(plaintext.data() + payload.first, payload.second - payload.first,
+                             &fragments)) {
+      return SniffResult::kNotFound;
+    }
+  }
+  std::sort(fragments.begin(), fragments.end(),
+            [](const CryptoFragment& a, const CryptoFragment& b) { return a.offset < b.offset; });
+  ByteChain chain;
+  uint64_t covered = 0;
+  for (const auto& fragment : fragments) {
+    // Only the contiguous prefix of the stream can be parsed.
+    if (fragment.offset > covered) break;
+    uint64_t skip = covered - fragment.offset;
+    if (skip >= fragment.size) continue;
+    if (!chain.Append(fragment.data + skip, fragment.size - skip)) break;
+    covered = fragment.offset + fragment.size;
+  }
+  return ParseClientHello(chain, false, server_name);
+}
+
+}  // namespace vpn_plugin
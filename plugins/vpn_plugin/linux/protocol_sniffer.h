@@ -0,0 +1,40 @@
+#ifndef FLUTTER_PLUGIN_PROTOCOL_SNIFFER_H_
+#define FLUTTER_PLUGIN_PROTOCOL_SNIFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace vpn_plugin {
+
+enum class SniffResult {
+  kFound,
+  // The bytes so far are a plausible start; more may reveal the domain.
+  kNeedMore,
+  // Not a protocol the sniffer knows, or it carries no domain.
+  kNotFound,
+};
+
+// Reads the server_name extension of a TLS ClientHello at the start of a
+// TCP stream. The hello may span several records and be cut anywhere; the
+// bytes are parsed in place, so nothing is copied but the name itself.
+SniffResult SniffTlsServerName(const uint8_t* data, size_t size, std::string* server_name);
+
+// Reads the Host header of a plaintext HTTP/1.x request, without the port.
+SniffResult SniffHttpHost(const uint8_t* data, size_t size, std::string* host);
+
+// Tries TLS, then HTTP, on the first bytes a client sent on a stream.
+SniffResult SniffStreamDomain(const uint8_t* data, size_t size, std::string* domain);
+
+// Decrypts the QUIC v1 or v2 Initial packets of a client datagram (RFC 9001
+// section 5, RFC 9369) and reads the server name from the ClientHello in
+// their CRYPTO frames. kNeedMore means the hello continues in a later
+// datagram and the name was not in this part.
+SniffResult SniffQuicServerName(const uint8_t* data, size_t size, std::string* server_name);
+
+// Sniffed names are lowercased and checked to be plausible host names.
+bool IsValidSniffedName(const std::string& name);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_PROTOCOL_SNIFFER_H_
@@ -0,0 +1,167 @@
+#include "record_codec.h"
+
+#include <cstring>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr char kMagic[] = {'R', 'C', 1};
+
+enum FieldType : uint32_t {
+  kInt = 0,
+  kString = 1,
+  kStringList = 2,
+  kWideInt = 3,
+};
+
+void AppendVarint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+}  // namespace
+
+void RecordWriter::Reset(uint32_t fields_per_record) {
+  fields_per_record_ = fields_per_record;
+  records_ = 0;
+  table_.clear();
+  body_.clear();
+  index_.clear();
+}
+
+void RecordWriter::AddInt(int64_t value) {
+  uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+  if (zigzag >> 62) {
+    AppendVarint(&body_, kWideInt);
+    AppendVarint(&body_, zigzag);
+    return;
+  }
+  AppendVarint(&body_, zigzag << 2 | kInt);
+}
+
+void RecordWriter::AddString(std::string_view value) {
+  AppendVarint(&body_, static_cast<uint64_t>(Intern(value)) << 2 | kString);
+}
+
+void RecordWriter::AddStringList(const char* const* values, size_t count) {
+  AppendVarint(&body_, static_cast<uint64_t>(count) << 2 | kStringList);
+  for (size_t i = 0; i < count; i++) AppendVarint(&body_, Intern(values[i]));
+}
+
+const std::string& RecordWriter::Finish() {
+  out_.assign(kMagic, sizeof(kMagic));
+  AppendVarint(&out_, index_.size());
+  out_ += table_;
+  AppendVarint(&out_, records_);
+  AppendVarint(&out_, fields_per_record_);
+  out_ += body_;
+  return out_;
+}
+
+MemoryUsage RecordWriter::memory_usage() const {
+  MemoryUsage usage;
+  usage.bytes = HeapBytes(table_) + HeapBytes(body_) + HeapBytes(out_) + HeapBytes(key_) +
+                HeapBytes(index_);
+  for (const auto& entry : index_) usage.bytes += HeapBytes(entry.first);
+  usage.objects = index_.size();
+  return usage;
+}
+
+uint32_t RecordWriter::Intern(std::string_view value) {
+  // Looked up through a reused key so that repeated strings do not
+  // allocate.
+  key_.assign(value.data(), value.size());
+  auto it = index_.find(key_);
+  if (it != index_.end()) return it->second;
+  uint32_t index = static_cast<uint32_t>(index_.size());
+  index_.emplace(key_, index);
+  AppendVarint(&table_, value.size());
+  table_.append(value.data(), value.size());
+  return index;
+}
+
+bool RecordReader::Open(const uint8_t* data, size_t size) {
+  data_ = data;
+  size_ = size;
+  offset_ = sizeof(kMagic);
+  strings_.clear();
+  if (size < sizeof(kMagic) || memcmp(data, kMagic, sizeof(kMagic)) != 0) return false;
+  uint64_t count;
+  if (!ReadVarint(&count) || count > size_ - offset_) return false;
+  strings_.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t length;
+    if (!ReadVarint(&length) || length > size_ - offset_) return false;
+    strings_.emplace_back(reinterpret_cast<const char*>(data_ + offset_), length);
+    offset_ += length;
+  }
+  uint64_t records;
+  uint64_t fields;
+  if (!ReadVarint(&records) || !ReadVarint(&fields)) return false;
+  // Every field takes at least a byte.
+  if (fields != 0 && records > (size_ - offset_) / fields) return false;
+  record_count_ = records;
+  fields_per_record_ = fields;
+  return true;
+}
+
+bool RecordReader::ReadInt(int64_t* value) {
+  uint64_t zigzag;
+  if (!ReadField(kWideInt, &zigzag)) {
+    if (!ReadField(kInt, &zigzag)) return false;
+  } else if (zigzag != 0 || !ReadVarint(&zigzag)) {
+    return false;
+  }
+  *value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+  return true;
+}
+
+bool RecordReader::ReadString(std::string_view* value) {
+  uint64_t index;
+  if (!ReadField(kString, &index) || index >= strings_.size()) return false;
+  *value = strings_[index];
+  return true;
+}
+
+bool RecordReader::ReadStringList(std::vector<std::string_view>* values) {
+  uint64_t count;
+  if (!ReadField(kStringList, &count) || count > size_ - offset_) return false;
+  values->clear();
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t index;
+    if (!ReadVarint(&index) || index >= strings_.size()) return false;
+    values->push_back(strings_[index]);
+  }
+  return true;
+}
+
+bool RecordReader::ReadVarint(uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && offset_ < size_; shift += 7) {
+    uint8_t byte = data_[offset_++];
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RecordReader::ReadField(uint32_t type, uint64_t* payload) {
+  size_t start = offset_;
+  uint64_t field;
+  if (!ReadVarint(&field)) return false;
+  if ((field & 3) != type) {
+    offset_ = start;
+    return false;
+  }
+  *payload = field >> 2;
+  return true;
+}
+
+}  // namespace vpn_plugin
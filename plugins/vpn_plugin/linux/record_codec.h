@@ -0,0 +1,91 @@
+#ifndef FLUTTER_PLUGIN_RECORD_CODEC_H_
+#define FLUTTER_PLUGIN_RECORD_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_usage.h"
+
+namespace vpn_plugin {
+
+// Compact positional encoding for lists of flat records sent over a method
+// channel as one Uint8List, instead of a map with string keys per record.
+// Field order is fixed by the method, so no names are sent, and every
+// distinct string is sent once.
+//
+// Layout, all integers unsigned LEB128 varints:
+//   "RC" version(1 byte = 1)
+//   string_count  { byte_length UTF-8 bytes } * string_count
+//   record_count fields_per_record
+//   { field * fields_per_record } * record_count
+// A field is one varint whose low two bits give its type:
+//   0  integer, zigzag-encoded in the remaining bits
+//   1  string, the index into the string table in the remaining bits
+//   2  string list, the length in the remaining bits, then that many
+//      string indexes
+//   3  integer too wide for the above; the zigzag value follows as its own
+//      varint
+class RecordWriter {
+ public:
+  // Starts a new message. Buffers keep their capacity across messages.
+  void Reset(uint32_t fields_per_record);
+
+  void AddInt(int64_t value);
+  void AddString(std::string_view value);
+  void AddStringList(const char* const* values, size_t count);
+  // Finishes the current record; it must have fields_per_record fields.
+  void EndRecord() { records_++; }
+
+  // The encoded message, valid until the next Reset().
+  const std::string& Finish();
+
+  // The buffers kept across messages; the objects are the strings interned
+  // for the last one.
+  MemoryUsage memory_usage() const;
+
+ private:
+  uint32_t Intern(std::string_view value);
+
+  uint32_t fields_per_record_ = 0;
+  uint32_t records_ = 0;
+  std::string table_;
+  std::string body_;
+  std::string out_;
+  std::string key_;
+  std::unordered_map<std::string, uint32_t> index_;
+};
+
+// Reads what RecordWriter wrote. Strings point into the message, which must
+// outlive the reader. Read calls fail on a type mismatch or truncation.
+class RecordReader {
+ public:
+  bool Open(const uint8_t* data, size_t size);
+
+  size_t record_count() const { return record_count_; }
+  size_t fields_per_record() const { return fields_per_record_; }
+
+  bool ReadInt(int64_t* value);
+  bool ReadString(std::string_view* value);
+  bool ReadStringList(std::vector<std::string_view>* values);
+  // True once every field of every record was read.
+  bool done() const { return offset_ == size_; }
+
+ private:
+  bool ReadVarint(uint64_t* value);
+  bool ReadField(uint32_t type, uint64_t* payload);
+
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+  size_t record_count_ = 0;
+  size_t fields_per_record_ = 0;
+  std::vector<std::string_view> strings_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_RECORD_CODEC_H_
@@ -0,0 +1,89 @@
+#include "relay_budget.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr int64_t kMinFlowBytes = 64 * 1024;
+constexpr int64_t kMaxBytes = int64_t{1} << 34;
+
+}  // namespace
+
+RelayBudgetOptions RelayBudgetOptions::FromConfig(const ConfigDocument& config) {
+  const char* kSection = "listener.socks";
+  RelayBudgetOptions options;
+  int64_t per_flow = config.GetInt(kSection, "flow_buffer_limit",
+                                   static_cast<int64_t>(options.per_flow_bytes));
+  if (per_flow >= kMinFlowBytes && per_flow <= kMaxBytes) {
+    options.per_flow_bytes = static_cast<size_t>(per_flow);
+  }
+  int64_t total =
+      config.GetInt(kSection, "buffer_limit", static_cast<int64_t>(options.total_bytes));
+  if (total >= kMinFlowBytes && total <= kMaxBytes) options.total_bytes = static_cast<size_t>(total);
+  options.total_bytes = std::max(options.total_bytes, options.per_flow_bytes);
+  return options;
+}
+
+RelayBudget::RelayBudget(EventLoop* loop, RelayBudgetOptions options)
+    : loop_(loop), options_(options), alive_(std::make_shared<bool>(true)) {}
+
+RelayBudget::~RelayBudget() { *alive_ = false; }
+
+void RelayBudget::Charge(size_t bytes) {
+  buffered_ += bytes;
+  stats_.buffered_bytes.store(buffered_, std::memory_order_relaxed);
+  if (buffered_ > stats_.peak_buffered_bytes.load(std::memory_order_relaxed)) {
+    stats_.peak_buffered_bytes.store(buffered_, std::memory_order_relaxed);
+  }
+}
+
+void RelayBudget::Release(size_t bytes) {
+  buffered_ -= std::min(bytes, buffered_);
+  stats_.buffered_bytes.store(buffered_, std::memory_order_relaxed);
+  if (!exhausted()) ScheduleDrain();
+}
+
+RelayBudget::WaiterId RelayBudget::Wait(EventLoop::Task resume) {
+  WaiterId id = next_waiter_++;
+  waiters_.emplace(id, std::move(resume));
+  // The flows that filled the budget may have drained in the meantime.
+  if (!exhausted()) ScheduleDrain();
+  return id;
+}
+
+void RelayBudget::CancelWait(WaiterId id) { waiters_.erase(id); }
+
+void RelayBudget::OnPaused() {
+  stats_.paused_flows.fetch_add(1, std::memory_order_relaxed);
+  stats_.pauses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RelayBudget::OnResumed() { stats_.paused_flows.fetch_sub(1, std::memory_order_relaxed); }
+
+void RelayBudget::ScheduleDrain() {
+  // Waiters run from a task of their own: Release() is called from inside
+  // the callbacks of the flow that drained, which the waiters may touch.
+  if (waiters_.empty() || drain_posted_) return;
+  drain_posted_ = true;
+  std::weak_ptr<bool> alive = alive_;
+  loop_->Post([this, alive]() {
+    if (alive.expired() || !*alive.lock()) return;
+    drain_posted_ = false;
+    RunWaiters();
+  });
+}
+
+void RelayBudget::RunWaiters() {
+  // Resumed flows read and charge again; stop handing out credit as soon
+  // as that fills the budget, and leave the rest queued in order.
+  while (!waiters_.empty() && !exhausted()) {
+    EventLoop::Task resume = std::move(waiters_.begin()->second);
+    waiters_.erase(waiters_.begin());
+    resume();
+  }
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,88 @@
+#ifndef FLUTTER_PLUGIN_RELAY_BUDGET_H_
+#define FLUTTER_PLUGIN_RELAY_BUDGET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+
+#include "config_document.h"
+#include "event_loop.h"
+
+namespace vpn_plugin {
+
+struct RelayBudgetOptions {
+  // Bytes one flow may hold in user space, both directions together,
+  // before it stops reading and stops crediting its stream.
+  size_t per_flow_bytes = 512 * 1024;
+  // Bytes all flows of the loop may hold together.
+  size_t total_bytes = 32 * 1024 * 1024;
+
+  // Reads `flow_buffer_limit` and `buffer_limit` from [listener.socks].
+  // The total is for the whole process; callers running several loops
+  // divide it among them.
+  static RelayBudgetOptions FromConfig(const ConfigDocument& config);
+};
+
+struct RelayBudgetStats {
+  std::atomic<uint64_t> buffered_bytes{0};
+  std::atomic<uint64_t> peak_buffered_bytes{0};
+  // Flows currently not reading or not crediting their stream.
+  std::atomic<uint64_t> paused_flows{0};
+  std::atomic<uint64_t> pauses{0};
+};
+
+// Credit shared by the relay flows of one loop. Flows charge the bytes
+// they hold while one side is faster than the other; once a flow or the
+// loop is over budget the flow pauses, which stops its reads on the fast
+// side and withholds the window updates that let the endpoint send more.
+// Paused flows waiting on the loop's budget resume, oldest first, once it
+// has room again.
+//
+// Not thread-safe except for stats(); use it on the loop thread.
+class RelayBudget {
+ public:
+  using WaiterId = uint64_t;
+
+  RelayBudget(EventLoop* loop, RelayBudgetOptions options);
+  ~RelayBudget();
+
+  RelayBudget(const RelayBudget&) = delete;
+  RelayBudget& operator=(const RelayBudget&) = delete;
+
+  size_t per_flow_bytes() const { return options_.per_flow_bytes; }
+  size_t buffered() const { return buffered_; }
+  bool exhausted() const { return buffered_ >= options_.total_bytes; }
+
+  void Charge(size_t bytes);
+  void Release(size_t bytes);
+
+  // Queues |resume| to run on the loop once the budget has drained. Each
+  // waiter runs once; queue again if still over budget.
+  WaiterId Wait(EventLoop::Task resume);
+  void CancelWait(WaiterId id);
+
+  // Count flows that paused for any reason, for the stats.
+  void OnPaused();
+  void OnResumed();
+
+  const RelayBudgetStats& stats() const { return stats_; }
+
+ private:
+  void ScheduleDrain();
+  void RunWaiters();
+
+  EventLoop* loop_;
+  RelayBudgetOptions options_;
+  size_t buffered_ = 0;
+  WaiterId next_waiter_ = 1;
+  std::map<WaiterId, EventLoop::Task> waiters_;
+  bool drain_posted_ = false;
+  std::shared_ptr<bool> alive_;
+  RelayBudgetStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_RELAY_BUDGET_H_
@@ -0,0 +1,89 @@
+#include "routing_policy.h"
+
+namespace vpn_plugin {
+
+RuleSet::RuleSet(const std::vector<std::string>& rules) {
+  std::vector<std::string> domains;
+  for (const auto& raw : rules) {
+    if (raw.empty()) continue;
+    if (raw == "*") {
+      match_all_ = true;
+      continue;
+    }
+    if (raw.find('/') != std::string::npos) {
+      IpNetwork net;
+      if (IpNetwork::Parse(raw, &net)) networks_.push_back(net);
+      continue;
+    }
+    SocketAddress with_port;
+    IpAddress ip;
+    if (SocketAddress::Parse(raw, 0, &with_port)) {
+      addresses_.push_back(AddressRule{with_port.ip, with_port.port});
+      continue;
+    }
+    if (IpAddress::Parse(raw[0] == '[' ? raw.substr(1, raw.size() - 2) : raw, &ip)) {
+      addresses_.push_back(AddressRule{ip, 0});
+      continue;
+    }
+    domains.push_back(raw);
+  }
+  domains_ = DomainMatcher(domains);
+}
+
+bool RuleSet::empty() const {
+  return !match_all_ && domains_.empty() && addresses_.empty() && networks_.empty();
+}
+
+bool RuleSet::Matches(const FlowTarget& target) const {
+  if (match_all_) return true;
+  if (!target.domain.empty() && domains_.Matches(target.domain)) return true;
+  if (!target.ip.is_valid()) return false;
+  for (const auto& rule : addresses_) {
+    if (rule.ip == target.ip && (rule.port == 0 || rule.port == target.port)) return true;
+  }
+  for (const auto& net : networks_) {
+    if (net.Contains(target.ip)) return true;
+  }
+  return false;
+}
+
+RoutingPolicy::RoutingPolicy(RoutingMode default_mode,
+                             const std::vector<std::string>& bypass_rules,
+                             const std::vector<std::string>& vpn_rules,
+                             const std::vector<std::string>& excluded_routes)
+    : default_mode_(default_mode), bypass_rules_(bypass_rules), vpn_rules_(vpn_rules) {
+  for (const auto& route : excluded_routes) {
+    IpNetwork net;
+    if (IpNetwork::Parse(route, &net)) excluded_routes_.push_back(net);
+  }
+}
+
+RoutingPolicy RoutingPolicy::FromConfig(const ConfigDocument& config) {
+  // general: everything goes through the endpoint except the exclusions;
+  // selective: only the exclusions go through the endpoint.
+  auto exclusions = config.GetStringList("", "exclusions");
+  auto excluded_routes = config.GetStringList("listener.tun", "excluded_routes");
+  if (config.GetString("", "vpn_mode", "general") == "selective") {
+    return RoutingPolicy(RoutingMode::kBypass, {}, exclusions, excluded_routes);
+  }
+  return RoutingPolicy(RoutingMode::kVpn, exclusions, {}, excluded_routes);
+}
+
+RoutingMode RoutingPolicy::Decide(const FlowTarget& target) const {
+  if (target.ip.is_valid()) {
+    for (const auto& net : excluded_routes_) {
+      if (net.Contains(target.ip)) return RoutingMode::kBypass;
+    }
+  }
+  if (default_mode_ == RoutingMode::kVpn) {
+    return bypass_rules_.Matches(target) ? RoutingMode::kBypass : RoutingMode::kVpn;
+  }
+  return vpn_rules_.Matches(target) ? RoutingMode::kVpn : RoutingMode::kBypass;
+}
+
+bool RoutingPolicy::uses_domains() const {
+  return default_mode_ == RoutingMode::kVpn ? bypass_rules_.has_domain_rules()
+                                            : vpn_rules_.has_domain_rules();
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,77 @@
+#ifndef FLUTTER_PLUGIN_ROUTING_POLICY_H_
+#define FLUTTER_PLUGIN_ROUTING_POLICY_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "config_document.h"
+#include "domain_matcher.h"
+#include "net_address.h"
+
+namespace vpn_plugin {
+
+enum class RoutingMode : int64_t { kVpn = 0, kBypass = 1 };
+
+// Destination of a flow as seen by a listener. Either |domain| or |ip| (or
+// both) may be set.
+struct FlowTarget {
+  std::string domain;
+  IpAddress ip;
+  uint16_t port = 0;
+};
+
+// Set of rules in the exclusions syntax: domains ("example.com" also matches
+// "www.example.com", "*.example.com" matches subdomains only, "*word*"
+// matches names containing "word"), addresses with an optional port, CIDR
+// ranges, and "*" to match everything. The domain rules are compiled into
+// one DomainMatcher.
+class RuleSet {
+ public:
+  RuleSet() = default;
+  explicit RuleSet(const std::vector<std::string>& rules);
+
+  bool Matches(const FlowTarget& target) const;
+  bool empty() const;
+  bool has_domain_rules() const { return !domains_.empty(); }
+
+ private:
+  struct AddressRule {
+    IpAddress ip;
+    uint16_t port;  // 0 matches any port.
+  };
+
+  bool match_all_ = false;
+  DomainMatcher domains_;
+  std::vector<AddressRule> addresses_;
+  std::vector<IpNetwork> networks_;
+};
+
+// Decides whether a flow goes through the VPN endpoint or directly. Built
+// either from a routing profile (default mode, bypass and vpn rules) or from
+// the `vpn_mode` and `exclusions` keys of the configuration document.
+// Excluded routes always bypass the endpoint.
+class RoutingPolicy {
+ public:
+  RoutingPolicy() = default;
+  RoutingPolicy(RoutingMode default_mode, const std::vector<std::string>& bypass_rules,
+                const std::vector<std::string>& vpn_rules,
+                const std::vector<std::string>& excluded_routes);
+
+  static RoutingPolicy FromConfig(const ConfigDocument& config);
+
+  RoutingMode Decide(const FlowTarget& target) const;
+  RoutingMode default_mode() const { return default_mode_; }
+  // Whether knowing a flow's domain can change the decision.
+  bool uses_domains() const;
+
+ private:
+  RoutingMode default_mode_ = RoutingMode::kBypass;
+  RuleSet bypass_rules_;
+  RuleSet vpn_rules_;
+  std::vector<IpNetwork> excluded_routes_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_ROUTING_POLICY_H_
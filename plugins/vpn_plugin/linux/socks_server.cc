@@ -0,0 +1,1102 @@
+#include "socks_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "io_uring.h"
+#include "protocol_sniffer.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr uint8_t kSocksVersion = 5;
+constexpr uint8_t kAuthVersion = 1;
+constexpr uint8_t kMethodNoAuth = 0x00;
+constexpr uint8_t kMethodPassword = 0x02;
+constexpr uint8_t kMethodNone = 0xff;
+
+constexpr uint8_t kCmdConnect = 1;
+constexpr uint8_t kCmdUdpAssociate = 3;
+
+constexpr uint8_t kAtypIpv4 = 1;
+constexpr uint8_t kAtypDomain = 3;
+constexpr uint8_t kAtypIpv6 = 4;
+
+constexpr uint8_t kReplySucceeded = 0x00;
+constexpr uint8_t kReplyGeneralFailure = 0x01;
+constexpr uint8_t kReplyNotAllowed = 0x02;
+constexpr uint8_t kReplyNetworkUnreachable = 0x03;
+constexpr uint8_t kReplyHostUnreachable = 0x04;
+constexpr uint8_t kReplyConnectionRefused = 0x05;
+constexpr uint8_t kReplyCommandNotSupported = 0x07;
+constexpr uint8_t kReplyAddressNotSupported = 0x08;
+
+constexpr size_t kMaxHandshakeBytes = 1024;
+constexpr size_t kMaxEarlyDataBytes = 64 * 1024;
+// A ClientHello or request header longer than this is not sniffed.
+constexpr size_t kMaxSniffBytes = 16 * 1024;
+// Protocols where the server speaks first; waiting for client bytes there
+// only adds the sniff timeout.
+constexpr uint16_t kServerFirstPorts[] = {21, 22, 25, 110, 143, 587};
+// Sniffed QUIC server names remembered per UDP association.
+constexpr size_t kMaxSniffedUdpFlows = 256;
+
+uint8_t ReplyForErrno(int err) {
+  switch (err) {
+    case ECONNREFUSED: return kReplyConnectionRefused;
+    case ENETUNREACH: return kReplyNetworkUnreachable;
+    case EHOSTUNREACH:
+    case ETIMEDOUT: return kReplyHostUnreachable;
+    default: return kReplyGeneralFailure;
+  }
+}
+
+void CloseFd(int* fd) {
+  if (*fd >= 0) close(*fd);
+  *fd = -1;
+}
+
+// Appends ATYP, address and port of |addr| in SOCKS wire format.
+void AppendAddress(std::string* out, const SocketAddress& addr) {
+  if (addr.ip.is_v6()) {
+    out->push_back(static_cast<char>(kAtypIpv6));
+    out->append(reinterpret_cast<const char*>(addr.ip.bytes), 16);
+  } else {
+    out->push_back(static_cast<char>(kAtypIpv4));
+    out->append(reinterpret_cast<const char*>(addr.ip.bytes), 4);
+  }
+  out->push_back(static_cast<char>(addr.port >> 8));
+  out->push_back(static_cast<char>(addr.port & 0xff));
+}
+
+// Parses ATYP, address and port starting at |data|. Returns the number of
+// bytes consumed, 0 if more data is needed, or -1 on a malformed address.
+int ParseAddress(const uint8_t* data, size_t size, FlowTarget* out) {
+  if (size < 1) return 0;
+  size_t len;
+  switch (data[0]) {
+    case kAtypIpv4: len = 1 + 4; break;
+    case kAtypIpv6: len = 1 + 16; break;
+    case kAtypDomain:
+      if (size < 2) return 0;
+      if (data[1] == 0) return -1;
+      len = 2 + data[1];
+      break;
+    default: return -1;
+  }
+  if (size < len + 2) return 0;
+  if (data[0] == kAtypIpv4) {
+    out->ip = IpAddress::FromV4(data + 1);
+  } else if (data[0] == kAtypIpv6) {
+    out->ip = IpAddress::FromV6(data + 1);
+  } else {
+    out->domain.assign(reinterpret_cast<const char*>(data + 2), data[1]);
+    // Clients may send numeric addresses as domains.
+    IpAddress::Parse(out->domain, &out->ip);
+  }
+  out->port = static_cast<uint16_t>((data[len] << 8) | data[len + 1]);
+  return static_cast<int>(len + 2);
+}
+
+}  // namespace
+
+bool SocksServerOptions::FromConfig(const ConfigDocument& config, SocksServerOptions* out) {
+  const char* kSection = "listener.socks";
+  if (!config.HasSection(kSection)) return false;
+  SocksServerOptions options = *out;
+  if (!SocketAddress::Parse(config.GetString(kSection, "address", "127.0.0.1:1080"), 1080,
+                            &options.listen_address)) {
+    return false;
+  }
+  options.username = config.GetString(kSection, "username");
+  options.password = config.GetString(kSection, "password");
+  *out = std::move(options);
+  return true;
+}
+
+// Runs getaddrinfo() on a helper thread and posts results back to the loop.
+class SocksServer::Resolver {
+ public:
+  using Callback = std::function<void(bool ok, const SocketAddress& address)>;
+
+  explicit Resolver(EventLoop* loop) : shared_(std::make_shared<Shared>()) {
+    shared_->loop = loop;
+  }
+
+  // Lookups in flight are abandoned, not waited for: their workers finish
+  // on their own and drop the result, so a slow name server never holds
+  // up the shard's teardown.
+  ~Resolver() {
+    {
+      std::lock_guard<std::mutex> lock(shared_->mutex);
+      shared_->loop = nullptr;
+      shared_->queue.clear();
+    }
+    shared_->cv.notify_all();
+  }
+
+  void Resolve(const std::string& host, uint16_t port, Callback callback) {
+    bool spawn;
+    {
+      std::lock_guard<std::mutex> lock(shared_->mutex);
+      shared_->queue.push_back(Request{host, port, std::move(callback)});
+      // One slow lookup must not hold up the ones behind it, so a worker
+      // is added while none is idle, up to kMaxWorkers.
+      spawn = shared_->idle == 0 && shared_->workers < kMaxWorkers;
+      if (spawn) shared_->workers++;
+    }
+    if (spawn) {
+      std::thread([shared = shared_]() { Run(shared.get()); }).detach();
+    } else {
+      shared_->cv.notify_one();
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxWorkers = 4;
+
+  struct Request {
+    std::string host;
+    uint16_t port;
+    Callback callback;
+  };
+
+  // Outlives the resolver while workers hold it; |loop| is cleared when
+  // the resolver goes.
+  struct Shared {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Request> queue;
+    EventLoop* loop = nullptr;
+    size_t workers = 0;
+    size_t idle = 0;
+  };
+
+  static void Run(Shared* shared) {
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    while (true) {
+      shared->idle++;
+      shared->cv.wait(lock, [shared]() { return !shared->loop || !shared->queue.empty(); });
+      shared->idle--;
+      if (!shared->loop) break;
+      Request req = std::move(shared->queue.front());
+      shared->queue.pop_front();
+      lock.unlock();
+      SocketAddress address;
+      bool ok = false;
+      addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo* result = nullptr;
+      if (getaddrinfo(req.host.c_str(), nullptr, &hints, &result) == 0 && result) {
+        ok = SocketAddress::FromSockaddr(result->ai_addr, &address);
+        address.port = req.port;
+      }
+      if (result) freeaddrinfo(result);
+      lock.lock();
+      // Posting under the lock keeps the loop alive until it is done.
+      if (!shared->loop) break;
+      shared->loop->Post(
+          [callback = std::move(req.callback), ok, address]() { callback(ok, address); });
+    }
+    shared->workers--;
+  }
+
+  std::shared_ptr<Shared> shared_;
+};
+
+struct SocksServer::Direction {
+  int src = -1;
+  int dst = -1;
+  int pipe_r = -1;
+  int pipe_w = -1;
+  size_t pending = 0;
+  // Bytes that already went through user space (handshake replies, data the
+  // client sent before the upstream was connected).
+  std::string prefix;
+  bool src_eof = false;
+  bool shut = false;
+};
+
+struct SocksServer::UdpAssociation {
+  explicit UdpAssociation(const UdpSocketOptions& options)
+      : client_socket(options), upstream_v4(options), upstream_v6(options) {}
+
+  UdpSocket client_socket;
+  UdpSocket upstream_v4;
+  UdpSocket upstream_v6;
+  IpAddress control_peer;
+  SocketAddress client;
+  bool client_known = false;
+  std::unordered_map<std::string, SocketAddress> resolved;
+  // "address:port" -> server name from the flow's QUIC Initial.
+  std::unordered_map<std::string, std::string> sniffed;
+};
+
+struct SocksServer::Connection {
+  enum class State {
+    kGreeting,
+    kAuth,
+    kRequest,
+    kSniffing,
+    kResolving,
+    kConnecting,
+    kRelaying,
+    kUdp
+  };
+
+  uint64_t id = 0;
+  State state = State::kGreeting;
+  int client_fd = -1;
+  int upstream_fd = -1;
+  SocketAddress peer;
+  std::string in;
+  std::string out;
+  FlowTarget target;
+  EventLoop::TimerId connect_timer = 0;
+  EventLoop::TimerId sniff_timer = 0;
+  // Set once the reply to the request has been queued; a sniffed CONNECT
+  // is answered before its upstream exists.
+  bool replied = false;
+  Direction up;
+  Direction down;
+  // Replaces the splice pipes on io_uring loops.
+  std::shared_ptr<UringRelay> relay;
+  std::unique_ptr<UdpAssociation> udp;
+};
+
+SocksServer::SocksServer(EventLoop* loop, SocksServerOptions options)
+    : loop_(loop), options_(std::move(options)), alive_(std::make_shared<bool>(true)) {}
+
+SocksServer::~SocksServer() {
+  Close();
+  resolver_.reset();
+}
+
+bool SocksServer::Listen() {
+  sockaddr_storage ss;
+  socklen_t len = options_.listen_address.ToSockaddr(&ss);
+  if (len == 0) return false;
+  listen_fd_ = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) return false;
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (options_.reuse_port &&
+      setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+    CloseFd(&listen_fd_);
+    return false;
+  }
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&ss), len) != 0 ||
+      listen(listen_fd_, SOMAXCONN) != 0) {
+    CloseFd(&listen_fd_);
+    return false;
+  }
+  len = sizeof(ss);
+  getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&ss), &len);
+  SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &local_address_);
+  if (loop_->backend() == EventLoopBackend::kIoUring) {
+    uring_pool_ = UringRelayPool::Create(loop_, options_.uring);
+  }
+  if (uring_pool_ && loop_->uring()->SupportsOp(IORING_OP_ACCEPT)) {
+    // Armed from the loop thread, which owns the ring's requests; the
+    // listener is often set up before that thread starts.
+    std::weak_ptr<bool> alive = alive_;
+    loop_->Post([this, alive]() {
+      if (!alive.lock() || listen_fd_ < 0) return;
+      ArmAccept();
+      if (accept_token_ == 0) {
+        loop_->Add(listen_fd_, EventLoop::kReadable, [this](uint32_t) { OnAcceptable(); });
+      }
+    });
+    return true;
+  }
+  return loop_->Add(listen_fd_, EventLoop::kReadable, [this](uint32_t) { OnAcceptable(); });
+}
+
+void SocksServer::ArmAccept() {
+  accept_token_ = 0;
+  io_uring_sqe* sqe = loop_->uring()->GetSqe();
+  if (!sqe) return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  std::weak_ptr<bool> alive = alive_;
+  accept_token_ = loop_->AddCompletion([this, alive](int32_t result, uint32_t flags) {
+    if (!alive.lock() || listen_fd_ < 0) {
+      if (result >= 0) close(result);
+      return;
+    }
+    if (result >= 0) {
+      sockaddr_storage ss;
+      socklen_t len = sizeof(ss);
+      SocketAddress peer;
+      if (getpeername(result, reinterpret_cast<sockaddr*>(&ss), &len) == 0) {
+        SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &peer);
+      }
+      AdoptClient(result, peer);
+    }
+    if (flags & IORING_CQE_F_MORE) return;
+    // The kernel ends a multishot accept on errors such as running out of
+    // fds; readiness-based accepting takes over then.
+    accept_token_ = 0;
+    if (result >= 0) {
+      ArmAccept();
+    } else {
+      loop_->Add(listen_fd_, EventLoop::kReadable, [this](uint32_t) { OnAcceptable(); });
+    }
+  });
+  sqe->user_data = accept_token_;
+}
+
+void SocksServer::Close() {
+  if (accept_token_) {
+    if (io_uring_sqe* sqe = loop_->uring()->GetSqe()) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = accept_token_;
+    }
+    accept_token_ = 0;
+  }
+  if (listen_fd_ >= 0) {
+    loop_->Remove(listen_fd_);
+    CloseFd(&listen_fd_);
+  }
+  while (!connections_.empty()) CloseConnection(connections_.begin()->second.get());
+}
+
+SocksServer::Connection* SocksServer::Find(uint64_t id) {
+  auto it = connections_.find(id);
+  return it == connections_.end() ? nullptr : it->second.get();
+}
+
+RoutingMode SocksServer::Decide(const FlowTarget& target) const {
+  if (!options_.policy) return RoutingMode::kBypass;
+  // Only the decision sees the learned domain; the flow itself still goes
+  // to the address the client asked for.
+  FlowTarget attributed = target;
+  if (options_.domains && options_.domains->Attribute(&attributed, EventLoop::NowMs())) {
+    return options_.policy->Decide(attributed);
+  }
+  return options_.policy->Decide(target);
+}
+
+void SocksServer::OnAcceptable() {
+  while (true) {
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int fd = accept4(listen_fd_, reinterpret_cast<sockaddr*>(&ss), &len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+    SocketAddress peer;
+    SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &peer);
+    AdoptClient(fd, peer);
+  }
+}
+
+void SocksServer::AdoptClient(int fd, const SocketAddress& peer) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  auto conn = std::make_unique<Connection>();
+  conn->id = next_id_++;
+  conn->client_fd = fd;
+  conn->peer = peer;
+  uint64_t id = conn->id;
+  connections_[id] = std::move(conn);
+  stats_.accepted++;
+  stats_.active++;
+  if (!loop_->Add(fd, EventLoop::kReadable | EventLoop::kWritable | EventLoop::kHangup,
+                  [this, id](uint32_t events) { OnClientEvent(id, events); })) {
+    CloseConnection(Find(id));
+  }
+}
+
+void SocksServer::OnClientEvent(uint64_t id, uint32_t events) {
+  Connection* conn = Find(id);
+  if (!conn) return;
+  using State = Connection::State;
+
+  if (conn->state == State::kRelaying) {
+    PumpAll(conn);
+    return;
+  }
+  if ((events & EventLoop::kWritable) && !FlushOutput(conn)) {
+    CloseConnection(conn);
+    return;
+  }
+  if (conn->state == State::kUdp) {
+    // The association lives as long as the control connection; anything the
+    // client sends on it is ignored.
+    char buf[512];
+    while (true) {
+      ssize_t n = recv(conn->client_fd, buf, sizeof(buf), 0);
+      if (n > 0) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+      CloseConnection(conn);
+      return;
+    }
+  }
+  if (conn->state == State::kSniffing || conn->state == State::kResolving ||
+      conn->state == State::kConnecting) {
+    if (!ReadEarlyData(conn) ||
+        (conn->state == State::kSniffing && !ContinueSniffing(conn))) {
+      CloseConnection(conn);
+    }
+    return;
+  }
+  if (!ReadHandshake(conn)) CloseConnection(conn);
+}
+
+bool SocksServer::ReadEarlyData(Connection* conn) {
+  // Early data is kept for the upstream and sent once it is connected.
+  char buf[4096];
+  while (!conn->up.src_eof) {
+    ssize_t n = recv(conn->client_fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      conn->up.prefix.append(buf, n);
+      if (conn->up.prefix.size() > kMaxEarlyDataBytes) return false;
+    } else if (n == 0) {
+      conn->up.src_eof = true;
+    } else if (errno == EAGAIN || errno == EINTR) {
+      return true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SocksServer::ReadHandshake(Connection* conn) {
+  using State = Connection::State;
+  char buf[512];
+  while (true) {
+    ssize_t n = recv(conn->client_fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      conn->in.append(buf, n);
+      if (conn->in.size() > kMaxHandshakeBytes) return false;
+      continue;
+    }
+    if (n == 0) return false;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN) break;
+    return false;
+  }
+
+  while (true) {
+    State before = conn->state;
+    size_t buffered = conn->in.size();
+    bool ok = true;
+    switch (conn->state) {
+      case State::kGreeting: ok = HandleGreeting(conn); break;
+      case State::kAuth: ok = HandleAuth(conn); break;
+      case State::kRequest: ok = HandleRequest(conn); break;
+      default: return true;
+    }
+    if (!ok) return false;
+    if (conn->state == before && conn->in.size() == buffered) return true;
+  }
+}
+
+bool SocksServer::HandleGreeting(Connection* conn) {
+  const auto* data = reinterpret_cast<const uint8_t*>(conn->in.data());
+  if (conn->in.size() < 2) return true;
+  if (data[0] != kSocksVersion) return false;
+  size_t len = 2 + data[1];
+  if (conn->in.size() < len) return true;
+
+  uint8_t wanted = options_.username.empty() ? kMethodNoAuth : kMethodPassword;
+  uint8_t method = kMethodNone;
+  for (size_t i = 2; i < len; i++) {
+    if (data[i] == wanted) method = wanted;
+  }
+  conn->in.erase(0, len);
+  conn->out.push_back(static_cast<char>(kSocksVersion));
+  conn->out.push_back(static_cast<char>(method));
+  if (!FlushOutput(conn) || method == kMethodNone) return false;
+  conn->state = method == kMethodPassword ? Connection::State::kAuth
+                                          : Connection::State::kRequest;
+  return true;
+}
+
+bool SocksServer::HandleAuth(Connection* conn) {
+  const auto* data = reinterpret_cast<const uint8_t*>(conn->in.data());
+  size_t size = conn->in.size();
+  if (size < 2) return true;
+  if (data[0] != kAuthVersion) return false;
+  size_t ulen = data[1];
+  if (size < 2 + ulen + 1) return true;
+  size_t plen = data[2 + ulen];
+  if (size < 3 + ulen + plen) return true;
+
+  std::string user(conn->in, 2, ulen);
+  std::string pass(conn->in, 3 + ulen, plen);
+  conn->in.erase(0, 3 + ulen + plen);
+  bool ok = user == options_.username && pass == options_.password;
+  conn->out.push_back(static_cast<char>(kAuthVersion));
+  conn->out.push_back(static_cast<char>(ok ? 0x00 : 0x01));
+  if (!FlushOutput(conn) || !ok) return false;
+  conn->state = Connection::State::kRequest;
+  return true;
+}
+
+bool SocksServer::HandleRequest(Connection* conn) {
+  const auto* data = reinterpret_cast<const uint8_t*>(conn->in.data());
+  size_t size = conn->in.size();
+  if (size < 4) return true;
+  if (data[0] != kSocksVersion) return false;
+  uint8_t cmd = data[1];
+  FlowTarget target;
+  int consumed = ParseAddress(data + 3, size - 3, &target);
+  if (consumed == 0) return true;
+  if (consumed < 0) {
+    SendReply(conn, kReplyAddressNotSupported, nullptr);
+    return false;
+  }
+  conn->in.erase(0, 3 + consumed);
+  conn->up.prefix = std::move(conn->in);
+  conn->in.clear();
+  conn->target = target;
+
+  if (cmd == kCmdUdpAssociate) {
+    StartUdpAssociate(conn);
+    return true;
+  }
+  if (cmd != kCmdConnect) {
+    SendReply(conn, kReplyCommandNotSupported, nullptr);
+    return false;
+  }
+  if (!ShouldSniff(target)) return RouteRequest(conn, std::string());
+
+  // The client only sends its first bytes after the reply.
+  if (!SendReply(conn, kReplySucceeded, nullptr)) return false;
+  conn->state = Connection::State::kSniffing;
+  uint64_t id = conn->id;
+  conn->sniff_timer = loop_->AddTimer(options_.sniff_timeout_ms, [this, id]() {
+    Connection* c = Find(id);
+    if (!c) return;
+    c->sniff_timer = 0;
+    if (!RouteRequest(c, std::string())) CloseConnection(c);
+  });
+  return ContinueSniffing(conn);
+}
+
+bool SocksServer::ShouldSniff(const FlowTarget& target) const {
+  if (!options_.sniff || !target.domain.empty() || !target.ip.is_valid() || !options_.policy ||
+      !options_.policy->uses_domains()) {
+    return false;
+  }
+  for (uint16_t port : kServerFirstPorts) {
+    if (target.port == port) return false;
+  }
+  return true;
+}
+
+bool SocksServer::ContinueSniffing(Connection* conn) {
+  std::string domain;
+  SniffResult result =
+      SniffStreamDomain(reinterpret_cast<const uint8_t*>(conn->up.prefix.data()),
+                        conn->up.prefix.size(), &domain);
+  if (result == SniffResult::kNeedMore && !conn->up.src_eof &&
+      conn->up.prefix.size() < kMaxSniffBytes) {
+    return true;
+  }
+  if (conn->sniff_timer) {
+    loop_->CancelTimer(conn->sniff_timer);
+    conn->sniff_timer = 0;
+  }
+  if (result != SniffResult::kFound) domain.clear();
+  return RouteRequest(conn, domain);
+}
+
+bool SocksServer::RouteRequest(Connection* conn, const std::string& sniffed) {
+  const FlowTarget& target = conn->target;
+  // The sniffed name only steers the decision; the flow still goes to the
+  // address the client asked for.
+  FlowTarget decision = target;
+  if (!sniffed.empty()) {
+    decision.domain = sniffed;
+    stats_.sniffed++;
+  }
+  if (Decide(decision) == RoutingMode::kVpn) {
+    int fd = options_.tunnel ? options_.tunnel->Open(target) : -1;
+    if (fd < 0) {
+      stats_.rejected++;
+      SendReply(conn, kReplyNotAllowed, nullptr);
+      return false;
+    }
+    stats_.vpn_flows++;
+    return WatchConnect(conn, fd);
+  }
+
+  stats_.bypass_flows++;
+  if (target.ip.is_valid()) return StartConnect(conn, SocketAddress{target.ip, target.port});
+  conn->state = Connection::State::kResolving;
+  if (!resolver_) resolver_ = std::make_unique<Resolver>(loop_);
+  uint64_t id = conn->id;
+  std::weak_ptr<bool> alive = alive_;
+  resolver_->Resolve(target.domain, target.port,
+                     [this, id, alive](bool ok, const SocketAddress& address) {
+                       if (alive.lock()) OnResolved(id, ok, address);
+                     });
+  return true;
+}
+
+void SocksServer::OnResolved(uint64_t id, bool ok, const SocketAddress& address) {
+  Connection* conn = Find(id);
+  if (!conn) return;
+  if (!ok) {
+    SendReply(conn, kReplyHostUnreachable, nullptr);
+    CloseConnection(conn);
+    return;
+  }
+  conn->target.ip = address.ip;
+  if (!StartConnect(conn, address)) CloseConnection(conn);
+}
+
+bool SocksServer::StartConnect(Connection* conn, const SocketAddress& address) {
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    SendReply(conn, kReplyGeneralFailure, nullptr);
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0 && errno != EINPROGRESS) {
+    int err = errno;
+    close(fd);
+    SendReply(conn, ReplyForErrno(err), nullptr);
+    return false;
+  }
+  return WatchConnect(conn, fd);
+}
+
+bool SocksServer::WatchConnect(Connection* conn, int fd) {
+  conn->upstream_fd = fd;
+  conn->state = Connection::State::kConnecting;
+  uint64_t id = conn->id;
+  conn->connect_timer = loop_->AddTimer(options_.connect_timeout_ms, [this, id]() {
+    Connection* c = Find(id);
+    if (!c) return;
+    c->connect_timer = 0;
+    SendReply(c, kReplyHostUnreachable, nullptr);
+    CloseConnection(c);
+  });
+  if (!loop_->Add(fd, EventLoop::kReadable | EventLoop::kWritable | EventLoop::kHangup,
+                  [this, id](uint32_t events) { OnUpstreamEvent(id, events); })) {
+    SendReply(conn, kReplyGeneralFailure, nullptr);
+    return false;
+  }
+  return true;
+}
+
+void SocksServer::OnUpstreamEvent(uint64_t id, uint32_t events) {
+  Connection* conn = Find(id);
+  if (!conn) return;
+  if (conn->state == Connection::State::kRelaying) {
+    PumpAll(conn);
+    return;
+  }
+  if (conn->state != Connection::State::kConnecting) return;
+  if (!(events & (EventLoop::kWritable | EventLoop::kError | EventLoop::kHangup))) return;
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(conn->upstream_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err != 0) {
+    SendReply(conn, ReplyForErrno(err), nullptr);
+    CloseConnection(conn);
+    return;
+  }
+  OnConnected(conn);
+}
+
+void SocksServer::OnConnected(Connection* conn) {
+  if (conn->connect_timer) {
+    loop_->CancelTimer(conn->connect_timer);
+    conn->connect_timer = 0;
+  }
+  sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  SocketAddress bound;
+  if (getsockname(conn->upstream_fd, reinterpret_cast<sockaddr*>(&ss), &len) != 0 ||
+      !SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &bound)) {
+    bound = SocketAddress();
+  }
+  SendReply(conn, kReplySucceeded, bound.ip.is_valid() ? &bound : nullptr);
+  StartRelay(conn);
+}
+
+void SocksServer::StartRelay(Connection* conn) {
+  if (uring_pool_) {
+    // The relay drives both sockets from here on.
+    loop_->Remove(conn->client_fd);
+    loop_->Remove(conn->upstream_fd);
+    conn->state = Connection::State::kRelaying;
+    uint64_t id = conn->id;
+    std::string reply = std::move(conn->out);
+    conn->out.clear();
+    conn->relay = UringRelay::Start(uring_pool_, conn->client_fd, conn->upstream_fd,
+                                    std::move(conn->up.prefix), std::move(reply),
+                                    &stats_.bytes_relayed, [this, id](bool) {
+                                      if (Connection* c = Find(id)) CloseConnection(c);
+                                    });
+    return;
+  }
+  int up_pipe[2];
+  int down_pipe[2];
+  if (pipe2(up_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    CloseConnection(conn);
+    return;
+  }
+  if (pipe2(down_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    close(up_pipe[0]);
+    close(up_pipe[1]);
+    CloseConnection(conn);
+    return;
+  }
+  fcntl(up_pipe[1], F_SETPIPE_SZ, options_.pipe_size);
+  fcntl(down_pipe[1], F_SETPIPE_SZ, options_.pipe_size);
+
+  conn->up.src = conn->client_fd;
+  conn->up.dst = conn->upstream_fd;
+  conn->up.pipe_r = up_pipe[0];
+  conn->up.pipe_w = up_pipe[1];
+  conn->down.src = conn->upstream_fd;
+  conn->down.dst = conn->client_fd;
+  conn->down.pipe_r = down_pipe[0];
+  conn->down.pipe_w = down_pipe[1];
+  // Whatever part of the reply could not be written yet goes out first.
+  conn->down.prefix = std::move(conn->out);
+  conn->out.clear();
+  conn->state = Connection::State::kRelaying;
+  PumpAll(conn);
+}
+
+bool SocksServer::Pump(Direction* dir) {
+  while (!dir->prefix.empty()) {
+    stats_.relay_syscalls++;
+    ssize_t n = send(dir->dst, dir->prefix.data(), dir->prefix.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN;
+    }
+    dir->prefix.erase(0, n);
+  }
+  while (true) {
+    if (dir->pending > 0) {
+      stats_.relay_syscalls++;
+      ssize_t n = splice(dir->pipe_r, nullptr, dir->dst, nullptr, dir->pending,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN;
+      }
+      dir->pending -= n;
+      stats_.bytes_relayed += n;
+      continue;
+    }
+    if (dir->src_eof) {
+      if (!dir->shut) {
+        stats_.relay_syscalls++;
+        shutdown(dir->dst, SHUT_WR);
+        dir->shut = true;
+      }
+      return true;
+    }
+    // The pipe is empty here, so EAGAIN can only mean the source is drained.
+    stats_.relay_syscalls++;
+    ssize_t n = splice(dir->src, nullptr, dir->pipe_w, nullptr, options_.pipe_size,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+      dir->src_eof = true;
+      continue;
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN;
+    }
+    dir->pending += n;
+  }
+}
+
+void SocksServer::PumpAll(Connection* conn) {
+  if (!Pump(&conn->up) || !Pump(&conn->down) ||
+      (conn->up.shut && conn->down.shut)) {
+    CloseConnection(conn);
+  }
+}
+
+bool SocksServer::SendReply(Connection* conn, uint8_t code, const SocketAddress* bound) {
+  // Failures after an early success reply can only be signalled by closing.
+  if (conn->replied) return true;
+  conn->replied = true;
+  conn->out.push_back(static_cast<char>(kSocksVersion));
+  conn->out.push_back(static_cast<char>(code));
+  conn->out.push_back(0);
+  static const uint8_t kAnyV4[4] = {0, 0, 0, 0};
+  AppendAddress(&conn->out, bound ? *bound : SocketAddress{IpAddress::FromV4(kAnyV4), 0});
+  return FlushOutput(conn);
+}
+
+bool SocksServer::FlushOutput(Connection* conn) {
+  while (!conn->out.empty()) {
+    ssize_t n = send(conn->client_fd, conn->out.data(), conn->out.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN;
+    }
+    conn->out.erase(0, n);
+  }
+  return true;
+}
+
+void SocksServer::StartUdpAssociate(Connection* conn) {
+  sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  SocketAddress local;
+  if (getsockname(conn->client_fd, reinterpret_cast<sockaddr*>(&ss), &len) != 0 ||
+      !SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &local)) {
+    SendReply(conn, kReplyGeneralFailure, nullptr);
+    CloseConnection(conn);
+    return;
+  }
+  local.port = 0;
+  auto udp = std::make_unique<UdpAssociation>(options_.udp);
+  if (!udp->client_socket.Bind(local)) {
+    SendReply(conn, kReplyGeneralFailure, nullptr);
+    CloseConnection(conn);
+    return;
+  }
+  SocketAddress bound = udp->client_socket.local_address();
+  if (!udp_in_) {
+    udp_in_ = std::make_unique<UdpBatch>();
+    udp_out_ = std::make_unique<UdpBatch>();
+  }
+
+  udp->control_peer = conn->peer.ip;
+  conn->udp = std::move(udp);
+  conn->state = Connection::State::kUdp;
+  uint64_t id = conn->id;
+  loop_->Add(conn->udp->client_socket.fd(), EventLoop::kReadable,
+             [this, id](uint32_t) { OnUdpClientEvent(id); });
+  if (!SendReply(conn, kReplySucceeded, &bound)) CloseConnection(conn);
+}
+
+void SocksServer::OnUdpClientEvent(uint64_t id) {
+  Connection* conn = Find(id);
+  if (!conn || !conn->udp) return;
+  UdpAssociation* udp = conn->udp.get();
+  UdpBatch* in = udp_in_.get();
+  UdpBatch* out = udp_out_.get();
+  while (udp->client_socket.Receive(in) > 0) {
+    // Bypassed datagrams to known addresses are queued and leave in one
+    // batch per upstream socket.
+    UdpSocket* out_socket = nullptr;
+    out->Clear();
+    auto queue = [&](const SocketAddress& address, const uint8_t* payload, size_t size) {
+      UdpSocket* socket = UpstreamSocket(conn, address.ip.is_v6());
+      if (!socket) {
+        stats_.udp_dropped++;
+        return;
+      }
+      if (socket != out_socket || !out->Add(address, payload, size)) {
+        FlushUdp(out_socket, out);
+        out_socket = socket;
+        out->Add(address, payload, size);
+      }
+    };
+
+    for (size_t i = 0; i < in->size(); i++) {
+      const SocketAddress& from = in->peer(i);
+      const auto* data = static_cast<const uint8_t*>(in->datagram(i).iov_base);
+      size_t n = in->datagram(i).iov_len;
+      if (from.ip != udp->control_peer || (udp->client_known && !(from == udp->client))) {
+        stats_.udp_dropped++;
+        continue;
+      }
+      udp->client = from;
+      udp->client_known = true;
+
+      // RSV(2) FRAG(1) followed by the destination address. Fragmented
+      // datagrams are not supported and are dropped.
+      FlowTarget target;
+      int consumed = n > 3 && data[2] == 0 ? ParseAddress(data + 3, n - 3, &target) : -1;
+      if (consumed <= 0) {
+        stats_.udp_dropped++;
+        continue;
+      }
+      const uint8_t* payload = data + 3 + consumed;
+      size_t payload_size = n - 3 - consumed;
+      stats_.udp_datagrams++;
+
+      FlowTarget decision = target;
+      if (options_.sniff && target.domain.empty() && target.ip.is_valid()) {
+        std::string key = SocketAddress{target.ip, target.port}.ToString();
+        auto sniffed = udp->sniffed.find(key);
+        std::string name;
+        if (sniffed != udp->sniffed.end()) {
+          decision.domain = sniffed->second;
+        } else if (SniffQuicServerName(payload, payload_size, &name) == SniffResult::kFound) {
+          if (udp->sniffed.size() >= kMaxSniffedUdpFlows) udp->sniffed.clear();
+          udp->sniffed[key] = name;
+          decision.domain = name;
+          stats_.sniffed++;
+        }
+      }
+      if (Decide(decision) == RoutingMode::kVpn) {
+        if (options_.dns && target.port == 53 && target.ip.is_valid()) {
+          std::weak_ptr<bool> alive = alive_;
+          SocketAddress resolver{target.ip, target.port};
+          options_.dns->Resolve(payload, payload_size,
+                                [this, id, alive, resolver](const std::string& response) {
+                                  if (!alive.lock() || response.empty()) return;
+                                  Connection* c = Find(id);
+                                  if (!c || !c->udp) return;
+                                  SendUdpToClient(c, resolver, response.data(), response.size());
+                                });
+          continue;
+        }
+        // TunnelConnector only provides streams.
+        stats_.udp_dropped++;
+        continue;
+      }
+      if (target.ip.is_valid()) {
+        queue(SocketAddress{target.ip, target.port}, payload, payload_size);
+        continue;
+      }
+      auto cached = udp->resolved.find(target.domain);
+      if (cached != udp->resolved.end()) {
+        SocketAddress address = cached->second;
+        address.port = target.port;
+        queue(address, payload, payload_size);
+        continue;
+      }
+      if (!resolver_) resolver_ = std::make_unique<Resolver>(loop_);
+      std::weak_ptr<bool> alive = alive_;
+      std::string datagram(reinterpret_cast<const char*>(payload), payload_size);
+      std::string domain = target.domain;
+      resolver_->Resolve(domain, target.port,
+                         [this, id, alive, domain, datagram](bool ok, const SocketAddress& address) {
+                           if (!alive.lock()) return;
+                           Connection* c = Find(id);
+                           if (!c || !c->udp || !ok) return;
+                           c->udp->resolved[domain] = address;
+                           ForwardUdpToTarget(c, address,
+                                              reinterpret_cast<const uint8_t*>(datagram.data()),
+                                              datagram.size());
+                         });
+    }
+    FlushUdp(out_socket, out);
+  }
+}
+
+UdpSocket* SocksServer::UpstreamSocket(Connection* conn, bool v6) {
+  UdpSocket* socket = v6 ? &conn->udp->upstream_v6 : &conn->udp->upstream_v4;
+  if (socket->fd() >= 0) return socket;
+  if (!socket->Open(v6 ? AF_INET6 : AF_INET)) return nullptr;
+  uint64_t id = conn->id;
+  loop_->Add(socket->fd(), EventLoop::kReadable,
+             [this, id, v6](uint32_t) { OnUdpUpstreamEvent(id, v6); });
+  return socket;
+}
+
+size_t SocksServer::FlushUdp(UdpSocket* socket, UdpBatch* batch) {
+  size_t sent = socket && !batch->empty() ? socket->Send(*batch) : 0;
+  stats_.udp_dropped += batch->size() - sent;
+  batch->Clear();
+  return sent;
+}
+
+void SocksServer::ForwardUdpToTarget(Connection* conn, const SocketAddress& target,
+                                     const uint8_t* payload, size_t size) {
+  UdpSocket* socket = UpstreamSocket(conn, target.ip.is_v6());
+  if (!socket || !socket->SendTo(target, payload, size)) stats_.udp_dropped++;
+}
+
+void SocksServer::OnUdpUpstreamEvent(uint64_t id, bool v6) {
+  Connection* conn = Find(id);
+  if (!conn || !conn->udp) return;
+  UdpAssociation* udp = conn->udp.get();
+  UdpSocket* socket = v6 ? &udp->upstream_v6 : &udp->upstream_v4;
+  UdpBatch* in = udp_in_.get();
+  UdpBatch* out = udp_out_.get();
+  std::string header;
+  while (socket->Receive(in) > 0) {
+    if (!udp->client_known) continue;
+    // Replies to the one client address go out together; equally sized ones
+    // from one source become a single segmented send.
+    out->Clear();
+    for (size_t i = 0; i < in->size(); i++) {
+      header.assign(3, '\0');
+      AppendAddress(&header, in->peer(i));
+      size_t size = in->datagram(i).iov_len;
+      uint8_t* packet = out->Append(udp->client, header.size() + size);
+      if (!packet) {
+        stats_.udp_datagrams += FlushUdp(&udp->client_socket, out);
+        packet = out->Append(udp->client, header.size() + size);
+        if (!packet) {
+          stats_.udp_dropped++;
+          continue;
+        }
+      }
+      memcpy(packet, header.data(), header.size());
+      memcpy(packet + header.size(), in->datagram(i).iov_base, size);
+    }
+    stats_.udp_datagrams += FlushUdp(&udp->client_socket, out);
+  }
+}
+
+void SocksServer::SendUdpToClient(Connection* conn, const SocketAddress& from, const char* data,
+                                  size_t size) {
+  UdpAssociation* udp = conn->udp.get();
+  std::string packet(3, '\0');
+  AppendAddress(&packet, from);
+  packet.append(data, size);
+  if (udp->client_socket.SendTo(udp->client, packet.data(), packet.size())) {
+    stats_.udp_datagrams++;
+  } else {
+    stats_.udp_dropped++;
+  }
+}
+
+void SocksServer::CloseConnection(Connection* conn) {
+  if (!conn) return;
+  if (conn->connect_timer) loop_->CancelTimer(conn->connect_timer);
+  if (conn->sniff_timer) loop_->CancelTimer(conn->sniff_timer);
+  if (conn->relay) conn->relay->Stop();
+  for (int* fd : {&conn->client_fd, &conn->upstream_fd}) {
+    if (*fd >= 0) loop_->Remove(*fd);
+    CloseFd(fd);
+  }
+  for (Direction* dir : {&conn->up, &conn->down}) {
+    CloseFd(&dir->pipe_r);
+    CloseFd(&dir->pipe_w);
+  }
+  if (conn->udp) {
+    for (UdpSocket* socket :
+         {&conn->udp->client_socket, &conn->udp->upstream_v4, &conn->udp->upstream_v6}) {
+      if (socket->fd() >= 0) loop_->Remove(socket->fd());
+      socket->Close();
+    }
+  }
+  stats_.active--;
+  connections_.erase(conn->id);
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,186 @@
+#ifndef FLUTTER_PLUGIN_SOCKS_SERVER_H_
+#define FLUTTER_PLUGIN_SOCKS_SERVER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "config_document.h"
+#include "dns_forwarder.h"
+#include "domain_table.h"
+#include "event_loop.h"
+#include "net_address.h"
+#include "routing_policy.h"
+#include "udp_socket.h"
+#include "uring_relay.h"
+
+namespace vpn_plugin {
+
+// Opens streams through the VPN endpoint for flows the routing policy sends
+// to the tunnel.
+class TunnelConnector {
+ public:
+  virtual ~TunnelConnector() = default;
+  // Returns a non-blocking stream fd that is connected, or connecting, to
+  // |target| through the endpoint; -1 if the flow cannot be tunnelled.
+  virtual int Open(const FlowTarget& target) = 0;
+};
+
+struct SocksServerOptions {
+  SocketAddress listen_address;
+  // Username/password authentication (RFC 1929) is required when set.
+  std::string username;
+  std::string password;
+  // Without a policy every flow bypasses the endpoint.
+  std::shared_ptr<const RoutingPolicy> policy;
+  // Without a connector, flows routed to the VPN are refused.
+  TunnelConnector* tunnel = nullptr;
+  // Answers UDP datagrams to port 53 that are routed to the VPN; without
+  // it they are dropped like other VPN-routed UDP.
+  DnsForwarder* dns = nullptr;
+  // Supplies the domain of address-only targets to the routing policy.
+  const DomainTable* domains = nullptr;
+  // Routes CONNECTs to bare addresses by the TLS server name or HTTP Host
+  // in the client's first bytes, and UDP by the server name in QUIC
+  // Initials. Streams are answered with success before the upstream is
+  // chosen and wait at most sniff_timeout_ms for those bytes. Only used when
+  // the policy has domain rules.
+  bool sniff = false;
+  int sniff_timeout_ms = 300;
+  int pipe_size = 256 * 1024;
+  // Used instead of the splice relay, with a multishot accept, when the
+  // loop runs the io_uring backend.
+  UringRelayOptions uring;
+  // I/O of the UDP ASSOCIATE sockets.
+  UdpSocketOptions udp;
+  int connect_timeout_ms = 10000;
+  // Sets SO_REUSEPORT, so servers on several loops can listen on one
+  // address and have the kernel spread connections among them.
+  bool reuse_port = false;
+
+  // Reads the [listener.socks] section. Returns false if it is missing or
+  // the address is malformed.
+  static bool FromConfig(const ConfigDocument& config, SocksServerOptions* out);
+};
+
+struct SocksServerStats {
+  std::atomic<uint64_t> accepted{0};
+  std::atomic<uint64_t> active{0};
+  std::atomic<uint64_t> bypass_flows{0};
+  std::atomic<uint64_t> vpn_flows{0};
+  std::atomic<uint64_t> rejected{0};
+  std::atomic<uint64_t> bytes_relayed{0};
+  // splice(), send() and shutdown() calls of the epoll relay. The io_uring
+  // relay's work is counted by EventLoop::syscalls().
+  std::atomic<uint64_t> relay_syscalls{0};
+  std::atomic<uint64_t> udp_datagrams{0};
+  std::atomic<uint64_t> udp_dropped{0};
+  // Flows routed by a sniffed domain.
+  std::atomic<uint64_t> sniffed{0};
+};
+
+// SOCKS5 listener (RFC 1928) with CONNECT and UDP ASSOCIATE. TCP payload is
+// moved between the client and upstream sockets with splice() through a
+// pipe per direction, so relayed bytes never enter user space, or by a
+// UringRelay on io_uring loops. Datagrams move through UdpSockets in
+// batches, one per wakeup in each direction.
+class SocksServer {
+ public:
+  SocksServer(EventLoop* loop, SocksServerOptions options);
+  ~SocksServer();
+
+  SocksServer(const SocksServer&) = delete;
+  SocksServer& operator=(const SocksServer&) = delete;
+
+  // Binds and starts accepting. Must be called on the loop thread, or
+  // before the loop starts running.
+  bool Listen();
+  void Close();
+
+  // Routes flows from now on by |policy|. Flows already relayed keep the
+  // upstream they have. Must be called on the loop thread.
+  void set_policy(std::shared_ptr<const RoutingPolicy> policy) {
+    options_.policy = std::move(policy);
+  }
+
+  SocketAddress local_address() const { return local_address_; }
+  int listen_fd() const { return listen_fd_; }
+  const SocksServerStats& stats() const { return stats_; }
+
+ private:
+  struct Connection;
+  struct Direction;
+  struct UdpAssociation;
+  class Resolver;
+
+  void OnAcceptable();
+  void ArmAccept();
+  void AdoptClient(int fd, const SocketAddress& peer);
+  void OnClientEvent(uint64_t id, uint32_t events);
+  void OnUpstreamEvent(uint64_t id, uint32_t events);
+  void OnUdpClientEvent(uint64_t id);
+  void OnUdpUpstreamEvent(uint64_t id, bool v6);
+  void SendUdpToClient(Connection* conn, const SocketAddress& from, const char* data,
+                       size_t size);
+
+  bool ReadHandshake(Connection* conn);
+  bool HandleGreeting(Connection* conn);
+  bool HandleAuth(Connection* conn);
+  bool HandleRequest(Connection* conn);
+  bool ShouldSniff(const FlowTarget& target) const;
+  // Routes once enough early data is there. Returns false if the connection
+  // should be closed.
+  bool ContinueSniffing(Connection* conn);
+  // Picks the upstream for a CONNECT; |sniffed| is the domain found in the
+  // client's first bytes, if any. Returns false if the connection should be
+  // closed.
+  bool RouteRequest(Connection* conn, const std::string& sniffed);
+  bool ReadEarlyData(Connection* conn);
+  // Returns false if the connection should be closed.
+  bool StartConnect(Connection* conn, const SocketAddress& address);
+  // Takes |fd|, connected or connecting, as the upstream: waits for it to
+  // be writable, with the connect timeout. Returns false if the connection
+  // should be closed, which closes |fd| too.
+  bool WatchConnect(Connection* conn, int fd);
+  void StartUdpAssociate(Connection* conn);
+  void OnResolved(uint64_t id, bool ok, const SocketAddress& address);
+  void OnConnected(Connection* conn);
+  void StartRelay(Connection* conn);
+  bool Pump(Direction* dir);
+  void PumpAll(Connection* conn);
+
+  bool SendReply(Connection* conn, uint8_t code, const SocketAddress* bound);
+  bool FlushOutput(Connection* conn);
+  void ForwardUdpToTarget(Connection* conn, const SocketAddress& target,
+                          const uint8_t* payload, size_t size);
+  // Opens the association's upstream socket for the family on first use.
+  UdpSocket* UpstreamSocket(Connection* conn, bool v6);
+  // Sends and clears |batch|; returns how many datagrams left.
+  size_t FlushUdp(UdpSocket* socket, UdpBatch* batch);
+  void CloseConnection(Connection* conn);
+  Connection* Find(uint64_t id);
+  RoutingMode Decide(const FlowTarget& target) const;
+
+  EventLoop* loop_;
+  SocksServerOptions options_;
+  int listen_fd_ = -1;
+  SocketAddress local_address_;
+  uint64_t next_id_ = 1;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+  std::unique_ptr<Resolver> resolver_;
+  std::shared_ptr<UringRelayPool> uring_pool_;
+  uint64_t accept_token_ = 0;
+  // Shared by all UDP associations of the loop, allocated with the first.
+  std::unique_ptr<UdpBatch> udp_in_;
+  std::unique_ptr<UdpBatch> udp_out_;
+  // Lets resolver callbacks that outlive the server detect it is gone.
+  std::shared_ptr<bool> alive_;
+  SocksServerStats stats_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_SOCKS_SERVER_H_
@@ -0,0 +1,136 @@
+#include "socks_shards.h"
+
+#include <linux/filter.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <utility>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr int64_t kMaxShards = 256;
+
+// Hands each connection to the shard pinned to the CPU that received it,
+// or picks by CPU number modulo the shard count on CPUs without a shard.
+// Returns false if the kernel refuses the program; the 4-tuple hash then
+// stays in use.
+bool AttachCpuSteering(int fd, const std::vector<int>& shard_cpus) {
+  std::vector<sock_filter> code;
+  code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+  for (size_t i = 0; i < shard_cpus.size(); i++) {
+    uint32_t cpu = static_cast<uint32_t>(shard_cpus[i]);
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+  }
+  code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(shard_cpus.size())));
+  code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+  sock_fprog program = {static_cast<unsigned short>(code.size()), code.data()};
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+}
+
+}  // namespace
+
+std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) cpus.push_back(0);
+  return cpus;
+}
+
+SocksShardOptions SocksShardOptions::FromConfig(const ConfigDocument& config) {
+  const char* kSection = "listener.socks";
+  SocksShardOptions options;
+  int64_t shards = config.GetInt(kSection, "shards", static_cast<int64_t>(options.shards));
+  if (shards >= 0 && shards <= kMaxShards) options.shards = static_cast<size_t>(shards);
+  options.pin_cpus = config.GetBool(kSection, "pin_cpus", options.pin_cpus);
+  options.steer_by_cpu = config.GetBool(kSection, "steer_by_cpu", options.steer_by_cpu);
+  // io_uring is opt-in; the loops fall back to epoll where the kernel
+  // lacks it.
+  options.backend = config.GetString(kSection, "io_backend", "epoll") == "io_uring"
+                        ? EventLoopBackend::kIoUring
+                        : EventLoopBackend::kEpoll;
+  return options;
+}
+
+SocksShardGroup::SocksShardGroup(SocksShardOptions options, SocksServerOptions server_options,
+                                 ShardSetup setup)
+    : options_(options), server_options_(std::move(server_options)), setup_(std::move(setup)) {}
+
+SocksShardGroup::~SocksShardGroup() { Stop(); }
+
+bool SocksShardGroup::Start() {
+  if (!shards_.empty()) return true;
+  std::vector<int> cpus = AllowedCpus();
+  size_t count = options_.shards ? options_.shards : cpus.size();
+  local_address_ = server_options_.listen_address;
+  for (size_t i = 0; i < count; i++) {
+    auto shard = std::make_unique<Shard>(options_.backend);
+    SocksServerOptions server_options = server_options_;
+    server_options.listen_address = local_address_;
+    server_options.reuse_port = count > 1;
+    if (setup_) shard->teardown = setup_(i, shard->thread.loop(), &server_options);
+    shard->server = std::make_unique<SocksServer>(shard->thread.loop(), server_options);
+    bool listening = shard->server->Listen();
+    // The first listener settles the port when it was left to the kernel.
+    if (i == 0) local_address_ = shard->server->local_address();
+    shards_.push_back(std::move(shard));
+    if (!listening) {
+      Stop();
+      return false;
+    }
+  }
+
+  std::vector<int> shard_cpus;
+  for (size_t i = 0; i < count; i++) shard_cpus.push_back(cpus[i % cpus.size()]);
+  if (options_.steer_by_cpu && options_.pin_cpus && count > 1) {
+    // The program is shared by the whole reuseport group, and its result
+    // indexes the listeners in the order they were bound.
+    steering_by_cpu_ = AttachCpuSteering(shards_[0]->server->listen_fd(), shard_cpus);
+  }
+  for (size_t i = 0; i < count; i++) {
+    shards_[i]->thread.Start(options_.pin_cpus && count > 1 ? shard_cpus[i] : -1);
+  }
+  return true;
+}
+
+void SocksShardGroup::Stop() {
+  for (auto& shard : shards_) {
+    Shard* s = shard.get();
+    s->thread.RunSync([s]() {
+      s->server.reset();
+      if (s->teardown) s->teardown();
+    });
+    s->thread.Stop();
+  }
+  shards_.clear();
+  steering_by_cpu_ = false;
+}
+
+void SocksShardGroup::SetPolicy(std::shared_ptr<const RoutingPolicy> policy) {
+  server_options_.policy = policy;
+  for (auto& shard : shards_) {
+    SocksServer* server = shard->server.get();
+    // Stop() runs its teardown after this task, so the server is alive.
+    shard->thread.loop()->Post([server, policy]() { server->set_policy(policy); });
+  }
+}
+
+std::vector<uint64_t> SocksShardGroup::accepted() const {
+  std::vector<uint64_t> accepted;
+  for (const auto& shard : shards_) accepted.push_back(shard->server->stats().accepted.load());
+  return accepted;
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,98 @@
+#ifndef FLUTTER_PLUGIN_SOCKS_SHARDS_H_
+#define FLUTTER_PLUGIN_SOCKS_SHARDS_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "config_document.h"
+#include "event_loop.h"
+#include "net_address.h"
+#include "socks_server.h"
+
+namespace vpn_plugin {
+
+struct SocksShardOptions {
+  // Loop threads, each with its own listener; 0 means one per CPU the
+  // process may run on.
+  size_t shards = 1;
+  EventLoopBackend backend = EventLoopBackend::kEpoll;
+  // Pins shard i to the i-th CPU the process may run on.
+  bool pin_cpus = true;
+  // Attaches a classic BPF program to the listeners that hands each
+  // connection to the shard on the CPU that received it, instead of the
+  // kernel's hash of the 4-tuple. Ignored without pin_cpus, as unpinned
+  // shards run on any CPU; only useful when receive steering spreads
+  // connections over the pinned ones.
+  bool steer_by_cpu = false;
+
+  // Reads `shards`, `pin_cpus`, `steer_by_cpu` and `io_backend` from
+  // [listener.socks].
+  static SocksShardOptions FromConfig(const ConfigDocument& config);
+};
+
+// Runs the SOCKS listener on several loop threads at once. Every shard has
+// its own SocksServer bound to the same address with SO_REUSEPORT, so the
+// kernel picks the shard of each connection and everything about the flow,
+// UDP associations included, stays on that shard's thread. Shards share
+// only read-only state such as the routing policy; a setup hook gives each
+// its own upstream objects.
+class SocksShardGroup {
+ public:
+  // Called for each shard before its loop runs, to create the objects its
+  // server uses on |loop| and point |options| at them. Returns the task
+  // that destroys them; it runs on the loop thread after the server is
+  // gone.
+  using ShardSetup =
+      std::function<EventLoop::Task(size_t shard, EventLoop* loop, SocksServerOptions* options)>;
+
+  SocksShardGroup(SocksShardOptions options, SocksServerOptions server_options,
+                  ShardSetup setup = nullptr);
+  ~SocksShardGroup();
+
+  SocksShardGroup(const SocksShardGroup&) = delete;
+  SocksShardGroup& operator=(const SocksShardGroup&) = delete;
+
+  // Listens on every shard and starts their threads. Returns false, with
+  // nothing running, if any listener fails.
+  bool Start();
+  void Stop();
+  // Hands |policy| to every shard's loop, which routes new flows by it
+  // once the swap is through. Not safe against a concurrent Start() or
+  // Stop(), or another SetPolicy(): callers on several threads serialize
+  // these calls themselves, and the last call made wins.
+  void SetPolicy(std::shared_ptr<const RoutingPolicy> policy);
+
+  size_t size() const { return shards_.size(); }
+  // Address the shards listen on, with the port chosen if it was 0.
+  SocketAddress local_address() const { return local_address_; }
+  const SocksServer* server(size_t shard) const { return shards_[shard]->server.get(); }
+  EventLoop* loop(size_t shard) { return shards_[shard]->thread.loop(); }
+  // Connections accepted per shard, to check how they are spread.
+  std::vector<uint64_t> accepted() const;
+  // Whether the listeners hand connections out by receiving CPU.
+  bool steering_by_cpu() const { return steering_by_cpu_; }
+
+ private:
+  struct Shard {
+    explicit Shard(EventLoopBackend backend) : thread(backend) {}
+    LoopThread thread;
+    std::unique_ptr<SocksServer> server;
+    EventLoop::Task teardown;
+  };
+
+  SocksShardOptions options_;
+  SocksServerOptions server_options_;
+  ShardSetup setup_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  SocketAddress local_address_;
+  bool steering_by_cpu_ = false;
+};
+
+// CPUs the calling process may run on, in ascending order.
+std::vector<int> AllowedCpus();
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_SOCKS_SHARDS_H_
@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "config_document.h"
+
+namespace vpn_plugin {
+namespace test {
+
+TEST(BufferPool, SizesThePacketClassFromTheMtu) {
+  ConfigDocument config;
+  std::string error;
+  ASSERT_TRUE(ConfigDocument::Parse("[listener.tun]\nmtu_size = 9000\n", &config, &error));
+  EXPECT_EQ(BufferPoolOptions::FromConfig(config).packet_size, 9152u);
+
+  BufferPoolOptions options;
+  options.packet_size = 1500;
+  BufferPool pool(options);
+  void* packet = pool.Allocate(1400);
+  void* chunk = pool.Allocate(1600);
+  ASSERT_NE(packet, nullptr);
+  ASSERT_NE(chunk, nullptr);
+  EXPECT_EQ(BufferPool::BlockSize(packet), 1536u);
+  EXPECT_EQ(BufferPool::BlockSize(chunk), BufferPool::kChunkSize);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(packet) % 64, 0u);
+  EXPECT_EQ(pool.Allocate(BufferPool::kChunkSize + 1), nullptr);
+  BufferPool::Free(packet);
+  BufferPool::Free(chunk);
+}
+
+TEST(BufferPool, ReusesFreedBlocksAndStopsAtMaxBytes) {
+  BufferPoolOptions options;
+  options.max_bytes = BufferPool::kSlabSize;
+  BufferPool pool(options);
+  std::vector<void*> chunks;
+  while (void* chunk = pool.Allocate(BufferPool::kChunkSize)) chunks.push_back(chunk);
+  // One slab, less its header.
+  EXPECT_EQ(chunks.size(), 31u);
+  BufferPoolStats stats = pool.stats();
+  EXPECT_EQ(stats.slabs, 1u);
+  EXPECT_EQ(stats.failures, 1u);
+  EXPECT_EQ(stats.in_use, 31u);
+  // The packet class needs a slab of its own.
+  EXPECT_EQ(pool.Allocate(100), nullptr);
+
+  BufferPool::Free(chunks.back());
+  EXPECT_EQ(pool.Allocate(BufferPool::kChunkSize), chunks.back());
+  for (void* chunk : chunks) BufferPool::Free(chunk);
+  stats = pool.stats();
+  EXPECT_EQ(stats.in_use, 0u);
+  EXPECT_EQ(stats.peak_in_use, 31u);
+}
+
+TEST(BufferPool, TakesBackBlocksFreedOnOtherThreads) {
+  BufferPoolOptions options;
+  options.max_bytes = BufferPool::kSlabSize;
+  BufferPool pool(options);
+  std::vector<void*> chunks;
+  while (void* chunk = pool.Allocate(BufferPool::kChunkSize)) chunks.push_back(chunk);
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; t++) {
+    threads.emplace_back([&chunks, t] {
+      for (size_t i = t; i < chunks.size(); i += 4) BufferPool::Free(chunks[i]);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(pool.stats().remote_frees, chunks.size());
+
+  // The pool is full, so every block must come back from the remote list.
+  for (size_t i = 0; i < chunks.size(); i++) {
+    EXPECT_NE(pool.Allocate(BufferPool::kChunkSize), nullptr) << i;
+  }
+  EXPECT_EQ(pool.stats().slabs, 1u);
+  EXPECT_EQ(pool.stats().in_use, chunks.size());
+}
+
+TEST(BufferPool, OutlivesItsThreadUntilTheLastFree) {
+  PooledBuffer survivor;
+  std::thread thread([&survivor] {
+    BufferPool* pool = BufferPool::ForThread();
+    EXPECT_EQ(BufferPool::ForThread(), pool);
+    PooledBuffer scratch(pool, 100);
+    survivor = PooledBuffer(pool, 100);
+    ASSERT_TRUE(survivor);
+  });
+  thread.join();
+  // The pool and its slab are still mapped; freeing deletes them.
+  memset(survivor.data(), 0xab, 100);
+  survivor.reset();
+}
+
+TEST(ChunkQueue, SpansChunksAndReturnsThemWhenDrained) {
+  BufferPool pool;
+  ChunkQueue queue(&pool);
+  std::string data(BufferPool::kChunkSize * 2 + 100, '\0');
+  for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<char>(i * 7);
+  ASSERT_TRUE(queue.Append(data.data(), 1000));
+  ASSERT_TRUE(queue.Append(data.data() + 1000, data.size() - 1000));
+  EXPECT_EQ(queue.size(), data.size());
+  EXPECT_EQ(pool.stats().in_use, 3u);
+
+  std::string out;
+  while (!queue.empty()) {
+    size_t n = std::min<size_t>(queue.front_size(), 5000);
+    out.append(queue.front(), n);
+    queue.Consume(n);
+  }
+  EXPECT_EQ(out, data);
+  EXPECT_EQ(pool.stats().in_use, 0u);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,163 @@
+#ifndef FLUTTER_PLUGIN_TEST_CLIENT_HELLO_BUILDER_H_
+#define FLUTTER_PLUGIN_TEST_CLIENT_HELLO_BUILDER_H_
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vpn_plugin {
+namespace test {
+
+// The first flight of a real OpenSSL client: one TLS record holding the
+// ClientHello, with |server_name| in SNI unless it is empty.
+inline std::string BuildTlsClientHello(const std::string& server_name) {
+  SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+  SSL* ssl = SSL_new(ctx);
+  BIO* in = BIO_new(BIO_s_mem());
+  BIO* out = BIO_new(BIO_s_mem());
+  SSL_set_bio(ssl, in, out);
+  SSL_set_connect_state(ssl);
+  if (!server_name.empty()) SSL_set_tlsext_host_name(ssl, server_name.c_str());
+  SSL_do_handshake(ssl);
+  std::string hello;
+  char buffer[4096];
+  int n;
+  while ((n = BIO_read(out, buffer, sizeof(buffer))) > 0) hello.append(buffer, n);
+  SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  return hello;
+}
+
+// Re-frames the handshake bytes of |records| into records of at most
+// |record_size| payload bytes.
+inline std::string SplitTlsRecords(const std::string& records, size_t record_size) {
+  std::string handshake = records.substr(5);
+  std::string out;
+  for (size_t offset = 0; offset < handshake.size(); offset += record_size) {
+    std::string chunk = handshake.substr(offset, record_size);
+    out += records.substr(0, 3);
+    out.push_back(static_cast<char>(chunk.size() >> 8));
+    out.push_back(static_cast<char>(chunk.size()));
+    out += chunk;
+  }
+  return out;
+}
+
+// The client Initial keys for destination connection id 8394c8f03e515708,
+// from RFC 9001 appendix A.1 and RFC 9369 appendix A.1.
+struct QuicTestKeys {
+  uint8_t key[16];
+  uint8_t iv[12];
+  uint8_t hp[16];
+};
+
+inline QuicTestKeys QuicInitialTestKeys(uint32_t version) {
+  static const QuicTestKeys kV1 = {
+      {0x1f, 0x36, 0x96, 0x13, 0xdd, 0x76, 0xd5, 0x46, 0x77, 0x30, 0xef, 0xcb, 0xe3, 0xb1, 0xa2,
+       0x2d},
+      {0xfa, 0x04, 0x4b, 0x2f, 0x42, 0xa3, 0xfd, 0x3b, 0x46, 0xfb, 0x25, 0x5c},
+      {0x9f, 0x50, 0x44, 0x9e, 0x04, 0xa0, 0xe8, 0x10, 0x28, 0x3a, 0x1e, 0x99, 0x33, 0xad, 0xed,
+       0xd2}};
+  static const QuicTestKeys kV2 = {
+      {0x8b, 0x1a, 0x0b, 0xc1, 0x21, 0x28, 0x42, 0x90, 0xa2, 0x9e, 0x09, 0x71, 0xb5, 0xcd, 0x04,
+       0x5d},
+      {0x91, 0xf7, 0x3e, 0x23, 0x51, 0xd8, 0xfa, 0x91, 0x66, 0x0e, 0x90, 0x9f},
+      {0x45, 0xb9, 0x5e, 0x15, 0x23, 0x5d, 0x6f, 0x45, 0xa6, 0xb1, 0x9c, 0xbc, 0xb0, 0x29, 0x4b,
+       0xa9}};
+  return version == 0x6b3343cf ? kV2 : kV1;
+}
+
+struct QuicInitialSpec {
+  uint32_t version = 1;
+  // CRYPTO frames as (stream offset, data), in packet order.
+  std::vector<std::pair<uint64_t, std::string>> crypto;
+  uint32_t packet_number = 2;
+  // Padded with PADDING frames up to this datagram size.
+  size_t datagram_size = 1200;
+};
+
+inline void AppendQuicVarint(std::string* out, uint64_t value) {
+  if (value < 64) {
+    out->push_back(static_cast<char>(value));
+  } else if (value < 16384) {
+    out->push_back(static_cast<char>(0x40 | value >> 8));
+    out->push_back(static_cast<char>(value));
+  } else {
+    out->push_back(static_cast<char>(0x80 | value >> 24));
+    out->push_back(static_cast<char>(value >> 16));
+    out->push_back(static_cast<char>(value >> 8));
+    out->push_back(static_cast<char>(value));
+  }
+}
+
+// A protected client Initial packet as described in RFC 9001 section 5.
+inline std::string BuildQuicInitial(const QuicInitialSpec& spec) {
+  static const uint8_t kDcid[8] = {0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08};
+  constexpr size_t kPnLength = 4;
+  std::string payload;
+  for (const auto& frame : spec.crypto) {
+    payload.push_back(0x06);
+    AppendQuicVarint(&payload, frame.first);
+    AppendQuicVarint(&payload, frame.second.size());
+    payload += frame.second;
+  }
+  bool v2 = spec.version == 0x6b3343cf;
+  std::string header;
+  header.push_back(static_cast<char>(0xc0 | (v2 ? 0x10 : 0x00) | (kPnLength - 1)));
+  for (int shift : {24, 16, 8, 0}) header.push_back(static_cast<char>(spec.version >> shift));
+  header.push_back(8);
+  header.append(reinterpret_cast<const char*>(kDcid), 8);
+  header.push_back(0);  // Source connection id.
+  header.push_back(0);  // Token.
+  // Two-byte length field, then the packet number.
+  size_t fixed = header.size() + 2 + kPnLength + 16;
+  if (spec.datagram_size > fixed + payload.size()) {
+    payload.resize(spec.datagram_size - fixed, '\0');
+  }
+  size_t length = kPnLength + payload.size() + 16;
+  header.push_back(static_cast<char>(0x40 | length >> 8));
+  header.push_back(static_cast<char>(length));
+  size_t pn_offset = header.size();
+  for (int shift : {24, 16, 8, 0}) header.push_back(static_cast<char>(spec.packet_number >> shift));
+
+  QuicTestKeys keys = QuicInitialTestKeys(spec.version);
+  uint8_t nonce[12];
+  memcpy(nonce, keys.iv, sizeof(nonce));
+  for (int i = 0; i < 4; i++) nonce[11 - i] ^= static_cast<uint8_t>(spec.packet_number >> (8 * i));
+  std::string ciphertext(payload.size() + 16, '\0');
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  int n = 0;
+  EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), nullptr, nullptr, nullptr);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sizeof(nonce), nullptr);
+  EVP_EncryptInit_ex(ctx, nullptr, nullptr, keys.key, nonce);
+  EVP_EncryptUpdate(ctx, nullptr, &n, reinterpret_cast<const uint8_t*>(header.data()),
+                    static_cast<int>(header.size()));
+  EVP_EncryptUpdate(ctx, reinterpret_cast<uint8_t*>(&ciphertext[0]), &n,
+                    reinterpret_cast<const uint8_t*>(payload.data()),
+                    static_cast<int>(payload.size()));
+  EVP_EncryptFinal_ex(ctx, reinterpret_cast<uint8_t*>(&ciphertext[n]), &n);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, &ciphertext[payload.size()]);
+  EVP_CIPHER_CTX_free(ctx);
+
+  std::string packet = header + ciphertext;
+  uint8_t mask[16];
+  ctx = EVP_CIPHER_CTX_new();
+  EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), nullptr, keys.hp, nullptr);
+  EVP_EncryptUpdate(ctx, mask, &n, reinterpret_cast<const uint8_t*>(&packet[pn_offset + 4]), 16);
+  EVP_CIPHER_CTX_free(ctx);
+  packet[0] = static_cast<char>(packet[0] ^ (mask[0] & 0x0f));
+  for (size_t i = 0; i < kPnLength; i++) {
+    packet[pn_offset + i] = static_cast<char>(packet[pn_offset + i] ^ mask[1 + i]);
+  }
+  return packet;
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TEST_CLIENT_HELLO_BUILDER_H_
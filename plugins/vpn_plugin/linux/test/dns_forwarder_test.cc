@@ -0,0 +1,323 @@
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config_document.h"
+#include "dns_cache.h"
+#include "dns_forwarder.h"
+#include "dns_message.h"
+#include "test/dns_test_server.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+DnsQuestion Question(const std::string& name, uint16_t type = kDnsTypeA) {
+  DnsQuestion question;
+  question.name = name;
+  question.type = type;
+  question.klass = kDnsClassIn;
+  return question;
+}
+
+// Response to |question| with one A record per TTL in |ttls|.
+std::string Answer(uint16_t id, const DnsQuestion& question, const std::vector<uint32_t>& ttls) {
+  std::string out = BuildDnsQuery(id, question);
+  out[2] = static_cast<char>(0x81);
+  out[3] = static_cast<char>(0x80);
+  out[7] = static_cast<char>(ttls.size());
+  for (uint32_t ttl : ttls) {
+    out += std::string("\xc0\x0c\x00\x01\x00\x01", 6);
+    for (int shift : {24, 16, 8, 0}) out.push_back(static_cast<char>(ttl >> shift));
+    out += std::string("\x00\x04\x0a\x00\x00\x01", 6);
+  }
+  return out;
+}
+
+DnsMessage Parse(const std::string& wire) {
+  DnsMessage message;
+  EXPECT_TRUE(
+      DnsMessage::Parse(reinterpret_cast<const uint8_t*>(wire.data()), wire.size(), &message));
+  return message;
+}
+
+uint32_t FirstTtl(const std::string& wire) { return Parse(wire).answers.at(0).ttl; }
+
+class DnsForwarderTest : public ::testing::Test {
+ protected:
+  void CreateForwarder(std::vector<SocketAddress> upstreams,
+                       DnsForwarderOptions options = DnsForwarderOptions()) {
+    options.upstreams = std::move(upstreams);
+    forwarder_ = std::make_unique<DnsForwarder>(&loop_, options);
+    ASSERT_TRUE(forwarder_->Start());
+  }
+
+  // Resolves |name| and runs the loop until the answer arrives.
+  DnsMessage Resolve(const std::string& name, uint16_t type = kDnsTypeA) {
+    std::string query = BuildDnsQuery(0x1234, Question(name, type));
+    std::string response;
+    bool done = false;
+    forwarder_->Resolve(reinterpret_cast<const uint8_t*>(query.data()), query.size(),
+                        [&](const std::string& answer) {
+                          response = answer;
+                          done = true;
+                        });
+    RunUntil([&]() { return done; });
+    EXPECT_TRUE(done);
+    DnsMessage message = Parse(response);
+    EXPECT_EQ(message.id, 0x1234);
+    return message;
+  }
+
+  bool RunUntil(const std::function<bool()>& done, int timeout_ms = 5000) {
+    int64_t deadline = EventLoop::NowMs() + timeout_ms;
+    while (!done()) {
+      if (EventLoop::NowMs() > deadline) return false;
+      loop_.RunOnce(10);
+    }
+    return true;
+  }
+
+  EventLoop loop_;
+  std::unique_ptr<DnsForwarder> forwarder_;
+};
+
+}  // namespace
+
+TEST(DnsMessage, ParsesCompressedNames) {
+  std::string wire = Answer(7, Question("WWW.Example.com"), {300, 60});
+  DnsMessage message = Parse(wire);
+  EXPECT_TRUE(message.is_response());
+  ASSERT_EQ(message.questions.size(), 1u);
+  EXPECT_EQ(message.questions[0].name, "www.example.com");
+  ASSERT_EQ(message.answers.size(), 2u);
+  EXPECT_EQ(message.answers[1].name, "www.example.com");
+  EXPECT_EQ(message.answers[1].ttl, 60u);
+
+  uint32_t ttl = 0;
+  bool negative = true;
+  ASSERT_TRUE(DnsCacheLifetime(reinterpret_cast<const uint8_t*>(wire.data()), message, &ttl,
+                               &negative));
+  EXPECT_EQ(ttl, 60u);
+  EXPECT_FALSE(negative);
+
+  // A pointer to itself must not hang the parser.
+  std::string loop = BuildDnsQuery(1, Question("a"));
+  loop.resize(kDnsHeaderSize);
+  loop += std::string("\xc0\x0c\x00\x01\x00\x01", 6);
+  DnsMessage bad;
+  EXPECT_FALSE(
+      DnsMessage::Parse(reinterpret_cast<const uint8_t*>(loop.data()), loop.size(), &bad));
+}
+
+TEST(DnsCache, CountsDownTtlsAndServesStale) {
+  DnsCacheOptions options;
+  options.max_stale = 60;
+  options.stale_answer_ttl = 30;
+  DnsCache cache(options);
+  DnsQuestion question = Question("example.com");
+  std::string key = DnsCache::Key(question);
+  std::string wire = Answer(1, question, {100});
+  ASSERT_TRUE(cache.Insert(key, wire, Parse(wire), 0));
+
+  std::string response;
+  bool refresh = false;
+  ASSERT_EQ(cache.Find(key, 42, 40 * 1000, &response, &refresh), DnsCache::Result::kFresh);
+  EXPECT_EQ(Parse(response).id, 42);
+  EXPECT_EQ(FirstTtl(response), 60u);
+  EXPECT_FALSE(refresh);
+
+  ASSERT_EQ(cache.Find(key, 1, 120 * 1000, &response, &refresh), DnsCache::Result::kStale);
+  EXPECT_EQ(FirstTtl(response), 30u);
+  EXPECT_TRUE(refresh);
+  // A refresh is only handed out once.
+  cache.Find(key, 1, 121 * 1000, &response, &refresh);
+  EXPECT_FALSE(refresh);
+
+  EXPECT_EQ(cache.Find(key, 1, 161 * 1000, &response, &refresh), DnsCache::Result::kMiss);
+  EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST(DnsCache, PrefetchesPopularNamesBeforeExpiry) {
+  DnsCacheOptions options;
+  options.prefetch_hits = 3;
+  options.prefetch_percent = 10;
+  DnsCache cache(options);
+  DnsQuestion question = Question("popular.example");
+  std::string key = DnsCache::Key(question);
+  std::string wire = Answer(1, question, {100});
+  cache.Insert(key, wire, Parse(wire), 0);
+
+  std::string response;
+  bool refresh = false;
+  cache.Find(key, 1, 1000, &response, &refresh);
+  cache.Find(key, 1, 2000, &response, &refresh);
+  EXPECT_FALSE(refresh);
+  // Popular, but most of the lifetime is left.
+  cache.Find(key, 1, 50 * 1000, &response, &refresh);
+  EXPECT_FALSE(refresh);
+  cache.Find(key, 1, 95 * 1000, &response, &refresh);
+  EXPECT_TRUE(refresh);
+
+  DnsQuestion rare = Question("rare.example");
+  std::string rare_wire = Answer(1, rare, {100});
+  cache.Insert(DnsCache::Key(rare), rare_wire, Parse(rare_wire), 0);
+  cache.Find(DnsCache::Key(rare), 1, 95 * 1000, &response, &refresh);
+  EXPECT_FALSE(refresh);
+}
+
+TEST(DnsCache, EvictsLeastRecentlyUsedPerShard) {
+  DnsCacheOptions options;
+  options.capacity = 2;
+  options.shards = 1;
+  DnsCache cache(options);
+  std::vector<std::string> keys;
+  for (const char* name : {"a.test", "b.test", "c.test"}) {
+    DnsQuestion question = Question(name);
+    std::string wire = Answer(1, question, {100});
+    keys.push_back(DnsCache::Key(question));
+    cache.Insert(keys.back(), wire, Parse(wire), 0);
+    if (keys.size() == 2) {
+      std::string response;
+      bool refresh;
+      cache.Find(keys[0], 1, 0, &response, &refresh);
+    }
+  }
+  std::string response;
+  bool refresh;
+  EXPECT_EQ(cache.Find(keys[0], 1, 0, &response, &refresh), DnsCache::Result::kFresh);
+  EXPECT_EQ(cache.Find(keys[1], 1, 0, &response, &refresh), DnsCache::Result::kMiss);
+  EXPECT_EQ(cache.Find(keys[2], 1, 0, &response, &refresh), DnsCache::Result::kFresh);
+}
+
+TEST(DnsForwarderOptions, ReadsPlainUpstreams) {
+  ConfigDocument config;
+  ASSERT_TRUE(ConfigDocument::Parse(
+      "dns_upstreams = [\"8.8.8.8:53\", \"tls://1.1.1.1\", \"9.9.9.9\", "
+      "\"https://dns.adguard.com/dns-query\", \"[2606:4700::1111]:53\"]\n",
+      &config, nullptr));
+  DnsForwarderOptions options;
+  ASSERT_TRUE(DnsForwarderOptions::FromConfig(config, &options, nullptr));
+  ASSERT_EQ(options.upstreams.size(), 3u);
+  EXPECT_EQ(options.upstreams[1].ToString(), "9.9.9.9:53");
+}
+
+TEST_F(DnsForwarderTest, CachesAnswersAndNegativeAnswers) {
+  DnsTestServer upstream;
+  CreateForwarder({upstream.address()});
+  DnsMessage first = Resolve("www.example.com");
+  EXPECT_EQ(first.rcode(), kDnsRcodeNoError);
+  ASSERT_EQ(first.answers.size(), 1u);
+  DnsMessage second = Resolve("WWW.example.com");
+  EXPECT_EQ(second.answers.size(), 1u);
+  EXPECT_EQ(upstream.queries(), 1);
+
+  EXPECT_EQ(Resolve("nx.example.com").rcode(), kDnsRcodeNxDomain);
+  EXPECT_EQ(Resolve("nx.example.com").rcode(), kDnsRcodeNxDomain);
+  EXPECT_EQ(Resolve("www.example.com", kDnsTypeAaaa).answers.size(), 0u);
+  EXPECT_EQ(Resolve("www.example.com", kDnsTypeAaaa).answers.size(), 0u);
+  EXPECT_EQ(upstream.queries(), 3);
+  EXPECT_EQ(forwarder_->stats().cache_hits.load(), 3u);
+}
+
+TEST_F(DnsForwarderTest, RacesUpstreamsAndTakesFirstUsableAnswer) {
+  DnsTestServer slow;
+  slow.set_delay_ms(300);
+  slow.set_answer_octet(1);
+  DnsTestServer failing;
+  failing.set_rcode(kDnsRcodeServFail);
+  DnsTestServer fast;
+  fast.set_delay_ms(20);
+  fast.set_answer_octet(3);
+  CreateForwarder({slow.address(), failing.address(), fast.address()});
+
+  int64_t start = EventLoop::NowMs();
+  DnsMessage message = Resolve("race.example");
+  EXPECT_LT(EventLoop::NowMs() - start, 250);
+  ASSERT_EQ(message.answers.size(), 1u);
+  EXPECT_EQ(message.rcode(), kDnsRcodeNoError);
+  EXPECT_EQ(forwarder_->stats().upstream_queries.load(), 3u);
+}
+
+TEST_F(DnsForwarderTest, CoalescesConcurrentMisses) {
+  DnsTestServer upstream;
+  upstream.set_delay_ms(50);
+  CreateForwarder({upstream.address()});
+  std::string query = BuildDnsQuery(9, Question("same.example"));
+  int answers = 0;
+  for (int i = 0; i < 5; i++) {
+    forwarder_->Resolve(reinterpret_cast<const uint8_t*>(query.data()), query.size(),
+                        [&](const std::string&) { answers++; });
+  }
+  ASSERT_TRUE(RunUntil([&]() { return answers == 5; }));
+  EXPECT_EQ(upstream.queries(), 1);
+  EXPECT_EQ(forwarder_->stats().coalesced.load(), 4u);
+}
+
+TEST_F(DnsForwarderTest, AnswersServfailWhenUpstreamsTimeOut) {
+  DnsTestServer upstream;
+  upstream.set_silent(true);
+  DnsForwarderOptions options;
+  options.timeout_ms = 100;
+  CreateForwarder({upstream.address()}, options);
+  EXPECT_EQ(Resolve("silent.example").rcode(), kDnsRcodeServFail);
+  EXPECT_EQ(forwarder_->stats().upstream_timeouts.load(), 1u);
+}
+
+TEST_F(DnsForwarderTest, ServesStaleWhileRefreshing) {
+  DnsTestServer upstream;
+  upstream.set_ttl(1);
+  DnsForwarderOptions options;
+  options.timeout_ms = 100;
+  CreateForwarder({upstream.address()}, options);
+  Resolve("stale.example");
+  upstream.set_silent(true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+  DnsMessage stale = Resolve("stale.example");
+  ASSERT_EQ(stale.answers.size(), 1u);
+  EXPECT_EQ(stale.answers[0].ttl, DnsCacheOptions().stale_answer_ttl);
+  EXPECT_EQ(forwarder_->stats().stale_hits.load(), 1u);
+  // The background refresh times out and the entry stays usable.
+  ASSERT_TRUE(RunUntil([&]() { return forwarder_->stats().upstream_timeouts.load() == 1; }));
+  upstream.set_silent(false);
+  upstream.set_ttl(300);
+  EXPECT_EQ(Resolve("stale.example").answers.size(), 1u);
+  // That hit started a new refresh, which now succeeds.
+  RunUntil([&]() { return false; }, 200);
+  EXPECT_GT(Resolve("stale.example").answers[0].ttl, 200u);
+  EXPECT_EQ(forwarder_->stats().prefetches.load(), 2u);
+}
+
+TEST_F(DnsForwarderTest, ServesOverUdpListener) {
+  DnsTestServer upstream;
+  CreateForwarder({upstream.address()});
+  SocketAddress local;
+  IpAddress::Parse("127.0.0.1", &local.ip);
+  ASSERT_TRUE(forwarder_->Listen(local));
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_storage ss;
+  socklen_t len = forwarder_->local_address().ToSockaddr(&ss);
+  std::string query = BuildDnsQuery(77, Question("MiXeD.Example"));
+  sendto(fd, query.data(), query.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+  char buffer[512];
+  ssize_t n = -1;
+  ASSERT_TRUE(RunUntil([&]() {
+    n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    return n > 0;
+  }));
+  close(fd);
+  std::string response(buffer, static_cast<size_t>(n));
+  EXPECT_EQ(Parse(response).id, 77);
+  // The question comes back exactly as asked.
+  EXPECT_NE(response.find("MiXeD"), std::string::npos);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,147 @@
+#ifndef FLUTTER_PLUGIN_TEST_DNS_TEST_SERVER_H_
+#define FLUTTER_PLUGIN_TEST_DNS_TEST_SERVER_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "dns_message.h"
+#include "net_address.h"
+
+namespace vpn_plugin {
+namespace test {
+
+// Stand-in for an upstream resolver: answers A queries on a loopback UDP
+// port with a fixed address. Names under "nx." get NXDOMAIN and other types
+// get NODATA, both with an SOA for negative caching. Behaviour can be
+// changed while it runs.
+class DnsTestServer {
+ public:
+  DnsTestServer() {
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    IpAddress::Parse("127.0.0.1", &address_.ip);
+    address_.port = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() { Serve(); });
+  }
+
+  ~DnsTestServer() {
+    stopping_ = true;
+    shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    close(fd_);
+  }
+
+  const SocketAddress& address() const { return address_; }
+  int queries() const { return queries_; }
+
+  void set_ttl(uint32_t ttl) { ttl_ = ttl; }
+  void set_delay_ms(int delay_ms) { delay_ms_ = delay_ms; }
+  // Non-zero answers every query with this rcode and no records.
+  void set_rcode(uint8_t rcode) { rcode_ = rcode; }
+  void set_silent(bool silent) { silent_ = silent; }
+  // Last octet of the A record, to tell upstreams apart.
+  void set_answer_octet(uint8_t octet) { octet_ = octet; }
+
+ private:
+  void Serve() {
+    char buffer[1500];
+    while (!stopping_) {
+      sockaddr_storage ss;
+      socklen_t len = sizeof(ss);
+      ssize_t n = recvfrom(fd_, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr*>(&ss), &len);
+      if (n <= 0) {
+        if (stopping_) return;
+        continue;
+      }
+      queries_++;
+      if (silent_) continue;
+      DnsMessage query;
+      if (!DnsMessage::Parse(reinterpret_cast<const uint8_t*>(buffer), static_cast<size_t>(n),
+                             &query) ||
+          query.questions.size() != 1) {
+        continue;
+      }
+      if (delay_ms_ > 0) std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+      std::string response = BuildResponse(query);
+      sendto(fd_, response.data(), response.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+    }
+  }
+
+  std::string BuildResponse(const DnsMessage& query) {
+    const DnsQuestion& question = query.questions[0];
+    uint8_t rcode = rcode_;
+    bool nxdomain = question.name.size() > 3 && question.name.compare(0, 3, "nx.") == 0;
+    if (!rcode && nxdomain) rcode = kDnsRcodeNxDomain;
+    bool answer = !rcode && question.type == kDnsTypeA;
+    bool soa = !answer && (!rcode || rcode == kDnsRcodeNxDomain);
+    std::string out;
+    PutU16(&out, query.id);
+    PutU16(&out, static_cast<uint16_t>(0x8180 | rcode));
+    PutU16(&out, 1);
+    PutU16(&out, answer ? 1 : 0);
+    PutU16(&out, soa ? 1 : 0);
+    PutU16(&out, 0);
+    AppendDnsName(&out, question.name);
+    PutU16(&out, question.type);
+    PutU16(&out, question.klass);
+    if (answer) {
+      PutU16(&out, 0xc00c);
+      PutU16(&out, kDnsTypeA);
+      PutU16(&out, kDnsClassIn);
+      PutU32(&out, ttl_);
+      PutU16(&out, 4);
+      out += std::string("\x0a\x00\x00", 3) + static_cast<char>(octet_.load());
+    }
+    if (soa) {
+      std::string rdata;
+      AppendDnsName(&rdata, "ns.test");
+      AppendDnsName(&rdata, "admin.test");
+      for (uint32_t field : {1u, 3600u, 600u, 86400u, 60u}) PutU32(&rdata, field);
+      PutU16(&out, 0xc00c);
+      PutU16(&out, kDnsTypeSoa);
+      PutU16(&out, kDnsClassIn);
+      PutU32(&out, ttl_);
+      PutU16(&out, static_cast<uint16_t>(rdata.size()));
+      out += rdata;
+    }
+    return out;
+  }
+
+  static void PutU16(std::string* out, uint16_t value) {
+    out->push_back(static_cast<char>(value >> 8));
+    out->push_back(static_cast<char>(value & 0xff));
+  }
+
+  static void PutU32(std::string* out, uint32_t value) {
+    PutU16(out, static_cast<uint16_t>(value >> 16));
+    PutU16(out, static_cast<uint16_t>(value & 0xffff));
+  }
+
+  int fd_;
+  SocketAddress address_;
+  std::thread thread_;
+  std::atomic<bool> stopping_{false};
+  std::atomic<int> queries_{0};
+  std::atomic<uint32_t> ttl_{300};
+  std::atomic<int> delay_ms_{0};
+  std::atomic<uint8_t> rcode_{0};
+  std::atomic<bool> silent_{false};
+  std::atomic<uint8_t> octet_{1};
+};
+
+}  // namespace test
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TEST_DNS_TEST_SERVER_H_
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "domain_matcher.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+// The rules as RuleSet read them before the automaton, with keywords
+// checked by substring search.
+bool ReferenceMatches(const std::vector<std::string>& patterns, const std::string& raw) {
+  std::string domain = NormalizeDomain(raw);
+  for (const auto& raw_pattern : patterns) {
+    std::string pattern = NormalizeDomain(raw_pattern);
+    if (pattern.size() > 2 && pattern.front() == '*' && pattern.back() == '*') {
+      if (domain.find(pattern.substr(1, pattern.size() - 2)) != std::string::npos) return true;
+    } else if (pattern.compare(0, 2, "*.") == 0) {
+      std::string suffix = pattern.substr(1);
+      if (domain.size() >= suffix.size() &&
+          domain.compare(domain.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        return true;
+      }
+    } else {
+      if (pattern.compare(0, 4, "www.") == 0) pattern = pattern.substr(4);
+      if (domain == pattern || domain == "www." + pattern) return true;
+    }
+  }
+  return false;
+}
+
+// Names over a small alphabet, so that patterns and names overlap often.
+std::string RandomName(std::mt19937* rng) {
+  static const char kLabels[][6] = {"a", "ab", "b", "com", "co", "www", "om", "ba"};
+  std::uniform_int_distribution<int> labels(1, 4);
+  std::uniform_int_distribution<int> pick(0, 7);
+  std::string name;
+  for (int i = labels(*rng); i > 0; i--) {
+    if (!name.empty()) name += '.';
+    name += kLabels[pick(*rng)];
+  }
+  return name;
+}
+
+}  // namespace
+
+TEST(DomainMatcher, MatchesTheRuleSyntax) {
+  DomainMatcher matcher({"Company.com", "*.internal", "www.social.com", "*stream*", "*.a.b."});
+  EXPECT_EQ(matcher.patterns(), 5u);
+  EXPECT_TRUE(matcher.has_keywords());
+  EXPECT_TRUE(matcher.Matches("company.com"));
+  EXPECT_TRUE(matcher.Matches("WWW.Company.COM."));
+  EXPECT_FALSE(matcher.Matches("mail.company.com"));
+  EXPECT_FALSE(matcher.Matches("notcompany.com"));
+  EXPECT_TRUE(matcher.Matches("social.com"));
+  EXPECT_TRUE(matcher.Matches("www.social.com"));
+  EXPECT_TRUE(matcher.Matches("git.internal"));
+  EXPECT_TRUE(matcher.Matches("a.b.internal"));
+  EXPECT_FALSE(matcher.Matches("internal"));
+  EXPECT_FALSE(matcher.Matches("xinternal"));
+  EXPECT_TRUE(matcher.Matches("livestreams.example.net"));
+  EXPECT_TRUE(matcher.Matches("stream"));
+  EXPECT_FALSE(matcher.Matches("strea.m"));
+  EXPECT_TRUE(matcher.Matches("x.a.b"));
+  EXPECT_FALSE(matcher.Matches(""));
+
+  DomainMatcher suffixes({"*.internal", "company.com"});
+  EXPECT_FALSE(suffixes.has_keywords());
+  EXPECT_TRUE(suffixes.Matches("git.internal"));
+  EXPECT_FALSE(suffixes.Matches("internal.example"));
+  EXPECT_TRUE(DomainMatcher().empty());
+  EXPECT_FALSE(DomainMatcher().Matches("company.com"));
+}
+
+TEST(DomainMatcher, AgreesWithAPatternByPatternScan) {
+  std::mt19937 rng(7);
+  for (int round = 0; round < 50; round++) {
+    std::vector<std::string> patterns;
+    for (int i = 0; i < 20; i++) {
+      std::string name = RandomName(&rng);
+      switch (rng() % 4) {
+        case 0: patterns.push_back("*." + name); break;
+        case 1: patterns.push_back("*" + name + "*"); break;
+        case 2: patterns.push_back("www." + name); break;
+        default: patterns.push_back(name); break;
+      }
+    }
+    // Every other round without keywords, for the trie walk.
+    if (round % 2) {
+      for (auto& pattern : patterns) {
+        if (pattern.back() == '*') pattern = pattern.substr(1, pattern.size() - 2);
+      }
+    }
+    DomainMatcher matcher(patterns);
+    for (int i = 0; i < 200; i++) {
+      std::string domain = RandomName(&rng);
+      ASSERT_EQ(matcher.Matches(domain), ReferenceMatches(patterns, domain))
+          << "round " << round << " domain " << domain;
+    }
+  }
+}
+
+TEST(DomainMatcher, SharesStatesBetweenCommonSuffixes) {
+  std::vector<std::string> patterns;
+  for (int i = 0; i < 1000; i++) patterns.push_back("*.site" + std::to_string(i) + ".example.com");
+  DomainMatcher matcher(patterns);
+  // ".example.com" once, then "site" and the digits per pattern at most.
+  EXPECT_LT(matcher.states(), 1000u * 8 + 13);
+  EXPECT_GT(matcher.memory_usage().bytes, matcher.states() * 16);
+  EXPECT_EQ(matcher.memory_usage().objects, 1000u);
+  EXPECT_TRUE(matcher.Matches("cdn.site999.example.com"));
+  EXPECT_FALSE(matcher.Matches("cdn.site1000.example.com"));
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
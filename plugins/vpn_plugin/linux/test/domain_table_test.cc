@@ -0,0 +1,183 @@
+#include <gtest/gtest.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dns_forwarder.h"
+#include "dns_message.h"
+#include "domain_table.h"
+#include "event_loop.h"
+#include "packet_pipeline.h"
+#include "routing_policy.h"
+#include "test/dns_test_server.h"
+#include "test/packet_builder.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+constexpr int64_t kNow = 1000 * 1000;
+
+IpAddress Ip(const std::string& text) {
+  IpAddress ip;
+  IpAddress::Parse(text, &ip);
+  return ip;
+}
+
+// Response to an A query for |name| carrying |records|, each already in
+// wire format.
+std::string Response(const std::string& name, const std::vector<std::string>& records) {
+  DnsQuestion question;
+  question.name = name;
+  question.type = kDnsTypeA;
+  question.klass = kDnsClassIn;
+  std::string out = BuildDnsQuery(1, question);
+  out[2] = static_cast<char>(0x81);
+  out[3] = static_cast<char>(0x80);
+  out[7] = static_cast<char>(records.size());
+  for (const auto& record : records) out += record;
+  return out;
+}
+
+std::string Record(const std::string& owner, uint16_t type, uint32_t ttl,
+                   const std::string& rdata) {
+  std::string out;
+  AppendDnsName(&out, owner);
+  for (uint16_t field : {type, kDnsClassIn}) {
+    out.push_back(static_cast<char>(field >> 8));
+    out.push_back(static_cast<char>(field));
+  }
+  for (int shift : {24, 16, 8, 0}) out.push_back(static_cast<char>(ttl >> shift));
+  out.push_back(static_cast<char>(rdata.size() >> 8));
+  out.push_back(static_cast<char>(rdata.size()));
+  return out + rdata;
+}
+
+std::string AddressRecord(const std::string& owner, const std::string& address, uint32_t ttl) {
+  IpAddress ip = Ip(address);
+  return Record(owner, ip.is_v4() ? kDnsTypeA : kDnsTypeAaaa, ttl,
+                std::string(reinterpret_cast<const char*>(ip.bytes), ip.size()));
+}
+
+std::string CnameRecord(const std::string& owner, const std::string& target, uint32_t ttl) {
+  std::string rdata;
+  AppendDnsName(&rdata, target);
+  return Record(owner, kDnsTypeCname, ttl, rdata);
+}
+
+size_t Learn(DomainTable* table, const std::string& response, int64_t now_ms = kNow) {
+  DnsMessage message;
+  const auto* data = reinterpret_cast<const uint8_t*>(response.data());
+  EXPECT_TRUE(DnsMessage::Parse(data, response.size(), &message));
+  return table->Learn(data, response.size(), message, now_ms);
+}
+
+std::string Lookup(const DomainTable& table, const std::string& address,
+                   int64_t now_ms = kNow) {
+  std::string domain;
+  return table.Find(Ip(address), now_ms, &domain) ? domain : std::string();
+}
+
+}  // namespace
+
+TEST(DomainTable, LearnsAddressesThroughCnameChains) {
+  DomainTableOptions options;
+  options.min_ttl = 0;
+  DomainTable table(options);
+  std::string response = Response(
+      "www.example.com", {CnameRecord("www.example.com", "edge.cdn.net", 600),
+                          CnameRecord("edge.cdn.net", "a1.cdn.net", 120),
+                          AddressRecord("a1.cdn.net", "93.184.216.34", 300),
+                          AddressRecord("a1.cdn.net", "2001:db8::34", 300),
+                          AddressRecord("unrelated.org", "198.51.100.7", 300)});
+  EXPECT_EQ(Learn(&table, response), 2u);
+  EXPECT_EQ(table.size(), 2u);
+  EXPECT_EQ(Lookup(table, "93.184.216.34"), "www.example.com");
+  EXPECT_EQ(Lookup(table, "2001:db8::34"), "www.example.com");
+  EXPECT_EQ(Lookup(table, "198.51.100.7"), "");
+  // The mapping lives as long as the shortest TTL along the chain.
+  EXPECT_EQ(Lookup(table, "93.184.216.34", kNow + 119 * 1000), "www.example.com");
+  EXPECT_EQ(Lookup(table, "93.184.216.34", kNow + 120 * 1000), "");
+}
+
+TEST(DomainTable, KeepsFamiliesApartAndUpdatesOwners) {
+  DomainTable table;
+  table.Insert(Ip("10.1.2.3"), "v4.test", 60, kNow);
+  table.Insert(Ip("::a01:203"), "v6.test", 60, kNow);
+  EXPECT_EQ(Lookup(table, "10.1.2.3"), "v4.test");
+  EXPECT_EQ(Lookup(table, "::a01:203"), "v6.test");
+  // A shared address is attributed to the name it was resolved from last.
+  table.Insert(Ip("10.1.2.3"), "other.test", 60, kNow);
+  EXPECT_EQ(Lookup(table, "10.1.2.3"), "other.test");
+  EXPECT_EQ(table.size(), 2u);
+  // The minimum TTL keeps short-lived answers around for late connections.
+  EXPECT_EQ(Lookup(table, "10.1.2.3", kNow + 299 * 1000), "other.test");
+}
+
+TEST(DomainTable, StaysWithinCapacity) {
+  DomainTableOptions options;
+  options.capacity = 1024;
+  options.shards = 4;
+  DomainTable table(options);
+  for (uint32_t i = 0; i < 10000; i++) {
+    uint8_t bytes[4] = {10, static_cast<uint8_t>(i >> 16), static_cast<uint8_t>(i >> 8),
+                        static_cast<uint8_t>(i)};
+    table.Insert(IpAddress::FromV4(bytes), "host" + std::to_string(i % 50) + ".test",
+                 60 + i, kNow);
+  }
+  EXPECT_LE(table.size(), table.capacity());
+  EXPECT_GT(table.size(), table.capacity() * 9 / 10);
+  EXPECT_GT(table.stats().evicted.load(), 0u);
+  // Entries expiring last survive eviction.
+  EXPECT_EQ(Lookup(table, "10.0.39.15"), "host49.test");
+}
+
+TEST(DomainTable, GivesDomainRulesToAddressOnlyFlows) {
+  DomainTable table;
+  table.Insert(Ip("93.184.216.34"), "intranet.company.com", 300, EventLoop::NowMs());
+  PacketPipelineOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(
+      RoutingMode::kVpn, std::vector<std::string>{"*.company.com"}, std::vector<std::string>(),
+      std::vector<std::string>());
+  options.domains = &table;
+  PacketPipeline pipeline(options);
+
+  PacketSpec spec;
+  auto known = BuildPacket(spec);
+  spec.dst = "93.184.216.35";
+  auto unknown = BuildPacket(spec);
+  iovec packets[2] = {{known.data(), known.size()}, {unknown.data(), unknown.size()}};
+  PacketVerdict verdicts[2];
+  pipeline.Process(packets, 2, verdicts);
+  EXPECT_EQ(verdicts[0], PacketVerdict::kBypass);
+  EXPECT_EQ(verdicts[1], PacketVerdict::kTunnel);
+}
+
+TEST(DomainTable, LearnsFromForwardedAnswers) {
+  EventLoop loop;
+  DnsTestServer upstream;
+  DomainTable table;
+  DnsForwarderOptions options;
+  options.upstreams.push_back(upstream.address());
+  options.domains = &table;
+  DnsForwarder forwarder(&loop, options);
+  ASSERT_TRUE(forwarder.Start());
+
+  DnsQuestion question;
+  question.name = "app.example.com";
+  question.type = kDnsTypeA;
+  question.klass = kDnsClassIn;
+  std::string query = BuildDnsQuery(9, question);
+  std::string response;
+  forwarder.Resolve(reinterpret_cast<const uint8_t*>(query.data()), query.size(),
+                    [&](const std::string& answer) { response = answer; });
+  for (int i = 0; i < 200 && response.empty(); i++) loop.RunOnce(10);
+  ASSERT_FALSE(response.empty());
+  EXPECT_EQ(Lookup(table, "10.0.0.1", EventLoop::NowMs()), "app.example.com");
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,227 @@
+#ifndef FLUTTER_PLUGIN_TEST_FAKE_BINARY_MESSENGER_H_
+#define FLUTTER_PLUGIN_TEST_FAKE_BINARY_MESSENGER_H_
+
+#include <flutter_linux/flutter_linux.h>
+#include <gio/gio.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+// Stand-in for the engine side of the platform channels, so that a plugin
+// can be registered and driven without a Flutter engine or a display.
+// Messages sent with fake_binary_messenger_send() reach the handler the
+// plugin set on the channel; its response goes to the callback given
+// there. Messages the plugin sends, such as events, go to the callback
+// set with fake_binary_messenger_set_outgoing().
+//
+// Everything runs on the thread that iterates the default main context.
+
+G_DECLARE_FINAL_TYPE(FakeBinaryMessenger, fake_binary_messenger, FAKE, BINARY_MESSENGER, GObject)
+G_DECLARE_FINAL_TYPE(FakeResponseHandle, fake_response_handle, FAKE, RESPONSE_HANDLE,
+                     FlBinaryMessengerResponseHandle)
+G_DECLARE_FINAL_TYPE(FakePluginRegistrar, fake_plugin_registrar, FAKE, PLUGIN_REGISTRAR, GObject)
+
+typedef std::function<void(GBytes* response)> FakeResponseCallback;
+typedef std::function<void(const gchar* channel, GBytes* message)> FakeOutgoingCallback;
+
+struct FakeChannelHandler {
+  FlBinaryMessengerMessageHandler handler;
+  gpointer user_data;
+  GDestroyNotify destroy_notify;
+};
+
+struct _FakeBinaryMessenger {
+  GObject parent_instance;
+  std::map<std::string, FakeChannelHandler>* handlers;
+  FakeOutgoingCallback* outgoing;
+};
+
+struct _FakeResponseHandle {
+  FlBinaryMessengerResponseHandle parent_instance;
+  FakeResponseCallback* callback;
+};
+
+struct _FakePluginRegistrar {
+  GObject parent_instance;
+  FlBinaryMessenger* messenger;
+};
+
+// -------- Response handle --------
+G_DEFINE_TYPE(FakeResponseHandle, fake_response_handle,
+              fl_binary_messenger_response_handle_get_type())
+
+static void fake_response_handle_finalize(GObject* object) {
+  delete FAKE_RESPONSE_HANDLE(object)->callback;
+  G_OBJECT_CLASS(fake_response_handle_parent_class)->finalize(object);
+}
+
+static void fake_response_handle_class_init(FakeResponseHandleClass* klass) {
+  G_OBJECT_CLASS(klass)->finalize = fake_response_handle_finalize;
+}
+
+static void fake_response_handle_init(FakeResponseHandle* self) { self->callback = NULL; }
+
+// -------- Messenger --------
+static void fake_binary_messenger_iface_init(FlBinaryMessengerInterface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(FakeBinaryMessenger, fake_binary_messenger, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(fl_binary_messenger_get_type(),
+                                              fake_binary_messenger_iface_init))
+
+static void fake_binary_messenger_set_message_handler_on_channel(
+    FlBinaryMessenger* messenger, const gchar* channel, FlBinaryMessengerMessageHandler handler,
+    gpointer user_data, GDestroyNotify destroy_notify) {
+  FakeBinaryMessenger* self = FAKE_BINARY_MESSENGER(messenger);
+  auto it = self->handlers->find(channel);
+  if (it != self->handlers->end()) {
+    FakeChannelHandler old = it->second;
+    self->handlers->erase(it);
+    if (old.destroy_notify) old.destroy_notify(old.user_data);
+  }
+  if (handler) (*self->handlers)[channel] = {handler, user_data, destroy_notify};
+}
+
+static gboolean fake_binary_messenger_send_response(FlBinaryMessenger* messenger,
+                                                    FlBinaryMessengerResponseHandle* handle,
+                                                    GBytes* response, GError** error) {
+  FakeResponseHandle* self = FAKE_RESPONSE_HANDLE(handle);
+  if (!self->callback) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "response already sent");
+    return FALSE;
+  }
+  FakeResponseCallback* callback = self->callback;
+  self->callback = NULL;
+  (*callback)(response);
+  delete callback;
+  return TRUE;
+}
+
+static void fake_binary_messenger_send_on_channel(FlBinaryMessenger* messenger,
+                                                  const gchar* channel, GBytes* message,
+                                                  GCancellable* cancellable,
+                                                  GAsyncReadyCallback callback,
+                                                  gpointer user_data) {
+  FakeBinaryMessenger* self = FAKE_BINARY_MESSENGER(messenger);
+  if (self->outgoing && *self->outgoing) (*self->outgoing)(channel, message);
+  if (callback) {
+    g_autoptr(GTask) task = g_task_new(messenger, cancellable, callback, user_data);
+    g_task_return_pointer(task, g_bytes_new(NULL, 0), (GDestroyNotify)g_bytes_unref);
+  }
+}
+
+static GBytes* fake_binary_messenger_send_on_channel_finish(FlBinaryMessenger* messenger,
+                                                            GAsyncResult* result,
+                                                            GError** error) {
+  return (GBytes*)g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static void fake_binary_messenger_resize_channel(FlBinaryMessenger* messenger,
+                                                 const gchar* channel, int64_t new_size) {}
+
+static void fake_binary_messenger_set_warns_on_channel_overflow(FlBinaryMessenger* messenger,
+                                                                const gchar* channel,
+                                                                bool warns) {}
+
+static void fake_binary_messenger_iface_init(FlBinaryMessengerInterface* iface) {
+  iface->set_message_handler_on_channel = fake_binary_messenger_set_message_handler_on_channel;
+  iface->send_response = fake_binary_messenger_send_response;
+  iface->send_on_channel = fake_binary_messenger_send_on_channel;
+  iface->send_on_channel_finish = fake_binary_messenger_send_on_channel_finish;
+  iface->resize_channel = fake_binary_messenger_resize_channel;
+  iface->set_warns_on_channel_overflow = fake_binary_messenger_set_warns_on_channel_overflow;
+}
+
+static void fake_binary_messenger_dispose(GObject* object) {
+  FakeBinaryMessenger* self = FAKE_BINARY_MESSENGER(object);
+  if (self->handlers) {
+    for (auto& entry : *self->handlers) {
+      if (entry.second.destroy_notify) entry.second.destroy_notify(entry.second.user_data);
+    }
+    delete self->handlers;
+    self->handlers = NULL;
+  }
+  delete self->outgoing;
+  self->outgoing = NULL;
+  G_OBJECT_CLASS(fake_binary_messenger_parent_class)->dispose(object);
+}
+
+static void fake_binary_messenger_class_init(FakeBinaryMessengerClass* klass) {
+  G_OBJECT_CLASS(klass)->dispose = fake_binary_messenger_dispose;
+}
+
+static void fake_binary_messenger_init(FakeBinaryMessenger* self) {
+  self->handlers = new std::map<std::string, FakeChannelHandler>();
+  self->outgoing = NULL;
+}
+
+static inline FakeBinaryMessenger* fake_binary_messenger_new() {
+  return FAKE_BINARY_MESSENGER(g_object_new(fake_binary_messenger_get_type(), NULL));
+}
+
+static inline void fake_binary_messenger_set_outgoing(FakeBinaryMessenger* self,
+                                                      FakeOutgoingCallback callback) {
+  delete self->outgoing;
+  self->outgoing = new FakeOutgoingCallback(std::move(callback));
+}
+
+// Delivers |message| on |channel| as if Dart had sent it. Returns FALSE if
+// nothing handles the channel.
+static inline gboolean fake_binary_messenger_send(FakeBinaryMessenger* self, const gchar* channel,
+                                                  GBytes* message, FakeResponseCallback callback) {
+  auto it = self->handlers->find(channel);
+  if (it == self->handlers->end()) return FALSE;
+  FakeResponseHandle* handle =
+      FAKE_RESPONSE_HANDLE(g_object_new(fake_response_handle_get_type(), NULL));
+  handle->callback = new FakeResponseCallback(std::move(callback));
+  it->second.handler(FL_BINARY_MESSENGER(self), channel, message,
+                     FL_BINARY_MESSENGER_RESPONSE_HANDLE(handle), it->second.user_data);
+  g_object_unref(handle);
+  return TRUE;
+}
+
+// -------- Registrar --------
+static void fake_plugin_registrar_iface_init(FlPluginRegistrarInterface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(FakePluginRegistrar, fake_plugin_registrar, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(fl_plugin_registrar_get_type(),
+                                              fake_plugin_registrar_iface_init))
+
+static FlBinaryMessenger* fake_plugin_registrar_get_messenger(FlPluginRegistrar* registrar) {
+  return FAKE_PLUGIN_REGISTRAR(registrar)->messenger;
+}
+
+// No engine, so no textures and no view; flutter_linux calls these
+// without checking that they are set.
+static FlTextureRegistrar* fake_plugin_registrar_get_texture_registrar(
+    FlPluginRegistrar* registrar) {
+  return NULL;
+}
+
+static FlView* fake_plugin_registrar_get_view(FlPluginRegistrar* registrar) { return NULL; }
+
+static void fake_plugin_registrar_iface_init(FlPluginRegistrarInterface* iface) {
+  iface->get_messenger = fake_plugin_registrar_get_messenger;
+  iface->get_texture_registrar = fake_plugin_registrar_get_texture_registrar;
+  iface->get_view = fake_plugin_registrar_get_view;
+}
+
+static void fake_plugin_registrar_dispose(GObject* object) {
+  g_clear_object(&FAKE_PLUGIN_REGISTRAR(object)->messenger);
+  G_OBJECT_CLASS(fake_plugin_registrar_parent_class)->dispose(object);
+}
+
+static void fake_plugin_registrar_class_init(FakePluginRegistrarClass* klass) {
+  G_OBJECT_CLASS(klass)->dispose = fake_plugin_registrar_dispose;
+}
+
+static void fake_plugin_registrar_init(FakePluginRegistrar* self) { self->messenger = NULL; }
+
+static inline FakePluginRegistrar* fake_plugin_registrar_new(FakeBinaryMessenger* messenger) {
+  FakePluginRegistrar* self =
+      FAKE_PLUGIN_REGISTRAR(g_object_new(fake_plugin_registrar_get_type(), NULL));
+  self->messenger = FL_BINARY_MESSENGER(g_object_ref(messenger));
+  return self;
+}
+
+#endif  // FLUTTER_PLUGIN_TEST_FAKE_BINARY_MESSENGER_H_
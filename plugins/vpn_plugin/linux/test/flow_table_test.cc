@@ -0,0 +1,208 @@
+#include <gtest/gtest.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "domain_table.h"
+#include "event_loop.h"
+#include "flow_table.h"
+#include "packet_pipeline.h"
+#include "routing_policy.h"
+#include "test/packet_builder.h"
+#include "timer_wheel.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+constexpr uint64_t kStart = 1000 * 1000;
+
+FlowKey Key(uint32_t i, uint8_t protocol = kIpProtoUdp) {
+  PacketHeaders headers;
+  uint8_t src[4] = {10, 0, static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+  uint8_t dst[4] = {93, 184, 216, 34};
+  headers.src = IpAddress::FromV4(src);
+  headers.dst = IpAddress::FromV4(dst);
+  headers.protocol = protocol;
+  headers.src_port = static_cast<uint16_t>(40000 + (i >> 16));
+  headers.dst_port = 443;
+  return FlowKey::FromHeaders(headers);
+}
+
+FlowTableOptions Options() {
+  FlowTableOptions options;
+  options.tick_ms = 100;
+  options.udp_timeout_ms = 1000;
+  options.tcp_timeout_ms = 5000;
+  options.tcp_closing_timeout_ms = 500;
+  return options;
+}
+
+}  // namespace
+
+TEST(TimerWheel, FiresEachTimerOnItsTick) {
+  TimerWheel wheel(8);
+  // One timer per level, plus one past the horizon.
+  const uint64_t ticks[] = {3, 64, 100, 4096, 5000, 300000, (uint64_t{1} << 24) + 7};
+  for (uint32_t i = 0; i < 7; i++) wheel.Schedule(i, ticks[i]);
+  EXPECT_EQ(wheel.size(), 7u);
+
+  std::vector<std::pair<uint32_t, uint64_t>> fired;
+  auto record = [&](uint32_t id) { fired.emplace_back(id, wheel.now()); };
+  for (uint64_t tick = 0; tick <= ticks[6]; tick += 997) wheel.Advance(tick, record);
+  wheel.Advance(ticks[6], record);
+
+  ASSERT_EQ(fired.size(), 7u);
+  for (uint32_t i = 0; i < 7; i++) {
+    EXPECT_EQ(fired[i].first, i);
+    EXPECT_EQ(fired[i].second, ticks[i]);
+  }
+  EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheel, CancelsReschedulesAndMoves) {
+  TimerWheel wheel(4, 10);
+  wheel.Schedule(0, 20);
+  wheel.Schedule(1, 20);
+  wheel.Schedule(2, 5);  // In the past: due on the next tick.
+  EXPECT_EQ(wheel.expiry(2), 11u);
+  wheel.Cancel(1);
+  EXPECT_FALSE(wheel.scheduled(1));
+  wheel.Schedule(0, 200);
+  wheel.Move(0, 3);
+  EXPECT_FALSE(wheel.scheduled(0));
+  EXPECT_TRUE(wheel.scheduled(3));
+
+  std::vector<uint32_t> fired;
+  wheel.Advance(199, [&](uint32_t id) { fired.push_back(id); });
+  EXPECT_EQ(fired, std::vector<uint32_t>({2}));
+  wheel.Advance(200, [&](uint32_t id) { fired.push_back(id); });
+  EXPECT_EQ(fired, std::vector<uint32_t>({2, 3}));
+}
+
+TEST(FlowTable, ExpiresIdleFlowsWithTheirCounts) {
+  std::vector<FlowRecord> expired;
+  FlowTable table(Options(), [&](const FlowRecord& record) { expired.push_back(record); });
+  bool inserted;
+  FlowEntry* udp = table.Insert(Key(1), PacketVerdict::kBypass, kStart, &inserted);
+  ASSERT_NE(udp, nullptr);
+  EXPECT_TRUE(inserted);
+  table.Touch(udp, 100, 0, kStart);
+  FlowEntry* tcp = table.Insert(Key(2, kIpProtoTcp), PacketVerdict::kTunnel, kStart, &inserted);
+  table.Touch(tcp, 60, kTcpFlagSyn, kStart);
+
+  // Traffic at 800 ms pushes the UDP flow's deadline out without touching
+  // its timer.
+  udp = table.Find(Key(1));
+  table.Touch(udp, 200, 0, kStart + 800);
+  EXPECT_EQ(table.Expire(kStart + 1500), 0u);
+  EXPECT_EQ(table.Expire(kStart + 1800), 1u);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_TRUE(expired[0].key == Key(1));
+  EXPECT_EQ(expired[0].verdict, PacketVerdict::kBypass);
+  EXPECT_EQ(expired[0].bytes, 300u);
+  EXPECT_EQ(expired[0].packets, 2u);
+  EXPECT_EQ(expired[0].first_seen_ms, kStart);
+  EXPECT_EQ(expired[0].last_seen_ms, kStart + 800);
+  EXPECT_EQ(table.Find(Key(1)), nullptr);
+  EXPECT_EQ(table.size(), 1u);
+
+  EXPECT_EQ(table.Expire(kStart + 5000), 1u);
+  EXPECT_EQ(table.size(), 0u);
+}
+
+TEST(FlowTable, ShortensTheTimeoutOfClosingTcpFlows) {
+  size_t expired = 0;
+  FlowTable table(Options(), [&](const FlowRecord&) { expired++; });
+  bool inserted;
+  FlowEntry* flow = table.Insert(Key(1, kIpProtoTcp), PacketVerdict::kTunnel, kStart, &inserted);
+  table.Touch(flow, 60, kTcpFlagAck, kStart);
+  table.Touch(flow, 60, kTcpFlagFin | kTcpFlagAck, kStart + 1000);
+  EXPECT_EQ(table.Expire(kStart + 1400), 0u);
+  EXPECT_EQ(table.Expire(kStart + 1500), 1u);
+  EXPECT_EQ(expired, 1u);
+}
+
+TEST(FlowTable, KeepsProbeRunsIntactAcrossRemovals) {
+  FlowTableOptions options = Options();
+  options.capacity = 700;
+  FlowTable table(options, nullptr);
+  bool inserted;
+  for (uint32_t i = 0; i < 700; i++) {
+    // Stagger the flows so they expire in several batches.
+    ASSERT_NE(table.Insert(Key(i), PacketVerdict::kTunnel, kStart + (i % 7) * 100, &inserted),
+              nullptr);
+  }
+  EXPECT_EQ(table.Insert(Key(700), PacketVerdict::kTunnel, kStart, &inserted), nullptr);
+  EXPECT_FALSE(inserted);
+
+  for (uint32_t i = 0; i < 700; i += 3) EXPECT_TRUE(table.Remove(Key(i)));
+  EXPECT_FALSE(table.Remove(Key(0)));
+  for (uint32_t i = 0; i < 700; i++) {
+    EXPECT_EQ(table.Find(Key(i)) != nullptr, i % 3 != 0) << i;
+  }
+
+  // Expiry removes the rest in order of their deadlines, shifting entries
+  // and their timers on every removal.
+  for (uint32_t step = 0; step < 7; step++) {
+    table.Expire(kStart + 1000 + step * 100);
+    for (uint32_t i = 0; i < 700; i++) {
+      bool alive = i % 3 != 0 && i % 7 > step;
+      ASSERT_EQ(table.Find(Key(i)) != nullptr, alive) << i << " at step " << step;
+    }
+  }
+  EXPECT_EQ(table.size(), 0u);
+}
+
+TEST(FlowTable, KeepsTimersWhenGrowing) {
+  FlowTableOptions options = Options();
+  options.capacity = 1 << 16;
+  size_t expired = 0;
+  FlowTable table(options, [&](const FlowRecord&) { expired++; });
+  bool inserted;
+  for (uint32_t i = 0; i < 20000; i++) {
+    table.Insert(Key(i), PacketVerdict::kTunnel, kStart + (i < 10000 ? 0 : 500), &inserted);
+  }
+  EXPECT_EQ(table.size(), 20000u);
+  EXPECT_EQ(table.Expire(kStart + 1000), 10000u);
+  EXPECT_EQ(table.Find(Key(0)), nullptr);
+  EXPECT_NE(table.Find(Key(10000)), nullptr);
+  EXPECT_EQ(table.Expire(kStart + 1500), 10000u);
+  EXPECT_EQ(expired, 20000u);
+}
+
+TEST(PacketPipeline, ReportsExpiredFlowsWithTheirDomain) {
+  DomainTable domains;
+  IpAddress dst;
+  IpAddress::Parse("93.184.216.34", &dst);
+  domains.Insert(dst, "example.com", 3600, EventLoop::NowMs());
+
+  std::vector<FlowRecord> expired;
+  PacketPipelineOptions options;
+  options.domains = &domains;
+  options.flows.udp_timeout_ms = 1000;
+  options.on_flow_expired = [&](const FlowRecord& record) { expired.push_back(record); };
+  PacketPipeline pipeline(options);
+
+  PacketSpec spec;
+  spec.protocol = kIpProtoUdp;
+  spec.payload = 100;
+  std::vector<uint8_t> packet = BuildPacket(spec);
+  iovec iov[2] = {{packet.data(), packet.size()}, {packet.data(), packet.size()}};
+  PacketVerdict verdicts[2];
+  pipeline.Process(iov, 2, verdicts);
+  EXPECT_EQ(pipeline.flow_count(), 1u);
+
+  EXPECT_EQ(pipeline.Expire(EventLoop::NowMs() + 2000), 1u);
+  EXPECT_EQ(pipeline.flow_count(), 0u);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].domain, "example.com");
+  EXPECT_EQ(expired[0].packets, 2u);
+  EXPECT_EQ(expired[0].bytes, 2 * packet.size());
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,278 @@
+#ifndef FLUTTER_PLUGIN_TEST_H2_TEST_SERVER_H_
+#define FLUTTER_PLUGIN_TEST_H2_TEST_SERVER_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hpack.h"
+#include "http2_frame.h"
+#include "net_address.h"
+
+namespace vpn_plugin {
+namespace test {
+
+// Stand-in for the endpoint: a blocking cleartext HTTP/2 server on a
+// loopback port that answers CONNECT with a status and then echoes every
+// DATA frame back on the same stream, honouring the client's flow control.
+class H2TestServer {
+ public:
+  struct Options {
+    uint32_t max_concurrent_streams = 100;
+    // Receive window advertised to the client for each stream.
+    uint32_t initial_window = 1 << 20;
+    std::string status = "200";
+    // Sleeps this long after each read, to stand in for a slow endpoint.
+    int read_pause_ms = 0;
+  };
+
+  H2TestServer() : H2TestServer(Options()) {}
+  explicit H2TestServer(Options options) : options_(options) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, 64);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    IpAddress::Parse("127.0.0.1", &address_.ip);
+    address_.port = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() {
+      while (true) {
+        int c = accept(fd_, nullptr, nullptr);
+        if (c < 0) return;
+        connections_++;
+        int one = 1;
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.push_back(c);
+        workers_.emplace_back([this, c]() { Serve(c); });
+      }
+    });
+  }
+
+  ~H2TestServer() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+    std::vector<std::thread> workers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int c : clients_) shutdown(c, SHUT_RDWR);
+      workers.swap(workers_);
+    }
+    for (auto& worker : workers) worker.join();
+    for (int c : clients_) close(c);
+  }
+
+  const SocketAddress& address() const { return address_; }
+  int connections() const { return connections_; }
+  int streams() const { return streams_; }
+  std::string last_authority() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_authority_;
+  }
+  std::string last_credentials() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_credentials_;
+  }
+  // Peak number of streams open at once on any single connection.
+  int peak_streams_per_connection() const { return peak_streams_; }
+
+ private:
+  struct Stream {
+    int64_t send_window;
+    std::string pending;
+    bool end_stream = false;
+  };
+
+  void Serve(int fd) {
+    char preface[kHttp2ClientPrefaceSize];
+    if (!ReadExactly(fd, preface, sizeof(preface))) return Done(fd);
+    std::string out;
+    AppendHttp2Settings(&out, {{Http2Setting::kMaxConcurrentStreams, options_.max_concurrent_streams},
+                               {Http2Setting::kInitialWindowSize, options_.initial_window}});
+    // Open the connection window wide; stream windows still apply.
+    AppendHttp2WindowUpdate(&out, 0, (1u << 30));
+    if (!WriteAll(fd, out)) return Done(fd);
+
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    Http2FrameReader reader;
+    std::map<uint32_t, Stream> streams;
+    int64_t initial_window = kHttp2DefaultWindow;
+    int64_t connection_window = kHttp2DefaultWindow;
+    std::string block;
+    char buffer[65536];
+    while (true) {
+      ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) break;
+      if (options_.read_pause_ms > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(options_.read_pause_ms));
+      }
+      reader.Append(buffer, static_cast<size_t>(n));
+      out.clear();
+      Http2Frame frame;
+      Http2FrameReader::Result result;
+      while ((result = reader.Next(&frame)) == Http2FrameReader::Result::kFrame) {
+        switch (frame.type) {
+          case Http2FrameType::kSettings:
+            if (frame.flags & kHttp2FlagAck) break;
+            for (size_t i = 0; i + 6 <= frame.payload.size(); i += 6) {
+              if (frame.payload[i + 1] == static_cast<char>(Http2Setting::kInitialWindowSize)) {
+                initial_window = static_cast<int64_t>(ReadU32(frame.payload.data() + i + 2));
+              }
+            }
+            AppendHttp2SettingsAck(&out);
+            break;
+          case Http2FrameType::kHeaders:
+          case Http2FrameType::kContinuation: {
+            block += frame.payload;
+            if (!(frame.flags & kHttp2FlagEndHeaders)) break;
+            std::vector<HpackHeader> headers;
+            bool ok = decoder.Decode(reinterpret_cast<const uint8_t*>(block.data()), block.size(),
+                                     &headers);
+            block.clear();
+            if (!ok) return Done(fd);
+            OnRequest(headers);
+            streams[frame.stream_id] = Stream{initial_window, std::string()};
+            std::string response;
+            encoder.Encode({{":status", options_.status}}, &response);
+            AppendHttp2Headers(&out, frame.stream_id, response, options_.status != "200",
+                               kHttp2DefaultMaxFrameSize);
+            if (options_.status != "200") streams.erase(frame.stream_id);
+            peak_streams_ = std::max(peak_streams_.load(), static_cast<int>(streams.size()));
+            break;
+          }
+          case Http2FrameType::kData: {
+            auto it = streams.find(frame.stream_id);
+            if (it == streams.end()) break;
+            it->second.pending += frame.payload;
+            it->second.end_stream = (frame.flags & kHttp2FlagEndStream) != 0;
+            // Credit immediately; the echo is bounded by the client's window.
+            if (frame.length > 0) {
+              AppendHttp2WindowUpdate(&out, 0, frame.length);
+              if (!it->second.end_stream) {
+                AppendHttp2WindowUpdate(&out, frame.stream_id, frame.length);
+              }
+            }
+            break;
+          }
+          case Http2FrameType::kWindowUpdate: {
+            uint32_t increment = ReadU32(frame.payload.data()) & 0x7fffffff;
+            if (frame.stream_id == 0) {
+              connection_window += increment;
+            } else if (streams.count(frame.stream_id)) {
+              streams[frame.stream_id].send_window += increment;
+            }
+            break;
+          }
+          case Http2FrameType::kRstStream:
+            streams.erase(frame.stream_id);
+            break;
+          case Http2FrameType::kPing:
+            if (!(frame.flags & kHttp2FlagAck)) {
+              AppendHttp2Ping(&out, reinterpret_cast<const uint8_t*>(frame.payload.data()), true);
+            }
+            break;
+          case Http2FrameType::kGoaway:
+            return Done(fd);
+          default:
+            break;
+        }
+      }
+      if (result == Http2FrameReader::Result::kError) break;
+      // Echo whatever the windows allow.
+      for (auto it = streams.begin(); it != streams.end();) {
+        Stream& stream = it->second;
+        int64_t allowed = std::min(stream.send_window, connection_window);
+        size_t chunk = static_cast<size_t>(std::max<int64_t>(0, std::min<int64_t>(
+            allowed, static_cast<int64_t>(stream.pending.size()))));
+        bool finish = stream.end_stream && chunk == stream.pending.size();
+        if (chunk > 0 || finish) {
+          size_t offset = 0;
+          do {
+            size_t piece = std::min<size_t>(chunk - offset, kHttp2DefaultMaxFrameSize);
+            AppendHttp2Data(&out, it->first, stream.pending.data() + offset, piece,
+                            finish && offset + piece == chunk);
+            offset += piece;
+          } while (offset < chunk);
+        }
+        stream.pending.erase(0, chunk);
+        stream.send_window -= static_cast<int64_t>(chunk);
+        connection_window -= static_cast<int64_t>(chunk);
+        it = finish ? streams.erase(it) : std::next(it);
+      }
+      if (!out.empty() && !WriteAll(fd, out)) break;
+    }
+    Done(fd);
+  }
+
+  void OnRequest(const std::vector<HpackHeader>& headers) {
+    streams_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& header : headers) {
+      if (header.name == ":authority") last_authority_ = header.value;
+      if (header.name == "proxy-authorization") last_credentials_ = header.value;
+    }
+  }
+
+  void Done(int fd) { shutdown(fd, SHUT_RDWR); }
+
+  static uint32_t ReadU32(const char* p) {
+    const auto* u = reinterpret_cast<const uint8_t*>(p);
+    return static_cast<uint32_t>(u[0]) << 24 | static_cast<uint32_t>(u[1]) << 16 |
+           static_cast<uint32_t>(u[2]) << 8 | u[3];
+  }
+
+  static bool ReadExactly(int fd, char* buffer, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+      ssize_t n = recv(fd, buffer + got, size - got, 0);
+      if (n <= 0) return false;
+      got += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  static bool WriteAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) return false;
+      sent += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  Options options_;
+  int fd_;
+  SocketAddress address_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<int> clients_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> connections_{0};
+  std::atomic<int> streams_{0};
+  std::atomic<int> peak_streams_{0};
+  std::string last_authority_;
+  std::string last_credentials_;
+};
+
+}  // namespace test
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TEST_H2_TEST_SERVER_H_
@@ -0,0 +1,543 @@
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "hpack.h"
+#include "http2_frame.h"
+#include "http2_pool.h"
+#include "http2_tunnel.h"
+#include "relay_budget.h"
+#include "routing_policy.h"
+#include "socks_server.h"
+#include "test/h2_test_server.h"
+#include "upstream_cache.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+std::string FromHex(const std::string& hex) {
+  std::string out;
+  for (size_t i = 0; i + 1 < hex.size();) {
+    if (hex[i] == ' ') {
+      i++;
+      continue;
+    }
+    out.push_back(static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+    i += 2;
+  }
+  return out;
+}
+
+std::vector<HpackHeader> Decode(HpackDecoder* decoder, const std::string& block) {
+  std::vector<HpackHeader> headers;
+  EXPECT_TRUE(decoder->Decode(reinterpret_cast<const uint8_t*>(block.data()), block.size(),
+                              &headers));
+  return headers;
+}
+
+// Collects what the server echoes and credits it back immediately.
+class EchoDelegate : public Http2StreamDelegate {
+ public:
+  void OnHeaders(uint32_t, const std::vector<HpackHeader>& headers, bool end_stream) override {
+    for (const auto& header : headers) {
+      if (header.name == ":status") status = header.value;
+    }
+    closed = closed || end_stream;
+  }
+  void OnData(uint32_t stream_id, const char* data, size_t size, bool end_stream) override {
+    received.append(data, size);
+    connection->Consume(stream_id, size);
+    closed = closed || end_stream;
+  }
+  void OnWritable(uint32_t) override { Pump(); }
+  void OnClosed(uint32_t, Http2Error) override { closed = true; }
+
+  // Sends the rest of |outgoing| as the window allows.
+  void Pump() {
+    if (!connection || sent == outgoing.size()) return;
+    sent += connection->SendData(stream_id, outgoing.data() + sent, outgoing.size() - sent, true);
+  }
+
+  Http2Connection* connection = nullptr;
+  uint32_t stream_id = 0;
+  bool failed = false;
+  std::string status;
+  std::string outgoing;
+  size_t sent = 0;
+  std::string received;
+  bool closed = false;
+};
+
+class Http2PoolTest : public ::testing::Test {
+ protected:
+  void CreatePool(const SocketAddress& address, Http2PoolOptions options = Http2PoolOptions()) {
+    options.addresses = {address};
+    pool_ = std::make_unique<Http2Pool>(&loop_, std::move(options));
+  }
+
+  void Open(EchoDelegate* delegate) {
+    pool_->OpenStream(Http2ConnectHeaders("example.com:443", "", ""), false, delegate,
+                      [delegate](Http2Connection* connection, uint32_t stream_id) {
+                        delegate->connection = connection;
+                        delegate->stream_id = stream_id;
+                        delegate->failed = connection == nullptr;
+                        delegate->Pump();
+                      });
+  }
+
+  // Runs the loop on this thread until |done| holds or five seconds pass.
+  bool RunUntil(const std::function<bool()>& done) {
+    int64_t deadline = EventLoop::NowMs() + 5000;
+    while (!done()) {
+      if (EventLoop::NowMs() > deadline) return false;
+      loop_.RunOnce(50);
+    }
+    return true;
+  }
+
+  EventLoop loop_;
+  std::unique_ptr<Http2Pool> pool_;
+};
+
+}  // namespace
+
+TEST(Hpack, EncodesIntegersWithPrefix) {
+  std::string out;
+  HpackEncodeInteger(10, 5, 0, &out);
+  EXPECT_EQ(out, FromHex("0a"));
+  out.clear();
+  HpackEncodeInteger(1337, 5, 0, &out);
+  EXPECT_EQ(out, FromHex("1f9a0a"));
+
+  const auto* p = reinterpret_cast<const uint8_t*>(out.data());
+  uint64_t value = 0;
+  ASSERT_TRUE(HpackDecodeInteger(&p, p + out.size(), 5, &value));
+  EXPECT_EQ(value, 1337u);
+}
+
+TEST(Hpack, DecodesRfc7541HuffmanRequests) {
+  // RFC 7541 appendix C.4.
+  HpackDecoder decoder;
+  auto first = Decode(&decoder, FromHex("828684418cf1e3c2e5f23a6ba0ab90f4ff"));
+  ASSERT_EQ(first.size(), 4u);
+  EXPECT_EQ(first[3].name, ":authority");
+  EXPECT_EQ(first[3].value, "www.example.com");
+  EXPECT_EQ(decoder.table().size(), 57u);
+
+  auto second = Decode(&decoder, FromHex("828684be5886a8eb10649cbf"));
+  ASSERT_EQ(second.size(), 5u);
+  EXPECT_EQ(second[4].name, "cache-control");
+  EXPECT_EQ(second[4].value, "no-cache");
+  EXPECT_EQ(decoder.table().size(), 110u);
+
+  auto third = Decode(&decoder,
+                      FromHex("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"));
+  ASSERT_EQ(third.size(), 5u);
+  EXPECT_EQ(third[2].value, "/index.html");
+  EXPECT_EQ(third[4].name, "custom-key");
+  EXPECT_EQ(third[4].value, "custom-value");
+  EXPECT_EQ(decoder.table().size(), 164u);
+}
+
+TEST(Hpack, HuffmanRoundTripsEveryByte) {
+  std::string input;
+  for (int i = 0; i < 256; i++) input.push_back(static_cast<char>(i));
+  std::string encoded;
+  HpackHuffmanEncode(input, &encoded);
+  EXPECT_EQ(encoded.size(), HpackHuffmanEncodedLength(input));
+  std::string decoded;
+  ASSERT_TRUE(HpackHuffmanDecode(reinterpret_cast<const uint8_t*>(encoded.data()),
+                                 encoded.size(), &decoded));
+  EXPECT_EQ(decoded, input);
+}
+
+TEST(Hpack, ReusesDynamicTableAcrossBlocks) {
+  HpackEncoder encoder;
+  HpackDecoder decoder;
+  auto headers = Http2ConnectHeaders("example.com:443", "user", "secret");
+  std::string first;
+  std::string second;
+  encoder.Encode(headers, &first);
+  encoder.Encode(headers, &second);
+  // Every field is indexed the second time round.
+  EXPECT_LE(second.size(), headers.size());
+  EXPECT_EQ(Decode(&decoder, first).size(), headers.size());
+  auto decoded = Decode(&decoder, second);
+  ASSERT_EQ(decoded.size(), headers.size());
+  EXPECT_EQ(decoded[2].value, "Basic dXNlcjpzZWNyZXQ=");
+}
+
+TEST(Http2Frame, ReaderHandlesSplitInputAndPadding) {
+  std::string wire;
+  AppendHttp2Settings(&wire, {{Http2Setting::kMaxConcurrentStreams, 7}});
+  // DATA on stream 1 with 3 bytes of padding.
+  AppendHttp2FrameHeader(&wire, 1 + 5 + 3, Http2FrameType::kData, kHttp2FlagPadded, 1);
+  wire += std::string(1, '\x03') + "hello" + std::string(3, '\0');
+
+  Http2FrameReader reader;
+  Http2Frame frame;
+  for (char c : wire.substr(0, 19)) reader.Append(&c, 1);
+  ASSERT_EQ(reader.Next(&frame), Http2FrameReader::Result::kFrame);
+  EXPECT_EQ(frame.type, Http2FrameType::kSettings);
+  EXPECT_EQ(frame.payload.size(), 6u);
+  EXPECT_EQ(reader.Next(&frame), Http2FrameReader::Result::kNeedMore);
+  reader.Append(wire.data() + 19, wire.size() - 19);
+  ASSERT_EQ(reader.Next(&frame), Http2FrameReader::Result::kFrame);
+  EXPECT_EQ(frame.stream_id, 1u);
+  EXPECT_EQ(frame.payload, "hello");
+  EXPECT_EQ(frame.length, 9u);
+
+  std::string bad;
+  AppendHttp2FrameHeader(&bad, 2, Http2FrameType::kData, kHttp2FlagPadded, 1);
+  bad += std::string(1, '\x05') + "x";
+  reader.Append(bad.data(), bad.size());
+  EXPECT_EQ(reader.Next(&frame), Http2FrameReader::Result::kError);
+}
+
+TEST_F(Http2PoolTest, EchoesOverConnectStream) {
+  H2TestServer server;
+  CreatePool(server.address());
+  EchoDelegate stream;
+  stream.outgoing = "hello over h2";
+  Open(&stream);
+  ASSERT_TRUE(RunUntil([&]() { return stream.closed || stream.failed; }));
+  EXPECT_EQ(stream.status, "200");
+  EXPECT_EQ(stream.received, "hello over h2");
+  EXPECT_EQ(server.last_authority(), "example.com:443");
+  EXPECT_EQ(pool_->stats().connections_opened, 1u);
+}
+
+TEST_F(Http2PoolTest, SpreadsStreamsAcrossConnections) {
+  H2TestServer server;
+  Http2PoolOptions options;
+  options.max_connections = 3;
+  options.target_streams_per_connection = 4;
+  CreatePool(server.address(), options);
+  std::vector<EchoDelegate> streams(12);
+  for (auto& stream : streams) Open(&stream);
+  ASSERT_TRUE(RunUntil([&]() {
+    for (const auto& stream : streams) {
+      if (stream.status.empty()) return false;
+    }
+    return true;
+  }));
+  EXPECT_EQ(pool_->connection_count(), 3u);
+  EXPECT_EQ(pool_->StreamsPerConnection(), std::vector<size_t>({4, 4, 4}));
+  EXPECT_EQ(server.connections(), 3);
+
+  // Past the target on every connection, streams pack onto existing ones.
+  EchoDelegate extra;
+  Open(&extra);
+  ASSERT_TRUE(RunUntil([&]() { return !extra.status.empty(); }));
+  EXPECT_EQ(pool_->connection_count(), 3u);
+}
+
+TEST_F(Http2PoolTest, RespectsFlowControlWindows) {
+  H2TestServer::Options server_options;
+  server_options.initial_window = 16 * 1024;
+  H2TestServer server(server_options);
+  Http2PoolOptions options;
+  options.connection.stream_window = 32 * 1024;
+  options.connection.connection_window = 64 * 1024;
+  CreatePool(server.address(), options);
+
+  std::vector<EchoDelegate> streams(4);
+  for (size_t i = 0; i < streams.size(); i++) {
+    streams[i].outgoing.assign(256 * 1024, static_cast<char>('a' + i));
+    Open(&streams[i]);
+  }
+  ASSERT_TRUE(RunUntil([&]() {
+    for (const auto& stream : streams) {
+      if (!stream.closed && !stream.failed) return false;
+    }
+    return true;
+  }));
+  for (const auto& stream : streams) EXPECT_EQ(stream.received, stream.outgoing);
+}
+
+TEST_F(Http2PoolTest, FailsStreamsWhenEndpointIsDown) {
+  H2TestServer server;
+  SocketAddress address = server.address();
+  {
+    // Grab a port nobody listens on.
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_storage ss;
+    socklen_t len = address.ToSockaddr(&ss);
+    reinterpret_cast<sockaddr_in*>(&ss)->sin_port = 0;
+    bind(fd, reinterpret_cast<sockaddr*>(&ss), len);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len);
+    address.port = ntohs(reinterpret_cast<sockaddr_in*>(&ss)->sin_port);
+    close(fd);
+  }
+  CreatePool(address);
+  EchoDelegate stream;
+  Open(&stream);
+  ASSERT_TRUE(RunUntil([&]() { return stream.failed; }));
+  EXPECT_EQ(pool_->stats().connections_failed, 1u);
+  EXPECT_EQ(pool_->queued(), 0u);
+}
+
+// Takes TCP connections and never answers, like a path that lets the
+// handshake through and then stalls.
+class SilentServer {
+ public:
+  SilentServer() {
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, 16);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&sin), &address_);
+  }
+  ~SilentServer() {
+    for (int fd : accepted_) close(fd);
+    close(fd_);
+  }
+
+  const SocketAddress& address() const { return address_; }
+  // Connections taken so far.
+  int connections() {
+    for (int fd; (fd = accept(fd_, nullptr, nullptr)) >= 0;) accepted_.push_back(fd);
+    return static_cast<int>(accepted_.size());
+  }
+
+ private:
+  int fd_;
+  SocketAddress address_;
+  std::vector<int> accepted_;
+};
+
+TEST_F(Http2PoolTest, RacesPastStalledAddressAndCachesWinner) {
+  SilentServer stalled;
+  H2TestServer server;
+  Http2PoolOptions options;
+  options.addresses = {stalled.address(), server.address()};
+  options.race_delay_ms = 100;
+  options.winners = std::make_shared<UpstreamWinnerCache>();
+  options.network_id = []() { return std::string("test-network"); };
+  pool_ = std::make_unique<Http2Pool>(&loop_, options);
+
+  EchoDelegate stream;
+  stream.outgoing = "raced";
+  Open(&stream);
+  ASSERT_TRUE(RunUntil([&]() { return stream.closed || stream.failed; }));
+  EXPECT_EQ(stream.received, "raced");
+  // Far below the connect timeout the stalled attempt alone would take.
+  EXPECT_LT(pool_->stats().last_connect_ms, 1000u);
+  EXPECT_EQ(pool_->stats().races_started, 1u);
+  EXPECT_EQ(pool_->connection_count(), 1u);
+  EXPECT_EQ(stalled.connections(), 1);
+  SocketAddress winner;
+  // Without a server name the endpoint is keyed by its first address.
+  ASSERT_TRUE(options.winners->Lookup(stalled.address().ToString(), "test-network", &winner));
+  EXPECT_EQ(winner, server.address());
+
+  // A later cold start on the same network goes to the winner directly.
+  pool_ = std::make_unique<Http2Pool>(&loop_, options);
+  EchoDelegate again;
+  again.outgoing = "cached";
+  Open(&again);
+  ASSERT_TRUE(RunUntil([&]() { return again.closed || again.failed; }));
+  EXPECT_EQ(again.received, "cached");
+  EXPECT_EQ(pool_->stats().winner_cache_hits, 1u);
+  EXPECT_EQ(pool_->stats().races_started, 0u);
+  EXPECT_EQ(stalled.connections(), 1);
+}
+
+class Http2TunnelTest : public ::testing::Test {
+ protected:
+  // With |budget_options|, streams get the flow budget as their window, as
+  // the plugin sets them up.
+  void Start(H2TestServer::Options server_options,
+             const RelayBudgetOptions* budget_options = nullptr) {
+    server_ = std::make_unique<H2TestServer>(server_options);
+    Http2PoolOptions pool_options;
+    pool_options.addresses = {server_->address()};
+    if (budget_options) {
+      pool_options.connection.stream_window = static_cast<int32_t>(budget_options->per_flow_bytes);
+      budget_ = std::make_unique<RelayBudget>(thread_.loop(), *budget_options);
+    }
+    pool_ = std::make_unique<Http2Pool>(thread_.loop(), pool_options);
+    connector_ = std::make_unique<Http2TunnelConnector>(thread_.loop(), pool_.get(), "user",
+                                                        "secret", budget_.get());
+    SocksServerOptions options;
+    options.policy = std::make_shared<RoutingPolicy>(
+        RoutingMode::kVpn, std::vector<std::string>(), std::vector<std::string>(),
+        std::vector<std::string>());
+    options.tunnel = connector_.get();
+    IpAddress::Parse("127.0.0.1", &options.listen_address.ip);
+    socks_ = std::make_unique<SocksServer>(thread_.loop(), std::move(options));
+    ASSERT_TRUE(socks_->Listen());
+    thread_.Start();
+  }
+
+  void TearDown() override {
+    thread_.RunSync([this]() {
+      socks_.reset();
+      connector_.reset();
+      budget_.reset();
+      pool_.reset();
+    });
+    thread_.Stop();
+  }
+
+  // Opens a SOCKS5 CONNECT to example.com:443 and returns the reply code.
+  // A non-zero |receive_buffer| shrinks the client's socket buffer, so
+  // that a client that stops reading backs up into the relay quickly.
+  int Connect(int* out_fd, int receive_buffer = 0) {
+    sockaddr_storage ss;
+    socklen_t len = socks_->local_address().ToSockaddr(&ss);
+    int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (receive_buffer) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) return -1;
+    std::string request = std::string("\x05\x01\x00", 3) + std::string("\x05\x01\x00\x03", 4) +
+                          static_cast<char>(11) + "example.com" + std::string("\x01\xbb", 2);
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string reply = Receive(fd, 2 + 10);
+    *out_fd = fd;
+    return reply.size() == 12 ? reply[3] : -1;
+  }
+
+  static std::string Receive(int fd, size_t size) {
+    std::string out(size, '\0');
+    size_t got = 0;
+    while (got < size) {
+      ssize_t n = recv(fd, &out[got], size - got, 0);
+      // Not restarted on sockets with SO_RCVTIMEO.
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += static_cast<size_t>(n);
+    }
+    out.resize(got);
+    return out;
+  }
+
+  LoopThread thread_;
+  std::unique_ptr<H2TestServer> server_;
+  std::unique_ptr<RelayBudget> budget_;
+  std::unique_ptr<Http2Pool> pool_;
+  std::unique_ptr<Http2TunnelConnector> connector_;
+  std::unique_ptr<SocksServer> socks_;
+};
+
+TEST_F(Http2TunnelTest, CarriesSocksFlowOverStream) {
+  Start(H2TestServer::Options());
+  int fd = -1;
+  ASSERT_EQ(Connect(&fd), 0);
+  std::string big(1 << 20, 'z');
+  std::thread writer([&]() { send(fd, big.data(), big.size(), MSG_NOSIGNAL); });
+  EXPECT_EQ(Receive(fd, big.size()), big);
+  writer.join();
+  close(fd);
+  EXPECT_EQ(server_->last_authority(), "example.com:443");
+  EXPECT_EQ(server_->last_credentials(), "Basic dXNlcjpzZWNyZXQ=");
+}
+
+TEST_F(Http2TunnelTest, ClosesFlowWhenEndpointRefuses) {
+  H2TestServer::Options options;
+  options.status = "403";
+  Start(options);
+  int fd = -1;
+  Connect(&fd);
+  ASSERT_GE(fd, 0);
+  // The flow was accepted locally but the stream was refused, so it ends.
+  char c;
+  EXPECT_LE(recv(fd, &c, 1, 0), 0);
+  close(fd);
+  uint64_t refused = 0;
+  thread_.RunSync([&]() { refused = connector_->stats().flows_refused; });
+  EXPECT_EQ(refused, 1u);
+}
+
+TEST_F(Http2TunnelTest, BoundsBufferedBytesWhenClientsStopReading) {
+  RelayBudgetOptions budget;
+  budget.per_flow_bytes = 64 * 1024;
+  budget.total_bytes = 128 * 1024;
+  Start(H2TestServer::Options(), &budget);
+
+  constexpr size_t kFlows = 4;
+  constexpr size_t kSize = 4 << 20;
+  std::vector<int> fds(kFlows, -1);
+  std::vector<std::string> sent(kFlows);
+  std::vector<std::thread> writers;
+  for (size_t i = 0; i < kFlows; i++) {
+    ASSERT_EQ(Connect(&fds[i], 4096), 0);
+    sent[i].assign(kSize, static_cast<char>('a' + i));
+    writers.emplace_back([&, i]() { send(fds[i], sent[i].data(), kSize, MSG_NOSIGNAL); });
+  }
+  // Nobody reads the echo until the flows have had to pause.
+  uint64_t pauses = 0;
+  for (int i = 0; i < 100 && pauses == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    thread_.RunSync([&]() { pauses = budget_->stats().pauses.load(); });
+  }
+  EXPECT_GT(pauses, 0u);
+
+  std::vector<std::string> received(kFlows);
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < kFlows; i++) {
+    readers.emplace_back([&, i]() { received[i] = Receive(fds[i], kSize); });
+  }
+  for (auto& reader : readers) reader.join();
+  for (auto& writer : writers) writer.join();
+  for (size_t i = 0; i < kFlows; i++) {
+    EXPECT_EQ(received[i], sent[i]) << i;
+    close(fds[i]);
+  }
+
+  // Each stream's window keeps its flow within the flow budget; without
+  // the budget they would hold their 256 KiB default windows.
+  uint64_t peak = 0;
+  uint64_t paused = 1;
+  thread_.RunSync([&]() {
+    peak = budget_->stats().peak_buffered_bytes.load();
+    paused = budget_->stats().paused_flows.load();
+  });
+  EXPECT_LE(peak, kFlows * budget.per_flow_bytes);
+  EXPECT_EQ(paused, 0u);
+}
+
+TEST_F(Http2TunnelTest, BoundsBufferedBytesWithSlowEndpoint) {
+  H2TestServer::Options options;
+  options.initial_window = 32 * 1024;
+  options.read_pause_ms = 2;
+  RelayBudgetOptions budget;
+  budget.per_flow_bytes = 64 * 1024;
+  Start(options, &budget);
+  int fd = -1;
+  ASSERT_EQ(Connect(&fd), 0);
+  std::string big(4 << 20, 'q');
+  std::thread writer([&]() { send(fd, big.data(), big.size(), MSG_NOSIGNAL); });
+  EXPECT_EQ(Receive(fd, big.size()), big);
+  writer.join();
+  close(fd);
+
+  // The client outpaces the endpoint by far, yet the flow never holds more
+  // than the chunk it is waiting to send.
+  uint64_t peak = 0;
+  thread_.RunSync([&]() { peak = budget_->stats().peak_buffered_bytes.load(); });
+  EXPECT_GT(peak, 0u);
+  EXPECT_LE(peak, budget.per_flow_bytes + BufferPool::kChunkSize);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
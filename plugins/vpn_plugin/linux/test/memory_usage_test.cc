@@ -0,0 +1,157 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "dns_cache.h"
+#include "dns_message.h"
+#include "domain_table.h"
+#include "memory_usage.h"
+#include "net_address.h"
+#include "record_codec.h"
+#include "upstream_cache.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+constexpr int64_t kMinuteMs = 60 * 1000;
+
+// Response to an A query for |name| with one address record.
+std::string Response(const std::string& name, uint32_t address, uint32_t ttl) {
+  DnsQuestion question;
+  question.name = name;
+  question.type = kDnsTypeA;
+  question.klass = kDnsClassIn;
+  std::string out = BuildDnsQuery(1, question);
+  out[2] = static_cast<char>(0x81);
+  out[3] = static_cast<char>(0x80);
+  out[7] = 1;
+  AppendDnsName(&out, name);
+  for (uint16_t field : {kDnsTypeA, kDnsClassIn}) {
+    out.push_back(static_cast<char>(field >> 8));
+    out.push_back(static_cast<char>(field));
+  }
+  for (int shift : {24, 16, 8, 0}) out.push_back(static_cast<char>(ttl >> shift));
+  out.push_back(0);
+  out.push_back(4);
+  for (int shift : {24, 16, 8, 0}) out.push_back(static_cast<char>(address >> shift));
+  return out;
+}
+
+// The caches a shard fills as it forwards DNS and answers list calls.
+struct Caches {
+  Caches() : dns(DnsCacheOptions{1024, 16}), domains(DomainTableOptions{4096, 16}) {}
+
+  MemoryUsage Total() const {
+    MemoryUsage total = dns.memory_usage();
+    total += domains.memory_usage();
+    total += winners.memory_usage();
+    total += packer.memory_usage();
+    return total;
+  }
+
+  DnsCache dns;
+  DomainTable domains;
+  UpstreamWinnerCache winners;
+  RecordWriter packer;
+};
+
+// One simulated minute: 100 lookups, four in five for a popular name and
+// the rest for a name never seen before, then a list reply and, on the
+// hour, a connect from one of three networks.
+void SimulateMinute(Caches* caches, int64_t minute, uint64_t* fresh_names) {
+  int64_t now_ms = minute * kMinuteMs;
+  for (int i = 0; i < 100; i++) {
+    std::string name = i % 5 == 4 ? "host" + std::to_string((*fresh_names)++) + ".example.net"
+                                   : "popular" + std::to_string((minute * 7 + i) % 300) +
+                                         ".example.com";
+    DnsQuestion question;
+    question.name = name;
+    question.type = kDnsTypeA;
+    question.klass = kDnsClassIn;
+    std::string key = DnsCache::Key(question);
+    std::string cached;
+    bool refresh = false;
+    if (caches->dns.Find(key, 1, now_ms, &cached, &refresh) == DnsCache::Result::kFresh) {
+      continue;
+    }
+    std::string response =
+        Response(name, 0x0a000000 | static_cast<uint32_t>(*fresh_names * 31 + i), 300);
+    const auto* data = reinterpret_cast<const uint8_t*>(response.data());
+    DnsMessage message;
+    ASSERT_TRUE(DnsMessage::Parse(data, response.size(), &message));
+    caches->dns.Insert(key, response, message, now_ms);
+    caches->domains.Learn(data, response.size(), message, now_ms);
+  }
+  caches->packer.Reset(2);
+  for (int i = 0; i < 50; i++) {
+    caches->packer.AddInt(i);
+    caches->packer.AddString("server" + std::to_string((minute + i) % 80));
+    caches->packer.EndRecord();
+  }
+  caches->packer.Finish();
+  if (minute % 60 == 0) {
+    SocketAddress winner;
+    SocketAddress::Parse("192.0.2.1", 443, &winner);
+    caches->winners.Record("vpn.example.com:443", "network" + std::to_string(minute / 60 % 3),
+                           winner);
+  }
+}
+
+}  // namespace
+
+TEST(MemoryUsage, CountsEntriesAndTheBytesBehindThem) {
+  Caches caches;
+  MemoryUsage empty = caches.dns.memory_usage();
+  EXPECT_EQ(empty.objects, 0u);
+  uint64_t fresh_names = 0;
+  SimulateMinute(&caches, 1, &fresh_names);
+  MemoryUsage dns = caches.dns.memory_usage();
+  EXPECT_EQ(dns.objects, caches.dns.size());
+  // Every entry holds at least its key twice and the response.
+  EXPECT_GT(dns.bytes, empty.bytes + dns.objects * 2 * 20);
+  EXPECT_EQ(caches.domains.memory_usage().objects, caches.domains.size());
+  EXPECT_EQ(caches.packer.memory_usage().objects, 50u);
+  EXPECT_EQ(caches.winners.memory_usage().objects, 0u);
+
+  MemoryUsage slabs = BufferPool::ProcessMemoryUsage();
+  {
+    BufferPool pool;
+    void* block = pool.Allocate(1000);
+    ASSERT_NE(block, nullptr);
+    MemoryUsage mapped = BufferPool::ProcessMemoryUsage();
+    EXPECT_EQ(mapped.objects, slabs.objects + 1);
+    EXPECT_EQ(mapped.bytes, slabs.bytes + BufferPool::kSlabSize);
+    BufferPool::Free(block);
+  }
+  EXPECT_EQ(BufferPool::ProcessMemoryUsage().bytes, slabs.bytes);
+}
+
+// A day of traffic at one minute per step. Once the caches have filled,
+// their footprint has to stay put: growth after that is a leak or a bound
+// that does not hold.
+TEST(MemoryUsage, StaysFlatOverADayOfTraffic) {
+  Caches caches;
+  uint64_t fresh_names = 0;
+  std::vector<size_t> hourly;
+  for (int64_t minute = 1; minute <= 24 * 60; minute++) {
+    SimulateMinute(&caches, minute, &fresh_names);
+    if (HasFatalFailure()) return;
+    if (minute % 60 == 0) hourly.push_back(caches.Total().bytes);
+  }
+  EXPECT_LE(caches.dns.size(), 1024u);
+  EXPECT_LE(caches.domains.size(), caches.domains.capacity());
+  EXPECT_EQ(caches.winners.size(), 3u);
+
+  size_t warm = *std::max_element(hourly.begin() + 6, hourly.begin() + 12);
+  size_t late = *std::max_element(hourly.begin() + 12, hourly.end());
+  EXPECT_LE(late, warm + warm / 20) << "warm " << warm << " late " << late;
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "method_dispatcher.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Keeps a CPU busy for |ms|, like parsing a large rule set.
+void Spin(int64_t ms) {
+  int64_t end = NowUs() + ms * 1000;
+  volatile uint64_t sink = 0;
+  while (NowUs() < end) {
+    for (int i = 0; i < 1000; i++) sink = sink + static_cast<uint64_t>(i);
+  }
+}
+
+}  // namespace
+
+TEST(MethodTable, FindsEveryNameAndNothingElse) {
+  std::vector<std::string> names = {"addNewProfile", "getAllProfiles", "setDefaultRoutingMode",
+                                    "setProfileName", "setRules", "removeAllRules"};
+  MethodTable table(names);
+  for (size_t i = 0; i < names.size(); i++) {
+    EXPECT_EQ(table.Find(names[i].c_str()), static_cast<int>(i)) << names[i];
+  }
+  EXPECT_EQ(table.Find("setRule"), -1);
+  EXPECT_EQ(table.Find("setRulesX"), -1);
+  EXPECT_EQ(table.Find(""), -1);
+  EXPECT_EQ(table.Find(nullptr), -1);
+
+  std::vector<std::string> many;
+  for (int i = 0; i < 300; i++) many.push_back("method" + std::to_string(i));
+  MethodTable large(many);
+  for (size_t i = 0; i < many.size(); i++) {
+    ASSERT_EQ(large.Find(many[i].c_str()), static_cast<int>(i)) << many[i];
+  }
+  EXPECT_EQ(large.Find("method300"), -1);
+}
+
+TEST(MethodTable, FindsARepeatedNameAtItsFirstIndex) {
+  MethodTable table({"start", "stop", "start", "getCurrentState", "stop"});
+  EXPECT_EQ(table.Find("start"), 0);
+  EXPECT_EQ(table.Find("stop"), 1);
+  EXPECT_EQ(table.Find("getCurrentState"), 3);
+  EXPECT_EQ(table.Find("restart"), -1);
+}
+
+TEST(MethodDispatcher, KeepsOrderWithinALane) {
+  constexpr uint32_t kLanes = 4;
+  constexpr int kCalls = 500;
+  std::vector<int> seen[kLanes];
+  std::atomic<int> running[kLanes] = {};
+  std::atomic<bool> overlapped{false};
+  {
+    MethodDispatcherOptions options;
+    options.workers = 3;
+    MethodDispatcher dispatcher(options);
+    for (int i = 0; i < kCalls; i++) {
+      for (uint32_t lane = 0; lane < kLanes; lane++) {
+        dispatcher.Post(lane, [&, lane, i]() {
+          if (running[lane]++ != 0) overlapped = true;
+          seen[lane].push_back(i);
+          running[lane]--;
+        });
+      }
+    }
+    dispatcher.Drain();
+    EXPECT_EQ(dispatcher.stats().calls, kLanes * kCalls);
+  }
+  EXPECT_FALSE(overlapped);
+  for (uint32_t lane = 0; lane < kLanes; lane++) {
+    ASSERT_EQ(seen[lane].size(), static_cast<size_t>(kCalls));
+    EXPECT_TRUE(std::is_sorted(seen[lane].begin(), seen[lane].end())) << lane;
+  }
+}
+
+TEST(MethodDispatcher, DestructorRunsQueuedCalls) {
+  std::atomic<int> ran{0};
+  {
+    MethodDispatcher dispatcher;
+    for (int i = 0; i < 20; i++) {
+      dispatcher.Post(0, [&ran]() {
+        Spin(1);
+        ran++;
+      });
+    }
+  }
+  EXPECT_EQ(ran, 20);
+}
+
+// The frame loop keeps its pace while heavy calls run on the workers and
+// their replies come back to it as posted tasks, the way the plugin's
+// replies go back to the GTK main loop.
+TEST(MethodDispatcher, FrameLoopStaysResponsiveDuringHeavyCalls) {
+  constexpr int kCalls = 8;
+  EventLoop loop;
+  MethodDispatcher dispatcher;
+  int replies = 0;
+  std::vector<int> order;
+  for (int i = 0; i < kCalls; i++) {
+    dispatcher.Post(static_cast<uint32_t>(i % 4), [&loop, &replies, &order, i]() {
+      Spin(40);
+      loop.Post([&replies, &order, i]() {
+        order.push_back(i);
+        replies++;
+      });
+    });
+  }
+
+  // A vsync thread asks for a frame every millisecond; latency is how long
+  // the loop takes to get to it.
+  std::atomic<bool> stop{false};
+  int64_t worst_us = 0;
+  int frames = 0;
+  std::thread vsync([&]() {
+    while (!stop) {
+      int64_t asked = NowUs();
+      loop.Post([&, asked]() {
+        frames++;
+        worst_us = std::max(worst_us, NowUs() - asked);
+      });
+      usleep(1000);
+    }
+  });
+  int64_t deadline = EventLoop::NowMs() + 10000;
+  while (replies < kCalls && EventLoop::NowMs() < deadline) loop.RunOnce(5);
+  stop = true;
+  vsync.join();
+  loop.RunOnce(0);
+
+  ASSERT_EQ(replies, kCalls);
+  EXPECT_GT(frames, 50);
+  EXPECT_LT(worst_us, 2000) << "frames " << frames;
+  // Calls sharing a lane replied in order.
+  for (int lane = 0; lane < 4; lane++) {
+    auto first = std::find(order.begin(), order.end(), lane);
+    auto second = std::find(order.begin(), order.end(), lane + 4);
+    EXPECT_LT(first, second) << lane;
+  }
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
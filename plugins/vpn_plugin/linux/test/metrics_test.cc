@@ -0,0 +1,138 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config_document.h"
+#include "metrics.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream in(path);
+  std::stringstream data;
+  data << in.rdbuf();
+  return data.str();
+}
+
+}  // namespace
+
+TEST(Metrics, CountsFromManyThreads) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&counter]() {
+      for (int i = 0; i < 10000; i++) counter.Add();
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(counter.value(), 40000u);
+}
+
+TEST(Metrics, HistogramBucketsStayWithinTheirPrecision) {
+  size_t last = 0;
+  for (int64_t v = 0; v < (int64_t{1} << 20); v += 1 + v / 97) {
+    size_t index = Histogram::BucketIndex(v);
+    ASSERT_LT(index, Histogram::kBuckets);
+    ASSERT_GE(index, last) << v;
+    last = index;
+    int64_t high = Histogram::BucketHigh(index);
+    ASSERT_GE(high, v);
+    ASSERT_LE(high - v, v / 32) << v;
+    // The bucket above starts right after this one ends.
+    ASSERT_EQ(Histogram::BucketIndex(high + 1), index + 1) << v;
+  }
+  EXPECT_EQ(Histogram::BucketIndex(Histogram::kMaxValue), Histogram::kBuckets - 1);
+  EXPECT_EQ(Histogram::BucketIndex(INT64_MAX), Histogram::kBuckets - 1);
+  EXPECT_EQ(Histogram::BucketIndex(-5), 0u);
+}
+
+TEST(Metrics, ReportsPercentilesCountSumAndMax) {
+  Histogram histogram;
+  for (int64_t v = 1; v <= 10000; v++) histogram.Record(v);
+  HistogramSnapshot snapshot = histogram.Snapshot();
+  EXPECT_EQ(snapshot.count(), 10000u);
+  EXPECT_EQ(snapshot.sum(), 10000 * 10001 / 2);
+  EXPECT_EQ(snapshot.max(), 10000);
+  EXPECT_NEAR(snapshot.Percentile(0.5), 5000, 5000 / 32);
+  EXPECT_NEAR(snapshot.Percentile(0.99), 9900, 9900 / 32);
+  EXPECT_EQ(snapshot.Percentile(1.0), 10000);
+  EXPECT_EQ(snapshot.Percentile(0.0), 1);
+  EXPECT_EQ(snapshot.CountAtOrBelow(1023), 1023u);
+  EXPECT_EQ(Histogram().Snapshot().Percentile(0.5), 0);
+}
+
+TEST(Metrics, WritesPrometheusText) {
+  MetricsRegistry registry;
+  registry.GetCounter("vpn_test_total", "Things counted.")->Add(3);
+  registry.GetGauge("vpn_test_depth", "Queue depth.")->Set(-2);
+  Histogram* start = registry.GetHistogram("vpn_test_us", "Call time.", "method=\"start\"");
+  Histogram* stop = registry.GetHistogram("vpn_test_us", "Call time.", "method=\"stop\"");
+  EXPECT_EQ(registry.GetHistogram("vpn_test_us", "", "method=\"start\""), start);
+  start->Record(0);
+  start->Record(2);
+  start->Record(5);
+  stop->Record(1);
+  // Another type under a taken name is not exported.
+  registry.GetGauge("vpn_test_total", "Clash.")->Set(7);
+
+  EXPECT_EQ(registry.PrometheusText(),
+            "# HELP vpn_test_depth Queue depth.\n"
+            "# TYPE vpn_test_depth gauge\n"
+            "vpn_test_depth -2\n"
+            "# HELP vpn_test_total Things counted.\n"
+            "# TYPE vpn_test_total counter\n"
+            "vpn_test_total 3\n"
+            "# HELP vpn_test_us Call time.\n"
+            "# TYPE vpn_test_us histogram\n"
+            "vpn_test_us_bucket{method=\"start\",le=\"0\"} 1\n"
+            "vpn_test_us_bucket{method=\"start\",le=\"1\"} 1\n"
+            "vpn_test_us_bucket{method=\"start\",le=\"3\"} 2\n"
+            "vpn_test_us_bucket{method=\"start\",le=\"7\"} 3\n"
+            "vpn_test_us_bucket{method=\"start\",le=\"+Inf\"} 3\n"
+            "vpn_test_us_sum{method=\"start\"} 7\n"
+            "vpn_test_us_count{method=\"start\"} 3\n"
+            "vpn_test_us_bucket{method=\"stop\",le=\"0\"} 0\n"
+            "vpn_test_us_bucket{method=\"stop\",le=\"1\"} 1\n"
+            "vpn_test_us_bucket{method=\"stop\",le=\"+Inf\"} 1\n"
+            "vpn_test_us_sum{method=\"stop\"} 1\n"
+            "vpn_test_us_count{method=\"stop\"} 1\n");
+}
+
+TEST(Metrics, RewritesTheTextfileUntilDestroyed) {
+  ConfigDocument config;
+  std::string error;
+  std::string path = ::testing::TempDir() + "vpn_metrics_" + std::to_string(getpid()) + ".prom";
+  ASSERT_TRUE(ConfigDocument::Parse("[metrics]\ntextfile = \"" + path + "\"\ninterval = 0\n",
+                                    &config, &error))
+      << error;
+  MetricsOptions options = MetricsOptions::FromConfig(config);
+  EXPECT_EQ(options.textfile, path);
+  EXPECT_EQ(options.interval_ms, 1000);
+
+  MetricsRegistry registry;
+  Counter* counter = registry.GetCounter("vpn_test_total", "Things counted.");
+  {
+    MetricsFileWriter writer(&registry, options);
+    counter->Add(5);
+  }
+  // The last write happens on destruction, after the add.
+  EXPECT_NE(ReadFile(path).find("vpn_test_total 5\n"), std::string::npos);
+  EXPECT_NE(access(path.c_str(), R_OK), -1);
+  EXPECT_EQ(access((path + ".tmp").c_str(), F_OK), -1);
+  unlink(path.c_str());
+
+  MetricsFileWriter idle(&registry, MetricsOptions{});
+  EXPECT_EQ(idle.writes(), 0u);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,75 @@
+#ifndef FLUTTER_PLUGIN_TEST_PACKET_BUILDER_H_
+#define FLUTTER_PLUGIN_TEST_PACKET_BUILDER_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "net_address.h"
+#include "packet_headers.h"
+
+namespace vpn_plugin {
+namespace test {
+
+// Builds raw IPv4/IPv6 TCP and UDP packets for tests and replay harnesses.
+// Checksums are left at zero; nothing in the pipeline verifies them.
+struct PacketSpec {
+  std::string src = "10.0.0.2";
+  std::string dst = "93.184.216.34";
+  uint8_t protocol = kIpProtoTcp;
+  uint16_t src_port = 40000;
+  uint16_t dst_port = 443;
+  uint8_t tcp_flags = kTcpFlagAck;
+  size_t payload = 0;
+  // TCP options appended after the fixed header; must be a multiple of 4.
+  std::vector<uint8_t> tcp_options;
+};
+
+inline void PutU16(std::vector<uint8_t>* out, size_t offset, uint16_t value) {
+  (*out)[offset] = static_cast<uint8_t>(value >> 8);
+  (*out)[offset + 1] = static_cast<uint8_t>(value);
+}
+
+inline std::vector<uint8_t> BuildPacket(const PacketSpec& spec) {
+  IpAddress src, dst;
+  IpAddress::Parse(spec.src, &src);
+  IpAddress::Parse(spec.dst, &dst);
+  size_t ip_header = src.is_v4() ? 20 : 40;
+  size_t l4_header = spec.protocol == kIpProtoTcp ? 20 + spec.tcp_options.size() : 8;
+  size_t total = ip_header + l4_header + spec.payload;
+  std::vector<uint8_t> out(total, 0);
+  if (src.is_v4()) {
+    out[0] = 0x45;
+    PutU16(&out, 2, static_cast<uint16_t>(total));
+    out[8] = 64;
+    out[9] = spec.protocol;
+    memcpy(&out[12], src.bytes, 4);
+    memcpy(&out[16], dst.bytes, 4);
+  } else {
+    out[0] = 0x60;
+    PutU16(&out, 4, static_cast<uint16_t>(total - 40));
+    out[6] = spec.protocol;
+    out[7] = 64;
+    memcpy(&out[8], src.bytes, 16);
+    memcpy(&out[24], dst.bytes, 16);
+  }
+  PutU16(&out, ip_header, spec.src_port);
+  PutU16(&out, ip_header + 2, spec.dst_port);
+  if (spec.protocol == kIpProtoTcp) {
+    out[ip_header + 12] = static_cast<uint8_t>((l4_header / 4) << 4);
+    out[ip_header + 13] = spec.tcp_flags;
+    PutU16(&out, ip_header + 14, 65535);
+    for (size_t i = 0; i < spec.tcp_options.size(); i++) {
+      out[ip_header + 20 + i] = spec.tcp_options[i];
+    }
+  } else {
+    PutU16(&out, ip_header + 4, static_cast<uint16_t>(l4_header + spec.payload));
+  }
+  return out;
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TEST_PACKET_BUILDER_H_
@@ -0,0 +1,486 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config_document.h"
+#include "packet_headers.h"
+#include "packet_pipeline.h"
+#include "path_mtu.h"
+#include "pcap_file.h"
+#include "routing_policy.h"
+#include "test/packet_builder.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+iovec ToIovec(std::vector<uint8_t>& packet) {
+  iovec iov;
+  iov.iov_base = packet.data();
+  iov.iov_len = packet.size();
+  return iov;
+}
+
+// Sum of the TCP, UDP or ICMPv6 pseudo-header; ICMPv4 has none.
+uint32_t PseudoHeaderSum(const uint8_t* packet, const PacketHeaders& headers) {
+  if (headers.protocol == kIpProtoIcmp) return 0;
+  size_t length = headers.total_length - headers.l4_offset;
+  bool v4 = headers.src.is_v4();
+  uint32_t sum = ChecksumAdd(packet + (v4 ? 12 : 8), v4 ? 8 : 32);
+  return sum + static_cast<uint32_t>(length) + headers.protocol;
+}
+
+void SetL4Checksum(std::vector<uint8_t>* packet) {
+  PacketHeaders headers;
+  ASSERT_TRUE(ParsePacketHeaders(packet->data(), packet->size(), &headers));
+  uint8_t* l4 = packet->data() + headers.l4_offset;
+  size_t offset = headers.protocol == kIpProtoTcp ? 16 : 6;
+  l4[offset] = l4[offset + 1] = 0;
+  uint16_t sum = ChecksumFinish(ChecksumAdd(l4, headers.total_length - headers.l4_offset,
+                                            PseudoHeaderSum(packet->data(), headers)));
+  l4[offset] = static_cast<uint8_t>(sum >> 8);
+  l4[offset + 1] = static_cast<uint8_t>(sum);
+}
+
+bool L4ChecksumValid(const uint8_t* packet, size_t size) {
+  PacketHeaders headers;
+  if (!ParsePacketHeaders(packet, size, &headers)) return false;
+  return ChecksumFinish(ChecksumAdd(packet + headers.l4_offset,
+                                    headers.total_length - headers.l4_offset,
+                                    PseudoHeaderSum(packet, headers))) == 0;
+}
+
+uint16_t Mss(const std::vector<uint8_t>& packet, size_t option_offset) {
+  size_t at = (packet[0] >> 4 == 4 ? 20 : 40) + 20 + option_offset + 2;
+  return static_cast<uint16_t>(packet[at] << 8 | packet[at + 1]);
+}
+
+// Link with a small MTU that also loses a share of the packets that fit,
+// picked by a fixed pseudo-random sequence. What gets across is captured.
+class LossyLink {
+ public:
+  LossyLink(int mtu, int loss_percent) : mtu_(mtu), loss_percent_(loss_percent) {}
+
+  bool Send(const std::vector<uint8_t>& packet) {
+    seed_ = seed_ * 1103515245 + 12345;
+    bool lost = static_cast<int>((seed_ >> 16) % 100) < loss_percent_;
+    if (static_cast<int>(packet.size()) > mtu_ || lost) return false;
+    delivered_.Add(packet.data(), packet.size());
+    return true;
+  }
+
+  const PcapCapture& delivered() const { return delivered_; }
+
+ private:
+  int mtu_;
+  int loss_percent_;
+  uint32_t seed_ = 1;
+  PcapCapture delivered_;
+};
+
+// A UDP datagram of |size| bytes in total, as DPLPMTUD probes are padded.
+std::vector<uint8_t> Probe(int size) {
+  PacketSpec spec;
+  spec.protocol = kIpProtoUdp;
+  spec.dst_port = 4433;
+  spec.payload = static_cast<size_t>(size) - 28;
+  return BuildPacket(spec);
+}
+
+}  // namespace
+
+TEST(PacketHeaders, ParsesTcpAndUdp) {
+  PacketSpec spec;
+  spec.tcp_flags = kTcpFlagSyn;
+  spec.payload = 10;
+  auto tcp = BuildPacket(spec);
+  PacketHeaders headers;
+  ASSERT_TRUE(ParsePacketHeaders(tcp.data(), tcp.size(), &headers));
+  EXPECT_EQ(headers.src.ToString(), "10.0.0.2");
+  EXPECT_EQ(headers.dst.ToString(), "93.184.216.34");
+  EXPECT_EQ(headers.protocol, kIpProtoTcp);
+  EXPECT_EQ(headers.src_port, 40000);
+  EXPECT_EQ(headers.dst_port, 443);
+  EXPECT_EQ(headers.tcp_flags, kTcpFlagSyn);
+  EXPECT_EQ(headers.payload_offset, 40);
+  EXPECT_EQ(headers.total_length, 50);
+
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  spec.protocol = kIpProtoUdp;
+  spec.dst_port = 53;
+  auto udp = BuildPacket(spec);
+  ASSERT_TRUE(ParsePacketHeaders(udp.data(), udp.size(), &headers));
+  EXPECT_TRUE(headers.dst.is_v6());
+  EXPECT_EQ(headers.protocol, kIpProtoUdp);
+  EXPECT_EQ(headers.dst_port, 53);
+  EXPECT_EQ(headers.payload_offset, 48);
+}
+
+TEST(PacketHeaders, WalksIpv6ExtensionHeaders) {
+  PacketSpec spec;
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  spec.protocol = kIpProtoUdp;
+  auto plain = BuildPacket(spec);
+  // Insert an 8-byte hop-by-hop header in front of the UDP header.
+  std::vector<uint8_t> packet(plain.begin(), plain.begin() + 40);
+  packet[6] = 0;
+  packet.insert(packet.end(), {kIpProtoUdp, 0, 1, 4, 0, 0, 0, 0});
+  packet.insert(packet.end(), plain.begin() + 40, plain.end());
+  PutU16(&packet, 4, static_cast<uint16_t>(packet.size() - 40));
+  PacketHeaders headers;
+  ASSERT_TRUE(ParsePacketHeaders(packet.data(), packet.size(), &headers));
+  EXPECT_EQ(headers.protocol, kIpProtoUdp);
+  EXPECT_EQ(headers.l4_offset, 48);
+  EXPECT_EQ(headers.dst_port, 443);
+}
+
+TEST(PacketHeaders, RejectsMalformedPackets) {
+  auto packet = BuildPacket(PacketSpec());
+  PacketHeaders headers;
+  EXPECT_FALSE(ParsePacketHeaders(packet.data(), 19, &headers));
+  // Total length larger than the buffer.
+  EXPECT_FALSE(ParsePacketHeaders(packet.data(), packet.size() - 1, &headers));
+  // TCP data offset pointing past the packet.
+  packet[20 + 12] = 0xf0;
+  EXPECT_FALSE(ParsePacketHeaders(packet.data(), packet.size(), &headers));
+  uint8_t garbage[40] = {0x50};
+  EXPECT_FALSE(ParsePacketHeaders(garbage, sizeof(garbage), &headers));
+
+  // Non-first fragments parse, without ports.
+  auto fragment = BuildPacket(PacketSpec());
+  PutU16(&fragment, 6, 0x0010);
+  ASSERT_TRUE(ParsePacketHeaders(fragment.data(), fragment.size(), &headers));
+  EXPECT_TRUE(headers.fragment);
+  EXPECT_EQ(headers.dst_port, 0);
+}
+
+TEST(PacketPipeline, ClassifiesBatchAndCachesFlows) {
+  PacketPipelineOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(
+      RoutingMode::kVpn, std::vector<std::string>{"192.168.1.0/24", "1.1.1.1:53"},
+      std::vector<std::string>{}, std::vector<std::string>{"10.0.0.0/8"});
+  options.included_routes.resize(1);
+  IpNetwork::Parse("0.0.0.0/0", &options.included_routes[0]);
+  options.mtu = 1280;
+  PacketPipeline pipeline(options);
+
+  PacketSpec spec;
+  std::vector<std::vector<uint8_t>> packets;
+  packets.push_back(BuildPacket(spec));  // Tunnel.
+  packets.push_back(BuildPacket(spec));  // Same flow.
+  spec.dst = "192.168.1.20";
+  packets.push_back(BuildPacket(spec));  // Bypass rule.
+  spec.dst = "10.2.3.4";
+  packets.push_back(BuildPacket(spec));  // Excluded route.
+  spec.dst = "1.1.1.1";
+  spec.protocol = kIpProtoUdp;
+  spec.dst_port = 53;
+  packets.push_back(BuildPacket(spec));  // Address and port rule.
+  spec.dst_port = 443;
+  packets.push_back(BuildPacket(spec));  // Same address, other port.
+  spec.payload = 1300;
+  packets.push_back(BuildPacket(spec));  // Larger than the MTU.
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  spec.payload = 0;
+  packets.push_back(BuildPacket(spec));  // Outside the included routes.
+  packets.push_back(std::vector<uint8_t>(8, 0x45));
+
+  std::vector<iovec> iovs;
+  for (auto& packet : packets) iovs.push_back(ToIovec(packet));
+  std::vector<PacketVerdict> verdicts(iovs.size());
+  pipeline.Process(iovs.data(), iovs.size(), verdicts.data());
+
+  EXPECT_EQ(verdicts[0], PacketVerdict::kTunnel);
+  EXPECT_EQ(verdicts[1], PacketVerdict::kTunnel);
+  EXPECT_EQ(verdicts[2], PacketVerdict::kBypass);
+  EXPECT_EQ(verdicts[3], PacketVerdict::kBypass);
+  EXPECT_EQ(verdicts[4], PacketVerdict::kBypass);
+  EXPECT_EQ(verdicts[5], PacketVerdict::kTunnel);
+  EXPECT_EQ(verdicts[6], PacketVerdict::kDrop);
+  EXPECT_EQ(verdicts[7], PacketVerdict::kDrop);
+  EXPECT_EQ(verdicts[8], PacketVerdict::kDrop);
+
+  const auto& stats = pipeline.stats();
+  EXPECT_EQ(stats.packets, 9u);
+  EXPECT_EQ(stats.flow_hits, 1u);
+  EXPECT_EQ(stats.flow_misses, 6u);
+  EXPECT_EQ(stats.dropped_oversize, 1u);
+  EXPECT_EQ(stats.dropped_malformed, 1u);
+  EXPECT_EQ(stats.dropped_unrouted, 1u);
+  EXPECT_EQ(pipeline.flow_count(), 6u);
+}
+
+TEST(PacketPipeline, ReadsTunSettingsFromConfig) {
+  ConfigDocument doc;
+  ASSERT_TRUE(ConfigDocument::Parse(
+      "vpn_mode = \"selective\"\n"
+      "exclusions = [\"8.8.8.8\"]\n"
+      "[listener.tun]\n"
+      "included_routes = [\"0.0.0.0/0\", \"2000::/3\"]\n"
+      "excluded_routes = [\"8.8.8.0/24\"]\n"
+      "mtu_size = 1280\n",
+      &doc, nullptr));
+  auto options = PacketPipelineOptions::FromConfig(doc);
+  EXPECT_EQ(options.mtu, 1280);
+  EXPECT_EQ(options.included_routes.size(), 2u);
+  PacketPipeline pipeline(options);
+
+  PacketSpec spec;
+  spec.dst = "8.8.4.4";
+  auto other = BuildPacket(spec);
+  spec.dst = "8.8.8.8";
+  auto excluded = BuildPacket(spec);
+  iovec iovs[] = {ToIovec(other), ToIovec(excluded)};
+  PacketVerdict verdicts[2];
+  pipeline.Process(iovs, 2, verdicts);
+  // Selective mode only tunnels the exclusions, but excluded routes win.
+  EXPECT_EQ(verdicts[0], PacketVerdict::kBypass);
+  EXPECT_EQ(verdicts[1], PacketVerdict::kBypass);
+}
+
+TEST(PcapCapture, RoundTripsAndStripsLinkLayer) {
+  PcapCapture capture;
+  auto a = BuildPacket(PacketSpec());
+  PacketSpec spec;
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  auto b = BuildPacket(spec);
+  capture.Add(a.data(), a.size());
+  capture.Add(b.data(), b.size());
+  std::string raw = capture.Serialize();
+
+  PcapCapture parsed;
+  std::string error;
+  ASSERT_TRUE(PcapCapture::Parse(reinterpret_cast<const uint8_t*>(raw.data()), raw.size(),
+                                 &parsed, &error))
+      << error;
+  ASSERT_EQ(parsed.size(), 2u);
+  EXPECT_EQ(parsed.packet(1).iov_len, b.size());
+
+  // The same packets behind Ethernet (one with a VLAN tag) plus an ARP frame.
+  std::string ether = raw.substr(0, 24);
+  ether[20] = PcapCapture::kLinkTypeEthernet;
+  auto add_record = [&ether](const std::string& frame) {
+    uint32_t header[4] = {0, 0, static_cast<uint32_t>(frame.size()),
+                          static_cast<uint32_t>(frame.size())};
+    ether.append(reinterpret_cast<const char*>(header), sizeof(header));
+    ether += frame;
+  };
+  std::string macs(12, '\x11');
+  add_record(macs + std::string("\x08\x00", 2) + std::string(a.begin(), a.end()));
+  add_record(macs + std::string("\x81\x00\x00\x05\x86\xdd", 6) + std::string(b.begin(), b.end()));
+  add_record(macs + std::string("\x08\x06", 2) + std::string(28, '\0'));
+  ASSERT_TRUE(PcapCapture::Parse(reinterpret_cast<const uint8_t*>(ether.data()), ether.size(),
+                                 &parsed, &error))
+      << error;
+  ASSERT_EQ(parsed.size(), 2u);
+  EXPECT_EQ(parsed.skipped(), 1u);
+  PacketHeaders headers;
+  iovec v6 = parsed.packet(1);
+  ASSERT_TRUE(ParsePacketHeaders(static_cast<const uint8_t*>(v6.iov_base), v6.iov_len, &headers));
+  EXPECT_EQ(headers.dst.ToString(), "2001:db8::1");
+
+  EXPECT_FALSE(PcapCapture::Parse(reinterpret_cast<const uint8_t*>("\x0a\x0d\x0d\x0a"), 4,
+                                  &parsed, &error));
+}
+
+TEST(PacketPipeline, ClampsMssAndAnswersOversizePackets) {
+  PacketPipelineOptions options;
+  options.mtu = 1400;
+  std::vector<std::vector<uint8_t>> replies;
+  options.on_reply = [&replies](const uint8_t* packet, size_t size) {
+    replies.emplace_back(packet, packet + size);
+  };
+  PacketPipeline pipeline(options);
+
+  std::vector<std::vector<uint8_t>> packets;
+  PacketSpec spec;
+  spec.tcp_flags = kTcpFlagSyn;
+  spec.tcp_options = {2, 4, 0x05, 0xb4};  // MSS 1460.
+  packets.push_back(BuildPacket(spec));
+  // The MSS behind a NOP, so it straddles checksum words.
+  spec.tcp_options = {1, 2, 4, 0x05, 0xb4, 1, 1, 0};
+  packets.push_back(BuildPacket(spec));
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  spec.tcp_options = {2, 4, 0x05, 0xa0};  // MSS 1440.
+  packets.push_back(BuildPacket(spec));
+  spec.tcp_options = {2, 4, 0x01, 0x00};  // MSS 256 is left alone.
+  packets.push_back(BuildPacket(spec));
+  spec.tcp_flags = kTcpFlagAck;
+  spec.tcp_options.clear();
+  spec.payload = 1400;
+  packets.push_back(BuildPacket(spec));  // Too big, IPv6.
+  spec.src = "10.0.0.2";
+  spec.dst = "93.184.216.34";
+  packets.push_back(BuildPacket(spec));  // Too big, IPv4 with DF.
+  packets.back()[6] = 0x40;
+  packets.push_back(BuildPacket(spec));  // Too big, may be fragmented.
+  for (auto& packet : packets) SetL4Checksum(&packet);
+
+  std::vector<iovec> iovs;
+  for (auto& packet : packets) iovs.push_back(ToIovec(packet));
+  std::vector<PacketVerdict> verdicts(iovs.size());
+  pipeline.Process(iovs.data(), iovs.size(), verdicts.data());
+
+  EXPECT_EQ(Mss(packets[0], 0), 1360);
+  EXPECT_EQ(Mss(packets[1], 1), 1360);
+  EXPECT_EQ(Mss(packets[2], 0), 1340);
+  EXPECT_EQ(Mss(packets[3], 0), 256);
+  for (size_t i = 0; i < 4; i++) {
+    EXPECT_TRUE(L4ChecksumValid(packets[i].data(), packets[i].size())) << i;
+  }
+  EXPECT_EQ(verdicts[4], PacketVerdict::kDrop);
+  EXPECT_EQ(verdicts[5], PacketVerdict::kDrop);
+  EXPECT_EQ(verdicts[6], PacketVerdict::kDrop);
+
+  ASSERT_EQ(replies.size(), 2u);
+  // ICMPv6 packet too big from the destination, quoting the packet.
+  PacketHeaders headers;
+  ASSERT_TRUE(ParsePacketHeaders(replies[0].data(), replies[0].size(), &headers));
+  EXPECT_EQ(headers.protocol, kIpProtoIcmpV6);
+  EXPECT_EQ(headers.src.ToString(), "2001:db8::1");
+  EXPECT_EQ(headers.dst.ToString(), "fd00::2");
+  EXPECT_LE(replies[0].size(), kMaxTooBigSize);
+  EXPECT_TRUE(L4ChecksumValid(replies[0].data(), replies[0].size()));
+  const uint8_t* icmp = replies[0].data() + headers.l4_offset;
+  EXPECT_EQ(icmp[0], 2);
+  EXPECT_EQ(icmp[6] << 8 | icmp[7], 1400);
+  EXPECT_EQ(memcmp(icmp + 8, packets[4].data(), 40), 0);
+  // ICMP fragmentation needed, with the next-hop MTU.
+  ASSERT_TRUE(ParsePacketHeaders(replies[1].data(), replies[1].size(), &headers));
+  EXPECT_EQ(headers.protocol, kIpProtoIcmp);
+  EXPECT_EQ(headers.dst.ToString(), "10.0.0.2");
+  EXPECT_EQ(ChecksumFinish(ChecksumAdd(replies[1].data(), 20)), 0);
+  EXPECT_TRUE(L4ChecksumValid(replies[1].data(), replies[1].size()));
+  icmp = replies[1].data() + headers.l4_offset;
+  EXPECT_EQ(icmp[0], 3);
+  EXPECT_EQ(icmp[1], 4);
+  EXPECT_EQ(icmp[6] << 8 | icmp[7], 1400);
+
+  const auto& stats = pipeline.stats();
+  EXPECT_EQ(stats.mss_clamped, 3u);
+  EXPECT_EQ(stats.too_big_replies, 2u);
+  EXPECT_EQ(stats.dropped_oversize, 3u);
+  EXPECT_EQ(stats.dropped_oversize_unanswered, 1u);
+  EXPECT_EQ(stats.effective_mtu, 1400u);
+}
+
+TEST(PacketPipeline, CarriesIpv6UpToItsMinimumMtu) {
+  PacketPipelineOptions options;
+  std::vector<std::vector<uint8_t>> replies;
+  options.on_reply = [&replies](const uint8_t* packet, size_t size) {
+    replies.emplace_back(packet, packet + size);
+  };
+  PacketPipeline pipeline(options);
+  pipeline.SetPathMtu(1000);
+
+  std::vector<std::vector<uint8_t>> packets;
+  PacketSpec spec;
+  spec.tcp_flags = kTcpFlagAck;
+  spec.src = "fd00::2";
+  spec.dst = "2001:db8::1";
+  spec.payload = 1100;
+  packets.push_back(BuildPacket(spec));  // Over the path MTU, under 1280.
+  spec.payload = 1300;
+  packets.push_back(BuildPacket(spec));  // Over 1280.
+  spec.src = "10.0.0.2";
+  spec.dst = "93.184.216.34";
+  spec.payload = 1100;
+  packets.push_back(BuildPacket(spec));
+  packets.back()[6] = 0x40;
+  for (auto& packet : packets) SetL4Checksum(&packet);
+
+  std::vector<iovec> iovs;
+  for (auto& packet : packets) iovs.push_back(ToIovec(packet));
+  std::vector<PacketVerdict> verdicts(iovs.size());
+  pipeline.Process(iovs.data(), iovs.size(), verdicts.data());
+
+  EXPECT_EQ(verdicts[0], PacketVerdict::kTunnel);
+  EXPECT_EQ(verdicts[1], PacketVerdict::kDrop);
+  EXPECT_EQ(verdicts[2], PacketVerdict::kDrop);
+  // Every drop is answered, IPv6 with no less than its minimum.
+  ASSERT_EQ(replies.size(), 2u);
+  PacketHeaders headers;
+  ASSERT_TRUE(ParsePacketHeaders(replies[0].data(), replies[0].size(), &headers));
+  const uint8_t* icmp = replies[0].data() + headers.l4_offset;
+  EXPECT_EQ(icmp[6] << 8 | icmp[7], 1280);
+  ASSERT_TRUE(ParsePacketHeaders(replies[1].data(), replies[1].size(), &headers));
+  icmp = replies[1].data() + headers.l4_offset;
+  EXPECT_EQ(icmp[6] << 8 | icmp[7], 1000);
+  EXPECT_EQ(pipeline.stats().dropped_oversize, 2u);
+  EXPECT_EQ(pipeline.stats().dropped_oversize_unanswered, 0u);
+}
+
+TEST(PmtuSearch, ConvergesOnLossyLowMtuLink) {
+  // A 1380-byte path that drops one packet in ten.
+  LossyLink link(1380, 10);
+  PmtuSearch search;
+  while (int size = search.NextProbe()) {
+    if (link.Send(Probe(size))) {
+      search.OnProbeAcked(size);
+    } else {
+      search.OnProbeLost(size);
+    }
+    ASSERT_LT(search.probes(), 100u);
+  }
+  EXPECT_EQ(search.state(), PmtuState::kSearchComplete);
+  EXPECT_LE(search.mtu(), 1380);
+  EXPECT_GT(search.mtu(), 1380 - PmtuSearchOptions().resolution);
+
+  // Only probes that fit crossed; the pipeline then holds the TUN to the
+  // path, replaying a SYN from the capture harness.
+  PcapCapture capture;
+  for (size_t i = 0; i < link.delivered().size(); i++) {
+    EXPECT_LE(link.delivered().packet(i).iov_len, 1380u);
+  }
+  PacketSpec spec;
+  spec.tcp_flags = kTcpFlagSyn;
+  spec.tcp_options = {2, 4, 0x05, 0xb4};
+  auto syn = BuildPacket(spec);
+  capture.Add(syn.data(), syn.size());
+  PacketPipeline pipeline{PacketPipelineOptions()};
+  pipeline.SetPathMtu(search.mtu());
+  EXPECT_EQ(pipeline.stats().effective_mtu, static_cast<uint64_t>(search.mtu()));
+  std::vector<iovec> iovs = capture.packets();
+  PacketVerdict verdict;
+  pipeline.Process(iovs.data(), 1, &verdict);
+  std::vector<uint8_t> clamped(static_cast<uint8_t*>(iovs[0].iov_base),
+                               static_cast<uint8_t*>(iovs[0].iov_base) + iovs[0].iov_len);
+  EXPECT_EQ(Mss(clamped, 0), search.mtu() - 40);
+
+  pipeline.SetPathMtu(0);
+  EXPECT_EQ(pipeline.mtu(), 1500);
+}
+
+TEST(PmtuSearch, TakesPacketTooBigAsHintAndFallsBack) {
+  PmtuSearch search;
+  ASSERT_EQ(search.NextProbe(), 1280);
+  search.OnProbeAcked(1280);
+  ASSERT_EQ(search.NextProbe(), 1500);
+  // Reports below the base are ignored; a plausible one is probed next.
+  search.OnPacketTooBig(1000);
+  EXPECT_EQ(search.NextProbe(), 1500);
+  search.OnPacketTooBig(1420);
+  EXPECT_EQ(search.NextProbe(), 1420);
+  search.OnProbeAcked(1420);
+  EXPECT_EQ(search.state(), PmtuState::kSearchComplete);
+  EXPECT_EQ(search.mtu(), 1420);
+
+  // A path change shows up as a black hole; the search starts over.
+  search.OnBlackHole();
+  EXPECT_EQ(search.mtu(), 1280);
+  for (int i = 0; i < 3; i++) search.OnProbeLost(1280);
+  EXPECT_EQ(search.state(), PmtuState::kError);
+  EXPECT_EQ(search.NextProbe(), 0);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "policy_store.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+// The seed "Work Profile": bypass by default, two domains to the VPN.
+PolicyInputs WorkProfile() {
+  PolicyInputs inputs;
+  inputs.default_mode = RoutingMode::kBypass;
+  inputs.bypass_rules = {"company.com", "*.internal"};
+  inputs.vpn_rules = {"social.com", "*.entertainment"};
+  inputs.excluded_routes = {"10.0.0.0/8"};
+  return inputs;
+}
+
+FlowTarget Domain(const std::string& domain) {
+  FlowTarget target;
+  target.domain = domain;
+  return target;
+}
+
+}  // namespace
+
+TEST(PolicyStore, BuildsInTheBackgroundAndOnlyWhenInputsChange) {
+  PolicyStore store;
+  store.Set(2, WorkProfile());
+  store.Flush();
+  EXPECT_EQ(store.builds(), 1u);
+  std::shared_ptr<const RoutingPolicy> work = store.Get(2);
+  ASSERT_TRUE(work);
+  EXPECT_EQ(store.inline_builds(), 0u);
+  EXPECT_EQ(work->Decide(Domain("tv.entertainment")), RoutingMode::kVpn);
+  EXPECT_EQ(work->Decide(Domain("company.com")), RoutingMode::kBypass);
+
+  store.Set(2, WorkProfile());
+  store.Flush();
+  EXPECT_EQ(store.builds(), 1u);
+  EXPECT_EQ(store.Get(2), work);
+
+  PolicyInputs all_vpn = WorkProfile();
+  all_vpn.vpn_rules.push_back("*");
+  store.Set(2, all_vpn);
+  store.Flush();
+  EXPECT_EQ(store.builds(), 2u);
+  std::shared_ptr<const RoutingPolicy> rebuilt = store.Get(2);
+  EXPECT_NE(rebuilt, work);
+  EXPECT_EQ(rebuilt->Decide(Domain("company.com")), RoutingMode::kVpn);
+  // Whoever still holds the old policy keeps routing by it.
+  EXPECT_EQ(work->Decide(Domain("company.com")), RoutingMode::kBypass);
+}
+
+TEST(PolicyStore, BuildsOnTheCallerWhenTheBackgroundIsBehind) {
+  std::promise<void> entered;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::vector<int64_t> built;
+  PolicyStore store([&](int64_t server, uint64_t, std::shared_ptr<const RoutingPolicy>) {
+    built.push_back(server);
+    if (server == 1) {
+      entered.set_value();
+      released.wait();
+    }
+  });
+  store.Set(1, PolicyInputs());
+  store.Set(2, WorkProfile());
+  // The build thread is held in the callback for server 1.
+  entered.get_future().wait();
+  std::shared_ptr<const RoutingPolicy> work = store.Get(2);
+  release.set_value();
+  ASSERT_TRUE(work);
+  EXPECT_EQ(work->default_mode(), RoutingMode::kBypass);
+  EXPECT_EQ(store.inline_builds(), 1u);
+  store.Flush();
+  // Server 2 was current by the time the build thread got to it.
+  EXPECT_EQ(store.builds(), 1u);
+  EXPECT_EQ(built, std::vector<int64_t>{1});
+  EXPECT_EQ(store.Get(2), work);
+}
+
+TEST(PolicyStore, TellsALateCallbackItsPolicyIsStale) {
+  std::promise<uint64_t> entered;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  PolicyStore store([&](int64_t, uint64_t version, std::shared_ptr<const RoutingPolicy>) {
+    entered.set_value(version);
+    released.wait();
+  });
+  store.Set(1, PolicyInputs());
+  // The first build is installed and its callback held; an edit is then
+  // built on the caller before the callback hands its policy on.
+  uint64_t first = entered.get_future().get();
+  EXPECT_TRUE(store.IsCurrent(1, first));
+  store.Set(1, WorkProfile());
+  uint64_t second = 0;
+  std::shared_ptr<const RoutingPolicy> work = store.Get(1, &second);
+  ASSERT_TRUE(work);
+  EXPECT_NE(second, first);
+  EXPECT_FALSE(store.IsCurrent(1, first));
+  EXPECT_TRUE(store.IsCurrent(1, second));
+  release.set_value();
+  store.Flush();
+  EXPECT_TRUE(store.IsCurrent(1, second));
+  EXPECT_FALSE(store.IsCurrent(2, second));
+}
+
+TEST(PolicyStore, ForgetsServersNotRetained) {
+  PolicyStore store;
+  store.Set(1, PolicyInputs());
+  store.Set(2, WorkProfile());
+  store.Set(3, WorkProfile());
+  store.Retain({2});
+  store.Flush();
+  EXPECT_EQ(store.size(), 1u);
+  EXPECT_FALSE(store.Get(1));
+  EXPECT_FALSE(store.Get(3));
+  EXPECT_TRUE(store.Get(2));
+  EXPECT_FALSE(store.Get(7));
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
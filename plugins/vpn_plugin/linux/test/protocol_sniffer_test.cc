@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "protocol_sniffer.h"
+#include "test/client_hello_builder.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+constexpr uint32_t kQuicV2 = 0x6b3343cf;
+
+SniffResult Sniff(SniffResult (*sniffer)(const uint8_t*, size_t, std::string*),
+                  const std::string& data, std::string* name) {
+  return sniffer(reinterpret_cast<const uint8_t*>(data.data()), data.size(), name);
+}
+
+// The handshake message of a ClientHello record, as QUIC carries it.
+std::string HandshakeOf(const std::string& record) { return record.substr(5); }
+
+}  // namespace
+
+TEST(ProtocolSniffer, ReadsTlsServerName) {
+  std::string hello = BuildTlsClientHello("Api.Example.COM");
+  std::string name;
+  ASSERT_EQ(Sniff(SniffTlsServerName, hello, &name), SniffResult::kFound);
+  EXPECT_EQ(name, "api.example.com");
+
+  // Every prefix either waits for more or already has the name.
+  bool found = false;
+  for (size_t size = 0; size < hello.size(); size++) {
+    SniffResult result = Sniff(SniffTlsServerName, hello.substr(0, size), &name);
+    ASSERT_NE(result, SniffResult::kNotFound) << size;
+    found = found || result == SniffResult::kFound;
+  }
+  EXPECT_TRUE(found);
+
+  EXPECT_EQ(Sniff(SniffTlsServerName, BuildTlsClientHello(""), &name), SniffResult::kNotFound);
+  EXPECT_EQ(Sniff(SniffTlsServerName, std::string("\x16\x03\x01\x00\x05\x02\x00\x00\x01\x00", 10),
+                  &name),
+            SniffResult::kNotFound);
+}
+
+TEST(ProtocolSniffer, ReassemblesHelloSplitAcrossRecords) {
+  std::string hello = SplitTlsRecords(BuildTlsClientHello("split.example.net"), 37);
+  std::string name;
+  ASSERT_EQ(Sniff(SniffTlsServerName, hello, &name), SniffResult::kFound);
+  EXPECT_EQ(name, "split.example.net");
+  // A following record of another type marks the end of the hello.
+  std::string truncated = SplitTlsRecords(BuildTlsClientHello(""), 37) +
+                          std::string("\x14\x03\x03\x00\x01\x01", 6);
+  EXPECT_EQ(Sniff(SniffTlsServerName, truncated, &name), SniffResult::kNotFound);
+}
+
+TEST(ProtocolSniffer, ReadsHttpHost) {
+  std::string name;
+  std::string request =
+      "GET /index.html HTTP/1.1\r\nUser-Agent: test\r\nhOsT:  Www.Example.org:8080 \r\n\r\n";
+  ASSERT_EQ(Sniff(SniffHttpHost, request, &name), SniffResult::kFound);
+  EXPECT_EQ(name, "www.example.org");
+  EXPECT_EQ(Sniff(SniffHttpHost, "GE", &name), SniffResult::kNeedMore);
+  EXPECT_EQ(Sniff(SniffHttpHost, "POST / HTTP/1.1\r\nAccept: */*\r\n", &name),
+            SniffResult::kNeedMore);
+  EXPECT_EQ(Sniff(SniffHttpHost, "GET / HTTP/1.0\r\nAccept: */*\r\n\r\n", &name),
+            SniffResult::kNotFound);
+  EXPECT_EQ(Sniff(SniffHttpHost, "SSH-2.0-OpenSSH_9.6\r\n", &name), SniffResult::kNotFound);
+  EXPECT_EQ(Sniff(SniffHttpHost, "GET / HTTP/1.1\r\nHost: [::1]:80\r\n\r\n", &name),
+            SniffResult::kNotFound);
+
+  EXPECT_EQ(Sniff(SniffStreamDomain, request, &name), SniffResult::kFound);
+  EXPECT_EQ(Sniff(SniffStreamDomain, BuildTlsClientHello("tls.test"), &name),
+            SniffResult::kFound);
+  EXPECT_EQ(name, "tls.test");
+}
+
+TEST(ProtocolSniffer, DecryptsQuicInitials) {
+  std::string handshake = HandshakeOf(BuildTlsClientHello("quic.example.com"));
+  for (uint32_t version : {1u, kQuicV2}) {
+    QuicInitialSpec spec;
+    spec.version = version;
+    spec.crypto.emplace_back(0, handshake);
+    std::string name;
+    ASSERT_EQ(Sniff(SniffQuicServerName, BuildQuicInitial(spec), &name), SniffResult::kFound)
+        << version;
+    EXPECT_EQ(name, "quic.example.com");
+  }
+
+  // Out-of-order, overlapping CRYPTO frames, as some clients send them.
+  QuicInitialSpec spec;
+  spec.crypto.emplace_back(100, handshake.substr(100));
+  spec.crypto.emplace_back(0, handshake.substr(0, 120));
+  std::string name;
+  EXPECT_EQ(Sniff(SniffQuicServerName, BuildQuicInitial(spec), &name), SniffResult::kFound);
+
+  // A tampered packet does not authenticate.
+  std::string packet = BuildQuicInitial(spec);
+  packet[packet.size() - 1] ^= 1;
+  EXPECT_EQ(Sniff(SniffQuicServerName, packet, &name), SniffResult::kNotFound);
+  // Short-header packets carry nothing to sniff.
+  EXPECT_EQ(Sniff(SniffQuicServerName, std::string(1200, '\x40'), &name),
+            SniffResult::kNotFound);
+}
+
+TEST(ProtocolSniffer, WaitsForHelloContinuedInNextDatagram) {
+  std::string handshake = HandshakeOf(BuildTlsClientHello("second.example.com"));
+  QuicInitialSpec first;
+  // Stops before the extensions, like a large hello split over datagrams.
+  first.crypto.emplace_back(0, handshake.substr(0, 60));
+  std::string name;
+  EXPECT_EQ(Sniff(SniffQuicServerName, BuildQuicInitial(first), &name), SniffResult::kNeedMore);
+
+  // Two Initials coalesced in one datagram.
+  QuicInitialSpec second;
+  second.crypto.emplace_back(60, handshake.substr(60));
+  second.packet_number = 3;
+  second.datagram_size = 0;
+  first.datagram_size = 0;
+  std::string datagram = BuildQuicInitial(first) + BuildQuicInitial(second);
+  ASSERT_EQ(Sniff(SniffQuicServerName, datagram, &name), SniffResult::kFound);
+  EXPECT_EQ(name, "second.example.com");
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
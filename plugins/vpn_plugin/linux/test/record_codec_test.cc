@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "record_codec.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+const uint8_t* Bytes(const std::string& message) {
+  return reinterpret_cast<const uint8_t*>(message.data());
+}
+
+}  // namespace
+
+TEST(RecordCodec, RoundTripsRecordsAndSharesStrings) {
+  const char* dns[] = {"8.8.8.8", "8.8.4.4"};
+  const std::vector<int64_t> ids = {1, -2, INT64_MIN, INT64_MAX};
+  RecordWriter writer;
+  writer.Reset(4);
+  for (int64_t id : ids) {
+    writer.AddInt(id);
+    writer.AddString("vpn.example.com");
+    writer.AddStringList(dns, 2);
+    writer.AddString(id == 1 ? "" : "8.8.8.8");
+    writer.EndRecord();
+  }
+  std::string message = writer.Finish();
+  // Three distinct strings, each stored once.
+  EXPECT_LT(message.size(), 3 + 1 + 4 * (1 + 15) + 40);
+
+  RecordReader reader;
+  ASSERT_TRUE(reader.Open(Bytes(message), message.size()));
+  ASSERT_EQ(reader.record_count(), 4u);
+  ASSERT_EQ(reader.fields_per_record(), 4u);
+  for (int64_t expected : ids) {
+    int64_t id;
+    std::string_view domain;
+    std::vector<std::string_view> servers;
+    std::string_view last;
+    ASSERT_TRUE(reader.ReadInt(&id));
+    ASSERT_TRUE(reader.ReadString(&domain));
+    ASSERT_TRUE(reader.ReadStringList(&servers));
+    ASSERT_TRUE(reader.ReadString(&last));
+    EXPECT_EQ(id, expected);
+    EXPECT_EQ(domain, "vpn.example.com");
+    EXPECT_EQ(servers, std::vector<std::string_view>({"8.8.8.8", "8.8.4.4"}));
+    EXPECT_EQ(last, expected == 1 ? "" : "8.8.8.8");
+  }
+  EXPECT_TRUE(reader.done());
+
+  // The writer starts over cleanly with its buffers kept.
+  writer.Reset(1);
+  writer.AddString("other");
+  writer.EndRecord();
+  message = writer.Finish();
+  ASSERT_TRUE(reader.Open(Bytes(message), message.size()));
+  std::string_view value;
+  ASSERT_TRUE(reader.ReadString(&value));
+  EXPECT_EQ(value, "other");
+  EXPECT_TRUE(reader.done());
+}
+
+TEST(RecordCodec, RejectsMismatchedTypesAndTruncation) {
+  RecordWriter writer;
+  writer.Reset(2);
+  writer.AddInt(7);
+  writer.AddString("name");
+  writer.EndRecord();
+  std::string message = writer.Finish();
+
+  RecordReader reader;
+  ASSERT_TRUE(reader.Open(Bytes(message), message.size()));
+  std::string_view text;
+  EXPECT_FALSE(reader.ReadString(&text));
+  int64_t number;
+  // A failed read leaves the position alone.
+  EXPECT_TRUE(reader.ReadInt(&number));
+  EXPECT_FALSE(reader.ReadInt(&number));
+  EXPECT_TRUE(reader.ReadString(&text));
+
+  for (size_t size = 0; size < message.size(); size++) {
+    RecordReader truncated;
+    bool ok = truncated.Open(Bytes(message), size) && truncated.ReadInt(&number) &&
+              truncated.ReadString(&text);
+    EXPECT_FALSE(ok) << size;
+  }
+  std::string wrong = message;
+  wrong[2] = 2;
+  EXPECT_FALSE(reader.Open(Bytes(wrong), wrong.size()));
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
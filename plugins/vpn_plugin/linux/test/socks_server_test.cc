@@ -0,0 +1,507 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "config_document.h"
+#include "dns_forwarder.h"
+#include "routing_policy.h"
+#include "socks_server.h"
+#include "test/client_hello_builder.h"
+#include "test/dns_test_server.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+// Blocking TCP echo server on an ephemeral loopback port.
+class EchoServer {
+ public:
+  EchoServer() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, 16);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    port_ = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() {
+      while (true) {
+        int c = accept(fd_, nullptr, nullptr);
+        if (c < 0) return;
+        std::thread([c]() {
+          char buf[4096];
+          ssize_t n;
+          while ((n = recv(c, buf, sizeof(buf), 0)) > 0) send(c, buf, n, MSG_NOSIGNAL);
+          close(c);
+        }).detach();
+      }
+    });
+  }
+  ~EchoServer() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+  }
+  uint16_t port() const { return port_; }
+
+ private:
+  int fd_;
+  uint16_t port_;
+  std::thread thread_;
+};
+
+int ConnectTo(const SocketAddress& address) {
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+  timeval tv = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Blocking recv() that resumes after EINTR. Sockets with SO_RCVTIMEO are
+// not restarted by the kernel, and io_uring completes requests by task
+// work on the thread that submitted them, which interrupts this thread
+// when it also runs a ring.
+ssize_t Recv(int fd, void* buf, size_t size) {
+  ssize_t n;
+  do {
+    n = recv(fd, buf, size, 0);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+bool SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+std::string RecvExactly(int fd, size_t size) {
+  std::string out(size, '\0');
+  size_t got = 0;
+  while (got < size) {
+    ssize_t n = Recv(fd, &out[got], size - got);
+    if (n <= 0) break;
+    got += n;
+  }
+  out.resize(got);
+  return out;
+}
+
+std::string ConnectRequestV4(uint16_t port) {
+  std::string req = {5, 1, 0, 1, 127, 0, 0, 1};
+  req.push_back(static_cast<char>(port >> 8));
+  req.push_back(static_cast<char>(port & 0xff));
+  return req;
+}
+
+// Every listener test runs on both loop backends; on io_uring the relay is
+// the UringRelay and clients are taken by a multishot accept.
+class SocksServerTest : public ::testing::TestWithParam<EventLoopBackend> {
+ protected:
+  SocksServerTest() : thread_(GetParam()) {}
+
+  void StartServer(SocksServerOptions options) {
+    IpAddress::Parse("127.0.0.1", &options.listen_address.ip);
+    options.listen_address.port = 0;
+    server_ = std::make_unique<SocksServer>(thread_.loop(), std::move(options));
+    ASSERT_TRUE(server_->Listen());
+    thread_.Start();
+  }
+
+  void TearDown() override {
+    thread_.RunSync([this]() { server_.reset(); });
+    thread_.Stop();
+  }
+
+  LoopThread thread_;
+  std::unique_ptr<SocksServer> server_;
+  EchoServer echo_;
+};
+
+class SocketPairTunnel : public TunnelConnector {
+ public:
+  ~SocketPairTunnel() override {
+    if (far_end >= 0) close(far_end);
+  }
+  int Open(const FlowTarget& target) override {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    far_end = fds[1];
+    opened = target;
+    return fds[0];
+  }
+  int far_end = -1;
+  FlowTarget opened;
+};
+
+}  // namespace
+
+TEST(ConfigDocument, ParsesEncoderOutput) {
+  const std::string text =
+      "# Logging level\n"
+      "loglevel = \"info\"\n"
+      "vpn_mode = \"general\"\n"
+      "killswitch_enabled = true\n"
+      "exclusions = [\"example.com\", \"*.internal\"]\n"
+      "dns_upstreams = []\n"
+      "[endpoint]\n"
+      "hostname = \"vpn.example.com\"\n"
+      "certificate = \"\"\"\n-----BEGIN CERTIFICATE-----\nAAAA\n-----END CERTIFICATE-----\n\"\"\"\n"
+      "[listener]\n"
+      "[listener.tun]\n"
+      "mtu_size = 1280\n"
+      "[listener.socks]\n"
+      "address = \"127.0.0.1:1080\"\n"
+      "username = \"\"\n";
+  ConfigDocument doc;
+  std::string error;
+  ASSERT_TRUE(ConfigDocument::Parse(text, &doc, &error)) << error;
+  EXPECT_EQ(doc.GetString("", "loglevel"), "info");
+  EXPECT_TRUE(doc.GetBool("", "killswitch_enabled"));
+  EXPECT_EQ(doc.GetStringList("", "exclusions").size(), 2u);
+  EXPECT_TRUE(doc.GetStringList("", "dns_upstreams").empty());
+  EXPECT_EQ(doc.GetString("endpoint", "certificate"),
+            "-----BEGIN CERTIFICATE-----\nAAAA\n-----END CERTIFICATE-----");
+  EXPECT_EQ(doc.GetInt("listener.tun", "mtu_size"), 1280);
+
+  SocksServerOptions options;
+  ASSERT_TRUE(SocksServerOptions::FromConfig(doc, &options));
+  EXPECT_EQ(options.listen_address.ToString(), "127.0.0.1:1080");
+  EXPECT_TRUE(options.username.empty());
+}
+
+TEST(RoutingPolicy, AppliesProfileRules) {
+  RoutingPolicy work(RoutingMode::kBypass, {"company.com", "*.internal"},
+                     {"social.com", "*.entertainment"}, {"10.0.0.0/8"});
+  FlowTarget t;
+  t.domain = "www.social.com";
+  EXPECT_EQ(work.Decide(t), RoutingMode::kVpn);
+  t.domain = "tv.entertainment";
+  EXPECT_EQ(work.Decide(t), RoutingMode::kVpn);
+  t.domain = "entertainment";
+  EXPECT_EQ(work.Decide(t), RoutingMode::kBypass);
+  t.domain = "social.com";
+  IpAddress::Parse("10.1.2.3", &t.ip);
+  EXPECT_EQ(work.Decide(t), RoutingMode::kBypass);
+
+  RoutingPolicy def(RoutingMode::kVpn, {"192.168.1.0/24"}, {"*"}, {});
+  FlowTarget lan;
+  IpAddress::Parse("192.168.1.7", &lan.ip);
+  EXPECT_EQ(def.Decide(lan), RoutingMode::kBypass);
+  IpAddress::Parse("8.8.8.8", &lan.ip);
+  EXPECT_EQ(def.Decide(lan), RoutingMode::kVpn);
+}
+
+TEST_P(SocksServerTest, ConnectRelaysBypassFlow) {
+  StartServer(SocksServerOptions());
+  int fd = ConnectTo(server_->local_address());
+  ASSERT_GE(fd, 0);
+  ASSERT_TRUE(SendAll(fd, std::string("\x05\x01\x00", 3)));
+  EXPECT_EQ(RecvExactly(fd, 2), std::string("\x05\x00", 2));
+  // Payload pipelined right after the request must not be lost.
+  ASSERT_TRUE(SendAll(fd, ConnectRequestV4(echo_.port()) + "hello"));
+  std::string reply = RecvExactly(fd, 10);
+  ASSERT_EQ(reply.size(), 10u);
+  EXPECT_EQ(reply[1], 0);
+  EXPECT_EQ(RecvExactly(fd, 5), "hello");
+
+  std::string big(1 << 20, 'x');
+  std::thread writer([&]() { SendAll(fd, big); });
+  EXPECT_EQ(RecvExactly(fd, big.size()), big);
+  writer.join();
+  close(fd);
+  EXPECT_EQ(server_->stats().bypass_flows.load(), 1u);
+}
+
+TEST_P(SocksServerTest, RequiresPasswordWhenConfigured) {
+  SocksServerOptions options;
+  options.username = "user";
+  options.password = "secret";
+  StartServer(options);
+
+  int bad = ConnectTo(server_->local_address());
+  SendAll(bad, std::string("\x05\x01\x00", 3));
+  EXPECT_EQ(RecvExactly(bad, 2), std::string("\x05\xff", 2));
+  close(bad);
+
+  int fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x02", 3));
+  EXPECT_EQ(RecvExactly(fd, 2), std::string("\x05\x02", 2));
+  SendAll(fd, std::string("\x01\x04user\x06secret", 13));
+  EXPECT_EQ(RecvExactly(fd, 2), std::string("\x01\x00", 2));
+  SendAll(fd, ConnectRequestV4(echo_.port()));
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0);
+  close(fd);
+}
+
+TEST_P(SocksServerTest, RefusesVpnFlowWithoutTunnel) {
+  SocksServerOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(RoutingMode::kVpn, std::vector<std::string>(),
+                                                   std::vector<std::string>(),
+                                                   std::vector<std::string>());
+  StartServer(options);
+  int fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x00", 3));
+  RecvExactly(fd, 2);
+  SendAll(fd, ConnectRequestV4(echo_.port()));
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0x02);
+  close(fd);
+  EXPECT_EQ(server_->stats().rejected.load(), 1u);
+}
+
+TEST_P(SocksServerTest, HandsVpnFlowToTunnel) {
+  SocketPairTunnel tunnel;
+  SocksServerOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(
+      RoutingMode::kBypass, std::vector<std::string>(),
+      std::vector<std::string>{"*.example.com"}, std::vector<std::string>());
+  options.tunnel = &tunnel;
+  StartServer(options);
+
+  int fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x00", 3));
+  RecvExactly(fd, 2);
+  std::string req = {5, 1, 0, 3, 15};
+  req += "www.example.com";
+  req += std::string("\x01\xbb", 2);
+  SendAll(fd, req);
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0);
+  EXPECT_EQ(tunnel.opened.domain, "www.example.com");
+  EXPECT_EQ(tunnel.opened.port, 443);
+
+  SendAll(fd, "ping");
+  timeval tv = {5, 0};
+  setsockopt(tunnel.far_end, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  std::string got;
+  while (got.size() < 4) {
+    char buf[16];
+    ssize_t n = Recv(tunnel.far_end, buf, sizeof(buf));
+    if (n <= 0) break;
+    got.append(buf, n);
+  }
+  EXPECT_EQ(got, "ping");
+  close(fd);
+}
+
+// Hands out the read end of a pipe, which never becomes writable, like a
+// tunnel stream whose endpoint never answers.
+class StalledTunnel : public TunnelConnector {
+ public:
+  ~StalledTunnel() override {
+    if (write_end >= 0) close(write_end);
+  }
+  int Open(const FlowTarget&) override {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) return -1;
+    write_end = fds[1];
+    return fds[0];
+  }
+  int write_end = -1;
+};
+
+TEST_P(SocksServerTest, TimesOutVpnFlowThatNeverConnects) {
+  StalledTunnel tunnel;
+  SocksServerOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(RoutingMode::kVpn, std::vector<std::string>(),
+                                                   std::vector<std::string>(),
+                                                   std::vector<std::string>());
+  options.tunnel = &tunnel;
+  options.connect_timeout_ms = 50;
+  StartServer(options);
+  int fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x00", 3));
+  RecvExactly(fd, 2);
+  SendAll(fd, ConnectRequestV4(echo_.port()));
+  // Host unreachable, as for a bypass connect that times out.
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0x04);
+  close(fd);
+  EXPECT_EQ(server_->stats().vpn_flows.load(), 1u);
+}
+
+TEST_P(SocksServerTest, RoutesIpConnectBySniffedServerName) {
+  SocksServerOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(
+      RoutingMode::kVpn, std::vector<std::string>{"sniffed.test"}, std::vector<std::string>(),
+      std::vector<std::string>());
+  options.sniff = true;
+  StartServer(options);
+
+  // Without the sniffed name the flow would go to the (missing) tunnel.
+  std::string hello = BuildTlsClientHello("sniffed.test");
+  int fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x00", 3));
+  RecvExactly(fd, 2);
+  ASSERT_TRUE(SendAll(fd, ConnectRequestV4(echo_.port())));
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0);
+  ASSERT_TRUE(SendAll(fd, hello));
+  EXPECT_EQ(RecvExactly(fd, hello.size()), hello);
+  close(fd);
+  EXPECT_EQ(server_->stats().sniffed.load(), 1u);
+  EXPECT_EQ(server_->stats().bypass_flows.load(), 1u);
+
+  // Any other name keeps the default route, which can only be refused by
+  // closing after the early reply.
+  fd = ConnectTo(server_->local_address());
+  SendAll(fd, std::string("\x05\x01\x00", 3));
+  RecvExactly(fd, 2);
+  SendAll(fd, ConnectRequestV4(echo_.port()));
+  EXPECT_EQ(RecvExactly(fd, 10)[1], 0);
+  SendAll(fd, BuildTlsClientHello("other.test"));
+  EXPECT_EQ(RecvExactly(fd, 1), "");
+  close(fd);
+  EXPECT_EQ(server_->stats().rejected.load(), 1u);
+}
+
+TEST_P(SocksServerTest, UdpAssociateRelaysDatagrams) {
+  StartServer(SocksServerOptions());
+  // UDP echo target.
+  int target = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(target, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+  socklen_t len = sizeof(sin);
+  getsockname(target, reinterpret_cast<sockaddr*>(&sin), &len);
+  uint16_t target_port = ntohs(sin.sin_port);
+  constexpr int kBurst = 16;
+  std::thread echo([target]() {
+    for (int i = 0; i < 1 + kBurst; i++) {
+      char buf[2048];
+      sockaddr_storage from;
+      socklen_t from_len = sizeof(from);
+      ssize_t n =
+          recvfrom(target, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+      if (n > 0) sendto(target, buf, n, 0, reinterpret_cast<sockaddr*>(&from), from_len);
+    }
+  });
+
+  int control = ConnectTo(server_->local_address());
+  SendAll(control, std::string("\x05\x01\x00", 3));
+  RecvExactly(control, 2);
+  SendAll(control, std::string("\x05\x03\x00\x01\x00\x00\x00\x00\x00\x00", 10));
+  std::string reply = RecvExactly(control, 10);
+  ASSERT_EQ(reply[1], 0);
+  SocketAddress relay;
+  relay.ip = IpAddress::FromV4(reinterpret_cast<const uint8_t*>(reply.data() + 4));
+  relay.port = static_cast<uint16_t>((static_cast<uint8_t>(reply[8]) << 8) |
+                                     static_cast<uint8_t>(reply[9]));
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval tv = {5, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  std::string datagram = {0, 0, 0, 1, 127, 0, 0, 1};
+  datagram.push_back(static_cast<char>(target_port >> 8));
+  datagram.push_back(static_cast<char>(target_port & 0xff));
+  datagram += "dgram";
+  sockaddr_storage ss;
+  len = relay.ToSockaddr(&ss);
+  sendto(client, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+
+  char buf[2048];
+  ssize_t n = Recv(client, buf, sizeof(buf));
+  ASSERT_EQ(n, static_cast<ssize_t>(datagram.size()));
+  EXPECT_EQ(std::string(buf, n), datagram);
+
+  // A burst is relayed in batches both ways and keeps its order.
+  std::string header = datagram.substr(0, 10);
+  for (int i = 0; i < kBurst; i++) {
+    std::string burst = header + std::string(1200, static_cast<char>('a' + i));
+    sendto(client, burst.data(), burst.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+  }
+  for (int i = 0; i < kBurst; i++) {
+    n = Recv(client, buf, sizeof(buf));
+    ASSERT_EQ(n, static_cast<ssize_t>(10 + 1200));
+    EXPECT_EQ(buf[10], static_cast<char>('a' + i));
+  }
+
+  echo.join();
+  close(client);
+  close(target);
+  close(control);
+}
+
+TEST_P(SocksServerTest, UdpAssociateAnswersDnsFromForwarder) {
+  DnsTestServer upstream;
+  DnsForwarderOptions dns_options;
+  dns_options.upstreams.push_back(upstream.address());
+  auto dns = std::make_unique<DnsForwarder>(thread_.loop(), dns_options);
+  ASSERT_TRUE(dns->Start());
+  SocksServerOptions options;
+  options.policy = std::make_shared<RoutingPolicy>(RoutingMode::kVpn, std::vector<std::string>(),
+                                                   std::vector<std::string>(),
+                                                   std::vector<std::string>());
+  options.dns = dns.get();
+  StartServer(std::move(options));
+
+  int control = ConnectTo(server_->local_address());
+  SendAll(control, std::string("\x05\x01\x00", 3));
+  RecvExactly(control, 2);
+  SendAll(control, std::string("\x05\x03\x00\x01\x00\x00\x00\x00\x00\x00", 10));
+  std::string reply = RecvExactly(control, 10);
+  ASSERT_EQ(reply[1], 0);
+  SocketAddress relay;
+  relay.ip = IpAddress::FromV4(reinterpret_cast<const uint8_t*>(reply.data() + 4));
+  relay.port = static_cast<uint16_t>((static_cast<uint8_t>(reply[8]) << 8) |
+                                     static_cast<uint8_t>(reply[9]));
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval tv = {5, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  // The resolver address is never contacted; the forwarder answers instead.
+  std::string header = {0, 0, 0, 1, 10, 53, 53, 53, 0, 53};
+  std::string query = BuildDnsQuery(0x1234, DnsQuestion{"example.com", kDnsTypeA, kDnsClassIn});
+  std::string datagram = header + query;
+  sockaddr_storage ss;
+  socklen_t len = relay.ToSockaddr(&ss);
+  sendto(client, datagram.data(), datagram.size(), 0, reinterpret_cast<sockaddr*>(&ss), len);
+
+  char buf[2048];
+  ssize_t n = Recv(client, buf, sizeof(buf));
+  ASSERT_GT(n, static_cast<ssize_t>(header.size()));
+  EXPECT_EQ(std::string(buf, header.size()), header);
+  DnsMessage response;
+  ASSERT_TRUE(DnsMessage::Parse(reinterpret_cast<const uint8_t*>(buf) + header.size(),
+                                n - header.size(), &response));
+  EXPECT_EQ(response.id, 0x1234);
+  EXPECT_EQ(response.answers.size(), 1u);
+  EXPECT_EQ(upstream.queries(), 1);
+
+  close(client);
+  close(control);
+  thread_.RunSync([this, &dns]() {
+    server_.reset();
+    dns.reset();
+  });
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, SocksServerTest,
+                         ::testing::Values(EventLoopBackend::kEpoll, EventLoopBackend::kIoUring),
+                         [](const ::testing::TestParamInfo<EventLoopBackend>& info) {
+                           return info.param == EventLoopBackend::kEpoll ? "Epoll" : "IoUring";
+                         });
+
+}  // namespace test
+}  // namespace vpn_plugin
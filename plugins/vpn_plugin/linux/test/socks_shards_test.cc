@@ -0,0 +1,237 @@
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "config_document.h"
+#include "socks_shards.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+// Loopback listener that never accepts; connections to it complete in the
+// backlog, which is all a CONNECT needs.
+class Backlog {
+ public:
+  Backlog() {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, SOMAXCONN);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    port_ = ntohs(sin.sin_port);
+  }
+  ~Backlog() { close(fd_); }
+  uint16_t port() const { return port_; }
+
+ private:
+  int fd_;
+  uint16_t port_;
+};
+
+// Runs a SOCKS5 CONNECT to 127.0.0.1:|port| through |proxy|. Returns the
+// connected fd, or -1.
+int Connect(const SocketAddress& proxy, uint16_t port) {
+  sockaddr_storage ss;
+  socklen_t len = proxy.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+  timeval tv = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+    close(fd);
+    return -1;
+  }
+  const char request[] = {5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1, static_cast<char>(port >> 8),
+                          static_cast<char>(port & 0xff)};
+  send(fd, request, sizeof(request), MSG_NOSIGNAL);
+  char reply[12];
+  size_t got = 0;
+  while (got < sizeof(reply)) {
+    ssize_t n = recv(fd, reply + got, sizeof(reply) - got, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += static_cast<size_t>(n);
+  }
+  if (got != sizeof(reply) || reply[3] != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+SocksServerOptions LoopbackOptions() {
+  SocksServerOptions options;
+  IpAddress::Parse("127.0.0.1", &options.listen_address.ip);
+  return options;
+}
+
+}  // namespace
+
+TEST(SocksShards, ReadsShardSettingsFromConfig) {
+  ConfigDocument config;
+  std::string error;
+  ASSERT_TRUE(ConfigDocument::Parse(
+      "[listener.socks]\nshards = 0\npin_cpus = false\nsteer_by_cpu = true\n"
+      "io_backend = \"io_uring\"\n",
+      &config, &error))
+      << error;
+  SocksShardOptions options = SocksShardOptions::FromConfig(config);
+  EXPECT_EQ(options.shards, 0u);
+  EXPECT_FALSE(options.pin_cpus);
+  EXPECT_TRUE(options.steer_by_cpu);
+  EXPECT_EQ(options.backend, EventLoopBackend::kIoUring);
+
+  SocksShardGroup group(options, LoopbackOptions());
+  ASSERT_TRUE(group.Start());
+  EXPECT_EQ(group.size(), AllowedCpus().size());
+}
+
+TEST(SocksShards, SpreadsConnectionsOverShardsOnOnePort) {
+  Backlog upstream;
+  SocksShardOptions options;
+  options.shards = 4;
+  options.pin_cpus = false;
+  std::atomic<size_t> setups{0};
+  std::atomic<size_t> teardowns{0};
+  {
+    SocksShardGroup group(options, LoopbackOptions(),
+                          [&](size_t, EventLoop*, SocksServerOptions*) -> EventLoop::Task {
+                            setups++;
+                            return [&teardowns]() { teardowns++; };
+                          });
+    ASSERT_TRUE(group.Start());
+    ASSERT_EQ(group.size(), 4u);
+    EXPECT_NE(group.local_address().port, 0);
+    EXPECT_EQ(setups.load(), 4u);
+
+    std::vector<int> fds;
+    for (int i = 0; i < 64; i++) {
+      int fd = Connect(group.local_address(), upstream.port());
+      ASSERT_GE(fd, 0) << i;
+      fds.push_back(fd);
+    }
+    std::vector<uint64_t> accepted = group.accepted();
+    EXPECT_EQ(std::accumulate(accepted.begin(), accepted.end(), uint64_t{0}), 64u);
+    size_t used = 0;
+    for (uint64_t count : accepted) used += count > 0;
+    // The kernel hashes the 4-tuple; 64 source ports all landing on one
+    // shard would be a 1 in 4^63 event.
+    EXPECT_GT(used, 1u);
+    for (int fd : fds) close(fd);
+  }
+  EXPECT_EQ(teardowns.load(), 4u);
+}
+
+TEST(SocksShards, SteersConnectionsToTheShardOnTheReceivingCpu) {
+  Backlog upstream;
+  std::vector<int> cpus = AllowedCpus();
+  SocksShardOptions options;
+  options.shards = 2;
+  options.steer_by_cpu = true;
+  SocksShardGroup group(options, LoopbackOptions());
+  ASSERT_TRUE(group.Start());
+
+  // Loopback packets are received on the sending CPU, so a client pinned
+  // to shard 1's CPU lands on shard 1, or on shard 0 with a single CPU.
+  size_t expected = cpus.size() > 1 ? 1 : 0;
+  cpu_set_t saved;
+  sched_getaffinity(0, sizeof(saved), &saved);
+  cpu_set_t pinned;
+  CPU_ZERO(&pinned);
+  CPU_SET(cpus[expected], &pinned);
+  ASSERT_EQ(sched_setaffinity(0, sizeof(pinned), &pinned), 0);
+  std::vector<int> fds;
+  for (int i = 0; i < 16; i++) fds.push_back(Connect(group.local_address(), upstream.port()));
+  sched_setaffinity(0, sizeof(saved), &saved);
+
+  for (int fd : fds) {
+    EXPECT_GE(fd, 0);
+    close(fd);
+  }
+  EXPECT_EQ(group.accepted()[expected], 16u);
+}
+
+TEST(SocksShards, SteersOnlyPinnedShards) {
+  SocksShardOptions options;
+  options.shards = 2;
+  options.pin_cpus = false;
+  options.steer_by_cpu = true;
+  SocksShardGroup group(options, LoopbackOptions());
+  ASSERT_TRUE(group.Start());
+  EXPECT_FALSE(group.steering_by_cpu());
+}
+
+TEST(SocksShards, SwapsThePolicyOfRunningShards) {
+  Backlog upstream;
+  SocksShardOptions options;
+  options.shards = 2;
+  options.pin_cpus = false;
+  SocksShardGroup group(options, LoopbackOptions());
+  ASSERT_TRUE(group.Start());
+  // Tasks run in the order they are posted, so once these have run the
+  // swap has too.
+  auto swapped = [&group]() {
+    for (size_t i = 0; i < group.size(); i++) {
+      std::promise<void> done;
+      group.loop(i)->Post([&done]() { done.set_value(); });
+      done.get_future().wait();
+    }
+  };
+
+  int fd = Connect(group.local_address(), upstream.port());
+  EXPECT_GE(fd, 0);
+  close(fd);
+  // Everything to the VPN, and without a connector that is refused.
+  group.SetPolicy(std::make_shared<RoutingPolicy>(RoutingMode::kVpn, std::vector<std::string>(),
+                                                  std::vector<std::string>(),
+                                                  std::vector<std::string>()));
+  swapped();
+  for (int i = 0; i < 8; i++) EXPECT_EQ(Connect(group.local_address(), upstream.port()), -1);
+  group.SetPolicy(std::make_shared<RoutingPolicy>(RoutingMode::kVpn,
+                                                  std::vector<std::string>{"127.0.0.0/8"},
+                                                  std::vector<std::string>(),
+                                                  std::vector<std::string>()));
+  swapped();
+  for (int i = 0; i < 8; i++) {
+    fd = Connect(group.local_address(), upstream.port());
+    EXPECT_GE(fd, 0);
+    close(fd);
+  }
+  uint64_t rejected = 0;
+  uint64_t bypassed = 0;
+  for (size_t i = 0; i < group.size(); i++) {
+    rejected += group.server(i)->stats().rejected;
+    bypassed += group.server(i)->stats().bypass_flows;
+  }
+  EXPECT_EQ(rejected, 8u);
+  EXPECT_EQ(bypassed, 9u);
+}
+
+TEST(SocksShards, FailsWhenTheAddressIsTaken) {
+  Backlog taken;
+  SocksServerOptions server_options = LoopbackOptions();
+  server_options.listen_address.port = taken.port();
+  SocksShardOptions options;
+  options.shards = 2;
+  SocksShardGroup group(options, server_options);
+  EXPECT_FALSE(group.Start());
+  EXPECT_EQ(group.size(), 0u);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
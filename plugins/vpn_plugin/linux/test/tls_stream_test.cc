@@ -0,0 +1,219 @@
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "http2_frame.h"
+#include "http2_pool.h"
+#include "tls_session_cache.h"
+#include "tls_stream.h"
+#include "test/tls_test_server.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+std::shared_ptr<TlsClientContext> Context(const TlsTestServer& server,
+                                          std::shared_ptr<TlsSessionCache> sessions,
+                                          bool skip_verification = false) {
+  TlsClientOptions options;
+  options.certificate_pem = server.certificate_pem();
+  options.skip_verification = skip_verification;
+  options.sessions = std::move(sessions);
+  std::string error;
+  auto context = TlsClientContext::Create(options, &error);
+  EXPECT_TRUE(context) << error;
+  return context;
+}
+
+// Retries |step| for up to five seconds until it stops blocking. Only the
+// TCP connect waits for writability, so waiting for input suffices.
+ByteStream::Status Drive(int fd, const std::function<ByteStream::Status()>& step) {
+  int64_t deadline = EventLoop::NowMs() + 5000;
+  ByteStream::Status status;
+  while ((status = step()) == ByteStream::Status::kWouldBlock && EventLoop::NowMs() < deadline) {
+    pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, 1, 10);
+  }
+  return status;
+}
+
+// Starts a non-blocking TCP connect to |address|.
+int Dial(const SocketAddress& address) {
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  connect(fd, reinterpret_cast<sockaddr*>(&ss), len);
+  return fd;
+}
+
+// Connects to |server| through |context|, echoes one message and reports
+// whether the session was resumed. Reading the echo also takes in the
+// tickets the server issued after the handshake.
+bool Exchange(const TlsTestServer& server, const std::shared_ptr<TlsClientContext>& context,
+              bool* resumed) {
+  int fd = Dial(server.address());
+  TlsStream stream(context, fd, "localhost");
+  if (Drive(fd, [&]() { return stream.Handshake(); }) != ByteStream::Status::kOk) return false;
+  const std::string message = "ping";
+  size_t written = 0;
+  if (Drive(fd, [&]() { return stream.Write(message.data(), message.size(), &written); }) !=
+      ByteStream::Status::kOk) {
+    return false;
+  }
+  char buffer[64];
+  size_t read = 0;
+  if (Drive(fd, [&]() { return stream.Read(buffer, sizeof(buffer), &read); }) !=
+      ByteStream::Status::kOk) {
+    return false;
+  }
+  *resumed = stream.resumed();
+  return std::string(buffer, read) == message;
+}
+
+class IgnoreStream : public Http2StreamDelegate {
+ public:
+  void OnHeaders(uint32_t, const std::vector<HpackHeader>&, bool) override {}
+  void OnData(uint32_t, const char*, size_t, bool) override {}
+  void OnWritable(uint32_t) override {}
+  void OnClosed(uint32_t, Http2Error) override {}
+};
+
+}  // namespace
+
+TEST(TlsSessionCache, ResumesFromMemoryAndFromDisk) {
+  TlsTestServer server;
+  std::string path = ::testing::TempDir() + "tls_sessions_" + std::to_string(getpid());
+  auto sessions = std::make_shared<TlsSessionCache>(path);
+  auto context = Context(server, sessions);
+
+  bool resumed = true;
+  ASSERT_TRUE(Exchange(server, context, &resumed));
+  EXPECT_FALSE(resumed);
+  EXPECT_EQ(sessions->size(), 1u);
+  ASSERT_TRUE(Exchange(server, context, &resumed));
+  EXPECT_TRUE(resumed);
+  // The ticket used was replaced by a fresh one.
+  EXPECT_EQ(sessions->size(), 1u);
+
+  // A restart picks the tickets up from the file.
+  std::string error;
+  ASSERT_TRUE(sessions->Save(&error)) << error;
+  auto restored = std::make_shared<TlsSessionCache>(path);
+  ASSERT_TRUE(restored->Load(&error)) << error;
+  EXPECT_EQ(restored->size(), 1u);
+  ASSERT_TRUE(Exchange(server, Context(server, restored), &resumed));
+  EXPECT_TRUE(resumed);
+  EXPECT_EQ(server.resumed(), 2);
+
+  // Sessions made under other trust settings are not used.
+  ASSERT_TRUE(Exchange(server, Context(server, restored, true), &resumed));
+  EXPECT_FALSE(resumed);
+  unlink(path.c_str());
+}
+
+TEST(TlsSessionCache, ReturnsTheTicketOfAnUnfinishedHandshake) {
+  TlsTestServer server;
+  auto sessions = std::make_shared<TlsSessionCache>();
+  auto context = Context(server, sessions);
+  bool resumed = true;
+  ASSERT_TRUE(Exchange(server, context, &resumed));
+  ASSERT_EQ(sessions->size(), 1u);
+
+  // A listener that never answers holds the handshake after the
+  // ClientHello.
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  SocketAddress address;
+  ASSERT_TRUE(IpAddress::Parse("127.0.0.1", &address.ip));
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  ASSERT_EQ(bind(listener, reinterpret_cast<sockaddr*>(&ss), len), 0);
+  ASSERT_EQ(listen(listener, 1), 0);
+  getsockname(listener, reinterpret_cast<sockaddr*>(&ss), &len);
+  SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &address);
+  {
+    int fd = Dial(address);
+    TlsStream stream(context, fd, "localhost");
+    // Nothing is taken until the handshake starts.
+    EXPECT_EQ(sessions->size(), 1u);
+    pollfd pfd = {fd, POLLOUT, 0};
+    poll(&pfd, 1, 5000);
+    EXPECT_EQ(stream.Handshake(), ByteStream::Status::kWouldBlock);
+    // While it is offered, no other attempt gets it.
+    EXPECT_EQ(sessions->size(), 0u);
+  }
+  // Abandoned, as a connection that loses a race is, it goes back.
+  close(listener);
+  EXPECT_EQ(sessions->size(), 1u);
+  ASSERT_TRUE(Exchange(server, context, &resumed));
+  EXPECT_TRUE(resumed);
+}
+
+TEST(TlsSessionCache, RejectsCorruptFiles) {
+  std::string path = ::testing::TempDir() + "tls_sessions_bad_" + std::to_string(getpid());
+  TlsSessionCache missing(path);
+  std::string error;
+  EXPECT_TRUE(missing.Load(&error));
+  {
+    FILE* file = fopen(path.c_str(), "wb");
+    fputs("TTSESS01\x01", file);
+    fclose(file);
+  }
+  TlsSessionCache truncated(path);
+  EXPECT_FALSE(truncated.Load(&error));
+  EXPECT_EQ(truncated.size(), 0u);
+  unlink(path.c_str());
+}
+
+TEST(TlsSessionCache, SendsHttp2PrefaceAsEarlyData) {
+  TlsTestServer::Options server_options;
+  server_options.max_early_data = 16384;
+  // An empty SETTINGS frame is all the client waits for.
+  AppendHttp2Settings(&server_options.greeting, {});
+  server_options.echo = false;
+  TlsTestServer server(server_options);
+
+  EventLoop loop;
+  Http2PoolOptions options;
+  options.addresses = {server.address()};
+  options.server_name = "localhost";
+  options.tls = Context(server, std::make_shared<TlsSessionCache>());
+  IgnoreStream stream;
+  auto connect = [&](Http2Pool* pool) {
+    pool->OpenStream(Http2ConnectHeaders("example.com:443", "", ""), false, &stream,
+                     [](Http2Connection*, uint32_t) {});
+    int64_t deadline = EventLoop::NowMs() + 5000;
+    while (pool->stats().connections_opened == 0 && EventLoop::NowMs() < deadline) {
+      loop.RunOnce(10);
+    }
+    return pool->stats().connections_opened == 1;
+  };
+  const std::string kMagic(kHttp2ClientPreface, kHttp2ClientPrefaceSize);
+
+  {
+    Http2Pool cold(&loop, options);
+    ASSERT_TRUE(connect(&cold));
+    EXPECT_EQ(cold.stats().tls_resumed, 0u);
+    EXPECT_TRUE(server.last_early_data().empty());
+  }
+  Http2Pool warm(&loop, options);
+  ASSERT_TRUE(connect(&warm));
+  EXPECT_EQ(warm.stats().tls_resumed, 1u);
+  EXPECT_EQ(server.early_data_accepted(), 1);
+  EXPECT_EQ(server.last_early_data().compare(0, kMagic.size(), kMagic), 0);
+  // Accepted early data is not sent again.
+  int64_t deadline = EventLoop::NowMs() + 5000;
+  while (server.last_data().empty() && EventLoop::NowMs() < deadline) loop.RunOnce(10);
+  EXPECT_FALSE(server.last_data().empty());
+  EXPECT_EQ(server.last_data().find(kMagic), std::string::npos);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
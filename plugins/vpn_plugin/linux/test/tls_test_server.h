@@ -0,0 +1,215 @@
+#ifndef FLUTTER_PLUGIN_TEST_TLS_TEST_SERVER_H_
+#define FLUTTER_PLUGIN_TEST_TLS_TEST_SERVER_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net_address.h"
+
+namespace vpn_plugin {
+namespace test {
+
+// Stand-in for the endpoint's TLS layer: a blocking TLS 1.3 server on a
+// loopback port with a fresh self-signed certificate for "localhost". It
+// issues session tickets, optionally accepts early data, and either echoes
+// what it receives or just collects it.
+class TlsTestServer {
+ public:
+  struct Options {
+    // 0 rejects early data.
+    uint32_t max_early_data = 0;
+    // Sent once the handshake is done.
+    std::string greeting;
+    bool echo = true;
+  };
+
+  TlsTestServer() : TlsTestServer(Options()) {}
+  explicit TlsTestServer(Options options) : options_(std::move(options)) {
+    ctx_ = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_3_VERSION);
+    SSL_CTX_set_max_early_data(ctx_, options_.max_early_data);
+    SSL_CTX_set_options(ctx_, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_alpn_select_cb(ctx_, &SelectAlpn, nullptr);
+    MakeCertificate();
+
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+    listen(fd_, 64);
+    socklen_t len = sizeof(sin);
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&sin), &len);
+    IpAddress::Parse("127.0.0.1", &address_.ip);
+    address_.port = ntohs(sin.sin_port);
+    thread_ = std::thread([this]() {
+      while (true) {
+        int c = accept(fd_, nullptr, nullptr);
+        if (c < 0) return;
+        connections_++;
+        int one = 1;
+        setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::lock_guard<std::mutex> lock(mutex_);
+        clients_.push_back(c);
+        workers_.emplace_back([this, c]() { Serve(c); });
+      }
+    });
+  }
+
+  ~TlsTestServer() {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    thread_.join();
+    std::vector<std::thread> workers;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int c : clients_) shutdown(c, SHUT_RDWR);
+      workers.swap(workers_);
+    }
+    for (auto& worker : workers) worker.join();
+    for (int c : clients_) close(c);
+    SSL_CTX_free(ctx_);
+  }
+
+  const SocketAddress& address() const { return address_; }
+  const std::string& certificate_pem() const { return certificate_pem_; }
+  int connections() const { return connections_; }
+  int handshakes() const { return handshakes_; }
+  int resumed() const { return resumed_; }
+  int early_data_accepted() const { return early_accepted_; }
+  // Early data and regular data of the last connection.
+  std::string last_early_data() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_early_data_;
+  }
+  std::string last_data() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_data_;
+  }
+
+ private:
+  static int SelectAlpn(SSL*, const unsigned char** out, unsigned char* out_size,
+                        const unsigned char* in, unsigned int in_size, void*) {
+    static const unsigned char kH2[] = {2, 'h', '2'};
+    unsigned char* selected = nullptr;
+    if (SSL_select_next_proto(&selected, out_size, kH2, sizeof(kH2), in, in_size) !=
+        OPENSSL_NPN_NEGOTIATED) {
+      return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  void MakeCertificate() {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+    X509_EXTENSION* san =
+        X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, "DNS:localhost");
+    X509_add_ext(cert, san, -1);
+    X509_EXTENSION_free(san);
+    X509_sign(cert, key, EVP_sha256());
+    SSL_CTX_use_certificate(ctx_, cert);
+    SSL_CTX_use_PrivateKey(ctx_, key);
+
+    BIO* bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, cert);
+    char* data = nullptr;
+    long size = BIO_get_mem_data(bio, &data);
+    certificate_pem_.assign(data, static_cast<size_t>(size));
+    BIO_free(bio);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+  }
+
+  void Serve(int fd) {
+    SSL* ssl = SSL_new(ctx_);
+    SSL_set_fd(ssl, fd);
+    std::string early;
+    char buffer[16384];
+    bool ok = true;
+    if (options_.max_early_data > 0) {
+      while (true) {
+        size_t n = 0;
+        int result = SSL_read_early_data(ssl, buffer, sizeof(buffer), &n);
+        if (result == SSL_READ_EARLY_DATA_ERROR) {
+          ok = false;
+          break;
+        }
+        early.append(buffer, n);
+        if (result == SSL_READ_EARLY_DATA_FINISH) break;
+      }
+    }
+    if (ok && SSL_accept(ssl) == 1) {
+      handshakes_++;
+      if (SSL_session_reused(ssl)) resumed_++;
+      if (SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED) early_accepted_++;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_early_data_ = early;
+        last_data_.clear();
+      }
+      if (!options_.greeting.empty()) {
+        SSL_write(ssl, options_.greeting.data(), static_cast<int>(options_.greeting.size()));
+      }
+      int n;
+      while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (last_data_.size() < 65536) last_data_.append(buffer, static_cast<size_t>(n));
+        }
+        if (options_.echo && SSL_write(ssl, buffer, n) <= 0) break;
+      }
+    }
+    // A session only stays resumable after a clean shutdown.
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    shutdown(fd, SHUT_RDWR);
+  }
+
+  Options options_;
+  SSL_CTX* ctx_;
+  std::string certificate_pem_;
+  int fd_;
+  SocketAddress address_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<int> clients_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> connections_{0};
+  std::atomic<int> handshakes_{0};
+  std::atomic<int> resumed_{0};
+  std::atomic<int> early_accepted_{0};
+  std::string last_early_data_;
+  std::string last_data_;
+};
+
+}  // namespace test
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TEST_TLS_TEST_SERVER_H_
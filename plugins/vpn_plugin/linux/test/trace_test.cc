@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+size_t Count(const std::string& text, const std::string& needle) {
+  size_t count = 0;
+  for (size_t at = text.find(needle); at != std::string::npos; at = text.find(needle, at + 1)) {
+    count++;
+  }
+  return count;
+}
+
+// Protobuf fields of one message, with varints and nested messages only,
+// which is all the trace uses.
+struct Field {
+  uint32_t number;
+  uint64_t varint;
+  std::string bytes;
+};
+
+bool ReadVarint(const std::string& data, size_t* at, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; *at < data.size() && shift < 64; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(data[(*at)++]);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+bool ReadFields(const std::string& data, std::vector<Field>* fields) {
+  for (size_t at = 0; at < data.size();) {
+    uint64_t key, value;
+    if (!ReadVarint(data, &at, &key)) return false;
+    Field field{static_cast<uint32_t>(key >> 3), 0, {}};
+    if ((key & 7) == 0) {
+      if (!ReadVarint(data, &at, &field.varint)) return false;
+    } else if ((key & 7) == 2) {
+      if (!ReadVarint(data, &at, &value) || value > data.size() - at) return false;
+      field.bytes = data.substr(at, value);
+      at += value;
+    } else {
+      return false;
+    }
+    fields->push_back(field);
+  }
+  return true;
+}
+
+const Field* Find(const std::vector<Field>& fields, uint32_t number) {
+  for (const Field& field : fields) {
+    if (field.number == number) return &field;
+  }
+  return nullptr;
+}
+
+// Track events of a Perfetto trace in file order, as "B name", "E" or
+// "I name" per track uuid.
+bool TrackEvents(const std::string& trace, std::vector<std::pair<uint64_t, std::string>>* out) {
+  std::vector<Field> packets;
+  if (!ReadFields(trace, &packets)) return false;
+  for (const Field& packet : packets) {
+    std::vector<Field> fields;
+    if (packet.number != 1 || !ReadFields(packet.bytes, &fields)) return false;
+    const Field* event = Find(fields, 11);
+    if (!event) continue;
+    std::vector<Field> event_fields;
+    if (!ReadFields(event->bytes, &event_fields)) return false;
+    const Field* type = Find(event_fields, 9);
+    const Field* track = Find(event_fields, 11);
+    const Field* name = Find(event_fields, 23);
+    if (!type || !track || !Find(fields, 8)) return false;
+    std::string text = type->varint == 1 ? "B" : type->varint == 2 ? "E" : "I";
+    if (name) text += " " + name->bytes;
+    out->emplace_back(track->varint, text);
+  }
+  return true;
+}
+
+}  // namespace
+
+TEST(Tracer, RecordsNothingWhileDisabled) {
+  Tracer::Disable();
+  Tracer::Clear();
+  {
+    TraceSpan span("test.disabled");
+    Tracer::Instant("test.disabled");
+    Tracer::Complete("test.disabled", Tracer::NowNs());
+  }
+  EXPECT_EQ(Count(Tracer::Dump(TraceFormat::kChromeJson), "test.disabled"), 0u);
+}
+
+TEST(Tracer, WritesSpansOfEveryThreadAsChromeJson) {
+  Tracer::Enable();
+  Tracer::Clear();
+  int64_t posted = Tracer::NowNs();
+  {
+    TraceSpan outer("test.outer");
+    TraceSpan inner("test.inner", 7);
+  }
+  std::thread([posted]() {
+    Tracer::Complete("test.queued", posted);
+    Tracer::Instant("test.state", 2);
+  }).join();
+  Tracer::Disable();
+
+  std::string json = Tracer::Dump(TraceFormat::kChromeJson);
+  EXPECT_EQ(json.compare(0, 2, "{\""), 0);
+  EXPECT_EQ(Count(json, "\"name\":\"test.outer\""), 1u);
+  EXPECT_EQ(Count(json, "\"name\":\"test.inner\""), 1u);
+  EXPECT_EQ(Count(json, "\"ph\":\"X\""), 2u);
+  EXPECT_EQ(Count(json, "\"value\":7"), 1u);
+  // An async span is a begin and end pair.
+  EXPECT_EQ(Count(json, "\"name\":\"test.queued\""), 2u);
+  EXPECT_EQ(Count(json, "\"ph\":\"b\""), 1u);
+  EXPECT_EQ(Count(json, "\"ph\":\"e\""), 1u);
+  EXPECT_EQ(Count(json, "\"ph\":\"i\""), 1u);
+  EXPECT_EQ(Count(json, "\"value\":2"), 1u);
+}
+
+TEST(Tracer, KeepsTheNewestEventsOfAFullBuffer) {
+  Tracer::Enable(16);
+  Tracer::Clear();
+  std::thread([]() {
+    for (int i = 0; i < 40; i++) Tracer::Instant("test.wrap", i);
+  }).join();
+  Tracer::Disable();
+
+  std::string json = Tracer::Dump(TraceFormat::kChromeJson);
+  EXPECT_EQ(Count(json, "test.wrap"), 16u);
+  EXPECT_EQ(Count(json, "\"value\":23}"), 0u);
+  EXPECT_EQ(Count(json, "\"value\":24}"), 1u);
+  EXPECT_EQ(Count(json, "\"value\":39}"), 1u);
+  EXPECT_EQ(Tracer::dropped(), 24u);
+
+  // The exited thread's buffer goes with the next clear.
+  Tracer::Clear();
+  EXPECT_EQ(Count(Tracer::Dump(TraceFormat::kChromeJson), "test.wrap"), 0u);
+  EXPECT_EQ(Tracer::dropped(), 0u);
+}
+
+TEST(Tracer, WritesNestedSlicesAsPerfettoTrackEvents) {
+  Tracer::Enable();
+  Tracer::Clear();
+  int64_t posted = Tracer::NowNs();
+  {
+    TraceSpan outer("test.outer");
+    { TraceSpan inner("test.inner"); }
+    Tracer::Instant("test.state", 1);
+  }
+  // Two overlapping async spans of one name need two tracks.
+  Tracer::Complete("test.queued", posted);
+  Tracer::Complete("test.queued", posted + 1);
+  Tracer::Disable();
+
+  std::vector<std::pair<uint64_t, std::string>> events;
+  ASSERT_TRUE(TrackEvents(Tracer::Dump(TraceFormat::kPerfetto), &events));
+  std::vector<std::string> thread;
+  std::vector<uint64_t> queued_tracks;
+  for (const auto& event : events) {
+    if (event.second == "B test.queued") {
+      queued_tracks.push_back(event.first);
+    } else if (event.second != "E") {
+      thread.push_back(event.second);
+    }
+  }
+  EXPECT_EQ(thread, std::vector<std::string>({"B test.outer", "B test.inner", "I test.state"}));
+  ASSERT_EQ(queued_tracks.size(), 2u);
+  EXPECT_NE(queued_tracks[0], queued_tracks[1]);
+  // Every slice is closed.
+  size_t ends = 0;
+  for (const auto& event : events) ends += event.second == "E";
+  EXPECT_EQ(ends, 4u);
+}
+
+TEST(Tracer, DumpsWhileThreadsRecord) {
+  Tracer::Enable(64);
+  Tracer::Clear();
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 3; t++) {
+    threads.emplace_back([&stop]() {
+      while (!stop.load()) TraceSpan span("test.busy", 1);
+    });
+  }
+  for (int i = 0; i < 50; i++) {
+    std::vector<std::pair<uint64_t, std::string>> events;
+    ASSERT_TRUE(TrackEvents(Tracer::Dump(TraceFormat::kPerfetto), &events));
+    for (const auto& event : events) {
+      ASSERT_TRUE(event.second == "B test.busy" || event.second == "E") << event.second;
+    }
+  }
+  stop = true;
+  for (std::thread& thread : threads) thread.join();
+  Tracer::Disable();
+  Tracer::Clear();
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
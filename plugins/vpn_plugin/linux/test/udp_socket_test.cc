@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "udp_socket.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+SocketAddress Loopback() {
+  SocketAddress address;
+  SocketAddress::Parse("127.0.0.1:0", 0, &address);
+  return address;
+}
+
+std::string Payload(size_t size, int seed) {
+  std::string data(size, '\0');
+  for (size_t i = 0; i < size; i++) data[i] = static_cast<char>(seed * 31 + i);
+  return data;
+}
+
+void AppendTo(UdpBatch* batch, const SocketAddress& peer, const std::string& data) {
+  uint8_t* out = batch->Append(peer, data.size());
+  ASSERT_NE(out, nullptr);
+  memcpy(out, data.data(), data.size());
+}
+
+// Receives until |count| datagrams arrived or the socket stays empty.
+std::vector<std::string> ReceiveAll(UdpSocket* socket, size_t count,
+                                    std::vector<SocketAddress>* peers = nullptr) {
+  std::vector<std::string> out;
+  UdpBatch batch;
+  for (int idle = 0; out.size() < count && idle < 1000; idle++) {
+    if (socket->Receive(&batch) <= 0) continue;
+    for (size_t i = 0; i < batch.size(); i++) {
+      out.emplace_back(static_cast<const char*>(batch.datagram(i).iov_base),
+                       batch.datagram(i).iov_len);
+      if (peers) peers->push_back(batch.peer(i));
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+TEST(UdpSocketTest, RelaysBatchesWithPeers) {
+  UdpSocket a;
+  UdpSocket b;
+  ASSERT_TRUE(a.Bind(Loopback()));
+  ASSERT_TRUE(b.Bind(Loopback()));
+  UdpBatch batch;
+  std::vector<std::string> sent = {Payload(10, 1), Payload(1400, 2), "", Payload(3000, 3)};
+  for (const auto& data : sent) AppendTo(&batch, b.local_address(), data);
+  EXPECT_EQ(a.Send(batch), sent.size());
+
+  std::vector<SocketAddress> peers;
+  EXPECT_EQ(ReceiveAll(&b, sent.size(), &peers), sent);
+  ASSERT_EQ(peers.size(), sent.size());
+  for (const auto& peer : peers) EXPECT_TRUE(peer == a.local_address());
+  EXPECT_EQ(b.Receive(&batch), 0);
+}
+
+TEST(UdpSocketTest, SegmentsRunsOfEqualSizeToOnePeer) {
+  UdpSocket sender;
+  UdpSocketOptions no_gro;
+  no_gro.gro = false;
+  UdpSocket plain(no_gro);
+  UdpSocket coalescing;
+  ASSERT_TRUE(sender.Bind(Loopback()));
+  ASSERT_TRUE(plain.Bind(Loopback()));
+  ASSERT_TRUE(coalescing.Bind(Loopback()));
+  if (!sender.gso()) GTEST_SKIP() << "no UDP_SEGMENT";
+
+  // Ten full segments and a short tail to each receiver.
+  std::vector<std::string> sent;
+  for (int i = 0; i < 10; i++) sent.push_back(Payload(1200, i));
+  sent.push_back(Payload(500, 10));
+  UdpBatch batch;
+  for (const auto& data : sent) AppendTo(&batch, plain.local_address(), data);
+  for (const auto& data : sent) AppendTo(&batch, coalescing.local_address(), data);
+  uint64_t before = sender.syscalls();
+  EXPECT_EQ(sender.Send(batch), 2 * sent.size());
+  EXPECT_EQ(sender.syscalls() - before, 1u);
+
+  // Whether or not the kernel kept the train together, the receiver sees
+  // the original datagrams.
+  EXPECT_EQ(ReceiveAll(&plain, sent.size()), sent);
+  EXPECT_EQ(ReceiveAll(&coalescing, sent.size()), sent);
+}
+
+TEST(UdpSocketTest, FallsBackToOneCallPerDatagram) {
+  UdpSocketOptions options;
+  options.batching = false;
+  options.gso = false;
+  options.gro = false;
+  UdpSocket a(options);
+  UdpSocket b(options);
+  ASSERT_TRUE(a.Bind(Loopback()));
+  ASSERT_TRUE(b.Bind(Loopback()));
+  EXPECT_FALSE(a.gso());
+  EXPECT_FALSE(b.gro());
+
+  UdpBatch batch;
+  std::vector<std::string> sent;
+  for (int i = 0; i < 5; i++) {
+    sent.push_back(Payload(100, i));
+    AppendTo(&batch, b.local_address(), sent.back());
+  }
+  EXPECT_EQ(a.Send(batch), sent.size());
+  EXPECT_EQ(a.syscalls(), sent.size());
+  EXPECT_EQ(ReceiveAll(&b, sent.size()), sent);
+  EXPECT_EQ(b.syscalls(), sent.size());
+}
+
+TEST(UdpSocketTest, SkipsDatagramsTheKernelRefuses) {
+  UdpSocket a;
+  UdpSocket b;
+  ASSERT_TRUE(a.Bind(Loopback()));
+  ASSERT_TRUE(b.Bind(Loopback()));
+  SocketAddress v6;
+  SocketAddress::Parse("[::1]:9", 0, &v6);
+  UdpBatch batch;
+  AppendTo(&batch, b.local_address(), "first");
+  // An IPv6 peer on an IPv4 socket fails with EAFNOSUPPORT.
+  AppendTo(&batch, v6, "lost");
+  AppendTo(&batch, b.local_address(), "last");
+  EXPECT_EQ(a.Send(batch), 2u);
+  EXPECT_EQ(ReceiveAll(&b, 2), (std::vector<std::string>{"first", "last"}));
+}
+
+TEST(UdpSocketTest, BatchRefusesMoreThanItsCapacity) {
+  UdpBatch batch(2);
+  SocketAddress peer = Loopback();
+  EXPECT_NE(batch.Append(peer, 10), nullptr);
+  EXPECT_TRUE(batch.Add(peer, "x", 1));
+  EXPECT_EQ(batch.Append(peer, 10), nullptr);
+  EXPECT_FALSE(batch.Add(peer, "y", 1));
+  EXPECT_EQ(batch.Append(peer, UdpBatch::kSlotSize + 1), nullptr);
+  batch.Clear();
+  EXPECT_TRUE(batch.empty());
+  EXPECT_NE(batch.Append(peer, UdpBatch::kSlotSize), nullptr);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
@@ -0,0 +1,131 @@
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "event_loop.h"
+#include "uring_relay.h"
+
+namespace vpn_plugin {
+namespace test {
+
+namespace {
+
+// One end of a stream socketpair for the relay and one for the test.
+struct StreamPair {
+  StreamPair() {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    relay_end = fds[0];
+    test_end = fds[1];
+  }
+  ~StreamPair() {
+    close(relay_end);
+    close(test_end);
+  }
+  int relay_end;
+  int test_end;
+};
+
+class UringRelayTest : public ::testing::Test {
+ protected:
+  UringRelayTest() : loop_(EventLoopBackend::kIoUring) {}
+
+  void SetUp() override {
+    if (loop_.backend() != EventLoopBackend::kIoUring) GTEST_SKIP() << "no io_uring";
+  }
+
+  std::shared_ptr<UringRelayPool> MakePool(unsigned buffers) {
+    UringRelayOptions options;
+    options.buffer_count = buffers;
+    options.buffer_size = 4096;
+    options.max_buffers_per_direction = 4;
+    options.fixed_files = 16;
+    return UringRelayPool::Create(&loop_, options);
+  }
+
+  // Writes |data| to |from| and reads |to| while running the loop, like a
+  // client and a server on either side of the relay, until |expected| bytes
+  // arrived.
+  std::string Transfer(int from, int to, const std::string& data, size_t expected) {
+    std::string got;
+    size_t sent = 0;
+    for (int i = 0; i < 10000 && got.size() < expected; i++) {
+      if (sent < data.size()) {
+        ssize_t n = send(from, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) sent += n;
+      }
+      loop_.RunOnce(1);
+      char buf[8192];
+      ssize_t n;
+      while ((n = recv(to, buf, sizeof(buf), 0)) > 0) got.append(buf, n);
+    }
+    return got;
+  }
+
+  EventLoop loop_;
+};
+
+}  // namespace
+
+TEST_F(UringRelayTest, RelaysBothWaysAndHalfCloses) {
+  auto pool = MakePool(8);
+  ASSERT_TRUE(pool);
+  StreamPair client;
+  StreamPair upstream;
+  std::atomic<uint64_t> bytes{0};
+  int done = -1;
+  auto relay = UringRelay::Start(pool, client.relay_end, upstream.relay_end, "early", "reply",
+                                 &bytes, [&](bool ok) { done = ok; });
+
+  // More than the whole pool, so receives pause and wait for buffers.
+  std::string big(256 * 1024, 'u');
+  for (size_t i = 0; i < big.size(); i += 97) big[i] = static_cast<char>(i);
+  EXPECT_EQ(Transfer(client.test_end, upstream.test_end, big, 5 + big.size()), "early" + big);
+  EXPECT_EQ(Transfer(upstream.test_end, client.test_end, "pong", 9), "replypong");
+
+  shutdown(client.test_end, SHUT_WR);
+  for (int i = 0; i < 100 && done < 0; i++) loop_.RunOnce(1);
+  char c;
+  EXPECT_EQ(recv(upstream.test_end, &c, 1, 0), 0);
+  EXPECT_EQ(done, -1);
+  shutdown(upstream.test_end, SHUT_WR);
+  for (int i = 0; i < 100 && done < 0; i++) loop_.RunOnce(1);
+  EXPECT_EQ(done, 1);
+  EXPECT_EQ(bytes.load(), 5 + big.size() + 9);
+}
+
+TEST_F(UringRelayTest, StopReturnsBuffersToThePool) {
+  auto pool = MakePool(8);
+  ASSERT_TRUE(pool);
+  {
+    StreamPair client;
+    StreamPair upstream;
+    auto relay = UringRelay::Start(pool, client.relay_end, upstream.relay_end, "", "", nullptr,
+                                   [](bool) {});
+    // Nobody reads the upstream side, so the relay holds buffers.
+    std::string data(64 * 1024, 'x');
+    send(client.test_end, data.data(), data.size(), MSG_NOSIGNAL);
+    for (int i = 0; i < 20; i++) loop_.RunOnce(1);
+    relay->Stop();
+    for (int i = 0; i < 20; i++) loop_.RunOnce(1);
+  }
+  // A second relay gets the whole pool again.
+  StreamPair client;
+  StreamPair upstream;
+  auto relay = UringRelay::Start(pool, client.relay_end, upstream.relay_end, "", "", nullptr,
+                                 [](bool) {});
+  std::string data(40 * 1024, 'y');
+  EXPECT_EQ(Transfer(client.test_end, upstream.test_end, data, data.size()), data);
+  relay->Stop();
+  for (int i = 0; i < 20; i++) loop_.RunOnce(1);
+}
+
+}  // namespace test
+}  // namespace vpn_plugin
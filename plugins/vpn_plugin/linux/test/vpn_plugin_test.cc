@@ -2,7 +2,11 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "include/vpn_plugin/vpn_plugin.h"
+#include "test/fake_binary_messenger.h"
 #include "vpn_plugin_private.h"
 
 // This demonstrates a simple unit test of the C portion of this plugin's
@@ -16,15 +20,292 @@
 namespace vpn_plugin {
 namespace test {
 
-TEST(VpnPlugin, GetPlatformVersion) {
-  g_autoptr(FlMethodResponse) response = get_platform_version();
-  ASSERT_NE(response, nullptr);
-  ASSERT_TRUE(FL_IS_METHOD_SUCCESS_RESPONSE(response));
-  FlValue* result = fl_method_success_response_get_result(
-      FL_METHOD_SUCCESS_RESPONSE(response));
-  ASSERT_EQ(fl_value_get_type(result), FL_VALUE_TYPE_STRING);
-  // The full string varies, so just validate that it has the right format.
-  EXPECT_THAT(fl_value_get_string(result), testing::StartsWith("Linux "));
+namespace {
+
+FlValue* ServerArgs(const gchar* ip, const gchar* dns) {
+  FlValue* args = fl_value_new_map();
+  fl_value_set_string_take(args, "ipAddress", fl_value_new_string(ip));
+  fl_value_set_string_take(args, "domain", fl_value_new_string("vpn.example.com"));
+  fl_value_set_string_take(args, "username", fl_value_new_string("user"));
+  fl_value_set_string_take(args, "password", fl_value_new_string("secret"));
+  fl_value_set_string_take(args, "routingProfileId", fl_value_new_int(1));
+  fl_value_set_string_take(args, "protocol", fl_value_new_int(1));
+  fl_value_set_string_take(args, "dnsServers", fl_value_new_string(dns));
+  return args;
+}
+
+// The success result of |channel|.|method|, or NULL. Owned by the caller.
+FlValue* Call(VpnPlugin* plugin, const gchar* channel, const gchar* method, FlValue* args) {
+  g_autoptr(FlMethodResponse) response =
+      vpn_plugin_handle_method_call(plugin, channel, method, args);
+  if (!FL_IS_METHOD_SUCCESS_RESPONSE(response)) return NULL;
+  return fl_value_ref(
+      fl_method_success_response_get_result(FL_METHOD_SUCCESS_RESPONSE(response)));
+}
+
+// Encodes a call of |method| with |args|, which may be NULL.
+GBytes* Encode(const gchar* method, FlValue* args) {
+  g_autoptr(FlStandardMethodCodec) codec = fl_standard_method_codec_new();
+  return fl_method_codec_encode_method_call(FL_METHOD_CODEC(codec), method, args, NULL);
+}
+
+// Sends |method| on |channel| through |messenger| and runs the main loop
+// until the response arrives. Returns the decoded response.
+FlMethodResponse* Send(FakeBinaryMessenger* messenger, const gchar* channel, const gchar* method,
+                       FlValue* args = NULL) {
+  g_autoptr(FlStandardMethodCodec) codec = fl_standard_method_codec_new();
+  g_autoptr(GBytes) message = Encode(method, args);
+  GBytes* response = NULL;
+  if (!fake_binary_messenger_send(messenger, channel, message,
+                                  [&response](GBytes* bytes) { response = g_bytes_ref(bytes); })) {
+    return NULL;
+  }
+  gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+  while (!response && g_get_monotonic_time() < deadline) g_main_context_iteration(NULL, FALSE);
+  if (!response) return NULL;
+  FlMethodResponse* decoded = fl_method_codec_decode_response(FL_METHOD_CODEC(codec), response, NULL);
+  g_bytes_unref(response);
+  return decoded;
+}
+
+// A main loop timer that records how late its ticks come.
+struct Ticker {
+  static constexpr guint kIntervalMs = 10;
+
+  static gboolean Tick(gpointer data) {
+    Ticker* ticker = static_cast<Ticker*>(data);
+    gint64 now = g_get_monotonic_time();
+    ticker->worst_us = MAX(ticker->worst_us, now - ticker->due_us);
+    ticker->due_us = now + kIntervalMs * 1000;
+    ticker->ticks++;
+    return G_SOURCE_CONTINUE;
+  }
+
+  gint64 due_us = g_get_monotonic_time() + kIntervalMs * 1000;
+  gint64 worst_us = 0;
+  int ticks = 0;
+};
+
+}  // namespace
+
+TEST(VpnPlugin, AnswersCallsAndSendsEventsThroughTheMessenger) {
+  g_autoptr(FakeBinaryMessenger) messenger = fake_binary_messenger_new();
+  int events = 0;
+  fake_binary_messenger_set_outgoing(messenger, [&events](const gchar* channel, GBytes*) {
+    if (g_strcmp0(channel, "vpn_plugin_event_channel") == 0) events++;
+  });
+  g_autoptr(FakePluginRegistrar) registrar = fake_plugin_registrar_new(messenger);
+  vpn_plugin_register_with_registrar(FL_PLUGIN_REGISTRAR(registrar));
+
+  g_autoptr(FlMethodResponse) listened = Send(messenger, "vpn_plugin_event_channel", "listen");
+  ASSERT_NE(listened, nullptr);
+  EXPECT_TRUE(FL_IS_METHOD_SUCCESS_RESPONSE(listened));
+  // The current state is sent on subscription, or once storage has loaded
+  // if that was later.
+  gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+  while (events == 0 && g_get_monotonic_time() < deadline) g_main_context_iteration(NULL, FALSE);
+  EXPECT_EQ(events, 1);
+
+  // The handler runs on a dispatcher thread; the reply comes back through
+  // the main loop.
+  g_autoptr(FlMethodResponse) state = Send(messenger, "ivpn_manager", "getCurrentState");
+  ASSERT_NE(state, nullptr);
+  ASSERT_TRUE(FL_IS_METHOD_SUCCESS_RESPONSE(state));
+  EXPECT_EQ(fl_value_get_int(
+                fl_method_success_response_get_result(FL_METHOD_SUCCESS_RESPONSE(state))),
+            0);
+
+  g_autoptr(FlMethodResponse) unknown = Send(messenger, "servers_manager", "getPlatformVersion");
+  ASSERT_NE(unknown, nullptr);
+  EXPECT_TRUE(FL_IS_METHOD_NOT_IMPLEMENTED_RESPONSE(unknown));
+}
+
+TEST(VpnPlugin, KeepsTheMainLoopResponsiveWhileHandlersWork) {
+  g_autoptr(FakeBinaryMessenger) messenger = fake_binary_messenger_new();
+  std::vector<int64_t> states;
+  fake_binary_messenger_set_outgoing(messenger, [&states](const gchar* channel, GBytes* bytes) {
+    if (g_strcmp0(channel, "vpn_plugin_event_channel") != 0) return;
+    g_autoptr(FlStandardMethodCodec) codec = fl_standard_method_codec_new();
+    g_autoptr(FlMethodResponse) event =
+        fl_method_codec_decode_response(FL_METHOD_CODEC(codec), bytes, NULL);
+    if (!FL_IS_METHOD_SUCCESS_RESPONSE(event)) return;
+    states.push_back(
+        fl_value_get_int(fl_method_success_response_get_result(FL_METHOD_SUCCESS_RESPONSE(event))));
+  });
+  g_autoptr(FakePluginRegistrar) registrar = fake_plugin_registrar_new(messenger);
+  vpn_plugin_register_with_registrar(FL_PLUGIN_REGISTRAR(registrar));
+  g_autoptr(FlMethodResponse) listened = Send(messenger, "vpn_plugin_event_channel", "listen");
+  ASSERT_NE(listened, nullptr);
+
+  // Rules for the selected server's profile, so that start builds its
+  // policy and every edit rebuilds it while the engine runs. Encoded once,
+  // so the main loop only delivers them.
+  GString* rules = g_string_new(NULL);
+  for (int i = 0; i < 500000; i++) g_string_append_printf(rules, "host%d.example.com\n", i);
+  g_autoptr(FlValue) rule_args = fl_value_new_map();
+  fl_value_set_string_take(rule_args, "id", fl_value_new_int(1));
+  fl_value_set_string_take(rule_args, "mode", fl_value_new_int(1));
+  fl_value_set_string_take(rule_args, "rules", fl_value_new_string(rules->str));
+  g_string_free(rules, TRUE);
+  g_autoptr(GBytes) set_rules = Encode("setRules", rule_args);
+  g_autoptr(FlValue) start_args = fl_value_new_map();
+  fl_value_set_string_take(
+      start_args, "config",
+      fl_value_new_string("[listener.socks]\naddress = \"127.0.0.1:0\"\nshards = 2\n"
+                          "pin_cpus = false\n"));
+  g_autoptr(GBytes) start = Encode("start", start_args);
+
+  int sent = 0;
+  int answered = 0;
+  auto send = [&](const gchar* channel, GBytes* message) {
+    sent++;
+    EXPECT_TRUE(fake_binary_messenger_send(messenger, channel, message,
+                                           [&answered](GBytes*) { answered++; }));
+  };
+  send("routing_profiles_manager", set_rules);
+  send("ivpn_manager", start);
+
+  // A rule edit is always in flight until the connect timer has fired,
+  // and the ticks keep time throughout.
+  Ticker ticker;
+  guint timer = g_timeout_add(Ticker::kIntervalMs, Ticker::Tick, &ticker);
+  auto connected = [&states]() { return std::count(states.begin(), states.end(), 2) > 0; };
+  gint64 deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+  while (!connected() && g_get_monotonic_time() < deadline) {
+    if (answered == sent) send("routing_profiles_manager", set_rules);
+    g_main_context_iteration(NULL, TRUE);
+  }
+  g_source_remove(timer);
+  deadline = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+  while (answered < sent && g_get_monotonic_time() < deadline) {
+    g_main_context_iteration(NULL, FALSE);
+  }
+  g_autoptr(FlMethodResponse) stopped = Send(messenger, "ivpn_manager", "stop");
+
+  EXPECT_EQ(answered, sent);
+  EXPECT_GT(sent, 2);
+  EXPECT_TRUE(connected());
+  EXPECT_GT(ticker.ticks, 100);
+  EXPECT_LT(ticker.worst_us, 50 * 1000);
+}
+
+TEST(VpnPlugin, ReportsHandlerTimesInMetrics) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  g_autoptr(FlValue) before = Call(plugin, "storage_manager", "getMetrics", NULL);
+  ASSERT_NE(before, nullptr);
+  const gchar* series =
+      "vpn_method_duration_us{channel=\"ivpn_manager\",method=\"getCurrentState\"}";
+  FlValue* histogram = fl_value_lookup_string(before, series);
+  ASSERT_NE(histogram, nullptr);
+  int64_t count = fl_value_get_int(fl_value_lookup_string(histogram, "count"));
+
+  g_autoptr(FlValue) state = Call(plugin, "ivpn_manager", "getCurrentState", NULL);
+  ASSERT_NE(state, nullptr);
+  g_autoptr(FlValue) after = Call(plugin, "storage_manager", "getMetrics", NULL);
+  histogram = fl_value_lookup_string(after, series);
+  ASSERT_NE(histogram, nullptr);
+  EXPECT_EQ(fl_value_get_int(fl_value_lookup_string(histogram, "count")), count + 1);
+  EXPECT_NE(fl_value_lookup_string(histogram, "p99"), nullptr);
+  g_object_unref(plugin);
+}
+
+TEST(VpnPlugin, ValidatesIpv4Addresses) {
+  EXPECT_TRUE(is_valid_ipv4("192.168.1.100"));
+  EXPECT_TRUE(is_valid_ipv4("0.0.0.0"));
+  EXPECT_FALSE(is_valid_ipv4("256.1.1.1"));
+  EXPECT_FALSE(is_valid_ipv4("1.2.3"));
+  EXPECT_FALSE(is_valid_ipv4("1.2.3.4.5"));
+  EXPECT_FALSE(is_valid_ipv4("1.2.x.4"));
+  EXPECT_FALSE(is_valid_ipv4(""));
+  EXPECT_FALSE(is_valid_ipv4(NULL));
+}
+
+TEST(VpnPlugin, SplitsAndTrimsLists) {
+  GPtrArray* parts = string_split_csv(" 8.8.8.8 ,, 1.1.1.1,", ",");
+  ASSERT_EQ(parts->len, 2u);
+  EXPECT_STREQ(static_cast<const gchar*>(g_ptr_array_index(parts, 0)), "8.8.8.8");
+  EXPECT_STREQ(static_cast<const gchar*>(g_ptr_array_index(parts, 1)), "1.1.1.1");
+  string_array_free(parts);
+  parts = string_split_csv(NULL, ",");
+  EXPECT_EQ(parts->len, 0u);
+  string_array_free(parts);
+}
+
+TEST(VpnPlugin, AddsReplacesAndRemovesServersAndRules) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+
+  g_autoptr(FlValue) bad = ServerArgs("10.0.0", "8.8.8.8");
+  g_autoptr(FlValue) rejected = Call(plugin, "servers_manager", "addNewServer", bad);
+  ASSERT_NE(rejected, nullptr);
+  EXPECT_EQ(fl_value_get_int(rejected), 1);
+
+  g_autoptr(FlValue) good = ServerArgs("10.0.0.1", "8.8.8.8, 8.8.4.4");
+  g_autoptr(FlValue) added = Call(plugin, "servers_manager", "addNewServer", good);
+  ASSERT_NE(added, nullptr);
+  EXPECT_EQ(fl_value_get_int(added), 0);
+  g_autoptr(FlValue) servers = Call(plugin, "storage_manager", "getAllServers", NULL);
+  ASSERT_EQ(fl_value_get_length(servers), 3u);
+  FlValue* last = fl_value_get_list_value(servers, 2);
+  EXPECT_STREQ(fl_value_get_string(fl_value_lookup_string(last, "ipAddress")), "10.0.0.1");
+  EXPECT_EQ(fl_value_get_length(fl_value_lookup_string(last, "dnsServers")), 2u);
+
+  g_autoptr(FlValue) remove = fl_value_new_map();
+  fl_value_set_string_take(remove, "id", fl_value_new_int(3));
+  g_autoptr(FlValue) removed = Call(plugin, "servers_manager", "removeServer", remove);
+  g_autoptr(FlValue) remaining = Call(plugin, "storage_manager", "getAllServers", NULL);
+  EXPECT_EQ(fl_value_get_length(remaining), 2u);
+
+  // Replacing a rule list frees the old one.
+  for (const gchar* rules : {"a.example\nb.example", "c.example"}) {
+    g_autoptr(FlValue) args = fl_value_new_map();
+    fl_value_set_string_take(args, "id", fl_value_new_int(1));
+    fl_value_set_string_take(args, "mode", fl_value_new_int(1));
+    fl_value_set_string_take(args, "rules", fl_value_new_string(rules));
+    g_autoptr(FlValue) done = Call(plugin, "routing_profiles_manager", "setRules", args);
+    EXPECT_NE(done, nullptr);
+  }
+  g_autoptr(FlValue) profiles = Call(plugin, "storage_manager", "getRoutingProfiles", NULL);
+  FlValue* bypass = fl_value_lookup_string(fl_value_get_list_value(profiles, 0), "bypassRules");
+  ASSERT_EQ(fl_value_get_length(bypass), 1u);
+  EXPECT_STREQ(fl_value_get_string(fl_value_get_list_value(bypass, 0)), "c.example");
+
+  g_autoptr(FlMethodResponse) unknown =
+      vpn_plugin_handle_method_call(plugin, "servers_manager", "getPlatformVersion", NULL);
+  EXPECT_TRUE(FL_IS_METHOD_NOT_IMPLEMENTED_RESPONSE(unknown));
+  g_object_unref(plugin);
+}
+
+TEST(VpnPlugin, StorageMemoryReturnsToItsBaseline) {
+  VpnPlugin* plugin = VPN_PLUGIN(g_object_new(vpn_plugin_get_type(), NULL));
+  auto bytes = [plugin](const gchar* subsystem) -> int64_t {
+    g_autoptr(FlValue) usage = Call(plugin, "storage_manager", "getMemoryUsage", NULL);
+    FlValue* entry = usage ? fl_value_lookup_string(usage, subsystem) : NULL;
+    return entry ? fl_value_get_int(fl_value_lookup_string(entry, "bytes")) : -1;
+  };
+  int64_t servers = bytes("servers");
+  int64_t rules = bytes("routingRules");
+  ASSERT_GT(servers, 0);
+  ASSERT_GT(rules, 0);
+
+  // Many add, remove and rule edit cycles leave the storage as it was.
+  for (int i = 0; i < 1000; i++) {
+    g_autoptr(FlValue) server = ServerArgs("10.0.0.1", "8.8.8.8, 8.8.4.4");
+    g_autoptr(FlValue) added = Call(plugin, "servers_manager", "addNewServer", server);
+    ASSERT_NE(added, nullptr);
+    g_autoptr(FlValue) remove = fl_value_new_map();
+    fl_value_set_string_take(remove, "id", fl_value_new_int(3));
+    g_autoptr(FlValue) removed = Call(plugin, "servers_manager", "removeServer", remove);
+    g_autoptr(FlValue) args = fl_value_new_map();
+    fl_value_set_string_take(args, "id", fl_value_new_int(1));
+    fl_value_set_string_take(args, "mode", fl_value_new_int(0));
+    fl_value_set_string_take(args, "rules",
+                             fl_value_new_string(i % 2 ? "*" : "192.168.1.0/24\n10.0.0.0/8"));
+    g_autoptr(FlValue) done = Call(plugin, "routing_profiles_manager", "setRules", args);
+    ASSERT_NE(done, nullptr);
+  }
+  EXPECT_EQ(bytes("servers"), servers);
+  EXPECT_EQ(bytes("routingRules"), rules);
+  g_object_unref(plugin);
 }
 
 }  // namespace test
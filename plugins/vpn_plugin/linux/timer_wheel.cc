@@ -0,0 +1,90 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace vpn_plugin {
+
+TimerWheel::TimerWheel(size_t capacity, uint64_t now_tick)
+    : now_(now_tick),
+      next_(capacity, kNone),
+      prev_(capacity, kNone),
+      expiry_(capacity, 0),
+      slot_(capacity, kUnlinked) {
+  std::fill(std::begin(heads_), std::end(heads_), kNone);
+}
+
+void TimerWheel::Schedule(uint32_t id, uint64_t tick) {
+  if (slot_[id] != kUnlinked) Unlink(id);
+  expiry_[id] = std::max(tick, now_ + 1);
+  Link(id);
+}
+
+void TimerWheel::Cancel(uint32_t id) {
+  if (slot_[id] != kUnlinked) Unlink(id);
+}
+
+void TimerWheel::Move(uint32_t from, uint32_t to) {
+  if (slot_[from] == kUnlinked) return;
+  next_[to] = next_[from];
+  prev_[to] = prev_[from];
+  expiry_[to] = expiry_[from];
+  slot_[to] = slot_[from];
+  if (prev_[to] != kNone) {
+    next_[prev_[to]] = to;
+  } else {
+    heads_[slot_[to]] = to;
+  }
+  if (next_[to] != kNone) prev_[next_[to]] = to;
+  slot_[from] = kUnlinked;
+}
+
+void TimerWheel::Link(uint32_t id) {
+  // Timers further out than the top level can hold wait in its last slot
+  // and are placed again as they cascade.
+  constexpr uint64_t kHorizon = uint64_t{1} << (kLevels * kSlotBits);
+  uint64_t delta = expiry_[id] - now_;
+  uint64_t tick = delta < kHorizon ? expiry_[id] : now_ + kHorizon - 1;
+  int level = 0;
+  while (level < kLevels - 1 && delta >= (uint64_t{1} << ((level + 1) * kSlotBits))) level++;
+  uint16_t slot =
+      static_cast<uint16_t>(level * kSlots + ((tick >> (level * kSlotBits)) & kSlotMask));
+  slot_[id] = slot;
+  prev_[id] = kNone;
+  next_[id] = heads_[slot];
+  if (next_[id] != kNone) prev_[next_[id]] = id;
+  heads_[slot] = id;
+  count_++;
+}
+
+void TimerWheel::Unlink(uint32_t id) {
+  uint16_t slot = slot_[id];
+  if (prev_[id] != kNone) {
+    next_[prev_[id]] = next_[id];
+  } else {
+    heads_[slot] = next_[id];
+  }
+  if (next_[id] != kNone) prev_[next_[id]] = prev_[id];
+  slot_[id] = kUnlinked;
+  count_--;
+}
+
+void TimerWheel::Cascade() {
+  // Highest level first, so timers it hands down to a lower level that is
+  // also due are redistributed again below.
+  for (int level = kLevels - 1; level > 0; level--) {
+    if (now_ & ((uint64_t{1} << (level * kSlotBits)) - 1)) continue;
+    uint16_t slot =
+        static_cast<uint16_t>(level * kSlots + ((now_ >> (level * kSlotBits)) & kSlotMask));
+    uint32_t id = heads_[slot];
+    heads_[slot] = kNone;
+    while (id != kNone) {
+      uint32_t next = next_[id];
+      slot_[id] = kUnlinked;
+      count_--;
+      Link(id);
+      id = next;
+    }
+  }
+}
+
+}  // namespace vpn_plugin
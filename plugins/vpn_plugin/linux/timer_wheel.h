@@ -0,0 +1,80 @@
+#ifndef FLUTTER_PLUGIN_TIMER_WHEEL_H_
+#define FLUTTER_PLUGIN_TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace vpn_plugin {
+
+// Hierarchical timer wheel over dense ids [0, capacity): four levels of 64
+// slots, so a timer up to 2^24 ticks away is armed, cancelled or moved in
+// O(1) and only cascades once per level on its way down. Timers live in
+// intrusive lists indexed by id, which lets a table keep them beside its
+// slots without allocating per timer.
+class TimerWheel {
+ public:
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  explicit TimerWheel(size_t capacity, uint64_t now_tick = 0);
+
+  size_t capacity() const { return next_.size(); }
+  size_t size() const { return count_; }
+  uint64_t now() const { return now_; }
+
+  // Arms |id| to fire at |tick|, replacing any earlier schedule. Ticks not
+  // after now() fire on the next Advance().
+  void Schedule(uint32_t id, uint64_t tick);
+  void Cancel(uint32_t id);
+  bool scheduled(uint32_t id) const { return slot_[id] != kUnlinked; }
+  uint64_t expiry(uint32_t id) const { return expiry_[id]; }
+  // Hands the timer of |from| to |to|, which must not be scheduled.
+  void Move(uint32_t from, uint32_t to);
+
+  // Moves time forward to |tick|, calling fn(id) for every timer that is
+  // due. Callbacks may schedule, cancel or move timers.
+  template <typename Fn>
+  size_t Advance(uint64_t tick, Fn fn) {
+    size_t fired = 0;
+    while (now_ < tick) {
+      if (count_ == 0) {
+        now_ = tick;
+        break;
+      }
+      now_++;
+      Cascade();
+      uint32_t slot = static_cast<uint32_t>(now_ & kSlotMask);
+      while (heads_[slot] != kNone) {
+        uint32_t id = heads_[slot];
+        Unlink(id);
+        fired++;
+        fn(id);
+      }
+    }
+    return fired;
+  }
+
+ private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr uint32_t kSlots = 1u << kSlotBits;
+  static constexpr uint64_t kSlotMask = kSlots - 1;
+  static constexpr uint16_t kUnlinked = UINT16_MAX;
+
+  void Link(uint32_t id);
+  void Unlink(uint32_t id);
+  // Redistributes the higher-level slots that come due at now_.
+  void Cascade();
+
+  uint64_t now_;
+  size_t count_ = 0;
+  uint32_t heads_[kLevels * kSlots];
+  std::vector<uint32_t> next_;
+  std::vector<uint32_t> prev_;
+  std::vector<uint64_t> expiry_;
+  std::vector<uint16_t> slot_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TIMER_WHEEL_H_
@@ -0,0 +1,178 @@
+#include "tls_session_cache.h"
+
+#include <fcntl.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+namespace vpn_plugin {
+
+namespace {
+
+constexpr char kMagic[8] = {'T', 'T', 'S', 'E', 'S', 'S', '0', '1'};
+
+void AppendU32(std::string* out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8) out->push_back(static_cast<char>(v >> shift));
+}
+
+bool ReadU32(const std::string& data, size_t* offset, uint32_t* v) {
+  if (data.size() - *offset < 4) return false;
+  const auto* p = reinterpret_cast<const uint8_t*>(data.data() + *offset);
+  *v = static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  *offset += 4;
+  return true;
+}
+
+bool ReadBytes(const std::string& data, size_t* offset, std::string* out) {
+  uint32_t size;
+  if (!ReadU32(data, offset, &size) || data.size() - *offset < size) return false;
+  out->assign(data, *offset, size);
+  *offset += size;
+  return true;
+}
+
+SSL_SESSION* Decode(const std::string& der) {
+  const auto* p = reinterpret_cast<const unsigned char*>(der.data());
+  return d2i_SSL_SESSION(nullptr, &p, static_cast<long>(der.size()));
+}
+
+bool Usable(const SSL_SESSION* session) {
+  return SSL_SESSION_is_resumable(session) &&
+         SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) > time(nullptr);
+}
+
+// DER-encodes |session| if it can be resumed.
+bool Encode(SSL_SESSION* session, std::string* der) {
+  if (!session || !Usable(session)) return false;
+  int size = i2d_SSL_SESSION(session, nullptr);
+  if (size <= 0) return false;
+  der->assign(static_cast<size_t>(size), '\0');
+  auto* p = reinterpret_cast<unsigned char*>(&(*der)[0]);
+  return i2d_SSL_SESSION(session, &p) == size;
+}
+
+}  // namespace
+
+TlsSessionCache::TlsSessionCache(std::string path) : path_(std::move(path)) {}
+
+bool TlsSessionCache::Load(std::string* error) {
+  if (path_.empty()) return true;
+  std::ifstream file(path_, std::ios::binary);
+  if (!file) return true;
+  std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (data.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+    if (error) *error = path_ + " is not a session cache";
+    return false;
+  }
+  std::unordered_map<std::string, std::string> sessions;
+  size_t offset = sizeof(kMagic);
+  while (offset < data.size()) {
+    std::string key;
+    std::string der;
+    if (!ReadBytes(data, &offset, &key) || !ReadBytes(data, &offset, &der)) {
+      if (error) *error = path_ + " is truncated";
+      return false;
+    }
+    SSL_SESSION* session = Decode(der);
+    if (!session) continue;
+    if (Usable(session)) sessions[key] = std::move(der);
+    SSL_SESSION_free(session);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_ = std::move(sessions);
+  return true;
+}
+
+bool TlsSessionCache::Save(std::string* error) const {
+  if (path_.empty()) return true;
+  std::string data(kMagic, sizeof(kMagic));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : sessions_) {
+      AppendU32(&data, static_cast<uint32_t>(entry.first.size()));
+      data += entry.first;
+      AppendU32(&data, static_cast<uint32_t>(entry.second.size()));
+      data += entry.second;
+    }
+  }
+  // Written aside and renamed, so a crash leaves the old file or the new
+  // one.
+  std::string temp = path_ + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    if (error) *error = "cannot create " + temp;
+    return false;
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n <= 0) break;
+    written += static_cast<size_t>(n);
+  }
+  bool ok = close(fd) == 0 && written == data.size() && rename(temp.c_str(), path_.c_str()) == 0;
+  if (!ok) {
+    unlink(temp.c_str());
+    if (error) *error = "cannot write " + path_;
+  }
+  return ok;
+}
+
+SSL_SESSION* TlsSessionCache::Take(const std::string& key) {
+  std::string der;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(key);
+    if (it == sessions_.end()) return nullptr;
+    der = std::move(it->second);
+    sessions_.erase(it);
+  }
+  SSL_SESSION* session = Decode(der);
+  if (session && !Usable(session)) {
+    SSL_SESSION_free(session);
+    return nullptr;
+  }
+  return session;
+}
+
+void TlsSessionCache::Put(const std::string& key, SSL_SESSION* session) {
+  std::string der;
+  if (!Encode(session, &der)) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_[key] = std::move(der);
+}
+
+void TlsSessionCache::Restore(const std::string& key, SSL_SESSION* session) {
+  std::string der;
+  if (!Encode(session, &der)) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_.emplace(key, std::move(der));
+}
+
+void TlsSessionCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessions_.clear();
+}
+
+size_t TlsSessionCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sessions_.size();
+}
+
+MemoryUsage TlsSessionCache::memory_usage() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  MemoryUsage usage;
+  usage.bytes = HeapBytes(sessions_);
+  for (const auto& session : sessions_) {
+    usage.bytes += HeapBytes(session.first) + HeapBytes(session.second);
+  }
+  usage.objects = sessions_.size();
+  return usage;
+}
+
+}  // namespace vpn_plugin
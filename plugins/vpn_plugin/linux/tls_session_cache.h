@@ -0,0 +1,53 @@
+#ifndef FLUTTER_PLUGIN_TLS_SESSION_CACHE_H_
+#define FLUTTER_PLUGIN_TLS_SESSION_CACHE_H_
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "memory_usage.h"
+
+typedef struct ssl_session_st SSL_SESSION;
+
+namespace vpn_plugin {
+
+// Resumable TLS client sessions (session tickets) per endpoint, so that a
+// reconnect skips the full handshake and, on TLS 1.3, may send early data.
+// Thread-safe. Sessions are kept serialized and can be saved to a file to
+// survive restarts; the file holds secrets and is written owner-only.
+class TlsSessionCache {
+ public:
+  // With an empty |path| the cache lives in memory only.
+  explicit TlsSessionCache(std::string path = std::string());
+
+  // Replaces the contents with what Save() wrote. A missing file is not an
+  // error. Sessions that expired meanwhile are dropped.
+  bool Load(std::string* error);
+  bool Save(std::string* error) const;
+
+  // Removes and returns the session for |key|, or null; the caller owns the
+  // reference. TLS 1.3 tickets are meant to be used once (RFC 8446 appendix
+  // C.4), and the server sends fresh ones on every connection.
+  SSL_SESSION* Take(const std::string& key);
+  // Puts back a session from Take() whose handshake did not finish, unless
+  // a newer one was stored for |key| meanwhile. Does not take the reference.
+  void Restore(const std::string& key, SSL_SESSION* session);
+  // Stores |session| if it can be resumed; does not take the reference.
+  void Put(const std::string& key, SSL_SESSION* session);
+  void Clear();
+  size_t size() const;
+  MemoryUsage memory_usage() const;
+
+  const std::string& path() const { return path_; }
+
+ private:
+  std::string path_;
+  mutable std::mutex mutex_;
+  // DER-encoded sessions.
+  std::unordered_map<std::string, std::string> sessions_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TLS_SESSION_CACHE_H_
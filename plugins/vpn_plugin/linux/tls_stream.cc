@@ -0,0 +1,261 @@
+#include "tls_stream.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "trace.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+// Completes a non-blocking connect(). Returns kOk once connected.
+ByteStream::Status CheckConnected(int fd, bool* connected) {
+  if (*connected) return ByteStream::Status::kOk;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+    return ByteStream::Status::kError;
+  }
+  sockaddr_storage peer;
+  socklen_t peer_len = sizeof(peer);
+  if (getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &peer_len) != 0) {
+    return errno == ENOTCONN ? ByteStream::Status::kWouldBlock : ByteStream::Status::kError;
+  }
+  *connected = true;
+  return ByteStream::Status::kOk;
+}
+
+}  // namespace
+
+PlainStream::~PlainStream() {
+  if (fd_ >= 0) close(fd_);
+}
+
+ByteStream::Status PlainStream::Handshake() { return CheckConnected(fd_, &connected_); }
+
+ByteStream::Status PlainStream::Read(char* buffer, size_t size, size_t* read) {
+  ssize_t n = recv(fd_, buffer, size, 0);
+  if (n > 0) {
+    *read = static_cast<size_t>(n);
+    return Status::kOk;
+  }
+  if (n == 0) return Status::kClosed;
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? Status::kWouldBlock
+                                                                   : Status::kError;
+}
+
+ByteStream::Status PlainStream::Write(const char* data, size_t size, size_t* written) {
+  ssize_t n = send(fd_, data, size, MSG_NOSIGNAL);
+  if (n >= 0) {
+    *written = static_cast<size_t>(n);
+    return Status::kOk;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? Status::kWouldBlock
+                                                                   : Status::kError;
+}
+
+std::shared_ptr<TlsClientContext> TlsClientContext::Create(const TlsClientOptions& options,
+                                                           std::string* error) {
+  std::shared_ptr<TlsClientContext> context(new TlsClientContext());
+  context->ctx_ = SSL_CTX_new(TLS_client_method());
+  if (!context->ctx_) {
+    if (error) *error = "SSL_CTX_new failed";
+    return nullptr;
+  }
+  SSL_CTX* ctx = context->ctx_;
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  context->skip_verification_ = options.skip_verification;
+  if (options.skip_verification) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  } else {
+    SSL_CTX_set_default_verify_paths(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+  }
+  if (!options.certificate_pem.empty()) {
+    BIO* bio = BIO_new_mem_buf(options.certificate_pem.data(),
+                               static_cast<int>(options.certificate_pem.size()));
+    X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+    int added = 0;
+    while (X509* cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) {
+      if (X509_STORE_add_cert(store, cert) == 1) added++;
+      X509_free(cert);
+    }
+    BIO_free(bio);
+    ERR_clear_error();
+    if (added == 0) {
+      if (error) *error = "endpoint certificate is not valid PEM";
+      return nullptr;
+    }
+  }
+  if (!options.alpn.empty()) {
+    std::string wire;
+    for (const auto& protocol : options.alpn) {
+      wire.push_back(static_cast<char>(protocol.size()));
+      wire += protocol;
+    }
+    SSL_CTX_set_alpn_protos(ctx, reinterpret_cast<const unsigned char*>(wire.data()),
+                            static_cast<unsigned int>(wire.size()));
+  }
+  if (options.sessions) {
+    context->sessions_ = options.sessions;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &TlsStream::OnNewSession);
+    std::string trust = options.skip_verification ? "skip\n" : "verify\n";
+    trust += options.certificate_pem;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    EVP_Digest(trust.data(), trust.size(), digest, &digest_size, EVP_sha256(), nullptr);
+    static const char kHex[] = "0123456789abcdef";
+    context->session_tag_ = options.alpn.empty() ? std::string() : options.alpn[0];
+    context->session_tag_ += '/';
+    for (unsigned int i = 0; i < 8 && i < digest_size; i++) {
+      context->session_tag_.push_back(kHex[digest[i] >> 4]);
+      context->session_tag_.push_back(kHex[digest[i] & 0xf]);
+    }
+  }
+  return context;
+}
+
+std::string TlsClientContext::SessionKey(const std::string& server_name) const {
+  return server_name + '/' + session_tag_;
+}
+
+TlsClientContext::~TlsClientContext() {
+  if (ctx_) SSL_CTX_free(ctx_);
+}
+
+TlsStream::TlsStream(std::shared_ptr<TlsClientContext> context, int fd,
+                     const std::string& server_name)
+    : context_(std::move(context)), fd_(fd) {
+  ssl_ = SSL_new(context_->ctx());
+  if (!ssl_) return;
+  SSL_set_fd(ssl_, fd_);
+  SSL_set_connect_state(ssl_);
+  if (!server_name.empty()) {
+    SSL_set_tlsext_host_name(ssl_, server_name.c_str());
+    if (!context_->skip_verification()) SSL_set1_host(ssl_, server_name.c_str());
+  }
+  if (context_->sessions() && !server_name.empty()) {
+    SSL_set_app_data(ssl_, this);
+    session_key_ = context_->SessionKey(server_name);
+  }
+}
+
+void TlsStream::OfferSession() {
+  // Taken only once connected, so an attempt that never gets that far
+  // leaves the session to the others.
+  if (session_key_.empty() || offered_ || !SSL_in_before(ssl_)) return;
+  offered_ = context_->sessions()->Take(session_key_);
+  if (!offered_) return;
+  if (SSL_set_session(ssl_, offered_) == 1) {
+    early_data_ = SSL_SESSION_get_max_early_data(offered_) > 0;
+  }
+}
+
+int TlsStream::OnNewSession(SSL* ssl, SSL_SESSION* session) {
+  auto* stream = static_cast<TlsStream*>(SSL_get_app_data(ssl));
+  if (stream && !stream->session_key_.empty()) {
+    stream->context_->sessions()->Put(stream->session_key_, session);
+  }
+  // The cache keeps its own copy.
+  return 0;
+}
+
+TlsStream::~TlsStream() {
+  if (offered_) {
+    if (!handshake_done_) context_->sessions()->Restore(session_key_, offered_);
+    SSL_SESSION_free(offered_);
+  }
+  if (ssl_) SSL_free(ssl_);
+  if (fd_ >= 0) close(fd_);
+}
+
+ByteStream::Status TlsStream::MapError(int result) {
+  int error = SSL_get_error(ssl_, result);
+  switch (error) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return Status::kWouldBlock;
+    case SSL_ERROR_ZERO_RETURN:
+      return Status::kClosed;
+    default:
+      ERR_clear_error();
+      return Status::kError;
+  }
+}
+
+ByteStream::Status TlsStream::Handshake() {
+  if (!ssl_) return Status::kError;
+  if (handshake_done_) return Status::kOk;
+  Status status = CheckConnected(fd_, &connected_);
+  if (status != Status::kOk) return status;
+  if (handshake_started_ns_ == 0 && Tracer::enabled()) handshake_started_ns_ = Tracer::NowNs();
+  OfferSession();
+  int result = SSL_do_handshake(ssl_);
+  if (result == 1) {
+    handshake_done_ = true;
+    if (handshake_started_ns_ != 0) {
+      Tracer::Complete("tls.handshake", handshake_started_ns_, resumed());
+    }
+    return Status::kOk;
+  }
+  return MapError(result);
+}
+
+ByteStream::Status TlsStream::Read(char* buffer, size_t size, size_t* read) {
+  int result = SSL_read(ssl_, buffer, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+  if (result > 0) {
+    *read = static_cast<size_t>(result);
+    return Status::kOk;
+  }
+  return MapError(result);
+}
+
+ByteStream::Status TlsStream::Write(const char* data, size_t size, size_t* written) {
+  int result = SSL_write(ssl_, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)));
+  if (result > 0) {
+    *written = static_cast<size_t>(result);
+    return Status::kOk;
+  }
+  return MapError(result);
+}
+
+ByteStream::Status TlsStream::WriteEarlyData(const char* data, size_t size, size_t* written) {
+  *written = 0;
+  if (!ssl_ || handshake_done_) return Status::kOk;
+  Status status = CheckConnected(fd_, &connected_);
+  if (status != Status::kOk) return status;
+  OfferSession();
+  if (!early_data_) return Status::kOk;
+  if (SSL_write_early_data(ssl_, data, size, written) == 1) return Status::kOk;
+  *written = 0;
+  return MapError(0);
+}
+
+bool TlsStream::early_data_accepted() const {
+  return ssl_ && SSL_get_early_data_status(ssl_) == SSL_EARLY_DATA_ACCEPTED;
+}
+
+bool TlsStream::resumed() const { return ssl_ && SSL_session_reused(ssl_) == 1; }
+
+std::string TlsStream::alpn() const {
+  const unsigned char* data = nullptr;
+  unsigned int length = 0;
+  if (ssl_) SSL_get0_alpn_selected(ssl_, &data, &length);
+  if (!data) return std::string();
+  return std::string(reinterpret_cast<const char*>(data), length);
+}
+
+}  // namespace vpn_plugin
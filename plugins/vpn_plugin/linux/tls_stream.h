@@ -0,0 +1,144 @@
+#ifndef FLUTTER_PLUGIN_TLS_STREAM_H_
+#define FLUTTER_PLUGIN_TLS_STREAM_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tls_session_cache.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+namespace vpn_plugin {
+
+// Non-blocking byte stream over a connected (or connecting) socket. Calls
+// never block; kWouldBlock means the caller should wait for the socket to
+// become readable or writable and try again.
+class ByteStream {
+ public:
+  enum class Status { kOk, kWouldBlock, kClosed, kError };
+
+  virtual ~ByteStream() = default;
+
+  virtual int fd() const = 0;
+  // Drives connection setup, including the TLS handshake. Returns kOk once
+  // application data can flow.
+  virtual Status Handshake() = 0;
+  virtual Status Read(char* buffer, size_t size, size_t* read) = 0;
+  virtual Status Write(const char* data, size_t size, size_t* written) = 0;
+  // Sends |data| along with the handshake, as TLS 1.3 early data on a
+  // resumed session that allows it. Early data can be replayed by an
+  // attacker, so |data| must be safe to receive twice. Sets |written| to 0
+  // when early data is not possible; whatever was not written, or was
+  // written but not accepted, has to be sent normally after the handshake.
+  virtual Status WriteEarlyData(const char* data, size_t size, size_t* written) {
+    (void)data;
+    (void)size;
+    *written = 0;
+    return Status::kOk;
+  }
+  virtual bool early_data_accepted() const { return false; }
+  // Whether the handshake resumed an earlier session.
+  virtual bool resumed() const { return false; }
+  // Application protocol negotiated during the handshake, if any.
+  virtual std::string alpn() const { return std::string(); }
+};
+
+// Cleartext TCP, used for prior-knowledge h2c and tests. Takes ownership of
+// |fd|.
+class PlainStream : public ByteStream {
+ public:
+  explicit PlainStream(int fd) : fd_(fd) {}
+  ~PlainStream() override;
+
+  int fd() const override { return fd_; }
+  Status Handshake() override;
+  Status Read(char* buffer, size_t size, size_t* read) override;
+  Status Write(const char* data, size_t size, size_t* written) override;
+
+ private:
+  int fd_;
+  bool connected_ = false;
+};
+
+struct TlsClientOptions {
+  // Accept any certificate, as `skip_verification` in the endpoint section.
+  bool skip_verification = false;
+  // PEM certificate(s) to trust in addition to the system store.
+  std::string certificate_pem;
+  std::vector<std::string> alpn = {"h2"};
+  // Where sessions are resumed from and stored, keyed by server name, the
+  // first ALPN protocol and the trust settings above. Optional.
+  std::shared_ptr<TlsSessionCache> sessions;
+};
+
+// Shared client configuration; one per endpoint.
+class TlsClientContext {
+ public:
+  static std::shared_ptr<TlsClientContext> Create(const TlsClientOptions& options,
+                                                  std::string* error);
+  ~TlsClientContext();
+
+  SSL_CTX* ctx() const { return ctx_; }
+  bool skip_verification() const { return skip_verification_; }
+  TlsSessionCache* sessions() const { return sessions_.get(); }
+  // Cache key for sessions with |server_name|.
+  std::string SessionKey(const std::string& server_name) const;
+
+ private:
+  TlsClientContext() = default;
+
+  SSL_CTX* ctx_ = nullptr;
+  bool skip_verification_ = false;
+  std::shared_ptr<TlsSessionCache> sessions_;
+  // Protocol and a digest of the trust settings, so that a session is
+  // never resumed under weaker verification than it was made with.
+  std::string session_tag_;
+};
+
+// TLS client over a non-blocking socket. Takes ownership of |fd|.
+class TlsStream : public ByteStream {
+ public:
+  TlsStream(std::shared_ptr<TlsClientContext> context, int fd, const std::string& server_name);
+  ~TlsStream() override;
+
+  int fd() const override { return fd_; }
+  Status Handshake() override;
+  Status Read(char* buffer, size_t size, size_t* read) override;
+  Status Write(const char* data, size_t size, size_t* written) override;
+  Status WriteEarlyData(const char* data, size_t size, size_t* written) override;
+  bool early_data_accepted() const override;
+  bool resumed() const override;
+  std::string alpn() const override;
+
+ private:
+  friend class TlsClientContext;
+
+  // Stores tickets the server issues into the context's session cache.
+  static int OnNewSession(SSL* ssl, SSL_SESSION* session);
+  // Takes the cached session for this server, if any, and offers it in
+  // the handshake about to start.
+  void OfferSession();
+  Status MapError(int result);
+
+  std::shared_ptr<TlsClientContext> context_;
+  int fd_;
+  SSL* ssl_ = nullptr;
+  std::string session_key_;
+  // Session taken from the cache for this handshake. It goes back to the
+  // cache if the handshake does not finish, as when this attempt loses a
+  // race or fails, and is used up once it does.
+  SSL_SESSION* offered_ = nullptr;
+  // The session being resumed allows early data.
+  bool early_data_ = false;
+  bool connected_ = false;
+  bool handshake_done_ = false;
+  // When the handshake began, for tracing; 0 while tracing is off.
+  int64_t handshake_started_ns_ = 0;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TLS_STREAM_H_
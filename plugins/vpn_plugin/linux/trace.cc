@@ -0,0 +1,468 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace vpn_plugin {
+
+std::atomic<bool> Tracer::enabled_{false};
+
+namespace {
+
+// One event. The owning thread is the only writer; |sequence| is 0 while it
+// writes and the event's index plus one once done, so that a dump running
+// at the same time can tell a torn copy from a good one.
+struct Slot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<int> kind{0};
+  std::atomic<const char*> name{nullptr};
+  std::atomic<int64_t> start_ns{0};
+  std::atomic<int64_t> duration_ns{0};
+  std::atomic<int64_t> value{0};
+};
+
+struct ThreadBuffer {
+  explicit ThreadBuffer(size_t capacity) : slots(new Slot[capacity]), mask(capacity - 1) {}
+
+  std::unique_ptr<Slot[]> slots;
+  uint64_t mask;
+  int64_t tid = 0;
+  std::string thread_name;
+  // Events written so far; the last mask + 1 of them are kept.
+  std::atomic<uint64_t> head{0};
+  // Events below this index were cleared.
+  std::atomic<uint64_t> floor{0};
+  std::atomic<bool> exited{false};
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  size_t events_per_thread = Tracer::kDefaultEventsPerThread;
+};
+
+// Never destroyed: threads may still record while the process exits.
+Registry& registry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+struct ThreadState {
+  ~ThreadState() {
+    if (buffer) buffer->exited.store(true, std::memory_order_release);
+  }
+  ThreadBuffer* buffer = nullptr;
+};
+
+thread_local ThreadState t_state;
+
+ThreadBuffer* NewThreadBuffer() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  auto buffer = std::make_unique<ThreadBuffer>(r.events_per_thread);
+  buffer->tid = static_cast<int64_t>(syscall(SYS_gettid));
+  char name[16] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) buffer->thread_name = name;
+  r.buffers.push_back(std::move(buffer));
+  return r.buffers.back().get();
+}
+
+struct Event {
+  int kind;
+  const char* name;
+  int64_t start_ns;
+  int64_t duration_ns;
+  int64_t value;
+};
+
+struct ThreadEvents {
+  int64_t tid;
+  std::string name;
+  std::vector<Event> events;
+};
+
+std::vector<ThreadEvents> Snapshot() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  std::vector<ThreadEvents> threads;
+  for (const auto& buffer : r.buffers) {
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    uint64_t capacity = buffer->mask + 1;
+    uint64_t first = std::max(buffer->floor.load(std::memory_order_relaxed),
+                              head > capacity ? head - capacity : 0);
+    ThreadEvents thread{buffer->tid, buffer->thread_name, {}};
+    for (uint64_t i = first; i < head; i++) {
+      const Slot& slot = buffer->slots[i & buffer->mask];
+      if (slot.sequence.load(std::memory_order_acquire) != i + 1) continue;
+      Event event{slot.kind.load(std::memory_order_relaxed),
+                  slot.name.load(std::memory_order_relaxed),
+                  slot.start_ns.load(std::memory_order_relaxed),
+                  slot.duration_ns.load(std::memory_order_relaxed),
+                  slot.value.load(std::memory_order_relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // Overwritten while being copied.
+      if (slot.sequence.load(std::memory_order_relaxed) != i + 1) continue;
+      thread.events.push_back(event);
+    }
+    if (!thread.events.empty()) threads.push_back(std::move(thread));
+  }
+  return threads;
+}
+
+void AppendJsonString(std::string* out, const char* s) {
+  out->push_back('"');
+  for (; *s; s++) {
+    unsigned char c = static_cast<unsigned char>(*s);
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(static_cast<char>(c));
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(static_cast<char>(c));
+    }
+  }
+  out->push_back('"');
+}
+
+// Nanoseconds as the microseconds trace-event JSON counts in, without
+// going through a double.
+void AppendMicros(std::string* out, int64_t ns) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%lld.%03lld", static_cast<long long>(ns / 1000),
+           static_cast<long long>(ns % 1000));
+  out->append(buffer);
+}
+
+std::string ChromeJson(const std::vector<ThreadEvents>& threads) {
+  const long long pid = getpid();
+  char buffer[128];
+  std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  snprintf(buffer, sizeof(buffer),
+           "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%lld,\"tid\":%lld,"
+           "\"args\":{\"name\":\"vpn_plugin\"}}",
+           pid, pid);
+  out.append(buffer);
+  uint64_t async_id = 0;
+  for (const ThreadEvents& thread : threads) {
+    const long long tid = thread.tid;
+    if (!thread.name.empty()) {
+      snprintf(buffer, sizeof(buffer),
+               ",{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%lld,\"tid\":%lld,\"args\":{\"name\":",
+               pid, tid);
+      out.append(buffer);
+      AppendJsonString(&out, thread.name.c_str());
+      out.append("}}");
+    }
+    for (const Event& event : thread.events) {
+      // Async spans may overlap anything, so they go out as a begin and end
+      // pair with an id of their own.
+      int pairs = event.kind == Tracer::kAsync ? 2 : 1;
+      async_id += event.kind == Tracer::kAsync;
+      for (int i = 0; i < pairs; i++) {
+        out.append(",{\"name\":");
+        AppendJsonString(&out, event.name);
+        snprintf(buffer, sizeof(buffer), ",\"cat\":\"vpn_plugin\",\"pid\":%lld,\"tid\":%lld,\"ts\":",
+                 pid, tid);
+        out.append(buffer);
+        AppendMicros(&out, event.start_ns + (i == 1 ? event.duration_ns : 0));
+        switch (event.kind) {
+          case Tracer::kSpan:
+            out.append(",\"ph\":\"X\",\"dur\":");
+            AppendMicros(&out, event.duration_ns);
+            break;
+          case Tracer::kAsync:
+            snprintf(buffer, sizeof(buffer), ",\"ph\":\"%c\",\"id\":%llu", i == 0 ? 'b' : 'e',
+                     static_cast<unsigned long long>(async_id));
+            out.append(buffer);
+            break;
+          default:
+            out.append(",\"ph\":\"i\",\"s\":\"t\"");
+            break;
+        }
+        snprintf(buffer, sizeof(buffer), ",\"args\":{\"value\":%lld}}",
+                 static_cast<long long>(event.value));
+        out.append(buffer);
+      }
+    }
+  }
+  out.append("]}\n");
+  return out;
+}
+
+// Perfetto's protobuf schema, as much of it as is written here
+// (protos/perfetto/trace/trace_packet.proto and track_event/).
+enum : uint32_t {
+  kTracePacket = 1,
+  kPacketTimestamp = 8,
+  kPacketSequenceId = 10,
+  kPacketTrackEvent = 11,
+  kPacketClockId = 58,
+  kPacketTrackDescriptor = 60,
+  kTrackUuid = 1,
+  kTrackName = 2,
+  kTrackProcess = 3,
+  kTrackThread = 4,
+  kTrackParentUuid = 5,
+  kProcessPid = 1,
+  kProcessName = 6,
+  kThreadPid = 1,
+  kThreadTid = 2,
+  kThreadName = 5,
+  kEventDebugAnnotations = 4,
+  kEventType = 9,
+  kEventTrackUuid = 11,
+  kEventName = 23,
+  kAnnotationIntValue = 4,
+  kAnnotationName = 10,
+};
+
+enum : uint64_t {
+  kSliceBegin = 1,
+  kSliceEnd = 2,
+  kInstantEvent = 3,
+  kClockMonotonic = 3,
+  kSequenceId = 1,
+};
+
+// Track uuids: the process is its pid, threads and async lanes sit above.
+constexpr uint64_t kThreadUuidBase = uint64_t{1} << 32;
+constexpr uint64_t kAsyncUuidBase = uint64_t{2} << 32;
+
+void PutVarint(std::string* out, uint64_t v) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+void PutUint(std::string* out, uint32_t field, uint64_t v) {
+  PutVarint(out, uint64_t{field} << 3);
+  PutVarint(out, v);
+}
+
+void PutBytes(std::string* out, uint32_t field, const std::string& bytes) {
+  PutVarint(out, uint64_t{field} << 3 | 2);
+  PutVarint(out, bytes.size());
+  out->append(bytes);
+}
+
+void PutTrackDescriptor(std::string* out, const std::string& descriptor) {
+  std::string packet;
+  PutBytes(&packet, kPacketTrackDescriptor, descriptor);
+  PutBytes(out, kTracePacket, packet);
+}
+
+// A slice begin or end, or an instant, on one track. Ends sort before
+// begins at the same time, except the end of a slice that also begins
+// then; of several ends, the slice that began last ends first, and of
+// several begins, the one that ends last begins first.
+struct Mark {
+  int64_t ts;
+  int order;
+  int64_t tiebreak;
+  uint64_t type;
+  const Event* event;
+
+  bool operator<(const Mark& other) const {
+    if (ts != other.ts) return ts < other.ts;
+    if (order != other.order) return order < other.order;
+    return tiebreak < other.tiebreak;
+  }
+};
+
+void AddMarks(const Event& event, std::vector<Mark>* marks) {
+  if (event.kind == Tracer::kInstant) {
+    marks->push_back({event.start_ns, 1, 0, kInstantEvent, &event});
+    return;
+  }
+  int64_t end = event.start_ns + event.duration_ns;
+  marks->push_back({event.start_ns, 1, -end, kSliceBegin, &event});
+  marks->push_back({end, event.duration_ns == 0 ? 2 : 0, -event.start_ns, kSliceEnd, &event});
+}
+
+void PutMarks(std::string* out, uint64_t track, std::vector<Mark>* marks) {
+  std::stable_sort(marks->begin(), marks->end());
+  for (const Mark& mark : *marks) {
+    std::string event;
+    PutUint(&event, kEventType, mark.type);
+    PutUint(&event, kEventTrackUuid, track);
+    if (mark.type != kSliceEnd) {
+      PutBytes(&event, kEventName, mark.event->name);
+      std::string annotation;
+      PutBytes(&annotation, kAnnotationName, "value");
+      PutUint(&annotation, kAnnotationIntValue, static_cast<uint64_t>(mark.event->value));
+      PutBytes(&event, kEventDebugAnnotations, annotation);
+    }
+    std::string packet;
+    PutUint(&packet, kPacketTimestamp, static_cast<uint64_t>(mark.ts));
+    PutUint(&packet, kPacketClockId, kClockMonotonic);
+    PutUint(&packet, kPacketSequenceId, kSequenceId);
+    PutBytes(&packet, kPacketTrackEvent, event);
+    PutBytes(out, kTracePacket, packet);
+  }
+}
+
+std::string Perfetto(const std::vector<ThreadEvents>& threads) {
+  const uint64_t pid = static_cast<uint64_t>(getpid());
+  std::string out;
+  std::string process;
+  PutUint(&process, kProcessPid, pid);
+  PutBytes(&process, kProcessName, "vpn_plugin");
+  std::string descriptor;
+  PutUint(&descriptor, kTrackUuid, pid);
+  PutBytes(&descriptor, kTrackProcess, process);
+  PutTrackDescriptor(&out, descriptor);
+
+  std::vector<const Event*> async;
+  for (const ThreadEvents& events : threads) {
+    std::string thread;
+    PutUint(&thread, kThreadPid, pid);
+    PutUint(&thread, kThreadTid, static_cast<uint64_t>(events.tid));
+    if (!events.name.empty()) PutBytes(&thread, kThreadName, events.name);
+    const uint64_t track = kThreadUuidBase + static_cast<uint64_t>(events.tid);
+    descriptor.clear();
+    PutUint(&descriptor, kTrackUuid, track);
+    PutUint(&descriptor, kTrackParentUuid, pid);
+    PutBytes(&descriptor, kTrackThread, thread);
+    PutTrackDescriptor(&out, descriptor);
+    std::vector<Mark> marks;
+    for (const Event& event : events.events) {
+      if (event.kind == Tracer::kAsync) {
+        async.push_back(&event);
+      } else {
+        AddMarks(event, &marks);
+      }
+    }
+    PutMarks(&out, track, &marks);
+  }
+
+  // Slices on a track must nest, so overlapping async spans of one name
+  // are spread over as many lanes as it takes.
+  std::sort(async.begin(), async.end(), [](const Event* a, const Event* b) {
+    int by_name = strcmp(a->name, b->name);
+    return by_name != 0 ? by_name < 0 : a->start_ns < b->start_ns;
+  });
+  struct Lane {
+    int64_t end_ns;
+    std::vector<Mark> marks;
+  };
+  uint64_t next_track = kAsyncUuidBase;
+  for (size_t i = 0; i < async.size();) {
+    const char* name = async[i]->name;
+    std::vector<Lane> lanes;
+    for (; i < async.size() && strcmp(async[i]->name, name) == 0; i++) {
+      const Event& event = *async[i];
+      auto lane = std::find_if(lanes.begin(), lanes.end(),
+                               [&event](const Lane& l) { return l.end_ns <= event.start_ns; });
+      if (lane == lanes.end()) lane = lanes.insert(lanes.end(), Lane{0, {}});
+      lane->end_ns = event.start_ns + event.duration_ns;
+      AddMarks(event, &lane->marks);
+    }
+    for (Lane& lane : lanes) {
+      const uint64_t track = next_track++;
+      descriptor.clear();
+      PutUint(&descriptor, kTrackUuid, track);
+      PutUint(&descriptor, kTrackParentUuid, pid);
+      PutBytes(&descriptor, kTrackName, name);
+      PutTrackDescriptor(&out, descriptor);
+      PutMarks(&out, track, &lane.marks);
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+void Tracer::Enable(size_t events_per_thread) {
+  Registry& r = registry();
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    size_t capacity = 16;
+    while (capacity < events_per_thread) capacity <<= 1;
+    r.events_per_thread = capacity;
+  }
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::Disable() { enabled_.store(false, std::memory_order_relaxed); }
+
+void Tracer::Clear() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.buffers.erase(std::remove_if(r.buffers.begin(), r.buffers.end(),
+                                 [](const std::unique_ptr<ThreadBuffer>& buffer) {
+                                   return buffer->exited.load(std::memory_order_acquire);
+                                 }),
+                  r.buffers.end());
+  for (const auto& buffer : r.buffers) {
+    buffer->floor.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+  }
+}
+
+int64_t Tracer::NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Tracer::Record(Kind kind, const char* name, int64_t start_ns, int64_t duration_ns,
+                    int64_t value) {
+  ThreadBuffer* buffer = t_state.buffer;
+  if (!buffer) buffer = t_state.buffer = NewThreadBuffer();
+  uint64_t index = buffer->head.load(std::memory_order_relaxed);
+  Slot& slot = buffer->slots[index & buffer->mask];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.kind.store(kind, std::memory_order_relaxed);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.start_ns.store(start_ns, std::memory_order_relaxed);
+  slot.duration_ns.store(duration_ns, std::memory_order_relaxed);
+  slot.value.store(value, std::memory_order_relaxed);
+  slot.sequence.store(index + 1, std::memory_order_release);
+  buffer->head.store(index + 1, std::memory_order_release);
+}
+
+std::string Tracer::Dump(TraceFormat format) {
+  std::vector<ThreadEvents> threads = Snapshot();
+  return format == TraceFormat::kPerfetto ? Perfetto(threads) : ChromeJson(threads);
+}
+
+bool Tracer::Write(const std::string& path, TraceFormat format, std::string* error) {
+  std::string trace = Dump(format);
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (out) out.write(trace.data(), static_cast<std::streamsize>(trace.size()));
+  if (!out) {
+    *error = "cannot write " + path + ": " + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+uint64_t Tracer::dropped() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  uint64_t dropped = 0;
+  for (const auto& buffer : r.buffers) {
+    uint64_t recorded = buffer->head.load(std::memory_order_acquire) -
+                        buffer->floor.load(std::memory_order_relaxed);
+    if (recorded > buffer->mask + 1) dropped += recorded - (buffer->mask + 1);
+  }
+  return dropped;
+}
+
+}  // namespace vpn_plugin
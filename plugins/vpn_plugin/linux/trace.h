@@ -0,0 +1,99 @@
+#ifndef FLUTTER_PLUGIN_TRACE_H_
+#define FLUTTER_PLUGIN_TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace vpn_plugin {
+
+enum class TraceFormat {
+  // Chrome trace-event JSON, for chrome://tracing and ui.perfetto.dev.
+  kChromeJson,
+  // Perfetto trace protobuf, for ui.perfetto.dev and trace_processor.
+  kPerfetto,
+};
+
+// Spans and instant events recorded into a ring buffer per thread. A thread
+// only ever writes its own buffer, without locks; a dump copies every
+// buffer out while the threads go on writing. While tracing is off a record
+// call is one relaxed load and a branch.
+//
+// Event names are not copied: they must be string literals, or otherwise
+// outlive the trace.
+class Tracer {
+ public:
+  static constexpr size_t kDefaultEventsPerThread = 16384;
+
+  // Spans nest on their thread's track; async spans get tracks of their
+  // own.
+  enum Kind { kSpan, kAsync, kInstant };
+
+  // Starts recording. Buffers of threads that record from now on hold the
+  // last |events_per_thread| events, rounded up to a power of two.
+  static void Enable(size_t events_per_thread = kDefaultEventsPerThread);
+  // Stops recording; what was recorded stays until Clear().
+  static void Disable();
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  // Drops recorded events, and the buffers of threads that have exited.
+  static void Clear();
+
+  // Monotonic clock the events are stamped with.
+  static int64_t NowNs();
+
+  // A span from |start_ns| until now that may have begun on another thread
+  // and may overlap other spans, such as the wait of a queued task. Shown on
+  // tracks of its own rather than the calling thread's.
+  static void Complete(const char* name, int64_t start_ns, int64_t value = 0) {
+    if (enabled()) Record(kAsync, name, start_ns, NowNs() - start_ns, value);
+  }
+  // A point in time on the calling thread, such as a state change to
+  // |value|.
+  static void Instant(const char* name, int64_t value = 0) {
+    if (enabled()) Record(kInstant, name, NowNs(), 0, value);
+  }
+
+  // Every thread's events in |format|.
+  static std::string Dump(TraceFormat format);
+  static bool Write(const std::string& path, TraceFormat format, std::string* error);
+
+  // Events overwritten since the last Clear() because a thread recorded
+  // more than its buffer holds.
+  static uint64_t dropped();
+
+ private:
+  friend class TraceSpan;
+
+  static void Record(Kind kind, const char* name, int64_t start_ns, int64_t duration_ns,
+                     int64_t value);
+
+  static std::atomic<bool> enabled_;
+};
+
+// Records the scope it lives in as a span, if tracing was on when it began.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name, int64_t value = 0)
+      : name_(name), value_(value), start_ns_(Tracer::enabled() ? Tracer::NowNs() : 0) {}
+  ~TraceSpan() {
+    if (start_ns_ != 0) {
+      Tracer::Record(Tracer::kSpan, name_, start_ns_, Tracer::NowNs() - start_ns_, value_);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // Attaches a result known only at the end, such as a status.
+  void set_value(int64_t value) { value_ = value; }
+
+ private:
+  const char* name_;
+  int64_t value_;
+  int64_t start_ns_;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_TRACE_H_
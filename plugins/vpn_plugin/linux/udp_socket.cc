@@ -0,0 +1,259 @@
+#include "udp_socket.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace vpn_plugin {
+
+namespace {
+
+// Kernels before 5.5 accept at most 64 segments per send.
+constexpr size_t kMaxSegments = 64;
+// Largest UDP payload in one IPv4 packet, which a segmented send has to fit.
+constexpr size_t kMaxSegmentedBytes = 65507;
+
+constexpr size_t kControlSize = CMSG_SPACE(sizeof(int));
+
+}  // namespace
+
+UdpBatch::UdpBatch(size_t capacity)
+    : capacity_(std::max<size_t>(1, std::min(capacity, kMaxDatagrams))),
+      storage_(new uint8_t[capacity_ * kSlotSize]) {
+  datagrams_.reserve(capacity_);
+  peers_.reserve(capacity_);
+}
+
+void UdpBatch::Clear() {
+  used_slots_ = 0;
+  datagrams_.clear();
+  peers_.clear();
+}
+
+uint8_t* UdpBatch::Append(const SocketAddress& peer, size_t size) {
+  if (size > kSlotSize || used_slots_ == capacity_ || datagrams_.size() >= capacity_) {
+    return nullptr;
+  }
+  uint8_t* data = slot(used_slots_++);
+  datagrams_.push_back(iovec{data, size});
+  peers_.push_back(peer);
+  return data;
+}
+
+bool UdpBatch::Add(const SocketAddress& peer, const void* data, size_t size) {
+  if (datagrams_.size() >= capacity_) return false;
+  datagrams_.push_back(iovec{const_cast<void*>(data), size});
+  peers_.push_back(peer);
+  return true;
+}
+
+UdpSocket::UdpSocket(UdpSocketOptions options) : options_(options) {}
+
+UdpSocket::~UdpSocket() { Close(); }
+
+bool UdpSocket::Bind(const SocketAddress& address) {
+  sockaddr_storage ss;
+  socklen_t len = address.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  if (bind(fd, reinterpret_cast<sockaddr*>(&ss), len) != 0) {
+    close(fd);
+    return false;
+  }
+  return Setup(fd);
+}
+
+bool UdpSocket::Open(int family) {
+  int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  return fd >= 0 && Setup(fd);
+}
+
+bool UdpSocket::Setup(int fd) {
+  Close();
+  fd_ = fd;
+  // Setting a zero segment size is how the kernel is asked whether it
+  // supports UDP_SEGMENT at all; sends choose the size per message.
+  int zero = 0;
+  gso_ = options_.gso && setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+  int one = 1;
+  gro_ = options_.gro && setsockopt(fd_, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+  return true;
+}
+
+void UdpSocket::Close() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+}
+
+SocketAddress UdpSocket::local_address() const {
+  SocketAddress address;
+  sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (getsockname(fd_, reinterpret_cast<sockaddr*>(&ss), &len) == 0) {
+    SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &address);
+  }
+  return address;
+}
+
+int UdpSocket::Receive(UdpBatch* batch) {
+  batch->Clear();
+  size_t count = options_.batching ? batch->capacity() : 1;
+  mmsghdr msgs[UdpBatch::kMaxDatagrams];
+  iovec iovs[UdpBatch::kMaxDatagrams];
+  sockaddr_storage addrs[UdpBatch::kMaxDatagrams];
+  alignas(cmsghdr) char control[UdpBatch::kMaxDatagrams][kControlSize];
+  for (size_t i = 0; i < count; i++) {
+    iovs[i] = iovec{batch->slot(i), UdpBatch::kSlotSize};
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (gro_) {
+      msgs[i].msg_hdr.msg_control = control[i];
+      msgs[i].msg_hdr.msg_controllen = kControlSize;
+    }
+  }
+
+  int received;
+  while (true) {
+    syscalls_++;
+    if (options_.batching) {
+      received = recvmmsg(fd_, msgs, static_cast<unsigned>(count), 0, nullptr);
+    } else {
+      ssize_t n = recvmsg(fd_, &msgs[0].msg_hdr, 0);
+      if (n >= 0) msgs[0].msg_len = static_cast<unsigned>(n);
+      received = n < 0 ? -1 : 1;
+    }
+    if (received >= 0 || errno != EINTR) break;
+  }
+  if (received < 0) return errno == EAGAIN ? 0 : -1;
+
+  batch->used_slots_ = received;
+  for (int i = 0; i < received; i++) {
+    const msghdr& hdr = msgs[i].msg_hdr;
+    if (hdr.msg_flags & MSG_TRUNC) {
+      truncated_++;
+      continue;
+    }
+    SocketAddress peer;
+    SocketAddress::FromSockaddr(reinterpret_cast<const sockaddr*>(&addrs[i]), &peer);
+    size_t size = msgs[i].msg_len;
+    size_t segment = size;
+    if (gro_) {
+      for (cmsghdr* c = CMSG_FIRSTHDR(&hdr); c; c = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+          int value;
+          memcpy(&value, CMSG_DATA(c), sizeof(value));
+          if (value > 0) segment = static_cast<size_t>(value);
+        }
+      }
+    }
+    uint8_t* data = batch->slot(i);
+    size_t offset = 0;
+    do {
+      batch->datagrams_.push_back(iovec{data + offset, std::min(segment, size - offset)});
+      batch->peers_.push_back(peer);
+      offset += segment;
+    } while (offset < size);
+  }
+  return static_cast<int>(batch->size());
+}
+
+size_t UdpSocket::SegmentRun(const UdpBatch& batch, size_t start) const {
+  if (!gso_) return 1;
+  size_t segment = batch.datagram(start).iov_len;
+  if (segment == 0) return 1;
+  size_t max = std::min(kMaxSegments, kMaxSegmentedBytes / segment);
+  size_t end = start + 1;
+  while (end < batch.size() && end - start < max && batch.peer(end) == batch.peer(start)) {
+    size_t size = batch.datagram(end).iov_len;
+    if (size > segment || size == 0) break;
+    end++;
+    // Only the last segment may be shorter.
+    if (size < segment) break;
+  }
+  return end - start;
+}
+
+size_t UdpSocket::Send(const UdpBatch& batch) {
+  size_t sent = 0;
+  size_t next = 0;
+  // Runs before this index go out unsegmented after the route refused one.
+  size_t plain_until = 0;
+  while (next < batch.size()) {
+    mmsghdr msgs[UdpBatch::kMaxDatagrams];
+    sockaddr_storage addrs[UdpBatch::kMaxDatagrams];
+    alignas(cmsghdr) char control[UdpBatch::kMaxDatagrams][kControlSize];
+    size_t first[UdpBatch::kMaxDatagrams];
+    size_t runs[UdpBatch::kMaxDatagrams];
+    size_t max_messages = options_.batching ? UdpBatch::kMaxDatagrams : 1;
+    size_t count = 0;
+    for (size_t i = next; i < batch.size() && count < max_messages; count++) {
+      size_t run = i < plain_until ? 1 : SegmentRun(batch, i);
+      msghdr& hdr = msgs[count].msg_hdr;
+      memset(&msgs[count], 0, sizeof(msgs[count]));
+      hdr.msg_name = &addrs[count];
+      hdr.msg_namelen = batch.peer(i).ToSockaddr(&addrs[count]);
+      hdr.msg_iov = const_cast<iovec*>(&batch.datagram(i));
+      hdr.msg_iovlen = run;
+      if (run > 1) {
+        hdr.msg_control = control[count];
+        hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        cmsghdr* c = CMSG_FIRSTHDR(&hdr);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = static_cast<uint16_t>(batch.datagram(i).iov_len);
+        memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+      }
+      first[count] = i;
+      runs[count] = run;
+      i += run;
+    }
+
+    syscalls_++;
+    int done;
+    if (options_.batching) {
+      done = sendmmsg(fd_, msgs, static_cast<unsigned>(count), 0);
+    } else {
+      done = sendmsg(fd_, &msgs[0].msg_hdr, 0) < 0 ? -1 : 1;
+    }
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == ENOBUFS) return sent;
+      if (runs[0] > 1 && (errno == EIO || errno == EINVAL || errno == EMSGSIZE)) {
+        // EIO means the device cannot checksum segmented sends at all.
+        if (errno == EIO) gso_ = false;
+        plain_until = first[0] + runs[0];
+        continue;
+      }
+      next = first[0] + runs[0];
+      continue;
+    }
+    for (int i = 0; i < done; i++) sent += runs[i];
+    next = first[done - 1] + runs[done - 1];
+  }
+  return sent;
+}
+
+bool UdpSocket::SendTo(const SocketAddress& peer, const void* data, size_t size) {
+  sockaddr_storage ss;
+  socklen_t len = peer.ToSockaddr(&ss);
+  syscalls_++;
+  return sendto(fd_, data, size, 0, reinterpret_cast<sockaddr*>(&ss), len) >= 0;
+}
+
+}  // namespace vpn_plugin
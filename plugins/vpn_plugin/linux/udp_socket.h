@@ -0,0 +1,124 @@
+#ifndef FLUTTER_PLUGIN_UDP_SOCKET_H_
+#define FLUTTER_PLUGIN_UDP_SOCKET_H_
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "net_address.h"
+
+namespace vpn_plugin {
+
+// Datagrams moved through a UdpSocket in one go, each with its peer. The
+// datagram array has the layout PacketPipeline::Process() takes, so a
+// received batch can be classified without copying.
+class UdpBatch {
+ public:
+  static constexpr size_t kMaxDatagrams = 64;
+  // Large enough for any datagram and for a whole GRO-coalesced train.
+  static constexpr size_t kSlotSize = 65536;
+
+  // Room for |capacity| received or appended datagrams. Slot memory is only
+  // touched as datagrams land in it.
+  explicit UdpBatch(size_t capacity = kMaxDatagrams);
+
+  UdpBatch(const UdpBatch&) = delete;
+  UdpBatch& operator=(const UdpBatch&) = delete;
+
+  size_t capacity() const { return capacity_; }
+  // A received batch may hold more datagrams than its capacity when the
+  // kernel coalesced some with GRO.
+  size_t size() const { return datagrams_.size(); }
+  bool empty() const { return datagrams_.empty(); }
+  const iovec* datagrams() const { return datagrams_.data(); }
+  const iovec& datagram(size_t i) const { return datagrams_[i]; }
+  const SocketAddress& peer(size_t i) const { return peers_[i]; }
+
+  void Clear();
+  // Reserves a slot for a |size|-byte datagram to |peer| and returns where
+  // to write it, or nullptr when the batch is full.
+  uint8_t* Append(const SocketAddress& peer, size_t size);
+  // Queues |size| bytes at |data| without copying; they must stay valid
+  // until the batch is sent. Returns false when the batch is full.
+  bool Add(const SocketAddress& peer, const void* data, size_t size);
+
+ private:
+  friend class UdpSocket;
+
+  uint8_t* slot(size_t i) const { return storage_.get() + i * kSlotSize; }
+
+  size_t capacity_;
+  std::unique_ptr<uint8_t[]> storage_;
+  size_t used_slots_ = 0;
+  std::vector<iovec> datagrams_;
+  std::vector<SocketAddress> peers_;
+};
+
+struct UdpSocketOptions {
+  // Moves whole batches with recvmmsg()/sendmmsg(); otherwise every datagram
+  // takes its own recvmsg()/sendmsg().
+  bool batching = true;
+  // Sends runs of equally sized datagrams to one peer as a single
+  // UDP_SEGMENT buffer that the kernel or NIC splits.
+  bool gso = true;
+  // Lets the kernel hand over a train of datagrams from one flow as a
+  // single UDP_GRO buffer, split again on receipt.
+  bool gro = true;
+};
+
+// Non-blocking UDP socket with batched I/O. GSO and GRO are probed when the
+// socket opens and silently stay off on kernels without them (before 4.18
+// and 5.0), or if the route rejects segmented sends.
+class UdpSocket {
+ public:
+  explicit UdpSocket(UdpSocketOptions options = UdpSocketOptions());
+  ~UdpSocket();
+
+  UdpSocket(const UdpSocket&) = delete;
+  UdpSocket& operator=(const UdpSocket&) = delete;
+
+  // Opens a socket bound to |address|; port 0 picks an ephemeral one.
+  bool Bind(const SocketAddress& address);
+  // Opens an unbound socket of |family| (AF_INET or AF_INET6) for sending.
+  bool Open(int family);
+  void Close();
+
+  int fd() const { return fd_; }
+  SocketAddress local_address() const;
+  bool gso() const { return gso_; }
+  bool gro() const { return gro_; }
+
+  // Replaces the contents of |batch| with queued datagrams. Returns how many
+  // arrived, 0 once the queue is empty, or -1 on error. Truncated datagrams
+  // are dropped.
+  int Receive(UdpBatch* batch);
+  // Sends every datagram in |batch| and returns how many the kernel took.
+  // Sending stops early when the socket buffer is full; datagrams the
+  // kernel refuses (unreachable peer, too large) are skipped.
+  size_t Send(const UdpBatch& batch);
+  // Sends one datagram.
+  bool SendTo(const SocketAddress& peer, const void* data, size_t size);
+
+  // recvmmsg/sendmmsg (or recvmsg/sendmsg) calls made so far.
+  uint64_t syscalls() const { return syscalls_; }
+  uint64_t truncated() const { return truncated_; }
+
+ private:
+  bool Setup(int fd);
+  // Datagrams from |start| that can go out as one GSO send.
+  size_t SegmentRun(const UdpBatch& batch, size_t start) const;
+
+  UdpSocketOptions options_;
+  int fd_ = -1;
+  bool gso_ = false;
+  bool gro_ = false;
+  uint64_t syscalls_ = 0;
+  uint64_t truncated_ = 0;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_UDP_SOCKET_H_
@@ -0,0 +1,61 @@
+#include "upstream_cache.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace vpn_plugin {
+
+bool UpstreamWinnerCache::Lookup(const std::string& endpoint, const std::string& network,
+                                 SocketAddress* out) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = winners_.find(Key(endpoint, network));
+  if (it == winners_.end()) return false;
+  *out = it->second;
+  return true;
+}
+
+void UpstreamWinnerCache::Record(const std::string& endpoint, const std::string& network,
+                                 const SocketAddress& winner) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  winners_[Key(endpoint, network)] = winner;
+}
+
+void UpstreamWinnerCache::Forget(const std::string& endpoint, const std::string& network) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  winners_.erase(Key(endpoint, network));
+}
+
+size_t UpstreamWinnerCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return winners_.size();
+}
+
+MemoryUsage UpstreamWinnerCache::memory_usage() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  MemoryUsage usage;
+  usage.bytes = HeapBytes(winners_);
+  for (const auto& winner : winners_) usage.bytes += HeapBytes(winner.first);
+  usage.objects = winners_.size();
+  return usage;
+}
+
+std::string UpstreamWinnerCache::Key(const std::string& endpoint, const std::string& network) {
+  return endpoint + '\n' + network;
+}
+
+std::string LocalNetworkId(const SocketAddress& toward) {
+  sockaddr_storage ss;
+  socklen_t len = toward.ToSockaddr(&ss);
+  int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return std::string();
+  SocketAddress local;
+  // Connecting a datagram socket only runs the route lookup.
+  bool ok = connect(fd, reinterpret_cast<sockaddr*>(&ss), len) == 0;
+  len = sizeof(ss);
+  ok = ok && getsockname(fd, reinterpret_cast<sockaddr*>(&ss), &len) == 0 &&
+       SocketAddress::FromSockaddr(reinterpret_cast<sockaddr*>(&ss), &local);
+  close(fd);
+  return ok ? local.ip.ToString() : std::string();
+}
+
+}  // namespace vpn_plugin
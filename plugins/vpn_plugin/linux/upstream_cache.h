@@ -0,0 +1,41 @@
+#ifndef FLUTTER_PLUGIN_UPSTREAM_CACHE_H_
+#define FLUTTER_PLUGIN_UPSTREAM_CACHE_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "memory_usage.h"
+#include "net_address.h"
+
+namespace vpn_plugin {
+
+// Remembers which endpoint address won the last connection race, per
+// endpoint and per network, so that the next connect on the same network
+// goes to it first instead of racing again. Thread-safe; one cache serves
+// the pools of every shard and outlives engine restarts.
+class UpstreamWinnerCache {
+ public:
+  bool Lookup(const std::string& endpoint, const std::string& network, SocketAddress* out) const;
+  void Record(const std::string& endpoint, const std::string& network,
+              const SocketAddress& winner);
+  // Drops the entry, e.g. once the winner stopped working.
+  void Forget(const std::string& endpoint, const std::string& network);
+  size_t size() const;
+  MemoryUsage memory_usage() const;
+
+ private:
+  static std::string Key(const std::string& endpoint, const std::string& network);
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, SocketAddress> winners_;
+};
+
+// Names the network the device reaches |toward| through: the local address
+// the kernel picks as source for it. Nothing is sent. Empty if there is no
+// route.
+std::string LocalNetworkId(const SocketAddress& toward);
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_UPSTREAM_CACHE_H_
@@ -0,0 +1,315 @@
+#include "uring_relay.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+
+#include "io_uring.h"
+
+namespace vpn_plugin {
+
+namespace {
+
+void* MapAnonymous(size_t size) {
+  void* memory =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  return memory == MAP_FAILED ? nullptr : memory;
+}
+
+}  // namespace
+
+std::shared_ptr<UringRelayPool> UringRelayPool::Create(EventLoop* loop,
+                                                       const UringRelayOptions& options) {
+  IoUring* uring = loop->uring();
+  if (!uring || options.buffer_count == 0 || options.buffer_count > 32768 ||
+      (options.buffer_count & (options.buffer_count - 1)) != 0) {
+    return nullptr;
+  }
+  // SEND_ZC arrived in the same release as multishot receive, which the
+  // probe cannot report on its own.
+  for (uint8_t op : {IORING_OP_RECV, IORING_OP_WRITE_FIXED, IORING_OP_SEND,
+                     IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC}) {
+    if (!uring->SupportsOp(op)) return nullptr;
+  }
+  std::shared_ptr<UringRelayPool> pool(new UringRelayPool(loop, options));
+  if (!pool->Init()) return nullptr;
+  return pool;
+}
+
+UringRelayPool::UringRelayPool(EventLoop* loop, const UringRelayOptions& options)
+    : loop_(loop), options_(options) {}
+
+UringRelayPool::~UringRelayPool() {
+  // The loop may already have closed its ring, taking the registrations
+  // with it.
+  if (IoUring* uring = loop_->uring()) {
+    if (ring_registered_) uring->UnregisterBufferRing(kBufferGroup);
+    if (buffers_registered_) uring->UnregisterBuffers();
+    if (files_registered_) uring->UnregisterFiles();
+  }
+  if (ring_) munmap(ring_, ring_size_);
+  if (slab_) munmap(slab_, slab_size_);
+}
+
+bool UringRelayPool::Init() {
+  IoUring* uring = loop_->uring();
+  slab_size_ = options_.buffer_count * options_.buffer_size;
+  slab_ = static_cast<char*>(MapAnonymous(slab_size_));
+  ring_size_ = options_.buffer_count * sizeof(io_uring_buf);
+  ring_ = static_cast<io_uring_buf_ring*>(MapAnonymous(ring_size_));
+  if (!slab_ || !ring_) return false;
+  buffers_registered_ = uring->RegisterBuffer(slab_, slab_size_);
+  if (!buffers_registered_) return false;
+  ring_registered_ = uring->RegisterBufferRing(ring_, options_.buffer_count, kBufferGroup);
+  if (!ring_registered_) return false;
+  for (unsigned id = 0; id < options_.buffer_count; id++) Recycle(static_cast<uint16_t>(id));
+  // Without fixed files the relay passes plain fds.
+  files_registered_ = uring->RegisterSparseFiles(options_.fixed_files);
+  if (files_registered_) {
+    for (int slot = static_cast<int>(options_.fixed_files) - 1; slot >= 0; slot--) {
+      free_slots_.push_back(slot);
+    }
+  }
+  return true;
+}
+
+void UringRelayPool::Recycle(uint16_t id) {
+  // Indexed by hand: in C++ the header's flexible array member sits behind
+  // an empty struct that takes up space.
+  io_uring_buf* buf =
+      reinterpret_cast<io_uring_buf*>(ring_) + (ring_tail_ & (options_.buffer_count - 1));
+  buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+  buf->len = static_cast<uint32_t>(options_.buffer_size);
+  buf->bid = id;
+  ring_tail_++;
+  __atomic_store_n(&ring_->tail, ring_tail_, __ATOMIC_RELEASE);
+  if (starved_.empty()) return;
+  std::vector<std::pair<std::weak_ptr<UringRelay>, int>> starved;
+  starved.swap(starved_);
+  for (auto& entry : starved) {
+    if (auto relay = entry.first.lock()) relay->OnBuffersAvailable(entry.second);
+  }
+}
+
+void UringRelayPool::WaitForBuffers(std::weak_ptr<UringRelay> relay, int direction) {
+  starved_.emplace_back(std::move(relay), direction);
+}
+
+int UringRelayPool::AcquireSlot(int fd) {
+  if (free_slots_.empty()) return -1;
+  int slot = free_slots_.back();
+  if (!loop_->uring()->UpdateFile(static_cast<unsigned>(slot), fd)) return -1;
+  free_slots_.pop_back();
+  return slot;
+}
+
+void UringRelayPool::ReleaseSlot(int slot) {
+  // Requests already issued keep their own reference to the file.
+  loop_->uring()->UpdateFile(static_cast<unsigned>(slot), -1);
+  free_slots_.push_back(slot);
+}
+
+std::shared_ptr<UringRelay> UringRelay::Start(std::shared_ptr<UringRelayPool> pool, int a, int b,
+                                              std::string a_to_b_prefix,
+                                              std::string b_to_a_prefix,
+                                              std::atomic<uint64_t>* bytes, DoneCallback done) {
+  auto relay = std::make_shared<UringRelay>(std::move(pool), bytes, std::move(done));
+  int fds[2] = {a, b};
+  for (int i = 0; i < 2; i++) {
+    relay->sides_[i].fd = fds[i];
+    relay->sides_[i].slot = relay->pool_->AcquireSlot(fds[i]);
+  }
+  relay->dirs_[0].src = 0;
+  relay->dirs_[0].dst = 1;
+  relay->dirs_[0].prefix = std::move(a_to_b_prefix);
+  relay->dirs_[1].src = 1;
+  relay->dirs_[1].dst = 0;
+  relay->dirs_[1].prefix = std::move(b_to_a_prefix);
+  for (int d = 0; d < 2; d++) {
+    Direction* dir = &relay->dirs_[d];
+    if (!dir->prefix.empty()) {
+      dir->queue.push_back(Chunk{-1, 0, static_cast<uint32_t>(dir->prefix.size())});
+      relay->Send(d);
+    }
+    relay->ArmRecv(d);
+  }
+  return relay;
+}
+
+UringRelay::UringRelay(std::shared_ptr<UringRelayPool> pool, std::atomic<uint64_t>* bytes,
+                       DoneCallback done)
+    : pool_(std::move(pool)), bytes_(bytes), done_(std::move(done)) {}
+
+void UringRelay::Stop() {
+  if (stopped_) return;
+  stopped_ = true;
+  bytes_ = nullptr;
+  done_ = nullptr;
+  for (int d = 0; d < 2; d++) {
+    PauseRecv(d);
+    RecycleQueued(&dirs_[d]);
+  }
+  for (Side& side : sides_) {
+    if (side.slot >= 0) pool_->ReleaseSlot(side.slot);
+    side.slot = -1;
+  }
+}
+
+void UringRelay::PrepareFd(io_uring_sqe* sqe, const Side& side) const {
+  if (side.slot >= 0) {
+    sqe->fd = side.slot;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = side.fd;
+  }
+}
+
+void UringRelay::ArmRecv(int d) {
+  Direction* dir = &dirs_[d];
+  if (stopped_ || dir->receiving || dir->eof || dir->waiting_for_buffers ||
+      dir->queue.size() >= pool_->options().max_buffers_per_direction) {
+    return;
+  }
+  io_uring_sqe* sqe = pool_->loop()->uring()->GetSqe();
+  if (!sqe) {
+    Finish(false);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  PrepareFd(sqe, sides_[dir->src]);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UringRelayPool::kBufferGroup;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  auto self = shared_from_this();
+  dir->recv_token = pool_->loop()->AddCompletion(
+      [self, d](int32_t result, uint32_t flags) { self->OnRecv(d, result, flags); });
+  sqe->user_data = dir->recv_token;
+  dir->receiving = true;
+}
+
+void UringRelay::PauseRecv(int d) {
+  Direction* dir = &dirs_[d];
+  if (!dir->receiving || dir->cancelling) return;
+  io_uring_sqe* sqe = pool_->loop()->uring()->GetSqe();
+  if (!sqe) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = dir->recv_token;
+  dir->cancelling = true;
+}
+
+void UringRelay::OnRecv(int d, int32_t result, uint32_t flags) {
+  Direction* dir = &dirs_[d];
+  if (!(flags & IORING_CQE_F_MORE)) {
+    dir->receiving = false;
+    dir->cancelling = false;
+  }
+  if (flags & IORING_CQE_F_BUFFER) {
+    auto id = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (stopped_ || result <= 0) {
+      pool_->Recycle(id);
+    } else {
+      dir->queue.push_back(Chunk{id, 0, static_cast<uint32_t>(result)});
+      if (dir->queue.size() >= pool_->options().max_buffers_per_direction) PauseRecv(d);
+      Send(d);
+    }
+  }
+  if (stopped_) return;
+  if (result == 0) {
+    dir->eof = true;
+    MaybeShut(d);
+    return;
+  }
+  if (result == -ENOBUFS) {
+    dir->waiting_for_buffers = true;
+    pool_->WaitForBuffers(weak_from_this(), d);
+    return;
+  }
+  if (result < 0 && result != -ECANCELED) {
+    Finish(false);
+    return;
+  }
+  // Rearms after the kernel ended the multishot request on its own, or
+  // after a pause once the queue has drained.
+  ArmRecv(d);
+}
+
+void UringRelay::OnBuffersAvailable(int d) {
+  dirs_[d].waiting_for_buffers = false;
+  ArmRecv(d);
+}
+
+void UringRelay::Send(int d) {
+  Direction* dir = &dirs_[d];
+  if (stopped_ || dir->sending || dir->queue.empty()) return;
+  io_uring_sqe* sqe = pool_->loop()->uring()->GetSqe();
+  if (!sqe) {
+    Finish(false);
+    return;
+  }
+  const Chunk& chunk = dir->queue.front();
+  PrepareFd(sqe, sides_[dir->dst]);
+  sqe->len = chunk.size - chunk.offset;
+  if (chunk.buffer >= 0) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = reinterpret_cast<uint64_t>(pool_->buffer(static_cast<uint16_t>(chunk.buffer)) +
+                                           chunk.offset);
+    sqe->buf_index = 0;
+  } else {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = reinterpret_cast<uint64_t>(dir->prefix.data() + chunk.offset);
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  auto self = shared_from_this();
+  sqe->user_data = pool_->loop()->AddCompletion(
+      [self, d](int32_t result, uint32_t) { self->OnSend(d, result); });
+  dir->sending = true;
+}
+
+void UringRelay::OnSend(int d, int32_t result) {
+  Direction* dir = &dirs_[d];
+  dir->sending = false;
+  Chunk& chunk = dir->queue.front();
+  if (result > 0) chunk.offset += static_cast<uint32_t>(result);
+  if (stopped_ || chunk.offset == chunk.size) {
+    if (chunk.buffer >= 0) pool_->Recycle(static_cast<uint16_t>(chunk.buffer));
+    dir->queue.pop_front();
+  }
+  if (stopped_) return;
+  if (result <= 0) {
+    Finish(false);
+    return;
+  }
+  if (bytes_) *bytes_ += static_cast<uint64_t>(result);
+  Send(d);
+  if (dir->queue.size() <= pool_->options().max_buffers_per_direction / 2) ArmRecv(d);
+  MaybeShut(d);
+}
+
+void UringRelay::MaybeShut(int d) {
+  Direction* dir = &dirs_[d];
+  if (!dir->eof || !dir->queue.empty() || dir->sending || dir->shut) return;
+  shutdown(sides_[dir->dst].fd, SHUT_WR);
+  dir->shut = true;
+  if (dirs_[0].shut && dirs_[1].shut) Finish(true);
+}
+
+void UringRelay::Finish(bool ok) {
+  if (stopped_) return;
+  DoneCallback done = std::move(done_);
+  Stop();
+  if (done) done(ok);
+}
+
+void UringRelay::RecycleQueued(Direction* dir) {
+  // A chunk being written is recycled when its write completes.
+  size_t keep = dir->sending ? 1 : 0;
+  while (dir->queue.size() > keep) {
+    const Chunk& chunk = dir->queue.back();
+    if (chunk.buffer >= 0) pool_->Recycle(static_cast<uint16_t>(chunk.buffer));
+    dir->queue.pop_back();
+  }
+}
+
+}  // namespace vpn_plugin
@@ -0,0 +1,151 @@
+#ifndef FLUTTER_PLUGIN_URING_RELAY_H_
+#define FLUTTER_PLUGIN_URING_RELAY_H_
+
+#include <linux/io_uring.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+
+namespace vpn_plugin {
+
+struct UringRelayOptions {
+  // Receive buffers shared by every relay on the loop. The count must be a
+  // power of two.
+  unsigned buffer_count = 512;
+  size_t buffer_size = 16 * 1024;
+  // Buffers one direction may fill before its receives pause, so a slow
+  // reader cannot take the whole pool.
+  size_t max_buffers_per_direction = 16;
+  unsigned fixed_files = 4096;
+};
+
+class UringRelay;
+
+// Per-loop resources of the io_uring relay: one registered slab carved into
+// provided receive buffers, and a table of fixed files.
+class UringRelayPool {
+ public:
+  // Returns nullptr unless |loop| runs the io_uring backend and the kernel
+  // has multishot receive into provided buffer rings (Linux 6.0), or if
+  // another pool already holds the loop's registered buffers.
+  static std::shared_ptr<UringRelayPool> Create(EventLoop* loop,
+                                                const UringRelayOptions& options);
+  ~UringRelayPool();
+
+  UringRelayPool(const UringRelayPool&) = delete;
+  UringRelayPool& operator=(const UringRelayPool&) = delete;
+
+  EventLoop* loop() const { return loop_; }
+  const UringRelayOptions& options() const { return options_; }
+
+ private:
+  friend class UringRelay;
+
+  static constexpr uint16_t kBufferGroup = 0;
+
+  UringRelayPool(EventLoop* loop, const UringRelayOptions& options);
+  bool Init();
+
+  char* buffer(uint16_t id) const { return slab_ + static_cast<size_t>(id) * options_.buffer_size; }
+  // Hands buffer |id| back to the kernel and wakes relays that ran out.
+  void Recycle(uint16_t id);
+  void WaitForBuffers(std::weak_ptr<UringRelay> relay, int direction);
+  // Returns the fixed file slot now holding |fd|, or -1 if none is free.
+  int AcquireSlot(int fd);
+  void ReleaseSlot(int slot);
+
+  EventLoop* loop_;
+  UringRelayOptions options_;
+  char* slab_ = nullptr;
+  size_t slab_size_ = 0;
+  io_uring_buf_ring* ring_ = nullptr;
+  size_t ring_size_ = 0;
+  uint16_t ring_tail_ = 0;
+  bool buffers_registered_ = false;
+  bool ring_registered_ = false;
+  bool files_registered_ = false;
+  std::vector<int> free_slots_;
+  std::vector<std::pair<std::weak_ptr<UringRelay>, int>> starved_;
+};
+
+// Moves bytes both ways between two connected stream sockets on the loop's
+// io_uring: a multishot receive per direction fills buffers from the pool,
+// which go out with WRITE_FIXED and return to the pool once written. Both
+// fds are used through fixed file slots when the table has room.
+class UringRelay : public std::enable_shared_from_this<UringRelay> {
+ public:
+  // |ok| is false if a socket failed; true once both directions shut down.
+  using DoneCallback = std::function<void(bool ok)>;
+
+  // Starts relaying between |a| and |b|, first writing |a_to_b_prefix| to
+  // |b| and |b_to_a_prefix| to |a|. Relayed bytes are added to |bytes|
+  // until Stop(). The fds stay owned by the caller.
+  static std::shared_ptr<UringRelay> Start(std::shared_ptr<UringRelayPool> pool, int a, int b,
+                                           std::string a_to_b_prefix, std::string b_to_a_prefix,
+                                           std::atomic<uint64_t>* bytes, DoneCallback done);
+
+  // Cancels the receives and drops queued data; |done| is not called
+  // afterwards. The fds may be closed right after.
+  void Stop();
+
+  UringRelay(std::shared_ptr<UringRelayPool> pool, std::atomic<uint64_t>* bytes,
+             DoneCallback done);
+
+ private:
+  friend class UringRelayPool;
+
+  struct Chunk {
+    // Pool buffer id, or -1 for the direction's prefix.
+    int buffer;
+    uint32_t offset;
+    uint32_t size;
+  };
+  struct Side {
+    int fd = -1;
+    int slot = -1;
+  };
+  struct Direction {
+    int src = 0;
+    int dst = 1;
+    std::string prefix;
+    std::deque<Chunk> queue;
+    uint64_t recv_token = 0;
+    bool receiving = false;
+    bool cancelling = false;
+    bool sending = false;
+    bool waiting_for_buffers = false;
+    bool eof = false;
+    bool shut = false;
+  };
+
+  void PrepareFd(io_uring_sqe* sqe, const Side& side) const;
+  void ArmRecv(int d);
+  void PauseRecv(int d);
+  void OnRecv(int d, int32_t result, uint32_t flags);
+  void Send(int d);
+  void OnSend(int d, int32_t result);
+  void OnBuffersAvailable(int d);
+  void MaybeShut(int d);
+  void Finish(bool ok);
+  void RecycleQueued(Direction* dir);
+
+  std::shared_ptr<UringRelayPool> pool_;
+  std::atomic<uint64_t>* bytes_;
+  DoneCallback done_;
+  Side sides_[2];
+  Direction dirs_[2];
+  bool stopped_ = false;
+};
+
+}  // namespace vpn_plugin
+
+#endif  // FLUTTER_PLUGIN_URING_RELAY_H_
@@ -1,10 +1,39 @@
 #include "include/vpn_plugin/vpn_plugin.h"
+#include "vpn_plugin_private.h"
 
 #include <flutter_linux/flutter_linux.h>
 #include <glib-object.h>
 #include <gtk/gtk.h>
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "config_document.h"
+#include "dns_forwarder.h"
+#include "domain_table.h"
+#include "event_loop.h"
+#include "http2_pool.h"
+#include "http2_tunnel.h"
+#include "memory_usage.h"
+#include "method_dispatcher.h"
+#include "metrics.h"
+#include "policy_store.h"
+#include "record_codec.h"
+#include "relay_budget.h"
+#include "socks_server.h"
+#include "socks_shards.h"
+#include "tls_session_cache.h"
+#include "trace.h"
+#include "upstream_cache.h"
 
 typedef enum {
   VPN_STATE_DISCONNECTED = 0,
@@ -58,20 +87,21 @@ typedef struct {
   gboolean   has_selected_server;
   gint64     selected_server_id;
   gchar*     excluded_routes;
-  VpnState   vpn_state;
+  // Request records as the storage is seeded with them. Nothing appends
+  // to it, so it is not a live query log and drops nothing.
   GPtrArray* requests;
 } MockStorage;
 
 
 static gchar* g_strdup_or_empty(const gchar* s) { return g_strdup(s ? s : ""); }
 
-static void string_array_free(GPtrArray* arr) {
+// String arrays are created with g_free as their free function.
+void string_array_free(GPtrArray* arr) {
   if (!arr) return;
-  for (guint i = 0; i < arr->len; i++) g_free(g_ptr_array_index(arr, i));
   g_ptr_array_free(arr, TRUE);
 }
 
-static GPtrArray* string_split_csv(const gchar* csv, const gchar* delim) {
+GPtrArray* string_split_csv(const gchar* csv, const gchar* delim) {
   GPtrArray* out = g_ptr_array_new_with_free_func(g_free);
   if (!csv || !*csv) return out;
   gchar** parts = g_strsplit(csv, delim, -1);
@@ -84,7 +114,7 @@ static GPtrArray* string_split_csv(const gchar* csv, const gchar* delim) {
   return out;
 }
 
-static gboolean is_valid_ipv4(const gchar* ip) {
+gboolean is_valid_ipv4(const gchar* ip) {
   if (!ip) return FALSE;
   gchar** parts = g_strsplit(ip, ".", 4);
   int count = 0; gboolean ok = TRUE;
@@ -174,7 +204,6 @@ static MockStorage* storage_new(void) {
   m->routing_profiles = g_ptr_array_new_with_free_func((GDestroyNotify)profile_free);
   m->requests = g_ptr_array_new_with_free_func((GDestroyNotify)request_free);
   m->excluded_routes = g_strdup("");
-  m->vpn_state = VPN_STATE_DISCONNECTED;
 
   // profiles
   g_ptr_array_add(m->routing_profiles, profile_new(
@@ -222,6 +251,23 @@ static void storage_free(MockStorage* m) {
 }
 
 
+// What engine_start() brings up. It is published whole under
+// |engine_lock|, so other threads see all of it or none, and torn down
+// outside that lock.
+struct Engine {
+  // Native listener started from the [listener.socks] section of the
+  // config, with a SOCKS server, HTTP/2 upstream pool and DNS forwarder per
+  // shard.
+  vpn_plugin::SocksShardGroup* shards = NULL;
+  // Domains learned from forwarded answers, for address-only flows. Shared
+  // by the shards.
+  vpn_plugin::DomainTable* domains = NULL;
+  // The shards' DNS forwarders, for their caches' memory usage.
+  std::vector<vpn_plugin::DnsForwarder*> forwarders;
+  // Rewrites the [metrics] text file while the configuration names one.
+  vpn_plugin::MetricsFileWriter* metrics_writer = NULL;
+};
+
 struct _VpnPlugin {
   GObject parent_instance;
 
@@ -229,7 +275,7 @@ struct _VpnPlugin {
 
   // EventChannel: vpn_plugin_event_channel
   FlEventChannel* event_channel;
-  FlEventSink* event_sink;
+  gboolean listening;
 
   // MethodChannels
   FlMethodChannel* ch_ivpn;
@@ -237,64 +283,705 @@ struct _VpnPlugin {
   FlMethodChannel* ch_servers;
   FlMethodChannel* ch_routing;
 
+  // Main thread only, like |listening|: the pending connect timer, and
+  // whether on_ready_main() has run.
   guint connect_timeout_id;
+  gboolean announced;
+  // Bumped by every start and stop, so that a connect timer armed before
+  // the latest of them leaves the state alone.
+  gint connect_generation;
+  // A VpnState, read and written with g_atomic_int_*() from any thread.
+  gint vpn_state;
+
+  // The running engine, or NULL. Started and stopped on the ivpn lane;
+  // other threads read it with |engine_lock| held.
+  Engine* engine;
+  GMutex engine_lock;
+
+  // Encoder for the packed list replies, kept so its buffers are reused.
+  vpn_plugin::RecordWriter* packer;
+
+  // Each server's routing policy, rebuilt in the background whenever its
+  // profile or the excluded routes change, so that start and a change of
+  // server only look it up.
+  vpn_plugin::PolicyStore* policies;
+
+  // Method calls run here, one lane per channel, so that the main loop
+  // only parses and answers them. |lock| guards |storage|, which the
+  // channels share, and is held only while a handler reads or changes it.
+  // The main thread never takes it, and engine start and stop and policy
+  // builds run without it. Taken before |engine_lock| when both are.
+  vpn_plugin::MethodDispatcher* dispatcher;
+  GMutex lock;
+  // |storage| is loaded on a thread of its own so that registration
+  // returns at once. Until |ready| is set, handlers wait on |ready_cond|
+  // with |lock| held, so calls made meanwhile queue up in order. Set once,
+  // with g_atomic_int_set().
+  gint ready;
+  GCond ready_cond;
 };
 
 G_DEFINE_TYPE(VpnPlugin, vpn_plugin, g_object_get_type())
 
+// -------- Metrics --------
+// Metrics of the process, read by getMetrics and the [metrics] text file.
+// Never destroyed: shard and dispatcher threads may record until they exit.
+static vpn_plugin::MetricsRegistry* metrics() {
+  static vpn_plugin::MetricsRegistry* registry = new vpn_plugin::MetricsRegistry();
+  return registry;
+}
+
 // -------- EventChannel emit --------
+typedef struct {
+  VpnPlugin* plugin;
+  VpnState state;
+} StateEvent;
+
+static gboolean emit_on_main(gpointer data) {
+  static vpn_plugin::Counter* const dropped = metrics()->GetCounter(
+      "vpn_state_events_dropped_total", "State events sent while Dart was not listening.");
+  StateEvent* event = (StateEvent*)data;
+  VpnPlugin* self = event->plugin;
+  if (self->listening) {
+    g_autoptr(FlValue) value = fl_value_new_int(event->state);
+    fl_event_channel_send(self->event_channel, value, NULL, NULL);
+  } else {
+    dropped->Add();
+  }
+  g_object_unref(self);
+  g_free(event);
+  return G_SOURCE_REMOVE;
+}
+
+// Handlers run on dispatcher threads, and the event channel belongs to the
+// main loop; on the main thread this sends right away.
 static void emit_vpn_state(VpnPlugin* self, VpnState st) {
-  if (!self->event_sink) return;
-  FlValue* value = fl_value_new_int(st);
-  fl_event_sink_send(self->event_sink, value, NULL);
+  vpn_plugin::Tracer::Instant("vpn.state", st);
+  StateEvent* event = g_new(StateEvent, 1);
+  event->plugin = VPN_PLUGIN(g_object_ref(self));
+  event->state = st;
+  g_main_context_invoke(NULL, emit_on_main, event);
+}
+
+// Records the state for getCurrentState and sends it.
+static void set_vpn_state(VpnPlugin* self, VpnState st) {
+  g_atomic_int_set(&self->vpn_state, st);
+  emit_vpn_state(self, st);
+}
+
+// -------- Routing policies --------
+static std::vector<std::string> string_array_vector(GPtrArray* array) {
+  std::vector<std::string> out;
+  out.reserve(array->len);
+  for (guint i = 0; i < array->len; i++) out.push_back((const gchar*)g_ptr_array_index(array, i));
+  return out;
+}
+
+// A server's policy is its profile's, with the excluded routes on top. A
+// server whose profile is gone gets a new profile's defaults.
+static vpn_plugin::PolicyInputs policy_inputs(MockStorage* storage, const Server* server) {
+  vpn_plugin::PolicyInputs inputs;
+  for (guint i = 0; i < storage->routing_profiles->len; i++) {
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(storage->routing_profiles, i);
+    if (p->id != server->routing_profile_id) continue;
+    inputs.default_mode = p->default_mode == ROUTING_MODE_BYPASS ? vpn_plugin::RoutingMode::kBypass
+                                                                 : vpn_plugin::RoutingMode::kVpn;
+    inputs.bypass_rules = string_array_vector(p->bypass_rules);
+    inputs.vpn_rules = string_array_vector(p->vpn_rules);
+    break;
+  }
+  GPtrArray* routes = string_split_csv(storage->excluded_routes, ",");
+  inputs.excluded_routes = string_array_vector(routes);
+  string_array_free(routes);
+  return inputs;
+}
+
+// Hands the store the inputs of the servers using |profile_id|, or of all
+// servers if it is negative, after they may have changed, and forgets
+// removed servers. Inputs that did not change are not built again.
+static void refresh_policies(vpn_plugin::PolicyStore* policies, MockStorage* storage,
+                             gint64 profile_id) {
+  std::vector<int64_t> ids;
+  for (guint i = 0; i < storage->servers->len; i++) {
+    Server* s = (Server*)g_ptr_array_index(storage->servers, i);
+    ids.push_back(s->id);
+    if (profile_id < 0 || s->routing_profile_id == profile_id) {
+      policies->Set(s->id, policy_inputs(storage, s));
+    }
+  }
+  policies->Retain(ids);
+}
+
+// Swaps |server|'s policy, built at |version|, into the running engine if
+// that server is still the selected one: shards route new flows by it as
+// soon as they take the pointer. Both locks are held only for the checks
+// and the swap. A policy that is no longer the store's newest is dropped,
+// as whoever built the newer one offers it too, and offers of one engine
+// are serialized by |engine_lock|.
+static void offer_policy(VpnPlugin* self, gint64 server, uint64_t version,
+                         std::shared_ptr<const vpn_plugin::RoutingPolicy> policy) {
+  g_mutex_lock(&self->lock);
+  if (self->storage && self->storage->has_selected_server &&
+      self->storage->selected_server_id == server) {
+    g_mutex_lock(&self->engine_lock);
+    if (self->engine && self->engine->shards && self->policies->IsCurrent(server, version)) {
+      self->engine->shards->SetPolicy(std::move(policy));
+    }
+    g_mutex_unlock(&self->engine_lock);
+  }
+  g_mutex_unlock(&self->lock);
+}
+
+// Swaps the selected server's policy into the running engine. Called
+// without |lock|, as the policy may have to be built here.
+static void apply_selected_policy(VpnPlugin* self) {
+  g_mutex_lock(&self->engine_lock);
+  gboolean running = self->engine && self->engine->shards;
+  g_mutex_unlock(&self->engine_lock);
+  if (!running) return;
+  g_mutex_lock(&self->lock);
+  gboolean selected = self->storage->has_selected_server;
+  gint64 server = self->storage->selected_server_id;
+  g_mutex_unlock(&self->lock);
+  if (!selected) return;
+  uint64_t version = 0;
+  std::shared_ptr<const vpn_plugin::RoutingPolicy> policy = self->policies->Get(server, &version);
+  if (policy) offer_policy(self, server, version, std::move(policy));
+}
+
+// Runs on the store's thread when a rebuild lands, so that rule edits
+// reach a running engine too.
+static void on_policy_built(VpnPlugin* self, gint64 server, uint64_t version,
+                            std::shared_ptr<const vpn_plugin::RoutingPolicy> policy) {
+  offer_policy(self, server, version, std::move(policy));
+}
+
+// -------- Startup --------
+// Milliseconds since the process started. The start time comes from
+// /proc/self/stat, in clock ticks, so that exec and library loading count
+// too; it falls back to when this library was loaded.
+static gint64 process_uptime_ms(void) {
+  static const gint64 started_ms = []() -> gint64 {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    gint64 now_ms = (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    gchar* stat = NULL;
+    if (!g_file_get_contents("/proc/self/stat", &stat, NULL, NULL)) return now_ms;
+    // The command name may hold spaces; the fields after it do not.
+    // starttime is the 20th field after it.
+    const gchar* fields = strrchr(stat, ')');
+    unsigned long long ticks = 0;
+    bool parsed = fields && sscanf(fields + 1,
+                                   " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+                                   " %*d %*d %*d %*d %*d %*d %llu",
+                                   &ticks) == 1;
+    g_free(stat);
+    long hz = sysconf(_SC_CLK_TCK);
+    return parsed && hz > 0 ? (gint64)(ticks * 1000 / (unsigned long long)hz) : now_ms;
+  }();
+  timespec now;
+  clock_gettime(CLOCK_BOOTTIME, &now);
+  return (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000 - started_ms;
+}
+
+// Records one startup milestone as a gauge and, with G_MESSAGES_DEBUG set,
+// as a log line that bench/startup.sh reads.
+static void record_startup(const gchar* stage, const gchar* gauge, gint64 ms) {
+  metrics()->GetGauge(gauge, "Milliseconds from process start to this startup stage.")->Set(ms);
+  vpn_plugin::Tracer::Instant(stage, ms);
+  g_debug("vpn_plugin: startup: %s %" G_GINT64_FORMAT " ms", stage, ms);
+}
+
+static void on_first_frame(FlView* view, gpointer user_data) {
+  record_startup("first frame", "vpn_startup_first_frame_ms", process_uptime_ms());
+}
+
+// Sends the state to a listener that subscribed while storage was loading.
+// From here on on_event_listen() sends it, so it goes out once either way.
+static gboolean on_ready_main(gpointer data) {
+  VpnPlugin* self = VPN_PLUGIN(data);
+  self->announced = TRUE;
+  if (self->listening) emit_vpn_state(self, (VpnState)g_atomic_int_get(&self->vpn_state));
+  g_object_unref(self);
+  return G_SOURCE_REMOVE;
+}
+
+// Runs on the loader thread, holding a reference to the plugin. Storage
+// is in memory for now; a persistent store would be read here, off the
+// thread that draws the first frame. The servers' policies are queued for
+// the store's thread before any call can start the engine.
+static gpointer load_storage(gpointer data) {
+  VpnPlugin* self = VPN_PLUGIN(data);
+  gint64 started_ns = vpn_plugin::Tracer::NowNs();
+  MockStorage* storage;
+  {
+    vpn_plugin::TraceSpan span("storage.load");
+    storage = storage_new();
+    refresh_policies(self->policies, storage, -1);
+  }
+  metrics()
+      ->GetGauge("vpn_startup_storage_load_us", "Time the plugin took to load its storage.")
+      ->Set((vpn_plugin::Tracer::NowNs() - started_ns) / 1000);
+  g_mutex_lock(&self->lock);
+  self->storage = storage;
+  g_atomic_int_set(&self->ready, TRUE);
+  g_cond_broadcast(&self->ready_cond);
+  g_mutex_unlock(&self->lock);
+  record_startup("plugin ready", "vpn_startup_plugin_ready_ms", process_uptime_ms());
+  g_main_context_invoke(NULL, on_ready_main, self);
+  return NULL;
+}
+
+// Blocks until storage is loaded.
+static void wait_until_ready(VpnPlugin* self) {
+  if (g_atomic_int_get(&self->ready)) return;
+  g_mutex_lock(&self->lock);
+  while (!self->ready) g_cond_wait(&self->ready_cond, &self->lock);
+  g_mutex_unlock(&self->lock);
+}
+
+// -------- Native listener --------
+// TLS sessions to the endpoint, kept in the user's cache directory so that
+// the first connection after a restart can resume too.
+static std::shared_ptr<vpn_plugin::TlsSessionCache> tls_sessions() {
+  static std::shared_ptr<vpn_plugin::TlsSessionCache> sessions = []() {
+    gchar* dir = g_build_filename(g_get_user_cache_dir(), "trusttunnel", NULL);
+    g_mkdir_with_parents(dir, 0700);
+    gchar* path = g_build_filename(dir, "tls_sessions", NULL);
+    auto cache = std::make_shared<vpn_plugin::TlsSessionCache>(path);
+    g_free(path);
+    g_free(dir);
+    std::string error;
+    if (!cache->Load(&error)) g_warning("vpn_plugin: TLS sessions not restored: %s", error.c_str());
+    return cache;
+  }();
+  return sessions;
+}
+
+// Race winners stay known across reconnects and are shared by the shards.
+static std::shared_ptr<vpn_plugin::UpstreamWinnerCache> upstream_winners() {
+  static const auto winners = std::make_shared<vpn_plugin::UpstreamWinnerCache>();
+  return winners;
+}
+
+static void engine_free(Engine* engine) {
+  if (!engine) return;
+  // The writer's last write happens here, so the file shows the final
+  // counts.
+  delete engine->metrics_writer;
+  if (engine->shards) {
+    delete engine->shards;
+    std::string error;
+    if (!tls_sessions()->Save(&error)) g_warning("vpn_plugin: %s", error.c_str());
+  }
+  delete engine->domains;
+  delete engine;
+}
+
+// Takes the engine out of view and tears it down, which joins the shard
+// threads and writes the TLS sessions, with no lock held.
+static void engine_stop(VpnPlugin* self) {
+  g_mutex_lock(&self->engine_lock);
+  Engine* engine = self->engine;
+  self->engine = NULL;
+  g_mutex_unlock(&self->engine_lock);
+  engine_free(engine);
+}
+
+// Brings up what |config| describes. Returns NULL if there is nothing to
+// run.
+static Engine* engine_build(VpnPlugin* self, const vpn_plugin::ConfigDocument& config) {
+  Engine* engine = new Engine();
+  engine->metrics_writer = new vpn_plugin::MetricsFileWriter(
+      metrics(), vpn_plugin::MetricsOptions::FromConfig(config));
+  vpn_plugin::SocksServerOptions options;
+  if (!vpn_plugin::SocksServerOptions::FromConfig(config, &options)) return engine;
+  // The selected server's policy is built already; the configuration's
+  // vpn_mode and exclusions only route when no server is selected.
+  g_mutex_lock(&self->lock);
+  gboolean selected = self->storage->has_selected_server;
+  gint64 server = self->storage->selected_server_id;
+  g_mutex_unlock(&self->lock);
+  if (selected) options.policy = self->policies->Get(server);
+  if (!options.policy) {
+    options.policy = std::make_shared<vpn_plugin::RoutingPolicy>(
+        vpn_plugin::RoutingPolicy::FromConfig(config));
+  }
+  // Apps that connect by address still get their domain rules applied.
+  options.sniff = true;
+  // Each shard thread's pool is created with these on first use.
+  vpn_plugin::BufferPool::Configure(vpn_plugin::BufferPoolOptions::FromConfig(config));
+
+  // There is no HTTP/3 upstream here, so HTTP/2 serves whether it is the
+  // preferred protocol or the fallback.
+  bool http2 = config.GetString("endpoint", "upstream_protocol") == "http2" ||
+               config.GetString("endpoint", "upstream_fallback_protocol") == "http2";
+  std::string error;
+  vpn_plugin::Http2PoolOptions pool_options;
+  pool_options.winners = upstream_winners();
+  pool_options.tls_sessions = tls_sessions();
+  pool_options.connect_time_ms = metrics()->GetHistogram(
+      "vpn_upstream_connect_ms", "Time from a cold start to a ready HTTP/2 upstream connection.");
+  if (http2 && !vpn_plugin::Http2PoolOptions::FromConfig(config, &pool_options, &error)) {
+    g_warning("vpn_plugin: HTTP/2 upstream disabled: %s", error.c_str());
+    http2 = false;
+  }
+  vpn_plugin::SocksShardOptions shard_options = vpn_plugin::SocksShardOptions::FromConfig(config);
+  // The buffer limit is for the process; each shard gets its share. A
+  // stream's initial window is all its flow may hold before credit comes
+  // back, so it cannot exceed the flow's budget.
+  vpn_plugin::RelayBudgetOptions budget_options = vpn_plugin::RelayBudgetOptions::FromConfig(config);
+  size_t shard_count =
+      shard_options.shards ? shard_options.shards : vpn_plugin::AllowedCpus().size();
+  budget_options.total_bytes =
+      std::max(budget_options.total_bytes / shard_count, budget_options.per_flow_bytes);
+  pool_options.connection.stream_window = static_cast<int32_t>(std::min<size_t>(
+      static_cast<size_t>(pool_options.connection.stream_window), budget_options.per_flow_bytes));
+  std::string username = config.GetString("endpoint", "username");
+  std::string password = config.GetString("endpoint", "password");
+  vpn_plugin::DnsForwarderOptions dns_options;
+  bool dns = vpn_plugin::DnsForwarderOptions::FromConfig(config, &dns_options, &error);
+  if (dns) {
+    engine->domains = new vpn_plugin::DomainTable();
+    dns_options.domains = engine->domains;
+    dns_options.upstream_latency_us = metrics()->GetHistogram(
+        "vpn_dns_upstream_us", "Time from forwarding a DNS miss to the first usable answer.");
+  }
+  vpn_plugin::DomainTable* domains = engine->domains;
+
+  // Upstream objects are per shard, so a flow never leaves the thread that
+  // accepted it. Start() calls this for every shard before returning.
+  auto setup = [=](size_t, vpn_plugin::EventLoop* loop,
+                   vpn_plugin::SocksServerOptions* shard) -> vpn_plugin::EventLoop::Task {
+    vpn_plugin::Http2Pool* pool = NULL;
+    vpn_plugin::RelayBudget* budget = NULL;
+    vpn_plugin::Http2TunnelConnector* tunnel = NULL;
+    vpn_plugin::DnsForwarder* forwarder = NULL;
+    if (http2) {
+      pool = new vpn_plugin::Http2Pool(loop, pool_options);
+      budget = new vpn_plugin::RelayBudget(loop, budget_options);
+      tunnel = new vpn_plugin::Http2TunnelConnector(loop, pool, username, password, budget);
+      shard->tunnel = tunnel;
+    }
+    if (dns) {
+      forwarder = new vpn_plugin::DnsForwarder(loop, dns_options);
+      if (forwarder->Start()) {
+        shard->dns = forwarder;
+        shard->domains = domains;
+        engine->forwarders.push_back(forwarder);
+      } else {
+        g_warning("vpn_plugin: DNS forwarder disabled: cannot open upstream sockets");
+      }
+    }
+    return [pool, budget, tunnel, forwarder]() {
+      delete forwarder;
+      delete tunnel;
+      delete budget;
+      delete pool;
+    };
+  };
+  engine->shards = new vpn_plugin::SocksShardGroup(shard_options, options, setup);
+  if (!engine->shards->Start()) {
+    g_warning("vpn_plugin: cannot listen on %s", options.listen_address.ToString().c_str());
+    engine_free(engine);
+    return NULL;
+  }
+  return engine;
+}
+
+// Runs on the ivpn lane without |lock|: building the engine starts its
+// threads and may build the selected server's policy.
+static void engine_start(VpnPlugin* self, const gchar* config_text) {
+  vpn_plugin::TraceSpan span("engine.start");
+  engine_stop(self);
+  if (!config_text || !*config_text) return;
+
+  vpn_plugin::ConfigDocument config;
+  std::string error;
+  if (!vpn_plugin::ConfigDocument::Parse(config_text, &config, &error)) {
+    g_warning("vpn_plugin: bad configuration: %s", error.c_str());
+    return;
+  }
+  Engine* engine = engine_build(self, config);
+  if (!engine) return;
+  g_mutex_lock(&self->engine_lock);
+  self->engine = engine;
+  g_mutex_unlock(&self->engine_lock);
+  // A selection or rebuild that landed while the shards came up found no
+  // engine to hand its policy to.
+  apply_selected_policy(self);
+}
+
+
+// -------- Method dispatch --------
+typedef FlMethodResponse* (*MethodHandler)(VpnPlugin* self, FlValue* args);
+
+typedef struct {
+  const gchar* name;
+  MethodHandler handler;
+  // Handlers run with |lock| held, except these, which take it only around
+  // the storage they touch, if any: they also start or stop the engine or
+  // build policies.
+  gboolean self_locking;
+} MethodEntry;
+
+// Dispatcher lanes: calls of one channel are answered in order.
+enum {
+  LANE_IVPN,
+  LANE_STORAGE,
+  LANE_SERVERS,
+  LANE_ROUTING,
+};
+
+// Handlers of one method channel, with their names in a table built on
+// first use.
+typedef struct {
+  const gchar* name;
+  guint32 lane;
+  const MethodEntry* entries;
+  size_t count;
+} ChannelMethods;
+
+// What a channel's callback builds on first use: the lookup table of its
+// method names and each method's handler time.
+typedef struct {
+  vpn_plugin::MethodTable names;
+  std::vector<vpn_plugin::Histogram*> durations;
+} ChannelTable;
+
+typedef struct {
+  VpnPlugin* plugin;
+  FlMethodCall* call;
+  FlMethodResponse* response;
+} PendingCall;
+
+static ChannelTable channel_table(const ChannelMethods* channel) {
+  std::vector<std::string> names;
+  std::vector<vpn_plugin::Histogram*> durations;
+  for (size_t i = 0; i < channel->count; i++) {
+    names.push_back(channel->entries[i].name);
+    std::string labels = std::string("channel=\"") + channel->name + "\",method=\"" +
+                         channel->entries[i].name + "\"";
+    durations.push_back(metrics()->GetHistogram(
+        "vpn_method_duration_us", "Time method handlers run, waiting for the lock included.",
+        labels));
+  }
+  return ChannelTable{vpn_plugin::MethodTable(std::move(names)), std::move(durations)};
+}
+
+// Runs |entry|'s handler once storage is in.
+static FlMethodResponse* run_handler(VpnPlugin* self, const MethodEntry* entry, FlValue* args) {
+  wait_until_ready(self);
+  if (entry->self_locking) return entry->handler(self, args);
+  g_mutex_lock(&self->lock);
+  FlMethodResponse* response = entry->handler(self, args);
+  g_mutex_unlock(&self->lock);
+  return response;
+}
+
+static gboolean respond_on_main(gpointer data) {
+  PendingCall* pending = (PendingCall*)data;
+  fl_method_call_respond(pending->call, pending->response, NULL);
+  g_object_unref(pending->response);
+  g_object_unref(pending->call);
+  g_object_unref(pending->plugin);
+  g_free(pending);
+  return G_SOURCE_REMOVE;
+}
+
+// Looks the method up on the main thread, runs its handler on the
+// channel's dispatcher lane and sends the response from the main loop.
+static void dispatch_method_call(VpnPlugin* self, const ChannelMethods* channel,
+                                 const ChannelTable& table, FlMethodCall* call) {
+  static vpn_plugin::Gauge* const queued = metrics()->GetGauge(
+      "vpn_method_queue_depth", "Method calls posted to the dispatcher and not yet answered.");
+  static vpn_plugin::Histogram* const waited = metrics()->GetHistogram(
+      "vpn_method_wait_us", "Time method calls wait for their dispatcher lane.");
+  int index = table.names.Find(fl_method_call_get_name(call));
+  if (index < 0) {
+    g_autoptr(FlMethodResponse) resp = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
+    fl_method_call_respond(call, resp, NULL);
+    return;
+  }
+  const MethodEntry* entry = &channel->entries[index];
+  vpn_plugin::Histogram* duration = table.durations[index];
+  PendingCall* pending = g_new0(PendingCall, 1);
+  pending->plugin = (VpnPlugin*)g_object_ref(self);
+  pending->call = (FlMethodCall*)g_object_ref(call);
+  gint64 posted_ns = vpn_plugin::Tracer::NowNs();
+  queued->Add(1);
+  self->dispatcher->Post(channel->lane, [pending, entry, duration, posted_ns]() {
+    gint64 started_ns = vpn_plugin::Tracer::NowNs();
+    waited->Record((started_ns - posted_ns) / 1000);
+    vpn_plugin::Tracer::Complete("method.queued", posted_ns);
+    {
+      vpn_plugin::TraceSpan span(entry->name);
+      pending->response =
+          run_handler(pending->plugin, entry, fl_method_call_get_args(pending->call));
+    }
+    duration->Record((vpn_plugin::Tracer::NowNs() - started_ns) / 1000);
+    queued->Add(-1);
+    g_main_context_invoke(NULL, respond_on_main, pending);
+  });
 }
 
 // -------- IVpnManager handlers (MethodChannel "ivpn_manager") --------
-static FlMethodResponse* ivpn_start(VpnPlugin* self) {
-  self->storage->vpn_state = VPN_STATE_CONNECTING;
-  emit_vpn_state(self, self->storage->vpn_state);
+// A connect timer, armed or replaced on the main loop, which owns
+// |connect_timeout_id|. It holds a reference on the plugin until it is
+// destroyed.
+typedef struct {
+  VpnPlugin* plugin;
+  // |connect_generation| of the start that armed it.
+  gint generation;
+  gint64 started_ns;
+  // FALSE to only cancel the pending timer.
+  gboolean arm;
+} ConnectTimer;
+
+static void connect_timer_free(gpointer data) {
+  ConnectTimer* timer = (ConnectTimer*)data;
+  g_object_unref(timer->plugin);
+  g_free(timer);
+}
+
+static gboolean on_connect_timeout(gpointer data) {
+  static vpn_plugin::Histogram* const connect_time = metrics()->GetHistogram(
+      "vpn_connect_ms", "Time from a start call to the connected state.");
+  ConnectTimer* timer = (ConnectTimer*)data;
+  VpnPlugin* self = timer->plugin;
+  self->connect_timeout_id = 0;
+  if (g_atomic_int_get(&self->connect_generation) == timer->generation &&
+      g_atomic_int_compare_and_exchange(&self->vpn_state, VPN_STATE_CONNECTING,
+                                        VPN_STATE_CONNECTED)) {
+    connect_time->Record((vpn_plugin::Tracer::NowNs() - timer->started_ns) / 1000000);
+    vpn_plugin::Tracer::Complete("vpn.connect", timer->started_ns);
+    emit_vpn_state(self, VPN_STATE_CONNECTED);
+  }
+  return G_SOURCE_REMOVE;
+}
 
+static gboolean reset_connect_timer(gpointer data) {
+  ConnectTimer* timer = (ConnectTimer*)data;
+  VpnPlugin* self = timer->plugin;
   if (self->connect_timeout_id) g_source_remove(self->connect_timeout_id);
-  self->connect_timeout_id = g_timeout_add(2000, (GSourceFunc) (^(gpointer data) -> gboolean {
-    VpnPlugin* plugin = (VpnPlugin*)data;
-    plugin->storage->vpn_state = VPN_STATE_CONNECTED;
-    emit_vpn_state(plugin, plugin->storage->vpn_state);
-    plugin->connect_timeout_id = 0;
+  self->connect_timeout_id = 0;
+  if (!timer->arm) {
+    connect_timer_free(timer);
     return G_SOURCE_REMOVE;
-  }), self);
+  }
+  self->connect_timeout_id =
+      g_timeout_add_full(G_PRIORITY_DEFAULT, 2000, on_connect_timeout, timer, connect_timer_free);
+  return G_SOURCE_REMOVE;
+}
+
+// Replaces the pending connect timer, from any thread, with one for the
+// start at |generation|, or with none.
+static void post_connect_timer(VpnPlugin* self, gint generation, gint64 started_ns,
+                               gboolean arm) {
+  ConnectTimer* timer = g_new0(ConnectTimer, 1);
+  timer->plugin = VPN_PLUGIN(g_object_ref(self));
+  timer->generation = generation;
+  timer->started_ns = started_ns;
+  timer->arm = arm;
+  g_main_context_invoke(NULL, reset_connect_timer, timer);
+}
+
+static FlMethodResponse* ivpn_start(VpnPlugin* self, FlValue* args) {
+  gint64 started_ns = vpn_plugin::Tracer::NowNs();
+  gint generation = g_atomic_int_add(&self->connect_generation, 1) + 1;
+  set_vpn_state(self, VPN_STATE_CONNECTING);
 
+  FlValue* config = (args && fl_value_get_type(args) == FL_VALUE_TYPE_MAP)
+                        ? fl_value_lookup_string(args, "config") : NULL;
+  engine_start(self, (config && fl_value_get_type(config) == FL_VALUE_TYPE_STRING)
+                         ? fl_value_get_string(config) : NULL);
+
+  post_connect_timer(self, generation, started_ns, TRUE);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
 static FlMethodResponse* ivpn_stop(VpnPlugin* self) {
-  if (self->connect_timeout_id) { g_source_remove(self->connect_timeout_id); self->connect_timeout_id = 0; }
-  self->storage->vpn_state = VPN_STATE_DISCONNECTED;
-  emit_vpn_state(self, self->storage->vpn_state);
+  gint generation = g_atomic_int_add(&self->connect_generation, 1) + 1;
+  post_connect_timer(self, generation, 0, FALSE);
+  engine_stop(self);
+  set_vpn_state(self, VPN_STATE_DISCONNECTED);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
 static FlMethodResponse* ivpn_get_state(VpnPlugin* self) {
-  return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_int(self->storage->vpn_state)));
+  return FL_METHOD_RESPONSE(
+      fl_method_success_response_new(fl_value_new_int(g_atomic_int_get(&self->vpn_state))));
 }
 
-static void ivpn_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
-  VpnPlugin* self = VPN_PLUGIN(user_data);
-  const gchar* method = fl_method_call_get_name(call);
-  g_autoptr(FlMethodResponse) resp = NULL;
+// Tracing of the native side. startTrace takes an optional
+// eventsPerThread; writeTrace takes a path and a format, "json" for Chrome
+// trace events or "perfetto".
+static FlMethodResponse* ivpn_start_trace(VpnPlugin* self, FlValue* args) {
+  FlValue* size = (args && fl_value_get_type(args) == FL_VALUE_TYPE_MAP)
+                      ? fl_value_lookup_string(args, "eventsPerThread") : NULL;
+  vpn_plugin::Tracer::Clear();
+  vpn_plugin::Tracer::Enable((size && fl_value_get_type(size) == FL_VALUE_TYPE_INT &&
+                              fl_value_get_int(size) > 0)
+                                 ? (size_t)fl_value_get_int(size)
+                                 : vpn_plugin::Tracer::kDefaultEventsPerThread);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
+}
 
-  if (g_strcmp0(method, "start") == 0) resp = ivpn_start(self);
-  else if (g_strcmp0(method, "stop") == 0) resp = ivpn_stop(self);
-  else if (g_strcmp0(method, "getCurrentState") == 0) resp = ivpn_get_state(self);
-  else resp = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
+static FlMethodResponse* ivpn_stop_trace(VpnPlugin* self) {
+  vpn_plugin::Tracer::Disable();
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
+}
 
-  fl_method_call_respond(call, resp, NULL);
+static FlMethodResponse* ivpn_write_trace(VpnPlugin* self, FlValue* args) {
+  FlValue* path = (args && fl_value_get_type(args) == FL_VALUE_TYPE_MAP)
+                      ? fl_value_lookup_string(args, "path") : NULL;
+  FlValue* format = (args && fl_value_get_type(args) == FL_VALUE_TYPE_MAP)
+                        ? fl_value_lookup_string(args, "format") : NULL;
+  if (!path || fl_value_get_type(path) != FL_VALUE_TYPE_STRING) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new("bad-args", "path is required", NULL));
+  }
+  vpn_plugin::TraceFormat trace_format =
+      (format && fl_value_get_type(format) == FL_VALUE_TYPE_STRING &&
+       g_strcmp0(fl_value_get_string(format), "perfetto") == 0)
+          ? vpn_plugin::TraceFormat::kPerfetto
+          : vpn_plugin::TraceFormat::kChromeJson;
+  std::string error;
+  if (!vpn_plugin::Tracer::Write(fl_value_get_string(path), trace_format, &error)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new("io-error", error.c_str(), NULL));
+  }
+  return FL_METHOD_RESPONSE(
+      fl_method_success_response_new(fl_value_new_int((int64_t)vpn_plugin::Tracer::dropped())));
+}
+
+// None of these touch storage but for the policy lookup on start.
+static const MethodEntry kIvpnMethods[] = {
+  {"start", ivpn_start, TRUE},
+  {"stop", [](VpnPlugin* self, FlValue*) { return ivpn_stop(self); }, TRUE},
+  {"getCurrentState", [](VpnPlugin* self, FlValue*) { return ivpn_get_state(self); }, TRUE},
+  {"startTrace", ivpn_start_trace, TRUE},
+  {"stopTrace", [](VpnPlugin* self, FlValue*) { return ivpn_stop_trace(self); }, TRUE},
+  {"writeTrace", ivpn_write_trace, TRUE},
+};
+
+static const ChannelMethods kIvpnChannel = {
+  "ivpn_manager", LANE_IVPN, kIvpnMethods, G_N_ELEMENTS(kIvpnMethods),
+};
+
+static void ivpn_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
+  static const ChannelTable table = channel_table(&kIvpnChannel);
+  dispatch_method_call(VPN_PLUGIN(user_data), &kIvpnChannel, table, call);
 }
 
 // -------- StorageManager ("storage_manager") --------
+// Nothing on the Dart side calls this channel: the app keeps servers and
+// profiles in its own database and reaches the plugin through the pigeon
+// API. The packed list replies, like the trace, metrics and memory calls,
+// are for native tests and benches and for a Dart client to come, which
+// would decode the layout in record_codec.h.
 static FlMethodResponse* storage_get_servers(VpnPlugin* self) {
   FlValue* list = fl_value_new_list();
   for (guint i = 0; i < self->storage->servers->len; i++) {
-    Server* s = g_ptr_array_index(self->storage->servers, i);
+    Server* s = (Server*)g_ptr_array_index(self->storage->servers, i);
     FlValue* m = fl_value_new_map();
     fl_value_set_string_take(m, "id", fl_value_new_int(s->id));
     fl_value_set_string_take(m, "ipAddress", fl_value_new_string(s->ip_address));
@@ -303,7 +990,7 @@ static FlMethodResponse* storage_get_servers(VpnPlugin* self) {
     fl_value_set_string_take(m, "password", fl_value_new_string(s->password));
     FlValue* dns = fl_value_new_list();
     for (guint d = 0; d < s->dns_servers->len; d++) {
-      fl_value_append_take(dns, fl_value_new_string(g_ptr_array_index(s->dns_servers, d)));
+      fl_value_append_take(dns, fl_value_new_string((const gchar*)g_ptr_array_index(s->dns_servers, d)));
     }
     fl_value_set_string_take(m, "dnsServers", dns);
     fl_value_set_string_take(m, "vpnProtocol", fl_value_new_int(s->vpn_protocol));
@@ -316,19 +1003,19 @@ static FlMethodResponse* storage_get_servers(VpnPlugin* self) {
 static FlMethodResponse* storage_get_profiles(VpnPlugin* self) {
   FlValue* list = fl_value_new_list();
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     FlValue* m = fl_value_new_map();
     fl_value_set_string_take(m, "id", fl_value_new_int(p->id));
     fl_value_set_string_take(m, "name", fl_value_new_string(p->name));
     fl_value_set_string_take(m, "defaultMode", fl_value_new_int(p->default_mode));
     FlValue* bypass = fl_value_new_list();
     for (guint b = 0; b < p->bypass_rules->len; b++)
-      fl_value_append_take(bypass, fl_value_new_string(g_ptr_array_index(p->bypass_rules, b)));
+      fl_value_append_take(bypass, fl_value_new_string((const gchar*)g_ptr_array_index(p->bypass_rules, b)));
     fl_value_set_string_take(m, "bypassRules", bypass);
 
     FlValue* vpn = fl_value_new_list();
     for (guint b = 0; b < p->vpn_rules->len; b++)
-      fl_value_append_take(vpn, fl_value_new_string(g_ptr_array_index(p->vpn_rules, b)));
+      fl_value_append_take(vpn, fl_value_new_string((const gchar*)g_ptr_array_index(p->vpn_rules, b)));
     fl_value_set_string_take(m, "vpnRules", vpn);
 
     fl_value_append_take(list, m);
@@ -336,6 +1023,48 @@ static FlMethodResponse* storage_get_profiles(VpnPlugin* self) {
   return FL_METHOD_RESPONSE(fl_method_success_response_new(list));
 }
 
+// Same content as storage_get_servers() as one Uint8List in the
+// record_codec.h layout, fields in this order: id, ipAddress, domain,
+// login, password, dnsServers, vpnProtocol, routingProfileId.
+static FlMethodResponse* storage_get_servers_packed(VpnPlugin* self) {
+  vpn_plugin::RecordWriter* w = self->packer;
+  w->Reset(8);
+  for (guint i = 0; i < self->storage->servers->len; i++) {
+    Server* s = (Server*)g_ptr_array_index(self->storage->servers, i);
+    w->AddInt(s->id);
+    w->AddString(s->ip_address);
+    w->AddString(s->domain);
+    w->AddString(s->login);
+    w->AddString(s->password);
+    w->AddStringList((const char* const*)s->dns_servers->pdata, s->dns_servers->len);
+    w->AddInt(s->vpn_protocol);
+    w->AddInt(s->routing_profile_id);
+    w->EndRecord();
+  }
+  const std::string& packed = w->Finish();
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(
+      fl_value_new_uint8_list((const uint8_t*)packed.data(), packed.size())));
+}
+
+// Packed storage_get_profiles(): id, name, defaultMode, bypassRules,
+// vpnRules.
+static FlMethodResponse* storage_get_profiles_packed(VpnPlugin* self) {
+  vpn_plugin::RecordWriter* w = self->packer;
+  w->Reset(5);
+  for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
+    w->AddInt(p->id);
+    w->AddString(p->name);
+    w->AddInt(p->default_mode);
+    w->AddStringList((const char* const*)p->bypass_rules->pdata, p->bypass_rules->len);
+    w->AddStringList((const char* const*)p->vpn_rules->pdata, p->vpn_rules->len);
+    w->EndRecord();
+  }
+  const std::string& packed = w->Finish();
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(
+      fl_value_new_uint8_list((const uint8_t*)packed.data(), packed.size())));
+}
+
 static FlMethodResponse* storage_get_selected_id(VpnPlugin* self) {
   if (!self->storage->has_selected_server)
     return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
@@ -347,8 +1076,11 @@ static FlMethodResponse* storage_set_selected_id(VpnPlugin* self, FlValue* args)
   if (!v || fl_value_get_type(v) != FL_VALUE_TYPE_INT) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new("bad-args", "id is required", NULL));
   }
+  g_mutex_lock(&self->lock);
   self->storage->has_selected_server = TRUE;
   self->storage->selected_server_id = fl_value_get_int(v);
+  g_mutex_unlock(&self->lock);
+  apply_selected_policy(self);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
@@ -361,24 +1093,160 @@ static FlMethodResponse* storage_set_excluded(VpnPlugin* self, FlValue* args) {
   const gchar* s = (v && fl_value_get_type(v) == FL_VALUE_TYPE_STRING) ? fl_value_get_string(v) : "";
   g_free(self->storage->excluded_routes);
   self->storage->excluded_routes = g_strdup_or_empty(s);
+  refresh_policies(self->policies, self->storage, -1);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
-static void storage_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
-  VpnPlugin* self = VPN_PLUGIN(user_data);
-  const gchar* method = fl_method_call_get_name(call);
-  FlValue* args = fl_method_call_get_args(call);
-  g_autoptr(FlMethodResponse) resp = NULL;
+// Every metric of the process, keyed by series as Prometheus writes it,
+// e.g. vpn_method_duration_us{channel="...",method="..."}. Counters and
+// gauges map to their value, histograms to count, sum, max and p50, p90
+// and p99.
+static FlMethodResponse* storage_get_metrics(VpnPlugin* self) {
+  FlValue* map = fl_value_new_map();
+  for (const vpn_plugin::MetricsRegistry::Sample& sample : metrics()->Snapshot()) {
+    std::string series = sample.labels.empty() ? sample.name
+                                               : sample.name + "{" + sample.labels + "}";
+    if (sample.type != vpn_plugin::MetricsRegistry::Type::kHistogram) {
+      fl_value_set_string_take(map, series.c_str(), fl_value_new_int(sample.value));
+      continue;
+    }
+    const vpn_plugin::HistogramSnapshot& h = sample.histogram;
+    FlValue* value = fl_value_new_map();
+    fl_value_set_string_take(value, "count", fl_value_new_int((int64_t)h.count()));
+    fl_value_set_string_take(value, "sum", fl_value_new_int(h.sum()));
+    fl_value_set_string_take(value, "max", fl_value_new_int(h.max()));
+    fl_value_set_string_take(value, "p50", fl_value_new_int(h.Percentile(0.5)));
+    fl_value_set_string_take(value, "p90", fl_value_new_int(h.Percentile(0.9)));
+    fl_value_set_string_take(value, "p99", fl_value_new_int(h.Percentile(0.99)));
+    fl_value_set_string_take(map, series.c_str(), value);
+  }
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(map));
+}
+
+// GLib blocks are counted at the size asked for, without malloc's own
+// overhead.
+static size_t string_bytes(const gchar* s) { return s ? strlen(s) + 1 : 0; }
 
-  if (g_strcmp0(method, "getAllServers") == 0) resp = storage_get_servers(self);
-  else if (g_strcmp0(method, "getRoutingProfiles") == 0) resp = storage_get_profiles(self);
-  else if (g_strcmp0(method, "getSelectedServerId") == 0) resp = storage_get_selected_id(self);
-  else if (g_strcmp0(method, "setSelectedServerId") == 0) resp = storage_set_selected_id(self, args);
-  else if (g_strcmp0(method, "getExcludedRoutes") == 0) resp = storage_get_excluded(self);
-  else if (g_strcmp0(method, "setExcludedRoutes") == 0) resp = storage_set_excluded(self, args);
-  else resp = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
+static size_t ptr_array_bytes(GPtrArray* array) {
+  return sizeof(GPtrArray) + array->len * sizeof(gpointer);
+}
+
+static vpn_plugin::MemoryUsage string_array_usage(GPtrArray* array) {
+  vpn_plugin::MemoryUsage usage;
+  usage.bytes = ptr_array_bytes(array);
+  for (guint i = 0; i < array->len; i++) {
+    usage.bytes += string_bytes((const gchar*)g_ptr_array_index(array, i));
+  }
+  usage.objects = array->len;
+  return usage;
+}
 
-  fl_method_call_respond(call, resp, NULL);
+static vpn_plugin::MemoryUsage servers_usage(GPtrArray* servers) {
+  vpn_plugin::MemoryUsage usage;
+  usage.bytes = ptr_array_bytes(servers);
+  for (guint i = 0; i < servers->len; i++) {
+    Server* s = (Server*)g_ptr_array_index(servers, i);
+    usage.bytes += sizeof(Server) + string_bytes(s->ip_address) + string_bytes(s->domain) +
+                   string_bytes(s->login) + string_bytes(s->password) +
+                   string_array_usage(s->dns_servers).bytes;
+  }
+  usage.objects = servers->len;
+  return usage;
+}
+
+// Profiles without their rules, which |rules| receives.
+static vpn_plugin::MemoryUsage profiles_usage(GPtrArray* profiles,
+                                              vpn_plugin::MemoryUsage* rules) {
+  vpn_plugin::MemoryUsage usage;
+  usage.bytes = ptr_array_bytes(profiles);
+  for (guint i = 0; i < profiles->len; i++) {
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(profiles, i);
+    usage.bytes += sizeof(RoutingProfile) + string_bytes(p->name);
+    *rules += string_array_usage(p->bypass_rules);
+    *rules += string_array_usage(p->vpn_rules);
+  }
+  usage.objects = profiles->len;
+  return usage;
+}
+
+static vpn_plugin::MemoryUsage requests_usage(GPtrArray* requests) {
+  vpn_plugin::MemoryUsage usage;
+  usage.bytes = ptr_array_bytes(requests);
+  for (guint i = 0; i < requests->len; i++) {
+    VpnRequest* r = (VpnRequest*)g_ptr_array_index(requests, i);
+    usage.bytes += sizeof(VpnRequest) + string_bytes(r->zoned_date_time) +
+                   string_bytes(r->protocol_name) + string_bytes(r->source_ip_address) +
+                   string_bytes(r->destination_ip_address) + string_bytes(r->source_port) +
+                   string_bytes(r->destination_port) + string_bytes(r->domain);
+  }
+  usage.objects = requests->len;
+  return usage;
+}
+
+// Live bytes and objects per subsystem, plus their total. The engine's
+// caches only count while it runs; buffer pool slabs are the process's.
+static FlMethodResponse* storage_get_memory_usage(VpnPlugin* self) {
+  vpn_plugin::MemoryUsage rules;
+  vpn_plugin::MemoryUsage profiles = profiles_usage(self->storage->routing_profiles, &rules);
+  vpn_plugin::MemoryUsage dns_cache;
+  vpn_plugin::MemoryUsage domains;
+  g_mutex_lock(&self->engine_lock);
+  if (self->engine) {
+    for (vpn_plugin::DnsForwarder* forwarder : self->engine->forwarders) {
+      dns_cache += forwarder->cache().memory_usage();
+    }
+    if (self->engine->domains) domains = self->engine->domains->memory_usage();
+  }
+  g_mutex_unlock(&self->engine_lock);
+  const std::pair<const char*, vpn_plugin::MemoryUsage> subsystems[] = {
+    {"servers", servers_usage(self->storage->servers)},
+    {"routingProfiles", profiles},
+    {"routingRules", rules},
+    {"requests", requests_usage(self->storage->requests)},
+    {"dnsCache", dns_cache},
+    {"domainTable", domains},
+    {"tlsSessions", tls_sessions()->memory_usage()},
+    {"upstreamWinners", upstream_winners()->memory_usage()},
+    {"packedReplies", self->packer->memory_usage()},
+    {"bufferPools", vpn_plugin::BufferPool::ProcessMemoryUsage()},
+  };
+  FlValue* map = fl_value_new_map();
+  vpn_plugin::MemoryUsage total;
+  for (const auto& subsystem : subsystems) {
+    FlValue* value = fl_value_new_map();
+    fl_value_set_string_take(value, "bytes", fl_value_new_int((int64_t)subsystem.second.bytes));
+    fl_value_set_string_take(value, "objects",
+                             fl_value_new_int((int64_t)subsystem.second.objects));
+    fl_value_set_string_take(map, subsystem.first, value);
+    total += subsystem.second;
+  }
+  FlValue* value = fl_value_new_map();
+  fl_value_set_string_take(value, "bytes", fl_value_new_int((int64_t)total.bytes));
+  fl_value_set_string_take(value, "objects", fl_value_new_int((int64_t)total.objects));
+  fl_value_set_string_take(map, "total", value);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(map));
+}
+
+static const MethodEntry kStorageMethods[] = {
+  {"getAllServers", [](VpnPlugin* self, FlValue*) { return storage_get_servers(self); }},
+  {"getRoutingProfiles", [](VpnPlugin* self, FlValue*) { return storage_get_profiles(self); }},
+  {"getAllServersPacked", [](VpnPlugin* self, FlValue*) { return storage_get_servers_packed(self); }},
+  {"getRoutingProfilesPacked", [](VpnPlugin* self, FlValue*) { return storage_get_profiles_packed(self); }},
+  {"getSelectedServerId", [](VpnPlugin* self, FlValue*) { return storage_get_selected_id(self); }},
+  {"setSelectedServerId", storage_set_selected_id, TRUE},
+  {"getExcludedRoutes", [](VpnPlugin* self, FlValue*) { return storage_get_excluded(self); }},
+  {"setExcludedRoutes", storage_set_excluded},
+  {"getMetrics", [](VpnPlugin* self, FlValue*) { return storage_get_metrics(self); }},
+  {"getMemoryUsage", [](VpnPlugin* self, FlValue*) { return storage_get_memory_usage(self); }},
+};
+
+static const ChannelMethods kStorageChannel = {
+  "storage_manager", LANE_STORAGE, kStorageMethods, G_N_ELEMENTS(kStorageMethods),
+};
+
+static void storage_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
+  static const ChannelTable table = channel_table(&kStorageChannel);
+  dispatch_method_call(VPN_PLUGIN(user_data), &kStorageChannel, table, call);
 }
 
 // -------- ServersManager ("servers_manager") --------
@@ -402,10 +1270,11 @@ static FlMethodResponse* servers_add(VpnPlugin* self, FlValue* args) {
   // new id
   gint64 nid = 1;
   for (guint i = 0; i < self->storage->servers->len; i++) {
-    Server* s = g_ptr_array_index(self->storage->servers, i);
+    Server* s = (Server*)g_ptr_array_index(self->storage->servers, i);
     if (s->id >= nid) nid = s->id + 1;
   }
   g_ptr_array_add(self->storage->servers, server_new(nid, ip, domain, username, password, dns, (VpnProtocol)proto, profile_id));
+  refresh_policies(self->policies, self->storage, profile_id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_int(0))); // ok
 }
 
@@ -430,7 +1299,7 @@ static FlMethodResponse* servers_set(VpnPlugin* self, FlValue* args) {
   if (dns->len == 0) { string_array_free(dns); return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_int(5))); }
 
   for (guint i = 0; i < self->storage->servers->len; i++) {
-    Server* s = g_ptr_array_index(self->storage->servers, i);
+    Server* s = (Server*)g_ptr_array_index(self->storage->servers, i);
     if (s->id == id) {
       Server* updated = server_new(id, ip, domain, user, pass, dns, (VpnProtocol)proto, profile_id);
       server_free(s);
@@ -438,6 +1307,7 @@ static FlMethodResponse* servers_set(VpnPlugin* self, FlValue* args) {
       break;
     }
   }
+  refresh_policies(self->policies, self->storage, profile_id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_int(0)));
 }
 
@@ -445,8 +1315,11 @@ static FlMethodResponse* servers_set_selected(VpnPlugin* self, FlValue* args) {
   FlValue* v = fl_value_lookup_string(args, "id");
   if (!v || fl_value_get_type(v) != FL_VALUE_TYPE_INT)
     return FL_METHOD_RESPONSE(fl_method_error_response_new("bad-args","id required",NULL));
+  g_mutex_lock(&self->lock);
   self->storage->has_selected_server = TRUE;
   self->storage->selected_server_id = fl_value_get_int(v);
+  g_mutex_unlock(&self->lock);
+  apply_selected_policy(self);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
@@ -456,33 +1329,37 @@ static FlMethodResponse* servers_remove(VpnPlugin* self, FlValue* args) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new("bad-args","id required",NULL));
   gint64 id = fl_value_get_int(v);
 
+  gint64 profile_id = -1;
   for (guint i = 0; i < self->storage->servers->len; ) {
-    Server* s = g_ptr_array_index(self->storage->servers, i);
+    Server* s = (Server*)g_ptr_array_index(self->storage->servers, i);
     if (s->id == id) {
-      server_free(s);
+      profile_id = s->routing_profile_id;
+      // The array frees the server.
       g_ptr_array_remove_index_fast(self->storage->servers, i);
     } else { i++; }
   }
   if (self->storage->has_selected_server && self->storage->selected_server_id == id) {
     self->storage->has_selected_server = FALSE;
   }
+  if (profile_id >= 0) refresh_policies(self->policies, self->storage, profile_id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
-static void servers_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
-  VpnPlugin* self = VPN_PLUGIN(user_data);
-  const gchar* method = fl_method_call_get_name(call);
-  FlValue* args = fl_method_call_get_args(call);
-  g_autoptr(FlMethodResponse) resp = NULL;
+static const MethodEntry kServersMethods[] = {
+  {"addNewServer", servers_add},
+  {"getAllServers", [](VpnPlugin* self, FlValue*) { return servers_get_all(self); }},
+  {"setNewServer", servers_set},
+  {"setSelectedServerId", servers_set_selected, TRUE},
+  {"removeServer", servers_remove},
+};
 
-  if (g_strcmp0(method, "addNewServer") == 0) resp = servers_add(self, args);
-  else if (g_strcmp0(method, "getAllServers") == 0) resp = servers_get_all(self);
-  else if (g_strcmp0(method, "setNewServer") == 0) resp = servers_set(self, args);
-  else if (g_strcmp0(method, "setSelectedServerId") == 0) resp = servers_set_selected(self, args);
-  else if (g_strcmp0(method, "removeServer") == 0) resp = servers_remove(self, args);
-  else resp = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
+static const ChannelMethods kServersChannel = {
+  "servers_manager", LANE_SERVERS, kServersMethods, G_N_ELEMENTS(kServersMethods),
+};
 
-  fl_method_call_respond(call, resp, NULL);
+static void servers_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
+  static const ChannelTable table = channel_table(&kServersChannel);
+  dispatch_method_call(VPN_PLUGIN(user_data), &kServersChannel, table, call);
 }
 
 // -------- RoutingProfilesManager ("routing_profiles_manager") --------
@@ -490,12 +1367,14 @@ static FlMethodResponse* routing_add_profile(VpnPlugin* self) {
   // new id
   gint64 nid = 1;
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     if (p->id >= nid) nid = p->id + 1;
   }
+  gchar* name = g_strdup_printf("Profile %ld", (long)nid);
   g_ptr_array_add(self->storage->routing_profiles,
-                  profile_new(nid, g_strdup_printf("Profile %ld", (long)nid),
-                              ROUTING_MODE_VPN, NULL, NULL));
+                  profile_new(nid, name, ROUTING_MODE_VPN, NULL, NULL));
+  g_free(name);
+  refresh_policies(self->policies, self->storage, nid);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
@@ -505,9 +1384,10 @@ static FlMethodResponse* routing_set_mode(VpnPlugin* self, FlValue* args) {
   gint64 id = fl_value_get_int(fl_value_lookup_string(args, "id"));
   gint   mode = fl_value_get_int(fl_value_lookup_string(args, "mode"));
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     if (p->id == id) { p->default_mode = (RoutingMode)mode; break; }
   }
+  refresh_policies(self->policies, self->storage, id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
@@ -515,7 +1395,7 @@ static FlMethodResponse* routing_set_name(VpnPlugin* self, FlValue* args) {
   gint64 id = fl_value_get_int(fl_value_lookup_string(args, "id"));
   const gchar* name = fl_value_get_string(fl_value_lookup_string(args, "name"));
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     if (p->id == id) { g_free(p->name); p->name = g_strdup_or_empty(name); break; }
   }
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
@@ -528,7 +1408,7 @@ static FlMethodResponse* routing_set_rules(VpnPlugin* self, FlValue* args) {
 
   GPtrArray* arr = string_split_csv(rules, "\n");
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     if (p->id == id) {
       if (mode == ROUTING_MODE_BYPASS) { string_array_free(p->bypass_rules); p->bypass_rules = arr; }
       else { string_array_free(p->vpn_rules); p->vpn_rules = arr; }
@@ -537,72 +1417,135 @@ static FlMethodResponse* routing_set_rules(VpnPlugin* self, FlValue* args) {
     }
   }
   if (arr) string_array_free(arr);
+  refresh_policies(self->policies, self->storage, id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
 static FlMethodResponse* routing_remove_all_rules(VpnPlugin* self, FlValue* args) {
   gint64 id = fl_value_get_int(fl_value_lookup_string(args, "id"));
   for (guint i = 0; i < self->storage->routing_profiles->len; i++) {
-    RoutingProfile* p = g_ptr_array_index(self->storage->routing_profiles, i);
+    RoutingProfile* p = (RoutingProfile*)g_ptr_array_index(self->storage->routing_profiles, i);
     if (p->id == id) {
       string_array_free(p->bypass_rules); p->bypass_rules = g_ptr_array_new_with_free_func(g_free);
       string_array_free(p->vpn_rules);    p->vpn_rules    = g_ptr_array_new_with_free_func(g_free);
       break;
     }
   }
+  refresh_policies(self->policies, self->storage, id);
   return FL_METHOD_RESPONSE(fl_method_success_response_new(fl_value_new_null()));
 }
 
-static void routing_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
-  VpnPlugin* self = VPN_PLUGIN(user_data);
-  const gchar* method = fl_method_call_get_name(call);
-  FlValue* args = fl_method_call_get_args(call);
-  g_autoptr(FlMethodResponse) resp = NULL;
+static const MethodEntry kRoutingMethods[] = {
+  {"addNewProfile", [](VpnPlugin* self, FlValue*) { return routing_add_profile(self); }},
+  {"getAllProfiles", [](VpnPlugin* self, FlValue*) { return routing_get_all(self); }},
+  {"setDefaultRoutingMode", routing_set_mode},
+  {"setProfileName", routing_set_name},
+  {"setRules", routing_set_rules},
+  {"removeAllRules", routing_remove_all_rules},
+};
+
+static const ChannelMethods kRoutingChannel = {
+  "routing_profiles_manager", LANE_ROUTING, kRoutingMethods, G_N_ELEMENTS(kRoutingMethods),
+};
 
-  if (g_strcmp0(method, "addNewProfile") == 0) resp = routing_add_profile(self);
-  else if (g_strcmp0(method, "getAllProfiles") == 0) resp = routing_get_all(self);
-  else if (g_strcmp0(method, "setDefaultRoutingMode") == 0) resp = routing_set_mode(self, args);
-  else if (g_strcmp0(method, "setProfileName") == 0) resp = routing_set_name(self, args);
-  else if (g_strcmp0(method, "setRules") == 0) resp = routing_set_rules(self, args);
-  else if (g_strcmp0(method, "removeAllRules") == 0) resp = routing_remove_all_rules(self, args);
-  else resp = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
+static void routing_method_cb(FlMethodChannel* channel, FlMethodCall* call, gpointer user_data) {
+  static const ChannelTable table = channel_table(&kRoutingChannel);
+  dispatch_method_call(VPN_PLUGIN(user_data), &kRoutingChannel, table, call);
+}
 
-  fl_method_call_respond(call, resp, NULL);
+// -------- Direct calls --------
+FlMethodResponse* vpn_plugin_handle_method_call(VpnPlugin* self, const gchar* channel,
+                                                const gchar* method, FlValue* args) {
+  static const ChannelMethods* const kChannels[] = {
+    &kIvpnChannel, &kStorageChannel, &kServersChannel, &kRoutingChannel,
+  };
+  static const std::vector<ChannelTable> tables = []() {
+    std::vector<ChannelTable> built;
+    for (const ChannelMethods* c : kChannels) built.push_back(channel_table(c));
+    return built;
+  }();
+  for (size_t i = 0; i < G_N_ELEMENTS(kChannels); i++) {
+    if (g_strcmp0(kChannels[i]->name, channel) != 0) continue;
+    int index = tables[i].names.Find(method);
+    if (index < 0) break;
+    gint64 started_ns = vpn_plugin::Tracer::NowNs();
+    FlMethodResponse* response = run_handler(self, &kChannels[i]->entries[index], args);
+    tables[i].durations[index]->Record((vpn_plugin::Tracer::NowNs() - started_ns) / 1000);
+    return response;
+  }
+  return FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
 }
 
 // -------- EventChannel handler --------
-static FlStreamHandle* on_event_listen(FlEventChannel* channel,
-                                       FlValue* args,
-                                       gpointer user_data) {
+static FlMethodErrorResponse* on_event_listen(FlEventChannel* channel,
+                                              FlValue* args,
+                                              gpointer user_data) {
   VpnPlugin* self = VPN_PLUGIN(user_data);
-  self->event_sink = fl_event_channel_create_stream(channel, NULL);
-  emit_vpn_state(self, self->storage->vpn_state);
-  return (FlStreamHandle*)self->event_sink;
+  self->listening = TRUE;
+  // Until storage is in, on_ready_main() sends it.
+  if (self->announced) emit_vpn_state(self, (VpnState)g_atomic_int_get(&self->vpn_state));
+  return NULL;
 }
 
-static void on_event_cancel(FlEventChannel* channel, FlStreamHandle* handle, gpointer user_data) {
+static FlMethodErrorResponse* on_event_cancel(FlEventChannel* channel,
+                                              FlValue* args,
+                                              gpointer user_data) {
   VpnPlugin* self = VPN_PLUGIN(user_data);
-  self->event_sink = NULL;
+  self->listening = FALSE;
+  return NULL;
 }
 
 // -------- GObject lifecycle --------
 static void vpn_plugin_dispose(GObject* object) {
   VpnPlugin* self = VPN_PLUGIN(object);
-  if (self->connect_timeout_id) g_source_remove(self->connect_timeout_id);
+  // Every queued call holds a reference, so this only joins the threads.
+  delete self->dispatcher;
+  self->dispatcher = NULL;
+  delete self->policies;
+  self->policies = NULL;
+  // A pending connect timer holds a reference, so there is none here.
+  engine_stop(self);
   if (self->storage) { storage_free(self->storage); self->storage = NULL; }
+  delete self->packer;
+  self->packer = NULL;
   G_OBJECT_CLASS(vpn_plugin_parent_class)->dispose(object);
 }
 
+static void vpn_plugin_finalize(GObject* object) {
+  g_cond_clear(&VPN_PLUGIN(object)->ready_cond);
+  g_mutex_clear(&VPN_PLUGIN(object)->engine_lock);
+  g_mutex_clear(&VPN_PLUGIN(object)->lock);
+  G_OBJECT_CLASS(vpn_plugin_parent_class)->finalize(object);
+}
+
 static void vpn_plugin_class_init(VpnPluginClass* klass) {
   G_OBJECT_CLASS(klass)->dispose = vpn_plugin_dispose;
+  G_OBJECT_CLASS(klass)->finalize = vpn_plugin_finalize;
 }
 
 static void vpn_plugin_init(VpnPlugin* self) {
-  self->storage = storage_new();
+  self->storage = NULL;
   self->event_channel = NULL;
-  self->event_sink = NULL;
+  self->listening = FALSE;
   self->ch_ivpn = self->ch_storage = self->ch_servers = self->ch_routing = NULL;
   self->connect_timeout_id = 0;
+  self->announced = FALSE;
+  self->connect_generation = 0;
+  self->vpn_state = VPN_STATE_DISCONNECTED;
+  self->engine = NULL;
+  g_mutex_init(&self->engine_lock);
+  self->packer = new vpn_plugin::RecordWriter();
+  self->policies = new vpn_plugin::PolicyStore(
+      [self](int64_t server, uint64_t version,
+             std::shared_ptr<const vpn_plugin::RoutingPolicy> policy) {
+        on_policy_built(self, server, version, std::move(policy));
+      });
+  self->dispatcher = new vpn_plugin::MethodDispatcher();
+  g_mutex_init(&self->lock);
+  self->ready = FALSE;
+  g_cond_init(&self->ready_cond);
+  // The loader's reference keeps the plugin alive until storage is in.
+  g_thread_unref(g_thread_new("vpn-storage", load_storage, g_object_ref(self)));
 }
 
 void vpn_plugin_register_with_registrar(FlPluginRegistrar* registrar) {
@@ -615,17 +1558,22 @@ void vpn_plugin_register_with_registrar(FlPluginRegistrar* registrar) {
   fl_event_channel_set_stream_handlers(plugin->event_channel, on_event_listen, on_event_cancel, g_object_ref(plugin), g_object_unref);
 
   // MethodChannels
-  plugin->ch_ivpn = fl_method_channel_new(messenger, "ivpn_manager", FL_METHOD_CODEC(codec));
+  plugin->ch_ivpn = fl_method_channel_new(messenger, kIvpnChannel.name, FL_METHOD_CODEC(codec));
   fl_method_channel_set_method_call_handler(plugin->ch_ivpn, ivpn_method_cb, g_object_ref(plugin), g_object_unref);
 
-  plugin->ch_storage = fl_method_channel_new(messenger, "storage_manager", FL_METHOD_CODEC(codec));
+  plugin->ch_storage = fl_method_channel_new(messenger, kStorageChannel.name, FL_METHOD_CODEC(codec));
   fl_method_channel_set_method_call_handler(plugin->ch_storage, storage_method_cb, g_object_ref(plugin), g_object_unref);
 
-  plugin->ch_servers = fl_method_channel_new(messenger, "servers_manager", FL_METHOD_CODEC(codec));
+  plugin->ch_servers = fl_method_channel_new(messenger, kServersChannel.name, FL_METHOD_CODEC(codec));
   fl_method_channel_set_method_call_handler(plugin->ch_servers, servers_method_cb, g_object_ref(plugin), g_object_unref);
 
-  plugin->ch_routing = fl_method_channel_new(messenger, "routing_profiles_manager", FL_METHOD_CODEC(codec));
+  plugin->ch_routing = fl_method_channel_new(messenger, kRoutingChannel.name, FL_METHOD_CODEC(codec));
   fl_method_channel_set_method_call_handler(plugin->ch_routing, routing_method_cb, g_object_ref(plugin), g_object_unref);
 
+  // Headless embedders have no view, and so no frames.
+  FlView* view = fl_plugin_registrar_get_view(registrar);
+  if (view) g_signal_connect(view, "first-frame", G_CALLBACK(on_first_frame), NULL);
+  record_startup("plugin registered", "vpn_startup_registered_ms", process_uptime_ms());
+
   g_object_unref(plugin);
 }
\ No newline at end of file
@@ -6,5 +6,14 @@
 // https://github.com/flutter/flutter/issues/88724 for current limitations
 // in the unit-testable API.
 
-// Handles the getPlatformVersion method call.
-FlMethodResponse *get_platform_version();
+// Returns TRUE for a dotted-quad IPv4 address.
+gboolean is_valid_ipv4(const gchar* ip);
+
+// Splits |csv| at |delim| into trimmed, non-empty strings.
+GPtrArray* string_split_csv(const gchar* csv, const gchar* delim);
+void string_array_free(GPtrArray* arr);
+
+// Runs the handler of |method| on |channel| on the calling thread and
+// returns its response, or a not-implemented response.
+FlMethodResponse* vpn_plugin_handle_method_call(VpnPlugin* self, const gchar* channel,
+                                                const gchar* method, FlValue* args);
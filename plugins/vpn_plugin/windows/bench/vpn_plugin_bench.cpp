@@ -0,0 +1,111 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "vpn_plugin.h"
+
+// The plugin's storage managers, called directly on the benchmark thread:
+// address validation and list splitting on their own, server
+// add/replace/remove and rule replacement with growing storage, and
+// building the server list reply as EncodableValues.
+
+namespace vpn_plugin {
+namespace bench {
+
+namespace {
+
+std::string Ip(int64_t i) {
+  return "10." + std::to_string(i >> 16 & 255) + "." + std::to_string(i >> 8 & 255) + "." +
+         std::to_string(i & 255);
+}
+
+// Fills the storage up to |count| servers.
+void AddServers(ServersManagerImpl* servers, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    servers->AddNewServer("", Ip(i), "vpn.example.com", "user", "secret", VpnProtocol::kHttp2, 1,
+                          "8.8.8.8, 8.8.4.4");
+  }
+}
+
+}  // namespace
+
+static void BM_IsValidIp(benchmark::State& state) {
+  const std::vector<std::string> inputs = {"192.168.1.100", "10.0.0.1", "256.0.0.1", "1.2.3",
+                                           "vpn.example.com"};
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ServersManagerImpl::IsValidIp(inputs[i++ % inputs.size()]));
+  }
+}
+BENCHMARK(BM_IsValidIp);
+
+static void BM_SplitAndTrim(benchmark::State& state) {
+  std::string csv;
+  for (int64_t i = 0; i < state.range(0); i++) csv += " " + Ip(i) + " ,";
+  for (auto _ : state) {
+    auto parts = ServersManagerImpl::SplitAndTrim(csv, ',');
+    benchmark::DoNotOptimize(parts.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SplitAndTrim)->Arg(2)->Arg(1000);
+
+// One add, replace and remove of a server while |range| others are stored.
+static void BM_ServerAddSetRemove(benchmark::State& state) {
+  MockStorage storage;
+  ServersManagerImpl servers(&storage);
+  AddServers(&servers, state.range(0));
+  // Ids are one past the highest, and the two mock servers come first.
+  int64_t id = state.range(0) + 3;
+  for (auto _ : state) {
+    servers.AddNewServer("", "10.255.0.1", "vpn.example.com", "user", "secret",
+                         VpnProtocol::kHttp2, 1, "8.8.8.8, 8.8.4.4");
+    servers.SetNewServer(id, "", "10.255.0.2", "vpn.example.com", "user", "secret",
+                         VpnProtocol::kHttp2, 1, "8.8.8.8, 8.8.4.4");
+    servers.RemoveServer(id);
+  }
+}
+BENCHMARK(BM_ServerAddSetRemove)->Arg(10)->Arg(1000);
+
+// Replaces a profile's rules with a list of |range| lines.
+static void BM_SetRules(benchmark::State& state) {
+  MockStorage storage;
+  RoutingProfilesManagerImpl profiles(&storage);
+  std::string rules;
+  for (int64_t i = 0; i < state.range(0); i++) rules += "host" + std::to_string(i) + ".example.com\n";
+  for (auto _ : state) profiles.SetRules(1, RoutingMode::kBypass, rules);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SetRules)->Arg(10)->Arg(10000);
+
+// Builds the server list reply with |range| servers stored, one map per
+// server as the method channel sends it.
+static void BM_ServerListReply(benchmark::State& state) {
+  MockStorage storage;
+  ServersManagerImpl servers(&storage);
+  AddServers(&servers, state.range(0));
+  for (auto _ : state) {
+    flutter::EncodableList list;
+    for (const Server& s : servers.GetAllServers()) {
+      flutter::EncodableList dns;
+      for (const auto& d : s.dns_servers) dns.emplace_back(d);
+      list.emplace_back(flutter::EncodableMap{
+          {flutter::EncodableValue("id"), flutter::EncodableValue(s.id)},
+          {flutter::EncodableValue("ipAddress"), flutter::EncodableValue(s.ip_address)},
+          {flutter::EncodableValue("domain"), flutter::EncodableValue(s.domain)},
+          {flutter::EncodableValue("login"), flutter::EncodableValue(s.login)},
+          {flutter::EncodableValue("password"), flutter::EncodableValue(s.password)},
+          {flutter::EncodableValue("dnsServers"), flutter::EncodableValue(std::move(dns))},
+          {flutter::EncodableValue("vpnProtocol"),
+           flutter::EncodableValue(static_cast<int64_t>(s.vpn_protocol))},
+          {flutter::EncodableValue("routingProfileId"), flutter::EncodableValue(s.routing_profile_id)},
+      });
+    }
+    benchmark::DoNotOptimize(list.data());
+  }
+}
+BENCHMARK(BM_ServerListReply)->Arg(100)->Arg(5000);
+
+}  // namespace bench
+}  // namespace vpn_plugin
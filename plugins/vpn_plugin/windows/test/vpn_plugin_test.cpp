@@ -1,42 +1,48 @@
-#include <flutter/method_call.h>
-#include <flutter/method_result_functions.h>
-#include <flutter/standard_method_codec.h>
 #include <gtest/gtest.h>
 #include <windows.h>
 
 #include <memory>
 #include <string>
-#include <variant>
+#include <vector>
 
 #include "vpn_plugin.h"
 
 namespace vpn_plugin {
 namespace test {
 
-namespace {
-
-using flutter::EncodableMap;
-using flutter::EncodableValue;
-using flutter::MethodCall;
-using flutter::MethodResultFunctions;
-
-}  // namespace
-
-TEST(VpnPlugin, GetPlatformVersion) {
-  VpnPlugin plugin;
-  // Save the reply value from the success callback.
-  std::string result_string;
-  plugin.HandleMethodCall(
-      MethodCall("getPlatformVersion", std::make_unique<EncodableValue>()),
-      std::make_unique<MethodResultFunctions<>>(
-          [&result_string](const EncodableValue* result) {
-            result_string = std::get<std::string>(*result);
-          },
-          nullptr, nullptr));
-
-  // Since the exact string varies by host, just ensure that it's a string
-  // with the expected format.
-  EXPECT_TRUE(result_string.rfind("Windows ", 0) == 0);
+TEST(VpnPlugin, ValidatesIpAddresses) {
+  EXPECT_TRUE(ServersManagerImpl::IsValidIp("192.168.1.100"));
+  EXPECT_TRUE(ServersManagerImpl::IsValidIp("0.0.0.0"));
+  EXPECT_FALSE(ServersManagerImpl::IsValidIp("256.1.1.1"));
+  EXPECT_FALSE(ServersManagerImpl::IsValidIp("1.2.3"));
+  EXPECT_FALSE(ServersManagerImpl::IsValidIp("1.2.x.4"));
+  EXPECT_FALSE(ServersManagerImpl::IsValidIp(""));
+}
+
+TEST(VpnPlugin, SplitsAndTrimsLists) {
+  EXPECT_EQ(ServersManagerImpl::SplitAndTrim(" 8.8.8.8 ,, 1.1.1.1,", ','),
+            std::vector<std::string>({"8.8.8.8", "1.1.1.1"}));
+  EXPECT_TRUE(ServersManagerImpl::SplitAndTrim("", ',').empty());
+}
+
+TEST(VpnPlugin, AddsReplacesAndRemovesServersAndRules) {
+  MockStorage storage;
+  ServersManagerImpl servers(&storage);
+  EXPECT_EQ(servers.AddNewServer("", "10.0.0", "vpn.example.com", "user", "secret",
+                                 VpnProtocol::kHttp2, 1, "8.8.8.8"),
+            AddNewServerResult::kIpAddressIncorrect);
+  EXPECT_EQ(servers.AddNewServer("", "10.0.0.1", "vpn.example.com", "user", "secret",
+                                 VpnProtocol::kHttp2, 1, "8.8.8.8, 8.8.4.4"),
+            AddNewServerResult::kOk);
+  ASSERT_EQ(servers.GetAllServers().size(), 3u);
+  EXPECT_EQ(servers.GetAllServers()[2].dns_servers.size(), 2u);
+  servers.RemoveServer(3);
+  EXPECT_EQ(servers.GetAllServers().size(), 2u);
+
+  RoutingProfilesManagerImpl profiles(&storage);
+  profiles.SetRules(1, RoutingMode::kBypass, "a.example\nb.example");
+  profiles.SetRules(1, RoutingMode::kBypass, "c.example");
+  EXPECT_EQ(profiles.GetAllProfiles()[0].bypass_rules, std::vector<std::string>({"c.example"}));
 }
 
 }  // namespace test